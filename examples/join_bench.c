@@ -0,0 +1,166 @@
+/*
+ * join_bench.c - Hash join throughput against its memory budget
+ *
+ * Joins two sides of BENCH_ROWS records each (an INTEGER key, stored as
+ * a row stores it, and some TEXT) on keys that match one to one, as
+ * two tables joined on columns without an index would be. Each budget,
+ * from the smallest allowed to one that holds the build side, is timed
+ * over adding the build side, probing with the other and reading back
+ * the partitions. Partitions go to a temporary file next to
+ * BENCH_DB_PATH; point it at a hard disk partition rather than RAM: to
+ * see what the disk costs.
+ *
+ * A nested loop over the same rows compares BENCH_ROWS squared pairs;
+ * the last line times the comparisons alone on a sample of probe rows
+ * (keys worked out, no rows read or decoded) and scales it up, which is
+ * far less than such a join would take.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sql/hashjoin.h"
+#include "storage/row.h"
+#include "os/task.h"
+#include "api/error.h"
+
+#define BENCH_DB_PATH   "RAM:join_bench.db"
+#define BENCH_ROWS      100000L
+#define BENCH_SAMPLE    1000L       /* Probe rows the nested loop is timed on */
+#define BENCH_ROW_SIZE  64          /* Room for each stored record */
+
+/* Store a record of the bench: key, then text; *key_size bytes of key */
+static uint32_t bench_record(uint8_t *buf, long i, long key, const char *side,
+                             uint32_t *key_size)
+{
+    static struct amidb_row row;    /* Off the 4KB stack */
+    char text[32];
+    int size;
+
+    sprintf(text, "%s row %ld", side, i);
+    row_init(&row);
+    row_set_int(&row, 0, (int32_t)key);
+    row_set_text(&row, 1, text, 0);
+    size = row_serialize(&row, buf, BENCH_ROW_SIZE);
+    row_clear(&row);
+
+    /* The key is the first column: its type and four bytes, after the count */
+    *key_size = 5;
+    return (size > 0) ? (uint32_t)size : 0;
+}
+
+/* Join the two sides in memory bytes; prints one line */
+static int bench_run(uint32_t memory)
+{
+    static struct sql_hasher hasher;    /* Off the 4KB stack */
+    static uint8_t record[BENCH_ROW_SIZE];
+    const uint8_t *build;
+    const uint8_t *probe;
+    uint32_t build_size;
+    uint32_t probe_size;
+    uint32_t key_size;
+    uint32_t size;
+    uint32_t start;
+    uint32_t ms;
+    long matched = 0;
+    long i;
+    int rc;
+
+    size = bench_record(record, 0, 0, "build", &key_size);
+    rc = hasher_init(&hasher, BENCH_DB_PATH, memory, BENCH_ROWS,
+                     (uint32_t)BENCH_ROWS * (size + HASHER_RECORD_HEADER));
+    if (rc != AMIDB_OK) {
+        hasher_close(&hasher);
+        return rc;
+    }
+
+    start = task_time_ms();
+
+    for (i = 0; i < BENCH_ROWS && rc == AMIDB_OK; i++) {
+        size = bench_record(record, i, (i * 7919L) % BENCH_ROWS, "build", &key_size);
+        rc = hasher_build(&hasher, record, size, 2, key_size);
+    }
+    for (i = 0; i < BENCH_ROWS && rc == AMIDB_OK; i++) {
+        size = bench_record(record, i, i, "probe", &key_size);
+        rc = hasher_probe(&hasher, record, size, 2, key_size);
+        while (rc == AMIDB_OK && hasher_match(&hasher, &build, &build_size) == AMIDB_ROW) {
+            matched++;
+        }
+    }
+    if (rc == AMIDB_OK) {
+        rc = hasher_finish(&hasher);
+    }
+    while (rc == AMIDB_OK &&
+           (rc = hasher_next(&hasher, &build, &build_size, &probe, &probe_size)) == AMIDB_ROW) {
+        matched++;
+        rc = AMIDB_OK;
+    }
+    if (rc == AMIDB_DONE && matched != BENCH_ROWS) {
+        rc = AMIDB_CORRUPT;
+    }
+
+    ms = task_time_ms() - start;
+
+    if (rc == AMIDB_DONE) {
+        printf("  %7lu KB  %3lu partitions  %4lu loads  %7lu ms  %8lu rows/s\n",
+               (unsigned long)(hasher.memory_size / 1024),
+               (unsigned long)hasher.partitions_written,
+               (unsigned long)hasher.loads,
+               (unsigned long)ms,
+               (unsigned long)(ms ? 2 * BENCH_ROWS * 1000L / ms : 0));
+        rc = AMIDB_OK;
+    }
+
+    hasher_close(&hasher);
+    return rc;
+}
+
+/* Time the comparisons of a nested loop over BENCH_SAMPLE probe rows */
+static int bench_nested_loop(void)
+{
+    uint32_t start;
+    uint32_t ms;
+    long matched = 0;
+    long i;
+    long j;
+
+    start = task_time_ms();
+    for (i = 0; i < BENCH_SAMPLE; i++) {
+        for (j = 0; j < BENCH_ROWS; j++) {
+            if ((j * 7919L) % BENCH_ROWS == i) {
+                matched++;
+            }
+        }
+    }
+    ms = task_time_ms() - start;
+
+    printf("  nested loop, keys only                        %7lu ms\n",
+           (unsigned long)ms * (unsigned long)(BENCH_ROWS / BENCH_SAMPLE));
+    return (matched == BENCH_SAMPLE) ? AMIDB_OK : AMIDB_CORRUPT;
+}
+
+int main(void)
+{
+    static const uint32_t budgets[] = {
+        HASHER_MIN_MEMORY, 65536, 131072, 1048576, 8388608
+    };
+    uint32_t i;
+    int rc;
+
+    printf("AmiDB hash join benchmark (%ld x %ld rows)\n", BENCH_ROWS, BENCH_ROWS);
+    printf("-----------------------------------------------\n");
+
+    for (i = 0; i < sizeof(budgets) / sizeof(budgets[0]); i++) {
+        rc = bench_run(budgets[i]);
+        if (rc != AMIDB_OK) {
+            printf("  %lu bytes: failed (%d)\n", (unsigned long)budgets[i], rc);
+            return 1;
+        }
+    }
+
+    if (bench_nested_loop() != AMIDB_OK) {
+        printf("  nested loop: failed\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,42 @@
+/*
+ * task.h - Background worker interface for AmiDB
+ *
+ * A worker is a second task that runs one job at a time on behalf of
+ * its owner, so the owner can keep working while slow I/O completes.
+ * Only the task that created a worker may submit to, wait for or
+ * destroy it.
+ */
+
+#ifndef AMIDB_TASK_H
+#define AMIDB_TASK_H
+
+#include <stdint.h>
+
+/* Opaque worker handle */
+typedef void* amidb_worker_t;
+
+/* Job run on the worker; the return value is handed back by worker_wait */
+typedef int (*amidb_job_fn)(void *arg);
+
+/* Start a worker task (NULL on failure) */
+amidb_worker_t worker_create(const char *name);
+
+/* Stop the worker after its current job and free it */
+void worker_destroy(amidb_worker_t worker);
+
+/* Hand a job to the worker; the previous job must have been waited for */
+int worker_submit(amidb_worker_t worker, amidb_job_fn fn, void *arg);
+
+/* Wait for the submitted job and return its result */
+int worker_wait(amidb_worker_t worker);
+
+/*
+ * Milliseconds since an arbitrary start (for measuring intervals)
+ *
+ * Wall-clock time, not CPU time: intervals must include time spent
+ * waiting for a worker or the disk. Wraps after about 49 days, so only
+ * differences are meaningful.
+ */
+uint32_t task_time_ms(void);
+
+#endif /* AMIDB_TASK_H */
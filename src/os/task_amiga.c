@@ -0,0 +1,239 @@
+/*
+ * task_amiga.c - AmigaOS background worker implementation
+ *
+ * Each worker is a dos.library process. Jobs travel as exec messages:
+ * the owner puts the job on the worker's port and collects the reply on
+ * its own port, so neither side needs semaphores or extra signals.
+ */
+
+#include "os/task.h"
+#include "os/mem.h"
+
+/* AmigaOS includes */
+#include <exec/types.h>
+#include <exec/ports.h>
+#include <exec/tasks.h>
+#include <dos/dos.h>
+#include <dos/dosextens.h>
+#include <dos/dostags.h>
+#include <devices/timer.h>
+#include <stdlib.h>
+
+/* Manual declarations of exec.library functions */
+struct MsgPort *CreateMsgPort(void);
+void DeleteMsgPort(struct MsgPort *port);
+void PutMsg(struct MsgPort *port, struct Message *message);
+struct Message *GetMsg(struct MsgPort *port);
+void ReplyMsg(struct Message *message);
+struct Message *WaitPort(struct MsgPort *port);
+struct Task *FindTask(CONST_STRPTR name);
+void Forbid(void);
+BYTE OpenDevice(CONST_STRPTR name, ULONG unit, struct IORequest *io, ULONG flags);
+void CloseDevice(struct IORequest *io);
+
+/* Manual declarations of dos.library functions */
+struct Process *CreateNewProcTags(ULONG tag1, ...);
+struct DateStamp *DateStamp(struct DateStamp *date);
+
+/* Manual declarations of timer.device functions */
+void GetSysTime(struct timeval *dest);
+
+/* timer.device base for GetSysTime, opened on first use */
+struct Device *TimerBase = NULL;
+static struct timerequest g_timer_req;
+static int g_timer_state = 0;        /* 0 not tried, 1 open, -1 unavailable */
+
+/* Job message; the startup message carries the worker itself */
+struct worker_msg {
+    struct Message msg;
+    amidb_job_fn fn;                 /* NULL asks the worker to exit */
+    void *arg;
+    int result;
+};
+
+struct amiga_worker {
+    struct MsgPort *job_port;        /* Owned by the worker process */
+    struct MsgPort *reply_port;      /* Owned by the creating task */
+    struct worker_msg job;
+    int busy;                        /* Job submitted, not yet waited for */
+};
+
+/* Worker process entry point */
+static void worker_entry(void)
+{
+    struct Process *self;
+    struct worker_msg *startup;
+    struct amiga_worker *w;
+    struct worker_msg *msg;
+
+    self = (struct Process *)FindTask(NULL);
+
+    /* The creator sends the worker in a startup message */
+    WaitPort(&self->pr_MsgPort);
+    startup = (struct worker_msg *)GetMsg(&self->pr_MsgPort);
+    w = (struct amiga_worker *)startup->arg;
+
+    /* Own port for jobs: pr_MsgPort is busy with DOS packets */
+    w->job_port = CreateMsgPort();
+    startup->result = w->job_port ? 0 : -1;
+    ReplyMsg(&startup->msg);
+    if (!w->job_port) {
+        return;
+    }
+
+    for (;;) {
+        WaitPort(w->job_port);
+        msg = (struct worker_msg *)GetMsg(w->job_port);
+        if (!msg) {
+            continue;
+        }
+
+        if (!msg->fn) {
+            /* Stay in Forbid until the process is gone: the owner may */
+            /* unload the program as soon as the reply arrives */
+            Forbid();
+            DeleteMsgPort(w->job_port);
+            ReplyMsg(&msg->msg);
+            return;
+        }
+
+        msg->result = msg->fn(msg->arg);
+        ReplyMsg(&msg->msg);
+    }
+}
+
+/* Start a worker task */
+amidb_worker_t worker_create(const char *name) {
+    struct amiga_worker *w;
+    struct Process *proc;
+
+    w = (struct amiga_worker *)mem_alloc(sizeof(struct amiga_worker), AMIDB_MEM_CLEAR);
+    if (!w) {
+        return NULL;
+    }
+
+    w->reply_port = CreateMsgPort();
+    if (!w->reply_port) {
+        mem_free(w, sizeof(struct amiga_worker));
+        return NULL;
+    }
+
+    proc = CreateNewProcTags(NP_Entry, (ULONG)worker_entry,
+                             NP_Name, (ULONG)name,
+                             NP_StackSize, 8192,
+                             TAG_DONE);
+    if (!proc) {
+        DeleteMsgPort(w->reply_port);
+        mem_free(w, sizeof(struct amiga_worker));
+        return NULL;
+    }
+
+    /* Hand the worker over and wait until its job port exists */
+    w->job.msg.mn_ReplyPort = w->reply_port;
+    w->job.msg.mn_Length = sizeof(struct worker_msg);
+    w->job.arg = w;
+    PutMsg(&proc->pr_MsgPort, &w->job.msg);
+    WaitPort(w->reply_port);
+    GetMsg(w->reply_port);
+
+    if (w->job.result != 0) {
+        DeleteMsgPort(w->reply_port);
+        mem_free(w, sizeof(struct amiga_worker));
+        return NULL;
+    }
+
+    return (amidb_worker_t)w;
+}
+
+/* Stop the worker and free it */
+void worker_destroy(amidb_worker_t worker) {
+    struct amiga_worker *w = (struct amiga_worker *)worker;
+
+    if (!w) {
+        return;
+    }
+
+    worker_wait(worker);
+
+    /* Exit request */
+    w->job.fn = NULL;
+    PutMsg(w->job_port, &w->job.msg);
+    WaitPort(w->reply_port);
+    GetMsg(w->reply_port);
+
+    DeleteMsgPort(w->reply_port);
+    mem_free(w, sizeof(struct amiga_worker));
+}
+
+/* Hand a job to the worker */
+int worker_submit(amidb_worker_t worker, amidb_job_fn fn, void *arg) {
+    struct amiga_worker *w = (struct amiga_worker *)worker;
+
+    if (!w || !fn || w->busy) {
+        return -1;
+    }
+
+    w->job.fn = fn;
+    w->job.arg = arg;
+    w->job.result = 0;
+    w->busy = 1;
+    PutMsg(w->job_port, &w->job.msg);
+
+    return 0;
+}
+
+/* Wait for the submitted job */
+int worker_wait(amidb_worker_t worker) {
+    struct amiga_worker *w = (struct amiga_worker *)worker;
+
+    if (!w) {
+        return -1;
+    }
+    if (!w->busy) {
+        return 0;
+    }
+
+    WaitPort(w->reply_port);
+    GetMsg(w->reply_port);
+    w->busy = 0;
+
+    return w->job.result;
+}
+
+/* Close timer.device at exit */
+static void task_close_timer(void)
+{
+    CloseDevice((struct IORequest *)&g_timer_req);
+    TimerBase = NULL;
+}
+
+/*
+ * Milliseconds since an arbitrary start
+ *
+ * Elapsed time from the system clock, so waits for the writer task or
+ * the disk are counted. Falls back to the 50Hz DOS clock if
+ * timer.device cannot be opened.
+ */
+uint32_t task_time_ms(void) {
+    struct timeval tv;
+    struct DateStamp ds;
+
+    if (g_timer_state == 0) {
+        g_timer_state = -1;
+        if (OpenDevice((CONST_STRPTR)TIMERNAME, UNIT_VBLANK,
+                       (struct IORequest *)&g_timer_req, 0) == 0) {
+            TimerBase = g_timer_req.tr_node.io_Device;
+            g_timer_state = 1;
+            atexit(task_close_timer);
+        }
+    }
+
+    if (g_timer_state > 0) {
+        GetSysTime(&tv);
+        return (uint32_t)tv.tv_secs * 1000 + (uint32_t)tv.tv_micro / 1000;
+    }
+
+    DateStamp(&ds);
+    return ((uint32_t)ds.ds_Days * 1440 + (uint32_t)ds.ds_Minute) * 60000 +
+           (uint32_t)ds.ds_Tick * 20;
+}
@@ -9,6 +9,8 @@
 #include "sql/catalog.h"
 #include "storage/pager.h"
 #include "storage/cache.h"
+#include "txn/wal.h"
+#include "txn/txn.h"
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
@@ -26,6 +28,8 @@ static void trim_string(char *str);
 int main(int argc, char **argv) {
     struct amidb_pager *pager = NULL;
     struct page_cache *cache = NULL;
+    struct wal_context *wal = NULL;
+    struct txn_context *txn = NULL;
     struct catalog catalog;
     struct sql_executor executor;
     struct sql_repl repl;
@@ -104,6 +108,19 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    /* Transactions are optional: without them each statement commits */
+    wal = wal_create(pager);
+    if (wal != NULL) {
+        txn = txn_create(wal, cache);
+    }
+    if (txn == NULL) {
+        printf("Warning: Transactions unavailable\n");
+    } else if (wal_start_writer(wal) != 0) {
+        /* Commits still work, the WAL is just written inline */
+        printf("Warning: Background WAL writer unavailable\n");
+    }
+    executor.txn = txn;
+
     /* Execute script file if provided */
     if (script_file != NULL) {
         printf("Executing script: %s\n\n", script_file);
@@ -121,8 +138,20 @@ int main(int argc, char **argv) {
 
     /* Run REPL main loop */
     repl_run(&repl);
+    repl_close(&repl);
 
-    /* Cleanup */
+    /* Cleanup (an open transaction is rolled back, and the WAL */
+    /* checkpointed so the next open needs no recovery) */
+    if (txn != NULL) {
+        if (txn->state == TXN_STATE_ACTIVE) {
+            txn_abort(txn);
+        }
+        wal_checkpoint(wal);
+        txn_destroy(txn);
+    }
+    if (wal != NULL) {
+        wal_destroy(wal);
+    }
     executor_close(&executor);
     catalog_close(&catalog);
     cache_destroy(cache);
@@ -4,8 +4,10 @@
 
 #include "sql/catalog.h"
 #include "storage/btree.h"
+#include "storage/lsm.h"
 #include "util/crc32.h"
 #include "os/mem.h"
+#include "api/error.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,6 +27,11 @@ static FILE *g_catalog_debug_log = NULL;
 /* Forward declarations */
 static int serialize_schema(const struct table_schema *schema, uint8_t *buffer, uint32_t *size);
 static int deserialize_schema(const uint8_t *buffer, struct table_schema *schema);
+static int read_schema_page(struct catalog *cat, uint32_t page_num, uint8_t *buffer);
+static int write_schema_page(struct catalog *cat, uint32_t page_num, const uint8_t *buffer);
+static struct txn_context *active_txn(struct catalog *cat);
+static void catalog_sync_root(struct catalog *cat);
+static void catalog_save_root(struct catalog *cat);
 
 /*
  * Hash table name to int32_t key
@@ -44,6 +51,8 @@ int catalog_init(struct catalog *cat, struct amidb_pager *pager, struct page_cac
     cat->pager = pager;
     cat->cache = cache;
     cat->catalog_tree = NULL;
+    cat->txn = NULL;
+    cat->generation = 1;
 
     /* Get catalog root from file header */
     catalog_root = pager_get_catalog_root(pager);
@@ -97,6 +106,8 @@ int catalog_create_table(struct catalog *cat, const struct sql_create_table *cre
 
     CATALOG_LOG("[CATALOG] Creating table '%s'\n", create_stmt->table_name); 
 
+    catalog_sync_root(cat);
+
     /* Check if table already exists */
     hash_key = catalog_hash_name(create_stmt->table_name);
     rc = btree_search(cat->catalog_tree, hash_key, &existing_page);
@@ -128,9 +139,13 @@ int catalog_create_table(struct catalog *cat, const struct sql_create_table *cre
         }
     }
 
-    /* Create B+Tree for table data */
+    /* Create B+Tree (or LSM root) for table data */
     CATALOG_LOG("[CATALOG] Creating table B+Tree...\n"); 
-    table_tree = btree_create(cat->pager, cat->cache, &schema->btree_root);
+    if (create_stmt->engine == SQL_ENGINE_LSM) {
+        table_tree = lsm_create(cat->pager, cat->cache, &schema->btree_root);
+    } else {
+        table_tree = btree_create(cat->pager, cat->cache, &schema->btree_root);
+    }
     if (!table_tree) {
         CATALOG_LOG("[CATALOG] ERROR: btree_create failed\n"); 
         return -1;
@@ -180,6 +195,8 @@ int catalog_create_table(struct catalog *cat, const struct sql_create_table *cre
         CATALOG_LOG("[CATALOG] ERROR: btree_insert failed, rc=%d\n", rc);
         return -1;
     }
+    catalog_save_root(cat);
+    cat->generation++;
 
     CATALOG_LOG("[CATALOG] SUCCESS: Table '%s' created (hash=%d -> page=%u)\n",
                 create_stmt->table_name, hash_key, schema_page); 
@@ -195,6 +212,8 @@ int catalog_get_table(struct catalog *cat, const char *table_name, struct table_
     uint8_t *schema_buffer = g_catalog_page_buffer;  /* Use global buffer */
     int rc;
 
+    catalog_sync_root(cat);
+
     hash_key = catalog_hash_name(table_name);
     CATALOG_LOG("[GET_TABLE] Looking up table='%s', hash_key=%d\n", table_name, hash_key);
 
@@ -208,7 +227,7 @@ int catalog_get_table(struct catalog *cat, const char *table_name, struct table_
     CATALOG_LOG("[GET_TABLE] Found schema_page=%u\n", schema_page);
 
     /* Read schema page */
-    rc = pager_read_page(cat->pager, schema_page, schema_buffer);
+    rc = read_schema_page(cat, schema_page, schema_buffer);
     if (rc != 0) {
         CATALOG_LOG("[GET_TABLE] Failed to read page %u\n", schema_page);
         return -1;
@@ -240,6 +259,8 @@ int catalog_drop_table(struct catalog *cat, const char *table_name) {
     uint32_t schema_page;
     int rc;
 
+    catalog_sync_root(cat);
+
     hash_key = catalog_hash_name(table_name);
 
     /* Check if table exists */
@@ -253,6 +274,9 @@ int catalog_drop_table(struct catalog *cat, const char *table_name) {
     if (rc != 0) {
         return -1;
     }
+    catalog_save_root(cat);
+
+    cat->generation++;
 
     /* TODO: Free table's B+Tree pages and schema page */
     /* For now, just remove from catalog (pages become orphaned) */
@@ -268,8 +292,12 @@ int catalog_update_table(struct catalog *cat, const struct table_schema *schema)
     uint32_t schema_page;
     uint8_t *schema_buffer = g_catalog_page_buffer;  /* Use global buffer */
     uint32_t schema_size;
+    uint32_t copy;
+    struct txn_context *txn;
     int rc;
 
+    catalog_sync_root(cat);
+
     hash_key = catalog_hash_name(schema->name);
 
     /* Get schema page number */
@@ -278,20 +306,43 @@ int catalog_update_table(struct catalog *cat, const struct table_schema *schema)
         return -1;  /* Table not found */
     }
 
+    /* Shadow paging: write a copy and point the catalog at it */
+    txn = active_txn(cat);
+    if (txn && txn->shadow) {
+        if (txn_shadow_page(txn, schema_page, &copy) != 0) {
+            return -1;
+        }
+        if (copy != schema_page) {
+            schema_page = copy;
+            if (btree_insert(cat->catalog_tree, hash_key, schema_page) != 0) {
+                return -1;
+            }
+            catalog_save_root(cat);
+        }
+    }
+
     /* Serialize schema */
     if (serialize_schema(schema, schema_buffer, &schema_size) != 0) {
         return -1;
     }
 
     /* Write updated schema to page */
-    rc = pager_write_page(cat->pager, schema_page, schema_buffer);
+    rc = write_schema_page(cat, schema_page, schema_buffer);
     if (rc != 0) {
         return -1;
     }
+    cat->generation++;
 
     return 0;
 }
 
+/*
+ * Invalidate schemas read so far
+ */
+void catalog_invalidate(struct catalog *cat) {
+    cat->generation++;
+}
+
 /*
  * List all tables
  */
@@ -304,6 +355,8 @@ int catalog_list_tables(struct catalog *cat, char table_names[][64], int max_tab
     int count = 0;
     int rc;
 
+    catalog_sync_root(cat);
+
     /* Initialize cursor at beginning of catalog B+Tree */
     rc = btree_cursor_first(cat->catalog_tree, &cursor);
     if (rc != 0) {
@@ -318,7 +371,7 @@ int catalog_list_tables(struct catalog *cat, char table_names[][64], int max_tab
         }
 
         /* Read schema page */
-        rc = pager_read_page(cat->pager, value, schema_buffer);
+        rc = read_schema_page(cat, value, schema_buffer);
         if (rc == 0) {
             if (deserialize_schema(schema_buffer, schema) == 0) {
                 strncpy(table_names[count], schema->name, 63);
@@ -337,13 +390,116 @@ int catalog_list_tables(struct catalog *cat, char table_names[][64], int max_tab
     return count;
 }
 
+/* ========== Schema Page I/O ========== */
+
+/*
+ * Active transaction, or NULL
+ */
+static struct txn_context *active_txn(struct catalog *cat) {
+    if (cat->txn && cat->txn->state == TXN_STATE_ACTIVE) {
+        return cat->txn;
+    }
+    return NULL;
+}
+
+/*
+ * Point the catalog tree at the current root
+ *
+ * A shadow-paging transaction moves the root as it copies, and its abort
+ * moves it back (pager_shadow_abort), so the header is the authority.
+ * Only a shadow transaction tracks the catalog tree's pages.
+ */
+static void catalog_sync_root(struct catalog *cat) {
+    struct txn_context *txn = active_txn(cat);
+
+    cat->catalog_root = pager_get_catalog_root(cat->pager);
+    cat->catalog_tree->root_page = cat->catalog_root;
+    btree_set_transaction(cat->catalog_tree, (txn && txn->shadow) ? txn : NULL);
+}
+
+/*
+ * Record a new catalog root (after a root split, merge or copy)
+ */
+static void catalog_save_root(struct catalog *cat) {
+    if (cat->catalog_tree->root_page != cat->catalog_root) {
+        cat->catalog_root = cat->catalog_tree->root_page;
+        pager_set_catalog_root(cat->pager, cat->catalog_root);
+    }
+}
+
+/*
+ * Read a schema page (the transaction's version if it changed it)
+ */
+static int read_schema_page(struct catalog *cat, uint32_t page_num, uint8_t *buffer) {
+    struct txn_context *txn = active_txn(cat);
+    uint8_t *data;
+
+    if (txn && txn_is_page_dirty(txn, page_num)) {
+        /* Through the cache: reloads the page if it was spilled */
+        if (cache_get_page(cat->cache, page_num, &data) != 0) {
+            return -1;
+        }
+        memcpy(buffer, data, AMIDB_PAGE_SIZE);
+        cache_unpin(cat->cache, page_num);
+        return 0;
+    }
+
+    return pager_read_page(cat->pager, page_num, buffer);
+}
+
+/*
+ * Write a schema page
+ *
+ * Inside a transaction the write goes to the cache so that commit,
+ * rollback and savepoints cover it; otherwise it goes straight to disk.
+ */
+static int write_schema_page(struct catalog *cat, uint32_t page_num, const uint8_t *buffer) {
+    struct txn_context *txn = active_txn(cat);
+    struct cache_entry *entry;
+    uint8_t *data;
+    int rc;
+
+    if (!txn) {
+        /* Keep any copy cached by an earlier transaction in step */
+        entry = cache_find_entry(cat->cache, page_num);
+        if (entry) {
+            memcpy(entry->data, buffer, AMIDB_PAGE_SIZE);
+        }
+        return pager_write_page(cat->pager, page_num, buffer);
+    }
+
+    if (cache_get_page(cat->cache, page_num, &data) != 0) {
+        return -1;
+    }
+
+    /* A full undo buffer is fine for a page new to the transaction: */
+    /* abort rereads it from disk */
+    rc = txn_save_before_image(txn, page_num, data);
+    if (rc != AMIDB_OK && !(rc == AMIDB_FULL && !txn_is_page_dirty(txn, page_num))) {
+        cache_unpin(cat->cache, page_num);
+        return -1;
+    }
+    memcpy(data, buffer, AMIDB_PAGE_SIZE);
+
+    cache_mark_dirty(cat->cache, page_num);
+    if (txn_add_dirty_page(txn, page_num) != 0) {
+        cache_unpin(cat->cache, page_num);
+        return -1;
+    }
+    entry = cache_find_entry(cat->cache, page_num);
+    entry->txn_id = txn->txn_id;
+    cache_unpin(cat->cache, page_num);
+
+    return 0;
+}
+
 /* ========== Serialization ========== */
 
 /*
  * Serialize table schema to buffer
  */
 static int serialize_schema(const struct table_schema *schema, uint8_t *buffer, uint32_t *size) {
-    uint32_t offset = 12;  /* Start after 12-byte page header */
+    uint32_t offset = AMIDB_PAGE_HEADER_SIZE;  /* Start after page header */
     uint32_t i;
 
     CATALOG_LOG("[SERIALIZE] Serializing schema: name='%s'\n", schema->name);
@@ -397,6 +553,24 @@ static int serialize_schema(const struct table_schema *schema, uint8_t *buffer,
     memcpy(buffer + offset, &schema->row_count, 4);
     offset += 4;
 
+    /* Statistics (8 + 32 * 48 bytes; zero on pages written before ANALYZE existed) */
+    memcpy(buffer + offset, &schema->analyzed_rows, 4);
+    offset += 4;
+    memcpy(buffer + offset, &schema->row_bytes, 4);
+    offset += 4;
+    for (i = 0; i < 32; i++) {
+        memcpy(buffer + offset, &schema->stats[i].distinct, 4);
+        offset += 4;
+        memcpy(buffer + offset, &schema->stats[i].null_count, 4);
+        offset += 4;
+        memcpy(buffer + offset, &schema->stats[i].min_value, 4);
+        offset += 4;
+        memcpy(buffer + offset, &schema->stats[i].max_value, 4);
+        offset += 4;
+        memcpy(buffer + offset, schema->stats[i].histogram, 4 * CATALOG_HISTOGRAM_BUCKETS);
+        offset += 4 * CATALOG_HISTOGRAM_BUCKETS;
+    }
+
     *size = offset;
     return 0;
 }
@@ -405,12 +579,12 @@ static int serialize_schema(const struct table_schema *schema, uint8_t *buffer,
  * Deserialize table schema from buffer
  */
 static int deserialize_schema(const uint8_t *buffer, struct table_schema *schema) {
-    uint32_t offset = 12;  /* Start after 12-byte page header */
+    uint32_t offset = AMIDB_PAGE_HEADER_SIZE;  /* Start after page header */
     uint32_t i;
 
     CATALOG_LOG("[DESERIALIZE] Starting deserialization...\n");
-    CATALOG_LOG("[DESERIALIZE] First 16 bytes of DATA (offset 12+): ");
-    for (i = 12; i < 28; i++) {
+    CATALOG_LOG("[DESERIALIZE] First 16 bytes of DATA (offset %u+): ", AMIDB_PAGE_HEADER_SIZE);
+    for (i = AMIDB_PAGE_HEADER_SIZE; i < AMIDB_PAGE_HEADER_SIZE + 16; i++) {
         CATALOG_LOG("%02x ", buffer[i]);
     }
     CATALOG_LOG("...\n");
@@ -461,5 +635,23 @@ static int deserialize_schema(const uint8_t *buffer, struct table_schema *schema
     memcpy(&schema->row_count, buffer + offset, 4);
     offset += 4;
 
+    /* Statistics */
+    memcpy(&schema->analyzed_rows, buffer + offset, 4);
+    offset += 4;
+    memcpy(&schema->row_bytes, buffer + offset, 4);
+    offset += 4;
+    for (i = 0; i < 32; i++) {
+        memcpy(&schema->stats[i].distinct, buffer + offset, 4);
+        offset += 4;
+        memcpy(&schema->stats[i].null_count, buffer + offset, 4);
+        offset += 4;
+        memcpy(&schema->stats[i].min_value, buffer + offset, 4);
+        offset += 4;
+        memcpy(&schema->stats[i].max_value, buffer + offset, 4);
+        offset += 4;
+        memcpy(schema->stats[i].histogram, buffer + offset, 4 * CATALOG_HISTOGRAM_BUCKETS);
+        offset += 4 * CATALOG_HISTOGRAM_BUCKETS;
+    }
+
     return 0;
 }
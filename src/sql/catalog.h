@@ -14,17 +14,33 @@
 #include "storage/pager.h"
 #include "storage/cache.h"
 #include "storage/btree.h"
+#include "txn/txn.h"
 #include <stdint.h>
 
+/* Equal-width histogram buckets per INTEGER column (ANALYZE) */
+#define CATALOG_HISTOGRAM_BUCKETS   8
+
+/* Column statistics gathered by ANALYZE (see sql/stats.h) */
+struct column_stats {
+    uint32_t distinct;          /* Estimated distinct non-NULL values */
+    uint32_t null_count;        /* NULLs */
+    int32_t min_value;          /* INTEGER columns: smallest value */
+    int32_t max_value;          /* INTEGER columns: largest value */
+    uint32_t histogram[CATALOG_HISTOGRAM_BUCKETS];  /* INTEGER: rows per slice of min..max */
+};
+
 /* Table schema (persistent metadata) */
 struct table_schema {
     char name[64];              /* Table name */
     uint32_t column_count;      /* Number of columns */
     struct sql_column_def columns[32];  /* Column definitions */
     int8_t primary_key_index;   /* Index of PRIMARY KEY column (-1 if implicit rowid) */
-    uint32_t btree_root;        /* Root page of table's data B+Tree */
+    uint32_t btree_root;        /* Root page of table's data B+Tree (or LSM root) */
     uint32_t next_rowid;        /* Next auto-increment rowid (for implicit rowid tables) */
     uint32_t row_count;         /* Approximate row count (for stats) */
+    uint32_t analyzed_rows;     /* Rows ANALYZE read (0: no statistics) */
+    uint32_t row_bytes;         /* Average stored row size ANALYZE saw */
+    struct column_stats stats[32];  /* Per column, from ANALYZE */
 };
 
 /* Catalog manager */
@@ -33,6 +49,8 @@ struct catalog {
     struct page_cache *cache;
     struct btree *catalog_tree;     /* B+Tree: hash(table_name) → schema_page */
     uint32_t catalog_root;          /* Root page of catalog B+Tree */
+    struct txn_context *txn;        /* Schema updates join it while active */
+    uint32_t generation;            /* Bumped whenever a schema may have changed */
 };
 
 /* Catalog API */
@@ -51,7 +69,7 @@ void catalog_close(struct catalog *cat);
 
 /*
  * Create a new table in the catalog
- * Allocates a B+Tree for the table's data
+ * Allocates a B+Tree for the table's data (an LSM root for ENGINE = LSM)
  * Returns 0 on success, -1 on error (e.g., duplicate name)
  */
 int catalog_create_table(struct catalog *cat, const struct sql_create_table *create_stmt);
@@ -75,6 +93,15 @@ int catalog_drop_table(struct catalog *cat, const char *table_name);
  */
 int catalog_update_table(struct catalog *cat, const struct table_schema *schema);
 
+/*
+ * Note that schemas may have changed behind the catalog's back
+ *
+ * Called after a rollback, which puts schema pages back without going
+ * through the catalog. Anything holding a schema read at an older
+ * generation must read it again.
+ */
+void catalog_invalidate(struct catalog *cat);
+
 /*
  * List all table names
  * Fills table_names array with up to max_tables names
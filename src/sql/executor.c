@@ -6,48 +6,68 @@
  */
 
 #include "sql/executor.h"
+#include "sql/plan.h"
+#include "sql/stats.h"
 #include "storage/row.h"
 #include "storage/btree.h"
+#include "storage/lsm.h"
+#include "txn/cdc.h"
+#include "api/error.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 /* Forward declarations */
 static void set_error(struct sql_executor *exec, const char *message);
-
-/* Helper structure for ORDER BY - holds row data for sorting */
-struct row_buffer {
-    int32_t sort_key_int;        /* Integer sort key */
-    char sort_key_text[256];     /* Text sort key */
-    uint8_t sort_key_type;       /* AMIDB_TYPE_* */
-    struct amidb_row row;        /* Deserialized row */
+static struct txn_context *active_txn(struct sql_executor *exec);
+static int save_row_page(struct sql_executor *exec, uint32_t page_num, const uint8_t *data);
+static int mark_row_page_dirty(struct sql_executor *exec, uint32_t page_num);
+static int write_row_page(struct sql_executor *exec, uint32_t page_num, uint8_t *data,
+                          const uint8_t *row_buffer, int row_size);
+static int own_row_page(struct sql_executor *exec, struct btree *tree, int32_t key,
+                        uint32_t *page_num, uint8_t **page_data);
+static int log_row_change(struct sql_executor *exec, uint8_t op, const char *table,
+                          int32_t key, const uint8_t *row, int row_size);
+static int insert_row(struct sql_executor *exec, struct table_schema *schema,
+                      const struct sql_insert *insert_stmt);
+static int executor_write(struct sql_executor *exec, const struct sql_statement *stmt,
+                          struct table_schema *schema);
+static int executor_transaction(struct sql_executor *exec, const struct sql_statement *stmt);
+static int query_survives(struct sql_executor *exec, uint8_t type);
+static int load_schemas(struct sql_executor *exec, const struct sql_select *select,
+                        struct table_schema *schemas);
+
+/* Open streaming query */
+struct sql_query {
+    struct sql_select select;       /* Copy of the statement */
+    struct table_schema *schemas;   /* FROM table, then each joined table */
+    struct sql_plan plan;
+    struct txn_snapshot *snapshot;  /* Tables read through it (NULL: current) */
+    struct amidb_row row;           /* Row returned by the last step */
+    uint32_t explained;             /* EXPLAIN: operators described so far */
 };
 
-/* Comparison function for qsort (ascending integer) */
-static int compare_rows_int_asc(const void *a, const void *b) {
-    const struct row_buffer *ra = (const struct row_buffer *)a;
-    const struct row_buffer *rb = (const struct row_buffer *)b;
-    if (ra->sort_key_int < rb->sort_key_int) return -1;
-    if (ra->sort_key_int > rb->sort_key_int) return 1;
-    return 0;
-}
-
-/* Comparison function for qsort (descending integer) */
-static int compare_rows_int_desc(const void *a, const void *b) {
-    return compare_rows_int_asc(b, a);
-}
-
-/* Comparison function for qsort (ascending text) */
-static int compare_rows_text_asc(const void *a, const void *b) {
-    const struct row_buffer *ra = (const struct row_buffer *)a;
-    const struct row_buffer *rb = (const struct row_buffer *)b;
-    return strcmp(ra->sort_key_text, rb->sort_key_text);
-}
-
-/* Comparison function for qsort (descending text) */
-static int compare_rows_text_desc(const void *a, const void *b) {
-    return compare_rows_text_asc(b, a);
-}
+/* Prepared statement states */
+#define PREPARED_READY      0       /* Not run since prepared or reset */
+#define PREPARED_RUNNING    1       /* SELECT returning rows */
+#define PREPARED_DONE       2       /* Finished; reset to run again */
+
+/* Prepared statement */
+struct sql_prepared {
+    struct sql_executor *exec;
+    struct sql_statement stmt;      /* Parameters are bound into it */
+    struct sql_value *params[SQL_MAX_PARAMS];  /* Each ? in stmt */
+    uint32_t bound;                 /* Bit n-1 set: parameter n bound */
+    uint8_t state;                  /* PREPARED_* */
+
+    /* SELECT / INSERT: tables resolved once per catalog generation */
+    struct table_schema *schemas;   /* The table; a SELECT's joined tables follow */
+    uint32_t generation;            /* Catalog generation of schemas (0: none) */
+    struct sql_plan plan;           /* SELECT: built with schemas */
+    uint8_t planned;                /* 1 if plan is built */
+    struct amidb_row row;           /* Row returned by the last step */
+    uint32_t explained;             /* EXPLAIN: operators described so far */
+};
 
 /*
  * Initialize executor
@@ -60,6 +80,12 @@ int executor_init(struct sql_executor *exec, struct amidb_pager *pager,
     exec->txn = NULL;  /* Transaction support added in Week 5+ */
     exec->has_error = 0;
     exec->error_msg[0] = '\0';
+    exec->result_rows = NULL;
+    exec->result_count = 0;
+    exec->result_truncated = 0;
+    exec->query = NULL;
+    exec->sort_memory = 0;
+    exec->join_memory = 0;
 
     return 0;
 }
@@ -68,8 +94,18 @@ int executor_init(struct sql_executor *exec, struct amidb_pager *pager,
  * Close executor
  */
 void executor_close(struct sql_executor *exec) {
-    /* Nothing to clean up for now */
-    (void)exec;
+    uint32_t i;
+
+    executor_finish(exec);
+
+    if (exec->result_rows) {
+        for (i = 0; i < exec->result_count; i++) {
+            row_clear(&exec->result_rows[i]);
+        }
+        free(exec->result_rows);
+        exec->result_rows = NULL;
+    }
+    exec->result_count = 0;
 }
 
 /*
@@ -80,6 +116,16 @@ int executor_execute(struct sql_executor *exec, const struct sql_statement *stmt
     exec->has_error = 0;
     exec->error_msg[0] = '\0';
 
+    /* A streaming query must not see the tables change under it */
+    if (!query_survives(exec, stmt->type)) {
+        executor_finish(exec);
+    }
+
+    if (stmt->param_count > 0) {
+        set_error(exec, "Statement has parameters (use executor_prepare)");
+        return -1;
+    }
+
     /* Dispatch to appropriate handler */
     switch (stmt->type) {
         case STMT_CREATE_TABLE:
@@ -89,16 +135,22 @@ int executor_execute(struct sql_executor *exec, const struct sql_statement *stmt
             return executor_drop_table(exec, &stmt->stmt.drop_table);
 
         case STMT_INSERT:
-            return executor_insert(exec, &stmt->stmt.insert);
+        case STMT_UPDATE:
+        case STMT_DELETE:
+            return executor_write(exec, stmt, NULL);
 
         case STMT_SELECT:
             return executor_select(exec, &stmt->stmt.select);
 
-        case STMT_UPDATE:
-            return executor_update(exec, &stmt->stmt.update);
+        case STMT_ANALYZE:
+            return executor_analyze(exec, &stmt->stmt.analyze);
 
-        case STMT_DELETE:
-            return executor_delete(exec, &stmt->stmt.delete);
+        case STMT_BEGIN:
+        case STMT_COMMIT:
+        case STMT_ROLLBACK:
+        case STMT_SAVEPOINT:
+        case STMT_RELEASE:
+            return executor_transaction(exec, stmt);
 
         default:
             set_error(exec, "Unknown statement type");
@@ -121,6 +173,12 @@ int executor_create_table(struct sql_executor *exec, const struct sql_create_tab
     int i;
     int pk_count = 0;
 
+    /* Catalog B+Tree changes are not transactional */
+    if (active_txn(exec)) {
+        set_error(exec, "CREATE TABLE not allowed inside a transaction");
+        return -1;
+    }
+
     /* Validate table name */
     if (create_stmt->table_name[0] == '\0') {
         set_error(exec, "Table name cannot be empty");
@@ -197,6 +255,12 @@ int executor_create_table(struct sql_executor *exec, const struct sql_create_tab
 int executor_drop_table(struct sql_executor *exec, const struct sql_drop_table *drop_stmt) {
     int rc;
 
+    /* Catalog B+Tree changes are not transactional */
+    if (active_txn(exec)) {
+        set_error(exec, "DROP TABLE not allowed inside a transaction");
+        return -1;
+    }
+
     /* Validate table name */
     if (drop_stmt->table_name[0] == '\0') {
         set_error(exec, "Table name cannot be empty");
@@ -215,11 +279,101 @@ int executor_drop_table(struct sql_executor *exec, const struct sql_drop_table *
     return 0;
 }
 
+/*
+ * Gather statistics for one table
+ */
+static int analyze_table(struct sql_executor *exec, const char *table_name) {
+    static struct table_schema schema;  /* Off the 4KB stack */
+    int rc;
+
+    if (catalog_get_table(exec->catalog, table_name, &schema) != 0) {
+        snprintf(exec->error_msg, sizeof(exec->error_msg),
+                 "Table '%.63s' does not exist", table_name);
+        exec->has_error = 1;
+        return -1;
+    }
+
+    rc = stats_analyze(exec->pager, exec->cache, &schema);
+    if (rc != AMIDB_OK) {
+        set_error(exec, (rc == AMIDB_NOMEM) ? "Out of memory for ANALYZE" :
+                        "Failed to open table B+Tree");
+        return -1;
+    }
+
+    if (catalog_update_table(exec->catalog, &schema) != 0) {
+        set_error(exec, "Failed to save table statistics");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Execute ANALYZE
+ *
+ * Each table's statistics replace the ones it had; its row_count is
+ * set to the rows counted.
+ */
+int executor_analyze(struct sql_executor *exec, const struct sql_analyze *analyze_stmt) {
+    char (*table_names)[64];
+    int capacity = 32;
+    int count;
+    int rc = 0;
+    int i;
+
+    if (analyze_stmt->table_name[0] != '\0') {
+        return analyze_table(exec, analyze_stmt->table_name);
+    }
+
+    /* Names are listed first: saving statistics changes the catalog */
+    /* (a full list may have left some out, so grow it and list again) */
+    for (;;) {
+        table_names = (char (*)[64])malloc(capacity * sizeof(*table_names));
+        if (!table_names) {
+            set_error(exec, "Out of memory for ANALYZE");
+            return -1;
+        }
+        count = catalog_list_tables(exec->catalog, table_names, capacity);
+        if (count < capacity) {
+            break;
+        }
+        free(table_names);
+        capacity *= 2;
+    }
+
+    for (i = 0; i < count && rc == 0; i++) {
+        rc = analyze_table(exec, table_names[i]);
+    }
+
+    free(table_names);
+    return rc;
+}
+
 /*
  * Execute INSERT (Week 5)
  */
 int executor_insert(struct sql_executor *exec, const struct sql_insert *insert_stmt) {
     static struct table_schema schema;  /* Move off stack (4KB limit) */
+
+    /* Retrieve table schema */
+    if (catalog_get_table(exec->catalog, insert_stmt->table_name, &schema) != 0) {
+        snprintf(exec->error_msg, sizeof(exec->error_msg),
+                 "Table '%s' does not exist", insert_stmt->table_name);
+        exec->has_error = 1;
+        return -1;
+    }
+
+    return insert_row(exec, &schema, insert_stmt);
+}
+
+/*
+ * Insert a row into a table whose schema the caller has read
+ *
+ * The schema is updated (root, next_rowid, row_count) and written back
+ * to the catalog.
+ */
+static int insert_row(struct sql_executor *exec, struct table_schema *schema,
+                      const struct sql_insert *insert_stmt) {
     struct amidb_row row;
     struct btree *table_tree;
     static uint8_t row_buffer[4096];  /* Move off stack */
@@ -230,20 +384,11 @@ int executor_insert(struct sql_executor *exec, const struct sql_insert *insert_s
     uint32_t i;
     uint8_t *page_data;
 
-    /* Retrieve table schema */
-    rc = catalog_get_table(exec->catalog, insert_stmt->table_name, &schema);
-    if (rc != 0) {
-        snprintf(exec->error_msg, sizeof(exec->error_msg),
-                 "Table '%s' does not exist", insert_stmt->table_name);
-        exec->has_error = 1;
-        return -1;
-    }
-
     /* Validate value count matches column count */
-    if (insert_stmt->value_count != schema.column_count) {
+    if (insert_stmt->value_count != schema->column_count) {
         snprintf(exec->error_msg, sizeof(exec->error_msg),
                  "Column count mismatch: expected %u, got %u",
-                 schema.column_count, insert_stmt->value_count);
+                 schema->column_count, insert_stmt->value_count);
         exec->has_error = 1;
         return -1;
     }
@@ -253,7 +398,7 @@ int executor_insert(struct sql_executor *exec, const struct sql_insert *insert_s
 
     for (i = 0; i < insert_stmt->value_count; i++) {
         const struct sql_value *val = &insert_stmt->values[i];
-        const struct sql_column_def *col = &schema.columns[i];
+        const struct sql_column_def *col = &schema->columns[i];
 
         /* Set value based on type */
         switch (val->type) {
@@ -293,9 +438,9 @@ int executor_insert(struct sql_executor *exec, const struct sql_insert *insert_s
     }
 
     /* Determine PRIMARY KEY value */
-    if (schema.primary_key_index >= 0) {
+    if (schema->primary_key_index >= 0) {
         /* Explicit PRIMARY KEY */
-        const struct amidb_value *pk_val = row_get_value(&row, schema.primary_key_index);
+        const struct amidb_value *pk_val = row_get_value(&row, schema->primary_key_index);
         if (pk_val == NULL || pk_val->type != AMIDB_TYPE_INTEGER) {
             set_error(exec, "PRIMARY KEY must be INTEGER");
             row_clear(&row);
@@ -304,7 +449,7 @@ int executor_insert(struct sql_executor *exec, const struct sql_insert *insert_s
         primary_key = pk_val->u.i;
     } else {
         /* Implicit rowid - use auto-increment */
-        primary_key = (int32_t)schema.next_rowid;
+        primary_key = (int32_t)schema->next_rowid;
     }
 
     /* Serialize row */
@@ -323,26 +468,30 @@ int executor_insert(struct sql_executor *exec, const struct sql_insert *insert_s
         return -1;
     }
 
-    /* Write serialized row to page */
-    rc = cache_get_page(exec->cache, row_page, &page_data);
+    /* Write serialized row to page (new: nothing to read) */
+    rc = cache_new_page(exec->cache, row_page, &page_data);
     if (rc != 0) {
         set_error(exec, "Failed to get page for row");
         row_clear(&row);
         return -1;
     }
 
-    /* Write row data after the 12-byte page header */
-    memcpy(page_data + 12, row_buffer, row_size);
-    cache_mark_dirty(exec->cache, row_page);
+    /* Write row data after the page header */
+    rc = write_row_page(exec, row_page, page_data, row_buffer, row_size);
     cache_unpin(exec->cache, row_page);
+    if (rc != 0) {
+        row_clear(&row);
+        return -1;
+    }
 
     /* Open table B+Tree */
-    table_tree = btree_open(exec->pager, exec->cache, schema.btree_root);
+    table_tree = btree_open(exec->pager, exec->cache, schema->btree_root);
     if (table_tree == NULL) {
         set_error(exec, "Failed to open table B+Tree");
         row_clear(&row);
         return -1;
     }
+    btree_set_transaction(table_tree, active_txn(exec));
 
     /* Check for duplicate PRIMARY KEY (INSERT should fail on duplicates) */
     {
@@ -368,18 +517,30 @@ int executor_insert(struct sql_executor *exec, const struct sql_insert *insert_s
         return -1;
     }
 
-    /* CRITICAL: Update schema.btree_root from tree's root_page
+    /* LSM tables merge their runs after the insert, not during it;
+     * a failed merge leaves the runs as they were
+     */
+    if (lsm_merge_pending(table_tree)) {
+        lsm_merge(table_tree);
+    }
+
+    /* CRITICAL: Update schema->btree_root from tree's root_page
      * If btree_insert caused a split, the root may have changed!
      */
-    schema.btree_root = table_tree->root_page;
+    schema->btree_root = table_tree->root_page;
 
     btree_close(table_tree);
 
-    /* If implicit rowid, update schema.next_rowid */
-    if (schema.primary_key_index < 0) {
-        schema.next_rowid++;
-        schema.row_count++;
-        rc = catalog_update_table(exec->catalog, &schema);
+    if (log_row_change(exec, CDC_INSERT, schema->name, primary_key, row_buffer, row_size) != 0) {
+        row_clear(&row);
+        return -1;
+    }
+
+    /* If implicit rowid, update schema->next_rowid */
+    if (schema->primary_key_index < 0) {
+        schema->next_rowid++;
+        schema->row_count++;
+        rc = catalog_update_table(exec->catalog, schema);
         if (rc != 0) {
             set_error(exec, "Failed to update table metadata");
             row_clear(&row);
@@ -387,8 +548,12 @@ int executor_insert(struct sql_executor *exec, const struct sql_insert *insert_s
         }
     } else {
         /* Explicit PRIMARY KEY - just update row count */
-        schema.row_count++;
-        catalog_update_table(exec->catalog, &schema);
+        schema->row_count++;
+        if (catalog_update_table(exec->catalog, schema) != 0) {
+            set_error(exec, "Failed to update table metadata");
+            row_clear(&row);
+            return -1;
+        }
     }
 
     row_clear(&row);
@@ -396,958 +561,204 @@ int executor_insert(struct sql_executor *exec, const struct sql_insert *insert_s
 }
 
 /*
- * Execute SELECT (Week 6)
- */
-/*
- * Execute SELECT (Week 6-7: with ORDER BY and LIMIT)
+ * Execute SELECT
+ *
+ * Streams the query and keeps the first MAX_RESULT_ROWS rows.
  */
 int executor_select(struct sql_executor *exec, const struct sql_select *select_stmt) {
-    static struct table_schema schema;  /* Move off stack (4KB limit) */
-    struct btree *table_tree;
-    struct btree_cursor cursor;
-    struct amidb_row row;
-    struct row_buffer *row_buffers = NULL;
-    uint8_t *page_data;
-    uint32_t row_page;
+    const struct amidb_row *row;
+    uint32_t i;
     int rc;
-    int match_count = 0;
-    int i, j;
-    int order_col_idx = -1;
-    int need_sorting = 0;
-    int row_buffer_count = 0;
-    int row_buffer_capacity = 100;  /* Max 100 rows for ORDER BY */
 
-    /* Initialize result storage */
-    exec->result_count = 0;
-    for (i = 0; i < MAX_RESULT_ROWS; i++) {
-        row_init(&exec->result_rows[i]);
+    /* Free the previous result set */
+    for (i = 0; i < exec->result_count; i++) {
+        row_clear(&exec->result_rows[i]);
     }
+    exec->result_count = 0;
+    exec->result_truncated = 0;
 
-    /* Retrieve table schema */
-    rc = catalog_get_table(exec->catalog, select_stmt->table_name, &schema);
-    if (rc != 0) {
-        snprintf(exec->error_msg, sizeof(exec->error_msg),
-                 "Table '%s' does not exist", select_stmt->table_name);
-        exec->has_error = 1;
-        return -1;
+    if (exec->result_rows == NULL) {
+        exec->result_rows = (struct amidb_row *)malloc(MAX_RESULT_ROWS * sizeof(struct amidb_row));
+        if (exec->result_rows == NULL) {
+            set_error(exec, "Out of memory for SELECT results");
+            return -1;
+        }
     }
 
-    /* Open table B+Tree */
-    table_tree = btree_open(exec->pager, exec->cache, schema.btree_root);
-    if (table_tree == NULL) {
-        set_error(exec, "Failed to open table B+Tree");
+    if (executor_query(exec, select_stmt) != 0) {
         return -1;
     }
 
-    /* Handle COUNT aggregate function */
-    if (select_stmt->aggregate == SQL_AGG_COUNT ||
-        select_stmt->aggregate == SQL_AGG_COUNT_STAR) {
-        int32_t count = 0;
-        int agg_col_idx = -1;
-
-        /* For COUNT(column), find the column index */
-        if (select_stmt->aggregate == SQL_AGG_COUNT) {
-            for (i = 0; i < schema.column_count; i++) {
-                if (strcmp(select_stmt->agg_column, schema.columns[i].name) == 0) {
-                    agg_col_idx = i;
-                    break;
-                }
-            }
-            if (agg_col_idx < 0) {
-                snprintf(exec->error_msg, sizeof(exec->error_msg),
-                         "Column '%s' not found", select_stmt->agg_column);
-                exec->has_error = 1;
-                btree_close(table_tree);
-                return -1;
-            }
-        }
-
-        /* Iterate through all rows and count */
-        rc = btree_cursor_first(table_tree, &cursor);
-        if (rc != 0) {
-            /* Empty table - count is 0 */
-            count = 0;
+    while ((rc = executor_step(exec, &row)) == AMIDB_ROW) {
+        if (exec->result_count < MAX_RESULT_ROWS) {
+            /* Take the row over from the query */
+            exec->result_rows[exec->result_count++] = exec->query->row;
+            row_init(&exec->query->row);
         } else {
-            while (cursor.valid) {
-                row_page = cursor.value;
-
-                rc = cache_get_page(exec->cache, row_page, &page_data);
-                if (rc != 0) {
-                    btree_cursor_next(&cursor);
-                    continue;
-                }
-
-                row_init(&row);
-                rc = row_deserialize(&row, page_data + 12, 4096 - 12);
-                cache_unpin(exec->cache, row_page);
-
-                if (rc < 0) {
-                    row_clear(&row);
-                    btree_cursor_next(&cursor);
-                    continue;
-                }
-
-                /* Apply WHERE filter if present */
-                int passes_filter = 1;
-                if (select_stmt->where.has_condition) {
-                    passes_filter = 0;
-                    int col_idx = -1;
-                    for (i = 0; i < schema.column_count; i++) {
-                        if (strcmp(select_stmt->where.column_name, schema.columns[i].name) == 0) {
-                            col_idx = i;
-                            break;
-                        }
-                    }
-
-                    if (col_idx >= 0 && col_idx < row.column_count) {
-                        const struct amidb_value *col_val = row_get_value(&row, col_idx);
-
-                        if (col_val->type == AMIDB_TYPE_INTEGER &&
-                            select_stmt->where.value.type == SQL_VALUE_INTEGER) {
-                            int32_t row_val = col_val->u.i;
-                            int32_t where_val = select_stmt->where.value.int_value;
-
-                            switch (select_stmt->where.op) {
-                                case SQL_OP_EQ: passes_filter = (row_val == where_val); break;
-                                case SQL_OP_NE: passes_filter = (row_val != where_val); break;
-                                case SQL_OP_LT: passes_filter = (row_val < where_val); break;
-                                case SQL_OP_LE: passes_filter = (row_val <= where_val); break;
-                                case SQL_OP_GT: passes_filter = (row_val > where_val); break;
-                                case SQL_OP_GE: passes_filter = (row_val >= where_val); break;
-                            }
-                        } else if (col_val->type == AMIDB_TYPE_TEXT &&
-                                  select_stmt->where.value.type == SQL_VALUE_TEXT) {
-                            char row_str[256];
-                            snprintf(row_str, sizeof(row_str), "%.*s",
-                                    (int)col_val->u.blob.size, (char*)col_val->u.blob.data);
-                            int cmp = strcmp(row_str, select_stmt->where.value.text_value);
-
-                            switch (select_stmt->where.op) {
-                                case SQL_OP_EQ: passes_filter = (cmp == 0); break;
-                                case SQL_OP_NE: passes_filter = (cmp != 0); break;
-                                case SQL_OP_LT: passes_filter = (cmp < 0); break;
-                                case SQL_OP_LE: passes_filter = (cmp <= 0); break;
-                                case SQL_OP_GT: passes_filter = (cmp > 0); break;
-                                case SQL_OP_GE: passes_filter = (cmp >= 0); break;
-                            }
-                        }
-                    }
-                }
-
-                if (passes_filter) {
-                    /* For COUNT(*) - count all rows */
-                    /* For COUNT(column) - count non-NULL values */
-                    if (select_stmt->aggregate == SQL_AGG_COUNT_STAR) {
-                        count++;
-                    } else {
-                        /* COUNT(column) - check if column is not NULL */
-                        if (agg_col_idx < row.column_count) {
-                            const struct amidb_value *val = row_get_value(&row, agg_col_idx);
-                            if (val->type != AMIDB_TYPE_NULL) {
-                                count++;
-                            }
-                        }
-                    }
-                }
-
-                row_clear(&row);
-                btree_cursor_next(&cursor);
-            }
+            exec->result_truncated = 1;
         }
-
-        btree_close(table_tree);
-
-        /* Create result row with count value */
-        row_init(&exec->result_rows[0]);
-        row_set_int(&exec->result_rows[0], 0, count);
-        exec->result_rows[0].column_count = 1;
-        exec->result_count = 1;
-
-        return 0;
     }
 
-    /* Handle SUM aggregate function */
-    if (select_stmt->aggregate == SQL_AGG_SUM) {
-        int32_t sum = 0;
-        int agg_col_idx = -1;
+    executor_finish(exec);
+    return (rc == AMIDB_DONE) ? 0 : -1;
+}
 
-        /* Find the column index */
-        for (i = 0; i < schema.column_count; i++) {
-            if (strcmp(select_stmt->agg_column, schema.columns[i].name) == 0) {
-                agg_col_idx = i;
-                break;
-            }
-        }
-        if (agg_col_idx < 0) {
-            snprintf(exec->error_msg, sizeof(exec->error_msg),
-                     "Column '%s' not found", select_stmt->agg_column);
-            exec->has_error = 1;
-            btree_close(table_tree);
-            return -1;
-        }
+/*
+ * Start a streaming SELECT
+ */
+int executor_query(struct sql_executor *exec, const struct sql_select *select_stmt) {
+    struct sql_query *query;
+    uint32_t i;
 
-        /* Verify column is INTEGER type */
-        if (schema.columns[agg_col_idx].type != SQL_TYPE_INTEGER) {
-            snprintf(exec->error_msg, sizeof(exec->error_msg),
-                     "SUM() requires INTEGER column, '%s' is not INTEGER",
-                     select_stmt->agg_column);
-            exec->has_error = 1;
-            btree_close(table_tree);
+    exec->has_error = 0;
+    exec->error_msg[0] = '\0';
+    executor_finish(exec);
+
+    query = (struct sql_query *)malloc(sizeof(struct sql_query));
+    if (query == NULL) {
+        set_error(exec, "Out of memory for query");
+        return -1;
+    }
+    memcpy(&query->select, select_stmt, sizeof(query->select));
+    query->snapshot = NULL;
+    row_init(&query->row);
+
+    for (i = 0; i < query->select.where.condition_count; i++) {
+        if (query->select.where.conditions[i].value.type == SQL_VALUE_PARAM) {
+            set_error(exec, "Statement has parameters (use executor_prepare)");
+            free(query);
             return -1;
         }
+    }
 
-        /* Iterate through all rows and sum */
-        rc = btree_cursor_first(table_tree, &cursor);
-        if (rc != 0) {
-            /* Empty table - sum is 0 */
-            sum = 0;
-        } else {
-            while (cursor.valid) {
-                row_page = cursor.value;
-
-                rc = cache_get_page(exec->cache, row_page, &page_data);
-                if (rc != 0) {
-                    btree_cursor_next(&cursor);
-                    continue;
-                }
+    /* Outside BEGIN ... COMMIT the query reads a snapshot, so later */
+    /* writes (each then a transaction) do not change what it returns. */
+    /* Inside one it must see the transaction's own changes. */
+    if (exec->txn && !active_txn(exec) && !query->select.explain &&
+        txn_snapshot_open(exec->txn, &query->snapshot) != AMIDB_OK) {
+        set_error(exec, "Out of memory for query");
+        free(query);
+        return -1;
+    }
 
-                row_init(&row);
-                rc = row_deserialize(&row, page_data + 12, 4096 - 12);
-                cache_unpin(exec->cache, row_page);
+    /* Retrieve table schemas */
+    query->schemas = (struct table_schema *)malloc((1 + query->select.join_count) *
+                                                   sizeof(struct table_schema));
+    if (query->schemas == NULL) {
+        set_error(exec, "Out of memory for query");
+        txn_snapshot_close(query->snapshot);
+        free(query);
+        return -1;
+    }
+    if (load_schemas(exec, &query->select, query->schemas) != 0) {
+        txn_snapshot_close(query->snapshot);
+        free(query->schemas);
+        free(query);
+        return -1;
+    }
 
-                if (rc < 0) {
-                    row_clear(&row);
-                    btree_cursor_next(&cursor);
-                    continue;
-                }
+    if (plan_build(&query->plan, exec->pager, exec->cache, query->schemas, &query->select) != 0) {
+        set_error(exec, query->plan.error_msg);
+        plan_close(&query->plan);
+        txn_snapshot_close(query->snapshot);
+        free(query->schemas);
+        free(query);
+        return -1;
+    }
+    if (query->snapshot) {
+        plan_set_snapshot(&query->plan, query->snapshot);
+    }
+    if (exec->sort_memory) {
+        query->plan.sort_memory = exec->sort_memory;
+    }
+    if (exec->join_memory) {
+        query->plan.join_memory = exec->join_memory;
+    }
+    query->explained = 0;
+    if (!query->select.explain && plan_open(&query->plan) != 0) {
+        set_error(exec, query->plan.error_msg);
+        plan_close(&query->plan);
+        txn_snapshot_close(query->snapshot);
+        free(query->schemas);
+        free(query);
+        return -1;
+    }
 
-                /* Apply WHERE filter if present */
-                int passes_filter = 1;
-                if (select_stmt->where.has_condition) {
-                    passes_filter = 0;
-                    int col_idx = -1;
-                    for (i = 0; i < schema.column_count; i++) {
-                        if (strcmp(select_stmt->where.column_name, schema.columns[i].name) == 0) {
-                            col_idx = i;
-                            break;
-                        }
-                    }
+    exec->query = query;
+    return 0;
+}
 
-                    if (col_idx >= 0 && col_idx < row.column_count) {
-                        const struct amidb_value *col_val = row_get_value(&row, col_idx);
-
-                        if (col_val->type == AMIDB_TYPE_INTEGER &&
-                            select_stmt->where.value.type == SQL_VALUE_INTEGER) {
-                            int32_t row_val = col_val->u.i;
-                            int32_t where_val = select_stmt->where.value.int_value;
-
-                            switch (select_stmt->where.op) {
-                                case SQL_OP_EQ: passes_filter = (row_val == where_val); break;
-                                case SQL_OP_NE: passes_filter = (row_val != where_val); break;
-                                case SQL_OP_LT: passes_filter = (row_val < where_val); break;
-                                case SQL_OP_LE: passes_filter = (row_val <= where_val); break;
-                                case SQL_OP_GT: passes_filter = (row_val > where_val); break;
-                                case SQL_OP_GE: passes_filter = (row_val >= where_val); break;
-                            }
-                        } else if (col_val->type == AMIDB_TYPE_TEXT &&
-                                  select_stmt->where.value.type == SQL_VALUE_TEXT) {
-                            char row_str[256];
-                            snprintf(row_str, sizeof(row_str), "%.*s",
-                                    (int)col_val->u.blob.size, (char*)col_val->u.blob.data);
-                            int cmp = strcmp(row_str, select_stmt->where.value.text_value);
-
-                            switch (select_stmt->where.op) {
-                                case SQL_OP_EQ: passes_filter = (cmp == 0); break;
-                                case SQL_OP_NE: passes_filter = (cmp != 0); break;
-                                case SQL_OP_LT: passes_filter = (cmp < 0); break;
-                                case SQL_OP_LE: passes_filter = (cmp <= 0); break;
-                                case SQL_OP_GT: passes_filter = (cmp > 0); break;
-                                case SQL_OP_GE: passes_filter = (cmp >= 0); break;
-                            }
-                        }
-                    }
-                }
+/*
+ * Get the next row of the open query
+ */
+int executor_step(struct sql_executor *exec, const struct amidb_row **row_out) {
+    struct sql_query *query = exec->query;
+    int rc;
 
-                if (passes_filter) {
-                    /* Add value to sum (skip NULL values) */
-                    if (agg_col_idx < row.column_count) {
-                        const struct amidb_value *val = row_get_value(&row, agg_col_idx);
-                        if (val->type == AMIDB_TYPE_INTEGER) {
-                            sum += val->u.i;
-                        }
-                    }
-                }
+    if (query == NULL) {
+        set_error(exec, "No query is open");
+        return AMIDB_ERROR;
+    }
 
-                row_clear(&row);
-                btree_cursor_next(&cursor);
-            }
-        }
+    row_clear(&query->row);
+    if (query->select.explain) {
+        rc = plan_explain(&query->plan, query->explained++, &query->row);
+    } else {
+        rc = plan_next(&query->plan, &query->row);
+    }
+    if (rc == AMIDB_ROW) {
+        *row_out = &query->row;
+    } else if (rc != AMIDB_DONE) {
+        set_error(exec, query->plan.error_msg);
+    }
+    return rc;
+}
 
-        btree_close(table_tree);
+/*
+ * Finish the open query
+ */
+void executor_finish(struct sql_executor *exec) {
+    struct sql_query *query = exec->query;
 
-        /* Create result row with sum value */
-        row_init(&exec->result_rows[0]);
-        row_set_int(&exec->result_rows[0], 0, sum);
-        exec->result_rows[0].column_count = 1;
-        exec->result_count = 1;
+    if (query == NULL) {
+        return;
+    }
+    row_clear(&query->row);
+    plan_close(&query->plan);
+    txn_snapshot_close(query->snapshot);
+    free(query->schemas);
+    free(query);
+    exec->query = NULL;
+}
 
+/*
+ * Can the open query stay open across a statement of this type?
+ *
+ * Only one reading a snapshot, and only across row writes (which then
+ * run in a transaction, see executor_write) and transaction control,
+ * including a BEGIN after the query started: the snapshot still reads
+ * the committed image of pages that transaction dirties. Catalog changes write outside any transaction, so the snapshot could
+ * not keep the pages they reuse.
+ */
+static int query_survives(struct sql_executor *exec, uint8_t type) {
+    if (exec->query == NULL || exec->query->snapshot == NULL) {
         return 0;
     }
 
-    /* Handle AVG aggregate function */
-    if (select_stmt->aggregate == SQL_AGG_AVG) {
-        int32_t sum = 0;
-        int32_t count = 0;
-        int agg_col_idx = -1;
-
-        /* Find the column index */
-        for (i = 0; i < schema.column_count; i++) {
-            if (strcmp(select_stmt->agg_column, schema.columns[i].name) == 0) {
-                agg_col_idx = i;
-                break;
-            }
-        }
-        if (agg_col_idx < 0) {
-            snprintf(exec->error_msg, sizeof(exec->error_msg),
-                     "Column '%s' not found", select_stmt->agg_column);
-            exec->has_error = 1;
-            btree_close(table_tree);
-            return -1;
-        }
-
-        /* Verify column is INTEGER type */
-        if (schema.columns[agg_col_idx].type != SQL_TYPE_INTEGER) {
-            snprintf(exec->error_msg, sizeof(exec->error_msg),
-                     "AVG() requires INTEGER column, '%s' is not INTEGER",
-                     select_stmt->agg_column);
-            exec->has_error = 1;
-            btree_close(table_tree);
-            return -1;
-        }
-
-        /* Iterate through all rows and calculate sum and count */
-        rc = btree_cursor_first(table_tree, &cursor);
-        if (rc != 0) {
-            /* Empty table - avg is 0 */
-            sum = 0;
-            count = 0;
-        } else {
-            while (cursor.valid) {
-                row_page = cursor.value;
-
-                rc = cache_get_page(exec->cache, row_page, &page_data);
-                if (rc != 0) {
-                    btree_cursor_next(&cursor);
-                    continue;
-                }
-
-                row_init(&row);
-                rc = row_deserialize(&row, page_data + 12, 4096 - 12);
-                cache_unpin(exec->cache, row_page);
-
-                if (rc < 0) {
-                    row_clear(&row);
-                    btree_cursor_next(&cursor);
-                    continue;
-                }
-
-                /* Apply WHERE filter if present */
-                int passes_filter = 1;
-                if (select_stmt->where.has_condition) {
-                    passes_filter = 0;
-                    int col_idx = -1;
-                    for (i = 0; i < schema.column_count; i++) {
-                        if (strcmp(select_stmt->where.column_name, schema.columns[i].name) == 0) {
-                            col_idx = i;
-                            break;
-                        }
-                    }
-
-                    if (col_idx >= 0 && col_idx < row.column_count) {
-                        const struct amidb_value *col_val = row_get_value(&row, col_idx);
-
-                        if (col_val->type == AMIDB_TYPE_INTEGER &&
-                            select_stmt->where.value.type == SQL_VALUE_INTEGER) {
-                            int32_t row_val = col_val->u.i;
-                            int32_t where_val = select_stmt->where.value.int_value;
-
-                            switch (select_stmt->where.op) {
-                                case SQL_OP_EQ: passes_filter = (row_val == where_val); break;
-                                case SQL_OP_NE: passes_filter = (row_val != where_val); break;
-                                case SQL_OP_LT: passes_filter = (row_val < where_val); break;
-                                case SQL_OP_LE: passes_filter = (row_val <= where_val); break;
-                                case SQL_OP_GT: passes_filter = (row_val > where_val); break;
-                                case SQL_OP_GE: passes_filter = (row_val >= where_val); break;
-                            }
-                        } else if (col_val->type == AMIDB_TYPE_TEXT &&
-                                  select_stmt->where.value.type == SQL_VALUE_TEXT) {
-                            char row_str[256];
-                            snprintf(row_str, sizeof(row_str), "%.*s",
-                                    (int)col_val->u.blob.size, (char*)col_val->u.blob.data);
-                            int cmp = strcmp(row_str, select_stmt->where.value.text_value);
-
-                            switch (select_stmt->where.op) {
-                                case SQL_OP_EQ: passes_filter = (cmp == 0); break;
-                                case SQL_OP_NE: passes_filter = (cmp != 0); break;
-                                case SQL_OP_LT: passes_filter = (cmp < 0); break;
-                                case SQL_OP_LE: passes_filter = (cmp <= 0); break;
-                                case SQL_OP_GT: passes_filter = (cmp > 0); break;
-                                case SQL_OP_GE: passes_filter = (cmp >= 0); break;
-                            }
-                        }
-                    }
-                }
-
-                if (passes_filter) {
-                    /* Add value to sum and increment count (skip NULL values) */
-                    if (agg_col_idx < row.column_count) {
-                        const struct amidb_value *val = row_get_value(&row, agg_col_idx);
-                        if (val->type == AMIDB_TYPE_INTEGER) {
-                            sum += val->u.i;
-                            count++;
-                        }
-                    }
-                }
-
-                row_clear(&row);
-                btree_cursor_next(&cursor);
-            }
-        }
-
-        btree_close(table_tree);
-
-        /* Create result row with avg value (integer division) */
-        row_init(&exec->result_rows[0]);
-        if (count > 0) {
-            row_set_int(&exec->result_rows[0], 0, sum / count);
-        } else {
-            row_set_int(&exec->result_rows[0], 0, 0);
-        }
-        exec->result_rows[0].column_count = 1;
-        exec->result_count = 1;
-
-        return 0;
-    }
-
-    /* Handle MIN aggregate function */
-    if (select_stmt->aggregate == SQL_AGG_MIN) {
-        int32_t min_val = 0;
-        int found_any = 0;
-        int agg_col_idx = -1;
-
-        /* Find the column index */
-        for (i = 0; i < schema.column_count; i++) {
-            if (strcmp(select_stmt->agg_column, schema.columns[i].name) == 0) {
-                agg_col_idx = i;
-                break;
-            }
-        }
-        if (agg_col_idx < 0) {
-            snprintf(exec->error_msg, sizeof(exec->error_msg),
-                     "Column '%s' not found", select_stmt->agg_column);
-            exec->has_error = 1;
-            btree_close(table_tree);
-            return -1;
-        }
-
-        /* Verify column is INTEGER type */
-        if (schema.columns[agg_col_idx].type != SQL_TYPE_INTEGER) {
-            snprintf(exec->error_msg, sizeof(exec->error_msg),
-                     "MIN() requires INTEGER column, '%s' is not INTEGER",
-                     select_stmt->agg_column);
-            exec->has_error = 1;
-            btree_close(table_tree);
-            return -1;
-        }
-
-        /* Iterate through all rows and find minimum */
-        rc = btree_cursor_first(table_tree, &cursor);
-        if (rc != 0) {
-            /* Empty table - min is 0 */
-            min_val = 0;
-            found_any = 0;
-        } else {
-            while (cursor.valid) {
-                row_page = cursor.value;
-
-                rc = cache_get_page(exec->cache, row_page, &page_data);
-                if (rc != 0) {
-                    btree_cursor_next(&cursor);
-                    continue;
-                }
-
-                row_init(&row);
-                rc = row_deserialize(&row, page_data + 12, 4096 - 12);
-                cache_unpin(exec->cache, row_page);
-
-                if (rc < 0) {
-                    row_clear(&row);
-                    btree_cursor_next(&cursor);
-                    continue;
-                }
-
-                /* Apply WHERE filter if present */
-                int passes_filter = 1;
-                if (select_stmt->where.has_condition) {
-                    passes_filter = 0;
-                    int col_idx = -1;
-                    for (i = 0; i < schema.column_count; i++) {
-                        if (strcmp(select_stmt->where.column_name, schema.columns[i].name) == 0) {
-                            col_idx = i;
-                            break;
-                        }
-                    }
-
-                    if (col_idx >= 0 && col_idx < row.column_count) {
-                        const struct amidb_value *col_val = row_get_value(&row, col_idx);
-
-                        if (col_val->type == AMIDB_TYPE_INTEGER &&
-                            select_stmt->where.value.type == SQL_VALUE_INTEGER) {
-                            int32_t row_val = col_val->u.i;
-                            int32_t where_val = select_stmt->where.value.int_value;
-
-                            switch (select_stmt->where.op) {
-                                case SQL_OP_EQ: passes_filter = (row_val == where_val); break;
-                                case SQL_OP_NE: passes_filter = (row_val != where_val); break;
-                                case SQL_OP_LT: passes_filter = (row_val < where_val); break;
-                                case SQL_OP_LE: passes_filter = (row_val <= where_val); break;
-                                case SQL_OP_GT: passes_filter = (row_val > where_val); break;
-                                case SQL_OP_GE: passes_filter = (row_val >= where_val); break;
-                            }
-                        } else if (col_val->type == AMIDB_TYPE_TEXT &&
-                                  select_stmt->where.value.type == SQL_VALUE_TEXT) {
-                            char row_str[256];
-                            snprintf(row_str, sizeof(row_str), "%.*s",
-                                    (int)col_val->u.blob.size, (char*)col_val->u.blob.data);
-                            int cmp = strcmp(row_str, select_stmt->where.value.text_value);
-
-                            switch (select_stmt->where.op) {
-                                case SQL_OP_EQ: passes_filter = (cmp == 0); break;
-                                case SQL_OP_NE: passes_filter = (cmp != 0); break;
-                                case SQL_OP_LT: passes_filter = (cmp < 0); break;
-                                case SQL_OP_LE: passes_filter = (cmp <= 0); break;
-                                case SQL_OP_GT: passes_filter = (cmp > 0); break;
-                                case SQL_OP_GE: passes_filter = (cmp >= 0); break;
-                            }
-                        }
-                    }
-                }
-
-                if (passes_filter) {
-                    /* Check value and update minimum (skip NULL values) */
-                    if (agg_col_idx < row.column_count) {
-                        const struct amidb_value *val = row_get_value(&row, agg_col_idx);
-                        if (val->type == AMIDB_TYPE_INTEGER) {
-                            if (!found_any || val->u.i < min_val) {
-                                min_val = val->u.i;
-                                found_any = 1;
-                            }
-                        }
-                    }
-                }
-
-                row_clear(&row);
-                btree_cursor_next(&cursor);
-            }
-        }
-
-        btree_close(table_tree);
-
-        /* Create result row with min value */
-        row_init(&exec->result_rows[0]);
-        if (found_any) {
-            row_set_int(&exec->result_rows[0], 0, min_val);
-        } else {
-            row_set_int(&exec->result_rows[0], 0, 0);
-        }
-        exec->result_rows[0].column_count = 1;
-        exec->result_count = 1;
-
-        return 0;
-    }
-
-    /* Handle MAX aggregate function */
-    if (select_stmt->aggregate == SQL_AGG_MAX) {
-        int32_t max_val = 0;
-        int found_any = 0;
-        int agg_col_idx = -1;
-
-        /* Find the column index */
-        for (i = 0; i < schema.column_count; i++) {
-            if (strcmp(select_stmt->agg_column, schema.columns[i].name) == 0) {
-                agg_col_idx = i;
-                break;
-            }
-        }
-        if (agg_col_idx < 0) {
-            snprintf(exec->error_msg, sizeof(exec->error_msg),
-                     "Column '%s' not found", select_stmt->agg_column);
-            exec->has_error = 1;
-            btree_close(table_tree);
-            return -1;
-        }
-
-        /* Verify column is INTEGER type */
-        if (schema.columns[agg_col_idx].type != SQL_TYPE_INTEGER) {
-            snprintf(exec->error_msg, sizeof(exec->error_msg),
-                     "MAX() requires INTEGER column, '%s' is not INTEGER",
-                     select_stmt->agg_column);
-            exec->has_error = 1;
-            btree_close(table_tree);
-            return -1;
-        }
-
-        /* Iterate through all rows and find maximum */
-        rc = btree_cursor_first(table_tree, &cursor);
-        if (rc != 0) {
-            /* Empty table - max is 0 */
-            max_val = 0;
-            found_any = 0;
-        } else {
-            while (cursor.valid) {
-                row_page = cursor.value;
-
-                rc = cache_get_page(exec->cache, row_page, &page_data);
-                if (rc != 0) {
-                    btree_cursor_next(&cursor);
-                    continue;
-                }
-
-                row_init(&row);
-                rc = row_deserialize(&row, page_data + 12, 4096 - 12);
-                cache_unpin(exec->cache, row_page);
-
-                if (rc < 0) {
-                    row_clear(&row);
-                    btree_cursor_next(&cursor);
-                    continue;
-                }
-
-                /* Apply WHERE filter if present */
-                int passes_filter = 1;
-                if (select_stmt->where.has_condition) {
-                    passes_filter = 0;
-                    int col_idx = -1;
-                    for (i = 0; i < schema.column_count; i++) {
-                        if (strcmp(select_stmt->where.column_name, schema.columns[i].name) == 0) {
-                            col_idx = i;
-                            break;
-                        }
-                    }
-
-                    if (col_idx >= 0 && col_idx < row.column_count) {
-                        const struct amidb_value *col_val = row_get_value(&row, col_idx);
-
-                        if (col_val->type == AMIDB_TYPE_INTEGER &&
-                            select_stmt->where.value.type == SQL_VALUE_INTEGER) {
-                            int32_t row_val = col_val->u.i;
-                            int32_t where_val = select_stmt->where.value.int_value;
-
-                            switch (select_stmt->where.op) {
-                                case SQL_OP_EQ: passes_filter = (row_val == where_val); break;
-                                case SQL_OP_NE: passes_filter = (row_val != where_val); break;
-                                case SQL_OP_LT: passes_filter = (row_val < where_val); break;
-                                case SQL_OP_LE: passes_filter = (row_val <= where_val); break;
-                                case SQL_OP_GT: passes_filter = (row_val > where_val); break;
-                                case SQL_OP_GE: passes_filter = (row_val >= where_val); break;
-                            }
-                        } else if (col_val->type == AMIDB_TYPE_TEXT &&
-                                  select_stmt->where.value.type == SQL_VALUE_TEXT) {
-                            char row_str[256];
-                            snprintf(row_str, sizeof(row_str), "%.*s",
-                                    (int)col_val->u.blob.size, (char*)col_val->u.blob.data);
-                            int cmp = strcmp(row_str, select_stmt->where.value.text_value);
-
-                            switch (select_stmt->where.op) {
-                                case SQL_OP_EQ: passes_filter = (cmp == 0); break;
-                                case SQL_OP_NE: passes_filter = (cmp != 0); break;
-                                case SQL_OP_LT: passes_filter = (cmp < 0); break;
-                                case SQL_OP_LE: passes_filter = (cmp <= 0); break;
-                                case SQL_OP_GT: passes_filter = (cmp > 0); break;
-                                case SQL_OP_GE: passes_filter = (cmp >= 0); break;
-                            }
-                        }
-                    }
-                }
-
-                if (passes_filter) {
-                    /* Check value and update maximum (skip NULL values) */
-                    if (agg_col_idx < row.column_count) {
-                        const struct amidb_value *val = row_get_value(&row, agg_col_idx);
-                        if (val->type == AMIDB_TYPE_INTEGER) {
-                            if (!found_any || val->u.i > max_val) {
-                                max_val = val->u.i;
-                                found_any = 1;
-                            }
-                        }
-                    }
-                }
-
-                row_clear(&row);
-                btree_cursor_next(&cursor);
-            }
-        }
-
-        btree_close(table_tree);
-
-        /* Create result row with max value */
-        row_init(&exec->result_rows[0]);
-        if (found_any) {
-            row_set_int(&exec->result_rows[0], 0, max_val);
-        } else {
-            row_set_int(&exec->result_rows[0], 0, 0);
-        }
-        exec->result_rows[0].column_count = 1;
-        exec->result_count = 1;
-
-        return 0;
-    }
-
-    /* Determine if we need in-memory sorting */
-    if (select_stmt->order_by.has_order) {
-        /* Find ORDER BY column index */
-        for (i = 0; i < schema.column_count; i++) {
-            if (strcmp(select_stmt->order_by.column_name, schema.columns[i].name) == 0) {
-                order_col_idx = i;
-                break;
-            }
-        }
-
-        if (order_col_idx < 0) {
-            snprintf(exec->error_msg, sizeof(exec->error_msg),
-                     "ORDER BY column '%s' not found", select_stmt->order_by.column_name);
-            exec->has_error = 1;
-            btree_close(table_tree);
-            return -1;
-        }
-
-        /* Check if we need sorting (not if ordering by PK ascending) */
-        int is_pk_order = (schema.primary_key_index >= 0 && order_col_idx == schema.primary_key_index);
-        need_sorting = !(is_pk_order && select_stmt->order_by.ascending);
-
-        if (need_sorting) {
-            /* Allocate row buffer for sorting */
-            row_buffers = (struct row_buffer *)malloc(row_buffer_capacity * sizeof(struct row_buffer));
-            if (row_buffers == NULL) {
-                set_error(exec, "Out of memory for ORDER BY");
-                btree_close(table_tree);
-                return -1;
-            }
-            memset(row_buffers, 0, row_buffer_capacity * sizeof(struct row_buffer));
-        }
-    }
-
-    /* WHERE clause fast path: Direct PRIMARY KEY lookup */
-    if (select_stmt->where.has_condition && !need_sorting) {
-        int is_pk_where = 0;
-        if (schema.primary_key_index >= 0) {
-            if (strcmp(select_stmt->where.column_name,
-                      schema.columns[schema.primary_key_index].name) == 0) {
-                is_pk_where = 1;
-            }
-        }
-
-        if (is_pk_where && select_stmt->where.op == SQL_OP_EQ) {
-            /* Fast path: Direct B+Tree search */
-            if (select_stmt->where.value.type != SQL_VALUE_INTEGER) {
-                set_error(exec, "WHERE on PRIMARY KEY requires INTEGER value");
-                btree_close(table_tree);
-                if (row_buffers) free(row_buffers);
-                return -1;
-            }
-
-            rc = btree_search(table_tree, select_stmt->where.value.int_value, &row_page);
-            if (rc == 0) {
-                rc = cache_get_page(exec->cache, row_page, &page_data);
-                if (rc == 0) {
-                    row_init(&exec->result_rows[0]);
-                    row_deserialize(&exec->result_rows[0], page_data + 12, 4096 - 12);
-                    exec->result_count = 1;
-                    cache_unpin(exec->cache, row_page);
-                }
-            }
-
-            btree_close(table_tree);
-            return 0;
-        }
-    }
-
-    /* Collect rows (with WHERE filtering if present) */
-    rc = btree_cursor_first(table_tree, &cursor);
-    if (rc != 0) {
-        /* Empty table */
-        btree_close(table_tree);
-        if (row_buffers) free(row_buffers);
-        exec->result_count = 0;
-        return 0;
-    }
-
-    while (cursor.valid) {
-        row_page = cursor.value;
-
-        rc = cache_get_page(exec->cache, row_page, &page_data);
-        if (rc != 0) {
-            cache_unpin(exec->cache, row_page);
-            btree_cursor_next(&cursor);
-            continue;
-        }
-
-        row_init(&row);
-        rc = row_deserialize(&row, page_data + 12, 4096 - 12);
-        cache_unpin(exec->cache, row_page);
-
-        if (rc < 0) {
-            row_clear(&row);
-            btree_cursor_next(&cursor);
-            continue;
-        }
-
-        /* Apply WHERE filter */
-        int passes_filter = 1;
-        if (select_stmt->where.has_condition) {
-            passes_filter = 0;
-            int col_idx = -1;
-            for (i = 0; i < schema.column_count; i++) {
-                if (strcmp(select_stmt->where.column_name, schema.columns[i].name) == 0) {
-                    col_idx = i;
-                    break;
-                }
-            }
-
-            if (col_idx >= 0 && col_idx < row.column_count) {
-                const struct amidb_value *col_val = row_get_value(&row, col_idx);
-
-                if (col_val->type == AMIDB_TYPE_INTEGER &&
-                    select_stmt->where.value.type == SQL_VALUE_INTEGER) {
-                    int32_t row_val = col_val->u.i;
-                    int32_t where_val = select_stmt->where.value.int_value;
-
-                    switch (select_stmt->where.op) {
-                        case SQL_OP_EQ: passes_filter = (row_val == where_val); break;
-                        case SQL_OP_NE: passes_filter = (row_val != where_val); break;
-                        case SQL_OP_LT: passes_filter = (row_val < where_val); break;
-                        case SQL_OP_LE: passes_filter = (row_val <= where_val); break;
-                        case SQL_OP_GT: passes_filter = (row_val > where_val); break;
-                        case SQL_OP_GE: passes_filter = (row_val >= where_val); break;
-                    }
-                } else if (col_val->type == AMIDB_TYPE_TEXT &&
-                          select_stmt->where.value.type == SQL_VALUE_TEXT) {
-                    char row_str[256];
-                    snprintf(row_str, sizeof(row_str), "%.*s",
-                            (int)col_val->u.blob.size, (char*)col_val->u.blob.data);
-                    int cmp = strcmp(row_str, select_stmt->where.value.text_value);
-
-                    switch (select_stmt->where.op) {
-                        case SQL_OP_EQ: passes_filter = (cmp == 0); break;
-                        case SQL_OP_NE: passes_filter = (cmp != 0); break;
-                        case SQL_OP_LT: passes_filter = (cmp < 0); break;
-                        case SQL_OP_LE: passes_filter = (cmp <= 0); break;
-                        case SQL_OP_GT: passes_filter = (cmp > 0); break;
-                        case SQL_OP_GE: passes_filter = (cmp >= 0); break;
-                    }
-                }
-            }
-        }
-
-        if (!passes_filter) {
-            row_clear(&row);
-            btree_cursor_next(&cursor);
-            continue;
-        }
-
-        /* If we need sorting, buffer the row */
-        if (need_sorting) {
-            if (row_buffer_count >= row_buffer_capacity) {
-                set_error(exec, "Too many rows for ORDER BY (max 100)");
-                for (j = 0; j < row_buffer_count; j++) {
-                    row_clear(&row_buffers[j].row);
-                }
-                free(row_buffers);
-                row_clear(&row);
-                btree_close(table_tree);
-                return -1;
-            }
-
-            /* Extract sort key */
-            const struct amidb_value *sort_val = row_get_value(&row, order_col_idx);
-            row_buffers[row_buffer_count].sort_key_type = sort_val->type;
-
-            if (sort_val->type == AMIDB_TYPE_INTEGER) {
-                row_buffers[row_buffer_count].sort_key_int = sort_val->u.i;
-            } else if (sort_val->type == AMIDB_TYPE_TEXT) {
-                snprintf(row_buffers[row_buffer_count].sort_key_text,
-                        sizeof(row_buffers[row_buffer_count].sort_key_text),
-                        "%.*s", (int)sort_val->u.blob.size, (char*)sort_val->u.blob.data);
-            }
-
-            /* Deep copy the row */
-            row_buffers[row_buffer_count].row = row;
-            row_buffer_count++;
-            /* Don't row_clear here - we're keeping the row */
-        } else {
-            /* No sorting - store row in result set with LIMIT */
-            if (exec->result_count < MAX_RESULT_ROWS) {
-                /* Deep copy the row to result set */
-                exec->result_rows[exec->result_count] = row;
-                exec->result_count++;
-                match_count++;
-                /* Don't row_clear here - we're keeping the row */
-            } else {
-                row_clear(&row);
-            }
-
-            /* Check LIMIT */
-            if (select_stmt->limit > 0 && match_count >= select_stmt->limit) {
-                break;
-            }
-        }
-
-        btree_cursor_next(&cursor);
-    }
-
-    btree_close(table_tree);
-
-    /* If we buffered rows, sort and output them */
-    if (need_sorting && row_buffer_count > 0) {
-        /* Sort the rows */
-        if (row_buffers[0].sort_key_type == AMIDB_TYPE_INTEGER) {
-            if (select_stmt->order_by.ascending) {
-                qsort(row_buffers, row_buffer_count, sizeof(struct row_buffer), compare_rows_int_asc);
-            } else {
-                qsort(row_buffers, row_buffer_count, sizeof(struct row_buffer), compare_rows_int_desc);
-            }
-        } else if (row_buffers[0].sort_key_type == AMIDB_TYPE_TEXT) {
-            if (select_stmt->order_by.ascending) {
-                qsort(row_buffers, row_buffer_count, sizeof(struct row_buffer), compare_rows_text_asc);
-            } else {
-                qsort(row_buffers, row_buffer_count, sizeof(struct row_buffer), compare_rows_text_desc);
-            }
-        }
-
-        /* Copy sorted rows to result set with LIMIT */
-        int output_limit = row_buffer_count;
-        if (select_stmt->limit > 0 && select_stmt->limit < row_buffer_count) {
-            output_limit = select_stmt->limit;
-        }
-        if (output_limit > MAX_RESULT_ROWS) {
-            output_limit = MAX_RESULT_ROWS;
-        }
-
-        for (j = 0; j < output_limit; j++) {
-            exec->result_rows[j] = row_buffers[j].row;
-            /* Don't row_clear - we're transferring ownership */
-        }
-        exec->result_count = output_limit;
-
-        /* Clean up remaining row buffers that weren't transferred */
-        for (j = output_limit; j < row_buffer_count; j++) {
-            row_clear(&row_buffers[j].row);
-        }
-        free(row_buffers);
-    }
-
-    return 0;
-}
+    switch (type) {
+        case STMT_INSERT:
+        case STMT_UPDATE:
+        case STMT_DELETE:
+        case STMT_BEGIN:
+        case STMT_COMMIT:
+        case STMT_ROLLBACK:
+        case STMT_SAVEPOINT:
+        case STMT_RELEASE:
+            return 1;
+        default:
+            return 0;
+    }
+}
 
 /*
  * Execute UPDATE
@@ -1357,11 +768,14 @@ int executor_update(struct sql_executor *exec, const struct sql_update *update_s
     struct btree *table_tree;
     struct btree_cursor cursor;
     struct amidb_row row;
+    static struct sql_predicate where;  /* Move off stack */
     static uint8_t row_buffer[4096];  /* Move off stack */
     uint8_t *page_data;
     uint32_t row_page;
     int update_count = 0;
     int update_col_idx = -1;
+    int should_update;
+    int log_rc = 0;
     int rc;
     int i;
     int row_size;
@@ -1415,31 +829,34 @@ int executor_update(struct sql_executor *exec, const struct sql_update *update_s
         set_error(exec, "Failed to open table B+Tree");
         return -1;
     }
+    btree_set_transaction(table_tree, active_txn(exec));
 
     /* WHERE clause fast path: Direct PRIMARY KEY lookup */
-    if (update_stmt->where.has_condition) {
+    /* (the whole WHERE is one comparison: pk = n) */
+    if (update_stmt->where.has_condition && update_stmt->where.node_count == 1) {
+        const struct sql_condition *cond = &update_stmt->where.conditions[0];
         int is_pk_where = 0;
         if (schema.primary_key_index >= 0) {
-            if (strcmp(update_stmt->where.column_name,
+            if (strcmp(cond->column_name,
                       schema.columns[schema.primary_key_index].name) == 0) {
                 is_pk_where = 1;
             }
         }
 
-        if (is_pk_where && update_stmt->where.op == SQL_OP_EQ) {
+        if (is_pk_where && cond->op == SQL_OP_EQ) {
             /* Fast path: Direct B+Tree search and update */
-            if (update_stmt->where.value.type != SQL_VALUE_INTEGER) {
+            if (cond->value.type != SQL_VALUE_INTEGER) {
                 set_error(exec, "WHERE on PRIMARY KEY requires INTEGER value");
                 btree_close(table_tree);
                 return -1;
             }
 
-            rc = btree_search(table_tree, update_stmt->where.value.int_value, &row_page);
+            rc = btree_search(table_tree, cond->value.int_value, &row_page);
             if (rc == 0) {
                 rc = cache_get_page(exec->cache, row_page, &page_data);
                 if (rc == 0) {
                     row_init(&row);
-                    row_deserialize(&row, page_data + 12, 4096 - 12);
+                    row_deserialize(&row, page_data + AMIDB_PAGE_HEADER_SIZE, AMIDB_PAGE_SIZE - AMIDB_PAGE_HEADER_SIZE);
 
                     /* Update the column value */
                     if (update_stmt->value.type == SQL_VALUE_INTEGER) {
@@ -1450,10 +867,20 @@ int executor_update(struct sql_executor *exec, const struct sql_update *update_s
 
                     /* Serialize and write back */
                     row_size = row_serialize(&row, row_buffer, sizeof(row_buffer));
-                    if (row_size > 0) {
-                        memcpy(page_data + 12, row_buffer, row_size);
-                        cache_mark_dirty(exec->cache, row_page);
+                    if (row_size > 0 &&
+                        own_row_page(exec, table_tree, cond->value.int_value,
+                                     &row_page, &page_data) != 0) {
+                        set_error(exec, "Failed to copy row page");
+                        log_rc = -1;
+                    } else if (row_size > 0 &&
+                               write_row_page(exec, row_page, page_data,
+                                              row_buffer, row_size) != 0) {
+                        log_rc = -1;
+                    } else if (row_size > 0) {
                         update_count = 1;
+                        log_rc = log_row_change(exec, CDC_UPDATE, schema.name,
+                                                cond->value.int_value,
+                                                row_buffer, row_size);
                     }
 
                     row_clear(&row);
@@ -1461,12 +888,22 @@ int executor_update(struct sql_executor *exec, const struct sql_update *update_s
                 }
             }
 
+            /* Shadow paging may have moved the root */
+            if (table_tree->root_page != schema.btree_root) {
+                schema.btree_root = table_tree->root_page;
+                if (catalog_update_table(exec->catalog, &schema) != 0) {
+                    set_error(exec, "Failed to update table metadata");
+                    log_rc = -1;
+                }
+            }
+
             btree_close(table_tree);
-            return 0;
+            return log_rc;
         }
     }
 
     /* General case: Iterate through all rows */
+    predicate_compile(&where, &schema, &update_stmt->where, 0);
     rc = btree_cursor_first(table_tree, &cursor);
     if (rc != 0) {
         /* Empty table */
@@ -1484,62 +921,16 @@ int executor_update(struct sql_executor *exec, const struct sql_update *update_s
             continue;
         }
 
-        row_init(&row);
-        rc = row_deserialize(&row, page_data + 12, 4096 - 12);
-
-        if (rc < 0) {
-            row_clear(&row);
-            cache_unpin(exec->cache, row_page);
-            btree_cursor_next(&cursor);
-            continue;
-        }
+        /* Apply WHERE filter if present (rows that fail are not decoded) */
+        should_update = predicate_matches_stored(&where, page_data + AMIDB_PAGE_HEADER_SIZE,
+                                                 AMIDB_PAGE_SIZE - AMIDB_PAGE_HEADER_SIZE);
 
-        /* Apply WHERE filter if present */
-        int should_update = 1;
-        if (update_stmt->where.has_condition) {
+        row_init(&row);
+        if (should_update &&
+            row_deserialize(&row, page_data + AMIDB_PAGE_HEADER_SIZE,
+                            AMIDB_PAGE_SIZE - AMIDB_PAGE_HEADER_SIZE) < 0) {
             should_update = 0;
-            int col_idx = -1;
-            for (i = 0; i < schema.column_count; i++) {
-                if (strcmp(update_stmt->where.column_name, schema.columns[i].name) == 0) {
-                    col_idx = i;
-                    break;
-                }
-            }
-
-            if (col_idx >= 0 && col_idx < row.column_count) {
-                const struct amidb_value *col_val = row_get_value(&row, col_idx);
-
-                if (col_val->type == AMIDB_TYPE_INTEGER &&
-                    update_stmt->where.value.type == SQL_VALUE_INTEGER) {
-                    int32_t row_val = col_val->u.i;
-                    int32_t where_val = update_stmt->where.value.int_value;
-
-                    switch (update_stmt->where.op) {
-                        case SQL_OP_EQ: should_update = (row_val == where_val); break;
-                        case SQL_OP_NE: should_update = (row_val != where_val); break;
-                        case SQL_OP_LT: should_update = (row_val < where_val); break;
-                        case SQL_OP_LE: should_update = (row_val <= where_val); break;
-                        case SQL_OP_GT: should_update = (row_val > where_val); break;
-                        case SQL_OP_GE: should_update = (row_val >= where_val); break;
-                    }
-                } else if (col_val->type == AMIDB_TYPE_TEXT &&
-                          update_stmt->where.value.type == SQL_VALUE_TEXT) {
-                    char row_str[256];
-                    snprintf(row_str, sizeof(row_str), "%.*s",
-                            (int)col_val->u.blob.size, (char*)col_val->u.blob.data);
-                    int cmp = strcmp(row_str, update_stmt->where.value.text_value);
-
-                    switch (update_stmt->where.op) {
-                        case SQL_OP_EQ: should_update = (cmp == 0); break;
-                        case SQL_OP_NE: should_update = (cmp != 0); break;
-                        case SQL_OP_LT: should_update = (cmp < 0); break;
-                        case SQL_OP_LE: should_update = (cmp <= 0); break;
-                        case SQL_OP_GT: should_update = (cmp > 0); break;
-                        case SQL_OP_GE: should_update = (cmp >= 0); break;
-                    }
-                }
-            }
-        }
+        }
 
         if (should_update) {
             /* Update the column value */
@@ -1551,20 +942,39 @@ int executor_update(struct sql_executor *exec, const struct sql_update *update_s
 
             /* Serialize and write back */
             row_size = row_serialize(&row, row_buffer, sizeof(row_buffer));
-            if (row_size > 0) {
-                memcpy(page_data + 12, row_buffer, row_size);
-                cache_mark_dirty(exec->cache, row_page);
+            if (row_size > 0 &&
+                own_row_page(exec, table_tree, cursor.key, &row_page, &page_data) != 0) {
+                set_error(exec, "Failed to copy row page");
+                log_rc = -1;
+            } else if (row_size > 0 &&
+                       write_row_page(exec, row_page, page_data, row_buffer, row_size) != 0) {
+                log_rc = -1;
+            } else if (row_size > 0) {
                 update_count++;
+                log_rc = log_row_change(exec, CDC_UPDATE, schema.name, cursor.key,
+                                        row_buffer, row_size);
             }
         }
 
         row_clear(&row);
         cache_unpin(exec->cache, row_page);
+        if (log_rc != 0) {
+            break;
+        }
         btree_cursor_next(&cursor);
     }
 
+    /* Shadow paging may have moved the root */
+    if (table_tree->root_page != schema.btree_root) {
+        schema.btree_root = table_tree->root_page;
+        if (catalog_update_table(exec->catalog, &schema) != 0) {
+            set_error(exec, "Failed to update table metadata");
+            log_rc = -1;
+        }
+    }
+
     btree_close(table_tree);
-    return 0;
+    return log_rc;
 }
 
 /*
@@ -1574,12 +984,14 @@ int executor_delete(struct sql_executor *exec, const struct sql_delete *delete_s
     static struct table_schema schema;  /* Move off stack (4KB limit) */
     struct btree *table_tree;
     struct btree_cursor cursor;
-    struct amidb_row row;
+    static struct sql_predicate where;  /* Move off stack */
     uint8_t *page_data;
     uint32_t row_page;
     int32_t *keys_to_delete = NULL;
     int delete_count = 0;
     int delete_capacity = 100;
+    int should_delete;
+    int log_rc = 0;
     int rc;
     int i, j;
 
@@ -1598,6 +1010,7 @@ int executor_delete(struct sql_executor *exec, const struct sql_delete *delete_s
         set_error(exec, "Failed to open table B+Tree");
         return -1;
     }
+    btree_set_transaction(table_tree, active_txn(exec));
 
     /* Allocate buffer for keys to delete */
     keys_to_delete = (int32_t *)malloc(delete_capacity * sizeof(int32_t));
@@ -1608,43 +1021,50 @@ int executor_delete(struct sql_executor *exec, const struct sql_delete *delete_s
     }
 
     /* WHERE clause fast path: Direct PRIMARY KEY lookup */
-    if (delete_stmt->where.has_condition) {
+    /* (the whole WHERE is one comparison: pk = n) */
+    if (delete_stmt->where.has_condition && delete_stmt->where.node_count == 1) {
+        const struct sql_condition *cond = &delete_stmt->where.conditions[0];
         int is_pk_where = 0;
         if (schema.primary_key_index >= 0) {
-            if (strcmp(delete_stmt->where.column_name,
+            if (strcmp(cond->column_name,
                       schema.columns[schema.primary_key_index].name) == 0) {
                 is_pk_where = 1;
             }
         }
 
-        if (is_pk_where && delete_stmt->where.op == SQL_OP_EQ) {
+        if (is_pk_where && cond->op == SQL_OP_EQ) {
             /* Fast path: Direct B+Tree delete */
-            if (delete_stmt->where.value.type != SQL_VALUE_INTEGER) {
+            if (cond->value.type != SQL_VALUE_INTEGER) {
                 set_error(exec, "WHERE on PRIMARY KEY requires INTEGER value");
                 btree_close(table_tree);
                 free(keys_to_delete);
                 return -1;
             }
 
-            rc = btree_delete(table_tree, delete_stmt->where.value.int_value);
+            rc = btree_delete(table_tree, cond->value.int_value);
             if (rc == 0) {
                 delete_count = 1;
                 schema.row_count--;
+                log_rc = log_row_change(exec, CDC_DELETE, schema.name,
+                                        cond->value.int_value, NULL, 0);
             }
 
+            schema.btree_root = table_tree->root_page;
             btree_close(table_tree);
             free(keys_to_delete);
 
             /* Update catalog */
-            if (delete_count > 0) {
-                catalog_update_table(exec->catalog, &schema);
+            if (delete_count > 0 && catalog_update_table(exec->catalog, &schema) != 0) {
+                set_error(exec, "Failed to update table metadata");
+                log_rc = -1;
             }
 
-            return 0;
+            return log_rc;
         }
     }
 
     /* Collect keys to delete (can't delete during iteration) */
+    predicate_compile(&where, &schema, &delete_stmt->where, 0);
     rc = btree_cursor_first(table_tree, &cursor);
     if (rc != 0) {
         /* Empty table */
@@ -1664,70 +1084,17 @@ int executor_delete(struct sql_executor *exec, const struct sql_delete *delete_s
             continue;
         }
 
-        row_init(&row);
-        rc = row_deserialize(&row, page_data + 12, 4096 - 12);
+        /* Apply WHERE filter if present (on the stored row: nothing is decoded) */
+        should_delete = predicate_matches_stored(&where, page_data + AMIDB_PAGE_HEADER_SIZE,
+                                                 AMIDB_PAGE_SIZE - AMIDB_PAGE_HEADER_SIZE);
         cache_unpin(exec->cache, row_page);
 
-        if (rc < 0) {
-            row_clear(&row);
-            btree_cursor_next(&cursor);
-            continue;
-        }
-
-        /* Apply WHERE filter if present */
-        int should_delete = 1;
-        if (delete_stmt->where.has_condition) {
-            should_delete = 0;
-            int col_idx = -1;
-            for (i = 0; i < schema.column_count; i++) {
-                if (strcmp(delete_stmt->where.column_name, schema.columns[i].name) == 0) {
-                    col_idx = i;
-                    break;
-                }
-            }
-
-            if (col_idx >= 0 && col_idx < row.column_count) {
-                const struct amidb_value *col_val = row_get_value(&row, col_idx);
-
-                if (col_val->type == AMIDB_TYPE_INTEGER &&
-                    delete_stmt->where.value.type == SQL_VALUE_INTEGER) {
-                    int32_t row_val = col_val->u.i;
-                    int32_t where_val = delete_stmt->where.value.int_value;
-
-                    switch (delete_stmt->where.op) {
-                        case SQL_OP_EQ: should_delete = (row_val == where_val); break;
-                        case SQL_OP_NE: should_delete = (row_val != where_val); break;
-                        case SQL_OP_LT: should_delete = (row_val < where_val); break;
-                        case SQL_OP_LE: should_delete = (row_val <= where_val); break;
-                        case SQL_OP_GT: should_delete = (row_val > where_val); break;
-                        case SQL_OP_GE: should_delete = (row_val >= where_val); break;
-                    }
-                } else if (col_val->type == AMIDB_TYPE_TEXT &&
-                          delete_stmt->where.value.type == SQL_VALUE_TEXT) {
-                    char row_str[256];
-                    snprintf(row_str, sizeof(row_str), "%.*s",
-                            (int)col_val->u.blob.size, (char*)col_val->u.blob.data);
-                    int cmp = strcmp(row_str, delete_stmt->where.value.text_value);
-
-                    switch (delete_stmt->where.op) {
-                        case SQL_OP_EQ: should_delete = (cmp == 0); break;
-                        case SQL_OP_NE: should_delete = (cmp != 0); break;
-                        case SQL_OP_LT: should_delete = (cmp < 0); break;
-                        case SQL_OP_LE: should_delete = (cmp <= 0); break;
-                        case SQL_OP_GT: should_delete = (cmp > 0); break;
-                        case SQL_OP_GE: should_delete = (cmp >= 0); break;
-                    }
-                }
-            }
-        }
-
         if (should_delete) {
             if (delete_count >= delete_capacity) {
                 set_error(exec, "Too many rows to delete (max 100)");
                 for (j = 0; j < delete_count; j++) {
                     /* Clean up what we can */
                 }
-                row_clear(&row);
                 free(keys_to_delete);
                 btree_close(table_tree);
                 return -1;
@@ -1735,29 +1102,589 @@ int executor_delete(struct sql_executor *exec, const struct sql_delete *delete_s
             keys_to_delete[delete_count++] = current_key;
         }
 
-        row_clear(&row);
         btree_cursor_next(&cursor);
     }
 
     /* Now delete all marked keys */
-    for (i = 0; i < delete_count; i++) {
-        btree_delete(table_tree, keys_to_delete[i]);
+    for (i = 0; i < delete_count && log_rc == 0; i++) {
+        if (btree_delete(table_tree, keys_to_delete[i]) == 0) {
+            log_rc = log_row_change(exec, CDC_DELETE, schema.name, keys_to_delete[i], NULL, 0);
+        }
         schema.row_count--;
     }
 
+    schema.btree_root = table_tree->root_page;
     btree_close(table_tree);
     free(keys_to_delete);
 
     /* Update catalog */
-    if (delete_count > 0) {
-        catalog_update_table(exec->catalog, &schema);
+    if (delete_count > 0 && catalog_update_table(exec->catalog, &schema) != 0) {
+        set_error(exec, "Failed to update table metadata");
+        log_rc = -1;
     }
 
+    return log_rc;
+}
+
+/* ========== Prepared Statements ========== */
+
+/*
+ * Prepare a statement
+ */
+int executor_prepare(struct sql_executor *exec, const char *sql, struct sql_prepared **stmt_out) {
+    struct sql_lexer lexer;
+    struct sql_parser parser;
+    struct sql_prepared *ps;
+    struct sql_value *value;
+    uint32_t count;
+    uint32_t i;
+
+    exec->has_error = 0;
+    exec->error_msg[0] = '\0';
+    *stmt_out = NULL;
+
+    ps = (struct sql_prepared *)malloc(sizeof(struct sql_prepared));
+    if (ps == NULL) {
+        set_error(exec, "Out of memory for prepared statement");
+        return -1;
+    }
+    memset(ps, 0, sizeof(struct sql_prepared));
+    ps->exec = exec;
+    row_init(&ps->row);
+
+    lexer_init(&lexer, sql);
+    parser_init(&parser, &lexer);
+    if (parser_parse_statement(&parser, &ps->stmt) != 0) {
+        set_error(exec, parser_get_error(&parser));
+        free(ps);
+        return -1;
+    }
+
+    /* Room for the schemas of a SELECT's tables, or an INSERT's table */
+    if (ps->stmt.type == STMT_SELECT || ps->stmt.type == STMT_INSERT) {
+        count = (ps->stmt.type == STMT_SELECT) ? 1 + ps->stmt.stmt.select.join_count : 1;
+        ps->schemas = (struct table_schema *)malloc(count * sizeof(struct table_schema));
+        if (ps->schemas == NULL) {
+            set_error(exec, "Out of memory for prepared statement");
+            free(ps);
+            return -1;
+        }
+    }
+
+    /* Find the placeholders: INSERT values, or WHERE values */
+    if (ps->stmt.type == STMT_INSERT) {
+        count = ps->stmt.stmt.insert.value_count;
+    } else {
+        count = (ps->stmt.type == STMT_SELECT) ? ps->stmt.stmt.select.where.condition_count : 0;
+    }
+    for (i = 0; i < count; i++) {
+        if (ps->stmt.type == STMT_INSERT) {
+            value = &ps->stmt.stmt.insert.values[i];
+        } else {
+            value = &ps->stmt.stmt.select.where.conditions[i].value;
+        }
+        if (value->type == SQL_VALUE_PARAM) {
+            ps->params[value->int_value - 1] = value;
+        }
+    }
+
+    *stmt_out = ps;
     return 0;
 }
 
+/*
+ * Find the value a parameter is bound into
+ */
+static struct sql_value *bind_target(struct sql_prepared *ps, uint32_t index) {
+    if (index < 1 || index > ps->stmt.param_count) {
+        snprintf(ps->exec->error_msg, sizeof(ps->exec->error_msg),
+                 "Parameter %u out of range", index);
+        ps->exec->has_error = 1;
+        return NULL;
+    }
+    if (ps->state == PREPARED_RUNNING) {
+        set_error(ps->exec, "Statement is running (reset it first)");
+        return NULL;
+    }
+    ps->bound |= 1UL << (index - 1);
+    return ps->params[index - 1];
+}
+
+/*
+ * Bind parameters
+ */
+int prepared_bind_int(struct sql_prepared *ps, uint32_t index, int32_t value) {
+    struct sql_value *target = bind_target(ps, index);
+
+    if (target == NULL) {
+        return (ps->state == PREPARED_RUNNING) ? AMIDB_BUSY : AMIDB_ERROR;
+    }
+    target->type = SQL_VALUE_INTEGER;
+    target->int_value = value;
+    return AMIDB_OK;
+}
+
+int prepared_bind_text(struct sql_prepared *ps, uint32_t index, const char *text) {
+    struct sql_value *target = bind_target(ps, index);
+
+    if (target == NULL) {
+        return (ps->state == PREPARED_RUNNING) ? AMIDB_BUSY : AMIDB_ERROR;
+    }
+    target->type = SQL_VALUE_TEXT;
+    strncpy(target->text_value, text, sizeof(target->text_value) - 1);
+    target->text_value[sizeof(target->text_value) - 1] = '\0';
+    return AMIDB_OK;
+}
+
+int prepared_bind_null(struct sql_prepared *ps, uint32_t index) {
+    struct sql_value *target = bind_target(ps, index);
+
+    if (target == NULL) {
+        return (ps->state == PREPARED_RUNNING) ? AMIDB_BUSY : AMIDB_ERROR;
+    }
+    target->type = SQL_VALUE_NULL;
+    return AMIDB_OK;
+}
+
+/*
+ * Read the tables' schemas again if the catalog changed since they were
+ * read (a plan built on the old ones is dropped)
+ */
+static int prepared_refresh(struct sql_prepared *ps) {
+    struct sql_executor *exec = ps->exec;
+    const char *table_name = ps->stmt.stmt.insert.table_name;
+
+    if (ps->generation == exec->catalog->generation) {
+        return 0;
+    }
+    if (ps->planned) {
+        plan_close(&ps->plan);
+        ps->planned = 0;
+    }
+    if (ps->stmt.type == STMT_SELECT) {
+        if (load_schemas(exec, &ps->stmt.stmt.select, ps->schemas) != 0) {
+            ps->generation = 0;
+            return -1;
+        }
+    } else if (catalog_get_table(exec->catalog, table_name, &ps->schemas[0]) != 0) {
+        snprintf(exec->error_msg, sizeof(exec->error_msg),
+                 "Table '%s' does not exist", table_name);
+        exec->has_error = 1;
+        ps->generation = 0;
+        return -1;
+    }
+    ps->generation = exec->catalog->generation;
+    return 0;
+}
+
+/*
+ * Run a SELECT: build its plan if needed and open it
+ */
+static int prepared_open(struct sql_prepared *ps) {
+    struct sql_executor *exec = ps->exec;
+
+    if (prepared_refresh(ps) != 0) {
+        return -1;
+    }
+    if (!ps->planned) {
+        if (plan_build(&ps->plan, exec->pager, exec->cache, ps->schemas,
+                       &ps->stmt.stmt.select) != 0) {
+            set_error(exec, ps->plan.error_msg);
+            plan_close(&ps->plan);
+            return -1;
+        }
+        ps->planned = 1;
+    }
+    if (exec->sort_memory) {
+        ps->plan.sort_memory = exec->sort_memory;
+    }
+    if (exec->join_memory) {
+        ps->plan.join_memory = exec->join_memory;
+    }
+    ps->explained = 0;
+    if (!ps->stmt.stmt.select.explain && plan_open(&ps->plan) != 0) {
+        set_error(exec, ps->plan.error_msg);
+        plan_rewind(&ps->plan);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Run a prepared statement, or get its next row
+ */
+int prepared_step(struct sql_prepared *ps, const struct amidb_row **row_out) {
+    struct sql_executor *exec = ps->exec;
+    uint32_t i;
+    int rc;
+
+    exec->has_error = 0;
+    exec->error_msg[0] = '\0';
+
+    if (ps->state == PREPARED_DONE) {
+        return AMIDB_DONE;
+    }
+
+    if (ps->state == PREPARED_READY) {
+        for (i = 0; i < ps->stmt.param_count; i++) {
+            if (!(ps->bound & (1UL << i))) {
+                snprintf(exec->error_msg, sizeof(exec->error_msg),
+                         "Parameter %u is not bound", i + 1);
+                exec->has_error = 1;
+                return AMIDB_ERROR;
+            }
+        }
+
+        if (ps->stmt.type != STMT_SELECT) {
+            if (!query_survives(exec, ps->stmt.type)) {
+                executor_finish(exec);
+            }
+            if (ps->stmt.type != STMT_INSERT) {
+                rc = executor_execute(exec, &ps->stmt);
+            } else if (prepared_refresh(ps) != 0) {
+                rc = -1;
+            } else {
+                rc = executor_write(exec, &ps->stmt, &ps->schemas[0]);
+                /* The catalog changed only by this insert: schema is current */
+                /* (after a failure it may not be, so read it again) */
+                ps->generation = (rc == 0) ? exec->catalog->generation : 0;
+            }
+            if (rc != 0) {
+                return AMIDB_ERROR;
+            }
+            ps->state = PREPARED_DONE;
+            return AMIDB_DONE;
+        }
+
+        if (prepared_open(ps) != 0) {
+            return AMIDB_ERROR;
+        }
+        ps->state = PREPARED_RUNNING;
+    }
+
+    row_clear(&ps->row);
+    if (ps->stmt.stmt.select.explain) {
+        rc = plan_explain(&ps->plan, ps->explained++, &ps->row);
+    } else {
+        rc = plan_next(&ps->plan, &ps->row);
+    }
+    if (rc == AMIDB_ROW) {
+        *row_out = &ps->row;
+        return AMIDB_ROW;
+    }
+    if (rc != AMIDB_DONE) {
+        set_error(exec, ps->plan.error_msg);
+    }
+    plan_rewind(&ps->plan);
+    ps->state = PREPARED_DONE;
+    return rc;
+}
+
+/*
+ * Make a prepared statement ready to run again
+ */
+void prepared_reset(struct sql_prepared *ps) {
+    if (ps->state == PREPARED_RUNNING) {
+        plan_rewind(&ps->plan);
+    }
+    row_clear(&ps->row);
+    ps->state = PREPARED_READY;
+}
+
+/*
+ * Free a prepared statement
+ */
+void prepared_finalize(struct sql_prepared *ps) {
+    if (ps == NULL) {
+        return;
+    }
+    prepared_reset(ps);
+    if (ps->planned) {
+        plan_close(&ps->plan);
+    }
+    free(ps->schemas);
+    free(ps);
+}
+
 /* ========== Helper Functions ========== */
 
+/*
+ * Read the schemas of a SELECT's tables: the FROM table's, then one for
+ * each INNER JOIN table (1 + join_count of them)
+ *
+ * Returns: 0 on success, -1 on error
+ */
+static int load_schemas(struct sql_executor *exec, const struct sql_select *select,
+                        struct table_schema *schemas) {
+    const char *name;
+    uint32_t i;
+
+    for (i = 0; i <= select->join_count; i++) {
+        name = (i == 0) ? select->table_name : select->joins[i - 1].table_name;
+        if (catalog_get_table(exec->catalog, name, &schemas[i]) != 0) {
+            snprintf(exec->error_msg, sizeof(exec->error_msg),
+                     "Table '%s' does not exist", name);
+            exec->has_error = 1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Execute INSERT / UPDATE / DELETE
+ *
+ * With change capture or log shipping on, a statement outside BEGIN ...
+ * COMMIT runs in a transaction of its own, so its changes reach the WAL.
+ * Under shadow paging it does too: only a transaction copies pages
+ * instead of overwriting them. So does one while a streaming query is
+ * open on a snapshot, which only isolates it from transactions.
+ *
+ * An INSERT uses schema if given (a prepared statement's), else reads it.
+ */
+static int executor_write(struct sql_executor *exec, const struct sql_statement *stmt,
+                          struct table_schema *schema) {
+    int implicit = 0;
+    int rc;
+
+    if (exec->txn && (exec->txn->wal->cdc_handle || exec->txn->wal->ship_handle ||
+                      exec->txn->commit_mode == TXN_COMMIT_SHADOW ||
+                      (exec->query && exec->query->snapshot)) &&
+        !active_txn(exec)) {
+        if (txn_begin(exec->txn) != 0) {
+            set_error(exec, "Failed to begin transaction");
+            return -1;
+        }
+        exec->catalog->txn = exec->txn;
+        implicit = 1;
+    }
+
+    switch (stmt->type) {
+        case STMT_INSERT:
+            if (schema) {
+                rc = insert_row(exec, schema, &stmt->stmt.insert);
+            } else {
+                rc = executor_insert(exec, &stmt->stmt.insert);
+            }
+            break;
+        case STMT_UPDATE:
+            rc = executor_update(exec, &stmt->stmt.update);
+            break;
+        default:
+            rc = executor_delete(exec, &stmt->stmt.delete);
+            break;
+    }
+
+    if (implicit) {
+        if (rc != 0) {
+            txn_abort(exec->txn);
+            catalog_invalidate(exec->catalog);
+        } else if (txn_commit(exec->txn) != 0) {
+            set_error(exec, "Failed to commit transaction");
+            rc = -1;
+        }
+    }
+
+    return rc;
+}
+
+/*
+ * Execute BEGIN / COMMIT / ROLLBACK [TO] / SAVEPOINT / RELEASE
+ */
+static int executor_transaction(struct sql_executor *exec, const struct sql_statement *stmt) {
+    const char *name = stmt->stmt.transaction.savepoint_name;
+    int rc;
+
+    if (!exec->txn) {
+        set_error(exec, "Transactions not available");
+        return -1;
+    }
+
+    if (stmt->type == STMT_BEGIN) {
+        if (active_txn(exec)) {
+            set_error(exec, "Transaction already active");
+            return -1;
+        }
+        if (txn_begin(exec->txn) != 0) {
+            set_error(exec, "Failed to begin transaction");
+            return -1;
+        }
+        exec->catalog->txn = exec->txn;
+        return 0;
+    }
+
+    if (!active_txn(exec)) {
+        set_error(exec, "No active transaction");
+        return -1;
+    }
+
+    switch (stmt->type) {
+        case STMT_COMMIT:
+            rc = txn_commit(exec->txn);
+            break;
+
+        case STMT_ROLLBACK:
+            if (name[0] == '\0') {
+                rc = txn_abort(exec->txn);
+            } else {
+                rc = txn_rollback_to_savepoint(exec->txn, name);
+            }
+            catalog_invalidate(exec->catalog);
+            break;
+
+        case STMT_SAVEPOINT:
+            rc = txn_savepoint(exec->txn, name);
+            if (rc == AMIDB_FULL) {
+                set_error(exec, "Too many nested savepoints");
+                return -1;
+            }
+            break;
+
+        case STMT_RELEASE:
+            rc = txn_release_savepoint(exec->txn, name);
+            break;
+
+        default:
+            rc = -1;
+            break;
+    }
+
+    if (rc == AMIDB_NOTFOUND) {
+        snprintf(exec->error_msg, sizeof(exec->error_msg),
+                 "No such savepoint '%s'", name);
+        exec->has_error = 1;
+        return -1;
+    }
+    if (rc != 0) {
+        set_error(exec, "Transaction operation failed");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Active transaction, or NULL (outside BEGIN ... COMMIT every
+ * statement writes straight through the cache as before)
+ */
+static struct txn_context *active_txn(struct sql_executor *exec) {
+    if (exec->txn && exec->txn->state == TXN_STATE_ACTIVE) {
+        return exec->txn;
+    }
+    return NULL;
+}
+
+/*
+ * Save a row page's before-image (must precede the write)
+ *
+ * Returns: 0 on success, -1 if rollback could not restore the page
+ */
+static int save_row_page(struct sql_executor *exec, uint32_t page_num, const uint8_t *data) {
+    struct txn_context *txn = active_txn(exec);
+    int rc;
+
+    if (!txn) {
+        return 0;
+    }
+
+    rc = txn_save_before_image(txn, page_num, data);
+    if (rc == AMIDB_FULL && !txn_is_page_dirty(txn, page_num)) {
+        rc = AMIDB_OK;  /* Undo buffer full: abort rereads it from disk */
+    }
+    if (rc != AMIDB_OK) {
+        set_error(exec, (rc == AMIDB_NOMEM) ? "Out of memory for rollback" :
+                        "Failed to save row page for rollback");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Mark a row page dirty and track it in the active transaction
+ *
+ * Returns: 0 on success, -1 if the transaction could not track it
+ */
+static int mark_row_page_dirty(struct sql_executor *exec, uint32_t page_num) {
+    struct txn_context *txn = active_txn(exec);
+    struct cache_entry *entry;
+
+    cache_mark_dirty(exec->cache, page_num);
+
+    if (txn) {
+        if (txn_add_dirty_page(txn, page_num) != AMIDB_OK) {
+            set_error(exec, "Out of memory for transaction");
+            return -1;
+        }
+        entry = cache_find_entry(exec->cache, page_num);
+        if (entry) {
+            entry->txn_id = txn->txn_id;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Write a serialized row into its pinned page, covered by the active
+ * transaction
+ *
+ * Returns: 0 on success, -1 on error (page left unchanged if the
+ *          before-image could not be saved)
+ */
+static int write_row_page(struct sql_executor *exec, uint32_t page_num, uint8_t *data,
+                          const uint8_t *row_buffer, int row_size) {
+    if (save_row_page(exec, page_num, data) != 0) {
+        return -1;
+    }
+    memcpy(data + AMIDB_PAGE_HEADER_SIZE, row_buffer, row_size);
+    return mark_row_page_dirty(exec, page_num);
+}
+
+/*
+ * Make a row page writable before it is changed in place
+ *
+ * A shadow-paging transaction copies it first and points the table's
+ * B+Tree entry at the copy; *page_num and *page_data (pinned) follow.
+ */
+static int own_row_page(struct sql_executor *exec, struct btree *tree, int32_t key,
+                        uint32_t *page_num, uint8_t **page_data) {
+    struct txn_context *txn = active_txn(exec);
+    uint32_t copy;
+
+    if (!txn || !txn->shadow) {
+        return 0;
+    }
+
+    if (txn_shadow_page(txn, *page_num, &copy) != 0) {
+        return -1;
+    }
+    if (copy == *page_num) {
+        return 0;
+    }
+
+    if (btree_insert(tree, key, copy) != 0 ||
+        cache_get_page(exec->cache, copy, page_data) != 0) {
+        return -1;
+    }
+    cache_unpin(exec->cache, *page_num);
+    *page_num = copy;
+
+    return 0;
+}
+
+/*
+ * Log a row change for change capture (no-op unless it is enabled)
+ */
+static int log_row_change(struct sql_executor *exec, uint8_t op, const char *table,
+                          int32_t key, const uint8_t *row, int row_size) {
+    struct txn_context *txn = active_txn(exec);
+
+    if (txn && txn_log_row(txn, op, table, key, row, (uint32_t)row_size) != 0) {
+        set_error(exec, "Failed to log row change");
+        return -1;
+    }
+    return 0;
+}
+
 /*
  * Set executor error message
  */
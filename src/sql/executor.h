@@ -14,11 +14,15 @@
 #include "storage/cache.h"
 #include "storage/row.h"
 #include "txn/txn.h"
+#include "api/error.h"
 #include <stdint.h>
 
-/* Maximum rows to buffer for SELECT results (REPL only) */
+/* Maximum rows executor_execute keeps of a SELECT (see executor_query) */
 #define MAX_RESULT_ROWS 100
 
+struct sql_query;
+struct sql_prepared;
+
 /* Executor context */
 struct sql_executor {
     struct amidb_pager *pager;
@@ -28,9 +32,14 @@ struct sql_executor {
     char error_msg[256];            /* Last error message */
     uint8_t has_error;              /* 1 if error occurred */
 
-    /* SELECT result storage (for REPL display) */
-    struct amidb_row result_rows[MAX_RESULT_ROWS];
+    /* SELECT result set of executor_execute (allocated on first use) */
+    struct amidb_row *result_rows;  /* MAX_RESULT_ROWS rows */
     uint32_t result_count;          /* Number of rows in result set */
+    uint8_t result_truncated;       /* 1 if rows past MAX_RESULT_ROWS were dropped */
+
+    struct sql_query *query;        /* Open streaming query (NULL if none) */
+    uint32_t sort_memory;           /* ORDER BY budget in bytes (0: PLAN_SORT_MEMORY) */
+    uint32_t join_memory;           /* Hash join budget in bytes (0: PLAN_HASH_MEMORY) */
 };
 
 /* Executor API */
@@ -70,6 +79,14 @@ int executor_create_table(struct sql_executor *exec, const struct sql_create_tab
  */
 int executor_drop_table(struct sql_executor *exec, const struct sql_drop_table *drop_stmt);
 
+/*
+ * Execute ANALYZE statement
+ *
+ * Reads every row of the table (every table if none is named) and
+ * saves column statistics for the planner (see sql/stats.h).
+ */
+int executor_analyze(struct sql_executor *exec, const struct sql_analyze *analyze_stmt);
+
 /*
  * Execute INSERT statement
  * Week 5: To be implemented
@@ -78,10 +95,119 @@ int executor_insert(struct sql_executor *exec, const struct sql_insert *insert_s
 
 /*
  * Execute SELECT statement
- * Week 6: To be implemented
+ *
+ * Keeps the first MAX_RESULT_ROWS rows in result_rows; use
+ * executor_query for larger results. EXPLAIN SELECT returns a row per
+ * operator of the plan instead (see plan_explain) and reads no rows.
  */
 int executor_select(struct sql_executor *exec, const struct sql_select *select_stmt);
 
+/*
+ * Streaming SELECT
+ *
+ * executor_query starts a SELECT and each executor_step returns its next
+ * row, read from the table as it is asked for (sorted queries read all
+ * their rows when started), so a result of any size takes constant
+ * memory. The statement is copied; it need not outlive the call.
+ *
+ * One query is open per executor: executor_query finishes the open one
+ * first. With a transaction context, a query started outside BEGIN reads
+ * a snapshot taken when it started, so INSERT, UPDATE, DELETE and
+ * transaction control may run while it is open (a later BEGIN and the
+ * writes inside it included) without changing what it returns. Other
+ * statements (CREATE, DROP, ANALYZE, ...) finish it first. A query
+ * started inside BEGIN reads the transaction's own writes, so any
+ * statement finishes it.
+ */
+
+/*
+ * Start a SELECT
+ *
+ * Returns: 0 on success, -1 on error (unknown table or column)
+ */
+int executor_query(struct sql_executor *exec, const struct sql_select *select_stmt);
+
+/*
+ * Get the next row of the open query
+ *
+ * *row_out stays valid until the next executor_step or executor_finish.
+ *
+ * Returns: AMIDB_ROW, AMIDB_DONE, AMIDB_BUSY if commits made since the
+ *          query started outgrew the version budget (run it again), or
+ *          AMIDB_ERROR (see executor_get_error)
+ */
+int executor_step(struct sql_executor *exec, const struct amidb_row **row_out);
+
+/*
+ * Finish the open query (if any) and free what it holds
+ */
+void executor_finish(struct sql_executor *exec);
+
+/*
+ * Prepared statements
+ *
+ * executor_prepare parses a statement once; ? marks a value (in VALUES
+ * or WHERE) bound before each run, numbered from 1 left to right. A
+ * prepared SELECT or INSERT also keeps the table's schema, and a SELECT
+ * its plan (columns resolved, scan or seek chosen), so running it again
+ * only binds values and runs the plan. Both are read again only when
+ * the catalog changes (CREATE, DROP, a write through another statement,
+ * a rollback).
+ *
+ *   executor_prepare(exec, "INSERT INTO t VALUES (?, ?)", &ps);
+ *   for (...) {
+ *       prepared_bind_int(ps, 1, id);
+ *       prepared_bind_text(ps, 2, name);
+ *       prepared_step(ps, &row);           (AMIDB_DONE)
+ *       prepared_reset(ps);
+ *   }
+ *   prepared_finalize(ps);
+ *
+ * Bindings are kept across prepared_reset. A running SELECT has the
+ * same rules as executor_query: reset it before changing its table.
+ */
+
+/*
+ * Prepare a statement
+ *
+ * Returns: 0 on success (*stmt_out set), -1 on a parse error
+ */
+int executor_prepare(struct sql_executor *exec, const char *sql, struct sql_prepared **stmt_out);
+
+/*
+ * Bind a value to parameter index (1-based)
+ *
+ * Returns: AMIDB_OK, AMIDB_ERROR (no such parameter), or AMIDB_BUSY
+ * (SELECT running: reset it first)
+ */
+int prepared_bind_int(struct sql_prepared *stmt, uint32_t index, int32_t value);
+int prepared_bind_text(struct sql_prepared *stmt, uint32_t index, const char *text);
+int prepared_bind_null(struct sql_prepared *stmt, uint32_t index);
+
+/*
+ * Run the statement (first call) or get its next row
+ *
+ * A SELECT returns its rows one per call; other statements run on the
+ * first call. After AMIDB_DONE the statement does nothing more until
+ * prepared_reset. *row_out stays valid until the next step or reset.
+ *
+ * Returns: AMIDB_ROW, AMIDB_DONE, or AMIDB_ERROR (see executor_get_error;
+ * also if a parameter is not bound)
+ */
+int prepared_step(struct sql_prepared *stmt, const struct amidb_row **row_out);
+
+/*
+ * Make the statement ready to run again (bindings are kept)
+ */
+void prepared_reset(struct sql_prepared *stmt);
+
+/*
+ * Free a prepared statement (NULL is ignored)
+ *
+ * Must be called before the executor is closed.
+ */
+void prepared_finalize(struct sql_prepared *stmt);
+
 /*
  * Execute UPDATE statement
  * Week 8: To be implemented
@@ -0,0 +1,615 @@
+/*
+ * hashjoin.c - Grace hash join for INNER JOIN
+ */
+
+#include "sql/hashjoin.h"
+#include "api/error.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Record (in memory and in partitions):
+ *   [0..3] next record of its chain (an offset in memory)  [4..7] hash
+ *   of the key  [8..9] size  [10..11] key offset  [12..13] key size
+ *   then the record's bytes
+ * Chunk, a stretch of one side of a partition in the temporary file:
+ *   [0..3] the side's chunk before it  [4..7] bytes of records
+ *   then the records
+ * Fields are copied with memcpy: records are not aligned.
+ */
+
+/* No record or chunk */
+#define HASHER_NONE     0xFFFFFFFFUL
+
+#define CHUNK_HEADER    8
+
+/* Sides of a partition */
+#define SIDE_BUILD      0
+#define SIDE_PROBE      1
+
+/* One side of a partition: its chunks, each pointing at the one before */
+struct hasher_side {
+    uint32_t last;                  /* Last chunk written (HASHER_NONE: none) */
+    uint32_t count;                 /* Records */
+};
+
+struct hasher_partition {
+    struct hasher_side sides[2];
+    uint32_t used;                  /* Record bytes in its buffer */
+};
+
+/* Numbers the temporary files of joins open at the same time */
+static uint32_t hasher_file_number = 0;
+
+/* ========== Records ========== */
+
+static uint32_t read_u32(const uint8_t *p) {
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint32_t read_u16(const uint8_t *p) {
+    uint16_t v;
+
+    memcpy(&v, p, 2);
+    return v;
+}
+
+static void write_u32(uint8_t *p, uint32_t v) {
+    memcpy(p, &v, 4);
+}
+
+static void write_u16(uint8_t *p, uint32_t v) {
+    uint16_t v16 = (uint16_t)v;
+
+    memcpy(p, &v16, 2);
+}
+
+static uint32_t record_size(const uint8_t *rec) {
+    return HASHER_RECORD_HEADER + read_u16(rec + 8);
+}
+
+static void put_header(uint8_t *rec, uint32_t hash, uint32_t size,
+                       uint32_t key_offset, uint32_t key_size) {
+    write_u32(rec, HASHER_NONE);
+    write_u32(rec + 4, hash);
+    write_u16(rec + 8, size);
+    write_u16(rec + 10, key_offset);
+    write_u16(rec + 12, key_size);
+}
+
+/* FNV-1a: every byte moves every bit (INTEGER keys differ in few bytes) */
+static uint32_t hash_key(const uint8_t *key, uint32_t size) {
+    uint32_t hash = 2166136261UL;
+    uint32_t i;
+
+    for (i = 0; i < size; i++) {
+        hash ^= key[i];
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+/* Largest record, header included (a quarter of the budget) */
+static uint32_t record_limit(const struct sql_hasher *hasher) {
+    return hasher->memory_size / 4 - CHUNK_HEADER;
+}
+
+/* ========== Hash Table ========== */
+
+/* End of the records: the buckets start there */
+static uint32_t records_end(const struct sql_hasher *hasher) {
+    return hasher->memory_size - hasher->bucket_count * (uint32_t)sizeof(uint32_t);
+}
+
+/*
+ * Empty the table, with a bucket for each of rows records (at most a
+ * quarter of the room left)
+ */
+static void reset_table(struct sql_hasher *hasher, uint32_t rows) {
+    uint32_t room = hasher->memory_size - hasher->start;
+    uint32_t count = 16;
+
+    while (count < rows && count * 2 * sizeof(uint32_t) <= room / 4) {
+        count *= 2;
+    }
+    hasher->bucket_count = count;
+    hasher->buckets = (uint32_t *)(hasher->memory + records_end(hasher));
+    memset(hasher->buckets, 0xFF, count * sizeof(uint32_t));
+    hasher->used = hasher->start;
+}
+
+/* Put the record at offset at the head of its chain */
+static void link_record(struct sql_hasher *hasher, uint32_t offset) {
+    uint8_t *rec = hasher->memory + offset;
+    uint32_t *bucket = &hasher->buckets[read_u32(rec + 4) & (hasher->bucket_count - 1)];
+
+    write_u32(rec, *bucket);
+    *bucket = offset;
+}
+
+/* Make a record the one probed (its header in front of it) */
+static void set_probe(struct sql_hasher *hasher, const uint8_t *rec) {
+    hasher->probe = rec + HASHER_RECORD_HEADER;
+    hasher->probe_size = read_u16(rec + 8);
+    hasher->probe_hash = read_u32(rec + 4);
+    hasher->probe_key = hasher->probe + read_u16(rec + 10);
+    hasher->probe_key_size = read_u16(rec + 12);
+    hasher->match = hasher->buckets[hasher->probe_hash & (hasher->bucket_count - 1)];
+}
+
+/* ========== Partitions ========== */
+
+/* Partitions for a build side of bytes (whether or not it fits) */
+static uint32_t partition_count(uint32_t memory, uint32_t bytes) {
+    uint32_t most = memory / (2 * HASHER_BUFFER);
+    uint32_t count = bytes / (memory / 2) + 1;
+
+    if (most > HASHER_MAX_PARTITIONS) {
+        most = HASHER_MAX_PARTITIONS;
+    }
+    if (count > most) {
+        count = most;
+    }
+    return (count < HASHER_MIN_PARTITIONS) ? HASHER_MIN_PARTITIONS : count;
+}
+
+/* Append to the temporary file (created on the first write) */
+static int append(struct sql_hasher *hasher, const uint8_t *data, uint32_t size) {
+    if (hasher->file == NULL) {
+        hasher->file = file_open(hasher->path, AMIDB_O_RDWR | AMIDB_O_CREATE | AMIDB_O_TRUNC);
+        if (hasher->file == NULL) {
+            return AMIDB_IOERR;
+        }
+        hasher->file_end = 0;
+    }
+    if (file_seek(hasher->file, (int32_t)hasher->file_end, AMIDB_SEEK_SET) < 0 ||
+        file_write(hasher->file, data, size) != (int32_t)size) {
+        return AMIDB_IOERR;
+    }
+    hasher->file_end += size;
+    return AMIDB_OK;
+}
+
+/* Start a chunk of a side: its header, chained to the side's last */
+static void chunk_begin(struct sql_hasher *hasher, struct hasher_side *side,
+                        uint8_t *chunk, uint32_t length) {
+    write_u32(chunk, side->last);
+    write_u32(chunk + 4, length);
+    side->last = hasher->file_end;
+    if (CHUNK_HEADER + length > hasher->largest_chunk) {
+        hasher->largest_chunk = CHUNK_HEADER + length;
+    }
+}
+
+/* Write a partition's buffer out as a chunk of the side being added */
+static int flush_partition(struct sql_hasher *hasher, uint32_t p) {
+    struct hasher_partition *part = &hasher->partitions[p];
+    uint8_t *buf = hasher->memory + p * HASHER_BUFFER;
+    uint32_t length = part->used;
+
+    if (length == 0) {
+        return AMIDB_OK;
+    }
+    part->used = 0;
+    chunk_begin(hasher, &part->sides[hasher->probing], buf, length);
+    return append(hasher, buf, CHUNK_HEADER + length);
+}
+
+/*
+ * Add a record to its partition, on the side being added (through the
+ * partition's buffer, or in a chunk of its own if it is larger)
+ */
+static int partition_put(struct sql_hasher *hasher, const uint8_t *header,
+                         const uint8_t *bytes, uint32_t size) {
+    uint32_t p = (read_u32(header + 4) >> 16) % hasher->partition_count;
+    struct hasher_partition *part = &hasher->partitions[p];
+    uint8_t *buf = hasher->memory + p * HASHER_BUFFER + CHUNK_HEADER;
+    uint32_t total = HASHER_RECORD_HEADER + size;
+    uint8_t chunk[CHUNK_HEADER];
+    int rc;
+
+    part->sides[hasher->probing].count++;
+    if (CHUNK_HEADER + part->used + total > HASHER_BUFFER) {
+        rc = flush_partition(hasher, p);
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+    }
+    if (CHUNK_HEADER + total <= HASHER_BUFFER) {
+        memcpy(buf + part->used, header, HASHER_RECORD_HEADER);
+        memcpy(buf + part->used + HASHER_RECORD_HEADER, bytes, size);
+        part->used += total;
+        return AMIDB_OK;
+    }
+
+    chunk_begin(hasher, &part->sides[hasher->probing], chunk, total);
+    if (append(hasher, chunk, CHUNK_HEADER) != AMIDB_OK ||
+        append(hasher, header, HASHER_RECORD_HEADER) != AMIDB_OK ||
+        append(hasher, bytes, size) != AMIDB_OK) {
+        return AMIDB_IOERR;
+    }
+    return AMIDB_OK;
+}
+
+/* Move the build records in memory out to their partitions */
+static int spill(struct sql_hasher *hasher) {
+    uint32_t pos = hasher->start;
+    uint8_t *rec;
+    int rc;
+
+    hasher->spilled = 1;
+    while (pos < hasher->used) {
+        rec = hasher->memory + pos;
+        pos += record_size(rec);
+        rc = partition_put(hasher, rec, rec + HASHER_RECORD_HEADER, read_u16(rec + 8));
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+    }
+    hasher->used = hasher->start;
+    return AMIDB_OK;
+}
+
+/* Flush the partitions of the side being added */
+static int flush_all(struct sql_hasher *hasher) {
+    uint32_t p;
+    int rc;
+
+    for (p = 0; p < hasher->partition_count; p++) {
+        rc = flush_partition(hasher, p);
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+    }
+    return AMIDB_OK;
+}
+
+/* ========== Joining the Partitions ========== */
+
+/*
+ * Read a chunk's header and records (into dest, at most room bytes)
+ *
+ * Returns: AMIDB_OK, AMIDB_FULL (not room for it), or AMIDB_IOERR
+ */
+static int read_chunk(struct sql_hasher *hasher, uint32_t offset, uint8_t *dest,
+                      uint32_t room, uint32_t *previous, uint32_t *length) {
+    uint8_t chunk[CHUNK_HEADER];
+
+    if (file_seek(hasher->file, (int32_t)offset, AMIDB_SEEK_SET) < 0 ||
+        file_read(hasher->file, chunk, CHUNK_HEADER) != CHUNK_HEADER) {
+        return AMIDB_IOERR;
+    }
+    *previous = read_u32(chunk);
+    *length = read_u32(chunk + 4);
+    if (*length > room) {
+        return AMIDB_FULL;
+    }
+    if (file_read(hasher->file, dest, *length) != (int32_t)*length) {
+        return AMIDB_IOERR;
+    }
+    return AMIDB_OK;
+}
+
+/* First chunk to load of a partition (none if no record probes it) */
+static uint32_t first_build(const struct sql_hasher *hasher, uint32_t p) {
+    const struct hasher_partition *part = &hasher->partitions[p];
+
+    return (part->sides[SIDE_PROBE].count > 0) ? part->sides[SIDE_BUILD].last : HASHER_NONE;
+}
+
+/*
+ * Load the next piece of the current partition's build side: as many
+ * of its chunks as fit
+ *
+ * Returns: AMIDB_OK, AMIDB_FULL, AMIDB_IOERR, or AMIDB_CORRUPT
+ */
+static int load_piece(struct sql_hasher *hasher) {
+    const struct hasher_side *side = &hasher->partitions[hasher->current].sides[SIDE_BUILD];
+    uint32_t previous;
+    uint32_t length;
+    uint32_t pos;
+    uint32_t end;
+    int rc;
+
+    reset_table(hasher, side->count);
+    hasher->loads++;
+
+    while (hasher->next_build != HASHER_NONE) {
+        rc = read_chunk(hasher, hasher->next_build, hasher->memory + hasher->used,
+                        records_end(hasher) - hasher->used, &previous, &length);
+        if (rc == AMIDB_FULL && hasher->used > hasher->start) {
+            break;                  /* The rest is the next piece */
+        }
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+
+        pos = hasher->used;
+        end = pos + length;
+        while (pos < end) {
+            if (pos + HASHER_RECORD_HEADER > end ||
+                pos + record_size(hasher->memory + pos) > end) {
+                return AMIDB_CORRUPT;
+            }
+            link_record(hasher, pos);
+            pos += record_size(hasher->memory + pos);
+        }
+        hasher->used = end;
+        hasher->next_build = previous;
+    }
+    return AMIDB_OK;
+}
+
+/* ========== Hasher ========== */
+
+/*
+ * Partitions a build side of bytes would be cut into
+ */
+uint32_t hasher_partitions(uint32_t memory, uint32_t bytes) {
+    uint32_t room;
+
+    if (memory < HASHER_MIN_MEMORY) {
+        memory = HASHER_MIN_MEMORY;
+    }
+    memory &= ~(uint32_t)3;
+
+    /* A quarter of the records' room is kept for buckets */
+    room = memory - partition_count(memory, bytes) * HASHER_BUFFER;
+    return (bytes <= room - room / 4) ? 0 : partition_count(memory, bytes);
+}
+
+/*
+ * Start a join
+ */
+int hasher_init(struct sql_hasher *hasher, const char *base_path, uint32_t memory,
+                uint32_t rows, uint32_t bytes) {
+    uint32_t path_size;
+    uint32_t p;
+
+    memset(hasher, 0, sizeof(struct sql_hasher));
+    if (memory < HASHER_MIN_MEMORY) {
+        memory = HASHER_MIN_MEMORY;
+    }
+    hasher->memory_size = memory & ~(uint32_t)3;
+    hasher->partition_count = partition_count(hasher->memory_size, bytes);
+    hasher->start = hasher->partition_count * HASHER_BUFFER;
+    hasher->match = HASHER_NONE;
+
+    hasher->memory = (uint8_t *)malloc(hasher->memory_size);
+    hasher->partitions = (struct hasher_partition *)malloc(hasher->partition_count *
+                                                           sizeof(struct hasher_partition));
+
+    /* Named now (base_path need not outlive the call), created on the first spill */
+    path_size = (uint32_t)strlen(base_path) + 20;
+    hasher->path = (char *)malloc(path_size);
+    if (hasher->memory == NULL || hasher->partitions == NULL || hasher->path == NULL) {
+        hasher_close(hasher);
+        return AMIDB_NOMEM;
+    }
+    snprintf(hasher->path, path_size, "%s-hash%lu", base_path,
+             (unsigned long)hasher_file_number++);
+
+    for (p = 0; p < hasher->partition_count; p++) {
+        hasher->partitions[p].sides[SIDE_BUILD].last = HASHER_NONE;
+        hasher->partitions[p].sides[SIDE_BUILD].count = 0;
+        hasher->partitions[p].sides[SIDE_PROBE].last = HASHER_NONE;
+        hasher->partitions[p].sides[SIDE_PROBE].count = 0;
+        hasher->partitions[p].used = 0;
+    }
+
+    /* Too much for memory: partition from the start */
+    reset_table(hasher, rows);
+    hasher->spilled = (hasher_partitions(hasher->memory_size, bytes) > 0);
+    return AMIDB_OK;
+}
+
+/*
+ * Add a build record
+ */
+int hasher_build(struct sql_hasher *hasher, const uint8_t *record, uint32_t size,
+                 uint32_t key_offset, uint32_t key_size) {
+    uint32_t total = HASHER_RECORD_HEADER + size;
+    uint32_t hash = hash_key(record + key_offset, key_size);
+    uint8_t header[HASHER_RECORD_HEADER];
+    uint8_t *rec;
+    int rc;
+
+    if (total > record_limit(hasher)) {
+        return AMIDB_FULL;
+    }
+
+    if (!hasher->spilled) {
+        if (hasher->used + total <= records_end(hasher)) {
+            rec = hasher->memory + hasher->used;
+            put_header(rec, hash, size, key_offset, key_size);
+            memcpy(rec + HASHER_RECORD_HEADER, record, size);
+            link_record(hasher, hasher->used);
+            hasher->used += total;
+            return AMIDB_OK;
+        }
+        rc = spill(hasher);
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+    }
+
+    put_header(header, hash, size, key_offset, key_size);
+    return partition_put(hasher, header, record, size);
+}
+
+/*
+ * Probe with a record
+ */
+int hasher_probe(struct sql_hasher *hasher, const uint8_t *record, uint32_t size,
+                 uint32_t key_offset, uint32_t key_size) {
+    uint8_t header[HASHER_RECORD_HEADER];
+    int rc;
+
+    if (!hasher->probing) {
+        rc = hasher->spilled ? flush_all(hasher) : AMIDB_OK;
+        hasher->probing = 1;
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+    }
+    if (HASHER_RECORD_HEADER + size > record_limit(hasher)) {
+        return AMIDB_FULL;
+    }
+
+    put_header(header, hash_key(record + key_offset, key_size), size, key_offset, key_size);
+    if (hasher->spilled) {
+        hasher->probe = NULL;
+        hasher->match = HASHER_NONE;
+        return partition_put(hasher, header, record, size);
+    }
+
+    set_probe(hasher, header);
+    hasher->probe = record;
+    hasher->probe_key = record + key_offset;
+    return AMIDB_OK;
+}
+
+/*
+ * Get the next build record matching the record probed
+ */
+int hasher_match(struct sql_hasher *hasher, const uint8_t **record, uint32_t *size) {
+    const uint8_t *rec;
+
+    while (hasher->match != HASHER_NONE) {
+        rec = hasher->memory + hasher->match;
+        hasher->match = read_u32(rec);
+        if (read_u32(rec + 4) == hasher->probe_hash &&
+            read_u16(rec + 12) == hasher->probe_key_size &&
+            memcmp(rec + HASHER_RECORD_HEADER + read_u16(rec + 10), hasher->probe_key,
+                   hasher->probe_key_size) == 0) {
+            *record = rec + HASHER_RECORD_HEADER;
+            *size = read_u16(rec + 8);
+            return AMIDB_ROW;
+        }
+    }
+    return AMIDB_DONE;
+}
+
+/*
+ * End the probe side
+ */
+int hasher_finish(struct sql_hasher *hasher) {
+    int rc;
+
+    if (hasher->spilled) {
+        if (!hasher->probing) {
+            rc = flush_all(hasher);     /* Build side */
+            hasher->probing = 1;
+            if (rc != AMIDB_OK) {
+                return rc;
+            }
+        }
+        rc = flush_all(hasher);
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+        hasher->partitions_written = hasher->partition_count;
+
+        /* The buffers give way to the probe chunk being read */
+        hasher->start = (hasher->largest_chunk > HASHER_BUFFER) ? hasher->largest_chunk
+                                                                : HASHER_BUFFER;
+        hasher->start = (hasher->start + 3) & ~(uint32_t)3;
+        hasher->current = 0;
+        hasher->next_build = first_build(hasher, 0);
+        hasher->next_probe = HASHER_NONE;
+        hasher->chunk_pos = 0;
+        hasher->chunk_size = 0;
+    }
+    hasher->probing = 1;
+    hasher->probe = NULL;
+    hasher->match = HASHER_NONE;
+    return AMIDB_OK;
+}
+
+/*
+ * Get the next matching pair of the partitions
+ */
+int hasher_next(struct sql_hasher *hasher, const uint8_t **build, uint32_t *build_size,
+                const uint8_t **probe, uint32_t *probe_size) {
+    const uint8_t *rec;
+    uint32_t previous;
+    int rc;
+
+    if (!hasher->spilled) {
+        return AMIDB_DONE;
+    }
+
+    for (;;) {
+        /* Build records matching the probe record */
+        if (hasher->probe != NULL) {
+            if (hasher_match(hasher, build, build_size) == AMIDB_ROW) {
+                *probe = hasher->probe;
+                *probe_size = hasher->probe_size;
+                return AMIDB_ROW;
+            }
+            hasher->probe = NULL;
+        }
+
+        /* The next probe record of the chunk read */
+        if (hasher->chunk_pos < hasher->chunk_size) {
+            rec = hasher->memory + hasher->chunk_pos;
+            if (hasher->chunk_pos + HASHER_RECORD_HEADER > hasher->chunk_size ||
+                hasher->chunk_pos + record_size(rec) > hasher->chunk_size) {
+                return AMIDB_CORRUPT;
+            }
+            hasher->chunk_pos += record_size(rec);
+            set_probe(hasher, rec);
+            continue;
+        }
+
+        /* The next chunk of the probe side */
+        if (hasher->next_probe != HASHER_NONE) {
+            rc = read_chunk(hasher, hasher->next_probe, hasher->memory, hasher->start,
+                            &previous, &hasher->chunk_size);
+            if (rc != AMIDB_OK) {
+                return (rc == AMIDB_FULL) ? AMIDB_CORRUPT : rc;
+            }
+            hasher->next_probe = previous;
+            hasher->chunk_pos = 0;
+            continue;
+        }
+
+        /* The next piece of the build side, else the next partition */
+        while (hasher->next_build == HASHER_NONE) {
+            if (hasher->current >= hasher->partition_count ||
+                ++hasher->current >= hasher->partition_count) {
+                return AMIDB_DONE;
+            }
+            hasher->next_build = first_build(hasher, hasher->current);
+        }
+        rc = load_piece(hasher);
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+        hasher->next_probe = hasher->partitions[hasher->current].sides[SIDE_PROBE].last;
+    }
+}
+
+/*
+ * Free the hasher
+ */
+void hasher_close(struct sql_hasher *hasher) {
+    if (hasher->file) {
+        file_close(hasher->file);
+        file_delete(hasher->path);
+        hasher->file = NULL;
+    }
+
+    free(hasher->path);
+    free(hasher->memory);
+    free(hasher->partitions);
+    hasher->path = NULL;
+    hasher->memory = NULL;
+    hasher->partitions = NULL;
+    hasher->buckets = NULL;
+    hasher->partition_count = 0;
+}
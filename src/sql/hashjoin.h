@@ -0,0 +1,166 @@
+/*
+ * hashjoin.h - Grace hash join for INNER JOIN
+ *
+ * Joins two streams of stored records on a key of bytes inside each.
+ * One side (the build side, the smaller of the two) is added first and
+ * kept in a hash table in a fixed memory budget; each record of the
+ * other side (the probe side) is then looked up in it, and comes back
+ * with every build record whose key holds the same bytes. Both sides
+ * are read once and a record meets only the records of its bucket, so
+ * the join is O(build + probe) rather than O(build * probe).
+ *
+ * When the build side does not fit the budget, both sides are cut into
+ * partitions by the hash of their keys and written to a temporary file
+ * next to the database (<database>-hash<n>, deleted when the hasher is
+ * closed): records that match land in the same partition, so each
+ * partition is then joined alone, its build side loaded into memory
+ * and its probe side read back past it. A build side that was expected
+ * to overflow is partitioned from the start. A partition still too
+ * large for the budget is loaded a piece at a time, its probe side read
+ * again for each piece.
+ *
+ * The partitions are written through buffers of HASHER_BUFFER bytes at
+ * the bottom of the budget, set aside from the start so a build side
+ * that overflows can be spilled without more memory. The hash table's
+ * buckets are sized from the records expected (or, for a partition,
+ * counted), and kept at the top of the budget.
+ */
+
+#ifndef AMIDB_SQL_HASHJOIN_H
+#define AMIDB_SQL_HASHJOIN_H
+
+#include "storage/pager.h"
+#include "os/file.h"
+#include <stdint.h>
+
+/* Buffer of a partition being written (records larger go out alone) */
+#define HASHER_BUFFER       1024
+
+/* Partitions a spill cuts the records into */
+#define HASHER_MIN_PARTITIONS   4
+#define HASHER_MAX_PARTITIONS   64
+
+/* Smallest budget: the partitions' buffers, and room for records of a */
+/* page (a record may take a quarter of the budget) */
+#define HASHER_MIN_MEMORY   (2 * HASHER_MIN_PARTITIONS * HASHER_BUFFER + 4 * AMIDB_PAGE_SIZE)
+
+/* Record header: chain, hash, size, key offset and size (see hashjoin.c) */
+#define HASHER_RECORD_HEADER 14
+
+struct hasher_partition;
+
+/*
+ * Hasher
+ */
+struct sql_hasher {
+    uint8_t *memory;                /* The budget: buffers, records up, buckets down */
+    uint32_t memory_size;
+    uint32_t start;                 /* First byte of the records */
+    uint32_t used;                  /* End of the records */
+    uint32_t *buckets;              /* First record of each chain */
+    uint32_t bucket_count;          /* A power of two */
+    uint8_t probing;                /* The build side is complete */
+
+    /* Partitions on disk */
+    char *path;                     /* Temporary file name */
+    amidb_file_t file;              /* Open once a partition is written */
+    uint32_t file_end;
+    struct hasher_partition *partitions;
+    uint32_t partition_count;       /* Partitions a spill makes */
+    uint8_t spilled;                /* Records go to the partitions */
+    uint32_t largest_chunk;         /* Largest stretch of records written at once */
+
+    /* Record being probed */
+    const uint8_t *probe;
+    uint32_t probe_size;
+    uint32_t probe_hash;
+    const uint8_t *probe_key;
+    uint32_t probe_key_size;
+    uint32_t match;                 /* Next record of its chain to test */
+
+    /* Partition being joined */
+    uint32_t current;
+    uint32_t next_build;            /* Next stretch of its build side to load */
+    uint32_t next_probe;            /* Next stretch of its probe side to read */
+    uint32_t chunk_pos;             /* Next probe record in the stretch read */
+    uint32_t chunk_size;
+
+    /* Statistics */
+    uint32_t partitions_written;    /* Partitions the sides went to (0: none) */
+    uint32_t loads;                 /* Build sides loaded, counting pieces */
+};
+
+/*
+ * Partitions a build side of bytes would be cut into
+ *
+ * Returns: 0 if it fits memory, else the partitions hasher_init makes
+ */
+uint32_t hasher_partitions(uint32_t memory, uint32_t bytes);
+
+/*
+ * Start a join
+ *
+ * base_path - Database file path (the temporary file is named after it)
+ * memory    - Budget in bytes (at least HASHER_MIN_MEMORY is used)
+ * rows      - Build records expected (sizes the hash table)
+ * bytes     - Their bytes expected, headers included (sizes the
+ *             partitions, and partitions from the start past memory)
+ *
+ * Returns: AMIDB_OK, or AMIDB_NOMEM
+ */
+int hasher_init(struct sql_hasher *hasher, const char *base_path, uint32_t memory,
+                uint32_t rows, uint32_t bytes);
+
+/*
+ * Add a build record (it is copied); its key is the key_size bytes at
+ * key_offset
+ *
+ * Returns: AMIDB_OK, AMIDB_FULL (record larger than a quarter of the
+ * budget), or AMIDB_IOERR
+ */
+int hasher_build(struct sql_hasher *hasher, const uint8_t *record, uint32_t size,
+                 uint32_t key_offset, uint32_t key_size);
+
+/*
+ * Probe with a record (ends the build side)
+ *
+ * In memory, its matches are then read with hasher_match, and the
+ * record must stay in place until they are. Once partitioned, it is
+ * written to its partition and its matches come from hasher_next.
+ *
+ * Returns: AMIDB_OK, AMIDB_FULL (record too large), or AMIDB_IOERR
+ */
+int hasher_probe(struct sql_hasher *hasher, const uint8_t *record, uint32_t size,
+                 uint32_t key_offset, uint32_t key_size);
+
+/*
+ * Get the next build record matching the record probed
+ *
+ * Returns: AMIDB_ROW, or AMIDB_DONE
+ */
+int hasher_match(struct sql_hasher *hasher, const uint8_t **record, uint32_t *size);
+
+/*
+ * End the probe side (no records may be added afterwards)
+ *
+ * Returns: AMIDB_OK, or AMIDB_IOERR
+ */
+int hasher_finish(struct sql_hasher *hasher);
+
+/*
+ * Get the next matching pair of the partitions (none if nothing was
+ * partitioned); both records stay in place until the next call
+ *
+ * Returns: AMIDB_ROW, AMIDB_DONE, AMIDB_FULL (a stretch of records
+ * larger than memory), AMIDB_IOERR, or AMIDB_CORRUPT
+ */
+int hasher_next(struct sql_hasher *hasher, const uint8_t **build, uint32_t *build_size,
+                const uint8_t **probe, uint32_t *probe_size);
+
+/*
+ * Free the hasher's memory and delete its temporary file (also after
+ * a failed hasher_init)
+ */
+void hasher_close(struct sql_hasher *hasher);
+
+#endif /* AMIDB_SQL_HASHJOIN_H */
@@ -74,6 +74,20 @@ uint32_t lexer_keyword_id(const char *text) {
     if (strcmp(upper, "AVG") == 0) return KW_AVG;
     if (strcmp(upper, "MIN") == 0) return KW_MIN;
     if (strcmp(upper, "MAX") == 0) return KW_MAX;
+    if (strcmp(upper, "BEGIN") == 0) return KW_BEGIN;
+    if (strcmp(upper, "COMMIT") == 0) return KW_COMMIT;
+    if (strcmp(upper, "ROLLBACK") == 0) return KW_ROLLBACK;
+    if (strcmp(upper, "SAVEPOINT") == 0) return KW_SAVEPOINT;
+    if (strcmp(upper, "RELEASE") == 0) return KW_RELEASE;
+    if (strcmp(upper, "TO") == 0) return KW_TO;
+    if (strcmp(upper, "TRANSACTION") == 0) return KW_TRANSACTION;
+    if (strcmp(upper, "ENGINE") == 0) return KW_ENGINE;
+    if (strcmp(upper, "ANALYZE") == 0) return KW_ANALYZE;
+    if (strcmp(upper, "EXPLAIN") == 0) return KW_EXPLAIN;
+    if (strcmp(upper, "INNER") == 0) return KW_INNER;
+    if (strcmp(upper, "JOIN") == 0) return KW_JOIN;
+    if (strcmp(upper, "ON") == 0) return KW_ON;
+    if (strcmp(upper, "AS") == 0) return KW_AS;
 
     return 0;  /* Not a keyword */
 }
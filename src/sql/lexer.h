@@ -52,6 +52,20 @@
 #define KW_AVG          30
 #define KW_MIN          31
 #define KW_MAX          32
+#define KW_BEGIN        33
+#define KW_COMMIT       34
+#define KW_ROLLBACK     35
+#define KW_SAVEPOINT    36
+#define KW_RELEASE      37
+#define KW_TO           38
+#define KW_TRANSACTION  39
+#define KW_ENGINE       40
+#define KW_ANALYZE      41
+#define KW_EXPLAIN      42
+#define KW_INNER        43
+#define KW_JOIN         44
+#define KW_ON           45
+#define KW_AS           46
 
 /* Symbol constants */
 #define SYM_LPAREN      '('
@@ -62,6 +76,8 @@
 #define SYM_LT          '<'
 #define SYM_GT          '>'
 #define SYM_STAR        '*'
+#define SYM_PARAM       '?'  /* Prepared statement parameter */
+#define SYM_DOT         '.'  /* table.column */
 
 /* Multi-character symbols (use high values to avoid collision with single chars) */
 #define SYM_LE          256  /* <= */
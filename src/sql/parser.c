@@ -7,6 +7,7 @@
 
 #include "sql/parser.h"
 #include <string.h>
+#include <ctype.h>
 #include <stdio.h>
 
 /* Forward declarations */
@@ -16,6 +17,7 @@ static int match_symbol(struct sql_parser *parser, uint32_t symbol_id);
 static int expect_keyword(struct sql_parser *parser, uint32_t keyword_id);
 static int expect_symbol(struct sql_parser *parser, uint32_t symbol_id);
 static int expect_identifier(struct sql_parser *parser, char *out_name);
+static int expect_column_ref(struct sql_parser *parser, char *out_name);
 static void set_error(struct sql_parser *parser, const char *message);
 
 static int parse_create_table(struct sql_parser *parser, struct sql_statement *stmt);
@@ -25,7 +27,11 @@ static int parse_data_type(struct sql_parser *parser, uint8_t *type);
 static int parse_insert(struct sql_parser *parser, struct sql_statement *stmt);
 static int parse_value(struct sql_parser *parser, struct sql_value *value);
 static int parse_select(struct sql_parser *parser, struct sql_statement *stmt);
+static int parse_table_ref(struct sql_parser *parser, char *table_name, char *alias);
 static int parse_where(struct sql_parser *parser, struct sql_where *where);
+static int parse_where_expr(struct sql_parser *parser, struct sql_where *where, int depth);
+static int parse_transaction(struct sql_parser *parser, struct sql_statement *stmt);
+static int parse_analyze(struct sql_parser *parser, struct sql_statement *stmt);
 
 /*
  * Initialize parser
@@ -34,6 +40,7 @@ void parser_init(struct sql_parser *parser, struct sql_lexer *lexer) {
     parser->lexer = lexer;
     parser->has_error = 0;
     parser->error_msg[0] = '\0';
+    parser->param_count = 0;
 
     /* Load first two tokens */
     lexer_next(lexer, &parser->current);
@@ -44,8 +51,11 @@ void parser_init(struct sql_parser *parser, struct sql_lexer *lexer) {
  * Parse SQL statement
  */
 int parser_parse_statement(struct sql_parser *parser, struct sql_statement *stmt) {
+    int rc;
+
     /* Clear statement */
     memset(stmt, 0, sizeof(struct sql_statement));
+    parser->param_count = 0;
 
     /* Check for EOF */
     if (parser->current.type == TOKEN_EOF) {
@@ -61,16 +71,34 @@ int parser_parse_statement(struct sql_parser *parser, struct sql_statement *stmt
 
     switch (parser->current.keyword_id) {
         case KW_CREATE:
-            return parse_create_table(parser, stmt);
+            rc = parse_create_table(parser, stmt);
+            break;
 
         case KW_DROP:
-            return parse_drop_table(parser, stmt);
+            rc = parse_drop_table(parser, stmt);
+            break;
 
         case KW_INSERT:
-            return parse_insert(parser, stmt);
+            rc = parse_insert(parser, stmt);
+            break;
 
         case KW_SELECT:
-            return parse_select(parser, stmt);
+            rc = parse_select(parser, stmt);
+            break;
+
+        case KW_EXPLAIN:
+            advance(parser);
+            if (!match_keyword(parser, KW_SELECT)) {
+                set_error(parser, "Expected SELECT after EXPLAIN");
+                return -1;
+            }
+            rc = parse_select(parser, stmt);
+            stmt->stmt.select.explain = 1;
+            break;
+
+        case KW_ANALYZE:
+            rc = parse_analyze(parser, stmt);
+            break;
 
         case KW_UPDATE:
             set_error(parser, "UPDATE not yet implemented");
@@ -80,10 +108,21 @@ int parser_parse_statement(struct sql_parser *parser, struct sql_statement *stmt
             set_error(parser, "DELETE not yet implemented");
             return -1;
 
+        case KW_BEGIN:
+        case KW_COMMIT:
+        case KW_ROLLBACK:
+        case KW_SAVEPOINT:
+        case KW_RELEASE:
+            rc = parse_transaction(parser, stmt);
+            break;
+
         default:
             set_error(parser, "Unknown SQL statement");
             return -1;
     }
+
+    stmt->param_count = parser->param_count;
+    return rc;
 }
 
 /*
@@ -94,10 +133,11 @@ int parser_parse_statement(struct sql_parser *parser, struct sql_statement *stmt
  *     column_name type [PRIMARY KEY],
  *     column_name type,
  *     ...
- *   )
+ *   ) [ENGINE = BTREE | LSM]
  */
 static int parse_create_table(struct sql_parser *parser, struct sql_statement *stmt) {
     struct sql_create_table *create = &stmt->stmt.create_table;
+    char engine[64];
     int primary_key_count = 0;
     int i;
 
@@ -169,6 +209,27 @@ static int parse_create_table(struct sql_parser *parser, struct sql_statement *s
         return -1;
     }
 
+    /* Optional ENGINE = name (B+Tree by default) */
+    create->engine = SQL_ENGINE_BTREE;
+    if (match_keyword(parser, KW_ENGINE)) {
+        advance(parser);
+        if (!expect_symbol(parser, SYM_EQUAL)) {
+            return -1;
+        }
+        if (!expect_identifier(parser, engine)) {
+            return -1;
+        }
+        for (i = 0; engine[i]; i++) {
+            engine[i] = (char)toupper((unsigned char)engine[i]);
+        }
+        if (strcmp(engine, "LSM") == 0) {
+            create->engine = SQL_ENGINE_LSM;
+        } else if (strcmp(engine, "BTREE") != 0) {
+            set_error(parser, "Unknown table engine (BTREE or LSM)");
+            return -1;
+        }
+    }
+
     /* Optional semicolon */
     if (match_symbol(parser, SYM_SEMICOLON)) {
         advance(parser);
@@ -363,7 +424,10 @@ static int parse_insert(struct sql_parser *parser, struct sql_statement *stmt) {
 /*
  * Parse value (for INSERT VALUES clause)
  *
- * Grammar: integer | 'string' | NULL
+ * Grammar: integer | 'string' | NULL | ?
+ *
+ * A ? is a parameter of a prepared statement; parameters are numbered
+ * from 1 in the order they appear.
  */
 static int parse_value(struct sql_parser *parser, struct sql_value *value) {
     memset(value, 0, sizeof(struct sql_value));
@@ -392,7 +456,20 @@ static int parse_value(struct sql_parser *parser, struct sql_value *value) {
         return 0;
     }
 
-    set_error(parser, "Expected value (integer, string, or NULL)");
+    /* Parameter */
+    if (match_symbol(parser, SYM_PARAM)) {
+        if (parser->param_count >= SQL_MAX_PARAMS) {
+            set_error(parser, "Too many parameters (max 32)");
+            return -1;
+        }
+        parser->param_count++;
+        value->type = SQL_VALUE_PARAM;
+        value->int_value = parser->param_count;
+        advance(parser);
+        return 0;
+    }
+
+    set_error(parser, "Expected value (integer, string, NULL, or ?)");
     return -1;
 }
 
@@ -400,7 +477,15 @@ static int parse_value(struct sql_parser *parser, struct sql_value *value) {
  * Parse SELECT statement
  *
  * Grammar:
- *   SELECT * FROM table_name [WHERE column op value]
+ *   SELECT * | column [, column ...] | aggregate(column)
+ *   FROM table_name [[AS] alias]
+ *   [[INNER] JOIN table_name [[AS] alias] ON column = column ...]
+ *   [WHERE expression]
+ *   [ORDER BY column [ASC | DESC]] [LIMIT n]
+ *
+ * A column may be written table.column (or alias.column).
+ *
+ * (EXPLAIN before SELECT is read by parser_parse_statement.)
  */
 static int parse_select(struct sql_parser *parser, struct sql_statement *stmt) {
     struct sql_select *select = &stmt->stmt.select;
@@ -434,9 +519,9 @@ static int parse_select(struct sql_parser *parser, struct sql_statement *stmt) {
             select->agg_column[0] = '\0';
         } else if (parser->current.type == TOKEN_IDENTIFIER) {
             /* COUNT(column) */
-            strncpy(select->agg_column, parser->current.text, 63);
-            select->agg_column[63] = '\0';
-            advance(parser);
+            if (!expect_column_ref(parser, select->agg_column)) {
+                return -1;
+            }
             select->aggregate = SQL_AGG_COUNT;
         } else {
             set_error(parser, "Expected '*' or column name in COUNT()");
@@ -468,9 +553,9 @@ static int parse_select(struct sql_parser *parser, struct sql_statement *stmt) {
             set_error(parser, "Expected column name in SUM()");
             return -1;
         }
-        strncpy(select->agg_column, parser->current.text, 63);
-        select->agg_column[63] = '\0';
-        advance(parser);
+        if (!expect_column_ref(parser, select->agg_column)) {
+            return -1;
+        }
         select->aggregate = SQL_AGG_SUM;
 
         /* Expect ) */
@@ -498,9 +583,9 @@ static int parse_select(struct sql_parser *parser, struct sql_statement *stmt) {
             set_error(parser, "Expected column name in AVG()");
             return -1;
         }
-        strncpy(select->agg_column, parser->current.text, 63);
-        select->agg_column[63] = '\0';
-        advance(parser);
+        if (!expect_column_ref(parser, select->agg_column)) {
+            return -1;
+        }
         select->aggregate = SQL_AGG_AVG;
 
         /* Expect ) */
@@ -528,9 +613,9 @@ static int parse_select(struct sql_parser *parser, struct sql_statement *stmt) {
             set_error(parser, "Expected column name in MIN()");
             return -1;
         }
-        strncpy(select->agg_column, parser->current.text, 63);
-        select->agg_column[63] = '\0';
-        advance(parser);
+        if (!expect_column_ref(parser, select->agg_column)) {
+            return -1;
+        }
         select->aggregate = SQL_AGG_MIN;
 
         /* Expect ) */
@@ -558,9 +643,9 @@ static int parse_select(struct sql_parser *parser, struct sql_statement *stmt) {
             set_error(parser, "Expected column name in MAX()");
             return -1;
         }
-        strncpy(select->agg_column, parser->current.text, 63);
-        select->agg_column[63] = '\0';
-        advance(parser);
+        if (!expect_column_ref(parser, select->agg_column)) {
+            return -1;
+        }
         select->aggregate = SQL_AGG_MAX;
 
         /* Expect ) */
@@ -576,8 +661,27 @@ static int parse_select(struct sql_parser *parser, struct sql_statement *stmt) {
     else if (match_symbol(parser, SYM_STAR)) {
         advance(parser);
         select->select_all = 1;
+    }
+    /* Column list */
+    else if (parser->current.type == TOKEN_IDENTIFIER) {
+        select->select_all = 0;
+        for (;;) {
+            if (select->column_count >= 32) {
+                set_error(parser, "Too many columns in SELECT (max 32)");
+                return -1;
+            }
+            if (!expect_column_ref(parser, select->columns[select->column_count])) {
+                return -1;
+            }
+            select->column_count++;
+
+            if (!match_symbol(parser, SYM_COMMA)) {
+                break;
+            }
+            advance(parser);
+        }
     } else {
-        set_error(parser, "Expected '*', COUNT(), SUM(), AVG(), MIN(), or MAX() after SELECT");
+        set_error(parser, "Expected '*', columns, COUNT(), SUM(), AVG(), MIN(), or MAX() after SELECT");
         return -1;
     }
 
@@ -586,11 +690,34 @@ static int parse_select(struct sql_parser *parser, struct sql_statement *stmt) {
         return -1;
     }
 
-    /* table_name */
-    if (!expect_identifier(parser, select->table_name)) {
+    /* table_name [alias] */
+    if (parse_table_ref(parser, select->table_name, select->alias) != 0) {
         return -1;
     }
 
+    /* [INNER] JOIN table_name [alias] ON column = column ... */
+    while (match_keyword(parser, KW_INNER) || match_keyword(parser, KW_JOIN)) {
+        struct sql_join *join;
+
+        if (select->join_count >= SQL_MAX_JOINS) {
+            set_error(parser, "Too many joins (max 3)");
+            return -1;
+        }
+        join = &select->joins[select->join_count++];
+
+        if (match_keyword(parser, KW_INNER)) {
+            advance(parser);
+        }
+        if (!expect_keyword(parser, KW_JOIN) ||
+            parse_table_ref(parser, join->table_name, join->alias) != 0 ||
+            !expect_keyword(parser, KW_ON) ||
+            !expect_column_ref(parser, join->left_column) ||
+            !expect_symbol(parser, SYM_EQUAL) ||
+            !expect_column_ref(parser, join->right_column)) {
+            return -1;
+        }
+    }
+
     /* Optional WHERE clause */
     if (match_keyword(parser, KW_WHERE)) {
         if (parse_where(parser, &select->where) != 0) {
@@ -608,7 +735,7 @@ static int parse_select(struct sql_parser *parser, struct sql_statement *stmt) {
         }
 
         /* column_name */
-        if (!expect_identifier(parser, select->order_by.column_name)) {
+        if (!expect_column_ref(parser, select->order_by.column_name)) {
             return -1;
         }
 
@@ -657,21 +784,63 @@ static int parse_select(struct sql_parser *parser, struct sql_statement *stmt) {
 }
 
 /*
- * Parse WHERE clause
+ * Parse a table in FROM or JOIN
+ *
+ * Grammar: table_name [[AS] alias]
+ */
+static int parse_table_ref(struct sql_parser *parser, char *table_name, char *alias) {
+    if (!expect_identifier(parser, table_name)) {
+        return -1;
+    }
+    if (match_keyword(parser, KW_AS)) {
+        advance(parser);
+        return expect_identifier(parser, alias) ? 0 : -1;
+    }
+    if (parser->current.type == TOKEN_IDENTIFIER) {
+        expect_identifier(parser, alias);
+    }
+    return 0;
+}
+
+/*
+ * Add a node to a WHERE tree
  *
- * Grammar: WHERE column_name op value
+ * Returns: the node's number, or -1 if the tree is full
+ */
+static int where_add_node(struct sql_parser *parser, struct sql_where *where,
+                          uint8_t type, uint8_t left, uint8_t right) {
+    struct sql_where_node *node;
+
+    if (where->node_count >= SQL_MAX_WHERE_NODES) {
+        set_error(parser, "WHERE clause too complex (max 32 terms)");
+        return -1;
+    }
+    node = &where->nodes[where->node_count];
+    node->type = type;
+    node->left = left;
+    node->right = right;
+    return where->node_count++;
+}
+
+/*
+ * Parse one comparison
+ *
+ * Grammar: column_name op value
  * Where op is: = | != | < | <= | > | >=
+ *
+ * Returns: the node's number, or -1 on error
  */
-static int parse_where(struct sql_parser *parser, struct sql_where *where) {
-    memset(where, 0, sizeof(struct sql_where));
+static int parse_comparison(struct sql_parser *parser, struct sql_where *where) {
+    struct sql_condition *cond;
 
-    /* WHERE */
-    if (!expect_keyword(parser, KW_WHERE)) {
+    if (where->condition_count >= SQL_MAX_CONDITIONS) {
+        set_error(parser, "Too many conditions in WHERE (max 16)");
         return -1;
     }
+    cond = &where->conditions[where->condition_count];
 
     /* column_name */
-    if (!expect_identifier(parser, where->column_name)) {
+    if (!expect_column_ref(parser, cond->column_name)) {
         return -1;
     }
 
@@ -683,22 +852,22 @@ static int parse_where(struct sql_parser *parser, struct sql_where *where) {
 
     switch (parser->current.symbol_id) {
         case SYM_EQUAL:
-            where->op = SQL_OP_EQ;
+            cond->op = SQL_OP_EQ;
             break;
         case SYM_NE:
-            where->op = SQL_OP_NE;
+            cond->op = SQL_OP_NE;
             break;
         case SYM_LT:
-            where->op = SQL_OP_LT;
+            cond->op = SQL_OP_LT;
             break;
         case SYM_LE:
-            where->op = SQL_OP_LE;
+            cond->op = SQL_OP_LE;
             break;
         case SYM_GT:
-            where->op = SQL_OP_GT;
+            cond->op = SQL_OP_GT;
             break;
         case SYM_GE:
-            where->op = SQL_OP_GE;
+            cond->op = SQL_OP_GE;
             break;
         default:
             set_error(parser, "Invalid comparison operator");
@@ -707,16 +876,224 @@ static int parse_where(struct sql_parser *parser, struct sql_where *where) {
     advance(parser);
 
     /* value */
-    if (parse_value(parser, &where->value) != 0) {
+    if (parse_value(parser, &cond->value) != 0) {
         return -1;
     }
 
+    return where_add_node(parser, where, SQL_WHERE_COMPARE, where->condition_count++, 0);
+}
+
+/*
+ * Parse a term: NOT term | ( expression ) | comparison
+ *
+ * Returns: the node's number, or -1 on error
+ */
+static int parse_where_term(struct sql_parser *parser, struct sql_where *where, int depth) {
+    int node;
+
+    if (match_keyword(parser, KW_NOT) || match_symbol(parser, SYM_LPAREN)) {
+        if (depth >= SQL_MAX_WHERE_DEPTH) {
+            set_error(parser, "WHERE clause nested too deeply");
+            return -1;
+        }
+        if (match_keyword(parser, KW_NOT)) {
+            advance(parser);
+            node = parse_where_term(parser, where, depth + 1);
+            if (node < 0) {
+                return -1;
+            }
+            return where_add_node(parser, where, SQL_WHERE_NOT, (uint8_t)node, 0);
+        }
+
+        advance(parser);
+        node = parse_where_expr(parser, where, depth + 1);
+        if (node < 0 || !expect_symbol(parser, SYM_RPAREN)) {
+            return -1;
+        }
+        return node;
+    }
+
+    return parse_comparison(parser, where);
+}
+
+/*
+ * Parse terms joined by AND (binds tighter than OR)
+ *
+ * Returns: the node's number, or -1 on error
+ */
+static int parse_where_and(struct sql_parser *parser, struct sql_where *where, int depth) {
+    int left;
+    int right;
+
+    left = parse_where_term(parser, where, depth);
+    while (left >= 0 && match_keyword(parser, KW_AND)) {
+        advance(parser);
+        right = parse_where_term(parser, where, depth);
+        if (right < 0) {
+            return -1;
+        }
+        left = where_add_node(parser, where, SQL_WHERE_AND, (uint8_t)left, (uint8_t)right);
+    }
+    return left;
+}
+
+/*
+ * Parse a WHERE expression: AND groups joined by OR
+ *
+ * Returns: the node's number, or -1 on error
+ */
+static int parse_where_expr(struct sql_parser *parser, struct sql_where *where, int depth) {
+    int left;
+    int right;
+
+    left = parse_where_and(parser, where, depth);
+    while (left >= 0 && match_keyword(parser, KW_OR)) {
+        advance(parser);
+        right = parse_where_and(parser, where, depth);
+        if (right < 0) {
+            return -1;
+        }
+        left = where_add_node(parser, where, SQL_WHERE_OR, (uint8_t)left, (uint8_t)right);
+    }
+    return left;
+}
+
+/*
+ * Parse WHERE clause
+ *
+ * Grammar:
+ *   WHERE expression
+ *   expression := and_group [OR and_group ...]
+ *   and_group  := term [AND term ...]
+ *   term       := NOT term | ( expression ) | column_name op value
+ * Where op is: = | != | < | <= | > | >=
+ */
+static int parse_where(struct sql_parser *parser, struct sql_where *where) {
+    int root;
+
+    memset(where, 0, sizeof(struct sql_where));
+
+    /* WHERE */
+    if (!expect_keyword(parser, KW_WHERE)) {
+        return -1;
+    }
+
+    root = parse_where_expr(parser, where, 0);
+    if (root < 0) {
+        return -1;
+    }
+
+    where->root = (uint8_t)root;
     where->has_condition = 1;
     return 0;
 }
 
 /* ========== Helper Functions ========== */
 
+/*
+ * Parse transaction control statement
+ *
+ * Grammar:
+ *   BEGIN [TRANSACTION]
+ *   COMMIT [TRANSACTION]
+ *   ROLLBACK [TRANSACTION] [TO [SAVEPOINT] name]
+ *   SAVEPOINT name
+ *   RELEASE [SAVEPOINT] name
+ */
+static int parse_transaction(struct sql_parser *parser, struct sql_statement *stmt) {
+    struct sql_transaction *txn = &stmt->stmt.transaction;
+    uint32_t keyword_id = parser->current.keyword_id;
+
+    advance(parser);
+
+    switch (keyword_id) {
+        case KW_BEGIN:
+            stmt->type = STMT_BEGIN;
+            if (match_keyword(parser, KW_TRANSACTION)) {
+                advance(parser);
+            }
+            break;
+
+        case KW_COMMIT:
+            stmt->type = STMT_COMMIT;
+            if (match_keyword(parser, KW_TRANSACTION)) {
+                advance(parser);
+            }
+            break;
+
+        case KW_ROLLBACK:
+            stmt->type = STMT_ROLLBACK;
+            if (match_keyword(parser, KW_TRANSACTION)) {
+                advance(parser);
+            }
+            if (match_keyword(parser, KW_TO)) {
+                advance(parser);
+                if (match_keyword(parser, KW_SAVEPOINT)) {
+                    advance(parser);
+                }
+                if (!expect_identifier(parser, txn->savepoint_name)) {
+                    return -1;
+                }
+            }
+            break;
+
+        case KW_SAVEPOINT:
+            stmt->type = STMT_SAVEPOINT;
+            if (!expect_identifier(parser, txn->savepoint_name)) {
+                return -1;
+            }
+            break;
+
+        case KW_RELEASE:
+            stmt->type = STMT_RELEASE;
+            if (match_keyword(parser, KW_SAVEPOINT)) {
+                advance(parser);
+            }
+            if (!expect_identifier(parser, txn->savepoint_name)) {
+                return -1;
+            }
+            break;
+    }
+
+    /* Optional semicolon */
+    if (match_symbol(parser, SYM_SEMICOLON)) {
+        advance(parser);
+    }
+
+    return 0;
+}
+
+/*
+ * Parse ANALYZE statement
+ *
+ * Grammar:
+ *   ANALYZE [table_name]
+ */
+static int parse_analyze(struct sql_parser *parser, struct sql_statement *stmt) {
+    struct sql_analyze *analyze = &stmt->stmt.analyze;
+
+    stmt->type = STMT_ANALYZE;
+
+    /* ANALYZE */
+    if (!expect_keyword(parser, KW_ANALYZE)) {
+        return -1;
+    }
+
+    /* Optional table_name */
+    if (parser->current.type == TOKEN_IDENTIFIER) {
+        if (!expect_identifier(parser, analyze->table_name)) {
+            return -1;
+        }
+    }
+
+    /* Optional semicolon */
+    if (match_symbol(parser, SYM_SEMICOLON)) {
+        advance(parser);
+    }
+
+    return 0;
+}
+
 /*
  * Advance to next token
  */
@@ -786,6 +1163,31 @@ static int expect_identifier(struct sql_parser *parser, char *out_name) {
     return 1;
 }
 
+/*
+ * Expect a column name, plain or table.column, and consume it
+ */
+static int expect_column_ref(struct sql_parser *parser, char *out_name) {
+    char column[64];
+
+    if (!expect_identifier(parser, out_name)) {
+        return 0;
+    }
+    if (!match_symbol(parser, SYM_DOT)) {
+        return 1;
+    }
+    advance(parser);
+    if (!expect_identifier(parser, column)) {
+        return 0;
+    }
+    if (strlen(out_name) + 1 + strlen(column) > 63) {
+        set_error(parser, "Column name too long");
+        return 0;
+    }
+    strcat(out_name, ".");
+    strcat(out_name, column);
+    return 1;
+}
+
 /*
  * Set parser error message
  */
@@ -794,3 +1196,4 @@ static void set_error(struct sql_parser *parser, const char *message) {
     parser->error_msg[sizeof(parser->error_msg) - 1] = '\0';
     parser->has_error = 1;
 }
+
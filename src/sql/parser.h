@@ -20,6 +20,12 @@
 #define STMT_DELETE         6
 #define STMT_CREATE_INDEX   7
 #define STMT_DROP_INDEX     8
+#define STMT_BEGIN          9
+#define STMT_COMMIT         10
+#define STMT_ROLLBACK       11   /* Whole txn, or ROLLBACK TO savepoint */
+#define STMT_SAVEPOINT      12
+#define STMT_RELEASE        13
+#define STMT_ANALYZE        14
 
 /* Data types */
 #define SQL_TYPE_INTEGER    1
@@ -31,6 +37,10 @@
 #define SQL_VALUE_TEXT      2
 #define SQL_VALUE_BLOB      3
 #define SQL_VALUE_NULL      4
+#define SQL_VALUE_PARAM     5  /* ? placeholder (int_value: its number) */
+
+/* Parameters in one statement */
+#define SQL_MAX_PARAMS      32
 
 /* Comparison operators (for WHERE clause) */
 #define SQL_OP_EQ           1  /* = */
@@ -49,6 +59,10 @@
 #define SQL_AGG_MIN         5  /* MIN(column) */
 #define SQL_AGG_MAX         6  /* MAX(column) */
 
+/* Table engines (CREATE TABLE ... ENGINE = name) */
+#define SQL_ENGINE_BTREE    0  /* Default */
+#define SQL_ENGINE_LSM      1  /* Buffered sorted runs (storage/lsm.h) */
+
 /* Column definition (for CREATE TABLE) */
 struct sql_column_def {
     char name[64];              /* Column name */
@@ -62,6 +76,7 @@ struct sql_create_table {
     char table_name[64];
     uint8_t column_count;
     struct sql_column_def columns[32];  /* Max 32 columns */
+    uint8_t engine;             /* SQL_ENGINE_* */
 };
 
 /* DROP TABLE statement */
@@ -85,12 +100,44 @@ struct sql_insert {
     struct sql_value values[32];  /* Max 32 values */
 };
 
-/* WHERE clause condition (simple: column op value) */
-struct sql_where {
+/* WHERE clause limits */
+#define SQL_MAX_CONDITIONS  16 /* Comparisons in one WHERE */
+#define SQL_MAX_WHERE_NODES 32 /* Comparisons, AND, OR and NOT together */
+#define SQL_MAX_WHERE_DEPTH 8  /* Nested parentheses and NOTs */
+
+/* WHERE expression node types */
+#define SQL_WHERE_COMPARE   1  /* conditions[left] */
+#define SQL_WHERE_AND       2  /* nodes[left] AND nodes[right] */
+#define SQL_WHERE_OR        3  /* nodes[left] OR nodes[right] */
+#define SQL_WHERE_NOT       4  /* NOT nodes[left] */
+
+/* One comparison: column op value */
+struct sql_condition {
     char column_name[64];
     uint8_t op;                 /* SQL_OP_* */
     struct sql_value value;
+};
+
+/* Node of a WHERE expression */
+struct sql_where_node {
+    uint8_t type;               /* SQL_WHERE_* */
+    uint8_t left;               /* Operand node, or condition for COMPARE */
+    uint8_t right;              /* Second operand of AND / OR */
+};
+
+/*
+ * WHERE clause: a tree of AND, OR and NOT over comparisons
+ *
+ * Nodes and comparisons are kept in arrays (no malloc); conditions are
+ * numbered in the order they appear, so parameters in them are too.
+ */
+struct sql_where {
     uint8_t has_condition;      /* 1 if WHERE clause exists */
+    uint8_t root;               /* Top node */
+    uint8_t node_count;
+    uint8_t condition_count;
+    struct sql_where_node nodes[SQL_MAX_WHERE_NODES];
+    struct sql_condition conditions[SQL_MAX_CONDITIONS];
 };
 
 /* ORDER BY clause */
@@ -100,9 +147,26 @@ struct sql_order_by {
     uint8_t has_order;          /* 1 if ORDER BY exists */
 };
 
+/* INNER JOINs in one SELECT (so up to four tables) */
+#define SQL_MAX_JOINS       3
+
+/*
+ * INNER JOIN table [alias] ON column = column
+ *
+ * Column names here, and anywhere else in a SELECT, may be qualified:
+ * "table.column", the table named by its alias if it has one.
+ */
+struct sql_join {
+    char table_name[64];
+    char alias[64];             /* Empty if none */
+    char left_column[64];       /* ON left = right, as written */
+    char right_column[64];
+};
+
 /* SELECT statement */
 struct sql_select {
     char table_name[64];
+    char alias[64];             /* FROM table's alias (empty if none) */
     uint8_t select_all;         /* 1 for SELECT * */
     uint8_t column_count;       /* Number of specific columns (if not *) */
     char columns[32][64];       /* Column names */
@@ -111,6 +175,9 @@ struct sql_select {
     int32_t limit;              /* -1 if no LIMIT */
     uint8_t aggregate;          /* SQL_AGG_* - aggregate function type */
     char agg_column[64];        /* Column for aggregate (empty for COUNT(*)) */
+    uint8_t explain;            /* 1 for EXPLAIN SELECT: rows describe the plan */
+    uint8_t join_count;
+    struct sql_join joins[SQL_MAX_JOINS];
 };
 
 /* UPDATE statement */
@@ -127,6 +194,16 @@ struct sql_delete {
     struct sql_where where;
 };
 
+/* BEGIN / COMMIT / ROLLBACK [TO] / SAVEPOINT / RELEASE statement */
+struct sql_transaction {
+    char savepoint_name[64];    /* Empty for a whole-transaction ROLLBACK */
+};
+
+/* ANALYZE statement */
+struct sql_analyze {
+    char table_name[64];        /* Empty for every table */
+};
+
 /* SQL statement (union of all statement types) */
 struct sql_statement {
     uint8_t type;               /* STMT_* constant */
@@ -137,7 +214,10 @@ struct sql_statement {
         struct sql_select select;
         struct sql_update update;
         struct sql_delete delete;
+        struct sql_transaction transaction;
+        struct sql_analyze analyze;
     } stmt;
+    uint8_t param_count;        /* ? placeholders, numbered 1.. in order */
 };
 
 /* Parser state */
@@ -147,6 +227,7 @@ struct sql_parser {
     struct sql_token next;      /* Lookahead token */
     char error_msg[256];        /* Error message */
     uint8_t has_error;          /* 1 if parse error occurred */
+    uint8_t param_count;        /* ? placeholders seen so far */
 };
 
 /* Parser API */
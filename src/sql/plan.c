@@ -0,0 +1,1917 @@
+/*
+ * plan.c - Query plans for SELECT
+ */
+
+#include "sql/plan.h"
+#include "sql/sort.h"
+#include "sql/hashjoin.h"
+#include "sql/predicate.h"
+#include "sql/stats.h"
+#include "storage/cache.h"
+#include "storage/pager.h"
+#include "txn/txn.h"
+#include "api/error.h"
+#include "os/mem.h"
+#include "util/endian.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Bytes before each row in a join's block: row size, ON column offset and size */
+#define JOIN_RECORD_HEADER  6
+
+/* Rows coming in that a block matches as cheaply as a hash would */
+#define JOIN_FEW_ROWS       48
+
+/* Phases of a hash join */
+#define HASH_BUILD          0
+#define HASH_PROBE          1
+#define HASH_PARTITIONS     2
+
+/* Largest row count or cost an estimate gives */
+#define PLAN_EST_MAX        0x7FFFFFFFUL
+
+/* Column index by name, -1 if the table has no such column */
+static int find_column(const struct table_schema *schema, const char *name) {
+    uint32_t i;
+
+    for (i = 0; i < schema->column_count; i++) {
+        if (strcmp(name, schema->columns[i].name) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+/* Schema of table t of the query (0: the FROM table) */
+static const struct table_schema *table_schema_of(const struct sql_plan *plan, uint32_t t) {
+    return (t == 0) ? plan->schema : plan->joins[t - 1].schema;
+}
+
+/* First column of table t in the joined row */
+static uint32_t table_base(const struct sql_plan *plan, uint32_t t) {
+    return (t == 0) ? 0 : plan->joins[t - 1].base;
+}
+
+/* Name table t's columns are qualified with: its alias, else its name */
+static const char *table_label(const struct sql_plan *plan, uint32_t t) {
+    const struct sql_select *select = plan->select;
+
+    if (t == 0) {
+        return select->alias[0] ? select->alias : select->table_name;
+    }
+    return select->joins[t - 1].alias[0] ? select->joins[t - 1].alias
+                                         : select->joins[t - 1].table_name;
+}
+
+/* Table a column of the joined row comes from */
+static uint32_t column_table(const struct sql_plan *plan, int col) {
+    uint32_t t = plan->join_count;
+
+    while (t > 0 && (uint32_t)col < plan->joins[t - 1].base) {
+        t--;
+    }
+    return t;
+}
+
+/*
+ * Column of the joined row a name refers to: column, or table.column
+ *
+ * Returns: the column, -1 if no table has it, -2 if more than one does
+ */
+static int resolve_column(const struct sql_plan *plan, const char *name) {
+    const char *dot = strchr(name, '.');
+    const char *label;
+    int found = -1;
+    int col;
+    uint32_t t;
+
+    for (t = 0; t <= plan->join_count; t++) {
+        if (dot != NULL) {
+            label = table_label(plan, t);
+            if (strlen(label) != (size_t)(dot - name) ||
+                strncmp(label, name, (size_t)(dot - name)) != 0) {
+                continue;
+            }
+            col = find_column(table_schema_of(plan, t), dot + 1);
+        } else {
+            col = find_column(table_schema_of(plan, t), name);
+        }
+        if (col >= 0) {
+            if (found >= 0) {
+                return -2;
+            }
+            found = (int)table_base(plan, t) + col;
+        }
+    }
+    return found;
+}
+
+/*
+ * Resolve a column the query names
+ *
+ * Returns: the column, or -1 (message in the plan; what names the
+ * column in it)
+ */
+static int query_column(struct sql_plan *plan, const char *name, const char *what) {
+    int col = resolve_column(plan, name);
+
+    if (col == -2) {
+        snprintf(plan->error_msg, sizeof(plan->error_msg), "Column '%s' is ambiguous", name);
+    } else if (col < 0) {
+        snprintf(plan->error_msg, sizeof(plan->error_msg), "%s '%s' not found", what, name);
+    }
+    return (col < 0) ? -1 : col;
+}
+
+/*
+ * Find a column of a stored row (row_serialize format)
+ *
+ * Points *field at the column's bytes, its type first, and sets
+ * *field_size; *field is NULL if the row has no such column or it is
+ * NULL.
+ *
+ * Returns: the row's size, or 0 if it is cut short
+ */
+static uint32_t stored_column(const uint8_t *buffer, uint32_t buffer_size, uint32_t column,
+                              const uint8_t **field, uint32_t *field_size) {
+    uint32_t offset = 2;
+    uint32_t start;
+    uint32_t count;
+    uint32_t i;
+    uint8_t type;
+
+    *field = NULL;
+    *field_size = 0;
+    if (buffer_size < 2) {
+        return 0;
+    }
+
+    count = get_u16(buffer);
+    for (i = 0; i < count; i++) {
+        start = offset;
+        if (offset >= buffer_size) {
+            return 0;
+        }
+        type = buffer[offset++];
+        if (type == AMIDB_TYPE_NULL) {
+            continue;
+        }
+        if (offset + 4 > buffer_size) {
+            return 0;
+        }
+        if (type != AMIDB_TYPE_INTEGER) {
+            if (get_u32(buffer + offset) > buffer_size - offset - 4) {
+                return 0;
+            }
+            offset += get_u32(buffer + offset);
+        }
+        offset += 4;
+        if (i == column) {
+            *field = buffer + start;
+            *field_size = offset - start;
+        }
+    }
+    return offset;
+}
+
+/*
+ * Get a row page for reading: through the snapshot if one is set
+ * (pinned either way; unpin with cache_unpin)
+ */
+static int read_row_page(struct sql_plan *plan, uint32_t row_page, uint8_t **page_data) {
+    if (plan->snapshot) {
+        return txn_snapshot_get_page(plan->snapshot, row_page, page_data);
+    }
+    return cache_get_page(plan->cache, row_page, page_data);
+}
+
+/*
+ * Read the row a tree entry points at, if it passes the WHERE left to
+ * test (tested on the stored row, before anything is decoded); an
+ * index-only plan makes the row from the key instead
+ *
+ * Returns: 0 if the row was read, 1 if it does not match, -1 on error
+ */
+static int load_row(struct sql_plan *plan, int32_t key, uint32_t row_page,
+                    struct amidb_row *row) {
+    uint8_t *page_data;
+    int rc;
+
+    if (plan->index_only) {
+        if (plan->schema->primary_key_index >= 0) {
+            row_set_int(row, (uint32_t)plan->schema->primary_key_index, key);
+        }
+        return 0;
+    }
+
+    if (read_row_page(plan, row_page, &page_data) != 0) {
+        return -1;
+    }
+    if (plan->has_filter &&
+        !predicate_matches_stored(&plan->filter, page_data + AMIDB_PAGE_HEADER_SIZE,
+                                  AMIDB_PAGE_SIZE - AMIDB_PAGE_HEADER_SIZE)) {
+        cache_unpin(plan->cache, row_page);
+        return 1;
+    }
+    rc = row_deserialize(row, page_data + AMIDB_PAGE_HEADER_SIZE,
+                         AMIDB_PAGE_SIZE - AMIDB_PAGE_HEADER_SIZE);
+    cache_unpin(plan->cache, row_page);
+
+    if (rc < 0) {
+        row_clear(row);
+        return -1;
+    }
+    return 0;
+}
+
+/* ========== WHERE ========== */
+
+/*
+ * Mark the PRIMARY KEY comparisons every row must pass as pushed down
+ *
+ * Only comparisons reached from the root through AND are candidates;
+ * one under OR or NOT does not have to hold for every row. NE bounds
+ * nothing, and a value that is not INTEGER (or a parameter, checked
+ * when the plan opens) is left to the filter.
+ */
+static void push_conjuncts(struct sql_plan *plan, uint32_t n) {
+    const struct sql_where *where = &plan->select->where;
+    const struct sql_where_node *node = &where->nodes[n];
+    const struct sql_condition *cond;
+
+    if (node->type == SQL_WHERE_AND) {
+        push_conjuncts(plan, node->left);
+        push_conjuncts(plan, node->right);
+        return;
+    }
+    if (node->type != SQL_WHERE_COMPARE) {
+        return;
+    }
+
+    cond = &where->conditions[node->left];
+    if (plan->where_columns[node->left] == plan->schema->primary_key_index &&
+        cond->op != SQL_OP_NE &&
+        (cond->value.type == SQL_VALUE_INTEGER || cond->value.type == SQL_VALUE_PARAM)) {
+        plan->pushed |= 1UL << node->left;
+    }
+}
+
+/* Conditions under a node (bit each) */
+static uint32_t where_conditions(const struct sql_where *where, uint32_t n) {
+    const struct sql_where_node *node = &where->nodes[n];
+
+    switch (node->type) {
+        case SQL_WHERE_COMPARE:
+            return 1UL << node->left;
+        case SQL_WHERE_AND:
+        case SQL_WHERE_OR:
+            return where_conditions(where, node->left) | where_conditions(where, node->right);
+        default:
+            return where_conditions(where, node->left);
+    }
+}
+
+/*
+ * Give each table of a join the parts of the WHERE that are on it alone
+ * and that every row must pass (joined to the rest by AND alone), to be
+ * tested on its stored rows; the rest is tested on the joined rows
+ */
+static void assign_conjuncts(struct sql_plan *plan, uint32_t n) {
+    const struct sql_where *where = &plan->select->where;
+    const struct sql_where_node *node = &where->nodes[n];
+    uint32_t conditions;
+    uint32_t table = 0;
+    uint32_t t;
+    uint32_t i;
+    int first = 1;
+
+    if (node->type == SQL_WHERE_AND) {
+        assign_conjuncts(plan, node->left);
+        assign_conjuncts(plan, node->right);
+        return;
+    }
+
+    conditions = where_conditions(where, n);
+    for (i = 0; i < where->condition_count; i++) {
+        if (!(conditions & (1UL << i))) {
+            continue;
+        }
+        if (plan->where_columns[i] < 0) {
+            return;                 /* Unknown column: left to the joined rows */
+        }
+        t = column_table(plan, plan->where_columns[i]);
+        if (!first && t != table) {
+            return;
+        }
+        table = t;
+        first = 0;
+    }
+
+    if (table == 0) {
+        plan->table_mask |= conditions;
+    } else {
+        plan->joins[table - 1].mask |= conditions;
+    }
+}
+
+/*
+ * Resolve the ON of join j: one side must be a column of its table, the
+ * other a column of a table before it
+ *
+ * Returns: 0 on success, -1 on error
+ */
+static int resolve_on(struct sql_plan *plan, uint32_t j) {
+    const struct sql_join *on = &plan->select->joins[j];
+    struct plan_join *join = &plan->joins[j];
+    int left;
+    int right;
+    int swap;
+
+    left = query_column(plan, on->left_column, "Column");
+    if (left < 0) {
+        return -1;
+    }
+    right = query_column(plan, on->right_column, "Column");
+    if (right < 0) {
+        return -1;
+    }
+    if (column_table(plan, left) == j + 1) {
+        swap = left;
+        left = right;
+        right = swap;
+    }
+    if (column_table(plan, right) != j + 1 || column_table(plan, left) > j) {
+        snprintf(plan->error_msg, sizeof(plan->error_msg),
+                 "ON must compare a column of '%s' with one of a table before it",
+                 table_label(plan, j + 1));
+        return -1;
+    }
+
+    join->outer_column = (uint8_t)left;
+    join->inner_column = (uint8_t)(right - join->base);
+    return 0;
+}
+
+/*
+ * Work out the keys the pushed-down comparisons allow (values are read
+ * now: a prepared statement binds them late)
+ *
+ * Returns: 0 on success, -1 on error
+ */
+static int bind_range(struct sql_plan *plan) {
+    const struct sql_where *where = &plan->select->where;
+    const struct sql_condition *cond;
+    int32_t low = INT32_MIN;
+    int32_t high = INT32_MAX;
+    int32_t v;
+    uint32_t i;
+
+    plan->range_empty = 0;
+    for (i = 0; i < where->condition_count; i++) {
+        if (!(plan->pushed & (1UL << i))) {
+            continue;
+        }
+        cond = &where->conditions[i];
+        if (cond->value.type != SQL_VALUE_INTEGER) {
+            if (cond->op == SQL_OP_EQ) {
+                snprintf(plan->error_msg, sizeof(plan->error_msg),
+                         "WHERE on PRIMARY KEY requires INTEGER value");
+                return -1;
+            }
+            plan->range_empty = 1;      /* Compares as unknown for every row */
+            continue;
+        }
+
+        v = cond->value.int_value;
+        switch (cond->op) {
+            case SQL_OP_EQ:
+                if (v > low) low = v;
+                if (v < high) high = v;
+                break;
+            case SQL_OP_GT:
+                if (v == INT32_MAX) plan->range_empty = 1;
+                else if (v + 1 > low) low = v + 1;
+                break;
+            case SQL_OP_GE:
+                if (v > low) low = v;
+                break;
+            case SQL_OP_LT:
+                if (v == INT32_MIN) plan->range_empty = 1;
+                else if (v - 1 < high) high = v - 1;
+                break;
+            case SQL_OP_LE:
+                if (v < high) high = v;
+                break;
+        }
+    }
+
+    if (low > high) {
+        plan->range_empty = 1;
+    }
+    plan->seek_key = low;
+    plan->range_end = high;
+    return 0;
+}
+
+/* ========== Operators ========== */
+
+/* scan: every row in key order */
+static int scan_open(struct sql_operator *op) {
+    /* An empty tree leaves the cursor invalid */
+    btree_cursor_first(op->plan->tree, &op->u.scan.cursor);
+    return 0;
+}
+
+static int scan_next(struct sql_operator *op, struct amidb_row *row) {
+    struct btree_cursor *cursor = &op->u.scan.cursor;
+    uint32_t row_page;
+    int32_t key;
+
+    while (cursor->valid) {
+        key = cursor->key;
+        row_page = cursor->value;
+        btree_cursor_next(cursor);
+
+        /* Unreadable rows are skipped */
+        if (load_row(op->plan, key, row_page, row) == 0) {
+            return AMIDB_ROW;
+        }
+    }
+    return AMIDB_DONE;
+}
+
+/* seek: the one row with the primary key in WHERE pk = n */
+/* (n is read when opened: a prepared statement binds it late) */
+static int seek_open(struct sql_operator *op) {
+    if (bind_range(op->plan) != 0) {
+        return -1;
+    }
+    op->u.seek.done = op->plan->range_empty;
+    return 0;
+}
+
+static int seek_next(struct sql_operator *op, struct amidb_row *row) {
+    uint32_t row_page;
+
+    if (op->u.seek.done) {
+        return AMIDB_DONE;
+    }
+    op->u.seek.done = 1;
+
+    if (btree_search(op->plan->tree, op->plan->seek_key, &row_page) != 0 ||
+        load_row(op->plan, op->plan->seek_key, row_page, row) != 0) {
+        return AMIDB_DONE;
+    }
+    return AMIDB_ROW;
+}
+
+/* range: rows with primary keys from seek_key to range_end, in key order */
+static int range_open(struct sql_operator *op) {
+    struct sql_plan *plan = op->plan;
+
+    if (bind_range(plan) != 0) {
+        return -1;
+    }
+    if (plan->range_empty) {
+        op->u.range.cursor.valid = 0;
+        return 0;
+    }
+    if (btree_cursor_seek(plan->tree, plan->seek_key, &op->u.range.cursor) != 0) {
+        snprintf(plan->error_msg, sizeof(plan->error_msg), "Failed to read table B+Tree");
+        return -1;
+    }
+    return 0;
+}
+
+static int range_next(struct sql_operator *op, struct amidb_row *row) {
+    struct btree_cursor *cursor = &op->u.range.cursor;
+    uint32_t row_page;
+    int32_t key;
+
+    while (cursor->valid && cursor->key <= op->plan->range_end) {
+        key = cursor->key;
+        row_page = cursor->value;
+        btree_cursor_next(cursor);
+
+        /* Unreadable rows are skipped */
+        if (load_row(op->plan, key, row_page, row) == 0) {
+            return AMIDB_ROW;
+        }
+    }
+    return AMIDB_DONE;
+}
+
+/* sort: every input row, then in ORDER BY order (spilling past sort_memory) */
+/* topk: the same, keeping only the LIMIT first rows */
+static int sort_open(struct sql_operator *op) {
+    struct sql_plan *plan = op->plan;
+    struct sql_sorter *sorter;
+    struct amidb_row row;
+    int rc;
+
+    sorter = (struct sql_sorter *)malloc(sizeof(struct sql_sorter));
+    if (sorter == NULL ||
+        sorter_init(sorter, plan->pager->file_path, plan->sort_memory,
+                    (uint32_t)plan->order_column, plan->select->order_by.ascending,
+                    (op->type == PLAN_OP_TOPK) ? (uint32_t)plan->select->limit : 0) != AMIDB_OK) {
+        if (sorter) {
+            sorter_close(sorter);
+            free(sorter);
+        }
+        snprintf(plan->error_msg, sizeof(plan->error_msg), "Out of memory for ORDER BY");
+        return -1;
+    }
+    op->u.sort.sorter = sorter;
+
+    row_init(&row);
+    while ((rc = op->child->next(op->child, &row)) == AMIDB_ROW) {
+        rc = sorter_add(sorter, &row);
+        row_clear(&row);
+        if (rc != AMIDB_OK) {
+            break;
+        }
+    }
+    if (rc == AMIDB_DONE) {
+        rc = sorter_finish(sorter);
+    } else if (rc == AMIDB_ERROR) {
+        return -1;                  /* The child set the message */
+    }
+
+    plan->sort_runs = sorter->runs_written;
+    plan->sort_passes = sorter->merge_passes;
+
+    if (rc == AMIDB_NOMEM) {
+        snprintf(plan->error_msg, sizeof(plan->error_msg), "Out of memory for ORDER BY");
+        return -1;
+    }
+    if (rc == AMIDB_FULL) {
+        snprintf(plan->error_msg, sizeof(plan->error_msg), "Row too large for ORDER BY");
+        return -1;
+    }
+    if (rc != AMIDB_OK) {
+        snprintf(plan->error_msg, sizeof(plan->error_msg),
+                 "Failed to write ORDER BY temporary file");
+        return -1;
+    }
+    return 0;
+}
+
+static int sort_next(struct sql_operator *op, struct amidb_row *row) {
+    int rc = sorter_next(op->u.sort.sorter, row);
+
+    if (rc != AMIDB_ROW && rc != AMIDB_DONE) {
+        snprintf(op->plan->error_msg, sizeof(op->plan->error_msg),
+                 "Failed to read ORDER BY temporary file");
+        return AMIDB_ERROR;
+    }
+    return rc;
+}
+
+static void sort_close(struct sql_operator *op) {
+    if (op->u.sort.sorter == NULL) {
+        return;
+    }
+    sorter_close(op->u.sort.sorter);
+    free(op->u.sort.sorter);
+    op->u.sort.sorter = NULL;
+}
+
+/* project: the selected columns, in select-list order */
+static int project_next(struct sql_operator *op, struct amidb_row *row) {
+    struct sql_plan *plan = op->plan;
+    struct amidb_row *out = &plan->scratch;
+    struct amidb_value *val;
+    uint8_t moved[32];
+    uint32_t i;
+    int rc;
+
+    rc = op->child->next(op->child, row);
+    if (rc != AMIDB_ROW) {
+        return rc;
+    }
+
+    /* Values move to the new row; a column selected twice is copied */
+    memset(moved, 0, sizeof(moved));
+    row_init(out);
+    for (i = 0; i < plan->projection_count; i++) {
+        uint8_t col = plan->projection[i];
+
+        if (col >= row->column_count) {
+            row_set_null(out, i);
+        } else if (!moved[col]) {
+            out->values[i] = row->values[col];
+            out->column_count = i + 1;
+            moved[col] = 1;
+        } else {
+            val = &row->values[col];
+            if (val->type == AMIDB_TYPE_INTEGER) {
+                rc = row_set_int(out, i, val->u.i);
+            } else if (val->type == AMIDB_TYPE_TEXT && val->u.blob.size > 0) {
+                rc = row_set_text(out, i, (const char *)val->u.blob.data, val->u.blob.size);
+            } else if (val->type == AMIDB_TYPE_BLOB) {
+                rc = row_set_blob(out, i, val->u.blob.data, val->u.blob.size);
+            } else {
+                rc = row_set_null(out, i);
+                out->values[i].type = val->type;
+            }
+            if (rc != 0) {
+                snprintf(plan->error_msg, sizeof(plan->error_msg), "Out of memory");
+                for (col = 0; col < 32; col++) {
+                    if (moved[col]) {
+                        row->values[col].type = AMIDB_TYPE_NULL;
+                    }
+                }
+                row_clear(out);
+                row_clear(row);
+                return AMIDB_ERROR;
+            }
+        }
+    }
+
+    /* Drop the columns not selected */
+    for (i = 0; i < 32; i++) {
+        if (moved[i]) {
+            row->values[i].type = AMIDB_TYPE_NULL;
+            row->values[i].u.blob.data = NULL;
+        }
+    }
+    row_clear(row);
+    *row = *out;
+    return AMIDB_ROW;
+}
+
+/* limit: the first LIMIT rows */
+static int limit_open(struct sql_operator *op) {
+    op->u.limit.returned = 0;
+    return 0;
+}
+
+static int limit_next(struct sql_operator *op, struct amidb_row *row) {
+    int rc;
+
+    if (op->u.limit.returned >= (uint32_t)op->plan->select->limit) {
+        return AMIDB_DONE;
+    }
+    rc = op->child->next(op->child, row);
+    if (rc == AMIDB_ROW) {
+        op->u.limit.returned++;
+    }
+    return rc;
+}
+
+/* aggregate: one row holding COUNT / SUM / AVG / MIN / MAX */
+static int aggregate_open(struct sql_operator *op) {
+    op->u.aggregate.done = 0;
+    return 0;
+}
+
+static int aggregate_next(struct sql_operator *op, struct amidb_row *row) {
+    struct sql_plan *plan = op->plan;
+    uint8_t aggregate = plan->select->aggregate;
+    const struct amidb_value *val;
+    struct amidb_row input;
+    int32_t result = 0;
+    int32_t count = 0;
+    int rc;
+
+    if (op->u.aggregate.done) {
+        return AMIDB_DONE;
+    }
+    op->u.aggregate.done = 1;
+
+    row_init(&input);
+    while ((rc = op->child->next(op->child, &input)) == AMIDB_ROW) {
+        if (aggregate == SQL_AGG_COUNT_STAR) {
+            count++;
+        } else {
+            /* NULLs are skipped; only INTEGERs are added up */
+            val = row_get_value(&input, (uint32_t)plan->agg_column);
+            if (val != NULL && val->type != AMIDB_TYPE_NULL &&
+                (aggregate == SQL_AGG_COUNT || val->type == AMIDB_TYPE_INTEGER)) {
+                if (aggregate == SQL_AGG_SUM || aggregate == SQL_AGG_AVG) {
+                    result += val->u.i;
+                } else if (aggregate == SQL_AGG_MIN) {
+                    if (count == 0 || val->u.i < result) {
+                        result = val->u.i;
+                    }
+                } else if (aggregate == SQL_AGG_MAX) {
+                    if (count == 0 || val->u.i > result) {
+                        result = val->u.i;
+                    }
+                }
+                count++;
+            }
+        }
+        row_clear(&input);
+    }
+    if (rc != AMIDB_DONE) {
+        return rc;
+    }
+
+    /* An empty input gives 0; AVG is an integer division */
+    if (aggregate == SQL_AGG_COUNT || aggregate == SQL_AGG_COUNT_STAR) {
+        result = count;
+    } else if (aggregate == SQL_AGG_AVG) {
+        result = (count > 0) ? result / count : 0;
+    }
+
+    row_set_int(row, 0, result);
+    return AMIDB_ROW;
+}
+
+/* join: each row coming in with every row of the joined table whose */
+/* ON column holds the same value (rows whose value is NULL match none) */
+
+/*
+ * Put a joined table's stored row in the columns after the row's
+ *
+ * Returns: 0 on success, -1 if the stored row cannot be read
+ */
+static int join_append(struct plan_join *join, const uint8_t *stored, uint32_t size,
+                       struct amidb_row *row) {
+    struct amidb_row inner;
+    uint32_t i;
+
+    row_init(&inner);
+    if (row_deserialize(&inner, stored, size) < 0 ||
+        join->base + inner.column_count > AMIDB_MAX_COLUMNS) {
+        row_clear(&inner);
+        return -1;
+    }
+    for (i = 0; i < inner.column_count; i++) {
+        row->values[join->base + i] = inner.values[i];
+    }
+    row->column_count = join->base + inner.column_count;
+    return 0;
+}
+
+/* Does a joined row pass the WHERE conditions on more than one table? */
+static int join_matches(struct sql_plan *plan, const struct plan_join *join,
+                        const struct amidb_row *row) {
+    return !join->last || !plan->has_join_filter || predicate_matches(&plan->join_filter, row);
+}
+
+/*
+ * Make the joined row of a stored row coming in and a stored row of the
+ * table
+ *
+ * Returns: 1 if it passes the WHERE, else 0 (row left empty)
+ */
+static int join_stored(struct sql_plan *plan, struct plan_join *join,
+                       const uint8_t *outer, uint32_t outer_size,
+                       const uint8_t *inner, uint32_t inner_size, struct amidb_row *row) {
+    if (row_deserialize(row, outer, outer_size) >= 0 &&
+        join_append(join, inner, inner_size, row) == 0 &&
+        join_matches(plan, join, row)) {
+        return 1;
+    }
+    row_clear(row);
+    return 0;
+}
+
+/*
+ * Copy the table's row at the cursor to buf and move the cursor on;
+ * rows its WHERE filter rejects, rows whose ON value is NULL and rows
+ * that cannot be read are passed over
+ *
+ * Returns: the row's size (its ON value at *key, *key_size bytes), or 0
+ */
+static uint32_t join_read_inner(struct sql_plan *plan, struct plan_join *join, uint8_t *buf,
+                                uint32_t *key, uint32_t *key_size) {
+    uint32_t row_page = join->cursor.value;
+    const uint8_t *field;
+    uint8_t *page_data;
+    uint8_t *stored;
+    uint32_t size = 0;
+
+    btree_cursor_next(&join->cursor);
+    if (read_row_page(plan, row_page, &page_data) != 0) {
+        return 0;
+    }
+    stored = page_data + AMIDB_PAGE_HEADER_SIZE;
+    if (!join->has_filter ||
+        predicate_matches_stored(&join->filter, stored, AMIDB_PAGE_SIZE - AMIDB_PAGE_HEADER_SIZE)) {
+        size = stored_column(stored, AMIDB_PAGE_SIZE - AMIDB_PAGE_HEADER_SIZE,
+                             join->inner_column, &field, key_size);
+        if (field == NULL) {
+            size = 0;
+        } else if (size > 0) {
+            memcpy(buf, stored, size);
+            *key = (uint32_t)(field - stored);
+        }
+    }
+    cache_unpin(plan->cache, row_page);
+    return size;
+}
+
+static int join_open(struct sql_operator *op) {
+    struct sql_plan *plan = op->plan;
+    struct plan_join *join = op->u.join.join;
+
+    join->block_used = 0;
+    join->block_pos = 0;
+    join->inner_size = 0;
+    join->outer_done = 0;
+    join->phase = HASH_BUILD;
+    if (join->strategy == PLAN_JOIN_BLOCK) {
+        join->block = (uint8_t *)malloc(PLAN_JOIN_MEMORY + AMIDB_PAGE_SIZE);
+        if (join->block == NULL) {
+            snprintf(plan->error_msg, sizeof(plan->error_msg), "Out of memory for JOIN");
+            return -1;
+        }
+    } else if (join->strategy == PLAN_JOIN_HASH) {
+        /* A stored row of each table joined so far fits */
+        join->record_capacity = (uint32_t)(join - plan->joins + 1) * AMIDB_PAGE_SIZE;
+        join->record = (uint8_t *)malloc(join->record_capacity);
+        join->hasher = (struct sql_hasher *)malloc(sizeof(struct sql_hasher));
+        if (join->record == NULL || join->hasher == NULL ||
+            hasher_init(join->hasher, plan->pager->file_path, plan->join_memory,
+                        join->build_rows, join->build_bytes) != AMIDB_OK) {
+            free(join->hasher);
+            join->hasher = NULL;
+            snprintf(plan->error_msg, sizeof(plan->error_msg), "Out of memory for JOIN");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Index nested loop: look the row up by PRIMARY KEY */
+static int join_index_next(struct sql_operator *op, struct amidb_row *row) {
+    struct sql_plan *plan = op->plan;
+    struct plan_join *join = op->u.join.join;
+    const struct amidb_value *val;
+    uint8_t *page_data;
+    uint8_t *stored;
+    uint32_t row_page;
+    int matched;
+    int rc;
+
+    for (;;) {
+        rc = op->child->next(op->child, row);
+        if (rc != AMIDB_ROW) {
+            return rc;
+        }
+
+        val = &row->values[join->outer_column];
+        matched = 0;
+        if (join->outer_column < row->column_count && val->type == AMIDB_TYPE_INTEGER &&
+            btree_search(join->tree, val->u.i, &row_page) == 0 &&
+            read_row_page(plan, row_page, &page_data) == 0) {
+            stored = page_data + AMIDB_PAGE_HEADER_SIZE;
+            matched = (!join->has_filter ||
+                       predicate_matches_stored(&join->filter, stored,
+                                                AMIDB_PAGE_SIZE - AMIDB_PAGE_HEADER_SIZE)) &&
+                      join_append(join, stored, AMIDB_PAGE_SIZE - AMIDB_PAGE_HEADER_SIZE,
+                                  row) == 0;
+            cache_unpin(plan->cache, row_page);
+        }
+        if (matched && join_matches(plan, join, row)) {
+            return AMIDB_ROW;
+        }
+        row_clear(row);
+    }
+}
+
+/*
+ * Add a row coming in to the block, with where its ON value lies (a
+ * row whose value is NULL is dropped)
+ *
+ * Returns: 0 if it was added or dropped, 1 if the block is full
+ */
+static int block_add(struct plan_join *join, const struct amidb_row *row) {
+    uint8_t *record = join->block + join->block_used;
+    const uint8_t *key;
+    uint32_t key_size;
+    int size;
+
+    if (join->block_used + JOIN_RECORD_HEADER >= PLAN_JOIN_MEMORY) {
+        return 1;
+    }
+    size = row_serialize(row, record + JOIN_RECORD_HEADER,
+                         PLAN_JOIN_MEMORY - join->block_used - JOIN_RECORD_HEADER);
+    if (size < 0) {
+        return 1;
+    }
+    stored_column(record + JOIN_RECORD_HEADER, (uint32_t)size, join->outer_column,
+                  &key, &key_size);
+    if (key == NULL) {
+        return 0;
+    }
+
+    put_u16(record, (uint16_t)size);
+    put_u16(record + 2, (uint16_t)(key - (record + JOIN_RECORD_HEADER)));
+    put_u16(record + 4, (uint16_t)key_size);
+    join->block_used += JOIN_RECORD_HEADER + (uint32_t)size;
+    return 0;
+}
+
+/*
+ * Block nested loop: fill the block with rows coming in, then walk the
+ * table once, matching each of its rows with every row of the block
+ * (values match when their stored bytes do)
+ */
+static int join_block_next(struct sql_operator *op, struct amidb_row *row) {
+    struct sql_plan *plan = op->plan;
+    struct plan_join *join = op->u.join.join;
+    uint8_t *inner = join->block + PLAN_JOIN_MEMORY;
+    uint8_t *record;
+    uint32_t size;
+    int rc;
+
+    for (;;) {
+        /* Rows of the block that match the table's row */
+        while (join->inner_size > 0 && join->block_pos < join->block_used) {
+            record = join->block + join->block_pos;
+            size = get_u16(record);
+            join->block_pos += JOIN_RECORD_HEADER + size;
+            if (get_u16(record + 4) != join->inner_key_size ||
+                memcmp(record + JOIN_RECORD_HEADER + get_u16(record + 2), inner + join->inner_key,
+                       join->inner_key_size) != 0) {
+                continue;
+            }
+            if (join_stored(plan, join, record + JOIN_RECORD_HEADER, size,
+                            inner, join->inner_size, row)) {
+                return AMIDB_ROW;
+            }
+        }
+
+        /* The table's next row */
+        if (join->block_used > 0 && join->cursor.valid) {
+            join->block_pos = 0;
+            join->inner_size = join_read_inner(plan, join, inner, &join->inner_key,
+                                               &join->inner_key_size);
+            continue;
+        }
+
+        /* The next block */
+        join->block_used = 0;
+        join->inner_size = 0;
+        while (!join->outer_done) {
+            if (join->has_pending) {
+                *row = join->pending;
+                row_init(&join->pending);
+                join->has_pending = 0;
+            } else {
+                rc = op->child->next(op->child, row);
+                if (rc == AMIDB_DONE) {
+                    join->outer_done = 1;
+                    break;
+                }
+                if (rc != AMIDB_ROW) {
+                    return rc;
+                }
+            }
+            if (block_add(join, row) != 0) {
+                if (join->block_used == 0) {
+                    row_clear(row);
+                    snprintf(plan->error_msg, sizeof(plan->error_msg), "Row too large for JOIN");
+                    return AMIDB_ERROR;
+                }
+                join->pending = *row;
+                join->has_pending = 1;
+                row_init(row);
+                break;
+            }
+            row_clear(row);
+        }
+        if (join->block_used == 0) {
+            return AMIDB_DONE;
+        }
+        btree_cursor_first(join->tree, &join->cursor);
+    }
+}
+
+/* Report a hasher's failure */
+static int hash_failed(struct sql_plan *plan, int rc, const char *io) {
+    if (rc == AMIDB_FULL) {
+        snprintf(plan->error_msg, sizeof(plan->error_msg), "Row too large for JOIN");
+    } else {
+        snprintf(plan->error_msg, sizeof(plan->error_msg),
+                 "Failed to %s JOIN temporary file", io);
+    }
+    return AMIDB_ERROR;
+}
+
+/*
+ * Put the next row of one side of a hash join in join->record: a row
+ * coming in, serialized, or a row of the table (rows whose ON value is
+ * NULL match nothing and are passed over)
+ *
+ * Returns: AMIDB_ROW, AMIDB_DONE, or AMIDB_ERROR
+ */
+static int hash_side_next(struct sql_operator *op, struct amidb_row *row, int outer) {
+    struct sql_plan *plan = op->plan;
+    struct plan_join *join = op->u.join.join;
+    const uint8_t *key;
+    int size;
+    int rc;
+
+    for (;;) {
+        if (!outer) {
+            if (!join->cursor.valid) {
+                return AMIDB_DONE;
+            }
+            join->record_size = join_read_inner(plan, join, join->record, &join->record_key,
+                                                &join->record_key_size);
+            if (join->record_size > 0) {
+                return AMIDB_ROW;
+            }
+            continue;
+        }
+
+        rc = op->child->next(op->child, row);
+        if (rc != AMIDB_ROW) {
+            return rc;
+        }
+        size = row_serialize(row, join->record, join->record_capacity);
+        row_clear(row);
+        if (size < 0) {
+            snprintf(plan->error_msg, sizeof(plan->error_msg), "Row too large for JOIN");
+            return AMIDB_ERROR;
+        }
+        stored_column(join->record, (uint32_t)size, join->outer_column, &key,
+                      &join->record_key_size);
+        if (key != NULL) {
+            join->record_size = (uint32_t)size;
+            join->record_key = (uint32_t)(key - join->record);
+            return AMIDB_ROW;
+        }
+    }
+}
+
+/* Joined row of a hashed row and the row that probed it */
+static int join_hashed(struct sql_plan *plan, struct plan_join *join,
+                       const uint8_t *build, uint32_t build_size,
+                       const uint8_t *probe, uint32_t probe_size, struct amidb_row *row) {
+    if (join->build_outer) {
+        return join_stored(plan, join, build, build_size, probe, probe_size, row);
+    }
+    return join_stored(plan, join, probe, probe_size, build, build_size, row);
+}
+
+/*
+ * Hash join: hash every row of the smaller side, then probe with each
+ * row of the other, in turn; if the hasher ran out of memory it
+ * partitioned both sides, and the partitions are joined last
+ */
+static int join_hash_next(struct sql_operator *op, struct amidb_row *row) {
+    struct sql_plan *plan = op->plan;
+    struct plan_join *join = op->u.join.join;
+    struct sql_hasher *hasher = join->hasher;
+    const uint8_t *build;
+    const uint8_t *probe;
+    uint32_t build_size;
+    uint32_t probe_size;
+    int rc;
+
+    if (join->phase == HASH_BUILD) {
+        btree_cursor_first(join->tree, &join->cursor);
+        while ((rc = hash_side_next(op, row, join->build_outer)) == AMIDB_ROW) {
+            rc = hasher_build(hasher, join->record, join->record_size, join->record_key,
+                              join->record_key_size);
+            if (rc != AMIDB_OK) {
+                return hash_failed(plan, rc, "write");
+            }
+        }
+        if (rc != AMIDB_DONE) {
+            return rc;
+        }
+        join->phase = HASH_PROBE;
+    }
+
+    while (join->phase == HASH_PROBE) {
+        /* Rows hashed that match the row probing */
+        while (hasher_match(hasher, &build, &build_size) == AMIDB_ROW) {
+            if (join_hashed(plan, join, build, build_size, join->record, join->record_size, row)) {
+                return AMIDB_ROW;
+            }
+        }
+
+        rc = hash_side_next(op, row, !join->build_outer);
+        if (rc == AMIDB_ROW) {
+            rc = hasher_probe(hasher, join->record, join->record_size, join->record_key,
+                              join->record_key_size);
+            if (rc != AMIDB_OK) {
+                return hash_failed(plan, rc, "write");
+            }
+        } else if (rc == AMIDB_DONE) {
+            rc = hasher_finish(hasher);
+            if (rc != AMIDB_OK) {
+                return hash_failed(plan, rc, "write");
+            }
+            plan->join_partitions = hasher->partitions_written;
+            join->phase = HASH_PARTITIONS;
+        } else {
+            return rc;
+        }
+    }
+
+    /* Partitions written to disk, joined one at a time */
+    for (;;) {
+        rc = hasher_next(hasher, &build, &build_size, &probe, &probe_size);
+        if (rc != AMIDB_ROW) {
+            return (rc == AMIDB_DONE) ? AMIDB_DONE : hash_failed(plan, rc, "read");
+        }
+        if (join_hashed(plan, join, build, build_size, probe, probe_size, row)) {
+            return AMIDB_ROW;
+        }
+    }
+}
+
+static int join_next(struct sql_operator *op, struct amidb_row *row) {
+    if (op->u.join.join->strategy == PLAN_JOIN_INDEX) {
+        return join_index_next(op, row);
+    }
+    if (op->u.join.join->strategy == PLAN_JOIN_HASH) {
+        return join_hash_next(op, row);
+    }
+    return join_block_next(op, row);
+}
+
+static void join_close(struct sql_operator *op) {
+    struct plan_join *join = op->u.join.join;
+
+    row_clear(&join->pending);
+    join->has_pending = 0;
+    if (join->block) {
+        free(join->block);
+        join->block = NULL;
+    }
+    if (join->hasher) {
+        hasher_close(join->hasher);
+        free(join->hasher);
+        join->hasher = NULL;
+    }
+    if (join->record) {
+        free(join->record);
+        join->record = NULL;
+    }
+}
+
+/* Operators without state to set up or free */
+static int op_open_child(struct sql_operator *op) {
+    (void)op;
+    return 0;
+}
+
+static void op_close_none(struct sql_operator *op) {
+    (void)op;
+}
+
+/* Put an operator on top of the pipeline */
+static void plan_push(struct sql_plan *plan, uint8_t type,
+                      int (*open)(struct sql_operator *),
+                      int (*next)(struct sql_operator *, struct amidb_row *),
+                      void (*close)(struct sql_operator *)) {
+    struct sql_operator *op = &plan->operators[plan->operator_count++];
+
+    memset(op, 0, sizeof(*op));
+    op->type = type;
+    op->open = open ? open : op_open_child;
+    op->next = next;
+    op->close = close ? close : op_close_none;
+    op->child = plan->root;
+    op->plan = plan;
+    plan->root = op;
+}
+
+/* ========== Costs ========== */
+
+/* Does the query need no column but the PRIMARY KEY? */
+static int keys_suffice(const struct sql_plan *plan) {
+    const struct sql_select *select = plan->select;
+    int pk = plan->schema->primary_key_index;
+    uint32_t i;
+
+    if (plan->join_count > 0) {
+        return 0;
+    }
+    if (select->aggregate == SQL_AGG_COUNT_STAR) {
+        return 1;
+    }
+    if (pk < 0 || select->select_all) {
+        return 0;
+    }
+    if (select->aggregate != SQL_AGG_NONE) {
+        return plan->agg_column == pk;
+    }
+    if (plan->order_column >= 0 && plan->order_column != pk) {
+        return 0;
+    }
+    for (i = 0; i < plan->projection_count; i++) {
+        if (plan->projection[i] != pk) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Cost the access paths the WHERE allows and push the cheapest
+ *
+ * A walk reads the leaves it passes and, unless it is index only, the
+ * page of each row. Ties go to the narrower path.
+ */
+static void choose_access(struct sql_plan *plan, int use_seek) {
+    const struct sql_select *select = plan->select;
+    const struct table_schema *schema = plan->schema;
+    uint32_t all = plan->table_mask;
+    uint32_t rows = schema->row_count;
+    uint32_t height = 1;
+    uint32_t range_rows;
+    uint32_t best_rows = rows;
+    uint32_t best_cost;
+    uint32_t cost;
+    uint32_t n;
+    uint8_t best = PLAN_OP_SCAN;
+    int keys_only = keys_suffice(plan);
+    int pushed_only = keys_only && plan->pushed == all;
+
+    for (n = rows; n > PLAN_LEAF_KEYS; n /= PLAN_LEAF_KEYS) {
+        height++;
+    }
+
+    /* scan: every leaf */
+    best_cost = rows / PLAN_LEAF_KEYS + 1 + ((keys_only && all == 0) ? 0 : rows);
+
+    if (plan->pushed) {
+        /* range: down the tree (an LSM tree is walked from its first key) */
+        range_rows = stats_rows(rows, stats_selectivity(schema, &select->where, plan->pushed));
+        cost = (plan->tree->engine == BTREE_ENGINE_LSM) ? rows / PLAN_LEAF_KEYS + 1 : height;
+        cost += range_rows / PLAN_LEAF_KEYS + (pushed_only ? 0 : range_rows);
+        if (cost <= best_cost) {
+            best = PLAN_OP_RANGE;
+            best_cost = cost;
+            best_rows = range_rows;
+        }
+
+        /* seek: down the tree to one key */
+        cost = height + (pushed_only ? 0 : 1);
+        if (use_seek && cost <= best_cost) {
+            best = PLAN_OP_SEEK;
+            best_cost = cost;
+            best_rows = (rows > 0) ? 1 : 0;
+        }
+    }
+
+    if (best == PLAN_OP_SEEK) {
+        plan_push(plan, PLAN_OP_SEEK, seek_open, seek_next, NULL);
+    } else if (best == PLAN_OP_RANGE) {
+        plan_push(plan, PLAN_OP_RANGE, range_open, range_next, NULL);
+    } else {
+        plan->pushed = 0;           /* The filter tests every condition */
+        plan_push(plan, PLAN_OP_SCAN, scan_open, scan_next, NULL);
+    }
+    plan->has_filter = plan->pushed != all;
+    plan->index_only = keys_only && !plan->has_filter;
+
+    plan->root->est_cost = best_cost;
+    plan->root->est_rows = stats_rows(best_rows,
+                                      stats_selectivity(schema, &select->where, all & ~plan->pushed));
+}
+
+/* a * b / c for an estimate, kept to PLAN_EST_MAX */
+static uint32_t scale_rows(uint32_t a, uint32_t b, uint32_t c) {
+    uint32_t r;
+
+    if (c == 0) {
+        c = 1;
+    }
+    if (b == 0 || a <= PLAN_EST_MAX / b) {
+        r = a * b / c;
+    } else {
+        a /= c;                     /* Near enough */
+        r = (a <= PLAN_EST_MAX / b) ? a * b : PLAN_EST_MAX;
+    }
+    return r;
+}
+
+/* Stored bytes of a row of the first tables of the query, joined */
+static uint32_t joined_row_bytes(const struct sql_plan *plan, uint32_t tables) {
+    const struct table_schema *schema;
+    uint32_t bytes = 0;
+    uint32_t t;
+
+    for (t = 0; t < tables; t++) {
+        schema = table_schema_of(plan, t);
+        bytes += schema->row_bytes ? schema->row_bytes : PLAN_ROW_BYTES;
+    }
+    return bytes;
+}
+
+/* Rows coming in a block of join j is expected to hold */
+static uint32_t join_block_rows(const struct sql_plan *plan, uint32_t j) {
+    return PLAN_JOIN_MEMORY / (joined_row_bytes(plan, j + 1) + JOIN_RECORD_HEADER);
+}
+
+/* Distinct values of a column (taken as unique without statistics) */
+static uint32_t column_distinct(const struct table_schema *schema, uint32_t col) {
+    if (schema->analyzed_rows > 0 && (int)col != schema->primary_key_index &&
+        schema->stats[col].distinct > 0) {
+        return schema->stats[col].distinct;
+    }
+    return (schema->row_count > 0) ? schema->row_count : 1;
+}
+
+/*
+ * Estimate a join and, if choose is set, pick its strategy
+ *
+ * A lookup goes down the table's tree and reads a row for each row
+ * coming in; a block nested loop reads the whole table once per block;
+ * a hash join reads it once, and if the smaller side does not fit its
+ * memory, writes both sides out and reads them back. Each row coming
+ * in meets the table's rows that share its value: one at most for a
+ * PRIMARY KEY, else the rows over the distinct values of the two ON
+ * columns (the more of them).
+ */
+static void estimate_join(struct sql_plan *plan, struct sql_operator *op, int choose) {
+    struct plan_join *join = op->u.join.join;
+    const struct table_schema *schema = join->schema;
+    uint32_t j = (uint32_t)(join - plan->joins);
+    uint32_t rows_in = op->child->est_rows;
+    uint32_t rows = schema->row_count;
+    uint32_t kept = stats_rows(rows, stats_selectivity(schema, &plan->select->where, join->mask));
+    uint32_t per_block = join_block_rows(plan, j);
+    uint32_t owner = column_table(plan, join->outer_column);
+    int by_key = (int)join->inner_column == schema->primary_key_index;
+    uint32_t scan = rows / PLAN_LEAF_KEYS + 1 + rows;
+    uint32_t inner_row = schema->row_bytes ? schema->row_bytes : PLAN_ROW_BYTES;
+    uint32_t outer_bytes = scale_rows(rows_in, joined_row_bytes(plan, j + 1) + HASHER_RECORD_HEADER, 1);
+    uint32_t inner_bytes = scale_rows(kept, inner_row + HASHER_RECORD_HEADER, 1);
+    uint32_t height = 1;
+    uint32_t index_cost;
+    uint32_t block_cost;
+    uint32_t hash_cost;
+    uint32_t spill;
+    uint32_t cost;
+    uint32_t distinct;
+    uint32_t n;
+
+    for (n = rows; n > PLAN_LEAF_KEYS; n /= PLAN_LEAF_KEYS) {
+        height++;
+    }
+    index_cost = scale_rows(rows_in, height + 1, 1);
+    block_cost = scale_rows(rows_in / (per_block ? per_block : 1) + 1, scan, 1);
+
+    /* The smaller side is hashed */
+    if (choose) {
+        join->build_outer = (outer_bytes < inner_bytes);
+    }
+    join->build_rows = join->build_outer ? rows_in : kept;
+    join->build_bytes = join->build_outer ? outer_bytes : inner_bytes;
+    hash_cost = scan;
+    if (hasher_partitions(plan->join_memory, join->build_bytes) > 0) {
+        spill = 2 * (outer_bytes / AMIDB_PAGE_SIZE + inner_bytes / AMIDB_PAGE_SIZE + 2);
+        hash_cost = (hash_cost < PLAN_EST_MAX - spill) ? hash_cost + spill : PLAN_EST_MAX;
+    }
+
+    if (choose) {
+        if (by_key && index_cost <= block_cost && index_cost <= hash_cost) {
+            join->strategy = PLAN_JOIN_INDEX;
+        } else if (block_cost < hash_cost ||
+                   (block_cost == hash_cost && rows_in <= JOIN_FEW_ROWS)) {
+            join->strategy = PLAN_JOIN_BLOCK;
+        } else {
+            join->strategy = PLAN_JOIN_HASH;
+        }
+    }
+    if (join->strategy == PLAN_JOIN_INDEX) {
+        cost = index_cost;
+    } else {
+        cost = (join->strategy == PLAN_JOIN_HASH) ? hash_cost : block_cost;
+    }
+    op->est_cost = (op->child->est_cost < PLAN_EST_MAX - cost) ? op->child->est_cost + cost
+                                                               : PLAN_EST_MAX;
+
+    if (by_key) {
+        op->est_rows = scale_rows(rows_in, kept, rows);
+    } else {
+        distinct = column_distinct(table_schema_of(plan, owner),
+                                   join->outer_column - table_base(plan, owner));
+        n = column_distinct(schema, join->inner_column);
+        op->est_rows = scale_rows(rows_in, kept, (n > distinct) ? n : distinct);
+    }
+}
+
+/*
+ * Estimate the rows and cost of the operators above the access path
+ *
+ * A sort that does not fit its memory writes its rows out once and
+ * reads them back; a limit over rows that are not sorted stops the
+ * walk early.
+ */
+static void estimate_pipeline(struct sql_plan *plan) {
+    struct sql_operator *op;
+    struct sql_operator *child;
+    uint32_t row_bytes = joined_row_bytes(plan, plan->join_count + 1);
+    uint32_t limit = (plan->select->limit > 0) ? (uint32_t)plan->select->limit : 0;
+    uint32_t per_page = AMIDB_PAGE_SIZE / row_bytes;
+    uint32_t pages;
+    uint32_t i;
+    int sorted = 0;
+
+    for (i = 1; i < plan->operator_count; i++) {
+        op = &plan->operators[i];
+        child = op->child;
+        op->est_rows = child->est_rows;
+        op->est_cost = child->est_cost;
+
+        switch (op->type) {
+            case PLAN_OP_JOIN:
+                estimate_join(plan, op, 0);
+                break;
+
+            case PLAN_OP_SORT:
+                pages = child->est_rows / (per_page ? per_page : 1) + 1;
+                if (pages > plan->sort_memory / AMIDB_PAGE_SIZE) {
+                    op->est_cost += 2 * pages;
+                }
+                sorted = 1;
+                break;
+
+            case PLAN_OP_TOPK:
+                if (op->est_rows > limit) {
+                    op->est_rows = limit;
+                }
+                sorted = 1;
+                break;
+
+            case PLAN_OP_LIMIT:
+                if (op->est_rows > limit) {
+                    if (!sorted) {
+                        op->est_cost /= child->est_rows / limit;
+                    }
+                    op->est_rows = limit;
+                }
+                break;
+
+            case PLAN_OP_AGGREGATE:
+                op->est_rows = 1;
+                break;
+        }
+    }
+}
+
+/* ========== Plan ========== */
+
+/*
+ * Build the plan for a SELECT
+ */
+int plan_build(struct sql_plan *plan, struct amidb_pager *pager, struct page_cache *cache,
+               const struct table_schema *schema, const struct sql_select *select) {
+    static const char *agg_names[] = { "", "COUNT", "COUNT", "SUM", "AVG", "MIN", "MAX" };
+    const struct sql_where *where = &select->where;
+    struct plan_join *join;
+    uint32_t all = where->has_condition ? (1UL << where->condition_count) - 1 : 0;
+    uint32_t columns = schema->column_count;
+    uint32_t rest;
+    int in_order = 1;               /* Joins keep the FROM table's key order */
+    int use_seek = 0;
+    int col;
+    uint32_t i;
+    uint32_t t;
+
+    plan->pager = pager;
+    plan->cache = cache;
+    plan->snapshot = NULL;
+    plan->tree = NULL;
+    plan->schema = schema;
+    plan->select = select;
+    plan->order_column = -1;
+    plan->agg_column = -1;
+    plan->projection_count = 0;
+    plan->operator_count = 0;
+    plan->root = NULL;
+    plan->error_msg[0] = '\0';
+    plan->sort_memory = PLAN_SORT_MEMORY;
+    plan->sort_runs = 0;
+    plan->sort_passes = 0;
+    plan->join_memory = PLAN_HASH_MEMORY;
+    plan->join_partitions = 0;
+    row_init(&plan->scratch);
+
+    plan->pushed = 0;
+    plan->has_filter = 0;
+    plan->index_only = 0;
+    plan->table_mask = 0;
+    plan->has_join_filter = 0;
+
+    /* Joined tables' columns follow the FROM table's */
+    plan->join_count = select->join_count;
+    for (i = 0; i < plan->join_count; i++) {
+        join = &plan->joins[i];
+        join->schema = &schema[i + 1];
+        join->tree = NULL;
+        join->block = NULL;
+        join->hasher = NULL;
+        join->record = NULL;
+        join->build_outer = 0;
+        join->base = (uint8_t)columns;
+        join->strategy = PLAN_JOIN_BLOCK;
+        join->last = (i + 1 == plan->join_count);
+        join->mask = 0;
+        join->has_filter = 0;
+        join->has_pending = 0;
+        row_init(&join->pending);
+        columns += join->schema->column_count;
+    }
+    if (columns > AMIDB_MAX_COLUMNS) {
+        snprintf(plan->error_msg, sizeof(plan->error_msg),
+                 "Joined tables have more than %d columns", AMIDB_MAX_COLUMNS);
+        return -1;
+    }
+    for (i = 1; i <= plan->join_count; i++) {
+        for (t = 0; t < i; t++) {
+            if (strcmp(table_label(plan, i), table_label(plan, t)) == 0) {
+                snprintf(plan->error_msg, sizeof(plan->error_msg),
+                         "Table '%s' is named twice (give it an alias)", table_label(plan, i));
+                return -1;
+            }
+        }
+    }
+
+    /* Resolve every column the query names */
+    if (select->aggregate != SQL_AGG_NONE) {
+        if (select->aggregate != SQL_AGG_COUNT_STAR) {
+            plan->agg_column = query_column(plan, select->agg_column, "Column");
+            if (plan->agg_column < 0) {
+                return -1;
+            }
+            t = column_table(plan, plan->agg_column);
+            if (select->aggregate != SQL_AGG_COUNT &&
+                table_schema_of(plan, t)->columns[plan->agg_column - (int)table_base(plan, t)].type !=
+                    SQL_TYPE_INTEGER) {
+                snprintf(plan->error_msg, sizeof(plan->error_msg),
+                         "%s() requires INTEGER column, '%s' is not INTEGER",
+                         agg_names[select->aggregate], select->agg_column);
+                return -1;
+            }
+        }
+    } else {
+        if (select->order_by.has_order) {
+            plan->order_column = query_column(plan, select->order_by.column_name,
+                                              "ORDER BY column");
+            if (plan->order_column < 0) {
+                return -1;
+            }
+        }
+        if (!select->select_all) {
+            for (i = 0; i < select->column_count; i++) {
+                col = query_column(plan, select->columns[i], "Column");
+                if (col < 0) {
+                    return -1;
+                }
+                plan->projection[i] = (uint8_t)col;
+            }
+            plan->projection_count = select->column_count;
+        }
+    }
+    for (i = 0; i < where->condition_count; i++) {
+        col = resolve_column(plan, where->conditions[i].column_name);
+        if (col == -2) {
+            snprintf(plan->error_msg, sizeof(plan->error_msg), "Column '%s' is ambiguous",
+                     where->conditions[i].column_name);
+            return -1;
+        }
+        plan->where_columns[i] = (int8_t)col;   /* -1: compares as unknown */
+    }
+    for (i = 0; i < plan->join_count; i++) {
+        if (resolve_on(plan, i) != 0) {
+            return -1;
+        }
+    }
+
+    /* Split the WHERE between the tables */
+    if (plan->join_count == 0) {
+        plan->table_mask = all;
+    } else if (where->has_condition) {
+        assign_conjuncts(plan, where->root);
+        rest = all & ~plan->table_mask;
+        for (i = 0; i < plan->join_count; i++) {
+            plan->joins[i].has_filter = plan->joins[i].mask != 0;
+            rest &= ~plan->joins[i].mask;
+        }
+        plan->has_join_filter = rest != 0;
+    }
+
+    /* Push PRIMARY KEY comparisons down: pk = n looks the row up, */
+    /* a range walks only its keys */
+    if (where->has_condition && schema->primary_key_index >= 0) {
+        push_conjuncts(plan, where->root);
+        for (i = 0; i < where->condition_count; i++) {
+            const struct sql_condition *cond = &where->conditions[i];
+
+            if (cond->op != SQL_OP_EQ ||
+                plan->where_columns[i] != schema->primary_key_index) {
+                continue;
+            }
+            if (cond->value.type != SQL_VALUE_INTEGER &&
+                cond->value.type != SQL_VALUE_PARAM) {
+                snprintf(plan->error_msg, sizeof(plan->error_msg),
+                         "WHERE on PRIMARY KEY requires INTEGER value");
+                return -1;
+            }
+            if (plan->pushed & (1UL << i)) {
+                use_seek = 1;
+            }
+        }
+    }
+
+    plan->tree = btree_open(pager, cache, schema->btree_root);
+    for (i = 0; i < plan->join_count && plan->tree != NULL; i++) {
+        plan->joins[i].tree = btree_open(pager, cache, plan->joins[i].schema->btree_root);
+        if (plan->joins[i].tree == NULL) {
+            break;
+        }
+    }
+    if (plan->tree == NULL || i < plan->join_count) {
+        snprintf(plan->error_msg, sizeof(plan->error_msg), "Failed to open table B+Tree");
+        return -1;
+    }
+
+    /* Bottom up */
+    choose_access(plan, use_seek);
+
+    for (i = 0; i < plan->join_count; i++) {
+        plan_push(plan, PLAN_OP_JOIN, join_open, join_next, join_close);
+        plan->root->u.join.join = &plan->joins[i];
+        estimate_join(plan, plan->root, 1);
+        if (plan->joins[i].strategy != PLAN_JOIN_INDEX) {
+            in_order = 0;
+        }
+    }
+
+    if (select->aggregate != SQL_AGG_NONE) {
+        plan_push(plan, PLAN_OP_AGGREGATE, aggregate_open, aggregate_next, NULL);
+        estimate_pipeline(plan);
+        return 0;
+    }
+
+    /* Scans come out in primary key order already (and lookups keep it) */
+    if (plan->order_column >= 0 &&
+        !(in_order && (use_seek || (plan->order_column == schema->primary_key_index &&
+                                    select->order_by.ascending)))) {
+        if (select->limit > 0 && select->limit <= SORTER_TOPK_MAX) {
+            plan_push(plan, PLAN_OP_TOPK, sort_open, sort_next, sort_close);
+        } else {
+            plan_push(plan, PLAN_OP_SORT, sort_open, sort_next, sort_close);
+        }
+    }
+    if (plan->projection_count > 0) {
+        plan_push(plan, PLAN_OP_PROJECT, NULL, project_next, NULL);
+    }
+    if (select->limit > 0) {
+        plan_push(plan, PLAN_OP_LIMIT, limit_open, limit_next, NULL);
+    }
+
+    estimate_pipeline(plan);
+    return 0;
+}
+
+/*
+ * Read the tables through a snapshot
+ */
+void plan_set_snapshot(struct sql_plan *plan, struct txn_snapshot *snap) {
+    uint32_t i;
+
+    plan->snapshot = snap;
+    if (plan->tree) {
+        btree_set_snapshot(plan->tree, snap);
+    }
+    for (i = 0; i < plan->join_count; i++) {
+        if (plan->joins[i].tree) {
+            btree_set_snapshot(plan->joins[i].tree, snap);
+        }
+    }
+}
+
+/*
+ * Open the pipeline (children first: a sort reads its input when opened)
+ */
+int plan_open(struct sql_plan *plan) {
+    const struct sql_where *where = &plan->select->where;
+    struct plan_join *join;
+    int8_t columns[SQL_MAX_CONDITIONS];
+    uint32_t skip = plan->table_mask;
+    uint32_t i;
+    uint32_t c;
+
+    /* The WHERE values are final now (parameters are bound) */
+    if (plan->has_filter) {
+        predicate_compile_columns(&plan->filter, where, plan->where_columns,
+                                  plan->pushed | ~plan->table_mask);
+    }
+    for (i = 0; i < plan->join_count; i++) {
+        join = &plan->joins[i];
+        skip |= join->mask;
+        if (!join->has_filter) {
+            continue;
+        }
+        /* Its stored rows number their columns from 0 */
+        for (c = 0; c < where->condition_count; c++) {
+            columns[c] = (plan->where_columns[c] >= 0 &&
+                          column_table(plan, plan->where_columns[c]) == i + 1) ?
+                         (int8_t)(plan->where_columns[c] - join->base) : -1;
+        }
+        predicate_compile_columns(&join->filter, where, columns, ~join->mask);
+    }
+    if (plan->has_join_filter) {
+        predicate_compile_columns(&plan->join_filter, where, plan->where_columns, skip);
+    }
+
+    for (i = 0; i < plan->operator_count; i++) {
+        if (plan->operators[i].open(&plan->operators[i]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Get the next result row
+ */
+int plan_next(struct sql_plan *plan, struct amidb_row *row) {
+    int rc;
+
+    rc = plan->root->next(plan->root, row);
+
+    /* Reads from a snapshot that went stale fail, which may have */
+    /* skipped rows: the result is no longer complete */
+    if (plan->snapshot && plan->snapshot->stale) {
+        if (rc == AMIDB_ROW) {
+            row_clear(row);
+        }
+        snprintf(plan->error_msg, sizeof(plan->error_msg),
+                 "Snapshot too old (run the query again)");
+        return AMIDB_BUSY;
+    }
+    return rc;
+}
+
+/*
+ * Describe one operator of the plan, from the top down
+ */
+int plan_explain(struct sql_plan *plan, uint32_t n, struct amidb_row *row) {
+    static const char *op_names[] = {
+        "", "SCAN", "SEEK", "RANGE", "SORT", "PROJECT", "LIMIT", "AGGREGATE", "TOPK", "JOIN"
+    };
+    static const char *agg_names[] = { "", "COUNT", "COUNT", "SUM", "AVG", "MIN", "MAX" };
+    const struct sql_select *select = plan->select;
+    const struct table_schema *schema = plan->schema;
+    const char *key = (schema->primary_key_index >= 0) ?
+                      schema->columns[schema->primary_key_index].name : "rowid";
+    const struct sql_join *on;
+    struct plan_join *join;
+    struct sql_operator *op;
+    char detail[128];
+    size_t len;
+    uint32_t i;
+
+    if (n >= plan->operator_count) {
+        return AMIDB_DONE;
+    }
+    if (n == 0) {
+        estimate_pipeline(plan);    /* sort_memory or join_memory may have changed */
+    }
+    op = &plan->operators[plan->operator_count - 1 - n];
+
+    detail[0] = '\0';
+    switch (op->type) {
+        case PLAN_OP_SCAN:
+        case PLAN_OP_SEEK:
+        case PLAN_OP_RANGE:
+            snprintf(detail, sizeof(detail), "%s", schema->name);
+            if (op->type != PLAN_OP_SCAN && bind_range(plan) == 0) {
+                len = strlen(detail);
+                if (plan->range_empty) {
+                    snprintf(detail + len, sizeof(detail) - len, " %s (none)", key);
+                } else if (op->type == PLAN_OP_SEEK) {
+                    snprintf(detail + len, sizeof(detail) - len, " %s = %ld", key,
+                             (long)plan->seek_key);
+                } else if (plan->range_end == INT32_MAX) {
+                    snprintf(detail + len, sizeof(detail) - len, " %s >= %ld", key,
+                             (long)plan->seek_key);
+                } else if (plan->seek_key == INT32_MIN) {
+                    snprintf(detail + len, sizeof(detail) - len, " %s <= %ld", key,
+                             (long)plan->range_end);
+                } else {
+                    snprintf(detail + len, sizeof(detail) - len, " %s %ld..%ld", key,
+                             (long)plan->seek_key, (long)plan->range_end);
+                }
+            }
+            len = strlen(detail);
+            if (plan->index_only) {
+                snprintf(detail + len, sizeof(detail) - len, ", index only");
+            } else if (plan->has_filter) {
+                snprintf(detail + len, sizeof(detail) - len, ", WHERE filter");
+            }
+            break;
+
+        case PLAN_OP_SORT:
+        case PLAN_OP_TOPK:
+            snprintf(detail, sizeof(detail), "%s %s", select->order_by.column_name,
+                     select->order_by.ascending ? "ASC" : "DESC");
+            len = strlen(detail);
+            if (op->type == PLAN_OP_TOPK) {
+                snprintf(detail + len, sizeof(detail) - len, ", keep %ld", (long)select->limit);
+            } else if (op->est_cost > op->child->est_cost) {
+                snprintf(detail + len, sizeof(detail) - len, ", on disk");
+            }
+            break;
+
+        case PLAN_OP_PROJECT:
+            for (i = 0; i < select->column_count; i++) {
+                len = strlen(detail);
+                snprintf(detail + len, sizeof(detail) - len, "%s%s", i ? ", " : "",
+                         select->columns[i]);
+            }
+            break;
+
+        case PLAN_OP_LIMIT:
+            snprintf(detail, sizeof(detail), "%ld", (long)select->limit);
+            break;
+
+        case PLAN_OP_AGGREGATE:
+            snprintf(detail, sizeof(detail), "%s(%s)", agg_names[select->aggregate],
+                     (select->aggregate == SQL_AGG_COUNT_STAR) ? "*" : select->agg_column);
+            break;
+
+        case PLAN_OP_JOIN:
+            join = op->u.join.join;
+            i = (uint32_t)(join - plan->joins);
+            on = &select->joins[i];
+            snprintf(detail, sizeof(detail), "%s%s%s ON %s = %s", on->table_name,
+                     on->alias[0] ? " " : "", on->alias, on->left_column, on->right_column);
+            len = strlen(detail);
+            if (join->strategy == PLAN_JOIN_INDEX) {
+                snprintf(detail + len, sizeof(detail) - len, ", lookup by %s",
+                         join->schema->columns[join->inner_column].name);
+            } else if (join->strategy == PLAN_JOIN_HASH) {
+                snprintf(detail + len, sizeof(detail) - len, ", hash of %s",
+                         join->build_outer ? "rows coming in" : table_label(plan, i + 1));
+                len = strlen(detail);
+                if (hasher_partitions(plan->join_memory, join->build_bytes) > 0) {
+                    snprintf(detail + len, sizeof(detail) - len, ", %lu partitions",
+                             (unsigned long)hasher_partitions(plan->join_memory,
+                                                              join->build_bytes));
+                }
+            } else {
+                snprintf(detail + len, sizeof(detail) - len, ", blocks of %lu rows",
+                         (unsigned long)join_block_rows(plan, i));
+            }
+            len = strlen(detail);
+            if (join->has_filter) {
+                snprintf(detail + len, sizeof(detail) - len, ", WHERE filter");
+                len = strlen(detail);
+            }
+            if (join->last && plan->has_join_filter) {
+                snprintf(detail + len, sizeof(detail) - len, ", WHERE on joined rows");
+            }
+            break;
+    }
+
+    if (row_set_text(row, 0, op_names[op->type], 0) != 0 ||
+        row_set_text(row, 1, detail, 0) != 0 ||
+        row_set_int(row, 2, (int32_t)op->est_rows) != 0 ||
+        row_set_int(row, 3, (int32_t)op->est_cost) != 0) {
+        row_clear(row);
+        snprintf(plan->error_msg, sizeof(plan->error_msg), "Out of memory");
+        return AMIDB_ERROR;
+    }
+    return AMIDB_ROW;
+}
+
+/*
+ * Close the pipeline, keeping the plan for another plan_open
+ */
+void plan_rewind(struct sql_plan *plan) {
+    uint32_t i;
+
+    for (i = plan->operator_count; i > 0; i--) {
+        plan->operators[i - 1].close(&plan->operators[i - 1]);
+    }
+}
+
+/*
+ * Close the pipeline and the tables' trees
+ */
+void plan_close(struct sql_plan *plan) {
+    uint32_t i;
+
+    plan_rewind(plan);
+    plan->operator_count = 0;
+    plan->root = NULL;
+
+    if (plan->tree) {
+        btree_close(plan->tree);
+        plan->tree = NULL;
+    }
+    for (i = 0; i < plan->join_count; i++) {
+        if (plan->joins[i].tree) {
+            btree_close(plan->joins[i].tree);
+            plan->joins[i].tree = NULL;
+        }
+    }
+}
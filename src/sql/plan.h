@@ -0,0 +1,303 @@
+/*
+ * plan.h - Query plans for SELECT
+ *
+ * A SELECT runs as a pipeline of operators built from its struct
+ * sql_select. Every operator has open, next and close; next pulls rows
+ * from the operator below it only as it needs them and hands back one
+ * row at a time, so a row travels from the table to the caller without
+ * being stored anywhere, unless an operator must see every row first
+ * (sort, aggregate). Pipelines are built bottom up:
+ *
+ *   scan | range | seek  [->  join ...]  ->  sort  ->  project  ->  limit
+ *   scan | range | seek  [->  join ...]  ->  aggregate
+ *
+ * scan walks the table's tree in key order. Comparisons of the PRIMARY
+ * KEY with an INTEGER that every row must pass (joined to the rest of
+ * the WHERE by AND alone) are pushed down into the access path: range
+ * walks only the keys between their bounds, and seek fetches the one
+ * row a pk = n names. What is left of the WHERE is compiled when the
+ * plan opens (predicate.h) and tested by the access operator on each
+ * row as it is stored, so rows it rejects are never decoded or passed
+ * up. sort is left out when the scan order is already the ORDER BY
+ * order (limit then stops the scan after LIMIT rows), project when the
+ * query is SELECT *. With a LIMIT of up to SORTER_TOPK_MAX the sort is
+ * a top-K sort that keeps only that many rows.
+ *
+ * Where more than one access path would do, each is given a cost in
+ * pages read, from the table's row_count and the fractions of rows
+ * the WHERE keeps (stats.h: ANALYZE statistics, or fixed guesses), and
+ * the cheapest is used. A query that needs no column but the PRIMARY
+ * KEY (COUNT(*), or only the key selected, with nothing left to
+ * filter) is answered from the tree's keys alone (index only) and
+ * never reads a row. plan_explain describes the pipeline with its
+ * estimates.
+ *
+ * INNER JOINs are run left-deep, in the order written: the FROM table is
+ * read by the access path and each join adds one table's columns after
+ * those of the tables before it. A join looks its table's row up by
+ * PRIMARY KEY for each row coming in (index nested loop) when the ON
+ * compares that key; reads the rows coming in by blocks of
+ * PLAN_JOIN_MEMORY and scans its table once per block, matching every
+ * row of the block (block nested loop); or hashes the smaller of its
+ * table and the rows coming in and probes the hash with the other
+ * (hash join, hashjoin.h), partitioning both to disk when the smaller
+ * does not fit join_memory. The cost decides; a block of a few rows is
+ * preferred to a hash that reads no fewer pages. WHERE conditions on
+ * one table alone are tested on that table's stored rows; the rest are
+ * tested on the joined rows by the last join.
+ *
+ * Rows are passed down the pipeline by the caller: next fills the row
+ * it is given and the caller owns it afterwards (row_clear it, or keep
+ * it).
+ *
+ * A plan reads the current pages, or a snapshot's (plan_set_snapshot):
+ * then every tree and row page comes from the database as committed
+ * when the snapshot was opened, however the tables change meanwhile.
+ */
+
+#ifndef AMIDB_SQL_PLAN_H
+#define AMIDB_SQL_PLAN_H
+
+#include "sql/parser.h"
+#include "sql/catalog.h"
+#include "sql/predicate.h"
+#include "storage/btree.h"
+#include "storage/row.h"
+#include <stdint.h>
+
+/* Operators in a pipeline (one of each kind at most, a join per table joined) */
+#define PLAN_MAX_OPERATORS  (6 + SQL_MAX_JOINS)
+
+/* Default memory for a sort (rows past it go to disk, see sort.h) */
+#define PLAN_SORT_MEMORY    32768
+
+/* Cost model: keys in a tree leaf as the tree fills, and the stored */
+/* row size assumed for a table that has not been analyzed */
+#define PLAN_LEAF_KEYS      48
+#define PLAN_ROW_BYTES      64
+
+/* Memory for the block of rows a block nested-loop join matches at once */
+#define PLAN_JOIN_MEMORY    32768
+
+/* Default memory for a hash join (past it both sides are partitioned) */
+#define PLAN_HASH_MEMORY    131072
+
+/* Operator kinds */
+#define PLAN_OP_SCAN        1
+#define PLAN_OP_SEEK        2
+#define PLAN_OP_RANGE       3       /* Scan between two primary keys */
+#define PLAN_OP_SORT        4
+#define PLAN_OP_PROJECT     5
+#define PLAN_OP_LIMIT       6
+#define PLAN_OP_AGGREGATE   7
+#define PLAN_OP_TOPK        8       /* Sort keeping only the LIMIT best rows */
+#define PLAN_OP_JOIN        9       /* Rows so far, each with a joined table's rows */
+
+/* Join strategies */
+#define PLAN_JOIN_INDEX     1       /* Look the PRIMARY KEY up per row coming in */
+#define PLAN_JOIN_BLOCK     2       /* Scan the table once per block of rows */
+#define PLAN_JOIN_HASH      3       /* Hash one side, probe with the other */
+
+struct sql_plan;
+struct sql_sorter;
+struct sql_hasher;
+
+/*
+ * A table joined by INNER JOIN
+ */
+struct plan_join {
+    const struct table_schema *schema;
+    struct btree *tree;             /* Open until plan_close */
+    uint8_t base;                   /* Its first column in the joined row */
+    uint8_t outer_column;           /* ON column of the tables before it (joined row) */
+    uint8_t inner_column;           /* ON column of this table */
+    uint8_t strategy;               /* PLAN_JOIN_* */
+    uint8_t last;                   /* Last join: tests the rest of the WHERE */
+    uint32_t mask;                  /* WHERE conditions on this table alone */
+    struct sql_predicate filter;    /* Those, tested on its stored rows */
+    uint8_t has_filter;
+    uint8_t build_outer;            /* Hash join: the rows coming in are hashed */
+    uint32_t build_rows;            /* Hash join: rows and bytes expected hashed */
+    uint32_t build_bytes;
+
+    /* Block nested loop, while open */
+    uint8_t *block;                 /* PLAN_JOIN_MEMORY of rows, then the table's row */
+    uint32_t block_used;
+    uint32_t block_pos;             /* Next row of the block to match */
+    uint32_t inner_size;            /* The table's row (0: none yet) */
+    uint32_t inner_key;             /* Its ON column: offset and size */
+    uint32_t inner_key_size;
+    struct btree_cursor cursor;     /* Walks the table */
+    uint8_t outer_done;             /* No rows are left coming in */
+    uint8_t has_pending;
+    struct amidb_row pending;       /* Row that did not fit the last block */
+
+    /* Hash join, while open */
+    struct sql_hasher *hasher;
+    uint8_t phase;                  /* Hashing, probing, or joining partitions */
+    uint8_t *record;                /* Row being hashed or probed, stored */
+    uint32_t record_capacity;
+    uint32_t record_size;
+    uint32_t record_key;            /* Its ON column: offset and size */
+    uint32_t record_key_size;
+};
+
+/*
+ * Operator
+ *
+ * next returns AMIDB_ROW with the row filled in, AMIDB_DONE when there
+ * are no more rows, or AMIDB_ERROR (message in the plan).
+ */
+struct sql_operator {
+    uint8_t type;                   /* PLAN_OP_* */
+    int (*open)(struct sql_operator *op);
+    int (*next)(struct sql_operator *op, struct amidb_row *row);
+    void (*close)(struct sql_operator *op);
+    struct sql_operator *child;     /* Input (NULL for scan / seek) */
+    struct sql_plan *plan;
+    uint32_t est_rows;              /* Rows it is expected to return */
+    uint32_t est_cost;              /* Pages read up to and including it */
+
+    union {
+        struct {
+            struct btree_cursor cursor;
+        } scan;
+        struct {
+            uint8_t done;
+        } seek;
+        struct {
+            struct btree_cursor cursor;
+        } range;
+        struct {
+            struct sql_sorter *sorter;
+        } sort;
+        struct {
+            uint32_t returned;
+        } limit;
+        struct {
+            uint8_t done;
+        } aggregate;
+        struct {
+            struct plan_join *join;
+        } join;
+    } u;
+};
+
+/*
+ * Query plan
+ */
+struct sql_plan {
+    struct amidb_pager *pager;
+    struct page_cache *cache;
+    struct txn_snapshot *snapshot;  /* Pages read through it (NULL: current) */
+    struct btree *tree;             /* The table's tree (open until plan_close) */
+    const struct table_schema *schema;  /* FROM table */
+    const struct sql_select *select;
+
+    struct plan_join joins[SQL_MAX_JOINS];
+    uint32_t join_count;
+    int8_t where_columns[SQL_MAX_CONDITIONS];  /* Joined-row column of each condition */
+    uint32_t table_mask;            /* WHERE conditions on the FROM table alone */
+    struct sql_predicate join_filter;   /* WHERE conditions on more than one table */
+    uint8_t has_join_filter;
+
+    uint32_t pushed;                /* WHERE conditions the access path answers (bit each) */
+    struct sql_predicate filter;    /* The FROM table's others, tested by the access operator */
+    uint8_t has_filter;
+    uint8_t index_only;             /* Access path reads keys only, never rows */
+    int32_t seek_key;               /* Key of a seek, or first key of a range */
+    int32_t range_end;              /* Last key of a range (read at plan_open) */
+    uint8_t range_empty;            /* The bounds leave no key */
+    int order_column;               /* ORDER BY column (-1 if none) */
+    int agg_column;                 /* Aggregate column (-1 for COUNT(*)) */
+    uint8_t projection[32];         /* Columns of a project (of the joined row) */
+    uint8_t projection_count;
+
+    struct sql_operator operators[PLAN_MAX_OPERATORS];
+    uint32_t operator_count;
+    struct sql_operator *root;      /* Top of the pipeline */
+    struct amidb_row scratch;       /* Row being built by project */
+
+    uint32_t sort_memory;           /* Budget of a sort (PLAN_SORT_MEMORY) */
+    uint32_t sort_runs;             /* Runs the last sort wrote (0: in memory) */
+    uint32_t sort_passes;           /* Its merge passes before the last */
+    uint32_t join_memory;           /* Budget of a hash join (PLAN_HASH_MEMORY) */
+    uint32_t join_partitions;       /* Partitions the last hash join wrote (0: in memory) */
+
+    char error_msg[128];            /* Set when a call fails */
+};
+
+/*
+ * Build the plan for a SELECT and open the tables' trees
+ *
+ * schema is the FROM table's, followed by one for each INNER JOIN
+ * table in order (select->join_count of them). Columns named by the
+ * query are resolved here, so an unknown or ambiguous column or an
+ * aggregate over a non-INTEGER column fails before any row is read.
+ * plan, the schemas and select must stay in place until plan_close.
+ * sort_memory and join_memory may be changed before plan_open.
+ *
+ * WHERE values may be parameters (SQL_VALUE_PARAM): they are read
+ * when the plan is opened, so a plan can be built once and opened
+ * again for each set of values bound into select.
+ *
+ * Returns: 0 on success, -1 on error (message in plan->error_msg)
+ */
+int plan_build(struct sql_plan *plan, struct amidb_pager *pager, struct page_cache *cache,
+               const struct table_schema *schema, const struct sql_select *select);
+
+/*
+ * Read the tables through a snapshot
+ *
+ * Must be set before plan_open, with a snapshot opened before the
+ * schemas given to plan_build were read (their roots must be valid in
+ * it). The snapshot stays the caller's; close it after plan_close. A
+ * read it can no longer answer (txn_snapshot_get_page: too old) makes
+ * the plan fail.
+ */
+void plan_set_snapshot(struct sql_plan *plan, struct txn_snapshot *snap);
+
+/*
+ * Open the pipeline
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int plan_open(struct sql_plan *plan);
+
+/*
+ * Get the next result row
+ *
+ * row must be empty (row_init); on AMIDB_ROW the caller owns it.
+ *
+ * Returns: AMIDB_ROW, AMIDB_DONE, AMIDB_ERROR (message in the plan), or
+ *          AMIDB_BUSY if the plan's snapshot became too old
+ */
+int plan_next(struct sql_plan *plan, struct amidb_row *row);
+
+/*
+ * Describe one operator of the plan (EXPLAIN), from the top down
+ *
+ * Fills row with the operator's name (TEXT), what it works on (TEXT),
+ * and the rows it is expected to return and the pages read up to it
+ * (INTEGER). Needs no plan_open.
+ *
+ * Returns: AMIDB_ROW, AMIDB_DONE past the last operator, or AMIDB_ERROR
+ */
+int plan_explain(struct sql_plan *plan, uint32_t n, struct amidb_row *row);
+
+/*
+ * Close the pipeline but keep the plan and the tree
+ *
+ * Frees what the operators hold; plan_open runs the plan again.
+ */
+void plan_rewind(struct sql_plan *plan);
+
+/*
+ * Close the pipeline and the tables' trees
+ *
+ * May be called before the last row; rows still held by a sort are
+ * freed. Safe to call after a failed plan_build.
+ */
+void plan_close(struct sql_plan *plan);
+
+#endif /* AMIDB_SQL_PLAN_H */
@@ -0,0 +1,301 @@
+/*
+ * predicate.c - Compiled WHERE clauses
+ *
+ * A program is run on a small stack of truth values. Comparisons and
+ * constants push one; NOT changes the top; AND and OR pop two and push
+ * one. With FALSE < UNKNOWN < TRUE, AND keeps the lesser and OR the
+ * greater, which is SQL's three-valued logic. A jump before the right
+ * side of AND (OR) skips it, leaving the left value as the result, when
+ * that is FALSE (TRUE).
+ */
+
+#include "sql/predicate.h"
+#include "util/endian.h"
+#include <string.h>
+
+/* Instructions */
+#define PRED_INT            1       /* column <op> int_value */
+#define PRED_TEXT           2       /* column <op> text */
+#define PRED_CONST          3       /* arg */
+#define PRED_NOT            4
+#define PRED_AND            5
+#define PRED_OR             6
+#define PRED_SKIP_FALSE     7       /* Top is FALSE: go to arg */
+#define PRED_SKIP_TRUE      8       /* Top is TRUE: go to arg */
+
+/* Truth values */
+#define PRED_FALSE          0
+#define PRED_UNKNOWN        1
+#define PRED_TRUE           2
+
+/* Outcomes each operator accepts: bit 0 less, bit 1 equal, bit 2 greater */
+static const uint8_t accept_bits[] = {
+    0,                              /* (unused) */
+    2,                              /* SQL_OP_EQ */
+    1 | 4,                          /* SQL_OP_NE */
+    1,                              /* SQL_OP_LT */
+    1 | 2,                          /* SQL_OP_LE */
+    4,                              /* SQL_OP_GT */
+    2 | 4                           /* SQL_OP_GE */
+};
+
+/* Conditions under a node (bit each) */
+static uint32_t node_conditions(const struct sql_where *where, uint32_t n) {
+    const struct sql_where_node *node = &where->nodes[n];
+
+    switch (node->type) {
+        case SQL_WHERE_COMPARE:
+            return 1UL << node->left;
+        case SQL_WHERE_AND:
+        case SQL_WHERE_OR:
+            return node_conditions(where, node->left) | node_conditions(where, node->right);
+        default:
+            return node_conditions(where, node->left);
+    }
+}
+
+/* Compile one node after the ones already in the program */
+static void compile_node(struct sql_predicate *pred, const struct sql_where *where,
+                         const int8_t *columns, uint32_t skip, uint32_t n) {
+    const struct sql_where_node *node = &where->nodes[n];
+    const struct sql_condition *cond;
+    struct predicate_instr *instr;
+    struct predicate_instr *jump;
+    int col;
+
+    /* Nothing left to test under this node */
+    if ((node_conditions(where, n) & ~skip) == 0) {
+        instr = &pred->code[pred->code_count++];
+        memset(instr, 0, sizeof(*instr));
+        instr->code = PRED_CONST;
+        instr->arg = PRED_TRUE;
+        return;
+    }
+
+    switch (node->type) {
+        case SQL_WHERE_COMPARE:
+            cond = &where->conditions[node->left];
+            instr = &pred->code[pred->code_count++];
+            memset(instr, 0, sizeof(*instr));
+            instr->code = PRED_CONST;
+            instr->arg = PRED_UNKNOWN;
+
+            col = columns[node->left];
+            if (col < 0 || cond->op < SQL_OP_EQ || cond->op > SQL_OP_GE) {
+                return;
+            }
+
+            if (cond->value.type == SQL_VALUE_INTEGER) {
+                instr->code = PRED_INT;
+                instr->int_value = cond->value.int_value;
+            } else if (cond->value.type == SQL_VALUE_TEXT) {
+                instr->code = PRED_TEXT;
+                instr->text = (const uint8_t *)cond->value.text_value;
+                instr->text_length = (uint32_t)strlen(cond->value.text_value);
+            } else {
+                return;                     /* NULL, or a parameter not bound */
+            }
+            instr->column = (uint8_t)col;
+            instr->accept = accept_bits[cond->op];
+            if ((uint32_t)col + 1 > pred->columns_read) {
+                pred->columns_read = (uint32_t)col + 1;
+            }
+            return;
+
+        case SQL_WHERE_AND:
+        case SQL_WHERE_OR:
+            compile_node(pred, where, columns, skip, node->left);
+            jump = &pred->code[pred->code_count++];
+            memset(jump, 0, sizeof(*jump));
+            jump->code = (node->type == SQL_WHERE_AND) ? PRED_SKIP_FALSE : PRED_SKIP_TRUE;
+            compile_node(pred, where, columns, skip, node->right);
+            instr = &pred->code[pred->code_count++];
+            memset(instr, 0, sizeof(*instr));
+            instr->code = (node->type == SQL_WHERE_AND) ? PRED_AND : PRED_OR;
+            jump->arg = (uint8_t)pred->code_count;
+            return;
+
+        case SQL_WHERE_NOT:
+            compile_node(pred, where, columns, skip, node->left);
+            instr = &pred->code[pred->code_count++];
+            memset(instr, 0, sizeof(*instr));
+            instr->code = PRED_NOT;
+            return;
+    }
+}
+
+/*
+ * Compile a WHERE clause for a table
+ */
+void predicate_compile(struct sql_predicate *pred, const struct table_schema *schema,
+                       const struct sql_where *where, uint32_t skip) {
+    int8_t columns[SQL_MAX_CONDITIONS];
+    uint32_t col;
+    uint32_t i;
+
+    for (i = 0; i < where->condition_count; i++) {
+        columns[i] = -1;
+        for (col = 0; col < schema->column_count; col++) {
+            if (strcmp(where->conditions[i].column_name, schema->columns[col].name) == 0) {
+                columns[i] = (int8_t)col;
+                break;
+            }
+        }
+    }
+    predicate_compile_columns(pred, where, columns, skip);
+}
+
+/*
+ * Compile a WHERE clause whose columns the caller has looked up
+ */
+void predicate_compile_columns(struct sql_predicate *pred, const struct sql_where *where,
+                               const int8_t *columns, uint32_t skip) {
+    pred->code_count = 0;
+    pred->columns_read = 0;
+    if (where->has_condition) {
+        compile_node(pred, where, columns, skip, where->root);
+    }
+}
+
+/* Run the program on a row's columns */
+static int predicate_run(const struct sql_predicate *pred, const struct amidb_value *fields,
+                         uint32_t field_count) {
+    uint8_t stack[SQL_MAX_WHERE_NODES];
+    const struct predicate_instr *instr;
+    const struct amidb_value *val;
+    uint32_t depth = 0;
+    uint32_t pc = 0;
+    uint32_t len;
+    int cmp;
+
+    if (pred->code_count == 0) {
+        return 1;
+    }
+
+    while (pc < pred->code_count) {
+        instr = &pred->code[pc++];
+        switch (instr->code) {
+            case PRED_INT:
+                val = &fields[instr->column];
+                if (instr->column >= field_count || val->type != AMIDB_TYPE_INTEGER) {
+                    stack[depth++] = PRED_UNKNOWN;
+                    break;
+                }
+                cmp = (val->u.i < instr->int_value) ? 0 : (val->u.i > instr->int_value) ? 2 : 1;
+                stack[depth++] = ((instr->accept >> cmp) & 1) ? PRED_TRUE : PRED_FALSE;
+                break;
+
+            case PRED_TEXT:
+                val = &fields[instr->column];
+                if (instr->column >= field_count || val->type != AMIDB_TYPE_TEXT) {
+                    stack[depth++] = PRED_UNKNOWN;
+                    break;
+                }
+                len = (val->u.blob.size < instr->text_length) ? val->u.blob.size : instr->text_length;
+                cmp = (len > 0) ? memcmp(val->u.blob.data, instr->text, len) : 0;
+                if (cmp == 0) {
+                    cmp = (val->u.blob.size < instr->text_length) ? -1 :
+                          (val->u.blob.size > instr->text_length) ? 1 : 0;
+                }
+                cmp = (cmp < 0) ? 0 : (cmp > 0) ? 2 : 1;
+                stack[depth++] = ((instr->accept >> cmp) & 1) ? PRED_TRUE : PRED_FALSE;
+                break;
+
+            case PRED_CONST:
+                stack[depth++] = instr->arg;
+                break;
+
+            case PRED_NOT:
+                stack[depth - 1] = (uint8_t)(PRED_TRUE - stack[depth - 1]);
+                break;
+
+            case PRED_AND:
+                depth--;
+                if (stack[depth] < stack[depth - 1]) {
+                    stack[depth - 1] = stack[depth];
+                }
+                break;
+
+            case PRED_OR:
+                depth--;
+                if (stack[depth] > stack[depth - 1]) {
+                    stack[depth - 1] = stack[depth];
+                }
+                break;
+
+            case PRED_SKIP_FALSE:
+                if (stack[depth - 1] == PRED_FALSE) {
+                    pc = instr->arg;
+                }
+                break;
+
+            case PRED_SKIP_TRUE:
+                if (stack[depth - 1] == PRED_TRUE) {
+                    pc = instr->arg;
+                }
+                break;
+        }
+    }
+
+    return stack[0] == PRED_TRUE;
+}
+
+/*
+ * Does a row match?
+ */
+int predicate_matches(const struct sql_predicate *pred, const struct amidb_row *row) {
+    return predicate_run(pred, row->values, row->column_count);
+}
+
+/*
+ * Does a stored row match?
+ */
+int predicate_matches_stored(struct sql_predicate *pred, const uint8_t *buffer,
+                             uint32_t buffer_size) {
+    struct amidb_value *field;
+    uint32_t count;
+    uint32_t offset = 2;
+    uint32_t size;
+    uint32_t i;
+
+    if (pred->code_count == 0) {
+        return 1;
+    }
+    if (buffer_size < 2) {
+        return 0;
+    }
+
+    /* Point the fields the program reads into the buffer */
+    count = get_u16(buffer);
+    if (count > pred->columns_read) {
+        count = pred->columns_read;
+    }
+    for (i = 0; i < count; i++) {
+        field = &pred->fields[i];
+        if (offset >= buffer_size) {
+            return 0;
+        }
+        field->type = buffer[offset++];
+        if (field->type == AMIDB_TYPE_NULL) {
+            continue;
+        }
+        if (offset + 4 > buffer_size) {
+            return 0;
+        }
+        if (field->type == AMIDB_TYPE_INTEGER) {
+            field->u.i = (int32_t)get_u32(buffer + offset);
+            offset += 4;
+            continue;
+        }
+        size = get_u32(buffer + offset);
+        offset += 4;
+        if (size > buffer_size - offset) {
+            return 0;
+        }
+        field->u.blob.data = (uint8_t *)buffer + offset;
+        field->u.blob.size = size;
+        offset += size;
+    }
+
+    return predicate_run(pred, pred->fields, count);
+}
@@ -0,0 +1,95 @@
+/*
+ * predicate.h - Compiled WHERE clauses
+ *
+ * A WHERE tree is compiled into a short program before any row is read:
+ * column names become column numbers, each comparison gets the kernel
+ * for its value's type (INTEGER, or TEXT with its length worked out
+ * once), and AND / OR become jumps that skip their right side when the
+ * left one decides. Running the program does no lookups, formatting or
+ * copying.
+ *
+ * A program runs on a row, or on a row as it is stored (the
+ * row_serialize format): the stored row's column headers are walked as
+ * far as the last column the program reads and TEXT is compared where
+ * it lies, so a row that does not match is never decoded.
+ *
+ * Values are read when compiling, so a statement with parameters is
+ * compiled after they are bound (once per run, not per row).
+ */
+
+#ifndef AMIDB_SQL_PREDICATE_H
+#define AMIDB_SQL_PREDICATE_H
+
+#include "sql/parser.h"
+#include "sql/catalog.h"
+#include "storage/row.h"
+#include <stdint.h>
+
+/* Instructions in a program: one per node, one jump per AND / OR */
+#define PREDICATE_MAX_CODE  (2 * SQL_MAX_WHERE_NODES)
+
+/* One instruction (see predicate.c) */
+struct predicate_instr {
+    uint8_t code;                   /* PRED_* */
+    uint8_t column;                 /* Column compared */
+    uint8_t accept;                 /* Outcomes that match: bit 0 <, 1 =, 2 > */
+    uint8_t arg;                    /* Jump target, or truth value of a constant */
+    int32_t int_value;
+    const uint8_t *text;            /* TEXT literal (in the WHERE clause) */
+    uint32_t text_length;
+};
+
+/*
+ * Compiled WHERE clause
+ */
+struct sql_predicate {
+    struct predicate_instr code[PREDICATE_MAX_CODE];
+    uint32_t code_count;            /* 0: no WHERE, every row matches */
+    uint32_t columns_read;          /* Highest column read, plus one */
+    struct amidb_value fields[AMIDB_MAX_COLUMNS];   /* Columns of a stored row */
+};
+
+/*
+ * Compile a WHERE clause for a table
+ *
+ * Conditions whose bit is set in skip are taken as true (the access
+ * path already guarantees them), and so is any part of the clause made
+ * of skipped conditions alone. A comparison with a column the table
+ * or the row does not have, with NULL, or with a value of the other
+ * type is unknown: NOT leaves it unknown, and only a clause that is
+ * true matches.
+ *
+ * where must stay in place while the program is used (TEXT literals
+ * are compared where they are).
+ */
+void predicate_compile(struct sql_predicate *pred, const struct table_schema *schema,
+                       const struct sql_where *where, uint32_t skip);
+
+/*
+ * Compile a WHERE clause whose column names the caller has resolved
+ *
+ * columns[i] is the column condition i compares (-1: none), as for
+ * predicate_compile otherwise. Used for joined rows, whose columns come
+ * from more than one table.
+ */
+void predicate_compile_columns(struct sql_predicate *pred, const struct sql_where *where,
+                               const int8_t *columns, uint32_t skip);
+
+/*
+ * Does a row match?
+ *
+ * Returns: 1 if it does, 0 if not
+ */
+int predicate_matches(const struct sql_predicate *pred, const struct amidb_row *row);
+
+/*
+ * Does a stored row match? (buffer holds the row_serialize format)
+ *
+ * A row too short for its headers does not match.
+ *
+ * Returns: 1 if it does, 0 if not
+ */
+int predicate_matches_stored(struct sql_predicate *pred, const uint8_t *buffer,
+                             uint32_t buffer_size);
+
+#endif /* AMIDB_SQL_PREDICATE_H */
@@ -6,7 +6,11 @@
 #include "sql/lexer.h"
 #include "sql/parser.h"
 #include "storage/row.h"
+#include "storage/backup.h"
+#include "txn/cdc.h"
+#include "api/error.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 
@@ -15,7 +19,17 @@ static int handle_meta_command(struct sql_repl *repl, const char *command);
 static void print_help(void);
 static void print_tables(struct sql_executor *exec);
 static void print_schema(struct sql_executor *exec, const char *table_name);
-static void print_select_results(struct sql_executor *exec);
+static int print_select_results(struct sql_executor *exec);
+static void set_durability(struct sql_executor *exec, const char *level);
+static void print_stats(struct sql_executor *exec);
+static void run_backup(struct sql_executor *exec, const char *path, int incremental);
+static void run_restore(struct sql_executor *exec, const char *db_path, const char *incr_path);
+static void set_capture(struct sql_executor *exec, const char *mode);
+static void print_changes(struct sql_executor *exec, const char *position);
+static void set_shipping(struct sql_executor *exec, const char *stream);
+static void set_following(struct sql_repl *repl, const char *stream);
+static void set_shadow(struct sql_executor *exec, const char *mode);
+static void follow_poll(struct sql_repl *repl);
 static void trim_string(char *str);
 
 /*
@@ -24,10 +38,21 @@ static void trim_string(char *str);
 int repl_init(struct sql_repl *repl, struct sql_executor *executor) {
     repl->executor = executor;
     repl->quit_requested = 0;
+    repl->replica = NULL;
     memset(repl->input_buffer, 0, sizeof(repl->input_buffer));
     return 0;
 }
 
+/*
+ * Release REPL resources
+ */
+void repl_close(struct sql_repl *repl) {
+    if (repl->replica) {
+        replica_close(repl->replica);
+        repl->replica = NULL;
+    }
+}
+
 /*
  * Print REPL banner
  */
@@ -105,6 +130,11 @@ int repl_execute_command(struct sql_repl *repl, const char *command) {
     struct sql_statement stmt;
     int rc;
 
+    /* A follower catches up with its primary before every command */
+    if (repl->replica) {
+        follow_poll(repl);
+    }
+
     /* Check for meta-command (starts with .) */
     if (command[0] == '.') {
         return handle_meta_command(repl, command);
@@ -117,6 +147,21 @@ int repl_execute_command(struct sql_repl *repl, const char *command) {
         return -1;
     }
 
+    /* Only the primary writes */
+    if (repl->replica && stmt.type != STMT_SELECT) {
+        printf("Error: Read-only follower (.follow off to write)\n");
+        return -1;
+    }
+
+    /* SELECT rows are printed as they are read */
+    if (stmt.type == STMT_SELECT) {
+        if (executor_query(repl->executor, &stmt.stmt.select) != 0) {
+            printf("Error: %s\n", executor_get_error(repl->executor));
+            return -1;
+        }
+        return print_select_results(repl->executor);
+    }
+
     /* Execute statement */
     rc = executor_execute(repl->executor, &stmt);
     if (rc != 0) {
@@ -138,10 +183,6 @@ int repl_execute_command(struct sql_repl *repl, const char *command) {
             printf("Row inserted successfully.\n");
             break;
 
-        case STMT_SELECT:
-            print_select_results(repl->executor);
-            break;
-
         case STMT_UPDATE:
             printf("Rows updated successfully.\n");
             break;
@@ -150,6 +191,10 @@ int repl_execute_command(struct sql_repl *repl, const char *command) {
             printf("Rows deleted successfully.\n");
             break;
 
+        case STMT_ANALYZE:
+            printf("Statistics updated.\n");
+            break;
+
         default:
             printf("Command executed successfully.\n");
             break;
@@ -164,10 +209,11 @@ int repl_execute_command(struct sql_repl *repl, const char *command) {
 static int handle_meta_command(struct sql_repl *repl, const char *command) {
     char cmd_name[64];
     char arg[256];
+    char arg2[256];
     int n;
 
     /* Parse meta-command */
-    n = sscanf(command, "%63s %255s", cmd_name, arg);
+    n = sscanf(command, "%63s %255s %255s", cmd_name, arg, arg2);
     if (n < 1) {
         return -1;
     }
@@ -200,6 +246,70 @@ static int handle_meta_command(struct sql_repl *repl, const char *command) {
         return 0;
     }
 
+    /* .durability [full|normal|off] */
+    if (strcmp(cmd_name, ".durability") == 0) {
+        set_durability(repl->executor, (n >= 2) ? arg : NULL);
+        return 0;
+    }
+
+    /* .backup <file> [incremental] */
+    if (strcmp(cmd_name, ".backup") == 0) {
+        if (n == 2) {
+            run_backup(repl->executor, arg, 0);
+        } else if (n == 3 && strcmp(arg2, "incremental") == 0) {
+            run_backup(repl->executor, arg, 1);
+        } else {
+            printf("Usage: .backup <file> [incremental]\n");
+        }
+        return 0;
+    }
+
+    /* .restore <backup> <increment> */
+    if (strcmp(cmd_name, ".restore") == 0) {
+        if (n == 3) {
+            run_restore(repl->executor, arg, arg2);
+        } else {
+            printf("Usage: .restore <backup> <increment>\n");
+        }
+        return 0;
+    }
+
+    /* .cdc [on|off] */
+    if (strcmp(cmd_name, ".cdc") == 0) {
+        set_capture(repl->executor, (n >= 2) ? arg : NULL);
+        return 0;
+    }
+
+    /* .changes [position] */
+    if (strcmp(cmd_name, ".changes") == 0) {
+        print_changes(repl->executor, (n >= 2) ? arg : NULL);
+        return 0;
+    }
+
+    /* .ship [<stream>|off] */
+    if (strcmp(cmd_name, ".ship") == 0) {
+        set_shipping(repl->executor, (n >= 2) ? arg : NULL);
+        return 0;
+    }
+
+    /* .shadow [on|off] */
+    if (strcmp(cmd_name, ".shadow") == 0) {
+        set_shadow(repl->executor, (n >= 2) ? arg : NULL);
+        return 0;
+    }
+
+    /* .follow [<stream>|off] */
+    if (strcmp(cmd_name, ".follow") == 0) {
+        set_following(repl, (n >= 2) ? arg : NULL);
+        return 0;
+    }
+
+    /* .stats */
+    if (strcmp(cmd_name, ".stats") == 0) {
+        print_stats(repl->executor);
+        return 0;
+    }
+
     printf("Unknown meta-command: %s\n", cmd_name);
     printf("Type .help for help\n");
     return -1;
@@ -218,13 +328,36 @@ static void print_help(void) {
     printf("  .quit              Exit the shell\n");
     printf("  .tables            List all tables\n");
     printf("  .schema <table>    Show table schema\n");
+    printf("  .durability [full|normal|off]\n");
+    printf("                     Show or set commit durability (inside\n");
+    printf("                     BEGIN: this transaction only)\n");
+    printf("  .stats             Show transaction and commit latency stats\n");
+    printf("  .backup <file> [incremental]\n");
+    printf("                     Copy the database (or the pages changed\n");
+    printf("                     since the last backup) to a backup file\n");
+    printf("  .restore <backup> <increment>\n");
+    printf("                     Apply an incremental backup to a backup\n");
+    printf("  .cdc [on|off]      Show or set change capture (committed row\n");
+    printf("                     changes are kept in <db>-cdc)\n");
+    printf("  .changes [position]\n");
+    printf("                     List captured changes from a position\n");
+    printf("  .ship [<stream>|off]\n");
+    printf("                     Ship committed WAL records to a follower\n");
+    printf("  .follow [<stream>|off]\n");
+    printf("                     Apply a primary's shipped WAL (read-only)\n");
+    printf("  .shadow [on|off]   Show or set shadow-paging commits (copy\n");
+    printf("                     changed pages, no WAL, no savepoints)\n");
     printf("\n");
     printf("SQL commands:\n");
     printf("  CREATE TABLE <name> (columns...)\n");
     printf("  INSERT INTO <table> VALUES (...)\n");
     printf("  SELECT * FROM <table> [WHERE ...] [ORDER BY ...] [LIMIT n]\n");
+    printf("  EXPLAIN SELECT ...  Show the plan: operator, rows, cost\n");
+    printf("  ANALYZE [<table>]   Gather column statistics for the planner\n");
     printf("  UPDATE <table> SET ... WHERE ...\n");
     printf("  DELETE FROM <table> WHERE ...\n");
+    printf("  BEGIN / COMMIT / ROLLBACK\n");
+    printf("  SAVEPOINT <name> / RELEASE <name> / ROLLBACK TO <name>\n");
     printf("\n");
     printf("Example:\n");
     printf("  CREATE TABLE users (id INTEGER PRIMARY KEY, name TEXT);\n");
@@ -233,6 +366,404 @@ static void print_help(void) {
     printf("\n");
 }
 
+/*
+ * Show or change the durability level
+ *
+ * Outside a transaction this sets the database default; inside one it
+ * only applies until COMMIT / ROLLBACK.
+ */
+static void set_durability(struct sql_executor *exec, const char *level) {
+    static const char *names[] = { "OFF", "NORMAL", "FULL" };  /* WAL_SYNC_* */
+    struct txn_context *txn = exec->txn;
+    uint8_t value;
+    int i;
+
+    if (txn == NULL) {
+        printf("Error: Transactions unavailable\n");
+        return;
+    }
+
+    if (level == NULL) {
+        printf("Durability: %s\n", names[txn->wal->durability]);
+        if (txn->state == TXN_STATE_ACTIVE) {
+            printf("Current transaction: %s\n", names[txn->wal->sync_mode]);
+        }
+        return;
+    }
+
+    for (i = 0; i < 3; i++) {
+        const char *a = level;
+        const char *b = names[i];
+        while (*a && toupper((unsigned char)*a) == *b) {
+            a++;
+            b++;
+        }
+        if (*a == '\0' && *b == '\0') {
+            break;
+        }
+    }
+    if (i == 3) {
+        printf("Usage: .durability [full|normal|off]\n");
+        return;
+    }
+    value = (uint8_t)i;
+
+    if (txn->state == TXN_STATE_ACTIVE) {
+        txn_set_durability(txn, value);
+        printf("Durability for this transaction: %s\n", names[value]);
+    } else {
+        wal_set_durability(txn->wal, value);
+        printf("Durability: %s\n", names[value]);
+    }
+}
+
+/*
+ * Back up the database with the online backup API
+ *
+ * Copies 64 pages (256KB) per step; a program doing this in the
+ * background would run its statements between the steps.
+ */
+static void run_backup(struct sql_executor *exec, const char *path, int incremental) {
+    struct amidb_backup *backup;
+    int rc;
+
+    /* The backup copies the file: committed pages still cached go first */
+    cache_flush(exec->cache);
+
+    if (incremental) {
+        rc = amidb_backup_init_incremental(exec->pager, path, &backup);
+    } else {
+        rc = amidb_backup_init(exec->pager, path, &backup);
+    }
+    if (rc != AMIDB_OK) {
+        printf("Error: Cannot start backup to '%s'\n", path);
+        return;
+    }
+
+    do {
+        rc = amidb_backup_step(backup, 64);
+    } while (rc == AMIDB_OK);
+
+    if (rc == AMIDB_DONE && incremental) {
+        printf("Incremental backup complete: %lu of %lu pages (epoch %lu)\n",
+               (unsigned long)backup->record_count,
+               (unsigned long)backup->page_count,
+               (unsigned long)backup->base_epoch + 1);
+    } else if (rc == AMIDB_DONE) {
+        printf("Backup complete: %lu pages (%lu recopied) in %lu steps\n",
+               (unsigned long)backup->pages_copied,
+               (unsigned long)backup->pages_recopied,
+               (unsigned long)backup->step_count);
+    } else {
+        printf("Error: Backup failed (%d)\n", rc);
+    }
+
+    amidb_backup_finish(backup);
+}
+
+/*
+ * Apply an incremental backup to a backup file
+ */
+static void run_restore(struct sql_executor *exec, const char *db_path, const char *incr_path) {
+    int rc;
+
+    /* Only closed files: the open database is not a backup */
+    if (strcmp(db_path, exec->pager->file_path) == 0) {
+        printf("Error: Cannot restore into the open database\n");
+        return;
+    }
+
+    rc = amidb_backup_restore(db_path, incr_path);
+    if (rc == AMIDB_OK) {
+        printf("Restored '%s' into '%s'\n", incr_path, db_path);
+    } else if (rc == AMIDB_ERROR) {
+        printf("Error: '%s' is not the backup this increment follows\n", db_path);
+    } else if (rc == AMIDB_CORRUPT) {
+        printf("Error: '%s' is damaged; nothing was written\n", incr_path);
+    } else {
+        printf("Error: Restore failed (%d)\n", rc);
+    }
+}
+
+/*
+ * Show or switch change capture
+ */
+static void set_capture(struct sql_executor *exec, const char *mode) {
+    struct txn_context *txn = exec->txn;
+
+    if (txn == NULL) {
+        printf("Error: Transactions unavailable\n");
+        return;
+    }
+
+    if (mode == NULL) {
+        printf("Change capture: %s\n", txn->wal->cdc_handle ? "ON" : "OFF");
+        return;
+    }
+
+    if (txn->state == TXN_STATE_ACTIVE) {
+        printf("Error: Cannot change capture inside a transaction\n");
+        return;
+    }
+
+    if (strcmp(mode, "on") == 0 || strcmp(mode, "ON") == 0) {
+        if (txn->commit_mode == TXN_COMMIT_SHADOW) {
+            printf("Error: Change capture needs the WAL (.shadow off first)\n");
+            return;
+        }
+        if (cdc_enable(txn->wal) != AMIDB_OK) {
+            printf("Error: Cannot create the change log\n");
+            return;
+        }
+        printf("Change capture: ON\n");
+    } else if (strcmp(mode, "off") == 0 || strcmp(mode, "OFF") == 0) {
+        cdc_disable(txn->wal);
+        printf("Change capture: OFF (change log deleted)\n");
+    } else {
+        printf("Usage: .cdc [on|off]\n");
+    }
+}
+
+/*
+ * List committed row changes from a change log position
+ */
+static void print_changes(struct sql_executor *exec, const char *position) {
+    static const char *ops[] = { "?", "INSERT", "UPDATE", "DELETE" };
+    struct cdc_reader *reader;
+    struct cdc_event event;
+    uint32_t count = 0;
+    int rc;
+
+    rc = cdc_reader_open(exec->pager->file_path,
+                         position ? (uint32_t)strtoul(position, NULL, 10) : 0, &reader);
+    if (rc == AMIDB_NOTFOUND) {
+        printf("Change capture is off (.cdc on to start it)\n");
+        return;
+    }
+    if (rc != AMIDB_OK) {
+        printf("Error: Cannot open the change log (%d)\n", rc);
+        return;
+    }
+
+    while ((rc = cdc_next(reader, &event)) == AMIDB_ROW) {
+        printf("  LSN %6lu  %s %s key %ld",
+               (unsigned long)event.lsn, ops[event.op <= CDC_DELETE ? event.op : 0],
+               event.table, (long)event.key);
+        if (event.row) {
+            printf(" (%lu bytes)", (unsigned long)event.row_size);
+        }
+        printf("\n");
+        count++;
+    }
+    if (rc == AMIDB_CORRUPT) {
+        printf("Error: Change log is damaged at position %lu\n",
+               (unsigned long)cdc_reader_position(reader));
+    }
+
+    printf("%lu change%s; next position: %lu\n", (unsigned long)count,
+           count == 1 ? "" : "s", (unsigned long)cdc_reader_position(reader));
+    cdc_reader_close(reader);
+}
+
+/*
+ * Show, start or stop shipping the WAL to a follower
+ */
+static void set_shipping(struct sql_executor *exec, const char *stream) {
+    struct txn_context *txn = exec->txn;
+    int rc;
+
+    if (txn == NULL) {
+        printf("Error: Transactions unavailable\n");
+        return;
+    }
+
+    if (stream == NULL) {
+        if (txn->wal->ship_handle) {
+            printf("Shipping: ON (%lu bytes shipped)\n", (unsigned long)txn->wal->ship_bytes);
+        } else if (txn->wal->ship_failed) {
+            printf("Shipping: OFF (stopped by a write error; copy the follower again)\n");
+        } else {
+            printf("Shipping: OFF\n");
+        }
+        return;
+    }
+
+    if (txn->state == TXN_STATE_ACTIVE) {
+        printf("Error: Cannot change shipping inside a transaction\n");
+        return;
+    }
+
+    if (strcmp(stream, "off") == 0 || strcmp(stream, "OFF") == 0) {
+        replica_ship_stop(txn->wal);
+        printf("Shipping: OFF\n");
+        return;
+    }
+
+    if (txn->commit_mode == TXN_COMMIT_SHADOW) {
+        printf("Error: Shipping needs the WAL (.shadow off first)\n");
+        return;
+    }
+
+    rc = replica_ship_start(txn->wal, stream);
+    if (rc == AMIDB_BUSY) {
+        printf("Error: Already shipping (.ship off first)\n");
+    } else if (rc != AMIDB_OK) {
+        printf("Error: Cannot open '%s' (%d)\n", stream, rc);
+    } else {
+        printf("Shipping to '%s' (copy the follower with .backup now)\n", stream);
+    }
+}
+
+/*
+ * Show, start or stop following a primary
+ */
+static void set_following(struct sql_repl *repl, const char *stream) {
+    struct sql_executor *exec = repl->executor;
+    struct txn_context *txn = exec->txn;
+    int rc;
+
+    if (stream == NULL) {
+        if (repl->replica) {
+            printf("Following: %lu transactions applied, %lu records (%lu already applied)\n",
+                   (unsigned long)repl->replica->txns_applied,
+                   (unsigned long)repl->replica->records_received,
+                   (unsigned long)repl->replica->records_skipped);
+        } else {
+            printf("Following: OFF\n");
+        }
+        return;
+    }
+
+    if (strcmp(stream, "off") == 0 || strcmp(stream, "OFF") == 0) {
+        repl_close(repl);
+        printf("Following: OFF\n");
+        return;
+    }
+
+    if (txn == NULL || txn->state == TXN_STATE_ACTIVE || repl->replica) {
+        printf("Error: Cannot follow now (transaction active or already following)\n");
+        return;
+    }
+
+    /* Applied images go straight to the file */
+    cache_flush(exec->cache);
+
+    rc = replica_open(txn->wal, exec->cache, stream, &repl->replica);
+    if (rc == AMIDB_NOTFOUND) {
+        printf("Error: No ship stream '%s'\n", stream);
+        return;
+    }
+    if (rc != AMIDB_OK) {
+        printf("Error: Cannot follow '%s' (%d)\n", stream, rc);
+        return;
+    }
+
+    follow_poll(repl);
+    if (repl->replica) {
+        printf("Following '%s': %lu transactions applied\n", stream,
+               (unsigned long)repl->replica->txns_applied);
+    }
+}
+
+/*
+ * Show or switch shadow-paging commits
+ */
+static void set_shadow(struct sql_executor *exec, const char *mode) {
+    struct txn_context *txn = exec->txn;
+    uint8_t value;
+    int rc;
+
+    if (txn == NULL) {
+        printf("Error: Transactions unavailable\n");
+        return;
+    }
+
+    if (mode == NULL) {
+        printf("Shadow paging: %s\n", txn->commit_mode == TXN_COMMIT_SHADOW ? "ON" : "OFF");
+        return;
+    }
+
+    if (strcmp(mode, "on") == 0 || strcmp(mode, "ON") == 0) {
+        value = TXN_COMMIT_SHADOW;
+    } else if (strcmp(mode, "off") == 0 || strcmp(mode, "OFF") == 0) {
+        value = TXN_COMMIT_WAL;
+    } else {
+        printf("Usage: .shadow [on|off]\n");
+        return;
+    }
+
+    /* Pages written outside a transaction must reach the file first */
+    if (txn->state != TXN_STATE_ACTIVE) {
+        cache_flush(exec->cache);
+    }
+
+    rc = txn_set_commit_mode(txn, value);
+    if (rc == AMIDB_BUSY) {
+        printf("Error: Cannot switch now (transaction active, or change capture /\n");
+        printf("       shipping on)\n");
+    } else if (rc != AMIDB_OK) {
+        printf("Error: Cannot switch commit mode (%d)\n", rc);
+    } else {
+        printf("Shadow paging: %s\n", value == TXN_COMMIT_SHADOW ? "ON" : "OFF");
+    }
+}
+
+/*
+ * Apply what the primary shipped since the last command
+ */
+static void follow_poll(struct sql_repl *repl) {
+    int rc;
+
+    rc = replica_poll(repl->replica);
+    if (rc < 0) {
+        printf("Error: Following stopped (%d)\n", rc);
+        repl_close(repl);
+    }
+}
+
+/*
+ * Print transaction counters and the commit latency distribution
+ */
+static void print_stats(struct sql_executor *exec) {
+    struct txn_context *txn = exec->txn;
+    uint32_t i;
+
+    if (txn == NULL) {
+        printf("Error: Transactions unavailable\n");
+        return;
+    }
+
+    printf("Commits: %lu  Aborts: %lu  Pages logged: %lu\n",
+           (unsigned long)txn->commit_count,
+           (unsigned long)txn->abort_count,
+           (unsigned long)txn->pages_logged);
+    printf("WAL flushes: %lu  (waited for writer: %lu, writer: %s)\n",
+           (unsigned long)txn->wal->flush_count,
+           (unsigned long)txn->wal->flush_waits,
+           txn->wal->writer ? "background" : "inline");
+    if (txn->commit_mode == TXN_COMMIT_SHADOW || txn->pages_shadowed > 0) {
+        printf("Pages shadowed: %lu\n", (unsigned long)txn->pages_shadowed);
+    }
+
+    if (txn->commit_count == 0) {
+        return;
+    }
+
+    printf("Commit latency (to durability point):\n");
+    for (i = 0; i < TXN_LATENCY_BUCKETS; i++) {
+        if (txn->commit_latency[i] == 0) {
+            continue;
+        }
+        if (i == 0) {
+            printf("  <     1 ms  %6lu\n", (unsigned long)txn->commit_latency[i]);
+        } else {
+            printf("  >= %4lu ms  %6lu\n", (unsigned long)txn_latency_bucket_ms(i),
+                   (unsigned long)txn->commit_latency[i]);
+        }
+    }
+    printf("  max %lu ms\n", (unsigned long)txn->commit_latency_max);
+}
+
 /*
  * Print all tables
  */
@@ -260,7 +791,8 @@ static void print_tables(struct sql_executor *exec) {
  * Print table schema
  */
 static void print_schema(struct sql_executor *exec, const char *table_name) {
-    struct table_schema schema;
+    static struct table_schema schema;  /* Off the 4KB stack */
+    struct btree *table_tree;
     int rc;
     int i;
     const char *type_name;
@@ -303,37 +835,50 @@ static void print_schema(struct sql_executor *exec, const char *table_name) {
         printf("\nImplicit rowid: yes (next=%u)\n", schema.next_rowid);
     }
     printf("Row count: %u\n", schema.row_count);
+
+    if (schema.analyzed_rows > 0) {
+        printf("Statistics (ANALYZE of %u rows):\n", schema.analyzed_rows);
+        for (i = 0; i < (int)schema.column_count; i++) {
+            printf("  %s: ~%u distinct, %u NULL", schema.columns[i].name,
+                   schema.stats[i].distinct, schema.stats[i].null_count);
+            if (schema.columns[i].type == SQL_TYPE_INTEGER &&
+                schema.stats[i].null_count < schema.analyzed_rows) {
+                printf(", %ld..%ld", (long)schema.stats[i].min_value,
+                       (long)schema.stats[i].max_value);
+            }
+            printf("\n");
+        }
+    }
+
+    table_tree = btree_open(exec->pager, exec->cache, schema.btree_root);
+    if (table_tree) {
+        printf("Engine: %s\n", (table_tree->engine == BTREE_ENGINE_LSM) ? "LSM" : "B+Tree");
+        btree_close(table_tree);
+    }
     printf("\n");
 }
 
 /*
- * Print SELECT results
+ * Print the rows of the open query as they are read
+ *
+ * Returns: 0 on success, -1 if the query failed part way
  */
-static void print_select_results(struct sql_executor *exec) {
-    uint32_t row_count = exec->result_count;
-    uint32_t col_count;
-    uint32_t i, j;
-    struct amidb_row *row;
+static int print_select_results(struct sql_executor *exec) {
+    const struct amidb_row *row;
     const struct amidb_value *val;
+    uint32_t row_count = 0;
+    uint32_t j;
     char buffer[256];
+    int rc;
 
-    if (row_count == 0) {
-        printf("No rows returned.\n");
-        return;
-    }
-
-    /* Get column count from first row */
-    row = &exec->result_rows[0];
-    col_count = row->column_count;
-
-    printf("\n");
-
-    /* Print rows */
-    for (i = 0; i < row_count; i++) {
-        row = &exec->result_rows[i];
+    while ((rc = executor_step(exec, &row)) == AMIDB_ROW) {
+        if (row_count == 0) {
+            printf("\n");
+        }
+        row_count++;
 
-        printf("Row %u: ", i + 1);
-        for (j = 0; j < col_count; j++) {
+        printf("Row %u: ", row_count);
+        for (j = 0; j < row->column_count; j++) {
             val = row_get_value(row, j);
             if (val == NULL) {
                 printf("NULL");
@@ -362,14 +907,26 @@ static void print_select_results(struct sql_executor *exec) {
                 }
             }
 
-            if (j < col_count - 1) {
+            if (j < row->column_count - 1) {
                 printf(", ");
             }
         }
         printf("\n");
     }
 
-    printf("\n%u row%s returned.\n\n", row_count, row_count == 1 ? "" : "s");
+    executor_finish(exec);
+
+    if (rc != AMIDB_DONE) {
+        printf("Error: %s\n", executor_get_error(exec));
+        return -1;
+    }
+
+    if (row_count == 0) {
+        printf("No rows returned.\n");
+    } else {
+        printf("\n%u row%s returned.\n\n", row_count, row_count == 1 ? "" : "s");
+    }
+    return 0;
 }
 
 /*
@@ -8,6 +8,7 @@
 #define AMIDB_REPL_H
 
 #include "sql/executor.h"
+#include "txn/replica.h"
 
 /*
  * REPL state
@@ -16,6 +17,7 @@ struct sql_repl {
     struct sql_executor *executor;
     char input_buffer[1024];
     int quit_requested;
+    struct replica *replica;         /* Following a primary (NULL: not) */
 };
 
 /*
@@ -23,6 +25,11 @@ struct sql_repl {
  */
 int repl_init(struct sql_repl *repl, struct sql_executor *executor);
 
+/*
+ * Release REPL resources (stops following a primary)
+ */
+void repl_close(struct sql_repl *repl);
+
 /*
  * Run REPL main loop
  * Returns 0 on normal exit, -1 on error
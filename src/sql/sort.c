@@ -0,0 +1,668 @@
+/*
+ * sort.c - External merge sort for ORDER BY
+ */
+
+#include "sql/sort.h"
+#include "api/error.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Record (in memory and in runs):
+ *   [0..1] row size  [2] key type  [3] key length  [4..7] integer key
+ *   then the key text and the serialized row
+ * Fields are copied with memcpy: records are not aligned.
+ */
+
+/* A run: a stretch of the temporary file */
+struct sorter_run {
+    uint32_t start;
+    uint32_t end;
+};
+
+/* Reads one run through a buffer of SORTER_BUFFER bytes */
+struct sorter_reader {
+    uint8_t *buf;
+    uint32_t start;                 /* Current record in buf */
+    uint32_t length;                /* Bytes in buf */
+    uint32_t pos;                   /* Next file offset to read */
+    uint32_t end;                   /* End of the run */
+};
+
+/* Collects records and appends them to the temporary file */
+struct sorter_writer {
+    uint8_t *buf;
+    uint32_t used;
+};
+
+/* Numbers the temporary files of sorts open at the same time */
+static uint32_t sorter_file_number = 0;
+
+/* ========== Records ========== */
+
+static uint32_t record_row_size(const uint8_t *rec) {
+    uint16_t size;
+
+    memcpy(&size, rec, 2);
+    return size;
+}
+
+static uint32_t record_size(const uint8_t *rec) {
+    return SORTER_RECORD_HEADER + rec[3] + record_row_size(rec);
+}
+
+/* Write a record's header and key */
+static void put_header(uint8_t *rec, uint32_t row_size, uint8_t key_type, uint32_t key_len,
+                       int32_t key_int, const struct amidb_value *key) {
+    uint16_t size16 = (uint16_t)row_size;
+
+    memcpy(rec, &size16, 2);
+    rec[2] = key_type;
+    rec[3] = (uint8_t)key_len;
+    memcpy(rec + 4, &key_int, 4);
+    if (key_len > 0) {
+        memcpy(rec + SORTER_RECORD_HEADER, key->u.blob.data, key_len);
+    }
+}
+
+static int compare_records(const uint8_t *a, const uint8_t *b, uint8_t key_type) {
+    int32_t ka, kb;
+    uint32_t n;
+    int cmp;
+
+    if (key_type == AMIDB_TYPE_INTEGER) {
+        memcpy(&ka, a + 4, 4);
+        memcpy(&kb, b + 4, 4);
+        return (ka < kb) ? -1 : (ka > kb) ? 1 : 0;
+    }
+    if (key_type == AMIDB_TYPE_TEXT) {
+        n = (a[3] < b[3]) ? a[3] : b[3];
+        cmp = memcmp(a + SORTER_RECORD_HEADER, b + SORTER_RECORD_HEADER, n);
+        if (cmp != 0) {
+            return cmp;
+        }
+        return (a[3] < b[3]) ? -1 : (a[3] > b[3]) ? 1 : 0;
+    }
+    return 0;
+}
+
+static int compare_int_asc(const void *a, const void *b) {
+    return compare_records(*(uint8_t *const *)a, *(uint8_t *const *)b, AMIDB_TYPE_INTEGER);
+}
+
+static int compare_int_desc(const void *a, const void *b) {
+    return compare_int_asc(b, a);
+}
+
+static int compare_text_asc(const void *a, const void *b) {
+    return compare_records(*(uint8_t *const *)a, *(uint8_t *const *)b, AMIDB_TYPE_TEXT);
+}
+
+static int compare_text_desc(const void *a, const void *b) {
+    return compare_text_asc(b, a);
+}
+
+/* Does record a come out before record b? */
+static int record_before(const struct sql_sorter *sorter, const uint8_t *a, const uint8_t *b) {
+    int cmp = compare_records(a, b, sorter->key_type);
+
+    return sorter->ascending ? (cmp < 0) : (cmp > 0);
+}
+
+/* Entries: record pointers growing down from the top of memory */
+/* (or the top-K heap) */
+static uint8_t **sorter_entries(struct sql_sorter *sorter) {
+    if (sorter->best) {
+        return sorter->best;
+    }
+    return (uint8_t **)(sorter->memory + sorter->memory_size) - sorter->count;
+}
+
+static void sort_entries(struct sql_sorter *sorter) {
+    int (*compare)(const void *, const void *) = NULL;
+
+    if (sorter->key_type == AMIDB_TYPE_INTEGER) {
+        compare = sorter->ascending ? compare_int_asc : compare_int_desc;
+    } else if (sorter->key_type == AMIDB_TYPE_TEXT) {
+        compare = sorter->ascending ? compare_text_asc : compare_text_desc;
+    }
+    if (compare && sorter->count > 1) {
+        qsort(sorter_entries(sorter), sorter->count, sizeof(uint8_t *), compare);
+    }
+}
+
+/* ========== Temporary File ========== */
+
+static int open_file(struct sql_sorter *sorter) {
+    sorter->file = file_open(sorter->path, AMIDB_O_RDWR | AMIDB_O_CREATE | AMIDB_O_TRUNC);
+    if (sorter->file == NULL) {
+        return AMIDB_IOERR;
+    }
+    sorter->file_end = 0;
+    return AMIDB_OK;
+}
+
+static int writer_flush(struct sql_sorter *sorter, struct sorter_writer *w) {
+    if (w->used == 0) {
+        return AMIDB_OK;
+    }
+    if (file_seek(sorter->file, (int32_t)sorter->file_end, AMIDB_SEEK_SET) < 0 ||
+        file_write(sorter->file, w->buf, w->used) != (int32_t)w->used) {
+        return AMIDB_IOERR;
+    }
+    sorter->file_end += w->used;
+    w->used = 0;
+    return AMIDB_OK;
+}
+
+static int writer_put(struct sql_sorter *sorter, struct sorter_writer *w, const uint8_t *rec) {
+    uint32_t size = record_size(rec);
+    int rc;
+
+    if (w->used + size > SORTER_BUFFER) {
+        rc = writer_flush(sorter, w);
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+    }
+    memcpy(w->buf + w->used, rec, size);
+    w->used += size;
+    return AMIDB_OK;
+}
+
+static int add_run(struct sql_sorter *sorter, uint32_t start, uint32_t end) {
+    struct sorter_run *runs;
+    uint32_t capacity;
+
+    if (sorter->run_count == sorter->run_capacity) {
+        capacity = sorter->run_capacity ? sorter->run_capacity * 2 : 16;
+        runs = (struct sorter_run *)realloc(sorter->runs, capacity * sizeof(struct sorter_run));
+        if (runs == NULL) {
+            return AMIDB_NOMEM;
+        }
+        sorter->runs = runs;
+        sorter->run_capacity = capacity;
+    }
+    sorter->runs[sorter->run_count].start = start;
+    sorter->runs[sorter->run_count].end = end;
+    sorter->run_count++;
+    sorter->runs_written++;
+    return AMIDB_OK;
+}
+
+/*
+ * Sort the rows in memory and write them out as a run
+ * (through the buffer at the bottom of memory)
+ */
+static int spill(struct sql_sorter *sorter) {
+    struct sorter_writer w;
+    uint8_t **entries;
+    uint32_t start = sorter->file_end;
+    uint32_t i;
+    int rc;
+
+    sort_entries(sorter);
+    entries = sorter_entries(sorter);
+
+    w.buf = sorter->memory;
+    w.used = 0;
+    for (i = 0; i < sorter->count; i++) {
+        rc = writer_put(sorter, &w, entries[i]);
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+    }
+    rc = writer_flush(sorter, &w);
+    if (rc != AMIDB_OK) {
+        return rc;
+    }
+
+    sorter->used = 0;
+    sorter->count = 0;
+    return add_run(sorter, start, sorter->file_end);
+}
+
+/* ========== Merging ========== */
+
+/*
+ * Make sure the reader's next record is whole in its buffer
+ *
+ * Returns: AMIDB_OK, AMIDB_DONE (run exhausted), or AMIDB_IOERR
+ */
+static int reader_fill(struct sql_sorter *sorter, struct sorter_reader *r) {
+    uint32_t avail = r->length - r->start;
+    uint32_t want;
+
+    if (avail >= SORTER_RECORD_HEADER && avail >= record_size(r->buf + r->start)) {
+        return AMIDB_OK;
+    }
+    if (r->pos >= r->end) {
+        return (avail == 0) ? AMIDB_DONE : AMIDB_IOERR;
+    }
+
+    memmove(r->buf, r->buf + r->start, avail);
+    r->start = 0;
+    r->length = avail;
+
+    want = SORTER_BUFFER - avail;
+    if (want > r->end - r->pos) {
+        want = r->end - r->pos;
+    }
+    if (file_seek(sorter->file, (int32_t)r->pos, AMIDB_SEEK_SET) < 0 ||
+        file_read(sorter->file, r->buf + avail, want) != (int32_t)want) {
+        return AMIDB_IOERR;
+    }
+    r->pos += want;
+    r->length += want;
+
+    if (r->length < SORTER_RECORD_HEADER || r->length < record_size(r->buf)) {
+        return AMIDB_IOERR;
+    }
+    return AMIDB_OK;
+}
+
+static const uint8_t *reader_record(const struct sorter_reader *r) {
+    return r->buf + r->start;
+}
+
+static void heap_down(struct sql_sorter *sorter, uint32_t i) {
+    uint32_t *heap = sorter->heap;
+    uint32_t child;
+    uint32_t tmp;
+
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= sorter->heap_count) {
+            break;
+        }
+        if (child + 1 < sorter->heap_count &&
+            record_before(sorter, reader_record(&sorter->readers[heap[child + 1]]),
+                          reader_record(&sorter->readers[heap[child]]))) {
+            child++;
+        }
+        if (!record_before(sorter, reader_record(&sorter->readers[heap[child]]),
+                           reader_record(&sorter->readers[heap[i]]))) {
+            break;
+        }
+        tmp = heap[i];
+        heap[i] = heap[child];
+        heap[child] = tmp;
+        i = child;
+    }
+}
+
+/*
+ * Start merging runs, reading through the buffers at buffers
+ */
+static int merge_begin(struct sql_sorter *sorter, const struct sorter_run *runs, uint32_t n,
+                       uint8_t *buffers) {
+    struct sorter_reader *r;
+    uint32_t i;
+    int rc;
+
+    sorter->heap_count = 0;
+    for (i = 0; i < n; i++) {
+        r = &sorter->readers[i];
+        r->buf = buffers + i * SORTER_BUFFER;
+        r->start = 0;
+        r->length = 0;
+        r->pos = runs[i].start;
+        r->end = runs[i].end;
+
+        rc = reader_fill(sorter, r);
+        if (rc == AMIDB_OK) {
+            sorter->heap[sorter->heap_count++] = i;
+        } else if (rc != AMIDB_DONE) {
+            return rc;
+        }
+    }
+
+    for (i = sorter->heap_count / 2; i > 0; i--) {
+        heap_down(sorter, i - 1);
+    }
+    return AMIDB_OK;
+}
+
+/* Smallest record not returned yet (NULL when all are) */
+static const uint8_t *merge_top(const struct sql_sorter *sorter) {
+    if (sorter->heap_count == 0) {
+        return NULL;
+    }
+    return reader_record(&sorter->readers[sorter->heap[0]]);
+}
+
+/* Move past merge_top's record (which is then gone) */
+static int merge_advance(struct sql_sorter *sorter) {
+    struct sorter_reader *r = &sorter->readers[sorter->heap[0]];
+    int rc;
+
+    r->start += record_size(reader_record(r));
+    rc = reader_fill(sorter, r);
+    if (rc == AMIDB_DONE) {
+        sorter->heap[0] = sorter->heap[--sorter->heap_count];
+    } else if (rc != AMIDB_OK) {
+        return rc;
+    }
+    heap_down(sorter, 0);
+    return AMIDB_OK;
+}
+
+/*
+ * Merge groups of fan_in runs into one run each
+ */
+static int merge_pass(struct sql_sorter *sorter, uint32_t fan_in) {
+    struct sorter_run *old = sorter->runs;
+    uint32_t old_count = sorter->run_count;
+    struct sorter_writer w;
+    const uint8_t *rec;
+    uint32_t start;
+    uint32_t g, n;
+    int rc = AMIDB_OK;
+
+    sorter->runs = NULL;
+    sorter->run_count = 0;
+    sorter->run_capacity = 0;
+
+    w.buf = sorter->memory + fan_in * SORTER_BUFFER;
+    for (g = 0; g < old_count && rc == AMIDB_OK; g += n) {
+        n = (old_count - g < fan_in) ? old_count - g : fan_in;
+        start = sorter->file_end;
+        w.used = 0;
+
+        rc = merge_begin(sorter, &old[g], n, sorter->memory);
+        while (rc == AMIDB_OK && (rec = merge_top(sorter)) != NULL) {
+            rc = writer_put(sorter, &w, rec);
+            if (rc == AMIDB_OK) {
+                rc = merge_advance(sorter);
+            }
+        }
+        if (rc == AMIDB_OK) {
+            rc = writer_flush(sorter, &w);
+        }
+        if (rc == AMIDB_OK) {
+            rc = add_run(sorter, start, sorter->file_end);
+        }
+    }
+
+    free(old);
+    sorter->merge_passes++;
+    return rc;
+}
+
+/* ========== Top-K ========== */
+
+/* The heap's top is the kept record that would come out last */
+static void topk_up(struct sql_sorter *sorter, uint32_t i) {
+    uint8_t **best = sorter->best;
+    uint8_t *tmp;
+    uint32_t parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!record_before(sorter, best[parent], best[i])) {
+            break;
+        }
+        tmp = best[i];
+        best[i] = best[parent];
+        best[parent] = tmp;
+        i = parent;
+    }
+}
+
+static void topk_down(struct sql_sorter *sorter, uint32_t i) {
+    uint8_t **best = sorter->best;
+    uint8_t *tmp;
+    uint32_t child;
+
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= sorter->count) {
+            break;
+        }
+        if (child + 1 < sorter->count && record_before(sorter, best[child], best[child + 1])) {
+            child++;
+        }
+        if (!record_before(sorter, best[i], best[child])) {
+            break;
+        }
+        tmp = best[i];
+        best[i] = best[child];
+        best[child] = tmp;
+        i = child;
+    }
+}
+
+/*
+ * Keep a row if it is among the best; probe holds its header and key
+ */
+static int topk_add(struct sql_sorter *sorter, const struct amidb_row *row, uint32_t size) {
+    uint32_t head = SORTER_RECORD_HEADER + sorter->probe[3];
+    uint8_t *rec;
+
+    /* Full, and it would come out after every kept row: dropped */
+    if (sorter->count == sorter->limit &&
+        !record_before(sorter, sorter->probe, sorter->best[0])) {
+        return AMIDB_OK;
+    }
+
+    rec = (uint8_t *)malloc(size);
+    if (rec == NULL) {
+        return AMIDB_NOMEM;
+    }
+    memcpy(rec, sorter->probe, head);
+    if (row_serialize(row, rec + head, size - head) < 0) {
+        free(rec);
+        return AMIDB_FULL;
+    }
+
+    if (sorter->count == sorter->limit) {
+        free(sorter->best[0]);
+        sorter->best[0] = rec;
+        topk_down(sorter, 0);
+    } else {
+        sorter->best[sorter->count++] = rec;
+        topk_up(sorter, sorter->count - 1);
+    }
+    return AMIDB_OK;
+}
+
+/* ========== Sorter ========== */
+
+/*
+ * Start a sort
+ */
+int sorter_init(struct sql_sorter *sorter, const char *base_path, uint32_t memory,
+                uint32_t key_column, uint8_t ascending, uint32_t limit) {
+    uint32_t path_size;
+
+    memset(sorter, 0, sizeof(struct sql_sorter));
+    sorter->key_column = key_column;
+    sorter->ascending = ascending;
+    sorter->limit = limit;
+
+    if (limit > 0 && limit <= SORTER_TOPK_MAX) {
+        sorter->best = (uint8_t **)malloc(limit * sizeof(uint8_t *));
+        return sorter->best ? AMIDB_OK : AMIDB_NOMEM;
+    }
+
+    if (memory < SORTER_MIN_MEMORY) {
+        memory = SORTER_MIN_MEMORY;
+    }
+    sorter->memory_size = memory & ~(uint32_t)(sizeof(uint8_t *) - 1);
+    sorter->memory = (uint8_t *)malloc(sorter->memory_size);
+
+    /* Named now (base_path need not outlive the call), created on the first run */
+    path_size = (uint32_t)strlen(base_path) + 20;
+    sorter->path = (char *)malloc(path_size);
+    if (sorter->memory == NULL || sorter->path == NULL) {
+        sorter_close(sorter);
+        return AMIDB_NOMEM;
+    }
+    snprintf(sorter->path, path_size, "%s-sort%lu", base_path,
+             (unsigned long)sorter_file_number++);
+    return AMIDB_OK;
+}
+
+/*
+ * Add a row
+ */
+int sorter_add(struct sql_sorter *sorter, const struct amidb_row *row) {
+    const struct amidb_value *key = row_get_value(row, sorter->key_column);
+    uint8_t key_type = key ? key->type : AMIDB_TYPE_NULL;
+    uint32_t row_size = row_get_serialized_size(row);
+    uint32_t key_len = 0;
+    int32_t key_int = 0;
+    uint32_t size;
+    uint8_t *rec;
+    int rc;
+
+    /* The first key that is not NULL decides how keys compare */
+    if (sorter->key_type == AMIDB_TYPE_NULL) {
+        sorter->key_type = key_type;
+    }
+    if (key_type == AMIDB_TYPE_INTEGER) {
+        key_int = key->u.i;
+    } else if (key_type == AMIDB_TYPE_TEXT) {
+        key_len = (key->u.blob.size < 255) ? key->u.blob.size : 255;
+    }
+
+    size = SORTER_RECORD_HEADER + key_len + row_size;
+    if (size > SORTER_BUFFER) {
+        return AMIDB_FULL;
+    }
+
+    if (sorter->best) {
+        put_header(sorter->probe, row_size, key_type, key_len, key_int, key);
+        return topk_add(sorter, row, size);
+    }
+
+    /* Full: write what is held out as a run */
+    if (SORTER_BUFFER + sorter->used + size + (sorter->count + 1) * sizeof(uint8_t *) >
+        sorter->memory_size) {
+        if (sorter->file == NULL) {
+            rc = open_file(sorter);
+            if (rc != AMIDB_OK) {
+                return rc;
+            }
+        }
+        rc = spill(sorter);
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+    }
+
+    rec = sorter->memory + SORTER_BUFFER + sorter->used;
+    put_header(rec, row_size, key_type, key_len, key_int, key);
+    if (row_serialize(row, rec + SORTER_RECORD_HEADER + key_len, row_size) < 0) {
+        return AMIDB_FULL;
+    }
+
+    sorter->used += size;
+    sorter->count++;
+    sorter_entries(sorter)[0] = rec;
+    return AMIDB_OK;
+}
+
+/*
+ * Sort what was added
+ */
+int sorter_finish(struct sql_sorter *sorter) {
+    uint32_t buffers = sorter->memory_size / SORTER_BUFFER;
+    int rc;
+
+    sorter->position = 0;
+    if (sorter->run_count == 0) {
+        sort_entries(sorter);
+        return AMIDB_OK;
+    }
+
+    if (sorter->count > 0) {
+        rc = spill(sorter);
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+    }
+
+    sorter->readers = (struct sorter_reader *)malloc(buffers * sizeof(struct sorter_reader));
+    sorter->heap = (uint32_t *)malloc(buffers * sizeof(uint32_t));
+    if (sorter->readers == NULL || sorter->heap == NULL) {
+        return AMIDB_NOMEM;
+    }
+
+    /* Every buffer can read a run in the last merge; before it, one writes */
+    while (sorter->run_count > buffers) {
+        rc = merge_pass(sorter, buffers - 1);
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+    }
+    return merge_begin(sorter, sorter->runs, sorter->run_count, sorter->memory);
+}
+
+/*
+ * Get the next row in order
+ */
+int sorter_next(struct sql_sorter *sorter, struct amidb_row *row) {
+    const uint8_t *rec;
+    int rc;
+
+    if (sorter->run_count == 0) {
+        if (sorter->position >= sorter->count) {
+            return AMIDB_DONE;
+        }
+        rec = sorter_entries(sorter)[sorter->position++];
+    } else {
+        rec = merge_top(sorter);
+        if (rec == NULL) {
+            return AMIDB_DONE;
+        }
+    }
+
+    if (row_deserialize(row, rec + SORTER_RECORD_HEADER + rec[3], record_row_size(rec)) < 0) {
+        row_clear(row);
+        return AMIDB_CORRUPT;
+    }
+
+    if (sorter->run_count > 0) {
+        rc = merge_advance(sorter);
+        if (rc != AMIDB_OK) {
+            row_clear(row);
+            return rc;
+        }
+    }
+    return AMIDB_ROW;
+}
+
+/*
+ * Free the sorter
+ */
+void sorter_close(struct sql_sorter *sorter) {
+    uint32_t i;
+
+    if (sorter->best) {
+        for (i = 0; i < sorter->count; i++) {
+            free(sorter->best[i]);
+        }
+        free(sorter->best);
+        sorter->best = NULL;
+    }
+    if (sorter->file) {
+        file_close(sorter->file);
+        file_delete(sorter->path);
+        sorter->file = NULL;
+    }
+
+    free(sorter->path);
+    free(sorter->memory);
+    free(sorter->runs);
+    free(sorter->readers);
+    free(sorter->heap);
+    sorter->path = NULL;
+    sorter->memory = NULL;
+    sorter->runs = NULL;
+    sorter->readers = NULL;
+    sorter->heap = NULL;
+    sorter->run_count = 0;
+    sorter->count = 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * sort.h - External merge sort for ORDER BY
+ *
+ * Sorts rows of any number in a fixed memory budget. Rows are added one
+ * at a time and stored serialized, with their sort key in front, in one
+ * block of the budget's size. When the block is full its rows are
+ * sorted and written out as a run to a temporary file next to the
+ * database (<database>-sort<n>, deleted when the sorter is closed).
+ * Merged runs are appended to it; the space of runs already merged is
+ * not reused.
+ *
+ * If nothing had to be written the rows are returned straight from
+ * memory. Otherwise the runs are merged: the block is cut into buffers
+ * of SORTER_BUFFER bytes, one per run being read plus one for the
+ * output, and groups of runs are merged into longer runs until few
+ * enough are left to be merged as the rows are returned. Each pass
+ * reads and writes every row once, and a pass is needed only when there
+ * are more runs than buffers, so a larger budget means fewer, longer
+ * runs and fewer passes.
+ *
+ * With a limit of at most SORTER_TOPK_MAX only the best rows are kept:
+ * a heap of that many records, each allocated alone, whose top is the
+ * row that would come out last. A new row is compared with it by key
+ * alone and dropped unless it beats it, so the other rows are never
+ * stored, memory is O(limit) whatever the budget, and the work is
+ * O(rows * log limit). Larger limits sort everything.
+ *
+ * The sort key is an INTEGER or TEXT column; which one is taken from
+ * the first key that is not NULL (keys of another type sort as 0 or '').
+ * TEXT keys compare by their first 255 bytes.
+ */
+
+#ifndef AMIDB_SQL_SORT_H
+#define AMIDB_SQL_SORT_H
+
+#include "storage/row.h"
+#include "storage/pager.h"
+#include "os/file.h"
+#include <stdint.h>
+
+/* Buffer for reading or writing a run (holds the largest record) */
+#define SORTER_BUFFER       (AMIDB_PAGE_SIZE + 512)
+
+/* Smallest budget: two runs merged into a third */
+#define SORTER_MIN_MEMORY   (4 * SORTER_BUFFER)
+
+/* Largest limit kept in a top-K heap */
+#define SORTER_TOPK_MAX     1000
+
+/* Record header: row size, key type and length, integer key (see sort.c) */
+#define SORTER_RECORD_HEADER 8
+
+struct sorter_run;
+struct sorter_reader;
+
+/*
+ * Sorter
+ */
+struct sql_sorter {
+    uint32_t key_column;
+    uint8_t ascending;
+    uint8_t key_type;               /* AMIDB_TYPE_* of the first key (0 before it) */
+
+    uint8_t *memory;                /* The budget: records up, entries down */
+    uint32_t memory_size;
+    uint32_t used;                  /* Record bytes at the bottom */
+    uint32_t count;                 /* Entries at the top */
+    uint32_t position;              /* Next entry to return (in memory) */
+
+    /* Runs on disk */
+    char *path;                     /* Temporary file name */
+    amidb_file_t file;              /* Open once a run is written */
+    uint32_t file_end;
+    struct sorter_run *runs;
+    uint32_t run_count;
+    uint32_t run_capacity;
+
+    /* Top-K */
+    uint32_t limit;                 /* Rows kept (0: all) */
+    uint8_t **best;                 /* Heap of the best records (NULL: not top-K) */
+    uint8_t probe[SORTER_RECORD_HEADER + 255];  /* Key of the row being added */
+
+    /* Final merge */
+    struct sorter_reader *readers;
+    uint32_t *heap;                 /* Reader numbers, smallest record first */
+    uint32_t heap_count;
+
+    /* Statistics */
+    uint32_t runs_written;          /* Runs written, counting merged ones */
+    uint32_t merge_passes;          /* Passes before the final merge */
+};
+
+/*
+ * Start a sort
+ *
+ * base_path - Database file path (the temporary file is named after it)
+ * memory    - Budget in bytes (at least SORTER_MIN_MEMORY is used)
+ * limit     - Rows wanted (0: all). Up to SORTER_TOPK_MAX only that
+ *             many are kept (top-K, outside the budget); above it every
+ *             row is sorted and the caller stops reading at the limit
+ *
+ * Returns: AMIDB_OK, or AMIDB_NOMEM
+ */
+int sorter_init(struct sql_sorter *sorter, const char *base_path, uint32_t memory,
+                uint32_t key_column, uint8_t ascending, uint32_t limit);
+
+/*
+ * Add a row (it is copied)
+ *
+ * Returns: AMIDB_OK, AMIDB_FULL (row too large), AMIDB_IOERR, or AMIDB_NOMEM
+ */
+int sorter_add(struct sql_sorter *sorter, const struct amidb_row *row);
+
+/*
+ * Sort what was added (no rows may be added afterwards)
+ *
+ * Returns: AMIDB_OK, AMIDB_IOERR, or AMIDB_NOMEM
+ */
+int sorter_finish(struct sql_sorter *sorter);
+
+/*
+ * Get the next row in order
+ *
+ * row must be empty (row_init); on AMIDB_ROW the caller owns it.
+ *
+ * Returns: AMIDB_ROW, AMIDB_DONE, AMIDB_IOERR, or AMIDB_CORRUPT
+ */
+int sorter_next(struct sql_sorter *sorter, struct amidb_row *row);
+
+/*
+ * Free the sorter's memory and delete its temporary file (also after
+ * a failed sorter_init)
+ */
+void sorter_close(struct sql_sorter *sorter);
+
+#endif /* AMIDB_SQL_SORT_H */
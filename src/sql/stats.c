@@ -0,0 +1,400 @@
+/*
+ * stats.c - Table statistics for the query planner
+ */
+
+#include "sql/stats.h"
+#include "storage/btree.h"
+#include "storage/row.h"
+#include "util/hash.h"
+#include "api/error.h"
+#include <string.h>
+#include <stdlib.h>
+
+/* Selectivity of a subtree whose conditions are all left out */
+#define STATS_IGNORED       0xFFFFFFFFUL
+
+/* Guesses without statistics */
+#define STATS_GUESS_EQ      (STATS_ONE / 10)
+#define STATS_GUESS_RANGE   (STATS_ONE / 3)
+
+/* Spread the bits of a hash (DJB2 alone leaves similar values close) */
+static uint32_t mix_hash(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85EBCA6BUL;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35UL;
+    h ^= h >> 16;
+    return h;
+}
+
+/* a / b in STATS_ONE units, at most STATS_ONE */
+static uint32_t ratio(uint32_t a, uint32_t b) {
+    if (b == 0) {
+        return 0;
+    }
+    if (a >= b) {
+        return STATS_ONE;
+    }
+    while (b > 0xFFFF) {
+        a >>= 1;
+        b >>= 1;
+    }
+    return (a << 16) / b;
+}
+
+/* a * b of two selectivities */
+static uint32_t mul(uint32_t a, uint32_t b) {
+    return ((a >> 1) * (b >> 1)) >> 14;
+}
+
+/* Width of each histogram slice of min..max */
+static uint32_t bucket_width(const struct column_stats *cs) {
+    return ((uint32_t)cs->max_value - (uint32_t)cs->min_value) / CATALOG_HISTOGRAM_BUCKETS + 1;
+}
+
+/* Rows in the histogram */
+static uint32_t histogram_rows(const struct column_stats *cs) {
+    uint32_t rows = 0;
+    uint32_t b;
+
+    for (b = 0; b < CATALOG_HISTOGRAM_BUCKETS; b++) {
+        rows += cs->histogram[b];
+    }
+    return rows;
+}
+
+/*
+ * Rows ANALYZE saw with a value below v (values in a slice taken as
+ * spread evenly over it)
+ */
+static uint32_t rows_below(const struct column_stats *cs, int32_t v) {
+    uint32_t width;
+    uint32_t offset;
+    uint32_t rows = 0;
+    uint32_t b;
+
+    if (v <= cs->min_value) {
+        return 0;
+    }
+    if (v > cs->max_value) {
+        return histogram_rows(cs);
+    }
+
+    width = bucket_width(cs);
+    offset = (uint32_t)v - (uint32_t)cs->min_value;
+    for (b = 0; b < offset / width; b++) {
+        rows += cs->histogram[b];
+    }
+    return rows + stats_rows(cs->histogram[b], ratio(offset % width, width));
+}
+
+/* Add a hash to a column's sketch: its smallest distinct hashes, ascending */
+static void sketch_add(uint32_t *sketch, uint8_t *count, uint32_t hash) {
+    uint32_t n = *count;
+    uint32_t i;
+
+    if (n == STATS_SKETCH_SIZE && hash >= sketch[n - 1]) {
+        return;
+    }
+    for (i = n; i > 0 && sketch[i - 1] > hash; i--) {
+    }
+    if (i > 0 && sketch[i - 1] == hash) {
+        return;
+    }
+    if (n == STATS_SKETCH_SIZE) {
+        n--;                        /* The largest drops out */
+    }
+    memmove(&sketch[i + 1], &sketch[i], (n - i) * sizeof(uint32_t));
+    sketch[i] = hash;
+    *count = (uint8_t)(n + 1);
+}
+
+/*
+ * Distinct hashes a full sketch stands for: K hashes spread evenly over
+ * 0..2^32 leave about 2^32 / K between them
+ */
+static uint32_t sketch_distinct(const uint32_t *sketch, uint8_t count, uint32_t values) {
+    uint32_t gap;
+
+    if (count < STATS_SKETCH_SIZE) {
+        return count;
+    }
+    gap = 0xFFFFFFFFUL / (sketch[STATS_SKETCH_SIZE - 1] + 1);
+    if (gap > values / (STATS_SKETCH_SIZE - 1)) {
+        return values;
+    }
+    return gap * (STATS_SKETCH_SIZE - 1);
+}
+
+/*
+ * Read the row a tree entry points at
+ *
+ * Returns: its stored size, or -1 if it cannot be read
+ */
+static int read_row(struct page_cache *cache, uint32_t row_page, struct amidb_row *row) {
+    uint8_t *page_data;
+    int size;
+
+    if (cache_get_page(cache, row_page, &page_data) != 0) {
+        return -1;
+    }
+    size = row_deserialize(row, page_data + AMIDB_PAGE_HEADER_SIZE,
+                           AMIDB_PAGE_SIZE - AMIDB_PAGE_HEADER_SIZE);
+    cache_unpin(cache, row_page);
+    if (size < 0) {
+        row_clear(row);
+    }
+    return size;
+}
+
+/*
+ * Read every row of a table and fill in its statistics
+ */
+int stats_analyze(struct amidb_pager *pager, struct page_cache *cache,
+                  struct table_schema *schema) {
+    struct btree *tree;
+    struct btree_cursor cursor;
+    struct amidb_row row;
+    const struct amidb_value *val;
+    struct column_stats *cs;
+    uint32_t *sketch;               /* STATS_SKETCH_SIZE hashes per column */
+    uint8_t sketch_count[32];
+    uint32_t int_count[32];         /* INTEGER values seen per column */
+    uint32_t rows = 0;
+    uint32_t bytes = 0;
+    uint32_t c;
+    int size;
+
+    sketch = (uint32_t *)malloc(32 * STATS_SKETCH_SIZE * sizeof(uint32_t));
+    if (sketch == NULL) {
+        return AMIDB_NOMEM;
+    }
+    tree = btree_open(pager, cache, schema->btree_root);
+    if (tree == NULL) {
+        free(sketch);
+        return AMIDB_IOERR;
+    }
+
+    memset(schema->stats, 0, sizeof(schema->stats));
+    memset(sketch_count, 0, sizeof(sketch_count));
+    memset(int_count, 0, sizeof(int_count));
+
+    /* Pass 1: NULLs, distinct values, INTEGER ranges */
+    btree_cursor_first(tree, &cursor);
+    for (; cursor.valid; btree_cursor_next(&cursor)) {
+        row_init(&row);
+        size = read_row(cache, cursor.value, &row);
+        if (size < 0) {
+            continue;               /* Unreadable rows are skipped */
+        }
+        rows++;
+        bytes += (uint32_t)size;
+
+        for (c = 0; c < schema->column_count; c++) {
+            cs = &schema->stats[c];
+            val = row_get_value(&row, c);
+            if (val == NULL || val->type == AMIDB_TYPE_NULL) {
+                cs->null_count++;
+                continue;
+            }
+            if (val->type == AMIDB_TYPE_INTEGER) {
+                if (int_count[c] == 0 || val->u.i < cs->min_value) {
+                    cs->min_value = val->u.i;
+                }
+                if (int_count[c] == 0 || val->u.i > cs->max_value) {
+                    cs->max_value = val->u.i;
+                }
+                int_count[c]++;
+                sketch_add(&sketch[c * STATS_SKETCH_SIZE], &sketch_count[c],
+                           mix_hash((uint32_t)val->u.i));
+            } else {
+                sketch_add(&sketch[c * STATS_SKETCH_SIZE], &sketch_count[c],
+                           mix_hash(hash_buffer(val->u.blob.data, val->u.blob.size)));
+            }
+        }
+        row_clear(&row);
+    }
+
+    /* PRIMARY KEY values are all different */
+    for (c = 0; c < schema->column_count; c++) {
+        cs = &schema->stats[c];
+        if ((int)c == schema->primary_key_index) {
+            cs->distinct = rows - cs->null_count;
+        } else {
+            cs->distinct = sketch_distinct(&sketch[c * STATS_SKETCH_SIZE], sketch_count[c],
+                                           rows - cs->null_count);
+        }
+    }
+    free(sketch);
+
+    /* Pass 2: histograms of INTEGER columns */
+    for (c = 0; c < schema->column_count; c++) {
+        if (schema->columns[c].type == SQL_TYPE_INTEGER && int_count[c] > 0) {
+            break;
+        }
+    }
+    if (c < schema->column_count) {
+        btree_cursor_first(tree, &cursor);
+        for (; cursor.valid; btree_cursor_next(&cursor)) {
+            row_init(&row);
+            if (read_row(cache, cursor.value, &row) < 0) {
+                continue;
+            }
+            for (c = 0; c < schema->column_count; c++) {
+                cs = &schema->stats[c];
+                val = row_get_value(&row, c);
+                if (schema->columns[c].type != SQL_TYPE_INTEGER ||
+                    val == NULL || val->type != AMIDB_TYPE_INTEGER) {
+                    continue;
+                }
+                cs->histogram[((uint32_t)val->u.i - (uint32_t)cs->min_value) / bucket_width(cs)]++;
+            }
+            row_clear(&row);
+        }
+    }
+
+    btree_close(tree);
+
+    schema->analyzed_rows = rows;
+    schema->row_bytes = rows ? bytes / rows : 0;
+    schema->row_count = rows;
+    return AMIDB_OK;
+}
+
+/* Selectivity of one comparison */
+static uint32_t condition_selectivity(const struct table_schema *schema,
+                                      const struct sql_condition *cond) {
+    const struct column_stats *cs;
+    const char *name;
+    uint32_t nonnull;
+    uint32_t eq;
+    uint32_t rows;
+    int32_t v;
+    int col;
+
+    /* A column named table.column: the caller's mask picks this table's */
+    name = strchr(cond->column_name, '.');
+    name = name ? name + 1 : cond->column_name;
+    for (col = 0; col < (int)schema->column_count; col++) {
+        if (strcmp(name, schema->columns[col].name) == 0) {
+            break;
+        }
+    }
+    if (col == (int)schema->column_count || cond->value.type == SQL_VALUE_NULL) {
+        return 0;                   /* Never true */
+    }
+    if (cond->value.type != SQL_VALUE_PARAM &&
+        !(cond->value.type == SQL_VALUE_INTEGER && schema->columns[col].type == SQL_TYPE_INTEGER) &&
+        !(cond->value.type == SQL_VALUE_TEXT && schema->columns[col].type == SQL_TYPE_TEXT)) {
+        return 0;                   /* Compares as unknown */
+    }
+
+    /* Without statistics: a PRIMARY KEY value is one row, the rest guessed */
+    if (schema->analyzed_rows == 0) {
+        if (col == schema->primary_key_index && schema->row_count > 0) {
+            eq = ratio(1, schema->row_count);
+        } else {
+            eq = STATS_GUESS_EQ;
+        }
+        if (cond->op == SQL_OP_EQ) {
+            return eq;
+        }
+        return (cond->op == SQL_OP_NE) ? STATS_ONE - eq : STATS_GUESS_RANGE;
+    }
+
+    cs = &schema->stats[col];
+    nonnull = ratio(schema->analyzed_rows - cs->null_count, schema->analyzed_rows);
+    eq = nonnull / (cs->distinct ? cs->distinct : 1);
+    rows = histogram_rows(cs);
+    if (cond->value.type != SQL_VALUE_INTEGER || rows == 0) {
+        /* TEXT or a parameter: no histogram to look in */
+        if (cond->op == SQL_OP_EQ) {
+            return eq;
+        }
+        return (cond->op == SQL_OP_NE) ? nonnull - eq : nonnull / 3;
+    }
+
+    v = cond->value.int_value;
+    switch (cond->op) {
+        case SQL_OP_EQ:
+            return (v < cs->min_value || v > cs->max_value) ? 0 : eq;
+        case SQL_OP_NE:
+            return (v < cs->min_value || v > cs->max_value) ? nonnull : nonnull - eq;
+        case SQL_OP_LT:
+            return ratio(rows_below(cs, v), schema->analyzed_rows);
+        case SQL_OP_LE:
+            return (v == INT32_MAX) ? nonnull :
+                   ratio(rows_below(cs, v + 1), schema->analyzed_rows);
+        case SQL_OP_GT:
+            return (v == INT32_MAX) ? 0 :
+                   ratio(rows - rows_below(cs, v + 1), schema->analyzed_rows);
+        case SQL_OP_GE:
+            return ratio(rows - rows_below(cs, v), schema->analyzed_rows);
+    }
+    return STATS_ONE;
+}
+
+/* Selectivity of a node, STATS_IGNORED if no condition under it counts */
+static uint32_t node_selectivity(const struct table_schema *schema, const struct sql_where *where,
+                                 uint32_t n, uint32_t mask) {
+    const struct sql_where_node *node = &where->nodes[n];
+    uint32_t left;
+    uint32_t right;
+
+    switch (node->type) {
+        case SQL_WHERE_COMPARE:
+            if (!(mask & (1UL << node->left))) {
+                return STATS_IGNORED;
+            }
+            return condition_selectivity(schema, &where->conditions[node->left]);
+
+        case SQL_WHERE_AND:
+        case SQL_WHERE_OR:
+            left = node_selectivity(schema, where, node->left, mask);
+            right = node_selectivity(schema, where, node->right, mask);
+            if (node->type == SQL_WHERE_AND) {
+                if (left == STATS_IGNORED) return right;
+                if (right == STATS_IGNORED) return left;
+                return mul(left, right);
+            }
+            if (left == STATS_IGNORED || right == STATS_IGNORED) {
+                return STATS_IGNORED;
+            }
+            return left + right - mul(left, right);
+
+        case SQL_WHERE_NOT:
+            left = node_selectivity(schema, where, node->left, mask);
+            return (left == STATS_IGNORED) ? left : STATS_ONE - left;
+    }
+    return STATS_IGNORED;
+}
+
+/*
+ * Estimate the fraction of a table's rows a WHERE clause keeps
+ */
+uint32_t stats_selectivity(const struct table_schema *schema, const struct sql_where *where,
+                           uint32_t mask) {
+    uint32_t sel;
+
+    if (!where->has_condition) {
+        return STATS_ONE;
+    }
+    sel = node_selectivity(schema, where, where->root, mask);
+    return (sel == STATS_IGNORED || sel > STATS_ONE) ? STATS_ONE : sel;
+}
+
+/*
+ * Rows of rows a selectivity keeps
+ */
+uint32_t stats_rows(uint32_t rows, uint32_t selectivity) {
+    uint32_t kept;
+
+    if (selectivity >= STATS_ONE) {
+        return rows;
+    }
+    kept = (rows >> 16) * selectivity + (((rows & 0xFFFF) * selectivity) >> 16);
+    if (kept == 0 && rows > 0 && selectivity > 0) {
+        kept = 1;
+    }
+    return kept;
+}
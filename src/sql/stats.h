@@ -0,0 +1,65 @@
+/*
+ * stats.h - Table statistics for the query planner
+ *
+ * ANALYZE reads every row of a table and keeps, per column, the number
+ * of NULLs, an estimate of the number of distinct values and, for
+ * INTEGER columns, the smallest and largest value and a histogram of
+ * CATALOG_HISTOGRAM_BUCKETS equal-width slices between them. They are
+ * saved with the table's schema (catalog.h). Writes do not keep them
+ * up to date: they describe the table as ANALYZE saw it, as fractions
+ * of the rows it read, and the planner scales them to row_count.
+ *
+ * Distinct values are counted in constant memory: the smallest
+ * STATS_SKETCH_SIZE hashes of a column's values are kept, and how
+ * closely they crowd towards zero tells how many different hashes
+ * there were (exact below STATS_SKETCH_SIZE values).
+ *
+ * Selectivities (the fraction of rows a WHERE clause keeps) are fixed
+ * point, STATS_ONE being every row; no floating point is needed.
+ */
+
+#ifndef AMIDB_SQL_STATS_H
+#define AMIDB_SQL_STATS_H
+
+#include "sql/catalog.h"
+#include "sql/parser.h"
+#include "storage/pager.h"
+#include "storage/cache.h"
+#include <stdint.h>
+
+/* Hashes kept per column to estimate its distinct values */
+#define STATS_SKETCH_SIZE   32
+
+/* Selectivity of every row */
+#define STATS_ONE           65536UL
+
+/*
+ * Read every row of a table and fill in its statistics
+ *
+ * Sets analyzed_rows, row_bytes and stats[] of schema, and row_count
+ * to the rows read; the caller saves the schema (catalog_update_table).
+ *
+ * Returns: AMIDB_OK, AMIDB_NOMEM, or AMIDB_IOERR if the table's tree
+ * cannot be opened
+ */
+int stats_analyze(struct amidb_pager *pager, struct page_cache *cache,
+                  struct table_schema *schema);
+
+/*
+ * Estimate the fraction of a table's rows a WHERE clause keeps
+ *
+ * Only conditions whose bit is set in mask are counted; the others are
+ * taken as true. Without statistics, fixed guesses are used (a PRIMARY
+ * KEY value names one row). Parameters are treated as unknown values.
+ *
+ * Returns: selectivity, 0 to STATS_ONE
+ */
+uint32_t stats_selectivity(const struct table_schema *schema, const struct sql_where *where,
+                           uint32_t mask);
+
+/*
+ * Rows of rows a selectivity keeps (at least one if any and it is not 0)
+ */
+uint32_t stats_rows(uint32_t rows, uint32_t selectivity);
+
+#endif /* AMIDB_SQL_STATS_H */
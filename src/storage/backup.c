@@ -0,0 +1,523 @@
+/*
+ * backup.c - Online backup implementation
+ */
+
+#include "storage/backup.h"
+#include "storage/pager.h"
+#include "txn/wal.h"
+#include "os/file.h"
+#include "os/mem.h"
+#include "api/error.h"
+#include "util/endian.h"
+#include "util/crc32.h"
+#include <string.h>
+
+/* Page copy buffer (static: too large for the 4KB 68000 stack) */
+static uint8_t g_backup_page[AMIDB_PAGE_SIZE];
+
+/*
+ * Recopy bitmap helpers
+ */
+static int backup_test(const struct amidb_backup *backup, uint32_t page_num)
+{
+    return (backup->recopy[page_num / 8] >> (page_num % 8)) & 1;
+}
+
+static void backup_set(struct amidb_backup *backup, uint32_t page_num)
+{
+    backup->recopy[page_num / 8] |= (uint8_t)(1 << (page_num % 8));
+}
+
+static void backup_clear(struct amidb_backup *backup, uint32_t page_num)
+{
+    backup->recopy[page_num / 8] &= (uint8_t)~(1 << (page_num % 8));
+}
+
+/*
+ * Append g_backup_page to an incremental backup as a page record
+ */
+static int backup_write_record(struct amidb_backup *backup, uint32_t page_num)
+{
+    uint8_t num_buf[4];
+
+    put_u32(num_buf, page_num);
+
+    if (file_seek(backup->dst_handle, AMIDB_INCR_HEADER_SIZE +
+                  backup->record_count * AMIDB_INCR_RECORD_SIZE, AMIDB_SEEK_SET) != 0 ||
+        file_write(backup->dst_handle, num_buf, 4) != 4 ||
+        file_write(backup->dst_handle, g_backup_page, AMIDB_PAGE_SIZE) != AMIDB_PAGE_SIZE) {
+        return AMIDB_IOERR;
+    }
+
+    backup->record_count++;
+    return AMIDB_OK;
+}
+
+/*
+ * Copy one page from the source file to the same place in the backup
+ * (or, for an incremental backup, to the next page record)
+ *
+ * The header page is written last (by backup_write_header) and the WAL
+ * region is not needed by a clean database, so both start out zeroed.
+ */
+static int backup_copy_page(struct amidb_backup *backup, uint32_t page_num)
+{
+    uint32_t wal_first = WAL_REGION_START / AMIDB_PAGE_SIZE;
+    uint32_t wal_pages = WAL_REGION_SIZE / AMIDB_PAGE_SIZE;
+    uint32_t lsn;
+    int rc;
+
+    if (page_num == 0 || (page_num >= wal_first && page_num < wal_first + wal_pages)) {
+        memset(g_backup_page, 0, AMIDB_PAGE_SIZE);
+    } else {
+        /* Raw copy: the backup is an exact image, free pages included */
+        if (file_seek(backup->src->file_handle, page_num * AMIDB_PAGE_SIZE,
+                      AMIDB_SEEK_SET) != 0 ||
+            file_read(backup->src->file_handle, g_backup_page,
+                      AMIDB_PAGE_SIZE) != AMIDB_PAGE_SIZE) {
+            return AMIDB_IOERR;
+        }
+
+        lsn = pager_get_page_lsn(g_backup_page);
+        if (lsn > backup->max_lsn) {
+            backup->max_lsn = lsn;
+        }
+    }
+
+    if (backup->incremental) {
+        rc = backup_write_record(backup, page_num);
+    } else if (file_seek(backup->dst_handle, page_num * AMIDB_PAGE_SIZE, AMIDB_SEEK_SET) != 0 ||
+               file_write(backup->dst_handle, g_backup_page,
+                          AMIDB_PAGE_SIZE) != AMIDB_PAGE_SIZE) {
+        rc = AMIDB_IOERR;
+    } else {
+        rc = AMIDB_OK;
+    }
+    if (rc != AMIDB_OK) {
+        return rc;
+    }
+
+    backup->pages_copied++;
+
+    return AMIDB_OK;
+}
+
+/*
+ * Write the backup's header page: the source's header and bitmap as of
+ * now, marked clean with an empty WAL and no changed pages, at the
+ * source's next backup epoch
+ */
+static int backup_write_header(struct amidb_backup *backup)
+{
+    struct amidb_file_header hdr;
+    uint8_t incr_header[AMIDB_INCR_HEADER_SIZE];
+    int rc;
+
+    hdr = backup->src->header;
+    hdr.flags &= ~DB_FLAG_DIRTY;
+    hdr.wal_head = 0;
+    hdr.wal_tail = 0;
+    if (!backup->src->read_only) {
+        hdr.backup_epoch++;
+    }
+
+    /* New WAL records must sort after every page image in the copy */
+    if (backup->max_lsn > hdr.checkpoint_lsn) {
+        hdr.checkpoint_lsn = backup->max_lsn;
+    }
+
+    pager_format_header(&hdr, backup->src->bitmap, NULL, backup->src->bitmap_size,
+                        g_backup_page);
+
+    if (!backup->incremental) {
+        if (file_seek(backup->dst_handle, 0, AMIDB_SEEK_SET) != 0 ||
+            file_write(backup->dst_handle, g_backup_page, AMIDB_PAGE_SIZE) != AMIDB_PAGE_SIZE) {
+            return AMIDB_IOERR;
+        }
+    } else {
+        /* Page 0 is the last record; the file header makes the file valid */
+        rc = backup_write_record(backup, 0);
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+
+        put_u32(incr_header + 0, AMIDB_INCR_MAGIC);
+        put_u32(incr_header + 4, backup->base_epoch);
+        put_u32(incr_header + 8, hdr.page_count);
+        put_u32(incr_header + 12, backup->record_count);
+        if (file_seek(backup->dst_handle, 0, AMIDB_SEEK_SET) != 0 ||
+            file_write(backup->dst_handle, incr_header,
+                       AMIDB_INCR_HEADER_SIZE) != AMIDB_INCR_HEADER_SIZE) {
+            return AMIDB_IOERR;
+        }
+    }
+
+    return (file_sync(backup->dst_handle) == 0) ? AMIDB_OK : AMIDB_IOERR;
+}
+
+/*
+ * Start a backup (full or incremental)
+ */
+static int backup_start(struct amidb_pager *src, const char *dst_path, int incremental,
+                        struct amidb_backup **backup_out)
+{
+    struct amidb_backup *backup;
+    uint32_t page_num;
+
+    if (!src || !dst_path || !backup_out) {
+        return AMIDB_ERROR;
+    }
+
+    if (src->backup) {
+        return AMIDB_BUSY;
+    }
+
+    backup = (struct amidb_backup *)mem_alloc(sizeof(struct amidb_backup), AMIDB_MEM_CLEAR);
+    if (!backup) {
+        return AMIDB_NOMEM;
+    }
+
+    backup->dst_handle = file_open(dst_path, AMIDB_O_RDWR | AMIDB_O_CREATE | AMIDB_O_TRUNC);
+    if (!backup->dst_handle) {
+        mem_free(backup, sizeof(struct amidb_backup));
+        return AMIDB_IOERR;
+    }
+
+    backup->src = src;
+    backup->incremental = incremental;
+    backup->base_epoch = src->header.backup_epoch;
+    backup->page_count = src->header.page_count;
+
+    if (incremental) {
+        /* No first pass: the changed pages are the ones to copy */
+        backup->next_page = backup->page_count;
+        memcpy(backup->recopy, src->changes, sizeof(backup->recopy));
+        for (page_num = 1; page_num < backup->page_count; page_num++) {
+            if (backup_test(backup, page_num)) {
+                backup->recopy_count++;
+            }
+        }
+    }
+
+    backup->remaining = (backup->page_count - backup->next_page) + backup->recopy_count;
+    src->backup = backup;
+
+    *backup_out = backup;
+    return AMIDB_OK;
+}
+
+/*
+ * Start a backup
+ */
+int amidb_backup_init(struct amidb_pager *src, const char *dst_path,
+                      struct amidb_backup **backup_out)
+{
+    return backup_start(src, dst_path, 0, backup_out);
+}
+
+/*
+ * Start an incremental backup
+ */
+int amidb_backup_init_incremental(struct amidb_pager *src, const char *dst_path,
+                                  struct amidb_backup **backup_out)
+{
+    return backup_start(src, dst_path, 1, backup_out);
+}
+
+/*
+ * Copy the next n_pages pages
+ */
+int amidb_backup_step(struct amidb_backup *backup, uint32_t n_pages)
+{
+    uint32_t copied;
+    uint32_t page_num;
+    int rc;
+
+    if (!backup) {
+        return AMIDB_ERROR;
+    }
+    if (backup->done) {
+        return AMIDB_DONE;
+    }
+    if (!backup->src) {
+        return AMIDB_ERROR;
+    }
+
+    backup->step_count++;
+    backup->page_count = backup->src->header.page_count;
+
+    copied = 0;
+    page_num = 0;
+    while (n_pages == 0 || copied < n_pages) {
+        if (backup->next_page < backup->page_count) {
+            /* First pass, in page order */
+            rc = backup_copy_page(backup, backup->next_page);
+            if (rc != AMIDB_OK) {
+                return rc;
+            }
+            backup->next_page++;
+        } else if (backup->recopy_count > 0) {
+            /* Pages written since they were copied */
+            while (!backup_test(backup, page_num)) {
+                page_num++;
+            }
+            rc = backup_copy_page(backup, page_num);
+            if (rc != AMIDB_OK) {
+                return rc;
+            }
+            backup_clear(backup, page_num);
+            backup->recopy_count--;
+            backup->pages_recopied++;
+        } else {
+            break;
+        }
+        copied++;
+    }
+
+    backup->remaining = (backup->page_count - backup->next_page) + backup->recopy_count;
+    if (backup->remaining > 0) {
+        return AMIDB_OK;
+    }
+
+    /* Everything matches the source: seal the copy */
+    rc = backup_write_header(backup);
+    if (rc != AMIDB_OK) {
+        return rc;
+    }
+
+    /* The source's changes are all in a backup now */
+    if (!backup->src->read_only && pager_clear_changes(backup->src) != 0) {
+        return AMIDB_IOERR;
+    }
+
+    backup->done = 1;
+    backup->src->backup = NULL;
+    backup->src = NULL;
+
+    return AMIDB_DONE;
+}
+
+/*
+ * Close the backup file and free the backup
+ */
+void amidb_backup_finish(struct amidb_backup *backup)
+{
+    if (!backup) {
+        return;
+    }
+
+    if (backup->src) {
+        backup->src->backup = NULL;
+    }
+    if (backup->dst_handle) {
+        file_close(backup->dst_handle);
+    }
+
+    mem_free(backup, sizeof(struct amidb_backup));
+}
+
+/*
+ * Read incremental backup record n into g_backup_page
+ */
+static int backup_read_record(void *handle, uint32_t n, uint32_t *page_num_out)
+{
+    uint8_t num_buf[4];
+
+    if (file_seek(handle, AMIDB_INCR_HEADER_SIZE + n * AMIDB_INCR_RECORD_SIZE,
+                  AMIDB_SEEK_SET) != 0 ||
+        file_read(handle, num_buf, 4) != 4 ||
+        file_read(handle, g_backup_page, AMIDB_PAGE_SIZE) != AMIDB_PAGE_SIZE) {
+        return AMIDB_CORRUPT;        /* Truncated */
+    }
+
+    *page_num_out = get_u32(num_buf);
+    return AMIDB_OK;
+}
+
+/*
+ * Check incremental backup record n (read into g_backup_page)
+ */
+static int backup_check_record(uint32_t n, uint32_t count, uint32_t page_num)
+{
+    if (n == count - 1) {
+        /* Last record: the header page */
+        if (page_num != 0 || get_u32(g_backup_page) != AMIDB_MAGIC) {
+            return AMIDB_CORRUPT;
+        }
+        return AMIDB_OK;
+    }
+
+    if (page_num == 0 || page_num >= AMIDB_MAX_PAGES ||
+        get_u32(g_backup_page) != page_num) {
+        return AMIDB_CORRUPT;
+    }
+
+    crc32_init();
+    if (get_u32(g_backup_page + 8) != crc32_compute(g_backup_page + 12, AMIDB_PAGE_SIZE - 12)) {
+        return AMIDB_CORRUPT;
+    }
+
+    return AMIDB_OK;
+}
+
+/*
+ * Grow a database file with zero pages up to (not including) page_num
+ *
+ * AmigaDOS cannot seek past the end of a file, so pages the source
+ * added since the base backup need the file extended first.
+ */
+static int backup_extend(void *handle, uint32_t page_num)
+{
+    uint8_t *zero_page;
+    int32_t size;
+    int rc;
+
+    size = file_size(handle);
+    if (size < 0) {
+        return AMIDB_IOERR;
+    }
+    if ((uint32_t)size >= page_num * AMIDB_PAGE_SIZE) {
+        return AMIDB_OK;
+    }
+
+    zero_page = (uint8_t *)mem_alloc(AMIDB_PAGE_SIZE, AMIDB_MEM_CLEAR);
+    if (!zero_page) {
+        return AMIDB_NOMEM;
+    }
+
+    rc = AMIDB_OK;
+    if (file_seek(handle, 0, AMIDB_SEEK_END) != 0) {
+        rc = AMIDB_IOERR;
+    }
+    while (rc == AMIDB_OK && (uint32_t)size < page_num * AMIDB_PAGE_SIZE) {
+        if (file_write(handle, zero_page, AMIDB_PAGE_SIZE) != AMIDB_PAGE_SIZE) {
+            rc = AMIDB_IOERR;
+        }
+        size += AMIDB_PAGE_SIZE;
+    }
+
+    mem_free(zero_page, AMIDB_PAGE_SIZE);
+    return rc;
+}
+
+/*
+ * Apply an incremental backup to a closed database file
+ */
+int amidb_backup_restore(const char *db_path, const char *incr_path)
+{
+    void *incr;
+    void *db;
+    uint8_t incr_header[AMIDB_INCR_HEADER_SIZE];
+    uint32_t base_epoch;
+    uint32_t count;
+    uint32_t checkpoint_lsn;
+    uint32_t page_num;
+    uint32_t i;
+    int rc;
+
+    if (!db_path || !incr_path) {
+        return AMIDB_ERROR;
+    }
+
+    incr = file_open(incr_path, AMIDB_O_RDONLY);
+    if (!incr) {
+        return AMIDB_IOERR;
+    }
+
+    if (file_read(incr, incr_header, AMIDB_INCR_HEADER_SIZE) != AMIDB_INCR_HEADER_SIZE ||
+        get_u32(incr_header) != AMIDB_INCR_MAGIC || get_u32(incr_header + 12) == 0) {
+        file_close(incr);
+        return AMIDB_CORRUPT;
+    }
+    base_epoch = get_u32(incr_header + 4);
+    count = get_u32(incr_header + 12);
+
+    db = file_open(db_path, AMIDB_O_RDWR);
+    if (!db) {
+        file_close(incr);
+        return AMIDB_IOERR;
+    }
+
+    /* The target must be the unmodified backup the increment follows */
+    rc = AMIDB_OK;
+    if (file_read(db, g_backup_page, AMIDB_PAGE_SIZE) != AMIDB_PAGE_SIZE) {
+        rc = AMIDB_IOERR;
+    } else if (get_u32(g_backup_page) != AMIDB_MAGIC ||
+               get_u32(g_backup_page + 4) != AMIDB_VERSION ||
+               get_u32(g_backup_page + 48) != base_epoch) {
+        rc = AMIDB_ERROR;
+    } else {
+        for (i = 0; i < AMIDB_MAX_PAGES / 8; i++) {
+            if (g_backup_page[AMIDB_CHANGES_OFFSET + i] != 0) {
+                rc = AMIDB_ERROR;
+                break;
+            }
+        }
+    }
+    checkpoint_lsn = get_u32(g_backup_page + 44);
+
+    /* Check every record before writing any, so a damaged increment */
+    /* leaves the target untouched */
+    for (i = 0; i < count && rc == AMIDB_OK; i++) {
+        rc = backup_read_record(incr, i, &page_num);
+        if (rc == AMIDB_OK) {
+            rc = backup_check_record(i, count, page_num);
+        }
+    }
+
+    /* Apply: data pages, then the header page (the last record) */
+    for (i = 0; i < count && rc == AMIDB_OK; i++) {
+        rc = backup_read_record(incr, i, &page_num);
+        if (rc != AMIDB_OK) {
+            break;
+        }
+
+        /* Pages the increment did not carry keep their LSNs */
+        if (page_num == 0 && get_u32(g_backup_page + 44) < checkpoint_lsn) {
+            put_u32(g_backup_page + 44, checkpoint_lsn);
+        }
+
+        rc = backup_extend(db, page_num);
+        if (rc != AMIDB_OK) {
+            break;
+        }
+
+        if (file_seek(db, page_num * AMIDB_PAGE_SIZE, AMIDB_SEEK_SET) != 0 ||
+            file_write(db, g_backup_page, AMIDB_PAGE_SIZE) != AMIDB_PAGE_SIZE) {
+            rc = AMIDB_IOERR;
+        }
+    }
+
+    if (rc == AMIDB_OK && file_sync(db) != 0) {
+        rc = AMIDB_IOERR;
+    }
+
+    file_close(db);
+    file_close(incr);
+
+    return rc;
+}
+
+/*
+ * A page was written to the source file
+ */
+void amidb_backup_note_write(struct amidb_backup *backup, uint32_t page_num)
+{
+    /* Pages not copied yet will be copied in their new state anyway */
+    if (page_num >= backup->next_page || page_num >= AMIDB_MAX_PAGES) {
+        return;
+    }
+
+    if (!backup_test(backup, page_num)) {
+        backup_set(backup, page_num);
+        backup->recopy_count++;
+    }
+}
+
+/*
+ * The source pager is being closed
+ */
+void amidb_backup_source_closed(struct amidb_backup *backup)
+{
+    backup->src = NULL;
+}
@@ -0,0 +1,128 @@
+/*
+ * backup.h - Online backup for AmiDB
+ *
+ * Copies a live database into a backup file a few pages at a time, so
+ * transactions keep running between steps. The pager reports every page
+ * it writes; pages that change after they were copied are copied again
+ * before the backup completes. The finished file is a clean database
+ * (no WAL to recover) holding the source as of the last step.
+ *
+ * Steps must be taken between statements, not in the middle of a pager
+ * write: the database file only ever holds committed pages, so any
+ * point between transactions is a consistent one.
+ *
+ * Incremental backups: the pager marks every page it writes in a change
+ * bitmap kept in page 0. A completed backup (full or incremental) clears
+ * it and advances the header's backup epoch. An incremental backup file
+ * holds only the marked pages plus page 0; amidb_backup_restore applies
+ * it to the backup taken at the epoch it starts from. Backup I/O grows
+ * with the pages changed, not with the database size.
+ */
+
+#ifndef AMIDB_BACKUP_H
+#define AMIDB_BACKUP_H
+
+#include <stdint.h>
+#include "storage/pager.h"
+
+/* Incremental backup file magic: "AmiI" in ASCII */
+#define AMIDB_INCR_MAGIC 0x416D6949
+
+/*
+ * Incremental backup file layout (big-endian):
+ *   header:  magic, base epoch, page count, record count (16 bytes)
+ *   records: page number (4 bytes) + page image, page 0 last
+ * The header is written when the backup completes; an unfinished file
+ * has no magic.
+ */
+#define AMIDB_INCR_HEADER_SIZE 16
+#define AMIDB_INCR_RECORD_SIZE (4 + AMIDB_PAGE_SIZE)
+
+/*
+ * Backup in progress
+ */
+struct amidb_backup {
+    struct amidb_pager *src;         /* Source (NULL once it was closed) */
+    void *dst_handle;                /* Backup file */
+    int incremental;                 /* Changed pages only (incremental file) */
+    uint32_t base_epoch;             /* Source backup epoch at the start */
+    uint32_t record_count;           /* Incremental: page records written */
+
+    uint32_t next_page;              /* Next page of the first pass */
+    uint8_t recopy[AMIDB_MAX_PAGES / 8];  /* Pages to copy (again) */
+    uint32_t recopy_count;
+    uint32_t max_lsn;                /* Highest page LSN copied */
+
+    /* Progress */
+    uint32_t page_count;             /* Source pages (grows with the source) */
+    uint32_t remaining;              /* Pages still to copy, recopies included */
+    uint32_t pages_copied;           /* Page writes so far */
+    uint32_t pages_recopied;         /* ... of which after the first pass */
+    uint32_t step_count;
+    int done;
+};
+
+/*
+ * Start a backup of src into dst_path (created or overwritten)
+ *
+ * Returns: 0 on success, AMIDB_BUSY if src already has a backup running,
+ *          AMIDB_NOMEM / AMIDB_IOERR on failure
+ */
+int amidb_backup_init(struct amidb_pager *src, const char *dst_path,
+                      struct amidb_backup **backup_out);
+
+/*
+ * Start an incremental backup of src into dst_path
+ *
+ * Copies the pages written since the last completed backup. The file can
+ * only be restored onto that backup (see amidb_backup_restore).
+ *
+ * Returns: as amidb_backup_init
+ */
+int amidb_backup_init_incremental(struct amidb_pager *src, const char *dst_path,
+                                  struct amidb_backup **backup_out);
+
+/*
+ * Copy up to n_pages pages (0 = all that are left)
+ *
+ * First copies the pages not yet copied, in page order, then pages that
+ * changed after they were copied. When nothing is left the backup's
+ * header is written and synced, and the source starts a new backup
+ * epoch with no pages marked changed.
+ *
+ * Returns: AMIDB_OK if more steps are needed, AMIDB_DONE when the
+ *          backup is complete, error code on failure
+ */
+int amidb_backup_step(struct amidb_backup *backup, uint32_t n_pages);
+
+/*
+ * Close the backup file and free the backup
+ *
+ * An unfinished backup file is left behind but has no valid header.
+ */
+void amidb_backup_finish(struct amidb_backup *backup);
+
+/*
+ * Apply an incremental backup to a closed database file
+ *
+ * db_path must be the backup the increment was taken against: a full or
+ * restored backup at the increment's base epoch, not modified since.
+ * Every record is checked before anything is written.
+ *
+ * Returns: 0 on success, AMIDB_ERROR if db_path is not at the base epoch
+ *          or was modified, AMIDB_CORRUPT if the increment is damaged,
+ *          AMIDB_IOERR / AMIDB_NOMEM on failure
+ */
+int amidb_backup_restore(const char *db_path, const char *incr_path);
+
+/*
+ * Pager hooks
+ */
+
+/* A page was written to the source file */
+void amidb_backup_note_write(struct amidb_backup *backup, uint32_t page_num);
+
+/* The source pager is being closed */
+void amidb_backup_source_closed(struct amidb_backup *backup);
+
+#endif /* AMIDB_BACKUP_H */
@@ -3,6 +3,7 @@
  */
 
 #include "storage/btree.h"
+#include "storage/lsm.h"
 #include "storage/pager.h"
 #include "storage/cache.h"
 #include "txn/txn.h"
@@ -36,19 +37,38 @@ static inline int32_t get_i32(const uint8_t *buf) {
 static int serialize_node(const struct btree_node *node, uint8_t *buffer);
 static int deserialize_node(struct btree_node *node, const uint8_t *buffer);
 static int find_key_in_node(const struct btree_node *node, int32_t key);
+static int child_index_for_key(const struct btree_node *node, int32_t key);
 static int find_leaf_page(struct btree *tree, int32_t key, uint32_t *leaf_page_out);
 
 /* Phase 3B: Split/merge functions */
 static int split_leaf_node(struct btree *tree, uint32_t leaf_page, int32_t *split_key_out, uint32_t *new_page_out);
 static int split_internal_node(struct btree *tree, uint32_t internal_page, int32_t *split_key_out, uint32_t *new_page_out);
-static int insert_into_parent(struct btree *tree, uint32_t left_page, int32_t key, uint32_t right_page);
+static int insert_into_parent(struct btree *tree, uint32_t level, int32_t key, uint32_t right_page);
 static int allocate_node(struct btree *tree, uint8_t node_type, uint32_t *page_out);
-static int rebalance_after_delete(struct btree *tree, uint32_t page_num);
+static int rebalance_after_delete(struct btree *tree, uint32_t level);
 static int borrow_from_sibling(struct btree *tree, uint32_t page_num, uint32_t parent_page, int child_index);
 static int merge_with_sibling(struct btree *tree, uint32_t left_page, uint32_t right_page, uint32_t parent_page, int separator_index);
 
-/* Phase 3C: Transaction integration helper */
+/* Shadow paging: copy-on-write of the nodes a change touches */
+static int btree_set_child(struct btree *tree, uint32_t page_num, uint32_t index, uint32_t child);
+static int btree_shadow_path(struct btree *tree);
+static int btree_own_child(struct btree *tree, struct btree_node *parent, int index);
+
+/* Phase 3C: Transaction integration helpers */
+static void btree_save_before_image(struct btree *tree, uint32_t page_num, const uint8_t *page_data);
 static void btree_mark_page_dirty(struct btree *tree, uint32_t page_num);
+static int btree_read_page(struct page_cache *cache, struct txn_snapshot *snap,
+                           uint32_t page_num, uint8_t **page_data);
+
+/*
+ * Save a page's before-image in the active transaction
+ * (must be called before the cached page is overwritten)
+ */
+static void btree_save_before_image(struct btree *tree, uint32_t page_num, const uint8_t *page_data) {
+    if (tree->txn) {
+        txn_save_before_image(tree->txn, page_num, page_data);
+    }
+}
 
 /*
  * Mark a page as dirty and track it in the active transaction
@@ -74,15 +94,101 @@ static void btree_mark_page_dirty(struct btree *tree, uint32_t page_num) {
     }
 }
 
+/*
+ * Get a page for reading: through the snapshot if one is set
+ * (pinned either way; unpin with cache_unpin)
+ */
+static int btree_read_page(struct page_cache *cache, struct txn_snapshot *snap,
+                           uint32_t page_num, uint8_t **page_data) {
+    if (snap) {
+        return txn_snapshot_get_page(snap, page_num, page_data);
+    }
+    return cache_get_page(cache, page_num, page_data);
+}
+
+/*
+ * Point a node's child slot at another page
+ */
+static int btree_set_child(struct btree *tree, uint32_t page_num, uint32_t index, uint32_t child) {
+    struct btree_node node;
+    uint8_t *page_data;
+
+    if (cache_get_page(tree->cache, page_num, &page_data) != 0) {
+        return -1;
+    }
+    deserialize_node(&node, page_data);
+    node.children[index] = child;
+
+    btree_save_before_image(tree, page_num, page_data);
+    serialize_node(&node, page_data);
+    btree_mark_page_dirty(tree, page_num);
+    cache_unpin(tree->cache, page_num);
+
+    return 0;
+}
+
+/*
+ * Shadow paging: give the transaction its own copy of every node on the
+ * path of the last descent, root first, so each copy's parent is already
+ * writable when it is repointed. Nothing to do outside a shadow
+ * transaction, or for nodes the transaction already copied.
+ */
+static int btree_shadow_path(struct btree *tree) {
+    uint32_t level;
+    uint32_t copy;
+
+    if (!tree->txn || !tree->txn->shadow) {
+        return 0;
+    }
+
+    for (level = 0; level < tree->path_depth; level++) {
+        if (txn_shadow_page(tree->txn, tree->path[level].page_num, &copy) != 0) {
+            return -1;
+        }
+        if (copy == tree->path[level].page_num) {
+            continue;
+        }
+
+        tree->path[level].page_num = copy;
+        if (level == 0) {
+            tree->root_page = copy;
+        } else if (btree_set_child(tree, tree->path[level - 1].page_num,
+                                   tree->path[level - 1].index, copy) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Shadow paging: own a sibling off the path before changing it
+ * (only the in-memory parent is repointed; the caller writes it back)
+ */
+static int btree_own_child(struct btree *tree, struct btree_node *parent, int index) {
+    uint32_t copy;
+
+    if (!tree->txn || !tree->txn->shadow) {
+        return 0;
+    }
+
+    if (txn_shadow_page(tree->txn, parent->children[index], &copy) != 0) {
+        return -1;
+    }
+    parent->children[index] = copy;
+
+    return 0;
+}
+
 /*
  * Serialize a B+Tree node to a page buffer
  */
 static int serialize_node(const struct btree_node *node, uint8_t *buffer) {
     uint32_t i;
-    uint32_t offset = 12;  /* Skip 12-byte page header */
+    uint32_t offset = AMIDB_PAGE_HEADER_SIZE;  /* Skip page header */
 
-    /* Clear buffer (but preserve page header at bytes 0-11) */
-    memset(buffer + 12, 0, AMIDB_PAGE_SIZE - 12);
+    /* Clear buffer (but preserve page header) */
+    memset(buffer + AMIDB_PAGE_HEADER_SIZE, 0, AMIDB_PAGE_SIZE - AMIDB_PAGE_HEADER_SIZE);
 
     /* Write node header */
     buffer[offset++] = node->node_type;
@@ -118,7 +224,7 @@ static int serialize_node(const struct btree_node *node, uint8_t *buffer) {
  */
 static int deserialize_node(struct btree_node *node, const uint8_t *buffer) {
     uint32_t i;
-    uint32_t offset = 12;  /* Skip 12-byte page header */
+    uint32_t offset = AMIDB_PAGE_HEADER_SIZE;  /* Skip page header */
 
     /* Read node header */
     node->node_type = buffer[offset++];
@@ -177,8 +283,27 @@ static int find_key_in_node(const struct btree_node *node, int32_t key) {
     return left;
 }
 
+/*
+ * Index of the child of an internal node that covers key
+ */
+static int child_index_for_key(const struct btree_node *node, int32_t key) {
+    int index;
+
+    index = find_key_in_node(node, key);
+
+    /* For internal nodes: children[i] contains keys < keys[i] */
+    /* children[num_keys] contains keys >= keys[num_keys-1] */
+    if (index >= (int)node->num_keys) {
+        return (int)node->num_keys;
+    } else if (key < node->keys[index]) {
+        return index;
+    }
+    return index + 1;
+}
+
 /*
  * Find the leaf page that should contain the given key
+ * (records the path taken in tree->path)
  */
 static int find_leaf_page(struct btree *tree, int32_t key, uint32_t *leaf_page_out) {
     uint32_t current_page;
@@ -187,11 +312,16 @@ static int find_leaf_page(struct btree *tree, int32_t key, uint32_t *leaf_page_o
     int index;
 
     current_page = tree->root_page;
+    tree->path_depth = 0;
 
     /* Traverse down to leaf */
     while (1) {
+        if (tree->path_depth >= BTREE_MAX_HEIGHT) {
+            return -1;  /* Corrupt: deeper than any valid tree */
+        }
+
         /* Get page from cache */
-        if (cache_get_page(tree->cache, current_page, &page_data) != 0) {
+        if (btree_read_page(tree->cache, tree->snapshot, current_page, &page_data) != 0) {
             return -1;
         }
 
@@ -201,6 +331,10 @@ static int find_leaf_page(struct btree *tree, int32_t key, uint32_t *leaf_page_o
         /* Unpin page */
         cache_unpin(tree->cache, current_page);
 
+        tree->path[tree->path_depth].page_num = current_page;
+        tree->path[tree->path_depth].index = 0;
+        tree->path_depth++;
+
         /* If leaf, we're done */
         if (node.node_type == BTREE_NODE_LEAF) {
             *leaf_page_out = current_page;
@@ -208,17 +342,9 @@ static int find_leaf_page(struct btree *tree, int32_t key, uint32_t *leaf_page_o
         }
 
         /* Internal node - find which child to follow */
-        index = find_key_in_node(&node, key);
-
-        /* For internal nodes: children[i] contains keys < keys[i] */
-        /* children[num_keys] contains keys >= keys[num_keys-1] */
-        if (index >= (int)node.num_keys) {
-            current_page = node.children[node.num_keys];
-        } else if (key < node.keys[index]) {
-            current_page = node.children[index];
-        } else {
-            current_page = node.children[index + 1];
-        }
+        index = child_index_for_key(&node, key);
+        tree->path[tree->path_depth - 1].index = (uint32_t)index;
+        current_page = node.children[index];
 
         if (current_page == 0) {
             return -1;  /* Invalid child pointer */
@@ -281,12 +407,16 @@ struct btree *btree_create(struct amidb_pager *pager, struct page_cache *cache,
         return NULL;
     }
 
+    /* A reused page may still be cached from its previous life */
+    cache_discard(cache, root_page);
+
     pager_sync(pager);
 
     /* Initialize tree structure */
     tree->pager = pager;
     tree->cache = cache;
     tree->txn = NULL;  /* No transaction initially */
+    tree->snapshot = NULL;
     tree->root_page = root_page;
     tree->num_entries = 0;
 
@@ -301,6 +431,7 @@ struct btree *btree_create(struct amidb_pager *pager, struct page_cache *cache,
 struct btree *btree_open(struct amidb_pager *pager, struct page_cache *cache,
                          uint32_t root_page) {
     struct btree *tree;
+    uint8_t *page_data;
 
     if (!pager || !cache) {
         return NULL;
@@ -315,9 +446,18 @@ struct btree *btree_open(struct amidb_pager *pager, struct page_cache *cache,
     tree->pager = pager;
     tree->cache = cache;
     tree->txn = NULL;  /* No transaction initially */
+    tree->snapshot = NULL;
     tree->root_page = root_page;
     tree->num_entries = 0;  /* Will be computed on demand */
 
+    /* An LSM table says so in its root page */
+    if (root_page != 0 && cache_get_page(cache, root_page, &page_data) == 0) {
+        if (page_data[4] == PAGE_TYPE_LSM) {
+            tree->engine = BTREE_ENGINE_LSM;
+        }
+        cache_unpin(cache, root_page);
+    }
+
     return tree;
 }
 
@@ -346,6 +486,16 @@ void btree_set_transaction(struct btree *tree, struct txn_context *txn) {
     tree->txn = txn;
 }
 
+/*
+ * Read the tree through a snapshot
+ */
+void btree_set_snapshot(struct btree *tree, struct txn_snapshot *snap) {
+    if (!tree) {
+        return;
+    }
+    tree->snapshot = snap;
+}
+
 /*
  * Insert a key/value pair (Phase 3B: with split support)
  */
@@ -358,14 +508,19 @@ int btree_insert(struct btree *tree, int32_t key, uint32_t value) {
     int32_t split_key;
     uint32_t new_page;
 
-    if (!tree) {
-        return -1;
+    if (!tree || tree->snapshot) {
+        return -1;  /* Snapshot trees are read-only */
+    }
+    if (tree->engine == BTREE_ENGINE_LSM) {
+        return lsm_insert(tree, key, value);
     }
 
-    /* Find leaf page */
-    if (find_leaf_page(tree, key, &leaf_page) != 0) {
+    /* Find leaf page and make its path writable */
+    if (find_leaf_page(tree, key, &leaf_page) != 0 ||
+        btree_shadow_path(tree) != 0) {
         return -1;
     }
+    leaf_page = tree->path[tree->path_depth - 1].page_num;
 
     /* Get leaf page from cache */
     if (cache_get_page(tree->cache, leaf_page, &page_data) != 0) {
@@ -385,14 +540,16 @@ int btree_insert(struct btree *tree, int32_t key, uint32_t value) {
         }
 
         /* Insert split key into parent */
-        if (insert_into_parent(tree, leaf_page, split_key, new_page) != 0) {
+        if (insert_into_parent(tree, tree->path_depth - 1, split_key, new_page) != 0) {
             return -1;
         }
 
         /* Re-find leaf page (key may now be in different leaf) */
-        if (find_leaf_page(tree, key, &leaf_page) != 0) {
+        if (find_leaf_page(tree, key, &leaf_page) != 0 ||
+            btree_shadow_path(tree) != 0) {
             return -1;
         }
+        leaf_page = tree->path[tree->path_depth - 1].page_num;
 
         /* Get the correct leaf page */
         if (cache_get_page(tree->cache, leaf_page, &page_data) != 0) {
@@ -424,6 +581,7 @@ int btree_insert(struct btree *tree, int32_t key, uint32_t value) {
     }
 
     /* Serialize and write back */
+    btree_save_before_image(tree, leaf_page, page_data);
     serialize_node(&node, page_data);
     btree_mark_page_dirty(tree, leaf_page);
     cache_unpin(tree->cache, leaf_page);
@@ -443,6 +601,9 @@ int btree_search(struct btree *tree, int32_t key, uint32_t *value_out) {
     if (!tree || !value_out) {
         return -1;
     }
+    if (tree->engine == BTREE_ENGINE_LSM) {
+        return lsm_search(tree, key, value_out);
+    }
 
     /* Find leaf page */
     if (find_leaf_page(tree, key, &leaf_page) != 0) {
@@ -450,7 +611,7 @@ int btree_search(struct btree *tree, int32_t key, uint32_t *value_out) {
     }
 
     /* Get leaf page from cache */
-    if (cache_get_page(tree->cache, leaf_page, &page_data) != 0) {
+    if (btree_read_page(tree->cache, tree->snapshot, leaf_page, &page_data) != 0) {
         return -1;
     }
 
@@ -481,8 +642,11 @@ int btree_delete(struct btree *tree, int32_t key) {
     int index;
     int i;
 
-    if (!tree) {
-        return -1;
+    if (!tree || tree->snapshot) {
+        return -1;  /* Snapshot trees are read-only */
+    }
+    if (tree->engine == BTREE_ENGINE_LSM) {
+        return lsm_delete(tree, key);
     }
 
     /* Find leaf page */
@@ -506,6 +670,16 @@ int btree_delete(struct btree *tree, int32_t key) {
         cache_unpin(tree->cache, leaf_page);
         return -1;  /* Not found */
     }
+    cache_unpin(tree->cache, leaf_page);
+
+    /* Make the path writable (the leaf may move) */
+    if (btree_shadow_path(tree) != 0) {
+        return -1;
+    }
+    leaf_page = tree->path[tree->path_depth - 1].page_num;
+    if (cache_get_page(tree->cache, leaf_page, &page_data) != 0) {
+        return -1;
+    }
 
     /* Shift keys and values to remove the entry */
     for (i = index; i < (int)node.num_keys - 1; i++) {
@@ -517,69 +691,185 @@ int btree_delete(struct btree *tree, int32_t key) {
     tree->num_entries--;
 
     /* Serialize and write back */
+    btree_save_before_image(tree, leaf_page, page_data);
     serialize_node(&node, page_data);
     btree_mark_page_dirty(tree, leaf_page);
     cache_unpin(tree->cache, leaf_page);
 
     /* Rebalance tree if needed (Phase 3B) */
-    if (rebalance_after_delete(tree, leaf_page) != 0) {
+    if (rebalance_after_delete(tree, tree->path_depth - 1) != 0) {
         return -1;
     }
 
     return 0;
 }
 
+/*
+ * Descend from a cursor's path top to the leftmost leaf holding a key
+ *
+ * Leaves left empty by deletes are skipped by climbing back up.
+ */
+static int cursor_descend(struct btree_cursor *cursor, uint32_t current_page) {
+    struct btree_node node;
+    uint8_t *page_data;
+    struct btree_path_entry *up;
+
+    while (1) {
+        if (cursor->path_depth >= BTREE_MAX_HEIGHT) {
+            cursor->valid = 0;
+            return -1;
+        }
+
+        /* Get page */
+        if (btree_read_page(cursor->cache, cursor->snapshot, current_page, &page_data) != 0) {
+            cursor->valid = 0;
+            return -1;
+        }
+
+        deserialize_node(&node, page_data);
+        cache_unpin(cursor->cache, current_page);
+
+        cursor->path[cursor->path_depth].page_num = current_page;
+        cursor->path[cursor->path_depth].index = 0;
+        cursor->path_depth++;
+
+        if (node.node_type == BTREE_NODE_LEAF) {
+            if (node.num_keys > 0) {
+                cursor->current_page = current_page;
+                cursor->current_index = 0;
+                cursor->key = node.keys[0];
+                cursor->value = node.values[0];
+                cursor->valid = 1;
+                return 0;
+            }
+
+            /* Empty leaf: climb to the next subtree to the right */
+            cursor->path_depth--;
+            while (1) {
+                if (cursor->path_depth == 0) {
+                    cursor->valid = 0;
+                    return 0;
+                }
+                up = &cursor->path[cursor->path_depth - 1];
+                if (btree_read_page(cursor->cache, cursor->snapshot, up->page_num, &page_data) != 0) {
+                    cursor->valid = 0;
+                    return -1;
+                }
+                deserialize_node(&node, page_data);
+                cache_unpin(cursor->cache, up->page_num);
+
+                if (up->index < node.num_keys) {
+                    up->index++;
+                    break;
+                }
+                cursor->path_depth--;
+            }
+            current_page = node.children[up->index];
+        } else {
+            /* Follow leftmost child */
+            current_page = node.children[0];
+        }
+
+        if (current_page == 0) {
+            cursor->valid = 0;
+            return -1;
+        }
+    }
+}
+
 /*
  * Create cursor positioned at first entry
  */
 int btree_cursor_first(struct btree *tree, struct btree_cursor *cursor) {
-    uint32_t current_page;
+    if (!tree || !cursor) {
+        return -1;
+    }
+    if (tree->engine == BTREE_ENGINE_LSM) {
+        return lsm_cursor_first(tree, cursor);
+    }
+
+    memset(cursor, 0, sizeof(*cursor));
+    cursor->pager = tree->pager;
+    cursor->cache = tree->cache;
+    cursor->snapshot = tree->snapshot;
+
+    /* Find leftmost leaf */
+    return cursor_descend(cursor, tree->root_page);
+}
+
+/*
+ * Create cursor positioned at the first entry >= key
+ */
+int btree_cursor_seek(struct btree *tree, int32_t key, struct btree_cursor *cursor) {
     struct btree_node node;
     uint8_t *page_data;
+    uint32_t current_page;
+    int index;
 
     if (!tree || !cursor) {
         return -1;
     }
+    if (tree->engine == BTREE_ENGINE_LSM) {
+        if (lsm_cursor_first(tree, cursor) != 0) {
+            return -1;
+        }
+        while (cursor->valid && cursor->key < key) {
+            lsm_cursor_next(cursor);
+        }
+        return 0;
+    }
 
     memset(cursor, 0, sizeof(*cursor));
     cursor->pager = tree->pager;
     cursor->cache = tree->cache;
+    cursor->snapshot = tree->snapshot;
 
-    /* Find leftmost leaf */
+    /* Descend towards key, recording the path for btree_cursor_next */
     current_page = tree->root_page;
-
     while (1) {
-        /* Get page */
-        if (cache_get_page(tree->cache, current_page, &page_data) != 0) {
+        if (cursor->path_depth >= BTREE_MAX_HEIGHT) {
+            return -1;
+        }
+        if (btree_read_page(cursor->cache, cursor->snapshot, current_page, &page_data) != 0) {
             return -1;
         }
-
         deserialize_node(&node, page_data);
-        cache_unpin(tree->cache, current_page);
-
-        if (node.node_type == BTREE_NODE_LEAF) {
-            /* Found leftmost leaf */
-            cursor->current_page = current_page;
-            cursor->current_index = 0;
+        cache_unpin(cursor->cache, current_page);
 
-            if (node.num_keys > 0) {
-                cursor->key = node.keys[0];
-                cursor->value = node.values[0];
-                cursor->valid = 1;
-            } else {
-                cursor->valid = 0;
-            }
+        cursor->path[cursor->path_depth].page_num = current_page;
+        cursor->path[cursor->path_depth].index = 0;
+        cursor->path_depth++;
 
-            return 0;
+        if (node.node_type == BTREE_NODE_LEAF) {
+            break;
         }
-
-        /* Follow leftmost child */
-        current_page = node.children[0];
-
+        index = child_index_for_key(&node, key);
+        cursor->path[cursor->path_depth - 1].index = (uint32_t)index;
+        current_page = node.children[index];
         if (current_page == 0) {
             return -1;
         }
     }
+
+    cursor->current_page = current_page;
+    index = find_key_in_node(&node, key);
+    if (index < (int)node.num_keys) {
+        cursor->current_index = (uint32_t)index;
+        cursor->key = node.keys[index];
+        cursor->value = node.values[index];
+        cursor->valid = 1;
+        return 0;
+    }
+
+    /* Every key in this leaf is smaller: the entry is in the next one */
+    /* (stand on the leaf's last slot and step past it) */
+    cursor->current_index = (uint32_t)index - 1;
+    cursor->valid = 1;
+    if (btree_cursor_next(cursor) != 0 && cursor->valid) {
+        cursor->valid = 0;
+        return -1;
+    }
+    return 0;
 }
 
 /*
@@ -588,13 +878,17 @@ int btree_cursor_first(struct btree *tree, struct btree_cursor *cursor) {
 int btree_cursor_next(struct btree_cursor *cursor) {
     struct btree_node node;
     uint8_t *page_data;
+    struct btree_path_entry *up;
 
     if (!cursor || !cursor->valid) {
         return -1;
     }
+    if (cursor->engine == BTREE_ENGINE_LSM) {
+        return lsm_cursor_next(cursor);
+    }
 
     /* Get current page */
-    if (cache_get_page(cursor->cache, cursor->current_page, &page_data) != 0) {
+    if (btree_read_page(cursor->cache, cursor->snapshot, cursor->current_page, &page_data) != 0) {
         return -1;
     }
 
@@ -611,25 +905,26 @@ int btree_cursor_next(struct btree_cursor *cursor) {
         return 0;
     }
 
-    /* Move to next leaf page */
-    if (node.next_leaf != 0) {
-        cursor->current_page = node.next_leaf;
-        cursor->current_index = 0;
+    /* Move to next leaf: climb until a node has a child further right */
+    cursor->path_depth--;
+    while (cursor->path_depth > 0) {
+        up = &cursor->path[cursor->path_depth - 1];
 
-        /* Get next page */
-        if (cache_get_page(cursor->cache, cursor->current_page, &page_data) != 0) {
+        if (btree_read_page(cursor->cache, cursor->snapshot, up->page_num, &page_data) != 0) {
             cursor->valid = 0;
             return -1;
         }
-
         deserialize_node(&node, page_data);
-        cache_unpin(cursor->cache, cursor->current_page);
+        cache_unpin(cursor->cache, up->page_num);
 
-        if (node.num_keys > 0) {
-            cursor->key = node.keys[0];
-            cursor->value = node.values[0];
-            return 0;
+        if (up->index < node.num_keys) {
+            up->index++;
+            if (cursor_descend(cursor, node.children[up->index]) != 0) {
+                return -1;
+            }
+            return cursor->valid ? 0 : -1;
         }
+        cursor->path_depth--;
     }
 
     /* No more entries */
@@ -668,6 +963,9 @@ int btree_cursor_get(struct btree_cursor *cursor, int32_t *key_out, uint32_t *va
 
 /*
  * Allocate a new B+Tree node
+ *
+ * The node is built in the cache and reaches the file with the rest of
+ * the change (at commit, checkpoint or eviction).
  */
 static int allocate_node(struct btree *tree, uint8_t node_type, uint32_t *page_out) {
     struct btree_node node;
@@ -685,26 +983,19 @@ static int allocate_node(struct btree *tree, uint8_t node_type, uint32_t *page_o
     memset(&node, 0, sizeof(node));
     node.node_type = node_type;
     node.num_keys = 0;
-    node.parent = 0;
-    node.next_leaf = 0;
 
-    /* Allocate page buffer */
-    page_data = (uint8_t *)mem_alloc(AMIDB_PAGE_SIZE, AMIDB_MEM_CLEAR);
-    if (!page_data) {
+    /* Get a cache entry for it (nothing to read) */
+    if (cache_new_page(tree->cache, new_page, &page_data) != 0) {
         pager_free_page(tree->pager, new_page);
         return -1;
     }
 
-    /* Serialize and write */
+    /* Serialize */
+    btree_save_before_image(tree, new_page, page_data);
     serialize_node(&node, page_data);
     page_data[4] = PAGE_TYPE_BTREE;
-    rc = pager_write_page(tree->pager, new_page, page_data);
-    mem_free(page_data, AMIDB_PAGE_SIZE);
-
-    if (rc != 0) {
-        pager_free_page(tree->pager, new_page);
-        return -1;
-    }
+    btree_mark_page_dirty(tree, new_page);
+    cache_unpin(tree->cache, new_page);
 
     *page_out = new_page;
     return 0;
@@ -755,18 +1046,13 @@ static int split_leaf_node(struct btree *tree, uint32_t leaf_page, int32_t *spli
     /* Update old node */
     old_node.num_keys = split_index;
 
-    /* Link leaves together */
-    new_node.next_leaf = old_node.next_leaf;
-    old_node.next_leaf = new_page;
-
-    /* Both nodes have same parent (will be updated by insert_into_parent) */
-    new_node.parent = old_node.parent;
-
     /* Write both nodes back */
+    btree_save_before_image(tree, leaf_page, old_data);
     serialize_node(&old_node, old_data);
     btree_mark_page_dirty(tree, leaf_page);
     cache_unpin(tree->cache, leaf_page);
 
+    btree_save_before_image(tree, new_page, new_data);
     serialize_node(&new_node, new_data);
     btree_mark_page_dirty(tree, new_page);
     cache_unpin(tree->cache, new_page);
@@ -780,25 +1066,20 @@ static int split_leaf_node(struct btree *tree, uint32_t leaf_page, int32_t *spli
 
 /*
  * Insert a key into parent after split (Phase 3B)
+ *
+ * level is the depth of the node that split (its parent is one up on
+ * the path); right_page is its new right half.
  */
-static int insert_into_parent(struct btree *tree, uint32_t left_page, int32_t key, uint32_t right_page) {
-    struct btree_node left_node, parent_node, new_root;
-    uint8_t *left_data, *parent_data;
+static int insert_into_parent(struct btree *tree, uint32_t level, int32_t key, uint32_t right_page) {
+    struct btree_node parent_node, new_root;
+    uint8_t *parent_data;
     uint32_t parent_page, new_root_page;
     int index, i;
     int32_t split_key;
     uint32_t new_page;
 
-    /* Get left node to find its parent */
-    if (cache_get_page(tree->cache, left_page, &left_data) != 0) {
-        return -1;
-    }
-    deserialize_node(&left_node, left_data);
-    parent_page = left_node.parent;
-    cache_unpin(tree->cache, left_page);
-
     /* If no parent, create new root */
-    if (parent_page == 0) {
+    if (level == 0) {
         /* Allocate new root */
         if (allocate_node(tree, BTREE_NODE_INTERNAL, &new_root_page) != 0) {
             return -1;
@@ -814,42 +1095,23 @@ static int insert_into_parent(struct btree *tree, uint32_t left_page, int32_t ke
         /* Setup new root with two children */
         new_root.num_keys = 1;
         new_root.keys[0] = key;
-        new_root.children[0] = left_page;
+        new_root.children[0] = tree->path[0].page_num;
         new_root.children[1] = right_page;
-        new_root.parent = 0;
 
         /* Write new root */
+        btree_save_before_image(tree, new_root_page, parent_data);
         serialize_node(&new_root, parent_data);
         btree_mark_page_dirty(tree, new_root_page);
         cache_unpin(tree->cache, new_root_page);
 
-        /* Update children's parent pointers */
-        if (cache_get_page(tree->cache, left_page, &left_data) != 0) {
-            return -1;
-        }
-        deserialize_node(&left_node, left_data);
-        left_node.parent = new_root_page;
-        serialize_node(&left_node, left_data);
-        btree_mark_page_dirty(tree, left_page);
-        cache_unpin(tree->cache, left_page);
-
-        if (cache_get_page(tree->cache, right_page, &left_data) != 0) {
-            return -1;
-        }
-        deserialize_node(&left_node, left_data);
-        left_node.parent = new_root_page;
-        serialize_node(&left_node, left_data);
-        btree_mark_page_dirty(tree, right_page);
-        cache_unpin(tree->cache, right_page);
-
         /* Update tree root */
         tree->root_page = new_root_page;
-        pager_sync(tree->pager);
 
         return 0;
     }
 
     /* Insert into existing parent */
+    parent_page = tree->path[level - 1].page_num;
     if (cache_get_page(tree->cache, parent_page, &parent_data) != 0) {
         return -1;
     }
@@ -865,17 +1127,14 @@ static int insert_into_parent(struct btree *tree, uint32_t left_page, int32_t ke
         }
 
         /* Recursively insert into parent's parent */
-        if (insert_into_parent(tree, parent_page, split_key, new_page) != 0) {
+        if (insert_into_parent(tree, level - 1, split_key, new_page) != 0) {
             return -1;
         }
 
-        /* Re-fetch parent (may have moved due to split) */
-        if (cache_get_page(tree->cache, left_page, &left_data) != 0) {
-            return -1;
+        /* The key belongs in whichever half covers it now */
+        if (key >= split_key) {
+            parent_page = new_page;
         }
-        deserialize_node(&left_node, left_data);
-        parent_page = left_node.parent;
-        cache_unpin(tree->cache, left_page);
 
         if (cache_get_page(tree->cache, parent_page, &parent_data) != 0) {
             return -1;
@@ -898,20 +1157,11 @@ static int insert_into_parent(struct btree *tree, uint32_t left_page, int32_t ke
     parent_node.num_keys++;
 
     /* Write parent back */
+    btree_save_before_image(tree, parent_page, parent_data);
     serialize_node(&parent_node, parent_data);
     btree_mark_page_dirty(tree, parent_page);
     cache_unpin(tree->cache, parent_page);
 
-    /* Update right child's parent pointer */
-    if (cache_get_page(tree->cache, right_page, &left_data) != 0) {
-        return -1;
-    }
-    deserialize_node(&left_node, left_data);
-    left_node.parent = parent_page;
-    serialize_node(&left_node, left_data);
-    btree_mark_page_dirty(tree, right_page);
-    cache_unpin(tree->cache, right_page);
-
     return 0;
 }
 
@@ -919,8 +1169,8 @@ static int insert_into_parent(struct btree *tree, uint32_t left_page, int32_t ke
  * Split an internal node (Phase 3B)
  */
 static int split_internal_node(struct btree *tree, uint32_t internal_page, int32_t *split_key_out, uint32_t *new_page_out) {
-    struct btree_node old_node, new_node, child_node;
-    uint8_t *old_data, *new_data, *child_data;
+    struct btree_node old_node, new_node;
+    uint8_t *old_data, *new_data;
     uint32_t new_page;
     uint32_t i, split_index;
 
@@ -956,32 +1206,19 @@ static int split_internal_node(struct btree *tree, uint32_t internal_page, int32
     }
     new_node.children[new_node.num_keys] = old_node.children[old_node.num_keys];
 
-    /* Update children's parent pointers */
-    for (i = 0; i <= new_node.num_keys; i++) {
-        if (cache_get_page(tree->cache, new_node.children[i], &child_data) != 0) {
-            continue;
-        }
-        deserialize_node(&child_node, child_data);
-        child_node.parent = new_page;
-        serialize_node(&child_node, child_data);
-        btree_mark_page_dirty(tree, new_node.children[i]);
-        cache_unpin(tree->cache, new_node.children[i]);
-    }
-
     /* Middle key goes to parent */
     *split_key_out = old_node.keys[split_index];
 
     /* Update old node */
     old_node.num_keys = split_index;
 
-    /* Both nodes have same parent */
-    new_node.parent = old_node.parent;
-
     /* Write both nodes back */
+    btree_save_before_image(tree, internal_page, old_data);
     serialize_node(&old_node, old_data);
     btree_mark_page_dirty(tree, internal_page);
     cache_unpin(tree->cache, internal_page);
 
+    btree_save_before_image(tree, new_page, new_data);
     serialize_node(&new_node, new_data);
     btree_mark_page_dirty(tree, new_page);
     cache_unpin(tree->cache, new_page);
@@ -1018,6 +1255,18 @@ static int borrow_from_sibling(struct btree *tree, uint32_t page_num, uint32_t p
 
         /* Can borrow if sibling has more than minimum */
         if (sibling.num_keys > BTREE_MIN_KEYS) {
+            /* The sibling changes too: it must be ours */
+            cache_unpin(tree->cache, sibling_page);
+            if (btree_own_child(tree, &parent, child_index + 1) != 0) {
+                cache_unpin(tree->cache, parent_page);
+                return -1;
+            }
+            sibling_page = parent.children[child_index + 1];
+            if (cache_get_page(tree->cache, sibling_page, &sibling_data) != 0) {
+                cache_unpin(tree->cache, parent_page);
+                return -1;
+            }
+
             /* Get current node */
             if (cache_get_page(tree->cache, page_num, &node_data) != 0) {
                 cache_unpin(tree->cache, sibling_page);
@@ -1060,14 +1309,17 @@ static int borrow_from_sibling(struct btree *tree, uint32_t page_num, uint32_t p
             }
 
             /* Write all nodes back */
+            btree_save_before_image(tree, page_num, node_data);
             serialize_node(&node, node_data);
             btree_mark_page_dirty(tree, page_num);
             cache_unpin(tree->cache, page_num);
 
+            btree_save_before_image(tree, sibling_page, sibling_data);
             serialize_node(&sibling, sibling_data);
             btree_mark_page_dirty(tree, sibling_page);
             cache_unpin(tree->cache, sibling_page);
 
+            btree_save_before_image(tree, parent_page, parent_data);
             serialize_node(&parent, parent_data);
             btree_mark_page_dirty(tree, parent_page);
             cache_unpin(tree->cache, parent_page);
@@ -1090,6 +1342,18 @@ static int borrow_from_sibling(struct btree *tree, uint32_t page_num, uint32_t p
 
         /* Can borrow if sibling has more than minimum */
         if (sibling.num_keys > BTREE_MIN_KEYS) {
+            /* The sibling changes too: it must be ours */
+            cache_unpin(tree->cache, sibling_page);
+            if (btree_own_child(tree, &parent, child_index - 1) != 0) {
+                cache_unpin(tree->cache, parent_page);
+                return -1;
+            }
+            sibling_page = parent.children[child_index - 1];
+            if (cache_get_page(tree->cache, sibling_page, &sibling_data) != 0) {
+                cache_unpin(tree->cache, parent_page);
+                return -1;
+            }
+
             /* Get current node */
             if (cache_get_page(tree->cache, page_num, &node_data) != 0) {
                 cache_unpin(tree->cache, sibling_page);
@@ -1131,14 +1395,17 @@ static int borrow_from_sibling(struct btree *tree, uint32_t page_num, uint32_t p
             }
 
             /* Write all nodes back */
+            btree_save_before_image(tree, page_num, node_data);
             serialize_node(&node, node_data);
             btree_mark_page_dirty(tree, page_num);
             cache_unpin(tree->cache, page_num);
 
+            btree_save_before_image(tree, sibling_page, sibling_data);
             serialize_node(&sibling, sibling_data);
             btree_mark_page_dirty(tree, sibling_page);
             cache_unpin(tree->cache, sibling_page);
 
+            btree_save_before_image(tree, parent_page, parent_data);
             serialize_node(&parent, parent_data);
             btree_mark_page_dirty(tree, parent_page);
             cache_unpin(tree->cache, parent_page);
@@ -1162,25 +1429,31 @@ static int merge_with_sibling(struct btree *tree, uint32_t left_page, uint32_t r
     uint8_t *left_data, *right_data, *parent_data;
     uint32_t i;
 
-    /* Get all three nodes */
+    /* Get all three nodes (the left one absorbs the right: own it) */
+    if (cache_get_page(tree->cache, parent_page, &parent_data) != 0) {
+        return -1;
+    }
+    deserialize_node(&parent, parent_data);
+
+    if (btree_own_child(tree, &parent, separator_index) != 0) {
+        cache_unpin(tree->cache, parent_page);
+        return -1;
+    }
+    left_page = parent.children[separator_index];
+
     if (cache_get_page(tree->cache, left_page, &left_data) != 0) {
+        cache_unpin(tree->cache, parent_page);
         return -1;
     }
     deserialize_node(&left, left_data);
 
     if (cache_get_page(tree->cache, right_page, &right_data) != 0) {
         cache_unpin(tree->cache, left_page);
+        cache_unpin(tree->cache, parent_page);
         return -1;
     }
     deserialize_node(&right, right_data);
 
-    if (cache_get_page(tree->cache, parent_page, &parent_data) != 0) {
-        cache_unpin(tree->cache, left_page);
-        cache_unpin(tree->cache, right_page);
-        return -1;
-    }
-    deserialize_node(&parent, parent_data);
-
     /* Merge right into left */
     if (left.node_type == BTREE_NODE_LEAF) {
         /* Leaf nodes: just copy keys/values */
@@ -1189,9 +1462,6 @@ static int merge_with_sibling(struct btree *tree, uint32_t left_page, uint32_t r
             left.values[left.num_keys] = right.values[i];
             left.num_keys++;
         }
-
-        /* Update leaf chain */
-        left.next_leaf = right.next_leaf;
     } else {
         /* Internal nodes: include separator from parent */
         left.keys[left.num_keys] = parent.keys[separator_index];
@@ -1214,6 +1484,7 @@ static int merge_with_sibling(struct btree *tree, uint32_t left_page, uint32_t r
     parent.num_keys--;
 
     /* Write updated nodes */
+    btree_save_before_image(tree, left_page, left_data);
     serialize_node(&left, left_data);
     btree_mark_page_dirty(tree, left_page);
     cache_unpin(tree->cache, left_page);
@@ -1221,6 +1492,7 @@ static int merge_with_sibling(struct btree *tree, uint32_t left_page, uint32_t r
     cache_unpin(tree->cache, right_page);
     pager_free_page(tree->pager, right_page);  /* Free the right node */
 
+    btree_save_before_image(tree, parent_page, parent_data);
     serialize_node(&parent, parent_data);
     btree_mark_page_dirty(tree, parent_page);
     cache_unpin(tree->cache, parent_page);
@@ -1230,70 +1502,52 @@ static int merge_with_sibling(struct btree *tree, uint32_t left_page, uint32_t r
 
 /*
  * Rebalance tree after deletion (Phase 3B)
+ *
+ * level is the depth on the path of the node that lost a key.
  */
-static int rebalance_after_delete(struct btree *tree, uint32_t page_num) {
+static int rebalance_after_delete(struct btree *tree, uint32_t level) {
     struct btree_node node, parent;
     uint8_t *node_data, *parent_data;
-    uint32_t parent_page;
-    int child_index, i;
+    uint32_t page_num, parent_page;
+    int child_index;
+
+    page_num = tree->path[level].page_num;
 
     /* Get the node */
     if (cache_get_page(tree->cache, page_num, &node_data) != 0) {
         return -1;
     }
     deserialize_node(&node, node_data);
+    cache_unpin(tree->cache, page_num);
 
     /* If node has enough keys, no rebalancing needed */
     if (node.num_keys >= BTREE_MIN_KEYS) {
-        cache_unpin(tree->cache, page_num);
         return 0;
     }
 
     /* If this is root and has at least 1 key, it's okay */
-    parent_page = node.parent;
-    if (parent_page == 0) {
+    if (level == 0) {
         /* Root node - special case */
         if (node.num_keys == 0 && node.node_type == BTREE_NODE_INTERNAL) {
             /* Root is empty internal node - make its only child the new root */
             tree->root_page = node.children[0];
-
-            /* Update new root's parent pointer */
-            cache_unpin(tree->cache, page_num);
-            if (cache_get_page(tree->cache, tree->root_page, &node_data) != 0) {
-                return -1;
-            }
-            deserialize_node(&node, node_data);
-            node.parent = 0;
-            serialize_node(&node, node_data);
-            btree_mark_page_dirty(tree, tree->root_page);
-            cache_unpin(tree->cache, tree->root_page);
-
             pager_free_page(tree->pager, page_num);
-        } else {
-            cache_unpin(tree->cache, page_num);
         }
         return 0;
     }
 
-    cache_unpin(tree->cache, page_num);
+    /* Child index in parent: the one followed on the way down */
+    parent_page = tree->path[level - 1].page_num;
+    child_index = (int)tree->path[level - 1].index;
 
-    /* Find child index in parent */
     if (cache_get_page(tree->cache, parent_page, &parent_data) != 0) {
         return -1;
     }
     deserialize_node(&parent, parent_data);
-
-    child_index = -1;
-    for (i = 0; i <= (int)parent.num_keys; i++) {
-        if (parent.children[i] == page_num) {
-            child_index = i;
-            break;
-        }
-    }
     cache_unpin(tree->cache, parent_page);
 
-    if (child_index < 0) {
-        return -1;  /* Not found in parent */
+    if (child_index > (int)parent.num_keys || parent.children[child_index] != page_num) {
+        return -1;  /* Path out of date */
     }
 
     /* Try to borrow from sibling */
@@ -1307,14 +1561,14 @@ static int rebalance_after_delete(struct btree *tree, uint32_t page_num) {
         uint32_t left_page = parent.children[child_index - 1];
         if (merge_with_sibling(tree, left_page, page_num, parent_page, child_index - 1) == 0) {
             /* Recursively rebalance parent */
-            return rebalance_after_delete(tree, parent_page);
+            return rebalance_after_delete(tree, level - 1);
         }
     } else {
         /* Merge with right sibling */
         uint32_t right_page = parent.children[child_index + 1];
         if (merge_with_sibling(tree, page_num, right_page, parent_page, child_index) == 0) {
             /* Recursively rebalance parent */
-            return rebalance_after_delete(tree, parent_page);
+            return rebalance_after_delete(tree, level - 1);
         }
     }
 
@@ -1330,8 +1584,8 @@ void btree_get_stats(struct btree *tree, uint32_t *num_entries, uint32_t *height
     uint32_t current_page;
     uint32_t tree_height = 0;
     uint32_t node_count = 0;
-    uint32_t leaf_count = 0;
-    uint32_t next_leaf;
+    struct btree_path_entry stack[BTREE_MAX_HEIGHT];
+    uint32_t depth;
 
     if (!tree) {
         if (num_entries) *num_entries = 0;
@@ -1339,6 +1593,10 @@ void btree_get_stats(struct btree *tree, uint32_t *num_entries, uint32_t *height
         if (num_nodes) *num_nodes = 0;
         return;
     }
+    if (tree->engine == BTREE_ENGINE_LSM) {
+        lsm_get_stats(tree, num_entries, height, num_nodes);
+        return;
+    }
 
     /* Return number of entries (already tracked) */
     if (num_entries) {
@@ -1374,54 +1632,51 @@ void btree_get_stats(struct btree *tree, uint32_t *num_entries, uint32_t *height
         *height = tree_height;
     }
 
-    /* Count nodes by traversing all leaf nodes and walking up */
+    /* Count nodes: depth-first walk with an explicit stack of */
+    /* (internal node, next child to visit) */
     if (num_nodes) {
-        /* Count leaf nodes by following the leaf chain */
-        leaf_count = 0;
+        node_count = 0;
+        depth = 0;
         current_page = tree->root_page;
 
-        /* First, find leftmost leaf */
         while (1) {
+            /* Visit current_page */
             if (cache_get_page(tree->cache, current_page, &page_data) != 0) {
                 break;
             }
-
             deserialize_node(&node, page_data);
             cache_unpin(tree->cache, current_page);
-
-            if (node.node_type == BTREE_NODE_LEAF) {
-                break;
+            node_count++;
+
+            if (node.node_type == BTREE_NODE_INTERNAL && depth < BTREE_MAX_HEIGHT) {
+                stack[depth].page_num = current_page;
+                stack[depth].index = 0;
+                depth++;
+                current_page = node.children[0];
+                continue;
             }
 
-            current_page = node.children[0];
-            if (current_page == 0) {
-                break;
-            }
-        }
+            /* Leaf: move on to the next unvisited child of an ancestor */
+            current_page = 0;
+            while (depth > 0) {
+                if (cache_get_page(tree->cache, stack[depth - 1].page_num, &page_data) != 0) {
+                    depth = 0;
+                    break;
+                }
+                deserialize_node(&node, page_data);
+                cache_unpin(tree->cache, stack[depth - 1].page_num);
 
-        /* Now traverse all leaves */
-        next_leaf = current_page;
-        while (next_leaf != 0) {
-            leaf_count++;
+                if (stack[depth - 1].index < node.num_keys) {
+                    stack[depth - 1].index++;
+                    current_page = node.children[stack[depth - 1].index];
+                    break;
+                }
+                depth--;
+            }
 
-            if (cache_get_page(tree->cache, next_leaf, &page_data) != 0) {
+            if (current_page == 0) {
                 break;
             }
-
-            deserialize_node(&node, page_data);
-            current_page = next_leaf;  /* Save current page for unpinning */
-            next_leaf = node.next_leaf;
-            cache_unpin(tree->cache, current_page);
-        }
-
-        /* For simplicity, estimate total nodes based on height and leaf count */
-        /* This is an approximation: leaf_count + internal nodes */
-        /* For a more accurate count, we'd need to traverse internal nodes too */
-        if (tree_height == 1) {
-            node_count = leaf_count;  /* Only leaves */
-        } else {
-            /* Rough estimate: leaves + ~(leaves / branching factor) internal nodes */
-            node_count = leaf_count + (leaf_count / 32);  /* Approximation */
         }
 
         *num_nodes = node_count;
@@ -3,6 +3,12 @@
  *
  * B+Tree structure for indexing database records.
  * Uses iterative traversal to avoid stack overflow (68000 has only 4KB stack).
+ *
+ * Nodes hold no parent or sibling links: a modification finds the
+ * parents on the path it descended, and cursors climb their own path.
+ * A node is then referenced from exactly one place (its parent, or the
+ * tree's root), which is what lets a shadow-paging transaction copy a
+ * node and repoint only that one reference (see txn_set_commit_mode).
  */
 
 #ifndef AMIDB_BTREE_H
@@ -14,12 +20,17 @@
 struct amidb_pager;
 struct page_cache;
 struct txn_context;
+struct txn_snapshot;
 
 /* B+Tree configuration */
 #define BTREE_ORDER 64          /* Maximum keys per node (fits in 4KB page) */
 #define BTREE_MIN_KEYS 32       /* Minimum keys per node (for splits) */
 #define BTREE_MAX_HEIGHT 16     /* Maximum tree height */
 
+/* Table engines behind the btree_* API (see storage/lsm.h) */
+#define BTREE_ENGINE_BTREE  0
+#define BTREE_ENGINE_LSM    1
+
 /* B+Tree node types */
 #define BTREE_NODE_INTERNAL 1
 #define BTREE_NODE_LEAF     2
@@ -35,8 +46,8 @@ struct btree_node {
     uint8_t  node_type;         /* BTREE_NODE_INTERNAL or BTREE_NODE_LEAF */
     uint8_t  reserved[3];       /* Padding for alignment */
     uint32_t num_keys;          /* Number of keys in this node */
-    uint32_t parent;            /* Parent page number (0 if root) */
-    uint32_t next_leaf;         /* Next leaf page (for leaf nodes, 0 if none) */
+    uint32_t parent;            /* Unused (0); kept for the page layout */
+    uint32_t next_leaf;         /* Unused (0); kept for the page layout */
 
     /* For internal nodes: keys[i] and children[i] */
     /* For leaf nodes: keys[i] and values[i] */
@@ -45,6 +56,12 @@ struct btree_node {
     uint32_t values[BTREE_ORDER];        /* For leaf nodes */
 };
 
+/* One step of a root-to-leaf descent */
+struct btree_path_entry {
+    uint32_t page_num;          /* Node visited */
+    uint32_t index;             /* Child followed (unused for the leaf) */
+};
+
 /* B+Tree cursor for iteration */
 struct btree_cursor {
     struct amidb_pager *pager;
@@ -53,11 +70,9 @@ struct btree_cursor {
     uint32_t current_page;      /* Current page number */
     uint32_t current_index;     /* Current key index within page */
 
-    /* Path from root to current position (for traversal) */
-    struct {
-        uint32_t page_num;
-        uint32_t index;
-    } path[BTREE_MAX_HEIGHT];
+    /* Path from root to current position (for traversal); */
+    /* LSM: the position in the memtable, then in each run */
+    struct btree_path_entry path[BTREE_MAX_HEIGHT];
     uint32_t path_depth;
 
     /* Current key/value */
@@ -65,6 +80,9 @@ struct btree_cursor {
     uint32_t value;
 
     uint8_t valid;              /* 1 if cursor points to valid entry */
+    uint8_t engine;             /* BTREE_ENGINE_* of the tree */
+
+    struct txn_snapshot *snapshot;  /* Snapshot being read (NULL if none) */
 };
 
 /* B+Tree handle */
@@ -72,8 +90,15 @@ struct btree {
     struct amidb_pager *pager;
     struct page_cache *cache;
     struct txn_context *txn;    /* Active transaction (NULL if none) */
+    struct txn_snapshot *snapshot;  /* Read-only snapshot (NULL if none) */
     uint32_t root_page;         /* Root page number */
     uint32_t num_entries;       /* Total number of entries */
+    uint8_t engine;             /* BTREE_ENGINE_* (from the root page type) */
+    uint32_t bloom_skips;       /* LSM: runs a lookup skipped by bloom filter */
+
+    /* Path of the last descent, root first (parents for split/merge) */
+    struct btree_path_entry path[BTREE_MAX_HEIGHT];
+    uint32_t path_depth;
 };
 
 /*
@@ -91,6 +116,9 @@ struct btree *btree_create(struct amidb_pager *pager, struct page_cache *cache,
 /*
  * Open an existing B+Tree
  *
+ * An LSM table's root page is recognised here; every call on the
+ * handle is then served by the LSM engine.
+ *
  * pager: Pager for page I/O
  * cache: Page cache
  * root_page: Root page number
@@ -117,11 +145,26 @@ void btree_close(struct btree *tree);
  */
 void btree_set_transaction(struct btree *tree, struct txn_context *txn);
 
+/*
+ * Read the B+Tree through a snapshot
+ *
+ * Searches and cursors then see the tree as committed when the snapshot
+ * was opened, however the writer changes it meanwhile. Open the tree
+ * with the root page valid at that time. A tree with a snapshot is
+ * read-only: insert and delete fail.
+ *
+ * snap: Snapshot (or NULL to read current pages again)
+ */
+void btree_set_snapshot(struct btree *tree, struct txn_snapshot *snap);
+
 /*
  * Insert a key/value pair
  *
  * Phase 3B: Full split support - handles node splits and tree growth
  *
+ * In a shadow-paging transaction the nodes on the path are copied
+ * first, so root_page may change without a split.
+ *
  * key: Key to insert
  * value: Value to associate with key
  *
@@ -158,6 +201,16 @@ int btree_delete(struct btree *tree, int32_t key);
  */
 int btree_cursor_first(struct btree *tree, struct btree_cursor *cursor);
 
+/*
+ * Create a cursor positioned at the first entry with a key >= key
+ *
+ * The cursor is left invalid if there is none. An LSM tree has no
+ * index over its runs: its cursor steps there from the first entry.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int btree_cursor_seek(struct btree *tree, int32_t key, struct btree_cursor *cursor);
+
 /*
  * Move cursor to next entry
  *
@@ -4,6 +4,7 @@
 
 #include "storage/cache.h"
 #include "storage/pager.h"
+#include "txn/txn.h"
 #include "os/mem.h"
 #include <string.h>
 
@@ -51,6 +52,7 @@ struct page_cache *cache_create(uint32_t capacity, struct amidb_pager *pager) {
     cache->count = 0;
     cache->lru_head = NULL;
     cache->lru_tail = NULL;
+    cache->txn = NULL;
 
     /* Initialize all entries as invalid */
     for (i = 0; i < capacity; i++) {
@@ -186,25 +188,44 @@ static struct cache_entry *evict_lru_page(struct page_cache *cache) {
             if (victim->state == CACHE_ENTRY_DIRTY) {
                 pager_write_page(cache->pager, victim->page_num, victim->data);
             }
+            break;
+        }
 
-            /* Remove from LRU list */
-            remove_from_lru(cache, victim);
-
-            /* Mark as invalid */
-            victim->state = CACHE_ENTRY_INVALID;
-            victim->page_num = 0;
+        /* Try previous entry */
+        victim = victim->lru_prev;
+    }
 
-            cache->count--;
+    /* Only transaction pages left: spill the oldest one to the WAL */
+    if (!victim && cache->txn) {
+        victim = cache->lru_tail;
 
-            return victim;
+        while (victim) {
+            if (victim->pin_count == 0 && victim->txn_id != 0) {
+                if (txn_spill_page(cache->txn, victim->page_num, victim->data) != 0) {
+                    return NULL;
+                }
+                break;
+            }
+            victim = victim->lru_prev;
         }
+    }
 
-        /* Try previous entry */
-        victim = victim->lru_prev;
+    if (!victim) {
+        /* All pages are pinned! */
+        return NULL;
     }
 
-    /* All pages are pinned! */
-    return NULL;
+    /* Remove from LRU list */
+    remove_from_lru(cache, victim);
+
+    /* Mark as invalid */
+    victim->state = CACHE_ENTRY_INVALID;
+    victim->page_num = 0;
+    victim->txn_id = 0;
+
+    cache->count--;
+
+    return victim;
 }
 
 /*
@@ -247,15 +268,21 @@ int cache_get_page(struct page_cache *cache, uint32_t page_num, uint8_t **data)
         }
     }
 
-    /* Load page from disk */
-    rc = pager_read_page(cache->pager, page_num, entry->data);
-    if (rc != 0) {
-        return -1;
+    /* Load page: spilled transaction pages come back from the WAL */
+    if (cache->txn && txn_load_spilled_page(cache->txn, page_num, entry->data) == 0) {
+        entry->state = CACHE_ENTRY_DIRTY;
+        entry->txn_id = cache->txn->txn_id;
+    } else {
+        rc = pager_read_page(cache->pager, page_num, entry->data);
+        if (rc != 0) {
+            return -1;
+        }
+        entry->state = CACHE_ENTRY_CLEAN;
+        entry->txn_id = 0;
     }
 
     /* Initialize entry */
     entry->page_num = page_num;
-    entry->state = CACHE_ENTRY_CLEAN;
     entry->pin_count = 1;  /* Automatically pinned */
 
     /* Add to head of LRU */
@@ -267,6 +294,76 @@ int cache_get_page(struct page_cache *cache, uint32_t page_num, uint8_t **data)
     return 0;
 }
 
+/*
+ * Get a cache entry for a new page (no disk read)
+ */
+int cache_new_page(struct page_cache *cache, uint32_t page_num, uint8_t **data) {
+    struct cache_entry *entry;
+
+    if (!cache || !data) {
+        return -1;
+    }
+
+    entry = find_entry(cache, page_num);
+
+    if (entry) {
+        /* Stale copy of the page's previous life */
+        move_to_lru_head(cache, entry);
+    } else {
+        entry = find_free_entry(cache);
+
+        if (!entry) {
+            entry = evict_lru_page(cache);
+
+            if (!entry) {
+                return -1;
+            }
+        }
+
+        entry->page_num = page_num;
+        entry->state = CACHE_ENTRY_CLEAN;
+        entry->txn_id = 0;
+        entry->pin_count = 0;
+
+        add_to_lru_head(cache, entry);
+        cache->count++;
+    }
+
+    memset(entry->data, 0, AMIDB_PAGE_SIZE);
+    entry->pin_count++;
+
+    *data = entry->data;
+    return 0;
+}
+
+/*
+ * Drop a page from the cache
+ */
+int cache_discard(struct page_cache *cache, uint32_t page_num) {
+    struct cache_entry *entry;
+
+    if (!cache) {
+        return -1;
+    }
+
+    entry = find_entry(cache, page_num);
+    if (!entry) {
+        return 0;
+    }
+
+    if (entry->pin_count > 0) {
+        return -1;
+    }
+
+    remove_from_lru(cache, entry);
+    entry->state = CACHE_ENTRY_INVALID;
+    entry->page_num = 0;
+    entry->txn_id = 0;
+    cache->count--;
+
+    return 0;
+}
+
 /*
  * Mark a page as dirty
  */
@@ -355,6 +452,9 @@ void cache_unpin_all(struct page_cache *cache, struct cache_pin_list *pins) {
  * Flush all dirty pages to disk
  */
 int cache_flush(struct page_cache *cache) {
+    struct pager_write *writes;
+    struct pager_write single;
+    uint32_t count;
     uint32_t i;
     int rc;
 
@@ -362,6 +462,12 @@ int cache_flush(struct page_cache *cache) {
         return -1;
     }
 
+    /* One write list for the whole cache, so pages go out sorted and */
+    /* consecutive pages merged; page by page if there is no memory */
+    writes = (struct pager_write *)mem_alloc(cache->capacity * sizeof(struct pager_write), 0);
+
+    count = 0;
+    rc = 0;
     for (i = 0; i < cache->capacity; i++) {
         if (cache->entries[i].state == CACHE_ENTRY_DIRTY) {
             /* Phase 3C: Skip pages belonging to uncommitted transactions */
@@ -369,14 +475,36 @@ int cache_flush(struct page_cache *cache) {
                 continue;  /* Don't flush uncommitted transaction pages */
             }
 
-            rc = pager_write_page(cache->pager,
-                                  cache->entries[i].page_num,
-                                  cache->entries[i].data);
-            if (rc != 0) {
-                return -1;
+            if (!writes) {
+                single.page_num = cache->entries[i].page_num;
+                single.data = cache->entries[i].data;
+                single.stamped = 0;
+                if (pager_write_batch(cache->pager, &single, 1) != 0) {
+                    return -1;
+                }
+                cache->entries[i].state = CACHE_ENTRY_CLEAN;
+                continue;
             }
 
-            cache->entries[i].state = CACHE_ENTRY_CLEAN;
+            writes[count].page_num = cache->entries[i].page_num;
+            writes[count].data = cache->entries[i].data;
+            writes[count].stamped = 0;
+            count++;
+        }
+    }
+
+    if (writes) {
+        rc = pager_write_batch(cache->pager, writes, count);
+
+        for (i = 0; i < count; i++) {
+            if (writes[i].result == 0) {
+                find_entry(cache, writes[i].page_num)->state = CACHE_ENTRY_CLEAN;
+            }
+        }
+
+        mem_free(writes, cache->capacity * sizeof(struct pager_write));
+        if (rc != 0) {
+            return -1;
         }
     }
 
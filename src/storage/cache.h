@@ -21,6 +21,7 @@
 
 /* Forward declarations */
 struct amidb_pager;
+struct txn_context;
 
 /* Cache entry states */
 #define CACHE_ENTRY_INVALID 0
@@ -49,6 +50,9 @@ struct page_cache {
 
     struct cache_entry *entries;   /* Array of cache entries */
 
+    /* Active transaction; its uncommitted pages can be spilled to the WAL */
+    struct txn_context *txn;       /* NULL if none */
+
     /* LRU list (most recent at head, least recent at tail) */
     struct cache_entry *lru_head;
     struct cache_entry *lru_tail;
@@ -90,6 +94,24 @@ void cache_destroy(struct page_cache *cache);
  */
 int cache_get_page(struct page_cache *cache, uint32_t page_num, uint8_t **data);
 
+/*
+ * Get a cache entry for a newly allocated page without reading it
+ *
+ * The page comes back zero-filled and pinned like cache_get_page; fill
+ * it in and mark it dirty. A copy still cached from before the page was
+ * freed is reused, so it can never be read back by mistake.
+ *
+ * Returns: 0 on success, -1 if every page is pinned
+ */
+int cache_new_page(struct page_cache *cache, uint32_t page_num, uint8_t **data);
+
+/*
+ * Drop a page from the cache without writing it
+ *
+ * Returns: 0 on success (also if it was not cached), -1 if it is pinned
+ */
+int cache_discard(struct page_cache *cache, uint32_t page_num);
+
 /*
  * Mark a page as dirty
  *
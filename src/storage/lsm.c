@@ -0,0 +1,1057 @@
+/*
+ * lsm.c - Log-structured table engine (memtable, sorted runs, merges)
+ *
+ * Page layouts (after the page header):
+ *
+ *   Root (PAGE_TYPE_LSM)
+ *     0   mem_count    entries in the memtable
+ *     4   run_count    runs, newest first
+ *     8   runs[]       header page and entry count per run
+ *     72  memtable     sorted key/value pairs
+ *
+ *   Run header (PAGE_TYPE_LSM_RUN)
+ *     0   entries, 4 min key, 8 max key, 12 data page count
+ *     16  bloom filter
+ *     ... fences: data page and its first key, in key order
+ *
+ *   Run data (PAGE_TYPE_LSM_RUN)
+ *     0   count, 4 next data page (0: last), 8 sorted key/value pairs
+ */
+
+#include "storage/lsm.h"
+#include "storage/pager.h"
+#include "storage/cache.h"
+#include "txn/txn.h"
+#include "os/mem.h"
+#include <string.h>
+
+/* Offsets from the start of the page */
+#define ROOT_MEM_COUNT  (AMIDB_PAGE_HEADER_SIZE + 0)
+#define ROOT_RUN_COUNT  (AMIDB_PAGE_HEADER_SIZE + 4)
+#define ROOT_RUNS       (AMIDB_PAGE_HEADER_SIZE + 8)
+#define ROOT_MEMTABLE   (AMIDB_PAGE_HEADER_SIZE + LSM_ROOT_HEADER)
+
+#define RUN_ENTRIES     (AMIDB_PAGE_HEADER_SIZE + 0)
+#define RUN_MIN_KEY     (AMIDB_PAGE_HEADER_SIZE + 4)
+#define RUN_MAX_KEY     (AMIDB_PAGE_HEADER_SIZE + 8)
+#define RUN_PAGE_COUNT  (AMIDB_PAGE_HEADER_SIZE + 12)
+#define RUN_BLOOM       (AMIDB_PAGE_HEADER_SIZE + LSM_RUN_HEADER)
+#define RUN_FENCES      (RUN_BLOOM + LSM_BLOOM_BYTES)
+
+#define DATA_COUNT      (AMIDB_PAGE_HEADER_SIZE + 0)
+#define DATA_NEXT       (AMIDB_PAGE_HEADER_SIZE + 4)
+#define DATA_ENTRIES    (AMIDB_PAGE_HEADER_SIZE + LSM_DATA_HEADER)
+
+/* Helper functions for endianness */
+static inline void put_u32(uint8_t *buf, uint32_t val) {
+    buf[0] = (uint8_t)(val & 0xFF);
+    buf[1] = (uint8_t)((val >> 8) & 0xFF);
+    buf[2] = (uint8_t)((val >> 16) & 0xFF);
+    buf[3] = (uint8_t)((val >> 24) & 0xFF);
+}
+
+static inline uint32_t get_u32(const uint8_t *buf) {
+    return (uint32_t)buf[0] |
+           ((uint32_t)buf[1] << 8) |
+           ((uint32_t)buf[2] << 16) |
+           ((uint32_t)buf[3] << 24);
+}
+
+static inline int32_t get_i32(const uint8_t *buf) {
+    return (int32_t)get_u32(buf);
+}
+
+/* A run being written */
+struct lsm_run_writer {
+    struct btree *tree;
+    uint8_t *header;            /* Run header image */
+    uint8_t *data;              /* Data page being filled */
+    uint32_t header_page;
+    uint32_t data_page;         /* 0: no data page started */
+    uint32_t data_count;
+    uint32_t entries;
+    uint32_t page_count;
+};
+
+/* Forward declarations of internal functions */
+static void lsm_save_before_image(struct btree *tree, uint32_t page_num, const uint8_t *page_data);
+static void lsm_mark_page_dirty(struct btree *tree, uint32_t page_num);
+static int lsm_read_page(struct page_cache *cache, struct txn_snapshot *snap,
+                         uint32_t page_num, uint8_t **page_data);
+static int lsm_own_root(struct btree *tree);
+static int lsm_put(struct btree *tree, int32_t key, uint32_t value);
+static uint32_t lsm_lower_bound(const uint8_t *entries, uint32_t count, int32_t key);
+static void lsm_bloom_add(uint8_t *bloom, int32_t key);
+static int lsm_bloom_test(const uint8_t *bloom, int32_t key);
+static int lsm_run_lookup(struct btree *tree, uint32_t header_page, int32_t key, uint32_t *value_out);
+static int lsm_run_first(struct page_cache *cache, struct txn_snapshot *snap,
+                         uint32_t header_page, uint32_t *data_page_out);
+static int lsm_data_head(struct page_cache *cache, struct txn_snapshot *snap,
+                         struct btree_path_entry *pos, int32_t *key_out, uint32_t *value_out);
+static int lsm_cursor_head(struct btree_cursor *cursor, uint32_t source,
+                           int32_t *key_out, uint32_t *value_out);
+static int lsm_cursor_settle(struct btree_cursor *cursor);
+static int lsm_writer_start(struct lsm_run_writer *w, struct btree *tree);
+static int lsm_writer_add(struct lsm_run_writer *w, int32_t key, uint32_t value);
+static int lsm_writer_finish(struct lsm_run_writer *w);
+static void lsm_writer_abort(struct lsm_run_writer *w);
+static int lsm_write_page(struct btree *tree, uint32_t page_num, uint8_t *image);
+static int lsm_flush(struct btree *tree, uint8_t *root);
+static int lsm_free_run(struct btree *tree, uint32_t header_page);
+
+/*
+ * Save a page's before-image in the active transaction
+ */
+static void lsm_save_before_image(struct btree *tree, uint32_t page_num, const uint8_t *page_data) {
+    if (tree->txn) {
+        txn_save_before_image(tree->txn, page_num, page_data);
+    }
+}
+
+/*
+ * Mark a page as dirty and track it in the active transaction
+ */
+static void lsm_mark_page_dirty(struct btree *tree, uint32_t page_num) {
+    struct cache_entry *entry;
+
+    cache_mark_dirty(tree->cache, page_num);
+
+    if (tree->txn) {
+        txn_add_dirty_page(tree->txn, page_num);
+        entry = cache_find_entry(tree->cache, page_num);
+        if (entry) {
+            entry->txn_id = tree->txn->txn_id;
+        }
+    }
+}
+
+/*
+ * Get a page for reading: through the snapshot if one is set
+ */
+static int lsm_read_page(struct page_cache *cache, struct txn_snapshot *snap,
+                         uint32_t page_num, uint8_t **page_data) {
+    if (snap) {
+        return txn_snapshot_get_page(snap, page_num, page_data);
+    }
+    return cache_get_page(cache, page_num, page_data);
+}
+
+/*
+ * Shadow paging: the root is the only page an LSM table rewrites,
+ * so it is the only one to copy (runs are written once, to new pages)
+ */
+static int lsm_own_root(struct btree *tree) {
+    uint32_t copy;
+
+    if (!tree->txn || !tree->txn->shadow) {
+        return 0;
+    }
+
+    if (txn_shadow_page(tree->txn, tree->root_page, &copy) != 0) {
+        return -1;
+    }
+    tree->root_page = copy;
+
+    return 0;
+}
+
+/*
+ * First entry whose key is >= key in a sorted key/value array
+ */
+static uint32_t lsm_lower_bound(const uint8_t *entries, uint32_t count, int32_t key) {
+    uint32_t low = 0;
+    uint32_t high = count;
+    uint32_t mid;
+
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (get_i32(entries + mid * 8) < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+/*
+ * Bloom filter: LSM_BLOOM_HASHES bits per key, by double hashing
+ */
+static void lsm_bloom_add(uint8_t *bloom, int32_t key) {
+    uint32_t h1 = (uint32_t)key * 0x9E3779B1UL;
+    uint32_t h2 = (((h1 >> 16) | (h1 << 16)) * 0x85EBCA6BUL) | 1;
+    uint32_t bit;
+    int i;
+
+    for (i = 0; i < LSM_BLOOM_HASHES; i++) {
+        bit = (h1 + (uint32_t)i * h2) % (LSM_BLOOM_BYTES * 8);
+        bloom[bit >> 3] |= (uint8_t)(1 << (bit & 7));
+    }
+}
+
+static int lsm_bloom_test(const uint8_t *bloom, int32_t key) {
+    uint32_t h1 = (uint32_t)key * 0x9E3779B1UL;
+    uint32_t h2 = (((h1 >> 16) | (h1 << 16)) * 0x85EBCA6BUL) | 1;
+    uint32_t bit;
+    int i;
+
+    for (i = 0; i < LSM_BLOOM_HASHES; i++) {
+        bit = (h1 + (uint32_t)i * h2) % (LSM_BLOOM_BYTES * 8);
+        if (!(bloom[bit >> 3] & (1 << (bit & 7)))) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Look a key up in one run
+ *
+ * Returns: 1 if the run holds the key (value may be a tombstone),
+ *          0 if not, -1 on error
+ */
+static int lsm_run_lookup(struct btree *tree, uint32_t header_page, int32_t key, uint32_t *value_out) {
+    uint8_t *page_data;
+    uint32_t page_count;
+    uint32_t data_page;
+    uint32_t low, high, mid;
+    uint32_t count;
+    uint32_t index;
+
+    if (lsm_read_page(tree->cache, tree->snapshot, header_page, &page_data) != 0) {
+        return -1;
+    }
+
+    if (key < get_i32(page_data + RUN_MIN_KEY) || key > get_i32(page_data + RUN_MAX_KEY)) {
+        cache_unpin(tree->cache, header_page);
+        return 0;
+    }
+    if (!lsm_bloom_test(page_data + RUN_BLOOM, key)) {
+        cache_unpin(tree->cache, header_page);
+        tree->bloom_skips++;
+        return 0;
+    }
+
+    /* Last data page whose first key is <= key */
+    page_count = get_u32(page_data + RUN_PAGE_COUNT);
+    low = 0;
+    high = page_count;
+    while (high - low > 1) {
+        mid = (low + high) / 2;
+        if (get_i32(page_data + RUN_FENCES + mid * 8 + 4) <= key) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    data_page = get_u32(page_data + RUN_FENCES + low * 8);
+    cache_unpin(tree->cache, header_page);
+
+    if (lsm_read_page(tree->cache, tree->snapshot, data_page, &page_data) != 0) {
+        return -1;
+    }
+    count = get_u32(page_data + DATA_COUNT);
+    index = lsm_lower_bound(page_data + DATA_ENTRIES, count, key);
+    if (index < count && get_i32(page_data + DATA_ENTRIES + index * 8) == key) {
+        *value_out = get_u32(page_data + DATA_ENTRIES + index * 8 + 4);
+        cache_unpin(tree->cache, data_page);
+        return 1;
+    }
+    cache_unpin(tree->cache, data_page);
+
+    return 0;
+}
+
+/*
+ * First data page of a run
+ */
+static int lsm_run_first(struct page_cache *cache, struct txn_snapshot *snap,
+                         uint32_t header_page, uint32_t *data_page_out) {
+    uint8_t *page_data;
+
+    if (lsm_read_page(cache, snap, header_page, &page_data) != 0) {
+        return -1;
+    }
+    *data_page_out = get_u32(page_data + RUN_FENCES);
+    cache_unpin(cache, header_page);
+
+    return 0;
+}
+
+/*
+ * Entry at a position in a run, following the data page chain past the
+ * end of a page (pos->page_num 0: run exhausted)
+ *
+ * Returns: 1 if there is an entry, 0 if the run is exhausted, -1 on error
+ */
+static int lsm_data_head(struct page_cache *cache, struct txn_snapshot *snap,
+                         struct btree_path_entry *pos, int32_t *key_out, uint32_t *value_out) {
+    uint8_t *page_data;
+    uint32_t page_num;
+
+    while (pos->page_num != 0) {
+        page_num = pos->page_num;
+        if (lsm_read_page(cache, snap, page_num, &page_data) != 0) {
+            return -1;
+        }
+        if (pos->index < get_u32(page_data + DATA_COUNT)) {
+            *key_out = get_i32(page_data + DATA_ENTRIES + pos->index * 8);
+            *value_out = get_u32(page_data + DATA_ENTRIES + pos->index * 8 + 4);
+            cache_unpin(cache, page_num);
+            return 1;
+        }
+        pos->page_num = get_u32(page_data + DATA_NEXT);
+        pos->index = 0;
+        cache_unpin(cache, page_num);
+    }
+
+    return 0;
+}
+
+/*
+ * Create an empty LSM table
+ */
+struct btree *lsm_create(struct amidb_pager *pager, struct page_cache *cache,
+                         uint32_t *root_page_out) {
+    struct btree *tree;
+    uint32_t root_page;
+    uint8_t *page_data;
+    int rc;
+
+    if (!pager || !cache || !root_page_out) {
+        return NULL;
+    }
+
+    tree = (struct btree *)mem_alloc(sizeof(struct btree), AMIDB_MEM_CLEAR);
+    if (!tree) {
+        return NULL;
+    }
+
+    if (pager_allocate_page(pager, &root_page) != 0) {
+        mem_free(tree, sizeof(struct btree));
+        return NULL;
+    }
+
+    /* Empty memtable, no runs */
+    page_data = (uint8_t *)mem_alloc(AMIDB_PAGE_SIZE, AMIDB_MEM_CLEAR);
+    if (!page_data) {
+        mem_free(tree, sizeof(struct btree));
+        return NULL;
+    }
+    page_data[4] = PAGE_TYPE_LSM;
+
+    rc = pager_write_page(pager, root_page, page_data);
+    mem_free(page_data, AMIDB_PAGE_SIZE);
+
+    if (rc != 0) {
+        mem_free(tree, sizeof(struct btree));
+        return NULL;
+    }
+
+    /* A reused page may still be cached from its previous life */
+    cache_discard(cache, root_page);
+
+    pager_sync(pager);
+
+    tree->pager = pager;
+    tree->cache = cache;
+    tree->root_page = root_page;
+    tree->engine = BTREE_ENGINE_LSM;
+
+    *root_page_out = root_page;
+
+    return tree;
+}
+
+/*
+ * Buffer a key's new value (or tombstone) in the memtable
+ */
+static int lsm_put(struct btree *tree, int32_t key, uint32_t value) {
+    uint8_t *root;
+    uint8_t *entry;
+    uint32_t mem_count;
+    uint32_t index;
+
+    if (lsm_own_root(tree) != 0) {
+        return -1;
+    }
+    if (cache_get_page(tree->cache, tree->root_page, &root) != 0) {
+        return -1;
+    }
+
+    mem_count = get_u32(root + ROOT_MEM_COUNT);
+    index = lsm_lower_bound(root + ROOT_MEMTABLE, mem_count, key);
+    entry = root + ROOT_MEMTABLE + index * 8;
+
+    /* Already buffered: replace in place */
+    if (index < mem_count && get_i32(entry) == key) {
+        lsm_save_before_image(tree, tree->root_page, root);
+        put_u32(entry + 4, value);
+        lsm_mark_page_dirty(tree, tree->root_page);
+        cache_unpin(tree->cache, tree->root_page);
+        return 0;
+    }
+
+    /* Full: flush the memtable into a run (merging first if need be) */
+    if (mem_count == LSM_MEMTABLE_MAX) {
+        if (get_u32(root + ROOT_RUN_COUNT) == LSM_MAX_RUNS) {
+            cache_unpin(tree->cache, tree->root_page);
+            if (lsm_merge(tree) != 0 ||
+                cache_get_page(tree->cache, tree->root_page, &root) != 0) {
+                return -1;
+            }
+        }
+        if (lsm_flush(tree, root) != 0) {
+            cache_unpin(tree->cache, tree->root_page);
+            return -1;
+        }
+        mem_count = 0;
+        index = 0;
+        entry = root + ROOT_MEMTABLE;
+    }
+
+    lsm_save_before_image(tree, tree->root_page, root);
+    memmove(entry + 8, entry, (mem_count - index) * 8);
+    put_u32(entry, (uint32_t)key);
+    put_u32(entry + 4, value);
+    put_u32(root + ROOT_MEM_COUNT, mem_count + 1);
+    lsm_mark_page_dirty(tree, tree->root_page);
+    cache_unpin(tree->cache, tree->root_page);
+
+    return 0;
+}
+
+/*
+ * Insert or replace a key
+ */
+int lsm_insert(struct btree *tree, int32_t key, uint32_t value) {
+    if (!tree || tree->snapshot || value == LSM_TOMBSTONE) {
+        return -1;
+    }
+
+    return lsm_put(tree, key, value);
+}
+
+/*
+ * Look up a key: memtable first, then the runs newest first
+ */
+int lsm_search(struct btree *tree, int32_t key, uint32_t *value_out) {
+    uint8_t *root;
+    uint32_t runs[LSM_MAX_RUNS];
+    uint32_t run_count;
+    uint32_t mem_count;
+    uint32_t index;
+    uint32_t value;
+    uint32_t i;
+    int rc;
+
+    if (!tree || !value_out) {
+        return -1;
+    }
+
+    if (lsm_read_page(tree->cache, tree->snapshot, tree->root_page, &root) != 0) {
+        return -1;
+    }
+
+    mem_count = get_u32(root + ROOT_MEM_COUNT);
+    index = lsm_lower_bound(root + ROOT_MEMTABLE, mem_count, key);
+    if (index < mem_count && get_i32(root + ROOT_MEMTABLE + index * 8) == key) {
+        value = get_u32(root + ROOT_MEMTABLE + index * 8 + 4);
+        cache_unpin(tree->cache, tree->root_page);
+        if (value == LSM_TOMBSTONE) {
+            return -1;
+        }
+        *value_out = value;
+        return 0;
+    }
+
+    run_count = get_u32(root + ROOT_RUN_COUNT);
+    for (i = 0; i < run_count; i++) {
+        runs[i] = get_u32(root + ROOT_RUNS + i * 8);
+    }
+    cache_unpin(tree->cache, tree->root_page);
+
+    for (i = 0; i < run_count; i++) {
+        rc = lsm_run_lookup(tree, runs[i], key, &value);
+        if (rc < 0) {
+            return -1;
+        }
+        if (rc > 0) {
+            if (value == LSM_TOMBSTONE) {
+                return -1;
+            }
+            *value_out = value;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Delete a key: drop it from the memtable if no run can hold it,
+ * otherwise buffer a tombstone
+ */
+int lsm_delete(struct btree *tree, int32_t key) {
+    uint8_t *root;
+    uint8_t *entry;
+    uint32_t mem_count;
+    uint32_t index;
+    uint32_t value;
+
+    if (!tree || tree->snapshot) {
+        return -1;
+    }
+
+    if (lsm_search(tree, key, &value) != 0) {
+        return -1;  /* Not found */
+    }
+
+    if (lsm_own_root(tree) != 0) {
+        return -1;
+    }
+    if (cache_get_page(tree->cache, tree->root_page, &root) != 0) {
+        return -1;
+    }
+
+    if (get_u32(root + ROOT_RUN_COUNT) == 0) {
+        mem_count = get_u32(root + ROOT_MEM_COUNT);
+        index = lsm_lower_bound(root + ROOT_MEMTABLE, mem_count, key);
+        entry = root + ROOT_MEMTABLE + index * 8;
+
+        lsm_save_before_image(tree, tree->root_page, root);
+        memmove(entry, entry + 8, (mem_count - index - 1) * 8);
+        put_u32(root + ROOT_MEM_COUNT, mem_count - 1);
+        lsm_mark_page_dirty(tree, tree->root_page);
+        cache_unpin(tree->cache, tree->root_page);
+        return 0;
+    }
+    cache_unpin(tree->cache, tree->root_page);
+
+    return lsm_put(tree, key, LSM_TOMBSTONE);
+}
+
+/*
+ * Entry at a cursor source: 0 is the memtable, 1.. the runs
+ *
+ * Returns: 1 if there is an entry, 0 if the source is exhausted, -1 on error
+ */
+static int lsm_cursor_head(struct btree_cursor *cursor, uint32_t source,
+                           int32_t *key_out, uint32_t *value_out) {
+    uint8_t *root;
+    uint32_t index;
+    int found = 0;
+
+    if (source > 0) {
+        return lsm_data_head(cursor->cache, cursor->snapshot, &cursor->path[source],
+                             key_out, value_out);
+    }
+
+    if (lsm_read_page(cursor->cache, cursor->snapshot, cursor->current_page, &root) != 0) {
+        return -1;
+    }
+    index = cursor->path[0].index;
+    if (index < get_u32(root + ROOT_MEM_COUNT)) {
+        *key_out = get_i32(root + ROOT_MEMTABLE + index * 8);
+        *value_out = get_u32(root + ROOT_MEMTABLE + index * 8 + 4);
+        found = 1;
+    }
+    cache_unpin(cursor->cache, cursor->current_page);
+
+    return found;
+}
+
+/*
+ * Move a cursor to the smallest key left in any source
+ *
+ * Every source holding that key steps past it; the newest version wins
+ * and a tombstone hides the key altogether.
+ *
+ * Returns: 0 if the cursor is on an entry, 1 if there are no more,
+ *          -1 on error
+ */
+static int lsm_cursor_settle(struct btree_cursor *cursor) {
+    int32_t keys[LSM_MAX_RUNS + 1];
+    uint32_t values[LSM_MAX_RUNS + 1];
+    uint8_t live[LSM_MAX_RUNS + 1];
+    uint32_t source;
+    int best;
+    int rc;
+
+    while (1) {
+        best = -1;
+        for (source = 0; source < cursor->path_depth; source++) {
+            rc = lsm_cursor_head(cursor, source, &keys[source], &values[source]);
+            if (rc < 0) {
+                cursor->valid = 0;
+                return -1;
+            }
+            live[source] = (uint8_t)rc;
+            if (rc && (best < 0 || keys[source] < keys[best])) {
+                best = (int)source;
+            }
+        }
+
+        if (best < 0) {
+            cursor->valid = 0;
+            return 1;
+        }
+
+        for (source = 0; source < cursor->path_depth; source++) {
+            if (live[source] && keys[source] == keys[best]) {
+                cursor->path[source].index++;
+            }
+        }
+
+        if (values[best] != LSM_TOMBSTONE) {
+            cursor->key = keys[best];
+            cursor->value = values[best];
+            cursor->valid = 1;
+            return 0;
+        }
+    }
+}
+
+/*
+ * Position a cursor on the smallest live key
+ */
+int lsm_cursor_first(struct btree *tree, struct btree_cursor *cursor) {
+    uint8_t *root;
+    uint32_t run_count;
+    uint32_t i;
+
+    if (!tree || !cursor) {
+        return -1;
+    }
+
+    memset(cursor, 0, sizeof(*cursor));
+    cursor->pager = tree->pager;
+    cursor->cache = tree->cache;
+    cursor->snapshot = tree->snapshot;
+    cursor->engine = BTREE_ENGINE_LSM;
+    cursor->current_page = tree->root_page;
+
+    if (lsm_read_page(tree->cache, tree->snapshot, tree->root_page, &root) != 0) {
+        return -1;
+    }
+    run_count = get_u32(root + ROOT_RUN_COUNT);
+    cursor->path[0].page_num = tree->root_page;
+    for (i = 0; i < run_count; i++) {
+        cursor->path[1 + i].page_num = get_u32(root + ROOT_RUNS + i * 8);
+    }
+    cursor->path_depth = 1 + run_count;
+    cache_unpin(tree->cache, tree->root_page);
+
+    /* Each run starts at its first data page */
+    for (i = 1; i < cursor->path_depth; i++) {
+        if (lsm_run_first(tree->cache, tree->snapshot, cursor->path[i].page_num,
+                          &cursor->path[i].page_num) != 0) {
+            return -1;
+        }
+    }
+
+    return (lsm_cursor_settle(cursor) < 0) ? -1 : 0;
+}
+
+/*
+ * Move to the next live key
+ */
+int lsm_cursor_next(struct btree_cursor *cursor) {
+    if (!cursor || !cursor->valid) {
+        return -1;
+    }
+
+    return (lsm_cursor_settle(cursor) == 0) ? 0 : -1;
+}
+
+/*
+ * Put a new page image in the cache, dirty in the transaction
+ */
+static int lsm_write_page(struct btree *tree, uint32_t page_num, uint8_t *image) {
+    uint8_t *page_data;
+
+    if (cache_new_page(tree->cache, page_num, &page_data) != 0) {
+        return -1;
+    }
+
+    lsm_save_before_image(tree, page_num, page_data);
+    memcpy(page_data, image, AMIDB_PAGE_SIZE);
+    lsm_mark_page_dirty(tree, page_num);
+    cache_unpin(tree->cache, page_num);
+
+    return 0;
+}
+
+/*
+ * Start writing a run (entries must then come in key order)
+ */
+static int lsm_writer_start(struct lsm_run_writer *w, struct btree *tree) {
+    memset(w, 0, sizeof(*w));
+    w->tree = tree;
+
+    w->header = (uint8_t *)mem_alloc(AMIDB_PAGE_SIZE, AMIDB_MEM_CLEAR);
+    w->data = (uint8_t *)mem_alloc(AMIDB_PAGE_SIZE, AMIDB_MEM_CLEAR);
+    if (!w->header || !w->data ||
+        pager_allocate_page(tree->pager, &w->header_page) != 0) {
+        lsm_writer_abort(w);
+        return -1;
+    }
+    w->header[4] = PAGE_TYPE_LSM_RUN;
+
+    return 0;
+}
+
+/*
+ * Append an entry to the run being written
+ */
+static int lsm_writer_add(struct lsm_run_writer *w, int32_t key, uint32_t value) {
+    uint32_t page_num;
+    uint8_t *entry;
+
+    /* Chain a new data page when the current one is full */
+    if (w->data_page == 0 || w->data_count == LSM_DATA_ENTRIES) {
+        if (w->page_count == LSM_RUN_MAX_PAGES) {
+            return -1;
+        }
+        if (pager_allocate_page(w->tree->pager, &page_num) != 0) {
+            return -1;
+        }
+        if (w->data_page != 0) {
+            put_u32(w->data + DATA_NEXT, page_num);
+            if (lsm_write_page(w->tree, w->data_page, w->data) != 0) {
+                pager_free_page(w->tree->pager, page_num);
+                return -1;
+            }
+        }
+
+        memset(w->data, 0, AMIDB_PAGE_SIZE);
+        w->data[4] = PAGE_TYPE_LSM_RUN;
+        w->data_page = page_num;
+        w->data_count = 0;
+
+        put_u32(w->header + RUN_FENCES + w->page_count * 8, page_num);
+        put_u32(w->header + RUN_FENCES + w->page_count * 8 + 4, (uint32_t)key);
+        w->page_count++;
+    }
+
+    entry = w->data + DATA_ENTRIES + w->data_count * 8;
+    put_u32(entry, (uint32_t)key);
+    put_u32(entry + 4, value);
+    w->data_count++;
+    put_u32(w->data + DATA_COUNT, w->data_count);
+
+    lsm_bloom_add(w->header + RUN_BLOOM, key);
+    if (w->entries == 0) {
+        put_u32(w->header + RUN_MIN_KEY, (uint32_t)key);
+    }
+    put_u32(w->header + RUN_MAX_KEY, (uint32_t)key);
+    w->entries++;
+
+    return 0;
+}
+
+/*
+ * Write out the last data page and the header
+ * (a run left empty is dropped: header_page is then 0)
+ */
+static int lsm_writer_finish(struct lsm_run_writer *w) {
+    if (w->entries == 0) {
+        pager_free_page(w->tree->pager, w->header_page);
+        w->header_page = 0;
+    } else {
+        put_u32(w->header + RUN_ENTRIES, w->entries);
+        put_u32(w->header + RUN_PAGE_COUNT, w->page_count);
+
+        if (lsm_write_page(w->tree, w->data_page, w->data) != 0 ||
+            lsm_write_page(w->tree, w->header_page, w->header) != 0) {
+            lsm_writer_abort(w);
+            return -1;
+        }
+    }
+
+    mem_free(w->header, AMIDB_PAGE_SIZE);
+    mem_free(w->data, AMIDB_PAGE_SIZE);
+    w->header = NULL;
+    w->data = NULL;
+
+    return 0;
+}
+
+/*
+ * Give up on a run: free its pages and buffers
+ */
+static void lsm_writer_abort(struct lsm_run_writer *w) {
+    uint32_t i;
+
+    if (w->header) {
+        for (i = 0; i < w->page_count; i++) {
+            pager_free_page(w->tree->pager, get_u32(w->header + RUN_FENCES + i * 8));
+        }
+        mem_free(w->header, AMIDB_PAGE_SIZE);
+        w->header = NULL;
+    }
+    if (w->header_page != 0) {
+        pager_free_page(w->tree->pager, w->header_page);
+        w->header_page = 0;
+    }
+    if (w->data) {
+        mem_free(w->data, AMIDB_PAGE_SIZE);
+        w->data = NULL;
+    }
+}
+
+/*
+ * Flush the memtable into a new run (root pinned, owned, with a free
+ * run slot)
+ */
+static int lsm_flush(struct btree *tree, uint8_t *root) {
+    struct lsm_run_writer w;
+    uint32_t mem_count;
+    uint32_t run_count;
+    uint8_t *entry;
+    uint32_t i;
+
+    mem_count = get_u32(root + ROOT_MEM_COUNT);
+    run_count = get_u32(root + ROOT_RUN_COUNT);
+
+    if (lsm_writer_start(&w, tree) != 0) {
+        return -1;
+    }
+    for (i = 0; i < mem_count; i++) {
+        entry = root + ROOT_MEMTABLE + i * 8;
+
+        /* No run yet: a tombstone has nothing to hide */
+        if (run_count == 0 && get_u32(entry + 4) == LSM_TOMBSTONE) {
+            continue;
+        }
+        if (lsm_writer_add(&w, get_i32(entry), get_u32(entry + 4)) != 0) {
+            lsm_writer_abort(&w);
+            return -1;
+        }
+    }
+    if (lsm_writer_finish(&w) != 0) {
+        return -1;
+    }
+
+    lsm_save_before_image(tree, tree->root_page, root);
+    if (w.header_page != 0) {
+        memmove(root + ROOT_RUNS + 8, root + ROOT_RUNS, run_count * 8);
+        put_u32(root + ROOT_RUNS, w.header_page);
+        put_u32(root + ROOT_RUNS + 4, w.entries);
+        put_u32(root + ROOT_RUN_COUNT, run_count + 1);
+    }
+    put_u32(root + ROOT_MEM_COUNT, 0);
+    lsm_mark_page_dirty(tree, tree->root_page);
+
+    return 0;
+}
+
+/*
+ * Free a run's header and data pages
+ */
+static int lsm_free_run(struct btree *tree, uint32_t header_page) {
+    uint8_t *page_data;
+    uint32_t *pages;
+    uint32_t count;
+    uint32_t i;
+    int rc;
+
+    if (cache_get_page(tree->cache, header_page, &page_data) != 0) {
+        return -1;
+    }
+    count = get_u32(page_data + RUN_PAGE_COUNT);
+    pages = (uint32_t *)mem_alloc((count + 1) * sizeof(uint32_t), 0);
+    if (!pages) {
+        cache_unpin(tree->cache, header_page);
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        pages[i] = get_u32(page_data + RUN_FENCES + i * 8);
+    }
+    pages[count] = header_page;
+    cache_unpin(tree->cache, header_page);
+
+    rc = pager_free_pages(tree->pager, pages, count + 1);
+    mem_free(pages, (count + 1) * sizeof(uint32_t));
+
+    return rc;
+}
+
+/*
+ * Is a merge due?
+ */
+int lsm_merge_pending(struct btree *tree) {
+    uint8_t *root;
+    uint32_t run_count;
+
+    if (!tree || tree->engine != BTREE_ENGINE_LSM || tree->snapshot) {
+        return 0;
+    }
+
+    if (cache_get_page(tree->cache, tree->root_page, &root) != 0) {
+        return 0;
+    }
+    run_count = get_u32(root + ROOT_RUN_COUNT);
+    cache_unpin(tree->cache, tree->root_page);
+
+    return run_count >= LSM_MERGE_RUNS;
+}
+
+/*
+ * Merge the newest runs into one
+ */
+int lsm_merge(struct btree *tree) {
+    struct btree_path_entry pos[LSM_MAX_RUNS];
+    uint32_t runs[LSM_MAX_RUNS];
+    uint32_t counts[LSM_MAX_RUNS];
+    int32_t keys[LSM_MAX_RUNS];
+    uint32_t values[LSM_MAX_RUNS];
+    uint8_t live[LSM_MAX_RUNS];
+    struct lsm_run_writer w;
+    uint8_t *root;
+    uint32_t run_count;
+    uint32_t merged;
+    uint32_t total;
+    uint32_t kept;
+    uint32_t i;
+    int best;
+    int rc;
+
+    if (!tree || tree->engine != BTREE_ENGINE_LSM || tree->snapshot) {
+        return -1;
+    }
+
+    if (lsm_own_root(tree) != 0) {
+        return -1;
+    }
+    if (cache_get_page(tree->cache, tree->root_page, &root) != 0) {
+        return -1;
+    }
+    run_count = get_u32(root + ROOT_RUN_COUNT);
+    for (i = 0; i < run_count; i++) {
+        runs[i] = get_u32(root + ROOT_RUNS + i * 8);
+        counts[i] = get_u32(root + ROOT_RUNS + i * 8 + 4);
+    }
+    cache_unpin(tree->cache, tree->root_page);
+
+    if (run_count < 2) {
+        return 0;
+    }
+
+    /* The two newest, then each older run no larger than those so far */
+    merged = 2;
+    total = counts[0] + counts[1];
+    while (merged < run_count && counts[merged] <= total) {
+        total += counts[merged];
+        merged++;
+    }
+
+    for (i = 0; i < merged; i++) {
+        pos[i].index = 0;
+        if (lsm_run_first(tree->cache, NULL, runs[i], &pos[i].page_num) != 0) {
+            return -1;
+        }
+    }
+
+    if (lsm_writer_start(&w, tree) != 0) {
+        return -1;
+    }
+    while (1) {
+        best = -1;
+        for (i = 0; i < merged; i++) {
+            rc = lsm_data_head(tree->cache, NULL, &pos[i], &keys[i], &values[i]);
+            if (rc < 0) {
+                lsm_writer_abort(&w);
+                return -1;
+            }
+            live[i] = (uint8_t)rc;
+            if (rc && (best < 0 || keys[i] < keys[best])) {
+                best = (int)i;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+
+        /* The newest version wins; older ones are dropped */
+        for (i = 0; i < merged; i++) {
+            if (live[i] && keys[i] == keys[best]) {
+                pos[i].index++;
+            }
+        }
+
+        /* Merged into the oldest run, a tombstone has nothing to hide */
+        if (values[best] == LSM_TOMBSTONE && merged == run_count) {
+            continue;
+        }
+        if (lsm_writer_add(&w, keys[best], values[best]) != 0) {
+            lsm_writer_abort(&w);
+            return -1;
+        }
+    }
+    if (lsm_writer_finish(&w) != 0) {
+        return -1;
+    }
+
+    /* Swap the new run in for the merged ones */
+    if (cache_get_page(tree->cache, tree->root_page, &root) != 0) {
+        return -1;
+    }
+    lsm_save_before_image(tree, tree->root_page, root);
+    kept = 0;
+    if (w.header_page != 0) {
+        put_u32(root + ROOT_RUNS, w.header_page);
+        put_u32(root + ROOT_RUNS + 4, w.entries);
+        kept = 1;
+    }
+    memmove(root + ROOT_RUNS + kept * 8, root + ROOT_RUNS + merged * 8,
+            (run_count - merged) * 8);
+    memset(root + ROOT_RUNS + (kept + run_count - merged) * 8, 0, (merged - kept) * 8);
+    put_u32(root + ROOT_RUN_COUNT, kept + run_count - merged);
+    lsm_mark_page_dirty(tree, tree->root_page);
+    cache_unpin(tree->cache, tree->root_page);
+
+    for (i = 0; i < merged; i++) {
+        if (lsm_free_run(tree, runs[i]) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Get table statistics
+ */
+void lsm_get_stats(struct btree *tree, uint32_t *num_entries, uint32_t *height, uint32_t *num_nodes) {
+    uint8_t *page_data;
+    uint32_t runs[LSM_MAX_RUNS];
+    uint32_t run_count = 0;
+    uint32_t entries = 0;
+    uint32_t nodes = 1;
+    uint32_t i;
+
+    if (lsm_read_page(tree->cache, tree->snapshot, tree->root_page, &page_data) == 0) {
+        entries = get_u32(page_data + ROOT_MEM_COUNT);
+        run_count = get_u32(page_data + ROOT_RUN_COUNT);
+        for (i = 0; i < run_count; i++) {
+            runs[i] = get_u32(page_data + ROOT_RUNS + i * 8);
+        }
+        cache_unpin(tree->cache, tree->root_page);
+    }
+
+    for (i = 0; i < run_count; i++) {
+        if (lsm_read_page(tree->cache, tree->snapshot, runs[i], &page_data) != 0) {
+            continue;
+        }
+        entries += get_u32(page_data + RUN_ENTRIES);
+        nodes += 1 + get_u32(page_data + RUN_PAGE_COUNT);
+        cache_unpin(tree->cache, runs[i]);
+    }
+
+    if (num_entries) *num_entries = entries;
+    if (height) *height = (run_count > 0) ? 2 : 1;
+    if (num_nodes) *num_nodes = nodes;
+}
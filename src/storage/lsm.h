@@ -0,0 +1,131 @@
+/*
+ * lsm.h - Log-structured table engine for AmiDB
+ *
+ * An alternative to the B+Tree for insert-heavy tables, selected per
+ * table with CREATE TABLE ... ENGINE = LSM. It is opened, searched,
+ * changed and iterated through the btree_* API: btree_open recognises
+ * an LSM root page and every call is routed here, so the executor does
+ * not know which engine a table uses.
+ *
+ * Writes go to a sorted buffer (the memtable) held in the root page,
+ * which stays in the cache: an insert rewrites that one page instead
+ * of a random leaf. Being a page, the buffer is logged, shadowed and
+ * recovered like any other; nothing is lost with the process. When it
+ * is full it is flushed into an immutable sorted run: a header page
+ * (fence keys and a bloom filter) and a chain of data pages. Point
+ * lookups check the memtable, then each run newest first, skipping a
+ * run whose key range or bloom filter rules the key out.
+ *
+ * Runs pile up until lsm_merge combines the newest of them into one.
+ * Inserts never merge (unless all run slots are taken); the caller
+ * merges after its statement, when lsm_merge_pending says so.
+ *
+ * A delete writes a tombstone (value 0) that hides older versions of
+ * the key until a merge into the oldest run drops it. Values must not
+ * be 0.
+ */
+
+#ifndef AMIDB_LSM_H
+#define AMIDB_LSM_H
+
+#include <stdint.h>
+#include "storage/btree.h"
+#include "storage/pager.h"
+
+/* Root page: memtable and run list */
+#define LSM_MAX_RUNS        8       /* Run slots (1 + runs <= BTREE_MAX_HEIGHT) */
+#define LSM_MERGE_RUNS      4       /* A merge is due at this many runs */
+#define LSM_ROOT_HEADER     (8 + LSM_MAX_RUNS * 8)
+#define LSM_MEMTABLE_MAX    ((AMIDB_PAGE_SIZE - AMIDB_PAGE_HEADER_SIZE - LSM_ROOT_HEADER) / 8)
+
+/* Run pages */
+#define LSM_BLOOM_BYTES     2048    /* Bloom filter per run (16384 bits) */
+#define LSM_BLOOM_HASHES    3
+#define LSM_RUN_HEADER      16
+#define LSM_RUN_MAX_PAGES   ((AMIDB_PAGE_SIZE - AMIDB_PAGE_HEADER_SIZE - LSM_RUN_HEADER - LSM_BLOOM_BYTES) / 8)
+#define LSM_DATA_HEADER     8
+#define LSM_DATA_ENTRIES    ((AMIDB_PAGE_SIZE - AMIDB_PAGE_HEADER_SIZE - LSM_DATA_HEADER) / 8)
+
+/* Value marking a deleted key */
+#define LSM_TOMBSTONE       0
+
+/*
+ * Create an empty LSM table
+ *
+ * Returns: handle on success (engine BTREE_ENGINE_LSM), NULL on error
+ */
+struct btree *lsm_create(struct amidb_pager *pager, struct page_cache *cache,
+                         uint32_t *root_page_out);
+
+/*
+ * Insert or replace a key (btree_insert on an LSM table)
+ *
+ * In a shadow-paging transaction the root page is copied first, so
+ * root_page may change.
+ *
+ * Returns: 0 on success, -1 on error (value 0, read-only tree, I/O)
+ */
+int lsm_insert(struct btree *tree, int32_t key, uint32_t value);
+
+/*
+ * Look up a key (btree_search on an LSM table)
+ *
+ * Returns: 0 if found, -1 if not found
+ */
+int lsm_search(struct btree *tree, int32_t key, uint32_t *value_out);
+
+/*
+ * Delete a key (btree_delete on an LSM table)
+ *
+ * Returns: 0 on success, -1 if not found
+ */
+int lsm_delete(struct btree *tree, int32_t key);
+
+/*
+ * Position a cursor on the smallest live key (btree_cursor_first)
+ *
+ * The cursor merges the memtable and the runs as it goes; each source's
+ * position is kept in cursor->path. The tree must not change under it
+ * (a shadow-paging change copies the root first, so that one may).
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int lsm_cursor_first(struct btree *tree, struct btree_cursor *cursor);
+
+/*
+ * Move to the next live key (btree_cursor_next)
+ *
+ * Returns: 0 on success, -1 if no more entries
+ */
+int lsm_cursor_next(struct btree_cursor *cursor);
+
+/*
+ * Is a merge due (LSM_MERGE_RUNS or more runs)?
+ *
+ * Returns: 1 if so, 0 if not (or on error)
+ */
+int lsm_merge_pending(struct btree *tree);
+
+/*
+ * Merge the newest runs into one
+ *
+ * At least the two newest runs are merged, and each older run no
+ * larger than the runs merged so far is taken in too, so run sizes
+ * grow geometrically and an entry is rewritten a logarithmic number of
+ * times. The new run replaces the merged ones in the root page and
+ * their pages are freed.
+ *
+ * Returns: 0 on success (or nothing to merge), -1 on error
+ */
+int lsm_merge(struct btree *tree);
+
+/*
+ * Get table statistics (btree_get_stats)
+ *
+ * num_entries counts stored entries: older versions and tombstones
+ * not merged away yet are included. height is 1 plus 1 if there are
+ * runs; num_nodes counts the root and every run page.
+ */
+void lsm_get_stats(struct btree *tree, uint32_t *num_entries, uint32_t *height, uint32_t *num_nodes);
+
+#endif /* AMIDB_LSM_H */
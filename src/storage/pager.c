@@ -4,12 +4,15 @@
 
 #include "storage/pager.h"
 #include "txn/wal.h"       /* Phase 3C: WAL support */
+#include "txn/txn.h"
+#include "storage/backup.h"
 #include "os/file.h"
 #include "os/mem.h"
 #include "util/endian.h"
 #include "util/crc32.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 /* Helper: Set bit in bitmap */
 static void bitmap_set(uint8_t *bitmap, uint32_t bit) {
@@ -26,6 +29,30 @@ static int bitmap_test(const uint8_t *bitmap, uint32_t bit) {
     return (bitmap[bit / 8] & (1 << (bit % 8))) != 0;
 }
 
+/*
+ * Helper: Note a page about to be written
+ *
+ * Marks the page in the change bitmap for the next incremental backup.
+ * A newly set mark is persisted before the page itself changes, so a
+ * crash can at worst leave a page marked that was not rewritten.
+ */
+static int pager_track_write(struct amidb_pager *pager, uint32_t page_num) {
+    if (page_num != 0 && !bitmap_test(pager->changes, page_num)) {
+        bitmap_set(pager->changes, page_num);
+        if (pager_write_header(pager) != 0) {
+            return -1;
+        }
+    }
+
+    if (pager->backup) {
+        amidb_backup_note_write(pager->backup, page_num);
+    }
+
+    return 0;
+}
+
+static int pager_retire_page(struct amidb_pager *pager, uint32_t page_num);
+
 /* Helper: Initialize file header */
 static void init_file_header(struct amidb_file_header *hdr) {
     uint32_t i;
@@ -40,7 +67,9 @@ static void init_file_header(struct amidb_file_header *hdr) {
     hdr->wal_head = 0;       /* Phase 3C: WAL position */
     hdr->wal_tail = 0;       /* Phase 3C: WAL tail */
     hdr->catalog_root = 0;   /* Phase 4: Catalog B+Tree */
-    for (i = 0; i < 5; i++) {
+    hdr->checkpoint_lsn = 0;
+    hdr->backup_epoch = 0;
+    for (i = 0; i < 3; i++) {
         hdr->reserved[i] = 0;
     }
 }
@@ -58,8 +87,10 @@ static void serialize_header(const struct amidb_file_header *hdr, uint8_t *buf)
     put_u32(buf + 32, hdr->wal_head);     /* Phase 3C */
     put_u32(buf + 36, hdr->wal_tail);     /* Phase 3C */
     put_u32(buf + 40, hdr->catalog_root); /* Phase 4 */
-    /* Reserved fields (5 × 4 = 20 bytes) */
-    memset(buf + 44, 0, 20);
+    put_u32(buf + 44, hdr->checkpoint_lsn);
+    put_u32(buf + 48, hdr->backup_epoch);
+    /* Reserved fields (3 × 4 = 12 bytes) */
+    memset(buf + 52, 0, 12);
 }
 
 /* Helper: Deserialize file header from bytes */
@@ -76,11 +107,156 @@ static void deserialize_header(struct amidb_file_header *hdr, const uint8_t *buf
     hdr->wal_head = get_u32(buf + 32);     /* Phase 3C */
     hdr->wal_tail = get_u32(buf + 36);     /* Phase 3C */
     hdr->catalog_root = get_u32(buf + 40); /* Phase 4 */
-    for (i = 0; i < 5; i++) {
+    hdr->checkpoint_lsn = get_u32(buf + 44);
+    hdr->backup_epoch = get_u32(buf + 48);
+    for (i = 0; i < 3; i++) {
         hdr->reserved[i] = 0;
     }
 }
 
+/* Version 1 upgrade: WAL region pages holding the original image */
+/* of the page being rewritten (alternating by page number) */
+#define UPGRADE_SLOT(page_num) (WAL_REGION_START + ((page_num) % 2) * AMIDB_PAGE_SIZE)
+
+/* Helper: Is a page number inside the WAL region? */
+static int pager_in_wal_region(uint32_t page_num) {
+    return page_num >= WAL_REGION_START / AMIDB_PAGE_SIZE &&
+           page_num < (WAL_REGION_START + WAL_REGION_SIZE) / AMIDB_PAGE_SIZE;
+}
+
+/*
+ * Helper: Is this a valid version 1 image of page_num?
+ *
+ * Version 1 pages carry the same checksum over bytes 12 onwards. The
+ * last four bytes must be unused, since the contents move up by four
+ * to make room for the LSN.
+ */
+static int pager_v1_page_ok(const uint8_t *buf, uint32_t page_num) {
+    crc32_init();
+    return get_u32(buf + 0) == page_num &&
+           get_u32(buf + 8) == crc32_compute(buf + 12, AMIDB_PAGE_SIZE - 12) &&
+           get_u32(buf + AMIDB_PAGE_SIZE - 4) == 0;
+}
+
+/* Helper: Read or write a raw page image at a file offset */
+static int pager_raw_io(struct amidb_pager *pager, uint32_t offset, uint8_t *buf, int write) {
+    int32_t rc;
+
+    file_seek(pager->file_handle, offset, AMIDB_SEEK_SET);
+    if (write) {
+        rc = file_write(pager->file_handle, buf, AMIDB_PAGE_SIZE);
+    } else {
+        rc = file_read(pager->file_handle, buf, AMIDB_PAGE_SIZE);
+    }
+    return (rc == AMIDB_PAGE_SIZE) ? 0 : -1;
+}
+
+/*
+ * Helper: Rewrite a clean version 1 file in the current format
+ *
+ * Every allocated page gets the 16-byte header: contents move up four
+ * bytes and the LSN starts at 0. Nothing is written until every page
+ * has been checked, so a file that cannot be upgraded is left as is.
+ *
+ * The rewrite is in place and restartable. DB_FLAG_UPGRADING is set
+ * first; each page's original image is then saved (synced) in one of
+ * two WAL region slots before the page is rewritten. Pages go in
+ * ascending order, so on restart the newest valid slot names the page
+ * that may be half done: it is restored and the rewrite carries on
+ * from there. The version only changes once every page is done.
+ */
+static int pager_upgrade_v1(struct amidb_pager *pager, uint8_t *page_buf) {
+    uint32_t page_count = pager->header.page_count;
+    uint32_t start = 1;
+    int restore = 0;
+    uint32_t i;
+
+    if (!(pager->header.flags & DB_FLAG_UPGRADING)) {
+        for (i = 1; i < page_count; i++) {
+            if (!bitmap_test(pager->bitmap, i) || pager_in_wal_region(i)) {
+                continue;
+            }
+            if (pager_raw_io(pager, i * AMIDB_PAGE_SIZE, page_buf, 0) != 0 ||
+                !pager_v1_page_ok(page_buf, i)) {
+                return -1;
+            }
+            /* Every page is rewritten: all count as changed */
+            bitmap_set(pager->changes, i);
+        }
+
+        /* Clear both slots, then mark the upgrade as started */
+        memset(page_buf, 0, AMIDB_PAGE_SIZE);
+        if (pager_raw_io(pager, UPGRADE_SLOT(0), page_buf, 1) != 0 ||
+            pager_raw_io(pager, UPGRADE_SLOT(1), page_buf, 1) != 0) {
+            return -1;
+        }
+        pager->header.flags |= DB_FLAG_UPGRADING;
+        if (pager_write_header(pager) != 0) {
+            return -1;
+        }
+        file_sync(pager->file_handle);
+    } else {
+        /* Interrupted: put back the page that was being rewritten */
+        for (i = 0; i < 2; i++) {
+            if (pager_raw_io(pager, WAL_REGION_START + i * AMIDB_PAGE_SIZE, page_buf, 0) == 0 &&
+                get_u32(page_buf) < page_count &&
+                get_u32(page_buf) % 2 == i &&
+                get_u32(page_buf) >= start &&
+                pager_v1_page_ok(page_buf, get_u32(page_buf))) {
+                start = get_u32(page_buf);
+                restore = 1;
+            }
+        }
+        if (restore) {
+            if (pager_raw_io(pager, UPGRADE_SLOT(start), page_buf, 0) != 0 ||
+                pager_raw_io(pager, start * AMIDB_PAGE_SIZE, page_buf, 1) != 0) {
+                return -1;
+            }
+            file_sync(pager->file_handle);
+        }
+    }
+
+    for (i = start; i < page_count; i++) {
+        if (!bitmap_test(pager->bitmap, i) || pager_in_wal_region(i)) {
+            continue;
+        }
+        if (pager_raw_io(pager, i * AMIDB_PAGE_SIZE, page_buf, 0) != 0) {
+            return -1;
+        }
+
+        /* Save the original (this sync also covers the previous page) */
+        if (pager_raw_io(pager, UPGRADE_SLOT(i), page_buf, 1) != 0) {
+            return -1;
+        }
+        file_sync(pager->file_handle);
+
+        memmove(page_buf + AMIDB_PAGE_HEADER_SIZE, page_buf + 12,
+                AMIDB_PAGE_SIZE - AMIDB_PAGE_HEADER_SIZE);
+        pager_set_page_lsn(page_buf, 0);
+        pager_stamp_page(page_buf, i);
+        if (pager_write_stamped_page(pager, i, page_buf) != 0) {
+            return -1;
+        }
+    }
+    file_sync(pager->file_handle);
+
+    pager->header.version = AMIDB_VERSION;
+    pager->header.flags &= ~DB_FLAG_UPGRADING;
+    pager->header.checkpoint_lsn = 0;
+    if (pager_write_header(pager) != 0) {
+        return -1;
+    }
+    file_sync(pager->file_handle);
+
+    /* Done: the slots go back to being WAL space (only now, as a */
+    /* restart before the header above relies on them) */
+    memset(page_buf, 0, AMIDB_PAGE_SIZE);
+    pager_raw_io(pager, UPGRADE_SLOT(0), page_buf, 1);
+    pager_raw_io(pager, UPGRADE_SLOT(1), page_buf, 1);
+
+    return 0;
+}
+
 /* Open pager */
 int pager_open(const char *path, int read_only, struct amidb_pager **pager_out) {
     struct amidb_pager *pager;
@@ -204,8 +380,8 @@ int pager_open(const char *path, int read_only, struct amidb_pager **pager_out)
 
         /* Write header page */
         printf("[DEBUG] Writing header page...\n");
-        serialize_header(&pager->header, page_buf);
-        memcpy(page_buf + 64, pager->bitmap, pager->bitmap_size);
+        pager_format_header(&pager->header, pager->bitmap, pager->changes,
+                            pager->bitmap_size, page_buf);
 
         rc = file_write(file_handle, page_buf, AMIDB_PAGE_SIZE);
         printf("[DEBUG] file_write returned %d (expected %u)\n", rc, AMIDB_PAGE_SIZE);
@@ -234,8 +410,13 @@ int pager_open(const char *path, int read_only, struct amidb_pager **pager_out)
 
         deserialize_header(&pager->header, page_buf);
 
-        /* Verify magic number */
-        if (pager->header.magic != AMIDB_MAGIC) {
+        /* Verify magic number and format version. A version 1 file is */
+        /* upgraded below; it must be writable, and cleanly closed since */
+        /* its WAL records predate LSNs */
+        if (pager->header.magic != AMIDB_MAGIC ||
+            (pager->header.version != AMIDB_VERSION &&
+             (pager->header.version != AMIDB_VERSION_V1 || read_only ||
+              (pager->header.flags & DB_FLAG_DIRTY)))) {
             mem_free(page_buf, AMIDB_PAGE_SIZE);
             mem_free(pager->file_path, strlen(path) + 1);
             mem_free(pager, sizeof(struct amidb_pager));
@@ -253,8 +434,20 @@ int pager_open(const char *path, int read_only, struct amidb_pager **pager_out)
             file_close(file_handle);
             return -1;
         }
-        memcpy(pager->bitmap, page_buf + 64, pager->bitmap_size);
+        memcpy(pager->bitmap, page_buf + AMIDB_BITMAP_OFFSET, pager->bitmap_size);
+    }
+
+    /* Load the change bitmap (all clear in a new file) */
+    pager->changes = (uint8_t *)mem_alloc(pager->bitmap_size, 0);
+    if (!pager->changes) {
+        mem_free(page_buf, AMIDB_PAGE_SIZE);
+        mem_free(pager->bitmap, pager->bitmap_size);
+        mem_free(pager->file_path, strlen(path) + 1);
+        mem_free(pager, sizeof(struct amidb_pager));
+        file_close(file_handle);
+        return -1;
     }
+    memcpy(pager->changes, page_buf + AMIDB_CHANGES_OFFSET, pager->bitmap_size);
 
     /* Phase 3C: Initialize WAL and transaction pointers */
     pager->wal = NULL;
@@ -279,6 +472,25 @@ int pager_open(const char *path, int read_only, struct amidb_pager **pager_out)
             }
             file_sync(file_handle);
         }
+
+        /* Reserve the WAL region so data pages are never allocated inside it */
+        for (i = WAL_REGION_START / AMIDB_PAGE_SIZE;
+             i < (WAL_REGION_START + WAL_REGION_SIZE) / AMIDB_PAGE_SIZE; i++) {
+            bitmap_set(pager->bitmap, i);
+        }
+    }
+
+    /* Rewrite a version 1 file in the current format */
+    if (!is_new_file && pager->header.version == AMIDB_VERSION_V1) {
+        if (pager_upgrade_v1(pager, page_buf) != 0) {
+            mem_free(page_buf, AMIDB_PAGE_SIZE);
+            mem_free(pager->changes, pager->bitmap_size);
+            mem_free(pager->bitmap, pager->bitmap_size);
+            mem_free(pager->file_path, strlen(path) + 1);
+            mem_free(pager, sizeof(struct amidb_pager));
+            file_close(file_handle);
+            return -1;
+        }
     }
 
     /* Phase 3C: Check for dirty flag and perform recovery if needed */
@@ -297,6 +509,7 @@ int pager_open(const char *path, int read_only, struct amidb_pager **pager_out)
             if (rc_recovery != 0) {
                 /* Recovery failed */
                 mem_free(page_buf, AMIDB_PAGE_SIZE);
+                mem_free(pager->changes, pager->bitmap_size);
                 mem_free(pager->bitmap, pager->bitmap_size);
                 mem_free(pager->file_path, strlen(path) + 1);
                 mem_free(pager, sizeof(struct amidb_pager));
@@ -310,8 +523,8 @@ int pager_open(const char *path, int read_only, struct amidb_pager **pager_out)
             pager->header.wal_tail = 0;
 
             /* Write cleared header to disk */
-            serialize_header(&pager->header, page_buf);
-            memcpy(page_buf + 64, pager->bitmap, pager->bitmap_size);
+            pager_format_header(&pager->header, pager->bitmap, pager->changes,
+                                pager->bitmap_size, page_buf);
             file_seek(file_handle, 0, AMIDB_SEEK_SET);
             file_write(file_handle, page_buf, AMIDB_PAGE_SIZE);
             file_sync(file_handle);
@@ -323,8 +536,8 @@ int pager_open(const char *path, int read_only, struct amidb_pager **pager_out)
     if (!read_only && is_new_file) {
         pager->header.flags |= DB_FLAG_DIRTY;
         /* Write header with dirty flag set */
-        serialize_header(&pager->header, page_buf);
-        memcpy(page_buf + 64, pager->bitmap, pager->bitmap_size);
+        pager_format_header(&pager->header, pager->bitmap, pager->changes,
+                            pager->bitmap_size, page_buf);
         file_seek(file_handle, 0, AMIDB_SEEK_SET);
         file_write(file_handle, page_buf, AMIDB_PAGE_SIZE);
         file_sync(file_handle);
@@ -344,6 +557,11 @@ void pager_close(struct amidb_pager *pager) {
         return;
     }
 
+    /* A backup still running can no longer make progress */
+    if (pager->backup) {
+        amidb_backup_source_closed(pager->backup);
+    }
+
     /* Phase 3C: Clear dirty flag on clean shutdown */
     /* Only do this if there's no uncommitted WAL data (for crash simulation tests) */
     if (pager->file_handle && !pager->read_only && pager->header.wal_head == 0) {
@@ -360,6 +578,18 @@ void pager_close(struct amidb_pager *pager) {
         mem_free(pager->bitmap, pager->bitmap_size);
     }
 
+    if (pager->changes) {
+        mem_free(pager->changes, pager->bitmap_size);
+    }
+
+    if (pager->shadow_bitmap) {
+        mem_free(pager->shadow_bitmap, pager->bitmap_size);
+    }
+
+    if (pager->retired) {
+        mem_free(pager->retired, pager->retired_capacity * sizeof(uint32_t));
+    }
+
     if (pager->file_path) {
         path_len = strlen(pager->file_path) + 1;
         mem_free(pager->file_path, path_len);
@@ -381,8 +611,22 @@ int pager_allocate_page(struct amidb_pager *pager, uint32_t *page_num_out) {
     /* Find first free page in bitmap */
     for (i = 1; i < AMIDB_MAX_PAGES; i++) {
         if (!bitmap_test(pager->bitmap, i)) {
-            /* Found free page */
+            /* Found free page (changed: a backup must see it allocated) */
             bitmap_set(pager->bitmap, i);
+            bitmap_set(pager->changes, i);
+
+            /* A transaction that rolls back frees it again */
+            if (pager->txn && txn_note_allocation(pager->txn, i) != 0) {
+                bitmap_clear(pager->bitmap, i);
+                return -1;
+            }
+
+            /* Shadow paging: the page stays free on disk until commit, */
+            /* and is only written then (unless the file must grow) */
+            if (pager->shadow && i < pager->header.page_count) {
+                *page_num_out = i;
+                return 0;
+            }
 
             if (i >= pager->header.page_count) {
                 pager->header.page_count = i + 1;
@@ -394,15 +638,17 @@ int pager_allocate_page(struct amidb_pager *pager, uint32_t *page_num_out) {
                 return -1;
             }
 
-            serialize_header(&pager->header, page_buf);
-            memcpy(page_buf + 64, pager->bitmap, pager->bitmap_size);
+            if (!pager->shadow) {
+                pager_format_header(&pager->header, pager->bitmap, pager->changes,
+                                    pager->bitmap_size, page_buf);
 
-            file_seek(pager->file_handle, 0, AMIDB_SEEK_SET);
-            rc = file_write(pager->file_handle, page_buf, AMIDB_PAGE_SIZE);
+                file_seek(pager->file_handle, 0, AMIDB_SEEK_SET);
+                rc = file_write(pager->file_handle, page_buf, AMIDB_PAGE_SIZE);
 
-            if (rc != AMIDB_PAGE_SIZE) {
-                mem_free(page_buf, AMIDB_PAGE_SIZE);
-                return -1;
+                if (rc != AMIDB_PAGE_SIZE) {
+                    mem_free(page_buf, AMIDB_PAGE_SIZE);
+                    return -1;
+                }
             }
 
             /* Phase 3C: Initialize the new page on disk with valid header */
@@ -411,11 +657,14 @@ int pager_allocate_page(struct amidb_pager *pager, uint32_t *page_num_out) {
             page_buf[4] = PAGE_TYPE_FREE;       /* page_type */
             /* Compute checksum for empty page */
             crc32_init();
-            put_u32(page_buf + 8, crc32_compute(page_buf + 12, AMIDB_PAGE_SIZE - 12));
+            put_u32(page_buf + 8, crc32_compute(page_buf + 12, AMIDB_PAGE_SIZE - 12));  /* LSN 0 + data */
 
             /* Write initialized page to disk */
             file_seek(pager->file_handle, i * AMIDB_PAGE_SIZE, AMIDB_SEEK_SET);
             file_write(pager->file_handle, page_buf, AMIDB_PAGE_SIZE);
+            if (pager->backup) {
+                amidb_backup_note_write(pager->backup, i);
+            }
 
             mem_free(page_buf, AMIDB_PAGE_SIZE);
 
@@ -427,6 +676,52 @@ int pager_allocate_page(struct amidb_pager *pager, uint32_t *page_num_out) {
     return -1;  /* No free pages */
 }
 
+/* Mark a page allocated elsewhere (e.g. by a replication primary) */
+int pager_claim_page(struct amidb_pager *pager, uint32_t page_num) {
+    uint8_t *page_buf;
+    int32_t rc;
+
+    if (pager->read_only || page_num == 0 || page_num >= AMIDB_MAX_PAGES) {
+        return -1;
+    }
+
+    if (bitmap_test(pager->bitmap, page_num)) {
+        return 0;  /* Already allocated */
+    }
+
+    bitmap_set(pager->bitmap, page_num);
+    bitmap_set(pager->changes, page_num);
+
+    /* The file cannot have holes: extend it with free pages up to this one */
+    if (page_num >= pager->header.page_count) {
+        page_buf = (uint8_t *)mem_alloc(AMIDB_PAGE_SIZE, AMIDB_MEM_CLEAR);
+        if (!page_buf) {
+            return -1;
+        }
+
+        crc32_init();
+        while (pager->header.page_count <= page_num) {
+            memset(page_buf, 0, AMIDB_PAGE_SIZE);
+            put_u32(page_buf + 0, pager->header.page_count);
+            page_buf[4] = PAGE_TYPE_FREE;
+            put_u32(page_buf + 8, crc32_compute(page_buf + 12, AMIDB_PAGE_SIZE - 12));
+
+            file_seek(pager->file_handle, pager->header.page_count * AMIDB_PAGE_SIZE,
+                      AMIDB_SEEK_SET);
+            rc = file_write(pager->file_handle, page_buf, AMIDB_PAGE_SIZE);
+            if (rc != AMIDB_PAGE_SIZE) {
+                mem_free(page_buf, AMIDB_PAGE_SIZE);
+                return -1;
+            }
+            pager->header.page_count++;
+        }
+
+        mem_free(page_buf, AMIDB_PAGE_SIZE);
+    }
+
+    return 0;
+}
+
 /* Free a page */
 int pager_free_page(struct amidb_pager *pager, uint32_t page_num) {
     uint8_t *page_buf;
@@ -440,6 +735,21 @@ int pager_free_page(struct amidb_pager *pager, uint32_t page_num) {
         return -1;  /* Page not allocated */
     }
 
+    /* A transaction's rollback may still need it: freed at commit */
+    if (pager->txn) {
+        return (txn_defer_free(pager->txn, page_num) == 0) ? 0 : -1;
+    }
+
+    if (pager->shadow) {
+        /* A committed page is still part of the committed tree: */
+        /* it is released by pager_shadow_commit */
+        if (bitmap_test(pager->shadow_bitmap, page_num)) {
+            return pager_retire_page(pager, page_num);
+        }
+        bitmap_clear(pager->bitmap, page_num);
+        return 0;
+    }
+
     bitmap_clear(pager->bitmap, page_num);
 
     /* Update header on disk */
@@ -448,8 +758,8 @@ int pager_free_page(struct amidb_pager *pager, uint32_t page_num) {
         return -1;
     }
 
-    serialize_header(&pager->header, page_buf);
-    memcpy(page_buf + 64, pager->bitmap, pager->bitmap_size);
+    pager_format_header(&pager->header, pager->bitmap, pager->changes,
+                        pager->bitmap_size, page_buf);
 
     file_seek(pager->file_handle, 0, AMIDB_SEEK_SET);
     rc = file_write(pager->file_handle, page_buf, AMIDB_PAGE_SIZE);
@@ -486,7 +796,7 @@ int pager_read_page(struct amidb_pager *pager, uint32_t page_num, uint8_t *page_
         return -1;  /* Page number mismatch */
     }
 
-    /* Verify checksum (skip header bytes) */
+    /* Verify checksum (covers the LSN and data) */
     crc32_init();
     computed_checksum = crc32_compute(page_data + 12, AMIDB_PAGE_SIZE - 12);
 
@@ -514,13 +824,18 @@ int pager_write_page(struct amidb_pager *pager, uint32_t page_num, const uint8_t
         return -1;
     }
 
+    if (pager_track_write(pager, page_num) != 0) {
+        mem_free(write_buf, AMIDB_PAGE_SIZE);
+        return -1;
+    }
+
     memcpy(write_buf, page_data, AMIDB_PAGE_SIZE);
 
     /* Set page header */
     put_u32(write_buf + 0, page_num);
     /* page_type already set by caller in write_buf[4] */
 
-    /* Compute and store checksum (excluding header) */
+    /* Compute and store checksum (LSN and data) */
     crc32_init();
     checksum = crc32_compute(write_buf + 12, AMIDB_PAGE_SIZE - 12);
     put_u32(write_buf + 8, checksum);
@@ -534,14 +849,187 @@ int pager_write_page(struct amidb_pager *pager, uint32_t page_num, const uint8_t
     return (rc == AMIDB_PAGE_SIZE) ? 0 : -1;
 }
 
+/* Stamp page number and checksum into a page image */
+uint32_t pager_stamp_page(uint8_t *page_data, uint32_t page_num) {
+    uint32_t checksum;
+
+    put_u32(page_data + 0, page_num);
+
+    crc32_init();
+    checksum = crc32_compute(page_data + 12, AMIDB_PAGE_SIZE - 12);
+    put_u32(page_data + 8, checksum);
+
+    return checksum;
+}
+
+/* Write a page stamped by pager_stamp_page (no copy, no checksum pass) */
+int pager_write_stamped_page(struct amidb_pager *pager, uint32_t page_num, const uint8_t *page_data) {
+    uint32_t offset;
+    int rc;
+
+    if (pager->read_only || page_num >= AMIDB_MAX_PAGES) {
+        return -1;
+    }
+
+    if (pager_track_write(pager, page_num) != 0) {
+        return -1;
+    }
+
+    offset = page_num * AMIDB_PAGE_SIZE;
+    file_seek(pager->file_handle, offset, AMIDB_SEEK_SET);
+    rc = file_write(pager->file_handle, page_data, AMIDB_PAGE_SIZE);
+
+    return (rc == AMIDB_PAGE_SIZE) ? 0 : -1;
+}
+
+/* Order batched writes by page number */
+static int pager_write_cmp(const void *a, const void *b) {
+    const struct pager_write *wa = (const struct pager_write *)a;
+    const struct pager_write *wb = (const struct pager_write *)b;
+
+    if (wa->page_num < wb->page_num) return -1;
+    if (wa->page_num > wb->page_num) return 1;
+    return 0;
+}
+
+/* Write a batch of pages in page order, merging consecutive pages */
+int pager_write_batch(struct amidb_pager *pager, struct pager_write *writes, uint32_t count) {
+    uint8_t *run_buf;
+    uint32_t first;
+    uint32_t run;
+    uint32_t i;
+    int marked;
+    int failed;
+    int rc;
+
+    if (pager->read_only) {
+        return -1;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    qsort(writes, count, sizeof(struct pager_write), pager_write_cmp);
+
+    /* Mark every page changed with one header write, not one per page */
+    marked = 0;
+    for (i = 0; i < count; i++) {
+        if (writes[i].page_num != 0 && writes[i].page_num < AMIDB_MAX_PAGES &&
+            !bitmap_test(pager->changes, writes[i].page_num)) {
+            bitmap_set(pager->changes, writes[i].page_num);
+            marked = 1;
+        }
+    }
+    if (marked && pager_write_header(pager) != 0) {
+        for (i = 0; i < count; i++) {
+            writes[i].result = -1;
+        }
+        return -1;
+    }
+
+    /* Staging buffer for runs (without it, every page is its own write) */
+    run_buf = (uint8_t *)mem_alloc(PAGER_RUN_PAGES * AMIDB_PAGE_SIZE, 0);
+
+    failed = 0;
+    first = 0;
+    while (first < count) {
+        /* Extend the run while page numbers stay consecutive */
+        run = 1;
+        if (run_buf) {
+            while (first + run < count && run < PAGER_RUN_PAGES &&
+                   writes[first + run].page_num == writes[first].page_num + run) {
+                run++;
+            }
+        }
+
+        if (run == 1) {
+            if (writes[first].stamped) {
+                rc = pager_write_stamped_page(pager, writes[first].page_num, writes[first].data);
+            } else {
+                rc = pager_write_page(pager, writes[first].page_num, writes[first].data);
+            }
+        } else if (writes[first].page_num + run > AMIDB_MAX_PAGES) {
+            rc = -1;
+        } else {
+            for (i = 0; i < run; i++) {
+                uint8_t *slot = run_buf + i * AMIDB_PAGE_SIZE;
+
+                memcpy(slot, writes[first + i].data, AMIDB_PAGE_SIZE);
+                if (!writes[first + i].stamped) {
+                    pager_stamp_page(slot, writes[first + i].page_num);
+                }
+            }
+
+            rc = -1;
+            if (file_seek(pager->file_handle, writes[first].page_num * AMIDB_PAGE_SIZE,
+                          AMIDB_SEEK_SET) == 0 &&
+                file_write(pager->file_handle, run_buf,
+                           run * AMIDB_PAGE_SIZE) == (int32_t)(run * AMIDB_PAGE_SIZE)) {
+                rc = 0;
+            }
+            for (i = 0; i < run && pager->backup; i++) {
+                amidb_backup_note_write(pager->backup, writes[first + i].page_num);
+            }
+        }
+
+        for (i = 0; i < run; i++) {
+            writes[first + i].result = (rc == 0) ? 0 : -1;
+        }
+        if (rc != 0) {
+            failed = 1;
+        }
+
+        pager->batch_pages += run;
+        pager->batch_writes++;
+        first += run;
+    }
+
+    if (run_buf) {
+        mem_free(run_buf, PAGER_RUN_PAGES * AMIDB_PAGE_SIZE);
+    }
+
+    return failed ? -1 : 0;
+}
+
+/* Get a page's LSN */
+uint32_t pager_get_page_lsn(const uint8_t *page_data) {
+    return get_u32(page_data + 12);
+}
+
+/* Set a page's LSN */
+void pager_set_page_lsn(uint8_t *page_data, uint32_t lsn) {
+    put_u32(page_data + 12, lsn);
+}
+
 /* Sync to disk */
 int pager_sync(struct amidb_pager *pager) {
     if (pager->read_only) {
         return 0;
     }
+    pager->sync_count++;
     return file_sync(pager->file_handle);
 }
 
+/* Is the page marked as written since the last backup */
+int pager_page_changed(struct amidb_pager *pager, uint32_t page_num) {
+    if (page_num >= AMIDB_MAX_PAGES) {
+        return 0;
+    }
+    return bitmap_test(pager->changes, page_num);
+}
+
+/* Clear the change bitmap and start the next backup epoch */
+int pager_clear_changes(struct amidb_pager *pager) {
+    if (pager->read_only) {
+        return -1;
+    }
+
+    memset(pager->changes, 0, pager->bitmap_size);
+    pager->header.backup_epoch++;
+
+    return pager_write_header(pager);
+}
+
 /* Get page count */
 uint32_t pager_get_page_count(struct amidb_pager *pager) {
     return pager->header.page_count;
@@ -559,7 +1047,142 @@ uint32_t pager_get_catalog_root(struct amidb_pager *pager) {
  */
 void pager_set_catalog_root(struct amidb_pager *pager, uint32_t catalog_root) {
     pager->header.catalog_root = catalog_root;
-    pager_write_header(pager);  /* Persist to disk */
+    if (!pager->shadow) {
+        pager_write_header(pager);  /* Persist to disk (shadow: at commit) */
+    }
+}
+
+/* Helper: Remember a committed page freed by a shadow transaction */
+static int pager_retire_page(struct amidb_pager *pager, uint32_t page_num) {
+    uint32_t *list;
+    uint32_t capacity;
+    uint32_t i;
+
+    for (i = 0; i < pager->retired_count; i++) {
+        if (pager->retired[i] == page_num) {
+            return 0;
+        }
+    }
+
+    if (pager->retired_count >= pager->retired_capacity) {
+        capacity = pager->retired_capacity ? pager->retired_capacity * 2 : 64;
+        list = (uint32_t *)mem_realloc(pager->retired, pager->retired_capacity * sizeof(uint32_t),
+                                       capacity * sizeof(uint32_t), 0);
+        if (!list) {
+            return -1;
+        }
+        pager->retired = list;
+        pager->retired_capacity = capacity;
+    }
+
+    pager->retired[pager->retired_count++] = page_num;
+    return 0;
+}
+
+/* Start a shadow transaction: remember the committed bitmap and root */
+int pager_shadow_begin(struct amidb_pager *pager) {
+    if (pager->read_only || pager->shadow) {
+        return -1;
+    }
+
+    if (!pager->shadow_bitmap) {
+        pager->shadow_bitmap = (uint8_t *)mem_alloc(pager->bitmap_size, 0);
+        if (!pager->shadow_bitmap) {
+            return -1;
+        }
+    }
+
+    memcpy(pager->shadow_bitmap, pager->bitmap, pager->bitmap_size);
+    pager->shadow_catalog_root = pager->header.catalog_root;
+    pager->retired_count = 0;
+    pager->shadow = 1;
+
+    return 0;
+}
+
+/* Was the page allocated by the running shadow transaction */
+int pager_page_is_new(struct amidb_pager *pager, uint32_t page_num) {
+    if (!pager->shadow || page_num >= AMIDB_MAX_PAGES) {
+        return 0;
+    }
+    return bitmap_test(pager->bitmap, page_num) &&
+           !bitmap_test(pager->shadow_bitmap, page_num);
+}
+
+/* Is a page in use (in memory, as the current transaction sees it)? */
+int pager_page_is_allocated(struct amidb_pager *pager, uint32_t page_num) {
+    if (page_num >= AMIDB_MAX_PAGES) {
+        return 0;
+    }
+    return bitmap_test(pager->bitmap, page_num);
+}
+
+/* Commit a shadow transaction: the header write switches to the new state */
+int pager_shadow_commit(struct amidb_pager *pager, int keep_retired) {
+    uint32_t i;
+
+    if (!pager->shadow) {
+        return -1;
+    }
+
+    if (!keep_retired) {
+        for (i = 0; i < pager->retired_count; i++) {
+            bitmap_clear(pager->bitmap, pager->retired[i]);
+        }
+    }
+    pager->retired_count = 0;
+    pager->shadow = 0;
+
+    return pager_write_header(pager);
+}
+
+/* Abort a shadow transaction: forget its allocations and root changes */
+void pager_shadow_abort(struct amidb_pager *pager) {
+    if (!pager->shadow) {
+        return;
+    }
+
+    memcpy(pager->bitmap, pager->shadow_bitmap, pager->bitmap_size);
+    pager->header.catalog_root = pager->shadow_catalog_root;
+    pager->retired_count = 0;
+    pager->shadow = 0;
+}
+
+/* Free several pages with one header write */
+int pager_free_pages(struct amidb_pager *pager, const uint32_t *pages, uint32_t count) {
+    uint32_t i;
+
+    if (pager->read_only) {
+        return -1;
+    }
+
+    if (pager->shadow || pager->txn) {
+        for (i = 0; i < count; i++) {
+            if (pager_free_page(pager, pages[i]) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (pages[i] != 0 && pages[i] < AMIDB_MAX_PAGES) {
+            bitmap_clear(pager->bitmap, pages[i]);
+        }
+    }
+
+    return pager_write_header(pager);
+}
+
+/* Serialize a header and bitmap into a page 0 image */
+void pager_format_header(const struct amidb_file_header *hdr, const uint8_t *bitmap,
+                         const uint8_t *changes, uint32_t bitmap_size, uint8_t *page_buf) {
+    memset(page_buf, 0, AMIDB_PAGE_SIZE);
+    serialize_header(hdr, page_buf);
+    memcpy(page_buf + AMIDB_BITMAP_OFFSET, bitmap, bitmap_size);
+    if (changes) {
+        memcpy(page_buf + AMIDB_CHANGES_OFFSET, changes, bitmap_size);
+    }
 }
 
 /* Write file header (Phase 3C: for persisting WAL state) */
@@ -577,9 +1200,17 @@ int pager_write_header(struct amidb_pager *pager) {
         return -1;
     }
 
-    /* Serialize header and bitmap */
-    serialize_header(&pager->header, page_buf);
-    memcpy(page_buf + 64, pager->bitmap, pager->bitmap_size);
+    /* Serialize header and bitmap (as committed during a shadow transaction) */
+    if (pager->shadow) {
+        struct amidb_file_header committed = pager->header;
+
+        committed.catalog_root = pager->shadow_catalog_root;
+        pager_format_header(&committed, pager->shadow_bitmap, pager->changes,
+                            pager->bitmap_size, page_buf);
+    } else {
+        pager_format_header(&pager->header, pager->bitmap, pager->changes,
+                            pager->bitmap_size, page_buf);
+    }
 
     /* Write to disk */
     file_seek(pager->file_handle, 0, AMIDB_SEEK_SET);
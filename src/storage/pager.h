@@ -16,8 +16,9 @@
 /* File format magic number: "AmiD" in ASCII */
 #define AMIDB_MAGIC 0x416D6944
 
-/* File format version */
-#define AMIDB_VERSION 1
+/* File format version (2: page header carries an LSN) */
+#define AMIDB_VERSION 2
+#define AMIDB_VERSION_V1 1     /* 12-byte page header; upgraded on open */
 
 /* Maximum number of pages (limited by bitmap size) */
 #define AMIDB_MAX_PAGES 4096   /* 16 MB max file size (512 byte bitmap - Amiga-friendly) */
@@ -29,9 +30,12 @@
 #define PAGE_TYPE_OVERFLOW  3
 #define PAGE_TYPE_FREELIST  4
 #define PAGE_TYPE_WAL       5
+#define PAGE_TYPE_LSM       6   /* LSM table root (memtable and runs) */
+#define PAGE_TYPE_LSM_RUN   7   /* LSM run header or data page */
 
 /* Database flags */
 #define DB_FLAG_DIRTY       0x0001  /* Unclean shutdown, needs recovery */
+#define DB_FLAG_UPGRADING   0x0002  /* Version 1 pages being rewritten */
 
 /* File header structure (stored in page 0) */
 struct amidb_file_header {
@@ -46,21 +50,33 @@ struct amidb_file_header {
     uint32_t wal_head;           /* Current WAL write position */
     uint32_t wal_tail;           /* Oldest unprocessed WAL entry */
     uint32_t catalog_root;       /* Root page of catalog B+Tree (Phase 4) */
-    uint32_t reserved[5];        /* Reserved for future use */
-    /* Followed by page allocation bitmap */
+    uint32_t checkpoint_lsn;     /* WAL records up to this LSN are in the file */
+    uint32_t backup_epoch;       /* Backups completed (changes are since the last) */
+    uint32_t reserved[3];        /* Reserved for future use */
+    /* Followed by page allocation bitmap and page change bitmap */
 };
 
+/* Page 0 layout: header, allocation bitmap, then one bit per page */
+/* written since the last backup (what an incremental backup copies) */
+#define AMIDB_BITMAP_OFFSET  64
+#define AMIDB_CHANGES_OFFSET (AMIDB_BITMAP_OFFSET + AMIDB_MAX_PAGES / 8)
+
+/* Page header size; page contents start right after it */
+#define AMIDB_PAGE_HEADER_SIZE 16
+
 /* Page header structure (at start of each page) */
 struct amidb_page_header {
     uint32_t page_num;           /* Page number (for verification) */
     uint8_t  page_type;          /* Page type (see PAGE_TYPE_*) */
     uint8_t  reserved[3];        /* Alignment padding */
-    uint32_t checksum;           /* CRC32 of page data (excluding this header) */
+    uint32_t checksum;           /* CRC32 of the rest of the page (LSN and data) */
+    uint32_t lsn;                /* LSN of the WAL record that last wrote the page */
 };
 
 /* Forward declarations for WAL and transaction support */
 struct wal_context;
 struct txn_context;
+struct amidb_backup;
 
 /* Pager handle */
 struct amidb_pager {
@@ -69,14 +85,45 @@ struct amidb_pager {
     struct amidb_file_header header;
     uint8_t *bitmap;             /* Page allocation bitmap */
     uint32_t bitmap_size;        /* Size of bitmap in bytes */
+    uint8_t *changes;            /* Pages written since the last backup (same size) */
     int read_only;               /* Read-only mode flag */
 
     /* Phase 3C: WAL and transaction support */
     struct wal_context *wal;     /* Write-ahead log (NULL if disabled) */
-    struct txn_context *txn;     /* Active transaction (NULL if none) */
+    struct txn_context *txn;     /* Active WAL transaction (NULL if none): */
+                                 /* told about pages allocated and freed */
+
+    /* Online backup in progress (NULL if none); told about page writes */
+    struct amidb_backup *backup;
+
+    /* Write statistics */
+    uint32_t batch_pages;        /* Pages written by pager_write_batch */
+    uint32_t batch_writes;       /* file_write calls they took */
+    uint32_t sync_count;         /* pager_sync calls */
+
+    /* Shadow paging transaction in progress (see pager_shadow_begin) */
+    uint8_t shadow;
+    uint8_t *shadow_bitmap;      /* Allocation bitmap as committed */
+    uint32_t shadow_catalog_root; /* Catalog root as committed */
+    uint32_t *retired;           /* Committed pages freed since */
+    uint32_t retired_count;
+    uint32_t retired_capacity;
+};
+
+/* Largest run of consecutive pages written with one call (32KB) */
+#define PAGER_RUN_PAGES 8
+
+/* One page of a batched write */
+struct pager_write {
+    uint32_t page_num;
+    const uint8_t *data;         /* Page image */
+    uint8_t stamped;             /* Already stamped by pager_stamp_page */
+    int8_t result;               /* Set by pager_write_batch: 0 or -1 */
 };
 
 /* Open/close pager */
+/* (a clean version 1 file is rewritten to the current format on its */
+/* first writable open; an interrupted rewrite resumes on the next) */
 int pager_open(const char *path, int read_only, struct amidb_pager **pager_out);
 void pager_close(struct amidb_pager *pager);
 
@@ -84,10 +131,40 @@ void pager_close(struct amidb_pager *pager);
 int pager_allocate_page(struct amidb_pager *pager, uint32_t *page_num_out);
 int pager_free_page(struct amidb_pager *pager, uint32_t page_num);
 
+/* Mark a page allocated that another pager allocated (a follower applying */
+/* its primary's pages), extending the file up to it. The header is not */
+/* written (see pager_write_header). Returns -1 on error */
+int pager_claim_page(struct amidb_pager *pager, uint32_t page_num);
+
 /* Page I/O */
 int pager_read_page(struct amidb_pager *pager, uint32_t page_num, uint8_t *page_data);
 int pager_write_page(struct amidb_pager *pager, uint32_t page_num, const uint8_t *page_data);
 
+/* In-place page I/O: stamp the header (page number and checksum, */
+/* returned) once, then write the image as is, without a copy */
+uint32_t pager_stamp_page(uint8_t *page_data, uint32_t page_num);
+int pager_write_stamped_page(struct amidb_pager *pager, uint32_t page_num, const uint8_t *page_data);
+
+/* Write many pages: sorted by page number (the array is reordered) and */
+/* consecutive pages merged into single writes. Returns -1 if any failed */
+int pager_write_batch(struct amidb_pager *pager, struct pager_write *writes, uint32_t count);
+
+/* Serialize a header and allocation bitmap into a page 0 image */
+/* (changes may be NULL: no pages changed since the last backup) */
+void pager_format_header(const struct amidb_file_header *hdr, const uint8_t *bitmap,
+                         const uint8_t *changes, uint32_t bitmap_size, uint8_t *page_buf);
+
+/* Change tracking: is the page marked as written since the last backup */
+int pager_page_changed(struct amidb_pager *pager, uint32_t page_num);
+
+/* A backup now holds every page: clear the change bitmap and start */
+/* the next backup epoch (persisted in the header) */
+int pager_clear_changes(struct amidb_pager *pager);
+
+/* Page LSN accessors (operate on an in-memory page image) */
+uint32_t pager_get_page_lsn(const uint8_t *page_data);
+void pager_set_page_lsn(uint8_t *page_data, uint32_t lsn);
+
 /* Sync to disk */
 int pager_sync(struct amidb_pager *pager);
 
@@ -101,4 +178,21 @@ int pager_write_header(struct amidb_pager *pager);
 uint32_t pager_get_catalog_root(struct amidb_pager *pager);
 void pager_set_catalog_root(struct amidb_pager *pager, uint32_t catalog_root);
 
+/* Free several pages with a single header write */
+int pager_free_pages(struct amidb_pager *pager, const uint32_t *pages, uint32_t count);
+
+/* Shadow paging: during a shadow transaction the header on disk keeps */
+/* the committed allocation bitmap and catalog root. Allocation, frees */
+/* and the catalog root only change in memory; committed pages freed */
+/* are retired (kept allocated) so the committed tree stays intact. */
+/* pager_shadow_commit writes the header: that write is the commit */
+/* point. It releases the retired pages unless keep_retired is set */
+/* (open snapshots still read them; free them later with */
+/* pager_free_pages). pager_shadow_abort restores the committed state. */
+int pager_shadow_begin(struct amidb_pager *pager);
+int pager_page_is_new(struct amidb_pager *pager, uint32_t page_num);
+int pager_page_is_allocated(struct amidb_pager *pager, uint32_t page_num);
+int pager_shadow_commit(struct amidb_pager *pager, int keep_retired);
+void pager_shadow_abort(struct amidb_pager *pager);
+
 #endif /* AMIDB_PAGER_H */
@@ -0,0 +1,439 @@
+/*
+ * cdc.c - Change data capture implementation
+ */
+
+#include "txn/cdc.h"
+#include "txn/wal.h"
+#include "storage/pager.h"
+#include "os/file.h"
+#include "os/mem.h"
+#include "util/endian.h"
+#include "api/error.h"
+#include <string.h>
+
+/* WAL record magic ("WALR") */
+#define CDC_RECORD_MAGIC 0x57414C52
+
+/* Record being copied (static: too large for the 4KB 68000 stack) */
+static uint8_t g_cdc_record[WAL_MAX_RECORD_SIZE];
+
+/*
+ * Build the change log path for a database (freed with mem_free)
+ */
+static char *cdc_log_path(const char *db_path, uint32_t *size_out)
+{
+    char *path;
+
+    *size_out = strlen(db_path) + sizeof(CDC_LOG_SUFFIX);
+    path = (char *)mem_alloc(*size_out, 0);
+    if (path) {
+        strcpy(path, db_path);
+        strcat(path, CDC_LOG_SUFFIX);
+    }
+
+    return path;
+}
+
+/*
+ * Read a record header from the change log
+ *
+ * Returns: AMIDB_OK, or AMIDB_DONE if no whole record starts at offset
+ */
+static int cdc_read_header(void *handle, uint32_t offset, uint32_t log_size,
+                           struct wal_record_header *hdr)
+{
+    if (offset + sizeof(*hdr) > log_size ||
+        file_seek(handle, offset, AMIDB_SEEK_SET) != 0 ||
+        file_read(handle, hdr, sizeof(*hdr)) != sizeof(*hdr)) {
+        return AMIDB_DONE;
+    }
+
+    if (hdr->magic != CDC_RECORD_MAGIC ||
+        hdr->record_size < sizeof(*hdr) ||
+        hdr->record_size > WAL_MAX_RECORD_SIZE ||
+        offset + hdr->record_size > log_size) {
+        return AMIDB_DONE;
+    }
+
+    return AMIDB_OK;
+}
+
+/*
+ * Find the end of the transaction starting (or continuing) at offset
+ *
+ * Only headers are read. Returns AMIDB_OK with the offset after its
+ * COMMIT record and that record's LSN, or AMIDB_DONE if the log ends
+ * (or is torn) first.
+ */
+static int cdc_find_commit(void *handle, uint32_t offset, uint32_t log_size,
+                           uint32_t *end_out, uint32_t *lsn_out)
+{
+    struct wal_record_header hdr;
+
+    for (;;) {
+        if (cdc_read_header(handle, offset, log_size, &hdr) != AMIDB_OK) {
+            return AMIDB_DONE;
+        }
+        offset += hdr.record_size;
+
+        if (hdr.record_type == WAL_COMMIT) {
+            *end_out = offset;
+            *lsn_out = hdr.lsn;
+            return AMIDB_OK;
+        }
+        if (hdr.record_type != WAL_ROW) {
+            return AMIDB_DONE;
+        }
+    }
+}
+
+/*
+ * Attach the change log
+ */
+int cdc_open_log(struct wal_context *wal, int create)
+{
+    char *path;
+    uint32_t path_size;
+    void *handle;
+    int32_t log_size;
+    uint32_t end;
+    uint32_t txn_end;
+    uint32_t lsn;
+
+    if (wal->cdc_handle) {
+        return AMIDB_OK;
+    }
+
+    path = cdc_log_path(wal->pager->file_path, &path_size);
+    if (!path) {
+        return AMIDB_NOMEM;
+    }
+
+    handle = NULL;
+    if (create) {
+        handle = file_open(path, AMIDB_O_RDWR | AMIDB_O_CREATE);
+    } else if (file_exists(path)) {
+        handle = file_open(path, AMIDB_O_RDWR);
+    } else {
+        mem_free(path, path_size);
+        return AMIDB_OK;             /* Capture not enabled */
+    }
+    mem_free(path, path_size);
+    if (!handle) {
+        return AMIDB_IOERR;
+    }
+
+    log_size = file_size(handle);
+    if (log_size < 0) {
+        file_close(handle);
+        return AMIDB_IOERR;
+    }
+
+    /* Keep whole transactions only */
+    end = 0;
+    lsn = 0;
+    while (cdc_find_commit(handle, end, (uint32_t)log_size, &txn_end, &lsn) == AMIDB_OK) {
+        end = txn_end;
+        wal->cdc_lsn = lsn;
+    }
+    if ((uint32_t)log_size > end && file_truncate(handle, end) != 0) {
+        file_close(handle);
+        return AMIDB_IOERR;
+    }
+
+    wal->cdc_handle = handle;
+    wal->cdc_end = end;
+
+    return AMIDB_OK;
+}
+
+/*
+ * Detach the change log
+ */
+void cdc_close_log(struct wal_context *wal)
+{
+    if (wal->cdc_handle) {
+        file_close(wal->cdc_handle);
+        wal->cdc_handle = NULL;
+    }
+}
+
+/*
+ * Enable change capture
+ */
+int cdc_enable(struct wal_context *wal)
+{
+    if (!wal || wal->pager->read_only) {
+        return AMIDB_ERROR;
+    }
+
+    return cdc_open_log(wal, 1);
+}
+
+/*
+ * Disable change capture and delete the change log
+ */
+void cdc_disable(struct wal_context *wal)
+{
+    char *path;
+    uint32_t path_size;
+
+    if (!wal || !wal->cdc_handle) {
+        return;
+    }
+
+    cdc_close_log(wal);
+
+    path = cdc_log_path(wal->pager->file_path, &path_size);
+    if (path) {
+        file_delete(path);
+        mem_free(path, path_size);
+    }
+}
+
+/*
+ * Append the record in g_cdc_record to the change log at *pos
+ */
+static int cdc_append(struct wal_context *wal, uint32_t *pos)
+{
+    struct wal_record_header hdr;
+
+    memcpy(&hdr, g_cdc_record, sizeof(hdr));
+
+    if (file_seek(wal->cdc_handle, *pos, AMIDB_SEEK_SET) != 0 ||
+        file_write(wal->cdc_handle, g_cdc_record,
+                   hdr.record_size) != (int32_t)hdr.record_size) {
+        return AMIDB_IOERR;
+    }
+
+    *pos += hdr.record_size;
+    return AMIDB_OK;
+}
+
+/*
+ * Copy a committed transaction's row records to the change log
+ */
+int cdc_publish(struct wal_context *wal, const uint32_t *offsets, uint32_t count,
+                uint32_t commit_offset)
+{
+    struct wal_record_header hdr;
+    uint32_t commit_lsn;
+    uint32_t pos;
+    uint32_t i;
+    int rc;
+
+    if (!wal || !wal->cdc_handle || count == 0) {
+        return AMIDB_OK;
+    }
+
+    /* Already copied (recovery after the copy was made) */
+    rc = wal_read_record(wal, commit_offset, g_cdc_record, sizeof(g_cdc_record));
+    if (rc != AMIDB_OK) {
+        return rc;
+    }
+    memcpy(&hdr, g_cdc_record, sizeof(hdr));
+    if (hdr.record_type != WAL_COMMIT) {
+        return AMIDB_CORRUPT;
+    }
+    if (hdr.lsn <= wal->cdc_lsn) {
+        return AMIDB_OK;
+    }
+    commit_lsn = hdr.lsn;
+
+    pos = wal->cdc_end;
+    for (i = 0; i < count; i++) {
+        rc = wal_read_record(wal, offsets[i], g_cdc_record, sizeof(g_cdc_record));
+        if (rc == AMIDB_OK) {
+            memcpy(&hdr, g_cdc_record, sizeof(hdr));
+            rc = (hdr.record_type == WAL_ROW) ? cdc_append(wal, &pos) : AMIDB_CORRUPT;
+        }
+        if (rc != AMIDB_OK) {
+            break;
+        }
+    }
+
+    /* The COMMIT record makes the transaction visible to readers */
+    if (rc == AMIDB_OK) {
+        rc = wal_read_record(wal, commit_offset, g_cdc_record, sizeof(g_cdc_record));
+    }
+    if (rc == AMIDB_OK) {
+        rc = cdc_append(wal, &pos);
+    }
+    if (rc == AMIDB_OK && wal->sync_mode != WAL_SYNC_OFF &&
+        file_sync(wal->cdc_handle) != 0) {
+        rc = AMIDB_IOERR;
+    }
+
+    if (rc != AMIDB_OK) {
+        /* Drop the partial copy; recovery can still make it */
+        file_truncate(wal->cdc_handle, wal->cdc_end);
+        return rc;
+    }
+
+    wal->cdc_end = pos;
+    wal->cdc_lsn = commit_lsn;
+
+    return AMIDB_OK;
+}
+
+/*
+ * Encode the fixed part of a WAL_ROW payload
+ */
+uint32_t cdc_encode_row_header(uint8_t *buf, uint8_t op, const char *table,
+                               int32_t key, uint32_t row_size)
+{
+    uint32_t name_len;
+
+    name_len = table ? strlen(table) : 0;
+    if (name_len > CDC_MAX_TABLE_NAME) {
+        name_len = CDC_MAX_TABLE_NAME;
+    }
+
+    buf[0] = op;
+    buf[1] = (uint8_t)name_len;
+    buf[2] = 0;
+    buf[3] = 0;
+    put_u32(buf + 4, (uint32_t)key);
+    put_u32(buf + 8, row_size);
+    memcpy(buf + CDC_ROW_HEADER_SIZE, table, name_len);
+
+    return CDC_ROW_HEADER_SIZE + name_len;
+}
+
+/*
+ * Open a reader on a database's change log
+ */
+int cdc_reader_open(const char *db_path, uint32_t position, struct cdc_reader **reader_out)
+{
+    struct cdc_reader *reader;
+    char *path;
+    uint32_t path_size;
+    void *handle;
+
+    if (!db_path || !reader_out) {
+        return AMIDB_ERROR;
+    }
+
+    path = cdc_log_path(db_path, &path_size);
+    if (!path) {
+        return AMIDB_NOMEM;
+    }
+    handle = NULL;
+    if (file_exists(path)) {
+        handle = file_open(path, AMIDB_O_RDONLY);
+    }
+    mem_free(path, path_size);
+    if (!handle) {
+        return AMIDB_NOTFOUND;
+    }
+
+    reader = (struct cdc_reader *)mem_alloc(sizeof(struct cdc_reader), AMIDB_MEM_CLEAR);
+    if (!reader) {
+        file_close(handle);
+        return AMIDB_NOMEM;
+    }
+    reader->record = (uint8_t *)mem_alloc(WAL_MAX_RECORD_SIZE, 0);
+    if (!reader->record) {
+        mem_free(reader, sizeof(struct cdc_reader));
+        file_close(handle);
+        return AMIDB_NOMEM;
+    }
+
+    reader->handle = handle;
+    reader->position = position;
+
+    *reader_out = reader;
+    return AMIDB_OK;
+}
+
+/*
+ * Get the next committed row change
+ */
+int cdc_next(struct cdc_reader *reader, struct cdc_event *event)
+{
+    struct wal_record_header hdr;
+    const uint8_t *payload;
+    int32_t log_size;
+    uint32_t name_len;
+    uint32_t lsn;
+
+    if (!reader || !event) {
+        return AMIDB_ERROR;
+    }
+
+    for (;;) {
+        log_size = file_size(reader->handle);
+        if (log_size < 0) {
+            return AMIDB_IOERR;
+        }
+
+        /* Only start on a transaction once its COMMIT is in the log */
+        if (reader->commit_end == 0 &&
+            cdc_find_commit(reader->handle, reader->position, (uint32_t)log_size,
+                            &reader->commit_end, &lsn) != AMIDB_OK) {
+            return AMIDB_DONE;
+        }
+
+        if (cdc_read_header(reader->handle, reader->position, (uint32_t)log_size,
+                            &hdr) != AMIDB_OK ||
+            file_seek(reader->handle, reader->position, AMIDB_SEEK_SET) != 0 ||
+            file_read(reader->handle, reader->record,
+                      hdr.record_size) != (int32_t)hdr.record_size ||
+            !wal_verify_checksum(reader->record, hdr.record_size) ||
+            hdr.lsn <= reader->last_lsn) {
+            return AMIDB_CORRUPT;
+        }
+
+        reader->position += hdr.record_size;
+        reader->last_lsn = hdr.lsn;
+        if (reader->position >= reader->commit_end) {
+            reader->commit_end = 0;
+        }
+
+        if (hdr.record_type == WAL_ROW) {
+            break;
+        }
+    }
+
+    /* Decode the row change */
+    payload = reader->record + sizeof(hdr);
+    name_len = payload[1];
+    if (hdr.record_size < sizeof(hdr) + CDC_ROW_HEADER_SIZE + name_len ||
+        name_len > CDC_MAX_TABLE_NAME ||
+        sizeof(hdr) + CDC_ROW_HEADER_SIZE + name_len + get_u32(payload + 8) != hdr.record_size) {
+        return AMIDB_CORRUPT;
+    }
+
+    event->op = payload[0];
+    memcpy(event->table, payload + CDC_ROW_HEADER_SIZE, name_len);
+    event->table[name_len] = '\0';
+    event->key = (int32_t)get_u32(payload + 4);
+    event->row_size = get_u32(payload + 8);
+    event->row = event->row_size ? payload + CDC_ROW_HEADER_SIZE + name_len : NULL;
+    event->lsn = hdr.lsn;
+    event->txn_id = hdr.txn_id;
+
+    return AMIDB_ROW;
+}
+
+/*
+ * Position after the last event returned
+ */
+uint32_t cdc_reader_position(struct cdc_reader *reader)
+{
+    return reader ? reader->position : 0;
+}
+
+/*
+ * Close a reader
+ */
+void cdc_reader_close(struct cdc_reader *reader)
+{
+    if (!reader) {
+        return;
+    }
+
+    file_close(reader->handle);
+    mem_free(reader->record, WAL_MAX_RECORD_SIZE);
+    mem_free(reader, sizeof(struct cdc_reader));
+}
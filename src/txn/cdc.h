@@ -0,0 +1,164 @@
+/*
+ * cdc.h - Change data capture for AmiDB
+ *
+ * With capture enabled, every row a transaction inserts, updates or
+ * deletes is logged as a WAL_ROW record next to its page images, so the
+ * row changes commit (or vanish) atomically with the pages. Once a
+ * commit is durable its row records are copied, followed by its COMMIT
+ * record, to the change log <db>-cdc. Unlike the WAL, the change log is
+ * never reset: it holds every committed change in commit order.
+ *
+ * If the program dies between the WAL commit and the copy, recovery
+ * finds the committed WAL_ROW records and appends what the change log
+ * is missing (it knows by LSN), so no committed change is lost and none
+ * is logged twice.
+ *
+ * Consumers tail the change log with a cdc_reader. A reader's position
+ * is a byte offset into the log; saving it and passing it back to
+ * cdc_reader_open resumes exactly where the consumer left off. Only
+ * transactions whose COMMIT record is in the log are returned.
+ *
+ * Change log records use the WAL record format. WAL_ROW payload
+ * (big-endian):
+ *   op (1), table name length (1), reserved (2), key (4),
+ *   row size (4), table name, serialized row (see storage/row.h)
+ */
+
+#ifndef AMIDB_CDC_H
+#define AMIDB_CDC_H
+
+#include <stdint.h>
+#include "txn/wal.h"
+
+/* Change log file: <db path>-cdc */
+#define CDC_LOG_SUFFIX "-cdc"
+
+/* Row change operations */
+#define CDC_INSERT   1
+#define CDC_UPDATE   2
+#define CDC_DELETE   3
+#define CDC_TRUNCATE 0x80   /* WAL only: ROLLBACK TO dropped later rows */
+
+/* Fixed part of a WAL_ROW payload */
+#define CDC_ROW_HEADER_SIZE 12
+
+/* Longest table name (as in the catalog) */
+#define CDC_MAX_TABLE_NAME 63
+
+/*
+ * Row change event
+ */
+struct cdc_event {
+    uint8_t op;                      /* CDC_INSERT / CDC_UPDATE / CDC_DELETE */
+    char table[CDC_MAX_TABLE_NAME + 1];
+    int32_t key;                     /* Primary key (or rowid) */
+    const uint8_t *row;              /* New row (NULL for CDC_DELETE); */
+    uint32_t row_size;               /* valid until the next cdc_next */
+    uint32_t lsn;                    /* LSN of the change */
+    uint64_t txn_id;                 /* Transaction that made it */
+};
+
+/*
+ * Change log reader
+ */
+struct cdc_reader {
+    void *handle;                    /* Change log file */
+    uint32_t position;               /* Offset of the next record */
+    uint32_t commit_end;             /* End of the transaction being read */
+                                     /* (0: its COMMIT not found yet) */
+    uint32_t last_lsn;               /* LSN of the last record read */
+    uint8_t *record;                 /* Current record */
+};
+
+/*
+ * Capture control
+ */
+
+/*
+ * Enable change capture: create the change log if needed and attach it
+ *
+ * Capture stays enabled for the database: wal_create attaches an
+ * existing change log automatically.
+ *
+ * Returns: 0 on success, AMIDB_IOERR / AMIDB_NOMEM on failure
+ */
+int cdc_enable(struct wal_context *wal);
+
+/*
+ * Disable change capture and delete the change log
+ *
+ * Must not be called inside a transaction.
+ */
+void cdc_disable(struct wal_context *wal);
+
+/*
+ * Attach (create = 0: only if it exists) / detach the change log
+ *
+ * Attaching scans the log for its last complete transaction and cuts off
+ * anything after it (a copy torn by a crash).
+ *
+ * Returns: 0 on success (also if create = 0 and there is no log),
+ *          error code on failure
+ */
+int cdc_open_log(struct wal_context *wal, int create);
+void cdc_close_log(struct wal_context *wal);
+
+/*
+ * Copy a committed transaction's row records to the change log
+ *
+ * offsets are the logical WAL offsets of its WAL_ROW records in order,
+ * commit_offset that of its COMMIT record; all must still be in the WAL.
+ * Rows dropped by ROLLBACK TO must already be left out. A transaction
+ * whose COMMIT LSN the log already holds is skipped.
+ *
+ * Returns: 0 on success, error code on failure
+ */
+int cdc_publish(struct wal_context *wal, const uint32_t *offsets, uint32_t count,
+                uint32_t commit_offset);
+
+/*
+ * Encode the fixed part and table name of a WAL_ROW payload
+ *
+ * buf must hold CDC_ROW_HEADER_SIZE + CDC_MAX_TABLE_NAME bytes; the row
+ * itself follows in the record. Longer table names are cut short.
+ *
+ * Returns: bytes written
+ */
+uint32_t cdc_encode_row_header(uint8_t *buf, uint8_t op, const char *table,
+                               int32_t key, uint32_t row_size);
+
+/*
+ * Consumer API
+ */
+
+/*
+ * Open a reader on a database's change log
+ *
+ * position: 0 for the start of the log, or a value returned by
+ *           cdc_reader_position to resume
+ *
+ * Returns: 0 on success, AMIDB_NOTFOUND if capture is not enabled,
+ *          AMIDB_NOMEM / AMIDB_IOERR on failure
+ */
+int cdc_reader_open(const char *db_path, uint32_t position, struct cdc_reader **reader_out);
+
+/*
+ * Get the next committed row change
+ *
+ * Returns: AMIDB_ROW with *event filled in, AMIDB_DONE if the log holds
+ *          no more committed changes (call again later to tail it),
+ *          AMIDB_CORRUPT if a record is damaged
+ */
+int cdc_next(struct cdc_reader *reader, struct cdc_event *event);
+
+/*
+ * Position after the last event returned (save it to resume)
+ */
+uint32_t cdc_reader_position(struct cdc_reader *reader);
+
+/*
+ * Close a reader
+ */
+void cdc_reader_close(struct cdc_reader *reader);
+
+#endif /* AMIDB_CDC_H */
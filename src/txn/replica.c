@@ -0,0 +1,505 @@
+/*
+ * replica.c - WAL shipping implementation
+ */
+
+#include "txn/replica.h"
+#include "txn/wal.h"
+#include "storage/pager.h"
+#include "storage/cache.h"
+#include "os/file.h"
+#include "os/mem.h"
+#include "api/error.h"
+#include <string.h>
+
+/* WAL record magic ("WALR") */
+#define REPLICA_RECORD_MAGIC 0x57414C52
+
+/* Record being shipped (static: too large for the 4KB 68000 stack) */
+static uint8_t g_ship_record[WAL_MAX_RECORD_SIZE];
+
+/*
+ * Read a record header from a stream file
+ *
+ * Returns: AMIDB_OK, or AMIDB_DONE if no whole record starts at offset
+ */
+static int replica_read_header(void *handle, uint32_t offset, uint32_t stream_size,
+                               struct wal_record_header *hdr)
+{
+    if (offset + sizeof(*hdr) > stream_size ||
+        file_seek(handle, offset, AMIDB_SEEK_SET) != 0 ||
+        file_read(handle, hdr, sizeof(*hdr)) != sizeof(*hdr)) {
+        return AMIDB_DONE;
+    }
+
+    if (hdr->magic != REPLICA_RECORD_MAGIC ||
+        hdr->record_size < sizeof(*hdr) ||
+        hdr->record_size > WAL_MAX_RECORD_SIZE ||
+        offset + hdr->record_size > stream_size) {
+        return AMIDB_DONE;
+    }
+
+    return AMIDB_OK;
+}
+
+/*
+ * Find the next COMMIT record in a stream file (headers only)
+ *
+ * Returns: AMIDB_OK with the offset after it and the highest LSN seen,
+ *          AMIDB_DONE if the stream ends (or is torn) first
+ */
+static int replica_find_commit(void *handle, uint32_t offset, uint32_t stream_size,
+                               uint32_t *end_out, uint32_t *lsn_out)
+{
+    struct wal_record_header hdr;
+
+    for (;;) {
+        if (replica_read_header(handle, offset, stream_size, &hdr) != AMIDB_OK) {
+            return AMIDB_DONE;
+        }
+        offset += hdr.record_size;
+        if (hdr.lsn > *lsn_out) {
+            *lsn_out = hdr.lsn;
+        }
+
+        if (hdr.record_type == WAL_COMMIT) {
+            *end_out = offset;
+            return AMIDB_OK;
+        }
+    }
+}
+
+/*
+ * Start shipping
+ */
+int replica_ship_start(struct wal_context *wal, const char *stream_path)
+{
+    void *handle;
+    int32_t stream_size;
+    uint32_t end;
+    uint32_t txn_end;
+    uint32_t lsn;
+
+    if (!wal || !stream_path) {
+        return AMIDB_ERROR;
+    }
+    if (wal->ship_handle) {
+        return AMIDB_BUSY;
+    }
+
+    if (file_exists(stream_path)) {
+        handle = file_open(stream_path, AMIDB_O_RDWR);
+    } else {
+        handle = file_open(stream_path, AMIDB_O_RDWR | AMIDB_O_CREATE);
+    }
+    if (!handle) {
+        return AMIDB_IOERR;
+    }
+
+    /* A file: keep whole shipments only and append after them */
+    /* (a pipe has no size and is simply written to) */
+    stream_size = file_size(handle);
+    wal->ship_sync = (stream_size >= 0);
+    if (stream_size > 0) {
+        end = 0;
+        lsn = 0;
+        while (replica_find_commit(handle, end, (uint32_t)stream_size,
+                                   &txn_end, &lsn) == AMIDB_OK) {
+            end = txn_end;
+        }
+        if (((uint32_t)stream_size > end && file_truncate(handle, end) != 0) ||
+            file_seek(handle, end, AMIDB_SEEK_SET) != 0) {
+            file_close(handle);
+            return AMIDB_IOERR;
+        }
+
+        /* The follower skips records it thinks it has (e.g. after a restore) */
+        if (lsn >= wal->next_lsn) {
+            wal->next_lsn = lsn + 1;
+        }
+    }
+
+    /* Records already in the WAL are committed and in the file */
+    wal->ship_handle = handle;
+    wal->ship_offset = wal->wal_head + wal->buffer_used;
+    wal->ship_failed = 0;
+
+    return AMIDB_OK;
+}
+
+/*
+ * Stop shipping
+ */
+void replica_ship_stop(struct wal_context *wal)
+{
+    if (wal && wal->ship_handle) {
+        file_close(wal->ship_handle);
+        wal->ship_handle = NULL;
+    }
+}
+
+/*
+ * Write a run of records to the stream
+ */
+static int replica_ship_write(struct wal_context *wal, const uint8_t *data, uint32_t length)
+{
+    if (length > 0 && file_write(wal->ship_handle, data, length) != (int32_t)length) {
+        return AMIDB_IOERR;
+    }
+    wal->ship_bytes += length;
+
+    return AMIDB_OK;
+}
+
+/*
+ * Ship the records flushed since the last call
+ */
+int replica_ship(struct wal_context *wal, const uint8_t *tail, uint32_t tail_offset)
+{
+    struct wal_record_header hdr;
+    const uint8_t *run;
+    uint32_t run_length;
+    uint32_t offset;
+    int rc;
+
+    if (!wal || !wal->ship_handle) {
+        return AMIDB_OK;
+    }
+
+    rc = AMIDB_OK;
+    offset = wal->ship_offset;
+
+    /* Records flushed by earlier (full buffer) flushes: read them back */
+    while (rc == AMIDB_OK && offset < tail_offset) {
+        rc = wal_read_record(wal, offset, g_ship_record, sizeof(g_ship_record));
+        if (rc == AMIDB_OK) {
+            memcpy(&hdr, g_ship_record, sizeof(hdr));
+            if (hdr.record_type != WAL_UNDO) {
+                rc = replica_ship_write(wal, g_ship_record, hdr.record_size);
+            }
+            offset += hdr.record_size;
+        }
+    }
+
+    /* The buffer just flushed is still in memory: write it in runs */
+    /* between the savepoint images it leaves out */
+    run = tail + (offset - tail_offset);
+    run_length = 0;
+    while (rc == AMIDB_OK && offset < wal->wal_head) {
+        memcpy(&hdr, tail + (offset - tail_offset), sizeof(hdr));
+        if (hdr.record_size < sizeof(hdr)) {
+            rc = AMIDB_CORRUPT;
+            break;
+        }
+        if (hdr.record_type == WAL_UNDO) {
+            rc = replica_ship_write(wal, run, run_length);
+            run = tail + (offset - tail_offset) + hdr.record_size;
+            run_length = 0;
+        } else {
+            run_length += hdr.record_size;
+        }
+        offset += hdr.record_size;
+    }
+    if (rc == AMIDB_OK) {
+        rc = replica_ship_write(wal, run, run_length);
+    }
+
+    /* The follower must not lose what the primary keeps */
+    if (rc == AMIDB_OK && wal->ship_sync && wal->sync_mode != WAL_SYNC_OFF &&
+        file_sync(wal->ship_handle) != 0) {
+        rc = AMIDB_IOERR;
+    }
+
+    if (rc != AMIDB_OK) {
+        replica_ship_stop(wal);
+        wal->ship_failed = 1;
+        return rc;
+    }
+
+    wal->ship_offset = offset;
+    return AMIDB_OK;
+}
+
+/*
+ * Attach a follower
+ */
+int replica_open(struct wal_context *wal, struct page_cache *cache,
+                 const char *stream_path, struct replica **replica_out)
+{
+    struct replica *replica;
+    void *handle;
+
+    if (!wal || !stream_path || !replica_out || wal->pager->read_only) {
+        return AMIDB_ERROR;
+    }
+
+    if (!file_exists(stream_path)) {
+        return AMIDB_NOTFOUND;
+    }
+    handle = file_open(stream_path, AMIDB_O_RDONLY);
+    if (!handle) {
+        return AMIDB_IOERR;
+    }
+
+    replica = (struct replica *)mem_alloc(sizeof(struct replica), AMIDB_MEM_CLEAR);
+    if (!replica) {
+        file_close(handle);
+        return AMIDB_NOMEM;
+    }
+    replica->record = (uint8_t *)mem_alloc(WAL_MAX_RECORD_SIZE, 0);
+    if (!replica->record) {
+        mem_free(replica, sizeof(struct replica));
+        file_close(handle);
+        return AMIDB_NOMEM;
+    }
+
+    replica->wal = wal;
+    replica->cache = cache;
+    replica->handle = handle;
+    replica->is_pipe = (file_size(handle) < 0);
+
+    *replica_out = replica;
+    return AMIDB_OK;
+}
+
+/*
+ * Read exactly length bytes from a pipe
+ */
+static int replica_read_pipe(void *handle, uint8_t *buf, uint32_t length)
+{
+    int32_t got;
+
+    while (length > 0) {
+        got = file_read(handle, buf, length);
+        if (got <= 0) {
+            return AMIDB_DONE;           /* Primary closed the pipe */
+        }
+        buf += got;
+        length -= (uint32_t)got;
+    }
+
+    return AMIDB_OK;
+}
+
+/*
+ * Read the next record into replica->record
+ *
+ * From a file, only records of transactions whose COMMIT is in the
+ * stream are read, so a shipment cut short is never half taken.
+ *
+ * Returns: AMIDB_OK, AMIDB_DONE if there is none yet, error code on failure
+ */
+static int replica_read_record(struct replica *replica)
+{
+    struct wal_record_header hdr;
+    int32_t stream_size;
+    uint32_t lsn;
+    int rc;
+
+    if (replica->is_pipe) {
+        rc = replica_read_pipe(replica->handle, (uint8_t *)&hdr, sizeof(hdr));
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+        if (hdr.magic != REPLICA_RECORD_MAGIC ||
+            hdr.record_size < sizeof(hdr) ||
+            hdr.record_size > WAL_MAX_RECORD_SIZE) {
+            return AMIDB_CORRUPT;
+        }
+        memcpy(replica->record, &hdr, sizeof(hdr));
+        rc = replica_read_pipe(replica->handle, replica->record + sizeof(hdr),
+                               hdr.record_size - sizeof(hdr));
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+    } else {
+        stream_size = file_size(replica->handle);
+        if (stream_size < 0) {
+            return AMIDB_IOERR;
+        }
+
+        if (replica->commit_end == 0) {
+            lsn = 0;
+            if (replica_find_commit(replica->handle, replica->position,
+                                    (uint32_t)stream_size, &replica->commit_end,
+                                    &lsn) != AMIDB_OK) {
+                return AMIDB_DONE;
+            }
+        }
+
+        if (replica_read_header(replica->handle, replica->position,
+                                (uint32_t)stream_size, &hdr) != AMIDB_OK ||
+            file_seek(replica->handle, replica->position, AMIDB_SEEK_SET) != 0 ||
+            file_read(replica->handle, replica->record,
+                      hdr.record_size) != (int32_t)hdr.record_size) {
+            return AMIDB_CORRUPT;
+        }
+    }
+
+    if (!wal_verify_checksum(replica->record, hdr.record_size)) {
+        return AMIDB_CORRUPT;
+    }
+
+    replica->position += hdr.record_size;
+    if (replica->position >= replica->commit_end) {
+        replica->commit_end = 0;
+    }
+    replica->records_received++;
+
+    return AMIDB_OK;
+}
+
+/*
+ * Apply the transaction just received (its COMMIT is in the WAL buffer)
+ */
+static int replica_apply(struct replica *replica)
+{
+    struct wal_context *wal = replica->wal;
+    struct cache_entry *entry;
+    uint32_t i;
+    int rc;
+
+    /* Allocations are not logged: pages new to the follower are claimed */
+    rc = wal_flush(wal);
+    for (i = 0; rc == AMIDB_OK && i < replica->page_count; i++) {
+        if (pager_claim_page(wal->pager, replica->pages[i]) != 0) {
+            rc = AMIDB_IOERR;
+        }
+    }
+    if (rc == AMIDB_OK && pager_write_header(wal->pager) != 0) {
+        rc = AMIDB_IOERR;
+    }
+
+    /* The recovery path replays what is on disk */
+    if (rc == AMIDB_OK) {
+        rc = wal_recover(wal);
+    }
+    if (rc == AMIDB_OK && pager_write_header(wal->pager) != 0) {
+        rc = AMIDB_IOERR;
+    }
+    if (rc == AMIDB_OK && wal->sync_mode != WAL_SYNC_OFF && pager_sync(wal->pager) != 0) {
+        rc = AMIDB_IOERR;
+    }
+
+    /*
+     * Readers must see the new images, even if applying failed halfway:
+     * unpinned copies are dropped, pinned ones read again in place
+     */
+    if (replica->cache) {
+        for (i = 0; i < replica->page_count; i++) {
+            entry = cache_find_entry(replica->cache, replica->pages[i]);
+            if (!entry || entry->state != CACHE_ENTRY_CLEAN) {
+                continue;
+            }
+            if (cache_discard(replica->cache, replica->pages[i]) != 0 &&
+                pager_read_page(wal->pager, replica->pages[i], entry->data) != 0 &&
+                rc == AMIDB_OK) {
+                rc = AMIDB_IOERR;
+            }
+        }
+    }
+    replica->page_count = 0;
+
+    if (rc != AMIDB_OK) {
+        return rc;
+    }
+
+    replica->txns_applied++;
+    return AMIDB_OK;
+}
+
+/*
+ * Apply every complete transaction in the stream
+ */
+int replica_poll(struct replica *replica)
+{
+    struct wal_record_header hdr;
+    struct amidb_pager *pager;
+    uint32_t *grown;
+    uint32_t new_capacity;
+    int applied;
+    int rc;
+
+    if (!replica) {
+        return AMIDB_ERROR;
+    }
+
+    pager = replica->wal->pager;
+    applied = 0;
+
+    for (;;) {
+        rc = replica_read_record(replica);
+        if (rc == AMIDB_DONE) {
+            break;
+        }
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+        memcpy(&hdr, replica->record, sizeof(hdr));
+
+        /* Applied before (the follower was copied or stopped after it) */
+        if (hdr.lsn <= pager->header.checkpoint_lsn) {
+            replica->records_skipped++;
+            continue;
+        }
+
+        /* Remember the page to uncache it once applied */
+        if (hdr.record_type == WAL_PAGE) {
+            if (replica->page_count == replica->page_capacity) {
+                new_capacity = replica->page_capacity ? replica->page_capacity * 2 : 64;
+                grown = (uint32_t *)mem_realloc(replica->pages,
+                                                replica->page_capacity * sizeof(uint32_t),
+                                                new_capacity * sizeof(uint32_t), 0);
+                if (!grown) {
+                    return AMIDB_NOMEM;
+                }
+                replica->pages = grown;
+                replica->page_capacity = new_capacity;
+            }
+            memcpy(&replica->pages[replica->page_count++],
+                   replica->record + sizeof(hdr), 4);
+        }
+
+        /* Flag the file for recovery while its WAL holds records */
+        if (!(pager->header.flags & DB_FLAG_DIRTY)) {
+            pager->header.flags |= DB_FLAG_DIRTY;
+            if (pager_write_header(pager) != 0) {
+                return AMIDB_IOERR;
+            }
+        }
+
+        rc = wal_append_record(replica->wal, replica->record);
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+
+        if (hdr.record_type == WAL_COMMIT) {
+            rc = replica_apply(replica);
+            if (rc != AMIDB_OK) {
+                return rc;
+            }
+            applied++;
+        }
+    }
+
+    return applied;
+}
+
+/*
+ * Detach a follower
+ */
+void replica_close(struct replica *replica)
+{
+    if (!replica) {
+        return;
+    }
+
+    /* A transaction not received completely waits for the next attach */
+    wal_reset_buffer(replica->wal);
+
+    file_close(replica->handle);
+    if (replica->pages) {
+        mem_free(replica->pages, replica->page_capacity * sizeof(uint32_t));
+    }
+    mem_free(replica->record, WAL_MAX_RECORD_SIZE);
+    mem_free(replica, sizeof(struct replica));
+}
@@ -0,0 +1,126 @@
+/*
+ * replica.h - WAL shipping to a read-only follower for AmiDB
+ *
+ * The primary ships its WAL: every time wal_flush makes a commit durable,
+ * the records flushed since the last shipment are appended to a ship
+ * stream, a file (or pipe) in the WAL record format. Savepoint
+ * before-images (WAL_UNDO) stay behind; nothing else is filtered, so
+ * the stream holds exactly what recovery needs.
+ *
+ * The follower is a copy of the primary's database (made with the
+ * online backup, see storage/backup.h) opened in its own process. It
+ * appends shipped records to its own WAL and, at each COMMIT, applies
+ * them with wal_recover: whole transactions only, page images the file
+ * already holds are skipped, and a follower that crashes mid-apply
+ * recovers like any database. Applied page images are dropped from the
+ * follower's cache, so reads between two polls see one committed state.
+ * Page allocation is not logged: a page new to the follower is claimed
+ * (pager_claim_page) when its first image arrives. Freed pages stay
+ * allocated on the follower.
+ *
+ * The follower resumes by LSN: records at or below its checkpoint LSN
+ * are already applied and are skipped.
+ *
+ * Only WAL-logged changes travel. Schema changes (CREATE / DROP TABLE)
+ * write the file directly, so the follower must be copied again after
+ * one, and after the primary stopped shipping or crashed before a
+ * shipment.
+ */
+
+#ifndef AMIDB_REPLICA_H
+#define AMIDB_REPLICA_H
+
+#include <stdint.h>
+#include "txn/wal.h"
+#include "storage/cache.h"
+
+/*
+ * Follower state
+ */
+struct replica {
+    struct wal_context *wal;         /* Follower's WAL (applies the records) */
+    struct page_cache *cache;        /* Follower's cache (NULL: none) */
+    void *handle;                    /* Ship stream */
+    int is_pipe;                     /* Stream cannot seek (read as it comes) */
+    uint32_t position;               /* Stream offset of the next record */
+    uint32_t commit_end;             /* End of the transaction being read */
+                                     /* (file only; 0: COMMIT not found yet) */
+    uint8_t *record;                 /* Record being read */
+
+    /* Pages of the transaction being received (to uncache when applied) */
+    uint32_t *pages;
+    uint32_t page_count;
+    uint32_t page_capacity;
+
+    /* Statistics */
+    uint32_t txns_applied;
+    uint32_t records_received;
+    uint32_t records_skipped;        /* Already applied (LSN too old) */
+};
+
+/*
+ * Primary side
+ */
+
+/*
+ * Start shipping committed WAL records to stream_path
+ *
+ * An existing stream file is appended to, after cutting off anything
+ * following its last COMMIT record.
+ *
+ * Returns: 0 on success, AMIDB_BUSY if already shipping,
+ *          AMIDB_IOERR / AMIDB_NOMEM on failure
+ */
+int replica_ship_start(struct wal_context *wal, const char *stream_path);
+
+/*
+ * Stop shipping (the stream is left in place)
+ */
+void replica_ship_stop(struct wal_context *wal);
+
+/*
+ * Ship the records flushed since the last call (called by wal_flush)
+ *
+ * tail is the buffer wal_flush just wrote, holding the WAL from
+ * tail_offset up to the head; older records are read back from disk.
+ * A failure stops shipping rather than failing the commit: the primary
+ * must not depend on its follower.
+ *
+ * Returns: 0 on success, error code if shipping was stopped
+ */
+int replica_ship(struct wal_context *wal, const uint8_t *tail, uint32_t tail_offset);
+
+/*
+ * Follower side
+ */
+
+/*
+ * Attach a follower to a ship stream
+ *
+ * wal belongs to the follower's database, cache (optional) is the cache
+ * its readers use. No transaction may run on wal while it is attached.
+ *
+ * Returns: 0 on success, AMIDB_NOTFOUND if the stream does not exist,
+ *          AMIDB_IOERR / AMIDB_NOMEM on failure
+ */
+int replica_open(struct wal_context *wal, struct page_cache *cache,
+                 const char *stream_path, struct replica **replica_out);
+
+/*
+ * Apply every transaction the stream holds completely
+ *
+ * A transaction whose COMMIT has not arrived yet is kept in the
+ * follower's WAL until a later poll. Reading a pipe blocks until the
+ * primary ships again or closes it.
+ *
+ * Returns: transactions applied (>= 0), AMIDB_CORRUPT if the stream is
+ *          damaged, other error code on failure
+ */
+int replica_poll(struct replica *replica);
+
+/*
+ * Detach a follower
+ */
+void replica_close(struct replica *replica);
+
+#endif /* AMIDB_REPLICA_H */
@@ -4,12 +4,414 @@
 
 #include "txn/txn.h"
 #include "txn/wal.h"
+#include "txn/cdc.h"
 #include "os/mem.h"
+#include "os/task.h"
 #include "storage/pager.h"
 #include "storage/cache.h"
 #include "api/error.h"
+#include "util/endian.h"
 #include <string.h>
 
+/* Scratch page image (static: too large for the 4KB 68000 stack) */
+static uint8_t g_page_buf[AMIDB_PAGE_SIZE];
+
+/*
+ * Grow a transaction list (doubling, starting at TXN_INITIAL_PAGES)
+ */
+static int txn_grow_list(void **list, uint32_t *capacity, uint32_t elem_size)
+{
+    uint32_t new_capacity;
+    void *new_list;
+
+    new_capacity = *capacity ? *capacity * 2 : TXN_INITIAL_PAGES;
+    new_list = mem_realloc(*list, *capacity * elem_size, new_capacity * elem_size, 0);
+    if (!new_list) {
+        return AMIDB_NOMEM;
+    }
+
+    *list = new_list;
+    *capacity = new_capacity;
+
+    return AMIDB_OK;
+}
+
+/*
+ * Find a spilled page, or NULL if it was never spilled
+ */
+static struct txn_spill_entry *txn_find_spilled(struct txn_context *txn, uint32_t page_num)
+{
+    uint32_t i;
+
+    for (i = 0; i < txn->spill_count; i++) {
+        if (txn->spilled[i].page_num == page_num) {
+            return &txn->spilled[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Find the before-image abort should use: the one taken before the page
+ * was first dirtied in this transaction (NULL if none was saved)
+ */
+static struct txn_undo_entry *txn_find_undo(struct txn_context *txn, uint32_t page_num)
+{
+    uint32_t i;
+
+    for (i = 0; i < txn->undo_count; i++) {
+        if (txn->undo[i].page_num == page_num &&
+            !(txn->undo[i].flags & TXN_UNDO_IN_TXN)) {
+            return &txn->undo[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Position of a page in the dirty list, or -1 if not dirty
+ */
+static int32_t txn_dirty_index(struct txn_context *txn, uint32_t page_num)
+{
+    uint32_t i;
+
+    for (i = 0; i < txn->dirty_count; i++) {
+        if (txn->dirty_pages[i] == page_num) {
+            return (int32_t)i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Release the undo buffer
+ */
+static void txn_free_undo(struct txn_context *txn)
+{
+    if (txn->undo_arena) {
+        mem_free(txn->undo_arena, txn->undo_limit * AMIDB_PAGE_SIZE);
+        txn->undo_arena = NULL;
+    }
+    if (txn->undo) {
+        mem_free(txn->undo, txn->undo_capacity * sizeof(struct txn_undo_entry));
+        txn->undo = NULL;
+    }
+    txn->undo_count = 0;
+    txn->undo_capacity = 0;
+    txn->undo_arena_used = 0;
+}
+
+/*
+ * Append a gathered record to the WAL, flushing the buffer to disk when
+ * it fills
+ *
+ * Records of an uncommitted transaction may safely reach the disk early:
+ * recovery ignores them until the COMMIT record is present. The flush is
+ * not waited for; the commit's own flush covers it.
+ */
+static int txn_log_gather(struct txn_context *txn, uint16_t type,
+                          const struct wal_segment *segs, uint32_t count,
+                          uint32_t *offset_out)
+{
+    uint32_t record_size;
+    uint32_t i;
+    int rc;
+
+    rc = wal_write_record_gather(txn->wal, type, segs, count);
+    if (rc == AMIDB_FULL) {
+        rc = wal_flush_async(txn->wal);
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+        rc = wal_write_record_gather(txn->wal, type, segs, count);
+    }
+    if (rc != AMIDB_OK) {
+        return rc;
+    }
+
+    if (offset_out) {
+        record_size = sizeof(struct wal_record_header);
+        for (i = 0; i < count; i++) {
+            record_size += segs[i].length;
+        }
+        *offset_out = txn->wal->wal_head + txn->wal->buffer_used - record_size;
+    }
+
+    return AMIDB_OK;
+}
+
+/*
+ * Append a record with a single (or no) payload
+ */
+static int txn_log_record(struct txn_context *txn, uint16_t type,
+                          const void *payload, uint32_t payload_size,
+                          uint32_t *offset_out)
+{
+    struct wal_segment seg;
+
+    seg.data = payload;
+    seg.length = payload_size;
+    seg.crc_known = 0;
+
+    return txn_log_gather(txn, type, &seg, payload_size ? 1 : 0, offset_out);
+}
+
+/*
+ * Append a page image as a WAL_PAGE or WAL_UNDO record
+ *
+ * The image is gathered straight from data; for WAL_PAGE the LSN of the
+ * record is substituted into its page header on the way, so recovery
+ * can tell whether the database file already holds it. data itself is
+ * left untouched.
+ */
+static int txn_log_image(struct txn_context *txn, uint16_t type, uint32_t page_num,
+                         const uint8_t *data, uint32_t *offset_out)
+{
+    struct wal_segment segs[4];
+    uint8_t lsn_buf[4];
+
+    segs[0].data = &page_num;
+    segs[0].length = 4;
+    segs[0].crc_known = 0;
+
+    if (type != WAL_PAGE) {
+        segs[1].data = data;
+        segs[1].length = AMIDB_PAGE_SIZE;
+        segs[1].crc_known = 0;
+        return txn_log_gather(txn, type, segs, 2, offset_out);
+    }
+
+    put_u32(lsn_buf, txn->wal->next_lsn);
+    segs[1].data = data;
+    segs[1].length = 12;                      /* Up to the LSN */
+    segs[1].crc_known = 0;
+    segs[2].data = lsn_buf;
+    segs[2].length = 4;
+    segs[2].crc_known = 0;
+    segs[3].data = data + 16;
+    segs[3].length = AMIDB_PAGE_SIZE - 16;
+    segs[3].crc_known = 0;
+
+    return txn_log_gather(txn, WAL_PAGE, segs, 4, offset_out);
+}
+
+/*
+ * Append a WAL_ROW record
+ */
+static int txn_log_row_record(struct txn_context *txn, uint8_t op, const char *table,
+                              int32_t key, const uint8_t *row, uint32_t row_size,
+                              uint32_t *offset_out)
+{
+    struct wal_segment segs[2];
+    uint8_t header[CDC_ROW_HEADER_SIZE + CDC_MAX_TABLE_NAME];
+
+    segs[0].data = header;
+    segs[0].length = cdc_encode_row_header(header, op, table, key, row_size);
+    segs[0].crc_known = 0;
+    segs[1].data = row;
+    segs[1].length = row_size;
+    segs[1].crc_known = 0;
+
+    return txn_log_gather(txn, WAL_ROW, segs, row_size ? 2 : 1, offset_out);
+}
+
+/*
+ * Log a cached page at commit, zero-copy
+ *
+ * The cached image itself gets the record's LSN and is stamped with its
+ * page checksum. That checksum is folded into the WAL record checksum,
+ * and the eager checkpoint writes the stamped image as is, so the page
+ * is checksummed once and copied once (into the WAL buffer) per commit.
+ */
+static int txn_log_cached_page(struct txn_context *txn, uint32_t page_num,
+                               uint8_t *data)
+{
+    struct wal_segment segs[3];
+    uint32_t page_crc;
+
+    pager_set_page_lsn(data, txn->wal->next_lsn);
+    page_crc = pager_stamp_page(data, page_num);
+
+    segs[0].data = &page_num;
+    segs[0].length = 4;
+    segs[0].crc_known = 0;
+    segs[1].data = data;
+    segs[1].length = 12;                      /* Page number, type, checksum */
+    segs[1].crc_known = 0;
+    segs[2].data = data + 12;
+    segs[2].length = AMIDB_PAGE_SIZE - 12;    /* Covered by the page checksum */
+    segs[2].crc = page_crc;
+    segs[2].crc_known = 1;
+
+    return txn_log_gather(txn, WAL_PAGE, segs, 3, NULL);
+}
+
+/*
+ * Committed contents of a page dirtied by the active transaction
+ *
+ * Its before-image if one is in RAM, otherwise the database file (which
+ * only ever receives committed pages) read into buf. NULL on I/O error.
+ */
+static const uint8_t *txn_committed_image(struct txn_context *txn, uint32_t page_num,
+                                          uint8_t *buf)
+{
+    struct txn_undo_entry *undo;
+
+    undo = txn_find_undo(txn, page_num);
+    if (undo && undo->image) {
+        return undo->image;
+    }
+
+    if (pager_read_page(txn->wal->pager, page_num, buf) != AMIDB_OK) {
+        return NULL;
+    }
+    return buf;
+}
+
+/*
+ * Free page versions superseded at or before a commit sequence number
+ * (no open snapshot is older than that)
+ */
+static void txn_drop_versions(struct txn_context *txn, uint32_t upto_seq)
+{
+    uint32_t i;
+    uint32_t kept;
+
+    kept = 0;
+    for (i = 0; i < txn->version_count; i++) {
+        if (txn->versions[i].superseded <= upto_seq) {
+            mem_free(txn->versions[i].image, AMIDB_PAGE_SIZE);
+        } else {
+            txn->versions[kept++] = txn->versions[i];
+        }
+    }
+    txn->version_count = kept;
+}
+
+/*
+ * Keep the committed images of the pages this commit replaces
+ *
+ * Only done while snapshots are open. If the version budget runs out the
+ * snapshots are marked stale rather than holding up the writer.
+ */
+static void txn_save_versions(struct txn_context *txn)
+{
+    struct txn_page_version *version;
+    struct txn_snapshot *snap;
+    const uint8_t *image;
+    uint8_t *copy;
+    uint32_t i;
+
+    if (!txn->snapshots) {
+        return;
+    }
+
+    for (i = 0; i < txn->dirty_count; i++) {
+        copy = NULL;
+        if (txn->version_count < txn->version_limit &&
+            (txn->version_count < txn->version_capacity ||
+             txn_grow_list((void **)&txn->versions, &txn->version_capacity,
+                           sizeof(struct txn_page_version)) == AMIDB_OK)) {
+            copy = (uint8_t *)mem_alloc(AMIDB_PAGE_SIZE, 0);
+        }
+        image = copy ? txn_committed_image(txn, txn->dirty_pages[i], copy) : NULL;
+
+        if (!image) {
+            /* Out of budget: every open snapshot loses its history */
+            if (copy) {
+                mem_free(copy, AMIDB_PAGE_SIZE);
+            }
+            for (snap = txn->snapshots; snap; snap = snap->next) {
+                snap->stale = 1;
+            }
+            txn_drop_versions(txn, 0xFFFFFFFF);
+            return;
+        }
+
+        if (image != copy) {
+            memcpy(copy, image, AMIDB_PAGE_SIZE);
+        }
+        version = &txn->versions[txn->version_count++];
+        version->page_num = txn->dirty_pages[i];
+        version->superseded = txn->commit_seq + 1;
+        version->image = copy;
+        txn->versions_saved++;
+    }
+}
+
+/*
+ * Free the pages commits replaced or freed, once no snapshot can read them
+ */
+static void txn_release_retired(struct txn_context *txn)
+{
+    if (txn->retired_count == 0 || txn->snapshots || txn->state != TXN_STATE_IDLE) {
+        return;
+    }
+
+    pager_free_pages(txn->wal->pager, txn->retired, txn->retired_count);
+    txn->retired_count = 0;
+}
+
+/*
+ * Reset per-transaction page lists (keeps allocated capacity)
+ */
+static void txn_reset_lists(struct txn_context *txn)
+{
+    txn->dirty_count = 0;
+    txn->pinned_count = 0;
+    txn->spill_count = 0;
+    txn->undo_count = 0;
+    txn->undo_arena_used = 0;
+    txn->row_count = 0;
+    txn->allocated_count = 0;
+    txn->freed_count = 0;
+    txn->savepoint_count = 0;
+}
+
+/*
+ * Settle the pages the transaction allocated and freed: a commit
+ * releases the ones it freed, a rollback the ones it allocated
+ *
+ * Open snapshots may still read pages a commit freed, so those are
+ * retired instead and freed when the last snapshot closes (if they do
+ * not fit the list, the snapshots go stale).
+ */
+static void txn_settle_pages(struct txn_context *txn, int committed)
+{
+    struct amidb_pager *pager = txn->wal->pager;
+    struct txn_snapshot *snap;
+
+    pager->txn = NULL;
+    if (committed && txn->freed_count > 0 && txn->snapshots) {
+        while (txn->retired_count + txn->freed_count > txn->retired_capacity) {
+            if (txn_grow_list((void **)&txn->retired, &txn->retired_capacity,
+                              sizeof(uint32_t)) != AMIDB_OK) {
+                break;
+            }
+        }
+        if (txn->retired_count + txn->freed_count <= txn->retired_capacity) {
+            memcpy(txn->retired + txn->retired_count, txn->freed,
+                   txn->freed_count * sizeof(uint32_t));
+            txn->retired_count += txn->freed_count;
+            txn->freed_count = 0;
+        } else {
+            for (snap = txn->snapshots; snap; snap = snap->next) {
+                snap->stale = 1;
+            }
+        }
+    }
+    if (committed && txn->freed_count > 0) {
+        pager_free_pages(pager, txn->freed, txn->freed_count);
+    } else if (!committed && txn->allocated_count > 0) {
+        pager_free_pages(pager, txn->allocated, txn->allocated_count);
+    }
+    txn->allocated_count = 0;
+    txn->freed_count = 0;
+}
+
 /*
  * Create a new transaction context
  */
@@ -32,278 +434,1372 @@ struct txn_context *txn_create(struct wal_context *wal, struct page_cache *cache
     txn->cache = cache;
     txn->state = TXN_STATE_IDLE;
     txn->txn_id = 0;
+    txn->dirty_pages = NULL;
     txn->dirty_count = 0;
+    txn->dirty_capacity = 0;
+    txn->pinned_pages = NULL;
     txn->pinned_count = 0;
+    txn->pinned_capacity = 0;
+    txn->spilled = NULL;
+    txn->spill_count = 0;
+    txn->spill_capacity = 0;
+    txn->wal_start = 0;
+    txn->undo = NULL;
+    txn->undo_count = 0;
+    txn->undo_capacity = 0;
+    txn->undo_arena = NULL;
+    txn->undo_arena_used = 0;
+    txn->undo_limit = TXN_UNDO_DEFAULT_PAGES;
+    txn->savepoint_count = 0;
     txn->pages_logged = 0;
+    txn->pages_spilled = 0;
+    txn->undo_restores = 0;
+    txn->disk_restores = 0;
     txn->commit_count = 0;
     txn->abort_count = 0;
+    txn->commit_seq = 0;
+    txn->snapshots = NULL;
+    txn->versions = NULL;
+    txn->version_count = 0;
+    txn->version_capacity = 0;
+    txn->version_limit = TXN_VERSION_DEFAULT_PAGES;
+    txn->versions_saved = 0;
+    txn->commit_mode = TXN_COMMIT_WAL;
+    txn->shadow = 0;
+    txn->retired = NULL;
+    txn->retired_count = 0;
+    txn->retired_capacity = 0;
+    txn->pages_shadowed = 0;
+
+    /* Let the cache spill our uncommitted pages under pressure */
+    cache->txn = txn;
 
     return txn;
 }
 
 /*
- * Destroy transaction context
+ * Destroy transaction context
+ */
+void txn_destroy(struct txn_context *txn)
+{
+    if (!txn) {
+        return;
+    }
+
+    /* Ensure transaction is not active */
+    if (txn->state == TXN_STATE_ACTIVE) {
+        txn_abort(txn);
+    }
+
+    if (txn->cache->txn == txn) {
+        txn->cache->txn = NULL;
+    }
+
+    if (txn->dirty_pages) {
+        mem_free(txn->dirty_pages, txn->dirty_capacity * sizeof(uint32_t));
+    }
+    if (txn->pinned_pages) {
+        mem_free(txn->pinned_pages, txn->pinned_capacity * sizeof(uint32_t));
+    }
+    if (txn->spilled) {
+        mem_free(txn->spilled, txn->spill_capacity * sizeof(struct txn_spill_entry));
+    }
+    if (txn->writes) {
+        mem_free(txn->writes, txn->write_capacity * sizeof(struct pager_write));
+    }
+    if (txn->rows) {
+        mem_free(txn->rows, txn->row_capacity * sizeof(uint32_t));
+    }
+    if (txn->allocated) {
+        mem_free(txn->allocated, txn->allocated_capacity * sizeof(uint32_t));
+    }
+    if (txn->freed) {
+        mem_free(txn->freed, txn->freed_capacity * sizeof(uint32_t));
+    }
+    txn_free_undo(txn);
+    txn_drop_versions(txn, 0xFFFFFFFF);
+    if (txn->versions) {
+        mem_free(txn->versions, txn->version_capacity * sizeof(struct txn_page_version));
+    }
+    txn_release_retired(txn);
+    if (txn->retired) {
+        mem_free(txn->retired, txn->retired_capacity * sizeof(uint32_t));
+    }
+
+    mem_free(txn, sizeof(struct txn_context));
+}
+
+/*
+ * Begin a new transaction
+ */
+int txn_begin(struct txn_context *txn)
+{
+    struct amidb_pager *pager;
+    int rc;
+
+    if (!txn) {
+        return AMIDB_ERROR;
+    }
+
+    /* Check state */
+    if (txn->state != TXN_STATE_IDLE) {
+        return AMIDB_BUSY;
+    }
+
+    /* Shadow paging: the header keeps the committed tree until commit */
+    if (txn->commit_mode == TXN_COMMIT_SHADOW) {
+        if (pager_shadow_begin(txn->wal->pager) != 0) {
+            return AMIDB_NOMEM;
+        }
+        txn->state = TXN_STATE_ACTIVE;
+        txn->shadow = 1;
+        txn->txn_id = ++txn->wal->current_txn_id;
+        txn->wal->sync_mode = txn->wal->durability;
+        txn_reset_lists(txn);
+        return AMIDB_OK;
+    }
+
+    /* Flag the file for recovery until the next clean close */
+    pager = txn->wal->pager;
+    if (!(pager->header.flags & DB_FLAG_DIRTY)) {
+        pager->header.flags |= DB_FLAG_DIRTY;
+        rc = pager_write_header(pager);
+        if (rc != 0) {
+            return AMIDB_IOERR;
+        }
+    }
+
+    /* Transition to ACTIVE state */
+    txn->state = TXN_STATE_ACTIVE;
+    txn->txn_id = ++txn->wal->current_txn_id;
+    txn->wal->sync_mode = txn->wal->durability;
+    txn_reset_lists(txn);
+    txn->wal_start = txn->wal->wal_head;
+    pager->txn = txn;
+
+    /* Write BEGIN record to WAL */
+    rc = wal_write_record(txn->wal, WAL_BEGIN, NULL, 0);
+    if (rc != AMIDB_OK) {
+        txn->state = TXN_STATE_IDLE;
+        return rc;
+    }
+
+    return AMIDB_OK;
+}
+
+/*
+ * Count a commit in the latency histogram
+ */
+static void txn_record_latency(struct txn_context *txn, uint32_t ms)
+{
+    uint32_t bucket;
+
+    bucket = 0;
+    while (bucket < TXN_LATENCY_BUCKETS - 1 && ms >= (1UL << bucket)) {
+        bucket++;
+    }
+    txn->commit_latency[bucket]++;
+
+    if (ms > txn->commit_latency_max) {
+        txn->commit_latency_max = ms;
+    }
+}
+
+/*
+ * Lower bound of a latency bucket
+ */
+uint32_t txn_latency_bucket_ms(uint32_t bucket)
+{
+    return bucket ? (1UL << (bucket - 1)) : 0;
+}
+
+/*
+ * Abort a shadow-paging transaction
+ *
+ * Every page it dirtied is new and becomes free again, so nothing is
+ * restored: the cached copies are dropped and the pager goes back to
+ * the committed bitmap and catalog root.
+ */
+static int txn_abort_shadow(struct txn_context *txn)
+{
+    struct cache_entry *entry;
+    uint32_t i;
+
+    txn->state = TXN_STATE_ABORTING;
+
+    for (i = 0; i < txn->pinned_count; i++) {
+        cache_unpin(txn->cache, txn->pinned_pages[i]);
+    }
+
+    for (i = 0; i < txn->dirty_count; i++) {
+        if (cache_discard(txn->cache, txn->dirty_pages[i]) != 0) {
+            /* Still pinned by a caller: keep it, but never write it */
+            entry = cache_find_entry(txn->cache, txn->dirty_pages[i]);
+            entry->state = CACHE_ENTRY_CLEAN;
+            entry->txn_id = 0;
+        }
+    }
+
+    pager_shadow_abort(txn->wal->pager);
+
+    txn_reset_lists(txn);
+    txn->shadow = 0;
+    txn->state = TXN_STATE_IDLE;
+    txn->abort_count++;
+    txn_release_retired(txn);
+
+    return AMIDB_OK;
+}
+
+/*
+ * Commit a shadow-paging transaction
+ *
+ * The new pages go to their (free) places in the file sorted and
+ * batched, are synced, and then the header write makes them the
+ * committed tree. Pages spilled earlier are already in place.
+ */
+static int txn_commit_shadow(struct txn_context *txn)
+{
+    struct amidb_pager *pager;
+    struct cache_entry *entry;
+    uint32_t start_ms;
+    uint32_t count;
+    uint32_t i;
+    int keep;
+    int rc;
+
+    pager = txn->wal->pager;
+    txn->state = TXN_STATE_COMMITTING;
+    start_ms = task_time_ms();
+
+    while (txn->write_capacity < txn->dirty_count) {
+        rc = txn_grow_list((void **)&txn->writes, &txn->write_capacity,
+                           sizeof(struct pager_write));
+        if (rc != AMIDB_OK) {
+            txn_abort_shadow(txn);
+            return rc;
+        }
+    }
+
+    count = 0;
+    for (i = 0; i < txn->dirty_count; i++) {
+        uint32_t page_num = txn->dirty_pages[i];
+
+        /* Allocated and freed again by this transaction: drop it */
+        if (!pager_page_is_allocated(pager, page_num)) {
+            if (cache_discard(txn->cache, page_num) != 0) {
+                entry = cache_find_entry(txn->cache, page_num);
+                entry->state = CACHE_ENTRY_CLEAN;
+                entry->txn_id = 0;
+            }
+            continue;
+        }
+
+        /* A committed page changed in place would break atomicity */
+        if (!pager_page_is_new(pager, page_num)) {
+            txn_abort_shadow(txn);
+            return AMIDB_ERROR;
+        }
+
+        entry = cache_find_entry(txn->cache, page_num);
+        if (entry && entry->state == CACHE_ENTRY_DIRTY) {
+            txn->writes[count].page_num = page_num;
+            txn->writes[count].data = entry->data;
+            txn->writes[count].stamped = 0;
+            count++;
+        }
+    }
+
+    /* New pages must be on disk before the header points at them */
+    if (pager_write_batch(pager, txn->writes, count) != 0 ||
+        (txn->wal->sync_mode != WAL_SYNC_OFF && pager_sync(pager) != 0)) {
+        txn_abort_shadow(txn);
+        return AMIDB_IOERR;
+    }
+
+    /* Open snapshots still read the pages this commit replaces */
+    keep = 0;
+    if (txn->snapshots && pager->retired_count > 0) {
+        keep = 1;
+        while (txn->retired_count + pager->retired_count > txn->retired_capacity) {
+            if (txn_grow_list((void **)&txn->retired, &txn->retired_capacity,
+                              sizeof(uint32_t)) != AMIDB_OK) {
+                /* No room to hold them: the snapshots lose their tree */
+                struct txn_snapshot *snap;
+                for (snap = txn->snapshots; snap; snap = snap->next) {
+                    snap->stale = 1;
+                }
+                keep = 0;
+                break;
+            }
+        }
+        if (keep) {
+            memcpy(txn->retired + txn->retired_count, pager->retired,
+                   pager->retired_count * sizeof(uint32_t));
+            txn->retired_count += pager->retired_count;
+        }
+    }
+
+    /* COMMIT POINT: the header switches to the new tree */
+    rc = pager_shadow_commit(pager, keep);
+    if (rc == 0 && txn->wal->sync_mode == WAL_SYNC_FULL) {
+        rc = pager_sync(pager);
+    }
+    txn_record_latency(txn, task_time_ms() - start_ms);
+
+    for (i = 0; i < count; i++) {
+        if (txn->writes[i].result == 0) {
+            entry = cache_find_entry(txn->cache, txn->writes[i].page_num);
+            entry->state = CACHE_ENTRY_CLEAN;
+            entry->txn_id = 0;
+        }
+    }
+
+    for (i = 0; i < txn->pinned_count; i++) {
+        cache_unpin(txn->cache, txn->pinned_pages[i]);
+    }
+
+    txn->commit_seq++;
+    txn_reset_lists(txn);
+    txn->shadow = 0;
+    txn->state = TXN_STATE_IDLE;
+    txn->commit_count++;
+
+    return (rc == 0) ? AMIDB_OK : AMIDB_IOERR;
+}
+
+/*
+ * Commit the current transaction (with eager checkpoint)
+ */
+int txn_commit(struct txn_context *txn)
+{
+    uint32_t i;
+    uint32_t count;
+    uint32_t start_ms;
+    uint32_t commit_offset;
+    int rc;
+    int checkpointed;
+    struct cache_entry *entry;
+    struct txn_spill_entry *spill;
+
+    if (!txn) {
+        return AMIDB_ERROR;
+    }
+
+    /* Check state */
+    if (txn->state != TXN_STATE_ACTIVE) {
+        return AMIDB_ERROR;
+    }
+
+    if (txn->shadow) {
+        return txn_commit_shadow(txn);
+    }
+
+    txn->state = TXN_STATE_COMMITTING;
+    start_ms = task_time_ms();
+
+    /* Room for the checkpoint's write list (failing here still aborts) */
+    while (txn->write_capacity < txn->dirty_count) {
+        rc = txn_grow_list((void **)&txn->writes, &txn->write_capacity,
+                           sizeof(struct pager_write));
+        if (rc != AMIDB_OK) {
+            txn_abort(txn);
+            return rc;
+        }
+    }
+
+    /* Step 1: Write all cached dirty pages to WAL */
+    /* (Spilled pages that were not reloaded are already logged) */
+    for (i = 0; i < txn->dirty_count; i++) {
+        uint32_t page_num = txn->dirty_pages[i];
+
+        /* Get page from cache */
+        entry = cache_find_entry(txn->cache, page_num);
+        if (entry && entry->state == CACHE_ENTRY_DIRTY) {
+            /* Write PAGE record to WAL (cached copy gets the same LSN) */
+            rc = txn_log_cached_page(txn, page_num, entry->data);
+            if (rc != AMIDB_OK) {
+                txn_abort(txn);
+                return rc;
+            }
+
+            txn->pages_logged++;
+        }
+    }
+
+    /* Step 2: Write COMMIT record */
+    rc = txn_log_record(txn, WAL_COMMIT, NULL, 0, &commit_offset);
+    if (rc != AMIDB_OK) {
+        txn_abort(txn);
+        return rc;
+    }
+
+    /* Step 3: Flush WAL to disk (DURABILITY POINT) */
+    rc = wal_flush(txn->wal);
+    if (rc != AMIDB_OK) {
+        /* At this point, WAL may be partially written, but COMMIT was not flushed */
+        /* On recovery, this transaction will be ignored (uncommitted) */
+        /* Its pages are left allocated: a leak rather than a guess */
+        txn->wal->pager->txn = NULL;
+        txn->state = TXN_STATE_IDLE;
+        return rc;
+    }
+
+    /* Transaction is now DURABLE */
+    txn->state = TXN_STATE_COMMITTED;
+    if (txn->wal->sync_mode != WAL_SYNC_OFF) {
+        txn->wal->sync_pending = 1;
+    }
+    txn_record_latency(txn, task_time_ms() - start_ms);
+
+    /* Open snapshots keep seeing the images this commit replaces */
+    /* (must happen before the checkpoint overwrites them on disk) */
+    txn_save_versions(txn);
+    txn->commit_seq++;
+
+    /* Change capture: copy the row changes to the change log while the */
+    /* WAL still holds them; if that fails, keep the WAL so recovery can */
+    checkpointed = (txn->row_count == 0 ||
+                    cdc_publish(txn->wal, txn->rows, txn->row_count,
+                                commit_offset) == AMIDB_OK);
+
+    /* Step 4: EAGER CHECKPOINT - Write dirty pages to main DB */
+    /* Cached pages go out sorted, consecutive ones in single writes */
+    count = 0;
+    for (i = 0; i < txn->dirty_count; i++) {
+        uint32_t page_num = txn->dirty_pages[i];
+
+        entry = cache_find_entry(txn->cache, page_num);
+        if (entry) {
+            /* Pages logged in step 1 are already stamped */
+            txn->writes[count].page_num = page_num;
+            txn->writes[count].data = entry->data;
+            txn->writes[count].stamped = (entry->state == CACHE_ENTRY_DIRTY);
+            count++;
+        } else {
+            /* Spilled page: read its image back from the WAL */
+            spill = txn_find_spilled(txn, page_num);
+            if (!spill ||
+                wal_read_page(txn->wal, spill->wal_offset, page_num, g_page_buf) != AMIDB_OK ||
+                pager_write_page(txn->wal->pager, page_num, g_page_buf) != AMIDB_OK) {
+                checkpointed = 0;
+            }
+        }
+    }
+
+    if (pager_write_batch(txn->wal->pager, txn->writes, count) != 0) {
+        /* Checkpoint failed, but transaction is already durable in WAL */
+        /* This is non-fatal - recovery will replay from WAL */
+        checkpointed = 0;
+    }
+
+    /* Mark written pages as clean */
+    for (i = 0; i < count; i++) {
+        if (txn->writes[i].result == 0) {
+            entry = cache_find_entry(txn->cache, txn->writes[i].page_num);
+            entry->state = CACHE_ENTRY_CLEAN;
+            entry->txn_id = 0;
+        }
+    }
+
+    /* Step 5: Sync main database and reset WAL (FULL), or leave both to */
+    /* a later checkpoint while the WAL still fits its region (NORMAL/OFF) */
+    /* A failed page write keeps the WAL for recovery to replay */
+    if (checkpointed &&
+        (txn->wal->sync_mode == WAL_SYNC_FULL || txn->wal->wal_head >= WAL_REGION_SIZE)) {
+        wal_checkpoint(txn->wal);
+    } else {
+        /* Live WAL: pager_close keeps the dirty flag so open recovers */
+        txn->wal->pager->header.wal_head = txn->wal->wal_head;
+    }
+
+    /* Step 6: Unpin all pages */
+    for (i = 0; i < txn->pinned_count; i++) {
+        cache_unpin(txn->cache, txn->pinned_pages[i]);
+    }
+
+    /* Pages the transaction freed can be reused now (or once no */
+    /* snapshot can read them) */
+    txn_settle_pages(txn, 1);
+
+    /* Reset state */
+    txn_reset_lists(txn);
+    txn->state = TXN_STATE_IDLE;
+    txn->commit_count++;
+    txn_release_retired(txn);
+
+    return AMIDB_OK;
+}
+
+/*
+ * Record a page allocated while the transaction is active
+ */
+int txn_note_allocation(struct txn_context *txn, uint32_t page_num)
+{
+    if (txn->allocated_count >= txn->allocated_capacity &&
+        txn_grow_list((void **)&txn->allocated, &txn->allocated_capacity,
+                      sizeof(uint32_t)) != AMIDB_OK) {
+        return AMIDB_NOMEM;
+    }
+
+    txn->allocated[txn->allocated_count++] = page_num;
+    return AMIDB_OK;
+}
+
+/*
+ * Record a page the active transaction frees (released at commit)
+ */
+int txn_defer_free(struct txn_context *txn, uint32_t page_num)
+{
+    if (txn->freed_count >= txn->freed_capacity &&
+        txn_grow_list((void **)&txn->freed, &txn->freed_capacity,
+                      sizeof(uint32_t)) != AMIDB_OK) {
+        return AMIDB_NOMEM;
+    }
+
+    txn->freed[txn->freed_count++] = page_num;
+    return AMIDB_OK;
+}
+
+/*
+ * Abort the current transaction
+ */
+int txn_abort(struct txn_context *txn)
+{
+    uint32_t i;
+    struct cache_entry *entry;
+    struct txn_undo_entry *undo;
+    uint8_t *data;
+    int result = AMIDB_OK;
+    int rc;
+
+    if (!txn) {
+        return AMIDB_ERROR;
+    }
+
+    if (txn->shadow) {
+        return txn_abort_shadow(txn);
+    }
+
+    txn->state = TXN_STATE_ABORTING;
+
+    /* Restore dirty pages from before-images, or from disk if none */
+    for (i = 0; i < txn->dirty_count; i++) {
+        uint32_t page_num = txn->dirty_pages[i];
+
+        entry = cache_find_entry(txn->cache, page_num);
+        if (entry) {
+            undo = txn_find_undo(txn, page_num);
+            if (undo) {
+                /* Restore from RAM (keeps pre-txn unflushed changes too) */
+                memcpy(entry->data, undo->image, AMIDB_PAGE_SIZE);
+                entry->state = undo->state;
+                txn->undo_restores++;
+            } else {
+                /* Read page from disk */
+                rc = pager_read_page(txn->wal->pager, page_num, g_page_buf);
+                if (rc == AMIDB_OK) {
+                    /* Restore clean version */
+                    memcpy(entry->data, g_page_buf, AMIDB_PAGE_SIZE);
+                    entry->state = CACHE_ENTRY_CLEAN;
+                } else {
+                    /* Read failed - invalidate cache entry */
+                    entry->state = CACHE_ENTRY_INVALID;
+                }
+                txn->disk_restores++;
+            }
+
+            entry->txn_id = 0;
+        }
+    }
+
+    /* Unpin all pages */
+    for (i = 0; i < txn->pinned_count; i++) {
+        cache_unpin(txn->cache, txn->pinned_pages[i]);
+    }
+
+    /* Spilled pages that are no longer cached need nothing if they were */
+    /* clean before: the database file still holds their committed */
+    /* version. One that was dirty before holds a change the file never */
+    /* saw, so it is loaded back (every other page can be evicted now) */
+    /* and its before-image restored. */
+    for (i = 0; i < txn->dirty_count; i++) {
+        uint32_t page_num = txn->dirty_pages[i];
+
+        undo = txn_find_undo(txn, page_num);
+        if (!undo || undo->state != CACHE_ENTRY_DIRTY ||
+            cache_find_entry(txn->cache, page_num)) {
+            continue;
+        }
+
+        if (cache_get_page(txn->cache, page_num, &data) != 0) {
+            result = AMIDB_IOERR;
+            continue;
+        }
+        memcpy(data, undo->image, AMIDB_PAGE_SIZE);
+        entry = cache_find_entry(txn->cache, page_num);
+        entry->state = undo->state;
+        entry->txn_id = 0;
+        cache_unpin(txn->cache, page_num);
+        txn->undo_restores++;
+    }
+
+    /* Pages the transaction allocated are free again */
+    txn_settle_pages(txn, 0);
+
+    /* Reset state and discard WAL buffer (and anything spilled to disk) */
+    txn_reset_lists(txn);
+    txn->state = TXN_STATE_IDLE;
+    txn->wal->buffer_used = txn->wal->txn_start_offset;
+    if (txn->wal->wal_head != txn->wal_start) {
+        /* Records that reached the disk must never be mistaken for newer */
+        /* ones, so checkpoint past them */
+        txn->wal->wal_head = txn->wal_start;
+        wal_checkpoint(txn->wal);
+    }
+    txn->abort_count++;
+
+    return result;
+}
+
+/*
+ * Add a page to the transaction's dirty page list
+ */
+int txn_add_dirty_page(struct txn_context *txn, uint32_t page_num)
+{
+    uint32_t i;
+
+    if (!txn) {
+        return AMIDB_ERROR;
+    }
+
+    /* Check if already in dirty list */
+    for (i = 0; i < txn->dirty_count; i++) {
+        if (txn->dirty_pages[i] == page_num) {
+            return AMIDB_OK;  /* Already tracked */
+        }
+    }
+
+    /* Add to dirty list */
+    if (txn->dirty_count >= txn->dirty_capacity &&
+        txn_grow_list((void **)&txn->dirty_pages, &txn->dirty_capacity,
+                      sizeof(uint32_t)) != AMIDB_OK) {
+        return AMIDB_NOMEM;
+    }
+
+    txn->dirty_pages[txn->dirty_count++] = page_num;
+
+    /* Also add to pinned list if not present */
+    for (i = 0; i < txn->pinned_count; i++) {
+        if (txn->pinned_pages[i] == page_num) {
+            return AMIDB_OK;  /* Already pinned */
+        }
+    }
+
+    if (txn->pinned_count >= txn->pinned_capacity &&
+        txn_grow_list((void **)&txn->pinned_pages, &txn->pinned_capacity,
+                      sizeof(uint32_t)) != AMIDB_OK) {
+        return AMIDB_NOMEM;
+    }
+
+    txn->pinned_pages[txn->pinned_count++] = page_num;
+
+    return AMIDB_OK;
+}
+
+/*
+ * Check if a page is dirty in this transaction
+ */
+int txn_is_page_dirty(struct txn_context *txn, uint32_t page_num)
+{
+    uint32_t i;
+
+    if (!txn) {
+        return 0;
+    }
+
+    for (i = 0; i < txn->dirty_count; i++) {
+        if (txn->dirty_pages[i] == page_num) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Save a page's before-image (copy-on-first-write)
+ */
+int txn_save_before_image(struct txn_context *txn, uint32_t page_num, const uint8_t *data)
+{
+    struct txn_undo_entry *undo;
+    struct cache_entry *entry;
+    uint32_t undo_mark = 0;
+    uint32_t dirty_mark = 0;
+    uint32_t wal_offset = 0;
+    uint8_t *image = NULL;
+    int32_t dirty_index;
+    uint32_t i;
+    int rc;
+
+    if (!txn || !data || txn->state != TXN_STATE_ACTIVE) {
+        return AMIDB_ERROR;
+    }
+
+    /* Shadow paging only ever writes pages new to the transaction */
+    if (txn->shadow) {
+        return AMIDB_OK;
+    }
+
+    /* Copies are taken per savepoint level */
+    if (txn->savepoint_count > 0) {
+        undo_mark = txn->savepoints[txn->savepoint_count - 1].undo_mark;
+        dirty_mark = txn->savepoints[txn->savepoint_count - 1].dirty_mark;
+    }
+
+    /* Already saved at this level */
+    for (i = undo_mark; i < txn->undo_count; i++) {
+        if (txn->undo[i].page_num == page_num) {
+            return AMIDB_OK;
+        }
+    }
+
+    /* First dirtied at this level without a copy: too late to save, */
+    /* and its before-image is on disk anyway */
+    dirty_index = txn_dirty_index(txn, page_num);
+    if (dirty_index >= (int32_t)dirty_mark) {
+        return AMIDB_OK;
+    }
+
+    /* Allocate the arena on first use */
+    if (!txn->undo_arena && txn->undo_limit > 0) {
+        txn->undo_arena = (uint8_t *)mem_alloc(txn->undo_limit * AMIDB_PAGE_SIZE, 0);
+        if (!txn->undo_arena) {
+            return AMIDB_NOMEM;
+        }
+    }
+
+    if (txn->undo_arena_used < txn->undo_limit) {
+        image = txn->undo_arena + txn->undo_arena_used * AMIDB_PAGE_SIZE;
+    } else if (dirty_index < 0) {
+        return AMIDB_FULL;  /* Abort falls back to disk reread */
+    }
+
+    if (txn->undo_count >= txn->undo_capacity &&
+        txn_grow_list((void **)&txn->undo, &txn->undo_capacity,
+                      sizeof(struct txn_undo_entry)) != AMIDB_OK) {
+        return AMIDB_NOMEM;
+    }
+
+    if (!image) {
+        /* A savepoint needs this mid-transaction state, which exists */
+        /* nowhere else: keep it in the WAL (recovery never replays it) */
+        rc = txn_log_image(txn, WAL_UNDO, page_num, data, &wal_offset);
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+    } else {
+        memcpy(image, data, AMIDB_PAGE_SIZE);
+        txn->undo_arena_used++;
+    }
+
+    entry = cache_find_entry(txn->cache, page_num);
+
+    undo = &txn->undo[txn->undo_count++];
+    undo->page_num = page_num;
+    undo->state = entry ? entry->state : CACHE_ENTRY_CLEAN;
+    undo->flags = (dirty_index >= 0) ? TXN_UNDO_IN_TXN : 0;
+    undo->image = image;
+    undo->wal_offset = wal_offset;
+
+    return AMIDB_OK;
+}
+
+/*
+ * Set the undo buffer size in pages
+ */
+int txn_set_undo_limit(struct txn_context *txn, uint32_t pages)
+{
+    if (!txn) {
+        return AMIDB_ERROR;
+    }
+
+    if (txn->state != TXN_STATE_IDLE) {
+        return AMIDB_BUSY;
+    }
+
+    /* Arena is reallocated at the new size on next use */
+    txn_free_undo(txn);
+    txn->undo_limit = pages;
+
+    return AMIDB_OK;
+}
+
+/*
+ * Find the newest savepoint with a name, or -1
+ */
+static int32_t txn_find_savepoint(struct txn_context *txn, const char *name)
+{
+    uint32_t i;
+
+    for (i = txn->savepoint_count; i > 0; i--) {
+        if (strcmp(txn->savepoints[i - 1].name, name) == 0) {
+            return (int32_t)(i - 1);
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Create a savepoint in the active transaction
+ */
+int txn_savepoint(struct txn_context *txn, const char *name)
+{
+    struct txn_savepoint *sp;
+
+    if (!txn || !name || txn->state != TXN_STATE_ACTIVE) {
+        return AMIDB_ERROR;
+    }
+
+    /* Rolling back would have to restore roots and freed pages too */
+    if (txn->shadow) {
+        return AMIDB_ERROR;
+    }
+
+    if (txn->savepoint_count >= TXN_MAX_SAVEPOINTS) {
+        return AMIDB_FULL;
+    }
+
+    sp = &txn->savepoints[txn->savepoint_count++];
+    strncpy(sp->name, name, sizeof(sp->name) - 1);
+    sp->name[sizeof(sp->name) - 1] = '\0';
+    sp->undo_mark = txn->undo_count;
+    sp->dirty_mark = txn->dirty_count;
+    sp->row_mark = txn->row_count;
+    sp->alloc_mark = txn->allocated_count;
+    sp->free_mark = txn->freed_count;
+
+    return AMIDB_OK;
+}
+
+/*
+ * Release a savepoint (and all savepoints created after it)
  */
-void txn_destroy(struct txn_context *txn)
+int txn_release_savepoint(struct txn_context *txn, const char *name)
 {
-    if (!txn) {
-        return;
+    int32_t index;
+
+    if (!txn || !name || txn->state != TXN_STATE_ACTIVE) {
+        return AMIDB_ERROR;
     }
 
-    /* Ensure transaction is not active */
-    if (txn->state == TXN_STATE_ACTIVE) {
-        txn_abort(txn);
+    index = txn_find_savepoint(txn, name);
+    if (index < 0) {
+        return AMIDB_NOTFOUND;
     }
 
-    mem_free(txn, sizeof(struct txn_context));
+    /* Undo entries stay: they now belong to the enclosing level */
+    txn->savepoint_count = (uint32_t)index;
+
+    return AMIDB_OK;
 }
 
 /*
- * Begin a new transaction
+ * Roll back to a savepoint
  */
-int txn_begin(struct txn_context *txn)
+int txn_rollback_to_savepoint(struct txn_context *txn, const char *name)
 {
+    struct txn_savepoint *sp;
+    struct txn_undo_entry *undo;
+    struct txn_spill_entry *spill;
+    struct cache_entry *entry;
+    uint8_t *data;
+    int32_t index;
+    uint32_t i, j;
+    int was_spilled;
     int rc;
 
-    if (!txn) {
+    if (!txn || !name || txn->state != TXN_STATE_ACTIVE) {
         return AMIDB_ERROR;
     }
 
-    /* Check state */
-    if (txn->state != TXN_STATE_IDLE) {
-        return AMIDB_BUSY;
+    index = txn_find_savepoint(txn, name);
+    if (index < 0) {
+        return AMIDB_NOTFOUND;
     }
+    sp = &txn->savepoints[index];
 
-    /* Transition to ACTIVE state */
-    txn->state = TXN_STATE_ACTIVE;
-    txn->txn_id = ++txn->wal->current_txn_id;
-    txn->dirty_count = 0;
-    txn->pinned_count = 0;
+    /* Change capture: recovery must drop the rows logged since, too */
+    if (txn->row_count > sp->row_mark) {
+        rc = txn_log_row_record(txn, CDC_TRUNCATE, "", (int32_t)sp->row_mark, NULL, 0, NULL);
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+        txn->row_count = sp->row_mark;
+    }
 
-    /* Write BEGIN record to WAL */
-    rc = wal_write_record(txn->wal, WAL_BEGIN, NULL, 0);
-    if (rc != AMIDB_OK) {
-        txn->state = TXN_STATE_IDLE;
-        return rc;
+    /* Step 1: Pages dirtied before the savepoint and modified since: */
+    /* restore their state at the savepoint. Walking the log backwards */
+    /* leaves each page with its earliest image after the mark. */
+    for (i = txn->undo_count; i > sp->undo_mark; i--) {
+        undo = &txn->undo[i - 1];
+        if (!(undo->flags & TXN_UNDO_IN_TXN) ||
+            txn_dirty_index(txn, undo->page_num) >= (int32_t)sp->dirty_mark) {
+            continue;  /* Page leaves the transaction in step 2 */
+        }
+
+        /* Bring the page in (reloads it if spilled), then overwrite */
+        if (cache_get_page(txn->cache, undo->page_num, &data) != 0) {
+            return AMIDB_ERROR;
+        }
+        if (undo->image) {
+            memcpy(data, undo->image, AMIDB_PAGE_SIZE);
+            rc = AMIDB_OK;
+        } else {
+            rc = wal_read_page(txn->wal, undo->wal_offset, undo->page_num, data);
+        }
+        entry = cache_find_entry(txn->cache, undo->page_num);
+        entry->state = CACHE_ENTRY_DIRTY;
+        entry->txn_id = txn->txn_id;
+        cache_unpin(txn->cache, undo->page_num);
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+        txn->undo_restores++;
+    }
+
+    /* Step 2: Pages first dirtied after the savepoint leave the transaction */
+    for (i = sp->dirty_mark; i < txn->dirty_count; i++) {
+        uint32_t page_num = txn->dirty_pages[i];
+
+        /* Forget any spilled image so a reload reads the database file */
+        was_spilled = 0;
+        spill = txn_find_spilled(txn, page_num);
+        if (spill) {
+            *spill = txn->spilled[--txn->spill_count];
+            was_spilled = 1;
+        }
+
+        /* Pre-transaction image, if one was saved */
+        undo = NULL;
+        for (j = sp->undo_mark; j < txn->undo_count; j++) {
+            if (txn->undo[j].page_num == page_num &&
+                !(txn->undo[j].flags & TXN_UNDO_IN_TXN)) {
+                undo = &txn->undo[j];
+                break;
+            }
+        }
+
+        entry = cache_find_entry(txn->cache, page_num);
+        if (undo && (entry || undo->state == CACHE_ENTRY_DIRTY)) {
+            /* Restore from RAM (loading the page if it was spilled) */
+            if (cache_get_page(txn->cache, page_num, &data) != 0) {
+                return AMIDB_ERROR;
+            }
+            memcpy(data, undo->image, AMIDB_PAGE_SIZE);
+            entry = cache_find_entry(txn->cache, page_num);
+            entry->state = undo->state;
+            entry->txn_id = 0;
+            cache_unpin(txn->cache, page_num);
+            txn->undo_restores++;
+        } else if (entry) {
+            /* Reread the committed version */
+            if (pager_read_page(txn->wal->pager, page_num, entry->data) == AMIDB_OK) {
+                entry->state = CACHE_ENTRY_CLEAN;
+            } else {
+                entry->state = CACHE_ENTRY_INVALID;
+            }
+            entry->txn_id = 0;
+            txn->disk_restores++;
+        }
+
+        /* A spilled image is already in the WAL; log the restored one */
+        /* after it so replay of this transaction ends with the right page */
+        if (was_spilled) {
+            if (undo) {
+                rc = txn_log_image(txn, WAL_PAGE, page_num, undo->image, NULL);
+            } else if (pager_read_page(txn->wal->pager, page_num, g_page_buf) == AMIDB_OK) {
+                rc = txn_log_image(txn, WAL_PAGE, page_num, g_page_buf, NULL);
+            } else {
+                return AMIDB_IOERR;
+            }
+            if (rc != AMIDB_OK) {
+                return rc;
+            }
+        }
+    }
+
+    /* Step 3: Pages allocated since are free again; pages freed since */
+    /* are still in use by the pages just restored */
+    if (txn->allocated_count > sp->alloc_mark) {
+        txn->wal->pager->txn = NULL;
+        rc = pager_free_pages(txn->wal->pager, txn->allocated + sp->alloc_mark,
+                              txn->allocated_count - sp->alloc_mark);
+        txn->wal->pager->txn = txn;
+        if (rc != 0) {
+            return AMIDB_IOERR;
+        }
     }
+    txn->allocated_count = sp->alloc_mark;
+    txn->freed_count = sp->free_mark;
+
+    /* Step 4: Truncate to the savepoint (it stays active) */
+    txn->dirty_count = sp->dirty_mark;
+    txn->undo_count = sp->undo_mark;
+    txn->undo_arena_used = 0;
+    for (i = 0; i < txn->undo_count; i++) {
+        if (txn->undo[i].image) {
+            txn->undo_arena_used++;
+        }
+    }
+    txn->savepoint_count = (uint32_t)index + 1;
 
     return AMIDB_OK;
 }
 
 /*
- * Commit the current transaction (with eager checkpoint)
+ * Log a row change for change capture
  */
-int txn_commit(struct txn_context *txn)
+int txn_log_row(struct txn_context *txn, uint8_t op, const char *table,
+                int32_t key, const uint8_t *row, uint32_t row_size)
 {
-    uint32_t i;
+    uint32_t offset;
     int rc;
-    struct cache_entry *entry;
-    struct {
-        uint32_t page_num;
-        uint8_t data[AMIDB_PAGE_SIZE];
-    } payload;
 
-    if (!txn) {
+    if (!txn || txn->state != TXN_STATE_ACTIVE ||
+        row_size > AMIDB_PAGE_SIZE - AMIDB_PAGE_HEADER_SIZE) {
         return AMIDB_ERROR;
     }
+    if (!txn->wal->cdc_handle) {
+        return AMIDB_OK;
+    }
 
-    /* Check state */
-    if (txn->state != TXN_STATE_ACTIVE) {
-        return AMIDB_ERROR;
+    if (txn->row_count >= txn->row_capacity) {
+        rc = txn_grow_list((void **)&txn->rows, &txn->row_capacity, sizeof(uint32_t));
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
     }
 
-    txn->state = TXN_STATE_COMMITTING;
+    rc = txn_log_row_record(txn, op, table, key, row, row_size, &offset);
+    if (rc != AMIDB_OK) {
+        return rc;
+    }
+    txn->rows[txn->row_count++] = offset;
 
-    /* Step 1: Write all dirty pages to WAL */
-    for (i = 0; i < txn->dirty_count; i++) {
-        uint32_t page_num = txn->dirty_pages[i];
+    return AMIDB_OK;
+}
 
-        /* Get page from cache */
-        entry = cache_find_entry(txn->cache, page_num);
-        if (entry && entry->state == CACHE_ENTRY_DIRTY) {
-            /* Prepare payload */
-            payload.page_num = page_num;
-            memcpy(payload.data, entry->data, AMIDB_PAGE_SIZE);
+/*
+ * Spill an uncommitted page to the WAL
+ */
+int txn_spill_page(struct txn_context *txn, uint32_t page_num, const uint8_t *data)
+{
+    struct txn_spill_entry *spill;
+    uint32_t offset;
+    int rc;
 
-            /* Write PAGE record to WAL */
-            rc = wal_write_record(txn->wal, WAL_PAGE, &payload, sizeof(payload));
-            if (rc != AMIDB_OK) {
-                txn_abort(txn);
-                return rc;
-            }
+    if (!txn || !data || txn->state != TXN_STATE_ACTIVE) {
+        return AMIDB_ERROR;
+    }
 
-            txn->pages_logged++;
+    /* Shadow paging: the page is unreachable from the committed tree, */
+    /* so it can go to its place in the file right away (and be read */
+    /* back from there) */
+    if (txn->shadow) {
+        if (pager_write_page(txn->wal->pager, page_num, data) != 0) {
+            return AMIDB_IOERR;
         }
+        txn->pages_spilled++;
+        return AMIDB_OK;
     }
 
-    /* Step 2: Write COMMIT record */
-    rc = wal_write_record(txn->wal, WAL_COMMIT, NULL, 0);
-    if (rc != AMIDB_OK) {
-        txn_abort(txn);
-        return rc;
+    /* Reserve a slot first so a failure leaves nothing half-done */
+    spill = txn_find_spilled(txn, page_num);
+    if (!spill && txn->spill_count >= txn->spill_capacity &&
+        txn_grow_list((void **)&txn->spilled, &txn->spill_capacity,
+                      sizeof(struct txn_spill_entry)) != AMIDB_OK) {
+        return AMIDB_NOMEM;
     }
 
-    /* Step 3: Flush WAL to disk (DURABILITY POINT) */
-    rc = wal_flush(txn->wal);
+    rc = txn_log_image(txn, WAL_PAGE, page_num, data, &offset);
     if (rc != AMIDB_OK) {
-        /* At this point, WAL may be partially written, but COMMIT was not flushed */
-        /* On recovery, this transaction will be ignored (uncommitted) */
-        txn->state = TXN_STATE_IDLE;
         return rc;
     }
 
-    /* Transaction is now DURABLE */
-    txn->state = TXN_STATE_COMMITTED;
+    /* A page spilled again simply points at its newest image */
+    if (!spill) {
+        spill = &txn->spilled[txn->spill_count++];
+        spill->page_num = page_num;
+    }
+    spill->wal_offset = offset;
 
-    /* Step 4: EAGER CHECKPOINT - Write dirty pages to main DB */
-    for (i = 0; i < txn->dirty_count; i++) {
-        uint32_t page_num = txn->dirty_pages[i];
+    txn->pages_spilled++;
 
-        entry = cache_find_entry(txn->cache, page_num);
-        if (entry) {
-            /* Write page to main database */
-            rc = pager_write_page(txn->wal->pager, page_num, entry->data);
-            if (rc != AMIDB_OK) {
-                /* Checkpoint failed, but transaction is already durable in WAL */
-                /* This is non-fatal - recovery will replay from WAL */
-                continue;
-            }
+    return AMIDB_OK;
+}
 
-            /* Mark page as clean */
-            entry->state = CACHE_ENTRY_CLEAN;
-            entry->txn_id = 0;
-        }
+/*
+ * Reload a spilled page
+ */
+int txn_load_spilled_page(struct txn_context *txn, uint32_t page_num, uint8_t *data)
+{
+    struct txn_spill_entry *spill;
+
+    if (!txn || !data) {
+        return AMIDB_ERROR;
     }
 
-    /* Sync main database */
-    pager_sync(txn->wal->pager);
+    if (txn->state != TXN_STATE_ACTIVE) {
+        return AMIDB_NOTFOUND;
+    }
 
-    /* Step 5: Reset WAL buffer (checkpoint complete) */
-    wal_reset_buffer(txn->wal);
+    spill = txn_find_spilled(txn, page_num);
+    if (!spill) {
+        return AMIDB_NOTFOUND;
+    }
 
-    /* Step 6: Unpin all pages */
-    for (i = 0; i < txn->pinned_count; i++) {
-        cache_unpin(txn->cache, txn->pinned_pages[i]);
+    return wal_read_page(txn->wal, spill->wal_offset, page_num, data);
+}
+
+/*
+ * Override the durability level for the current transaction
+ */
+int txn_set_durability(struct txn_context *txn, uint8_t level)
+{
+    if (!txn || txn->state != TXN_STATE_ACTIVE || level > WAL_SYNC_FULL) {
+        return AMIDB_ERROR;
     }
 
-    /* Reset state */
-    txn->dirty_count = 0;
-    txn->pinned_count = 0;
-    txn->state = TXN_STATE_IDLE;
-    txn->commit_count++;
+    txn->wal->sync_mode = level;
 
     return AMIDB_OK;
 }
 
 /*
- * Abort the current transaction
+ * Choose the commit mode
  */
-int txn_abort(struct txn_context *txn)
+int txn_set_commit_mode(struct txn_context *txn, uint8_t mode)
 {
-    uint32_t i;
+    if (!txn || mode > TXN_COMMIT_SHADOW) {
+        return AMIDB_ERROR;
+    }
+
+    if (txn->state != TXN_STATE_IDLE) {
+        return AMIDB_BUSY;
+    }
+
+    if (mode == TXN_COMMIT_SHADOW) {
+        /* Both need every change in the WAL */
+        if (txn->wal->cdc_handle || txn->wal->ship_handle) {
+            return AMIDB_BUSY;
+        }
+
+        /* Recovery must never replay old records over reused pages */
+        if (wal_checkpoint(txn->wal) != AMIDB_OK) {
+            return AMIDB_IOERR;
+        }
+    }
+
+    txn->commit_mode = mode;
+
+    return AMIDB_OK;
+}
+
+/*
+ * Copy a committed page for a shadow-paging transaction
+ */
+int txn_shadow_page(struct txn_context *txn, uint32_t page_num, uint32_t *page_out)
+{
+    struct amidb_pager *pager;
     struct cache_entry *entry;
-    uint8_t temp_buf[AMIDB_PAGE_SIZE];
+    uint8_t *src;
+    uint8_t *dst;
+    uint32_t copy;
     int rc;
 
-    if (!txn) {
+    if (!txn || !page_out) {
         return AMIDB_ERROR;
     }
 
-    txn->state = TXN_STATE_ABORTING;
+    *page_out = page_num;
+    if (txn->state != TXN_STATE_ACTIVE || !txn->shadow) {
+        return AMIDB_OK;
+    }
 
-    /* Reload dirty pages from disk (discard changes) */
-    for (i = 0; i < txn->dirty_count; i++) {
-        uint32_t page_num = txn->dirty_pages[i];
+    pager = txn->wal->pager;
+    if (pager_page_is_new(pager, page_num)) {
+        return AMIDB_OK;  /* Already the transaction's own */
+    }
 
-        entry = cache_find_entry(txn->cache, page_num);
-        if (entry) {
-            /* Read page from disk */
-            rc = pager_read_page(txn->wal->pager, page_num, temp_buf);
-            if (rc == AMIDB_OK) {
-                /* Restore clean version */
-                memcpy(entry->data, temp_buf, AMIDB_PAGE_SIZE);
-                entry->state = CACHE_ENTRY_CLEAN;
-            } else {
-                /* Read failed - invalidate cache entry */
-                entry->state = CACHE_ENTRY_INVALID;
-            }
+    if (pager_allocate_page(pager, &copy) != 0) {
+        return AMIDB_FULL;
+    }
 
-            entry->txn_id = 0;
-        }
+    if (cache_get_page(txn->cache, page_num, &src) != 0) {
+        pager_free_page(pager, copy);
+        return AMIDB_IOERR;
+    }
+    if (cache_new_page(txn->cache, copy, &dst) != 0) {
+        cache_unpin(txn->cache, page_num);
+        pager_free_page(pager, copy);
+        return AMIDB_NOMEM;
     }
 
-    /* Unpin all pages */
-    for (i = 0; i < txn->pinned_count; i++) {
-        cache_unpin(txn->cache, txn->pinned_pages[i]);
+    memcpy(dst, src, AMIDB_PAGE_SIZE);
+    cache_unpin(txn->cache, page_num);
+
+    cache_mark_dirty(txn->cache, copy);
+    entry = cache_find_entry(txn->cache, copy);
+    entry->txn_id = txn->txn_id;
+    rc = txn_add_dirty_page(txn, copy);
+    cache_unpin(txn->cache, copy);
+    if (rc != AMIDB_OK) {
+        return rc;
     }
 
-    /* Reset state and discard WAL buffer */
-    txn->dirty_count = 0;
-    txn->pinned_count = 0;
-    txn->state = TXN_STATE_IDLE;
-    txn->wal->buffer_used = txn->wal->txn_start_offset;
-    txn->abort_count++;
+    /* The original stays allocated until commit (it is still the */
+    /* committed version) */
+    if (pager_free_page(pager, page_num) != 0) {
+        return AMIDB_NOMEM;
+    }
+
+    txn->pages_shadowed++;
+    *page_out = copy;
 
     return AMIDB_OK;
 }
 
 /*
- * Add a page to the transaction's dirty page list
+ * Open a snapshot
  */
-int txn_add_dirty_page(struct txn_context *txn, uint32_t page_num)
+int txn_snapshot_open(struct txn_context *txn, struct txn_snapshot **snap_out)
 {
-    uint32_t i;
+    struct txn_snapshot *snap;
 
-    if (!txn) {
+    if (!txn || !snap_out) {
         return AMIDB_ERROR;
     }
 
-    /* Check if already in dirty list */
-    for (i = 0; i < txn->dirty_count; i++) {
-        if (txn->dirty_pages[i] == page_num) {
-            return AMIDB_OK;  /* Already tracked */
-        }
+    snap = (struct txn_snapshot *)mem_alloc(sizeof(struct txn_snapshot), AMIDB_MEM_CLEAR);
+    if (!snap) {
+        return AMIDB_NOMEM;
     }
 
-    /* Add to dirty list */
-    if (txn->dirty_count >= 64) {
-        return AMIDB_FULL;  /* Too many dirty pages */
-    }
+    snap->txn = txn;
+    snap->seq = txn->commit_seq;
+    snap->stale = 0;
+    snap->scratch = NULL;
+    snap->next = txn->snapshots;
+    txn->snapshots = snap;
 
-    txn->dirty_pages[txn->dirty_count++] = page_num;
+    *snap_out = snap;
+    return AMIDB_OK;
+}
 
-    /* Also add to pinned list if not present */
-    for (i = 0; i < txn->pinned_count; i++) {
-        if (txn->pinned_pages[i] == page_num) {
-            return AMIDB_OK;  /* Already pinned */
-        }
+/*
+ * Close a snapshot
+ */
+void txn_snapshot_close(struct txn_snapshot *snap)
+{
+    struct txn_context *txn;
+    struct txn_snapshot **link;
+    struct txn_snapshot *other;
+    uint32_t oldest;
+
+    if (!snap) {
+        return;
     }
 
-    if (txn->pinned_count >= 64) {
-        return AMIDB_FULL;
+    txn = snap->txn;
+    for (link = &txn->snapshots; *link; link = &(*link)->next) {
+        if (*link == snap) {
+            *link = snap->next;
+            break;
+        }
     }
 
-    txn->pinned_pages[txn->pinned_count++] = page_num;
+    /* Versions superseded no later than the oldest remaining snapshot */
+    /* are invisible to all of them */
+    oldest = 0xFFFFFFFF;
+    for (other = txn->snapshots; other; other = other->next) {
+        if (!other->stale && other->seq < oldest) {
+            oldest = other->seq;
+        }
+    }
+    txn_drop_versions(txn, oldest);
+    txn_release_retired(txn);
 
-    return AMIDB_OK;
+    if (snap->scratch) {
+        mem_free(snap->scratch, AMIDB_PAGE_SIZE);
+    }
+    mem_free(snap, sizeof(struct txn_snapshot));
 }
 
 /*
- * Check if a page is dirty in this transaction
+ * Get a page as seen by a snapshot
  */
-int txn_is_page_dirty(struct txn_context *txn, uint32_t page_num)
+int txn_snapshot_get_page(struct txn_snapshot *snap, uint32_t page_num, uint8_t **data_out)
 {
+    struct txn_context *txn;
+    struct txn_page_version *best;
+    const uint8_t *image;
     uint32_t i;
 
-    if (!txn) {
-        return 0;
+    if (!snap || !data_out) {
+        return AMIDB_ERROR;
+    }
+    if (snap->stale) {
+        return AMIDB_BUSY;
     }
+    txn = snap->txn;
 
-    for (i = 0; i < txn->dirty_count; i++) {
-        if (txn->dirty_pages[i] == page_num) {
-            return 1;
+    /* Pin like cache_get_page so callers unpin as usual */
+    if (cache_get_page(txn->cache, page_num, data_out) != 0) {
+        return AMIDB_IOERR;
+    }
+
+    /* Replaced by a later commit: the oldest version newer than us */
+    best = NULL;
+    for (i = 0; i < txn->version_count; i++) {
+        struct txn_page_version *v = &txn->versions[i];
+        if (v->page_num == page_num && v->superseded > snap->seq &&
+            (!best || v->superseded < best->superseded)) {
+            best = v;
         }
     }
+    if (best) {
+        *data_out = best->image;
+        return AMIDB_OK;
+    }
 
-    return 0;
+    /* Modified by the active transaction: its committed contents */
+    if (txn->state == TXN_STATE_ACTIVE && txn_dirty_index(txn, page_num) >= 0) {
+        if (!snap->scratch) {
+            snap->scratch = (uint8_t *)mem_alloc(AMIDB_PAGE_SIZE, 0);
+            if (!snap->scratch) {
+                cache_unpin(txn->cache, page_num);
+                return AMIDB_NOMEM;
+            }
+        }
+        image = txn_committed_image(txn, page_num, snap->scratch);
+        if (!image) {
+            cache_unpin(txn->cache, page_num);
+            return AMIDB_IOERR;
+        }
+        *data_out = (uint8_t *)image;
+    }
+
+    return AMIDB_OK;
+}
+
+/*
+ * Set the page version budget
+ */
+void txn_set_version_limit(struct txn_context *txn, uint32_t pages)
+{
+    if (txn) {
+        txn->version_limit = pages;
+    }
 }
@@ -23,11 +23,108 @@ typedef enum {
     TXN_STATE_COMMITTED       /* Commit complete (transient state) */
 } txn_state_t;
 
+/* Initial capacity of the dirty/pinned/spill lists (grown on demand) */
+#define TXN_INITIAL_PAGES 64
+
+/* Default before-image budget: 16 pages = 64KB */
+#define TXN_UNDO_DEFAULT_PAGES 16
+
+/* Commit latency histogram: bucket i counts commits that reached their */
+/* durability point in under 2^i ms (the last bucket takes the rest) */
+#define TXN_LATENCY_BUCKETS 12
+
+/* Commit modes (see txn_set_commit_mode) */
+#define TXN_COMMIT_WAL      0       /* Full-page WAL, eager checkpoint */
+#define TXN_COMMIT_SHADOW   1       /* Shadow paging, header swap */
+
+/* Undo entry flags */
+#define TXN_UNDO_IN_TXN 0x01        /* Page was already dirty in this txn */
+
+/*
+ * Before-Image
+ *
+ * Copy of a page taken just before it was first modified in the
+ * transaction, or first modified after the newest savepoint. Abort and
+ * ROLLBACK TO restore pages from these instead of rereading the disk.
+ */
+struct txn_undo_entry {
+    uint32_t page_num;              /* Page this image belongs to */
+    uint8_t  state;                 /* Cache state before the write */
+    uint8_t  flags;                 /* TXN_UNDO_* */
+    uint8_t  reserved[2];
+    uint8_t *image;                 /* Slot in the undo arena, or NULL ... */
+    uint32_t wal_offset;            /* ... if kept in a WAL_UNDO record */
+};
+
+/* Maximum savepoint nesting depth */
+#define TXN_MAX_SAVEPOINTS 16
+
+/*
+ * Savepoint
+ *
+ * Marks positions in the undo log and dirty list. Rolling back to it
+ * restores only the pages modified since it was taken.
+ */
+struct txn_savepoint {
+    char name[64];
+    uint32_t undo_mark;             /* undo_count when taken */
+    uint32_t dirty_mark;            /* dirty_count when taken */
+    uint32_t row_mark;              /* row_count when taken */
+    uint32_t alloc_mark;            /* allocated_count when taken */
+    uint32_t free_mark;             /* freed_count when taken */
+};
+
+/*
+ * Spilled Page
+ *
+ * An uncommitted page evicted from the cache under memory pressure. Its
+ * image lives in a WAL_PAGE record of the current transaction; the record
+ * is ignored by recovery unless the transaction commits.
+ */
+struct txn_spill_entry {
+    uint32_t page_num;              /* Spilled page */
+    uint32_t wal_offset;            /* Logical WAL offset of its PAGE record */
+};
+
+/* Default page version budget: 64 pages = 256KB */
+#define TXN_VERSION_DEFAULT_PAGES 64
+
+/*
+ * Page Version
+ *
+ * Committed image of a page that a later commit replaced, kept for as
+ * long as an open snapshot may still need it.
+ */
+struct txn_page_version {
+    uint32_t page_num;
+    uint32_t superseded;            /* commit_seq of the replacing commit */
+    uint8_t *image;                 /* AMIDB_PAGE_SIZE bytes */
+};
+
+/*
+ * Snapshot
+ *
+ * Read-only view of the database as committed when the snapshot was
+ * opened. Pages the writer has modified since are served from the
+ * before-images of the active transaction, or from page versions saved
+ * when later transactions committed, so the writer never waits for
+ * readers and readers never see half-applied changes.
+ */
+struct txn_snapshot {
+    struct txn_context *txn;
+    uint32_t seq;                   /* commit_seq when opened */
+    uint8_t stale;                  /* Versions it needed were dropped */
+    uint8_t reserved[3];
+    uint8_t *scratch;               /* Committed page reread from disk */
+    struct txn_snapshot *next;      /* Next open snapshot */
+};
+
 /*
  * Transaction Context
  *
  * Tracks all state for an active transaction, including dirty pages,
- * pinned pages, and transaction ID.
+ * pinned pages, and transaction ID. The page lists grow with the
+ * transaction, so its size is bounded by disk rather than RAM.
  */
 struct txn_context {
     struct wal_context *wal;        /* Associated WAL */
@@ -38,17 +135,80 @@ struct txn_context {
     uint64_t txn_id;                /* Current transaction ID */
 
     /* Dirty page tracking */
-    uint32_t dirty_pages[64];       /* Max 64 pages modified per txn */
+    uint32_t *dirty_pages;          /* Pages modified in this txn */
     uint32_t dirty_count;           /* Number of dirty pages */
+    uint32_t dirty_capacity;        /* Allocated slots */
 
     /* Pin tracking (to unpin on commit/abort) */
-    uint32_t pinned_pages[64];
+    uint32_t *pinned_pages;
     uint32_t pinned_count;
+    uint32_t pinned_capacity;
+
+    /* Pages spilled to the WAL under cache pressure */
+    struct txn_spill_entry *spilled;
+    uint32_t spill_count;
+    uint32_t spill_capacity;
+    uint32_t wal_start;             /* WAL head when the txn began */
+
+    /* Change capture: WAL offsets of this txn's WAL_ROW records */
+    uint32_t *rows;
+    uint32_t row_count;
+    uint32_t row_capacity;
+
+    /* Pages allocated in this txn (free again if it rolls back), and */
+    /* pages it freed (released only once it commits) */
+    uint32_t *allocated;
+    uint32_t allocated_count;
+    uint32_t allocated_capacity;
+    uint32_t *freed;
+    uint32_t freed_count;
+    uint32_t freed_capacity;
+
+    /* Eager checkpoint write list (sized at commit) */
+    struct pager_write *writes;
+    uint32_t write_capacity;
+
+    /* Undo buffer: before-images in one arena of undo_limit pages */
+    /* (allocated on first use; pages past the limit are reread from disk, */
+    /* or kept in the WAL when a savepoint needs their in-txn state) */
+    struct txn_undo_entry *undo;
+    uint32_t undo_count;
+    uint32_t undo_capacity;
+    uint8_t *undo_arena;
+    uint32_t undo_arena_used;       /* Arena slots in use */
+    uint32_t undo_limit;            /* Arena size in pages */
+
+    /* Nested savepoints (innermost last) */
+    struct txn_savepoint savepoints[TXN_MAX_SAVEPOINTS];
+    uint32_t savepoint_count;
+
+    /* Snapshot reads: open snapshots and the page versions they need */
+    uint32_t commit_seq;            /* Commits so far */
+    struct txn_snapshot *snapshots;
+    struct txn_page_version *versions;
+    uint32_t version_count;
+    uint32_t version_capacity;
+    uint32_t version_limit;         /* Budget in pages */
+
+    /* Shadow paging */
+    uint8_t commit_mode;            /* TXN_COMMIT_* for new transactions */
+    uint8_t shadow;                 /* Active transaction is a shadow one */
+    uint8_t reserved[2];
+    uint32_t *retired;              /* Pages replaced or freed by commits, */
+    uint32_t retired_count;         /* kept while snapshots may read them */
+    uint32_t retired_capacity;
 
     /* Statistics */
     uint32_t pages_logged;
+    uint32_t pages_spilled;
+    uint32_t undo_restores;         /* Pages restored from before-images */
+    uint32_t disk_restores;         /* Pages restored by rereading disk */
     uint32_t commit_count;
     uint32_t abort_count;
+    uint32_t versions_saved;        /* Page versions kept for snapshots */
+    uint32_t pages_shadowed;        /* Pages copied by shadow paging */
+    uint32_t commit_latency[TXN_LATENCY_BUCKETS];
+    uint32_t commit_latency_max;    /* Slowest commit in ms */
 };
 
 /*
@@ -68,13 +228,18 @@ struct txn_context *txn_create(struct wal_context *wal, struct page_cache *cache
 
 /*
  * Destroy transaction context
+ *
+ * All snapshots must be closed first.
  */
 void txn_destroy(struct txn_context *txn);
 
 /*
  * Begin a new transaction
  *
- * Writes a WAL_BEGIN record and transitions to TXN_STATE_ACTIVE.
+ * Writes a WAL_BEGIN record and transitions to TXN_STATE_ACTIVE. The
+ * file is flagged dirty first, so a crash before the next clean close
+ * triggers recovery on open. A shadow-paging transaction (see
+ * txn_set_commit_mode) logs nothing and needs no recovery.
  *
  * Returns: 0 on success, AMIDB_BUSY if transaction already active
  */
@@ -84,22 +249,48 @@ int txn_begin(struct txn_context *txn);
  * Commit the current transaction (with eager checkpoint)
  *
  * Algorithm:
- *   1. Write all dirty pages to WAL
+ *   1. Write all cached dirty pages to WAL (spilled pages are already
+ *      there; the WAL buffer is flushed whenever it fills)
  *   2. Write WAL_COMMIT record
  *   3. Flush WAL to disk (DURABILITY POINT)
- *   4. EAGER CHECKPOINT: Write dirty pages to main DB
- *   5. Reset WAL buffer
+ *   4. EAGER CHECKPOINT: Write dirty pages to main DB (spilled pages
+ *      are read back from the WAL)
+ *   5. FULL durability: sync main DB, raise the file's checkpoint LSN
+ *      and reset the WAL. NORMAL / OFF: keep the WAL until it outgrows
+ *      its region (see WAL_SYNC_*)
  *   6. Unpin all pages
  *
  * Returns: 0 on success, error code on failure
  */
 int txn_commit(struct txn_context *txn);
 
+/*
+ * Record a page the pager allocated while the transaction is active
+ *
+ * Abort, and ROLLBACK TO a savepoint taken before, free it again.
+ *
+ * Returns: AMIDB_OK, or AMIDB_NOMEM
+ */
+int txn_note_allocation(struct txn_context *txn, uint32_t page_num);
+
+/*
+ * Record a page the active transaction frees
+ *
+ * The page stays allocated until the transaction commits, so a rollback
+ * that brings back the pages pointing at it finds it intact.
+ *
+ * Returns: AMIDB_OK, or AMIDB_NOMEM
+ */
+int txn_defer_free(struct txn_context *txn, uint32_t page_num);
+
 /*
  * Abort the current transaction
  *
- * Discards all changes by reloading dirty pages from disk.
- * Unpins all pages.
+ * Discards all changes by restoring before-images from the undo buffer;
+ * pages without one are reloaded from disk. Spilled pages never reached
+ * the database file, so they are simply forgotten, unless they held a
+ * change from before the transaction: those are loaded back and their
+ * before-image restored. Unpins all pages.
  *
  * Returns: 0 on success, error code on failure
  */
@@ -114,7 +305,7 @@ int txn_abort(struct txn_context *txn);
  *   txn      - Transaction context
  *   page_num - Page number to track
  *
- * Returns: 0 on success, AMIDB_FULL if too many dirty pages
+ * Returns: 0 on success, AMIDB_NOMEM if the list cannot grow
  */
 int txn_add_dirty_page(struct txn_context *txn, uint32_t page_num);
 
@@ -125,4 +316,184 @@ int txn_add_dirty_page(struct txn_context *txn, uint32_t page_num);
  */
 int txn_is_page_dirty(struct txn_context *txn, uint32_t page_num);
 
+/*
+ * Save a page's before-image (copy-on-first-write)
+ *
+ * Must be called before the page is modified. Only the first call per
+ * page in a transaction (or since the newest savepoint) takes a copy;
+ * later calls are no-ops.
+ *
+ * Parameters:
+ *   txn      - Transaction context
+ *   page_num - Page about to be modified
+ *   data     - Current (unmodified) page contents
+ *
+ * Returns: 0 on success or if already saved,
+ *          AMIDB_FULL if the undo buffer is full (abort will reread disk)
+ */
+int txn_save_before_image(struct txn_context *txn, uint32_t page_num, const uint8_t *data);
+
+/*
+ * Set the undo buffer size in pages (0 disables before-images)
+ *
+ * Only allowed while no transaction is active.
+ *
+ * Returns: 0 on success, AMIDB_BUSY if a transaction is active
+ */
+int txn_set_undo_limit(struct txn_context *txn, uint32_t pages);
+
+/*
+ * Create a savepoint in the active transaction
+ *
+ * Savepoints nest; a name may be reused, in which case the newest one
+ * with that name is the one referenced by RELEASE / ROLLBACK TO.
+ *
+ * Returns: 0 on success, AMIDB_FULL if nested too deeply,
+ *          AMIDB_ERROR if no transaction is active or it is a
+ *          shadow-paging one
+ */
+int txn_savepoint(struct txn_context *txn, const char *name);
+
+/*
+ * Release a savepoint (and all savepoints created after it)
+ *
+ * Its changes become part of the enclosing savepoint or transaction.
+ *
+ * Returns: 0 on success, AMIDB_NOTFOUND if no such savepoint
+ */
+int txn_release_savepoint(struct txn_context *txn, const char *name);
+
+/*
+ * Roll back to a savepoint
+ *
+ * Restores the pages modified since the savepoint was taken and discards
+ * savepoints created after it. The savepoint itself stays active and
+ * the transaction continues.
+ *
+ * Returns: 0 on success, AMIDB_NOTFOUND if no such savepoint
+ */
+int txn_rollback_to_savepoint(struct txn_context *txn, const char *name);
+
+/*
+ * Log a row change for change capture (no-op unless it is enabled)
+ *
+ * op is CDC_INSERT, CDC_UPDATE or CDC_DELETE (see txn/cdc.h); row is the
+ * new serialized row (NULL for a delete). The record commits or rolls
+ * back with the transaction's pages.
+ *
+ * Returns: 0 on success, AMIDB_ERROR if no transaction is active,
+ *          other error on failure
+ */
+int txn_log_row(struct txn_context *txn, uint8_t op, const char *table,
+                int32_t key, const uint8_t *row, uint32_t row_size);
+
+/*
+ * Spill an uncommitted page to the WAL (called by the cache on eviction)
+ *
+ * Appends a WAL_PAGE record for the current transaction and remembers
+ * where it went, so the cache entry can be reused.
+ *
+ * Returns: 0 on success, error code on failure
+ */
+int txn_spill_page(struct txn_context *txn, uint32_t page_num, const uint8_t *data);
+
+/*
+ * Reload a spilled page (called by the cache on a miss)
+ *
+ * Returns: 0 if the page was spilled and has been copied to data,
+ *          AMIDB_NOTFOUND if it was not spilled, other error on failure
+ */
+int txn_load_spilled_page(struct txn_context *txn, uint32_t page_num, uint8_t *data);
+
+/*
+ * Set the durability level (WAL_SYNC_*) of the active transaction only
+ *
+ * The database default (wal_set_durability) applies again from the next
+ * transaction.
+ *
+ * Returns: 0 on success, AMIDB_ERROR if no transaction is active or the
+ *          level is unknown
+ */
+int txn_set_durability(struct txn_context *txn, uint8_t level);
+
+/*
+ * Choose how new transactions commit (TXN_COMMIT_*)
+ *
+ * TXN_COMMIT_SHADOW never overwrites a committed page. A page the
+ * transaction changes is first copied to a free page (txn_shadow_page)
+ * and its parent repointed at the copy, up to the B+Tree root. Commit
+ * writes each new page once, syncs, then writes the file header with
+ * the new catalog root and allocation bitmap: that one page write is
+ * the commit point, so a crash leaves the old tree or the new one and
+ * recovery has nothing to do. The replaced pages are freed then, or
+ * when the last snapshot that may read them closes; snapshots read the
+ * old tree in place, without page versions. Nothing is logged, so
+ * savepoints, change capture and log shipping need TXN_COMMIT_WAL.
+ *
+ * Switching to shadow paging checkpoints the WAL first.
+ *
+ * Returns: 0 on success, AMIDB_BUSY if a transaction is active or
+ *          change capture / log shipping is on, AMIDB_ERROR if the mode
+ *          is unknown, AMIDB_IOERR if the checkpoint failed
+ */
+int txn_set_commit_mode(struct txn_context *txn, uint8_t mode);
+
+/*
+ * Make a page writable by a shadow-paging transaction
+ *
+ * A page committed before the transaction began is copied to a newly
+ * allocated page (through the cache, dirty in the transaction) and the
+ * original is freed at commit; *page_out is then the copy and the
+ * caller must repoint whatever referenced the page. Pages allocated by
+ * the transaction itself, and all pages outside shadow paging, come
+ * back unchanged.
+ *
+ * Returns: 0 on success, error code on failure
+ */
+int txn_shadow_page(struct txn_context *txn, uint32_t page_num, uint32_t *page_out);
+
+/*
+ * Open a snapshot of the committed database
+ *
+ * May be called with or without an active transaction; the snapshot never
+ * sees that transaction's changes, nor those of transactions committed
+ * after it was opened. Only transactional writes are isolated: pages
+ * written outside a transaction are seen as they change.
+ *
+ * Returns: 0 on success, AMIDB_NOMEM on allocation failure
+ */
+int txn_snapshot_open(struct txn_context *txn, struct txn_snapshot **snap_out);
+
+/*
+ * Close a snapshot and free the page versions only it needed
+ */
+void txn_snapshot_close(struct txn_snapshot *snap);
+
+/*
+ * Get a page as seen by a snapshot
+ *
+ * Pins the page in the cache exactly like cache_get_page(), so callers
+ * unpin it the same way. The returned data must be treated as read-only
+ * and is valid until the page is unpinned or the next call on this
+ * snapshot.
+ *
+ * Returns: 0 on success,
+ *          AMIDB_BUSY if the snapshot is too old (its page versions were
+ *          dropped to stay within version_limit); reopen it
+ */
+int txn_snapshot_get_page(struct txn_snapshot *snap, uint32_t page_num, uint8_t **data_out);
+
+/*
+ * Set the page version budget (0 disables snapshots across commits)
+ *
+ * When a commit needs more, all open snapshots become stale instead of
+ * the writer waiting or failing.
+ */
+void txn_set_version_limit(struct txn_context *txn, uint32_t pages);
+
+/*
+ * Lower bound in ms of a commit latency histogram bucket
+ */
+uint32_t txn_latency_bucket_ms(uint32_t bucket);
+
 #endif /* AMIDB_TXN_H */
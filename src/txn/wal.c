@@ -3,13 +3,217 @@
  */
 
 #include "txn/wal.h"
+#include "txn/cdc.h"
+#include "txn/replica.h"
 #include "os/mem.h"
 #include "os/file.h"
+#include "os/task.h"
 #include "util/crc32.h"
+#include "util/endian.h"
 #include "api/error.h"
 #include <string.h>
 #include <stddef.h>  /* For offsetof */
 
+/*
+ * Open the overflow file that holds WAL data past the in-file region
+ *
+ * handle - Where to keep the handle (the writer task has its own)
+ * create - 1 to create the file if missing (writers), 0 for readers
+ */
+static int wal_open_overflow(struct wal_context *wal, void **handle, int create)
+{
+    char *path;
+    uint32_t path_size;
+
+    if (*handle) {
+        return AMIDB_OK;
+    }
+
+    path_size = strlen(wal->pager->file_path) + sizeof(WAL_OVERFLOW_SUFFIX);
+    path = (char *)mem_alloc(path_size, 0);
+    if (!path) {
+        return AMIDB_NOMEM;
+    }
+    strcpy(path, wal->pager->file_path);
+    strcat(path, WAL_OVERFLOW_SUFFIX);
+
+    if (create) {
+        *handle = file_open(path, AMIDB_O_RDWR | AMIDB_O_CREATE);
+    } else if (file_exists(path)) {
+        *handle = file_open(path, AMIDB_O_RDWR);
+    }
+
+    mem_free(path, path_size);
+
+    return *handle ? AMIDB_OK : AMIDB_IOERR;
+}
+
+/*
+ * Read or write WAL bytes at a logical offset
+ *
+ * Offsets below WAL_REGION_SIZE map into the database file's WAL region,
+ * everything beyond continues in the overflow file. A single request may
+ * straddle the boundary. The handles are the owner's or the writer's.
+ */
+static int wal_io_handles(struct wal_context *wal, amidb_file_t db_file,
+                          void **overflow, uint32_t offset, uint8_t *buf,
+                          uint32_t length, int is_write)
+{
+    amidb_file_t fh;
+    int32_t pos;
+    int32_t done;
+    uint32_t chunk;
+
+    while (length > 0) {
+        if (offset < WAL_REGION_SIZE) {
+            fh = db_file;
+            pos = WAL_REGION_START + offset;
+            chunk = WAL_REGION_SIZE - offset;
+        } else {
+            if (wal_open_overflow(wal, overflow, is_write) != AMIDB_OK) {
+                return AMIDB_IOERR;
+            }
+            fh = *overflow;
+            pos = offset - WAL_REGION_SIZE;
+            chunk = length;
+        }
+        if (chunk > length) {
+            chunk = length;
+        }
+
+        if (file_seek(fh, pos, AMIDB_SEEK_SET) != 0) {
+            return AMIDB_IOERR;
+        }
+
+        if (is_write) {
+            done = file_write(fh, buf, chunk);
+        } else {
+            done = file_read(fh, buf, chunk);
+        }
+        if (done != (int32_t)chunk) {
+            return AMIDB_IOERR;
+        }
+
+        offset += chunk;
+        buf += chunk;
+        length -= chunk;
+    }
+
+    return AMIDB_OK;
+}
+
+/*
+ * WAL I/O through the owner's handles
+ */
+static int wal_io(struct wal_context *wal, uint32_t offset, uint8_t *buf,
+                  uint32_t length, int is_write)
+{
+    return wal_io_handles(wal, wal->pager->file_handle, &wal->overflow_handle,
+                          offset, buf, length, is_write);
+}
+
+/*
+ * Write a buffer at a logical offset and sync it (unless sync_mode is OFF)
+ */
+static int wal_write_out(struct wal_context *wal, amidb_file_t db_file,
+                         void **overflow, uint32_t offset, uint8_t *buf,
+                         uint32_t length, uint8_t sync_mode)
+{
+    int rc;
+
+    rc = wal_io_handles(wal, db_file, overflow, offset, buf, length, 1);
+    if (rc != AMIDB_OK) {
+        return rc;
+    }
+
+    /* CRITICAL: Fsync for durability */
+    if (sync_mode != WAL_SYNC_OFF) {
+        if (file_sync(db_file) != 0) {
+            return AMIDB_IOERR;
+        }
+        if (*overflow && file_sync(*overflow) != 0) {
+            return AMIDB_IOERR;
+        }
+    }
+
+    return AMIDB_OK;
+}
+
+/*
+ * Background writer job: write out the buffer handed over by wal_submit
+ *
+ * Runs on the writer task. Only the flush_* fields and the writer's own
+ * handles are touched here; the owner leaves them alone until it has
+ * waited for the job.
+ */
+static int wal_writer_job(void *arg)
+{
+    struct wal_context *wal = (struct wal_context *)arg;
+
+    return wal_write_out(wal, wal->writer_file, &wal->writer_overflow,
+                         wal->flush_offset, wal->flush_buffer,
+                         wal->flush_length, wal->flush_sync);
+}
+
+/*
+ * Hand the active buffer to the disk and switch to the other buffer
+ *
+ * Without a writer the buffer is written inline. With one, only the
+ * previous in-flight buffer is waited for.
+ */
+static int wal_submit(struct wal_context *wal)
+{
+    int rc;
+
+    /* Nothing to flush */
+    if (wal->buffer_used == 0) {
+        return AMIDB_OK;
+    }
+
+    /* Check for 32-bit offset wrap (disk is the real limit) */
+    if (wal->wal_head + wal->buffer_used < wal->wal_head) {
+        return AMIDB_FULL;  /* Must checkpoint first */
+    }
+
+    if (!wal->writer) {
+        /* Write buffer to WAL region (continuing into overflow file) */
+        rc = wal_write_out(wal, wal->pager->file_handle, &wal->overflow_handle,
+                           wal->wal_head, wal->buffer, wal->buffer_used,
+                           wal->sync_mode);
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+    } else {
+        /* The other buffer must be free before recording moves there */
+        if (wal->flush_buffer) {
+            wal->flush_waits++;
+            rc = wal_wait(wal);
+            if (rc != AMIDB_OK) {
+                return rc;
+            }
+        }
+
+        wal->flush_buffer = wal->buffer;
+        wal->flush_offset = wal->wal_head;
+        wal->flush_length = wal->buffer_used;
+        wal->flush_sync = wal->sync_mode;
+        if (worker_submit((amidb_worker_t)wal->writer, wal_writer_job, wal) != 0) {
+            wal->flush_buffer = NULL;
+            return AMIDB_IOERR;
+        }
+
+        wal->buffer = (wal->buffer == wal->buffers[0]) ? wal->buffers[1] : wal->buffers[0];
+    }
+
+    /* Update WAL head and empty the buffer */
+    wal->wal_head += wal->buffer_used;
+    wal->buffer_used = 0;
+    wal->txn_start_offset = 0;
+    wal->flush_count++;
+
+    return AMIDB_OK;
+}
+
 /*
  * Create a new WAL context
  */
@@ -29,6 +233,7 @@ struct wal_context *wal_create(struct amidb_pager *pager)
 
     /* Initialize fields */
     wal->pager = pager;
+    wal->buffer = wal->buffers[0];
     wal->buffer_used = 0;
     wal->current_txn_id = 0;
     wal->txn_start_offset = 0;
@@ -36,6 +241,18 @@ struct wal_context *wal_create(struct amidb_pager *pager)
     wal->wal_tail = 0;
     wal->checkpoint_count = 0;
     wal->total_records = 0;
+    wal->durability = WAL_SYNC_FULL;
+    wal->sync_mode = WAL_SYNC_FULL;
+    wal->sync_pending = 0;
+
+    /* Everything up to the checkpoint LSN is already in the file */
+    wal->next_lsn = pager->header.checkpoint_lsn + 1;
+
+    /* Change capture stays on while the database has a change log */
+    if (!pager->read_only && cdc_open_log(wal, 0) != AMIDB_OK) {
+        mem_free(wal, sizeof(struct wal_context));
+        return NULL;
+    }
 
     return wal;
 }
@@ -49,6 +266,15 @@ void wal_destroy(struct wal_context *wal)
         return;
     }
 
+    wal_stop_writer(wal);
+
+    if (wal->overflow_handle) {
+        file_close(wal->overflow_handle);
+    }
+
+    cdc_close_log(wal);
+    replica_ship_stop(wal);
+
     mem_free(wal, sizeof(struct wal_context));
 }
 
@@ -57,21 +283,43 @@ void wal_destroy(struct wal_context *wal)
  */
 int wal_write_record(struct wal_context *wal, uint16_t type,
                      const void *payload, uint32_t payload_size)
+{
+    struct wal_segment seg;
+
+    if (payload_size > 0 && payload) {
+        seg.data = payload;
+        seg.length = payload_size;
+        seg.crc_known = 0;
+        return wal_write_record_gather(wal, type, &seg, 1);
+    }
+
+    return wal_write_record_gather(wal, type, NULL, 0);
+}
+
+/*
+ * Write a record gathered from payload segments
+ */
+int wal_write_record_gather(struct wal_context *wal, uint16_t type,
+                            const struct wal_segment *segs, uint32_t count)
 {
     struct wal_record_header hdr;
     uint32_t record_size;
     uint8_t *write_pos;
     uint32_t crc;
+    uint32_t i;
 
-    if (!wal) {
+    if (!wal || count > WAL_MAX_SEGMENTS || (count > 0 && !segs)) {
         return AMIDB_ERROR;
     }
 
-    record_size = sizeof(hdr) + payload_size;
+    record_size = sizeof(hdr);
+    for (i = 0; i < count; i++) {
+        record_size += segs[i].length;
+    }
 
     /* Check buffer space */
     if (wal->buffer_used + record_size > WAL_BUFFER_SIZE) {
-        return AMIDB_FULL;  /* Checkpoint should have prevented this */
+        return AMIDB_FULL;  /* Caller flushes and retries */
     }
 
     /* Build header (checksum will be computed last) */
@@ -79,32 +327,30 @@ int wal_write_record(struct wal_context *wal, uint16_t type,
     hdr.record_type = type;
     hdr.flags = 0;
     hdr.record_size = record_size;
+    hdr.lsn = wal->next_lsn;
     hdr.txn_id = wal->current_txn_id;
     hdr.checksum = 0;  /* Will be computed below */
 
-    /* Compute checksum (header + payload, excluding checksum field) */
+    /* Copy each segment into place, extending the checksum as we go */
+    /* (header fields before the checksum first) */
     crc32_init();
-    crc = 0;
-    /* Hash header fields before checksum */
-    crc = crc32_update(crc, (const uint8_t*)&hdr, offsetof(struct wal_record_header, checksum));
-    /* Hash payload if present */
-    if (payload_size > 0 && payload) {
-        crc = crc32_update(crc, (const uint8_t*)payload, payload_size);
+    crc = crc32_update(0, (const uint8_t*)&hdr, offsetof(struct wal_record_header, checksum));
+    write_pos = wal->buffer + wal->buffer_used + sizeof(hdr);
+    for (i = 0; i < count; i++) {
+        if (segs[i].crc_known) {
+            crc = crc32_combine(crc, segs[i].crc, segs[i].length);
+        } else {
+            crc = crc32_update(crc, (const uint8_t*)segs[i].data, segs[i].length);
+        }
+        memcpy(write_pos, segs[i].data, segs[i].length);
+        write_pos += segs[i].length;
     }
     hdr.checksum = crc;
 
-    /* Append to buffer */
-    write_pos = wal->buffer + wal->buffer_used;
-
-    /* Copy header */
-    memcpy(write_pos, &hdr, sizeof(hdr));
-
-    /* Copy payload if present */
-    if (payload_size > 0 && payload) {
-        memcpy(write_pos + sizeof(hdr), payload, payload_size);
-    }
+    memcpy(wal->buffer + wal->buffer_used, &hdr, sizeof(hdr));
 
     wal->buffer_used += record_size;
+    wal->next_lsn++;
     wal->total_records++;
 
     return AMIDB_OK;
@@ -115,47 +361,292 @@ int wal_write_record(struct wal_context *wal, uint16_t type,
  */
 int wal_flush(struct wal_context *wal)
 {
-    int32_t wal_file_offset;
-    int32_t bytes_written;
+    const uint8_t *tail;
+    uint32_t tail_offset;
     int rc;
 
     if (!wal) {
         return AMIDB_ERROR;
     }
 
-    /* Nothing to flush */
-    if (wal->buffer_used == 0) {
+    tail = wal->buffer;
+    tail_offset = wal->wal_head;
+
+    rc = wal_submit(wal);
+    if (rc != AMIDB_OK) {
+        return rc;
+    }
+
+    rc = wal_wait(wal);
+    if (rc != AMIDB_OK) {
+        return rc;
+    }
+
+    /* Durable now: the follower may have it (a shipping error only */
+    /* stops shipping) */
+    if (wal->ship_handle) {
+        replica_ship(wal, tail, tail_offset);
+    }
+
+    return AMIDB_OK;
+}
+
+/*
+ * Start flushing the WAL buffer without waiting for it
+ */
+int wal_flush_async(struct wal_context *wal)
+{
+    if (!wal) {
+        return AMIDB_ERROR;
+    }
+
+    return wal_submit(wal);
+}
+
+/*
+ * Wait for the buffer in flight
+ */
+int wal_wait(struct wal_context *wal)
+{
+    int rc;
+
+    if (!wal) {
+        return AMIDB_ERROR;
+    }
+
+    if (!wal->flush_buffer) {
         return AMIDB_OK;
     }
 
-    /* Calculate disk offset in WAL region */
-    wal_file_offset = WAL_REGION_START + wal->wal_head;
+    rc = worker_wait((amidb_worker_t)wal->writer);
+    wal->flush_buffer = NULL;
 
-    /* Check WAL region capacity */
-    if (wal->wal_head + wal->buffer_used > WAL_REGION_SIZE) {
-        return AMIDB_FULL;  /* Must checkpoint first */
+    return rc;
+}
+
+/*
+ * Start the background writer
+ */
+int wal_start_writer(struct wal_context *wal)
+{
+    if (!wal) {
+        return AMIDB_ERROR;
     }
 
-    /* Seek to WAL region */
-    rc = file_seek(wal->pager->file_handle, wal_file_offset, AMIDB_SEEK_SET);
-    if (rc != 0) {
-        return AMIDB_IOERR;
+    if (wal->writer) {
+        return AMIDB_OK;
     }
 
-    /* Write buffer to disk */
-    bytes_written = file_write(wal->pager->file_handle, wal->buffer, wal->buffer_used);
-    if (bytes_written != (int32_t)wal->buffer_used) {
+    /* Separate handle: the owner keeps seeking on the pager's */
+    wal->writer_file = file_open(wal->pager->file_path, AMIDB_O_RDWR);
+    if (!wal->writer_file) {
         return AMIDB_IOERR;
     }
 
-    /* CRITICAL: Fsync for durability */
-    rc = file_sync(wal->pager->file_handle);
-    if (rc != 0) {
-        return AMIDB_IOERR;
+    wal->writer = worker_create("AmiDB WAL writer");
+    if (!wal->writer) {
+        file_close(wal->writer_file);
+        wal->writer_file = NULL;
+        return AMIDB_NOMEM;
     }
 
-    /* Update WAL head */
-    wal->wal_head += wal->buffer_used;
+    return AMIDB_OK;
+}
+
+/*
+ * Stop the background writer
+ */
+int wal_stop_writer(struct wal_context *wal)
+{
+    int rc;
+
+    if (!wal || !wal->writer) {
+        return AMIDB_OK;
+    }
+
+    rc = wal_wait(wal);
+
+    worker_destroy((amidb_worker_t)wal->writer);
+    wal->writer = NULL;
+
+    file_close(wal->writer_file);
+    wal->writer_file = NULL;
+    if (wal->writer_overflow) {
+        file_close(wal->writer_overflow);
+        wal->writer_overflow = NULL;
+    }
+
+    return rc;
+}
+
+/*
+ * Read back a page image record from the WAL
+ */
+int wal_read_page(struct wal_context *wal, uint32_t record_offset,
+                  uint32_t page_num, uint8_t *page_data)
+{
+    struct wal_record_header hdr;
+    uint8_t num_buf[4];
+    uint32_t stored_page;
+    uint32_t crc;
+    int rc;
+
+    if (!wal || !page_data) {
+        return AMIDB_ERROR;
+    }
+
+    if (record_offset >= wal->wal_head ||
+        (wal->flush_buffer && record_offset >= wal->flush_offset)) {
+        /* Still in the active buffer, or in the one being written */
+        const uint8_t *rec;
+        uint32_t base;
+        uint32_t used;
+
+        if (record_offset >= wal->wal_head) {
+            rec = wal->buffer;
+            base = wal->wal_head;
+            used = wal->buffer_used;
+        } else {
+            rec = wal->flush_buffer;
+            base = wal->flush_offset;
+            used = wal->flush_length;
+        }
+        rec += record_offset - base;
+
+        if (record_offset - base + sizeof(hdr) + 4 + AMIDB_PAGE_SIZE > used) {
+            return AMIDB_CORRUPT;
+        }
+        memcpy(&hdr, rec, sizeof(hdr));
+        memcpy(num_buf, rec + sizeof(hdr), 4);
+        memcpy(page_data, rec + sizeof(hdr) + 4, AMIDB_PAGE_SIZE);
+    } else {
+        /* Flushed to disk */
+        rc = wal_io(wal, record_offset, (uint8_t *)&hdr, sizeof(hdr), 0);
+        if (rc == AMIDB_OK) {
+            rc = wal_io(wal, record_offset + sizeof(hdr), num_buf, 4, 0);
+        }
+        if (rc == AMIDB_OK) {
+            rc = wal_io(wal, record_offset + sizeof(hdr) + 4, page_data, AMIDB_PAGE_SIZE, 0);
+        }
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+    }
+
+    memcpy(&stored_page, num_buf, 4);
+    if (hdr.magic != 0x57414C52 ||
+        (hdr.record_type != WAL_PAGE && hdr.record_type != WAL_UNDO) ||
+        hdr.record_size != sizeof(hdr) + 4 + AMIDB_PAGE_SIZE ||
+        stored_page != page_num) {
+        return AMIDB_CORRUPT;
+    }
+
+    /* Verify checksum incrementally (header, page number, page data) */
+    crc32_init();
+    crc = crc32_update(0, (const uint8_t *)&hdr, offsetof(struct wal_record_header, checksum));
+    crc = crc32_update(crc, num_buf, 4);
+    crc = crc32_update(crc, page_data, AMIDB_PAGE_SIZE);
+    if (crc != hdr.checksum) {
+        return AMIDB_CORRUPT;
+    }
+
+    return AMIDB_OK;
+}
+
+/*
+ * Append a record taken from another WAL
+ */
+int wal_append_record(struct wal_context *wal, const uint8_t *record)
+{
+    struct wal_record_header hdr;
+    int rc;
+
+    if (!wal || !record) {
+        return AMIDB_ERROR;
+    }
+
+    memcpy(&hdr, record, sizeof(hdr));
+    if (hdr.record_size < sizeof(hdr) || hdr.record_size > WAL_MAX_RECORD_SIZE) {
+        return AMIDB_ERROR;
+    }
+
+    if (wal->buffer_used + hdr.record_size > WAL_BUFFER_SIZE) {
+        rc = wal_flush_async(wal);
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+    }
+
+    memcpy(wal->buffer + wal->buffer_used, record, hdr.record_size);
+    wal->buffer_used += hdr.record_size;
+    if (hdr.lsn >= wal->next_lsn) {
+        wal->next_lsn = hdr.lsn + 1;
+    }
+    wal->total_records++;
+
+    return AMIDB_OK;
+}
+
+/*
+ * Read back any record
+ */
+int wal_read_record(struct wal_context *wal, uint32_t record_offset,
+                    uint8_t *buf, uint32_t buf_size)
+{
+    struct wal_record_header hdr;
+    int rc;
+
+    if (!wal || !buf || buf_size < sizeof(hdr)) {
+        return AMIDB_ERROR;
+    }
+
+    if (record_offset >= wal->wal_head ||
+        (wal->flush_buffer && record_offset >= wal->flush_offset)) {
+        /* Still in the active buffer, or in the one being written */
+        const uint8_t *rec;
+        uint32_t base;
+        uint32_t used;
+        uint32_t avail;
+
+        if (record_offset >= wal->wal_head) {
+            rec = wal->buffer;
+            base = wal->wal_head;
+            used = wal->buffer_used;
+        } else {
+            rec = wal->flush_buffer;
+            base = wal->flush_offset;
+            used = wal->flush_length;
+        }
+        if (record_offset - base + sizeof(hdr) > used) {
+            return AMIDB_CORRUPT;
+        }
+        rec += record_offset - base;
+        avail = used - (record_offset - base);
+
+        memcpy(&hdr, rec, sizeof(hdr));
+        if (hdr.record_size < sizeof(hdr) || hdr.record_size > buf_size ||
+            hdr.record_size > avail) {
+            return AMIDB_CORRUPT;
+        }
+        memcpy(buf, rec, hdr.record_size);
+    } else {
+        /* Flushed to disk */
+        rc = wal_io(wal, record_offset, (uint8_t *)&hdr, sizeof(hdr), 0);
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+        if (hdr.record_size < sizeof(hdr) || hdr.record_size > buf_size) {
+            return AMIDB_CORRUPT;
+        }
+        rc = wal_io(wal, record_offset, buf, hdr.record_size, 0);
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+    }
+
+    if (hdr.magic != 0x57414C52 || !wal_verify_checksum(buf, hdr.record_size)) {
+        return AMIDB_CORRUPT;
+    }
 
     return AMIDB_OK;
 }
@@ -195,122 +686,245 @@ int wal_verify_checksum(const uint8_t *record_data, uint32_t record_size)
     return (computed_checksum == stored_checksum) ? 1 : 0;
 }
 
+/*
+ * PAGE record of the transaction being scanned by recovery
+ */
+struct wal_pending_page {
+    uint32_t offset;         /* Logical WAL offset of the record */
+    uint32_t page_num;
+    uint32_t lsn;
+};
+
+/*
+ * Grow one of recovery's lists (doubling, starting at 64 entries)
+ */
+static int wal_grow_list(void **list, uint32_t *capacity, uint32_t elem_size)
+{
+    uint32_t new_capacity;
+    void *grown;
+
+    new_capacity = *capacity ? *capacity * 2 : 64;
+    grown = mem_realloc(*list, *capacity * elem_size, new_capacity * elem_size, 0);
+    if (!grown) {
+        return AMIDB_NOMEM;
+    }
+
+    *list = grown;
+    *capacity = new_capacity;
+
+    return AMIDB_OK;
+}
+
+/*
+ * Replay the pending PAGE records of a committed transaction
+ *
+ * An image is only written if the page on disk is older than it, so
+ * pages already checkpointed (or replayed by an earlier, interrupted
+ * recovery) are left alone.
+ */
+static int wal_apply_pending(struct wal_context *wal,
+                             const struct wal_pending_page *pending,
+                             uint32_t count, uint8_t *page_buf)
+{
+    uint32_t disk_lsn;
+    uint32_t i;
+    int rc;
+
+    for (i = 0; i < count; i++) {
+        if (pending[i].lsn <= wal->pager->header.checkpoint_lsn) {
+            wal->recovered_skipped++;
+            continue;
+        }
+
+        /* A page that cannot be read (e.g. torn write) counts as oldest */
+        disk_lsn = 0;
+        if (pager_read_page(wal->pager, pending[i].page_num, page_buf) == 0) {
+            disk_lsn = pager_get_page_lsn(page_buf);
+        }
+        if (disk_lsn >= pending[i].lsn) {
+            wal->recovered_skipped++;
+            continue;
+        }
+
+        rc = wal_read_page(wal, pending[i].offset, pending[i].page_num, page_buf);
+        if (rc != AMIDB_OK) {
+            return rc;
+        }
+
+        /* Write page to main database (bypass transaction) */
+        rc = pager_write_page(wal->pager, pending[i].page_num, page_buf);
+        if (rc != 0) {
+            return rc;
+        }
+        wal->recovered_pages++;
+    }
+
+    return AMIDB_OK;
+}
+
 /*
  * Crash Recovery: Replay committed transactions from WAL
  */
 int wal_recover(struct wal_context *wal)
 {
-    uint8_t *wal_buffer;
-    uint64_t committed_txns[WAL_MAX_RECORDS];
-    uint32_t num_committed;
-    uint32_t offset;
     struct wal_record_header hdr;
-    int32_t bytes_read;
+    struct wal_pending_page *pending;
+    uint32_t pending_count;
+    uint32_t pending_capacity;
+    uint32_t *rows;
+    uint32_t row_count;
+    uint32_t row_capacity;
+    uint8_t row_header[CDC_ROW_HEADER_SIZE];
+    uint64_t scan_txn_id;
+    uint32_t last_lsn;
+    uint32_t offset;
+    uint8_t *page_buf;
     int rc;
 
     if (!wal) {
         return AMIDB_ERROR;
     }
 
-    /* Allocate temporary buffer for entire WAL region (128KB) */
-    wal_buffer = (uint8_t *)mem_alloc(WAL_REGION_SIZE, 0);
-    if (!wal_buffer) {
+    /* One buffer for checking records, then for LSN checks and replay */
+    page_buf = (uint8_t *)mem_alloc(WAL_MAX_RECORD_SIZE, 0);
+    if (!page_buf) {
         return AMIDB_NOMEM;
     }
 
-    /* Read entire WAL region from disk */
-    rc = file_seek(wal->pager->file_handle, WAL_REGION_START, AMIDB_SEEK_SET);
-    if (rc != 0) {
-        mem_free(wal_buffer, WAL_REGION_SIZE);
-        return AMIDB_IOERR;
-    }
-
-    bytes_read = file_read(wal->pager->file_handle, wal_buffer, WAL_REGION_SIZE);
-    if (bytes_read < 0) {
-        mem_free(wal_buffer, WAL_REGION_SIZE);
-        return AMIDB_IOERR;
-    }
-
-    /* PASS 1: Find all committed transaction IDs */
-    num_committed = 0;
+    pending = NULL;
+    pending_count = 0;
+    pending_capacity = 0;
+    rows = NULL;
+    row_count = 0;
+    row_capacity = 0;
+    scan_txn_id = 0;
+    last_lsn = 0;
     offset = 0;
+    rc = AMIDB_OK;
 
-    while (offset < wal->wal_head && offset + sizeof(hdr) <= WAL_REGION_SIZE) {
-        /* Copy header */
-        memcpy(&hdr, wal_buffer + offset, sizeof(hdr));
+    wal->recovered_records = 0;
+    wal->recovered_pages = 0;
+    wal->recovered_skipped = 0;
 
-        /* Validate magic */
-        if (hdr.magic != 0x57414C52) {
-            break;  /* Stop at corruption */
+    /* The header's WAL head is not trusted; the records delimit the log */
+    for (;;) {
+        /* Read header */
+        if (wal_io(wal, offset, (uint8_t *)&hdr, sizeof(hdr), 0) != AMIDB_OK) {
+            break;  /* Stop at end of readable WAL */
         }
 
-        /* Verify checksum */
-        if (!wal_verify_checksum(wal_buffer + offset, hdr.record_size)) {
-            break;  /* Stop at checksum failure */
+        /* Validate magic, size and LSN order */
+        if (hdr.magic != 0x57414C52 ||
+            hdr.record_size < sizeof(hdr) ||
+            hdr.record_size > WAL_MAX_RECORD_SIZE ||
+            offset + hdr.record_size < offset ||
+            hdr.lsn <= last_lsn) {
+            break;  /* Stop at corruption or stale tail */
         }
 
-        /* Track COMMIT records */
-        if (hdr.record_type == WAL_COMMIT) {
-            if (num_committed < WAL_MAX_RECORDS) {
-                committed_txns[num_committed++] = hdr.txn_id;
-            }
+        /* Every record is verified before anything is replayed: a torn */
+        /* page image ends the log here, so a COMMIT after it cannot */
+        /* apply the rest of its transaction */
+        if (wal_io(wal, offset, page_buf, hdr.record_size, 0) != AMIDB_OK ||
+            !wal_verify_checksum(page_buf, hdr.record_size)) {
+            break;  /* Stop at checksum failure */
         }
 
-        offset += hdr.record_size;
-    }
-
-    /* PASS 2: Replay PAGE records for committed transactions only */
-    offset = 0;
-
-    while (offset < wal->wal_head && offset + sizeof(hdr) <= WAL_REGION_SIZE) {
-        /* Copy header */
-        memcpy(&hdr, wal_buffer + offset, sizeof(hdr));
-
-        /* Validate magic */
-        if (hdr.magic != 0x57414C52) {
-            break;
+        if (hdr.record_type == WAL_BEGIN || hdr.txn_id != scan_txn_id) {
+            pending_count = 0;
+            row_count = 0;
+            scan_txn_id = hdr.txn_id;
         }
 
-        /* Check if this transaction committed */
-        int is_committed = 0;
-        uint32_t i;
-        for (i = 0; i < num_committed; i++) {
-            if (committed_txns[i] == hdr.txn_id) {
-                is_committed = 1;
+        if (hdr.record_type == WAL_PAGE) {
+            if (pending_count == pending_capacity &&
+                wal_grow_list((void **)&pending, &pending_capacity,
+                              sizeof(struct wal_pending_page)) != AMIDB_OK) {
+                rc = AMIDB_NOMEM;
                 break;
             }
-        }
 
-        /* Replay PAGE records for committed transactions */
-        if (is_committed && hdr.record_type == WAL_PAGE) {
-            struct wal_page_record *page_rec;
-            page_rec = (struct wal_page_record *)(wal_buffer + offset);
-
-            /* Write page to main database (bypass transaction) */
-            rc = pager_write_page(wal->pager, page_rec->page_num, page_rec->page_data);
-            if (rc != 0) {
-                mem_free(wal_buffer, WAL_REGION_SIZE);
-                return rc;
+            /* Page number follows the header */
+            if (hdr.record_size < sizeof(hdr) + 4) {
+                break;
+            }
+            memcpy(&pending[pending_count].page_num, page_buf + sizeof(hdr), 4);
+            pending[pending_count].offset = offset;
+            pending[pending_count].lsn = hdr.lsn;
+            pending_count++;
+        } else if (hdr.record_type == WAL_ROW) {
+            /* Row change: op and key (or, for CDC_TRUNCATE, rows kept) */
+            if (hdr.record_size < sizeof(hdr) + 8) {
+                break;
+            }
+            memcpy(row_header, page_buf + sizeof(hdr), 8);
+            if (row_header[0] == CDC_TRUNCATE) {
+                if (get_u32(row_header + 4) < row_count) {
+                    row_count = get_u32(row_header + 4);
+                }
+            } else {
+                if (row_count == row_capacity &&
+                    wal_grow_list((void **)&rows, &row_capacity, sizeof(uint32_t)) != AMIDB_OK) {
+                    rc = AMIDB_NOMEM;
+                    break;
+                }
+                rows[row_count++] = offset;
+            }
+        } else if (hdr.record_type == WAL_COMMIT) {
+            /* Everything scanned so far is on disk, not in the buffer */
+            wal->wal_head = offset + hdr.record_size;
+            wal->buffer_used = 0;
+            rc = wal_apply_pending(wal, pending, pending_count, page_buf);
+            if (rc != AMIDB_OK) {
+                break;
             }
+            pending_count = 0;
+
+            /* Row changes the change log missed (it skips what it has) */
+            if (row_count > 0 && wal->cdc_handle) {
+                rc = cdc_publish(wal, rows, row_count, offset);
+                if (rc != AMIDB_OK) {
+                    break;
+                }
+            }
+            row_count = 0;
         }
+        /* WAL_UNDO records only matter to a live transaction */
 
+        wal->recovered_records++;
+        last_lsn = hdr.lsn;
         offset += hdr.record_size;
     }
 
+    if (pending) {
+        mem_free(pending, pending_capacity * sizeof(struct wal_pending_page));
+    }
+    if (rows) {
+        mem_free(rows, row_capacity * sizeof(uint32_t));
+    }
+    mem_free(page_buf, WAL_MAX_RECORD_SIZE);
+
+    if (rc != AMIDB_OK) {
+        return rc;
+    }
+
     /* Sync main database */
     rc = pager_sync(wal->pager);
     if (rc != 0) {
-        mem_free(wal_buffer, WAL_REGION_SIZE);
         return rc;
     }
 
+    /* New records must sort after everything in the log */
+    if (last_lsn > wal->pager->header.checkpoint_lsn) {
+        wal->pager->header.checkpoint_lsn = last_lsn;
+    }
+    wal->next_lsn = wal->pager->header.checkpoint_lsn + 1;
+
     /* Clear WAL region */
     wal->wal_head = 0;
     wal->wal_tail = 0;
     wal->buffer_used = 0;
-
-    /* Free temporary buffer */
-    mem_free(wal_buffer, WAL_REGION_SIZE);
+    wal->ship_offset = 0;
 
     return AMIDB_OK;
 }
@@ -324,7 +938,68 @@ void wal_reset_buffer(struct wal_context *wal)
         return;
     }
 
+    wal_wait(wal);
+
     wal->buffer_used = 0;
     wal->wal_head = 0;
     wal->wal_tail = 0;
+    wal->ship_offset = 0;
+}
+
+/*
+ * Set the default durability level
+ */
+int wal_set_durability(struct wal_context *wal, uint8_t level)
+{
+    if (!wal || level > WAL_SYNC_FULL) {
+        return AMIDB_ERROR;
+    }
+
+    wal->durability = level;
+
+    return AMIDB_OK;
+}
+
+/*
+ * Checkpoint the database file and reset the WAL
+ */
+int wal_checkpoint(struct wal_context *wal)
+{
+    struct amidb_pager *pager;
+
+    if (!wal) {
+        return AMIDB_ERROR;
+    }
+
+    /* The WAL must not change under the writer */
+    if (wal_wait(wal) != AMIDB_OK) {
+        return AMIDB_IOERR;
+    }
+
+    /* Nothing logged since the last checkpoint */
+    pager = wal->pager;
+    if (pager->header.checkpoint_lsn == wal->next_lsn - 1) {
+        return AMIDB_OK;
+    }
+
+    /* Committed pages must be on disk before the WAL is reused. This */
+    /* goes by the commits in the WAL, not by sync_mode: an OFF */
+    /* transaction (or its abort) can checkpoint NORMAL commits */
+    if (wal->sync_pending) {
+        if (pager_sync(pager) != 0) {
+            return AMIDB_IOERR;
+        }
+        wal->sync_pending = 0;
+    }
+
+    /* Record that the file now holds everything logged so far */
+    /* (synced along with the next WAL flush or at close) */
+    pager->header.checkpoint_lsn = wal->next_lsn - 1;
+    pager->header.wal_head = 0;
+    pager_write_header(pager);
+
+    wal_reset_buffer(wal);
+    wal->checkpoint_count++;
+
+    return AMIDB_OK;
 }
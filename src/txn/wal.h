@@ -3,8 +3,16 @@
  *
  * Implements write-ahead logging for crash recovery and ACID transactions.
  * WAL region is stored at pages 3-34 (128KB) in the database file.
+ * WAL data beyond the region continues in an overflow file (<db>-wal),
+ * so large transactions are bounded by disk space, not by the region.
  *
- * Design: Eager checkpoint (checkpoint after every commit)
+ * Design: Eager checkpoint (committed pages are written to the database
+ * file at every commit). How often the file is synced and the WAL reset
+ * depends on the durability level.
+ *
+ * The WAL has two buffers. With a background writer started, a full
+ * buffer is written and synced by the writer while records go into the
+ * other one; without it, flushes happen inline.
  */
 
 #ifndef AMIDB_WAL_H
@@ -16,10 +24,10 @@
 /*
  * WAL Configuration
  */
-#define WAL_BUFFER_SIZE  32768        /* 32 KB in-memory buffer */
+#define WAL_BUFFER_SIZE  32768        /* 32 KB per in-memory buffer */
 #define WAL_REGION_START 0x3000       /* Page 3 offset (12KB) */
 #define WAL_REGION_SIZE  (32 * AMIDB_PAGE_SIZE)  /* 128 KB on disk (pages 3-34) */
-#define WAL_MAX_RECORDS  256          /* Maximum records to track in recovery */
+#define WAL_OVERFLOW_SUFFIX "-wal"    /* Overflow file: <db path>-wal */
 
 /*
  * WAL Record Types
@@ -28,25 +36,50 @@
 #define WAL_COMMIT     0x0002  /* Transaction commit */
 #define WAL_ABORT      0x0003  /* Transaction abort */
 #define WAL_PAGE       0x0010  /* Full page image */
+#define WAL_UNDO       0x0011  /* Savepoint before-image (never replayed) */
+#define WAL_ROW        0x0030  /* Row change for change capture (txn/cdc.h) */
 #define WAL_CHECKPOINT 0x0020  /* Checkpoint marker */
 
 /*
- * WAL Record Header (24 bytes)
+ * Durability Levels
+ *
+ * FULL   - WAL and database file synced at every commit; the WAL is
+ *          reset each time (default)
+ * NORMAL - Only the WAL is synced at commit. Committed pages are still
+ *          written to the database file, but it is synced, and the WAL
+ *          reset, only at checkpoint (when the WAL outgrows its region,
+ *          on wal_checkpoint, or at the next FULL commit). Commits are
+ *          as durable and atomic as with FULL.
+ * OFF    - Nothing is synced; the OS decides when data reaches the disk.
+ *          Survives a crashed program, not a crashed machine.
+ */
+#define WAL_SYNC_OFF     0
+#define WAL_SYNC_NORMAL  1
+#define WAL_SYNC_FULL    2
+
+/*
+ * WAL Record Header (28 bytes)
  *
  * Every WAL record starts with this header.
  * The checksum covers the entire record (header + payload).
+ *
+ * LSNs increase by one per record and never go back, so the valid part
+ * of the log is the run of records whose LSNs keep increasing; anything
+ * after that is left over from an older, longer transaction. A PAGE
+ * record's image carries the record's LSN in its page header.
  */
 struct wal_record_header {
     uint32_t magic;          /* 0x57414C52 ("WALR" in ASCII) */
     uint16_t record_type;    /* WAL_* type */
     uint16_t flags;          /* Reserved for future use */
     uint32_t record_size;    /* Total size including header */
+    uint32_t lsn;            /* Log sequence number */
     uint64_t txn_id;         /* Transaction ID */
     uint32_t checksum;       /* CRC32 of entire record */
 };
 
 /*
- * WAL Page Record (24 + 4 + 4096 = 4124 bytes)
+ * WAL Page Record (28 + 4 + 4096 = 4128 bytes)
  *
  * Stores a full page image for recovery.
  */
@@ -56,6 +89,27 @@ struct wal_page_record {
     uint8_t  page_data[AMIDB_PAGE_SIZE];  /* Full 4KB page */
 };
 
+/* Largest record: a WAL_ROW with a full row (at most a page minus its */
+/* header) and table name fits, too */
+#define WAL_MAX_RECORD_SIZE (sizeof(struct wal_page_record) + 64)
+
+/*
+ * Record payload segment for wal_write_record_gather
+ *
+ * Lets a record be assembled straight from where its parts live (e.g. a
+ * page image in the cache) instead of copying them together first. If
+ * crc_known is set, crc must be crc32_compute(data, length); it is then
+ * folded into the record checksum instead of rescanning the bytes.
+ */
+struct wal_segment {
+    const void *data;
+    uint32_t length;
+    uint32_t crc;
+    uint8_t crc_known;
+};
+
+#define WAL_MAX_SEGMENTS 4
+
 /*
  * WAL Context
  *
@@ -64,21 +118,56 @@ struct wal_page_record {
 struct wal_context {
     struct amidb_pager *pager;       /* For WAL region I/O */
 
-    /* In-memory buffer */
-    uint8_t buffer[WAL_BUFFER_SIZE]; /* 32KB buffer */
-    uint32_t buffer_used;            /* Bytes used in buffer */
+    /* In-memory buffers */
+    uint8_t buffers[2][WAL_BUFFER_SIZE];
+    uint8_t *buffer;                 /* Active buffer (records go here) */
+    uint32_t buffer_used;            /* Bytes used in active buffer */
 
     /* Current transaction tracking */
     uint64_t current_txn_id;         /* Incrementing counter */
+    uint32_t next_lsn;               /* LSN of the next record written */
     uint32_t txn_start_offset;       /* Where current txn starts in buffer */
 
+    /* Durability */
+    uint8_t durability;              /* Database default (WAL_SYNC_*) */
+    uint8_t sync_mode;               /* Level of the current transaction */
+    uint8_t sync_pending;            /* A NORMAL/FULL commit since the last */
+                                     /* checkpoint: it must sync the file */
+
     /* WAL region tracking (on disk) */
     uint32_t wal_head;               /* Next write position in WAL region */
     uint32_t wal_tail;               /* Oldest unprocessed entry */
+    void *overflow_handle;           /* WAL beyond the region (NULL until used) */
+
+    /* Background writer (NULL: flushes are synchronous) */
+    void *writer;                    /* amidb_worker_t */
+    void *writer_file;               /* Writer's own database file handle */
+    void *writer_overflow;           /* Writer's own overflow file handle */
+    uint8_t *flush_buffer;           /* Buffer being written (NULL if none) */
+    uint32_t flush_offset;           /* Its logical WAL offset */
+    uint32_t flush_length;           /* Its length */
+    uint8_t flush_sync;              /* sync_mode it was submitted with */
+
+    /* Change capture (txn/cdc.h; NULL: disabled) */
+    void *cdc_handle;                /* Change log file */
+    uint32_t cdc_end;                /* Its length */
+    uint32_t cdc_lsn;                /* COMMIT LSN of its last transaction */
+
+    /* Log shipping (txn/replica.h; NULL: not shipping) */
+    void *ship_handle;               /* Ship stream */
+    uint32_t ship_offset;            /* WAL offset shipped up to */
+    uint32_t ship_bytes;             /* Bytes shipped */
+    uint8_t ship_sync;               /* Stream is a file (synced with the WAL) */
+    uint8_t ship_failed;             /* Shipping stopped by a write error */
 
     /* Statistics */
     uint32_t checkpoint_count;
     uint32_t total_records;
+    uint32_t flush_count;            /* Buffers written */
+    uint32_t flush_waits;            /* Times a writer had to wait for the other */
+    uint32_t recovered_records;      /* Records scanned by wal_recover */
+    uint32_t recovered_pages;        /* Page images written by wal_recover */
+    uint32_t recovered_skipped;      /* Committed images already on disk */
 };
 
 /*
@@ -111,16 +200,118 @@ void wal_destroy(struct wal_context *wal);
 int wal_write_record(struct wal_context *wal, uint16_t type,
                      const void *payload, uint32_t payload_size);
 
+/*
+ * Write a record whose payload is gathered from several segments
+ *
+ * Each segment is copied once, directly into the WAL buffer; the
+ * checksum is built up segment by segment.
+ *
+ * Parameters:
+ *   wal   - WAL context
+ *   type  - Record type
+ *   segs  - Payload segments in order (NULL if count is 0)
+ *   count - Number of segments (at most WAL_MAX_SEGMENTS)
+ *
+ * Returns: 0 on success, AMIDB_FULL if the buffer has no room
+ */
+int wal_write_record_gather(struct wal_context *wal, uint16_t type,
+                            const struct wal_segment *segs, uint32_t count);
+
 /*
  * Flush WAL buffer to disk
  *
  * Writes the in-memory buffer to the WAL region and calls file_sync()
- * for durability. This is the critical durability point for transactions.
+ * for durability (unless sync_mode is WAL_SYNC_OFF). This is the critical
+ * durability point for transactions.
+ * The buffer is emptied afterwards, so a large transaction may flush
+ * several times before its COMMIT record is written.
+ *
+ * With a background writer, returns once this buffer (and any earlier
+ * one still in flight) is on disk.
  *
  * Returns: 0 on success, error code on failure
  */
 int wal_flush(struct wal_context *wal);
 
+/*
+ * Start flushing the WAL buffer without waiting for it
+ *
+ * With a background writer the buffer is handed over and recording
+ * continues in the other buffer; only a previous flush that is still
+ * running is waited for. Without a writer this is wal_flush.
+ *
+ * Returns: 0 on success, error code on failure (possibly of the
+ * previous flush)
+ */
+int wal_flush_async(struct wal_context *wal);
+
+/*
+ * Wait until every buffer handed to the background writer is on disk
+ *
+ * Returns: 0 on success, error code of a failed flush
+ */
+int wal_wait(struct wal_context *wal);
+
+/*
+ * Start / stop the background WAL writer
+ *
+ * The writer runs as a separate task with its own file handles. Start
+ * it after wal_recover and stop it (or wal_destroy) before the pager is
+ * closed. wal_stop_writer waits for pending flushes.
+ *
+ * Returns: 0 on success, AMIDB_NOMEM / AMIDB_IOERR if the task or its
+ * file handle could not be created (flushes stay synchronous)
+ */
+int wal_start_writer(struct wal_context *wal);
+int wal_stop_writer(struct wal_context *wal);
+
+/*
+ * Read back a page image record (WAL_PAGE or WAL_UNDO) from the WAL
+ *
+ * Used to reload pages spilled by an active transaction, and savepoint
+ * before-images that did not fit in RAM. The record may still be in the
+ * in-memory buffer or already flushed to disk.
+ *
+ * Parameters:
+ *   wal           - WAL context
+ *   record_offset - Logical WAL offset of the record header
+ *   page_num      - Expected page number (verified against the record)
+ *   page_data     - Output buffer (AMIDB_PAGE_SIZE bytes)
+ *
+ * Returns: 0 on success, AMIDB_CORRUPT if the record does not match
+ */
+int wal_read_page(struct wal_context *wal, uint32_t record_offset,
+                  uint32_t page_num, uint8_t *page_data);
+
+/*
+ * Read back any record from the WAL (header and payload)
+ *
+ * Like wal_read_page, the record may still be in a buffer. The checksum
+ * is verified.
+ *
+ * Parameters:
+ *   wal           - WAL context
+ *   record_offset - Logical WAL offset of the record header
+ *   buf           - Output buffer
+ *   buf_size      - Its size (WAL_MAX_RECORD_SIZE fits any record)
+ *
+ * Returns: 0 on success, AMIDB_CORRUPT if there is no valid record there
+ */
+int wal_read_record(struct wal_context *wal, uint32_t record_offset,
+                    uint8_t *buf, uint32_t buf_size);
+
+/*
+ * Append a record taken from another database's WAL (log shipping)
+ *
+ * The record is copied as it is, keeping its LSN and transaction ID;
+ * records written here later get higher LSNs. Flushes the buffer first
+ * if the record does not fit.
+ *
+ * Returns: 0 on success, AMIDB_ERROR if the record size is invalid,
+ *          other error code on failure
+ */
+int wal_append_record(struct wal_context *wal, const uint8_t *record);
+
 /*
  * Verify WAL record checksum
  *
@@ -135,16 +326,20 @@ int wal_verify_checksum(const uint8_t *record_data, uint32_t record_size);
 /*
  * Crash Recovery: Replay committed transactions from WAL
  *
- * Scans the WAL region, identifies committed transactions, and replays
- * their page writes to the main database. Uncommitted transactions are
- * discarded.
+ * Single streaming pass over the WAL region (and overflow file). Every
+ * record is read and checksummed while scanning; the PAGE records of
+ * the open transaction are remembered by offset and replayed when its
+ * COMMIT record is reached. Uncommitted transactions are discarded.
+ *
+ * Replay is idempotent: records at or below the header's checkpoint
+ * LSN are skipped outright, and a page image is only written if the
+ * page on disk carries an older LSN. Recovery can therefore be
+ * interrupted and rerun any number of times.
  *
- * Algorithm:
- *   1. Read entire WAL region (128KB)
- *   2. PASS 1: Find all COMMIT records → build committed_txns[] array
- *   3. PASS 2: Replay PAGE records for committed transactions only
- *   4. Sync main database
- *   5. Clear WAL region
+ * The scan stops at the first invalid record (including a torn page
+ * image) or LSN that does not increase, so a transaction is never
+ * partly replayed. Afterwards the header's checkpoint LSN is raised to the
+ * highest LSN seen, so new records always sort after old ones.
  *
  * Returns: 0 on success, error code on failure
  */
@@ -152,7 +347,31 @@ int wal_recover(struct wal_context *wal);
 
 /*
  * Reset WAL buffer (called after checkpoint)
+ *
+ * Waits for the background writer first.
  */
 void wal_reset_buffer(struct wal_context *wal);
 
+/*
+ * Set the database's default durability level (WAL_SYNC_*)
+ *
+ * Takes effect from the next transaction.
+ *
+ * Returns: 0 on success, AMIDB_ERROR for an unknown level
+ */
+int wal_set_durability(struct wal_context *wal, uint8_t level);
+
+/*
+ * Checkpoint: make the database file hold every committed transaction
+ *
+ * Syncs the database file (if a NORMAL or FULL commit is in the WAL,
+ * whatever the level of the current transaction), records the
+ * checkpoint LSN in the file header and resets the WAL. Must only be
+ * called between transactions. A no-op if nothing was logged since the
+ * last checkpoint.
+ *
+ * Returns: 0 on success, error code on failure
+ */
+int wal_checkpoint(struct wal_context *wal);
+
 #endif /* AMIDB_WAL_H */
@@ -4,10 +4,35 @@
 
 #include "util/crc32.h"
 
+#define CRC32_POLY 0xEDB88320UL
+
 /* CRC32 lookup table */
 static uint32_t crc32_table[256];
 static int crc32_table_initialized = 0;
 
+/* x^(2^n) modulo the polynomial, for crc32_combine */
+static uint32_t crc32_x2n_table[32];
+
+/* Multiply two polynomials modulo the CRC polynomial (bit-reflected) */
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m, p;
+
+    m = 1UL << 31;
+    p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC32_POLY : b >> 1;
+    }
+
+    return p;
+}
+
 /* Initialize CRC32 lookup table */
 void crc32_init(void) {
     uint32_t i, j, c;
@@ -20,7 +45,7 @@ void crc32_init(void) {
         c = i;
         for (j = 0; j < 8; j++) {
             if (c & 1) {
-                c = 0xEDB88320UL ^ (c >> 1);
+                c = CRC32_POLY ^ (c >> 1);
             } else {
                 c = c >> 1;
             }
@@ -28,6 +53,14 @@ void crc32_init(void) {
         crc32_table[i] = c;
     }
 
+    /* x^1, then square repeatedly */
+    c = 1UL << 30;
+    crc32_x2n_table[0] = c;
+    for (i = 1; i < 32; i++) {
+        c = crc32_multmodp(c, c);
+        crc32_x2n_table[i] = c;
+    }
+
     crc32_table_initialized = 1;
 }
 
@@ -53,3 +86,26 @@ uint32_t crc32_update(uint32_t crc, const uint8_t *data, uint32_t length) {
 uint32_t crc32_compute(const uint8_t *data, uint32_t length) {
     return crc32_update(0, data, length);
 }
+
+/* CRC32 of two buffers back to back, from their separate CRCs */
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint32_t len2) {
+    uint32_t p;
+    uint32_t k;
+
+    if (!crc32_table_initialized) {
+        crc32_init();
+    }
+
+    /* p = x^(8 * len2): crc1 shifted past len2 zero bytes */
+    p = 1UL << 31;
+    k = 3;
+    while (len2) {
+        if (len2 & 1) {
+            p = crc32_multmodp(crc32_x2n_table[k & 31], p);
+        }
+        len2 >>= 1;
+        k++;
+    }
+
+    return crc32_multmodp(p, crc1) ^ crc2;
+}
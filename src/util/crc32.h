@@ -19,4 +19,13 @@ uint32_t crc32_compute(const uint8_t *data, uint32_t length);
 /* Incremental CRC32 computation */
 uint32_t crc32_update(uint32_t crc, const uint8_t *data, uint32_t length);
 
+/*
+ * Combining CRCs: crc32_combine(crc(A), crc(B), len(B)) == crc(A then B)
+ *
+ * Lets a checksum that is already known for part of a record (such as
+ * a page's own checksum) be reused instead of rescanning the bytes.
+ * Costs a few hundred shifts, not a pass over len2 bytes.
+ */
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint32_t len2);
+
 #endif /* AMIDB_CRC32_H */
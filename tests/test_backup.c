@@ -0,0 +1,239 @@
+/*
+ * test_backup.c - Tests for online backup
+ */
+
+#include "test_harness.h"
+#include "storage/backup.h"
+#include "storage/pager.h"
+#include "storage/cache.h"
+#include "txn/txn.h"
+#include "txn/wal.h"
+#include "os/file.h"
+#include "os/mem.h"
+#include "api/error.h"
+#include <string.h>
+
+#define TEST_DB_BACKUP_SRC "RAM:backup_src.db"
+#define TEST_DB_BACKUP_DST "RAM:backup_dst.db"
+#define TEST_DB_BACKUP_INC "RAM:backup_inc.bak"
+
+#define BACKUP_TEST_PAGES 40
+
+/* Page buffers (static: too large for the 4KB 68000 stack) */
+static uint8_t backup_src_page[AMIDB_PAGE_SIZE];
+static uint8_t backup_dst_page[AMIDB_PAGE_SIZE];
+
+/* Helper: commit one transaction setting the first data byte of pages */
+static int backup_test_commit(struct page_cache *cache, struct txn_context *txn,
+                              const uint32_t *pages, uint32_t count, uint8_t value)
+{
+    struct cache_entry *entry;
+    uint8_t *data;
+    uint32_t i;
+
+    if (txn_begin(txn) != AMIDB_OK) {
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        if (cache_get_page(cache, pages[i], &data) != 0) {
+            return -1;
+        }
+        data[4] = PAGE_TYPE_BTREE;
+        data[AMIDB_PAGE_HEADER_SIZE] = value;
+        data[AMIDB_PAGE_HEADER_SIZE + 1] = (uint8_t)i;
+        cache_mark_dirty(cache, pages[i]);
+        txn_add_dirty_page(txn, pages[i]);
+        entry = cache_find_entry(cache, pages[i]);
+        entry->txn_id = txn->txn_id;
+        cache_unpin(cache, pages[i]);
+    }
+
+    return txn_commit(txn);
+}
+
+/* Test: Backup stays consistent while transactions commit between steps */
+TEST(backup_online_consistent) {
+    struct amidb_pager *pager = NULL;
+    struct amidb_pager *copy = NULL;
+    struct amidb_backup *backup;
+    struct amidb_backup *second;
+    struct page_cache *cache;
+    struct wal_context *wal;
+    struct txn_context *txn;
+    uint32_t pages[BACKUP_TEST_PAGES + 1];
+    uint32_t i;
+    int rc;
+
+    file_delete(TEST_DB_BACKUP_SRC);
+    file_delete(TEST_DB_BACKUP_DST);
+
+    TEST_BEGIN();
+
+    rc = pager_open(TEST_DB_BACKUP_SRC, 0, &pager);
+    ASSERT_EQ(rc, 0);
+    cache = cache_create(64, pager);
+    ASSERT_NOT_NULL(cache);
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+    txn = txn_create(wal, cache);
+    ASSERT_NOT_NULL(txn);
+
+    for (i = 0; i < BACKUP_TEST_PAGES; i++) {
+        rc = pager_allocate_page(pager, &pages[i]);
+        ASSERT_EQ(rc, 0);
+    }
+    ASSERT_EQ(backup_test_commit(cache, txn, pages, BACKUP_TEST_PAGES, 0x11), AMIDB_OK);
+
+    rc = amidb_backup_init(pager, TEST_DB_BACKUP_DST, &backup);
+    ASSERT_EQ(rc, AMIDB_OK);
+    ASSERT_EQ(amidb_backup_init(pager, TEST_DB_BACKUP_DST, &second), AMIDB_BUSY);
+
+    /* Copy up to the middle of the data pages */
+    ASSERT_EQ(amidb_backup_step(backup, pages[BACKUP_TEST_PAGES / 2]), AMIDB_OK);
+    ASSERT_EQ(backup->next_page, pages[BACKUP_TEST_PAGES / 2]);
+    ASSERT_EQ(backup->remaining, BACKUP_TEST_PAGES / 2);
+
+    /* Change a copied page and one not copied yet, and add a page */
+    ASSERT_EQ(backup_test_commit(cache, txn, &pages[0], 1, 0x22), AMIDB_OK);
+    ASSERT_EQ(backup_test_commit(cache, txn, &pages[BACKUP_TEST_PAGES - 1], 1, 0x33), AMIDB_OK);
+    ASSERT_EQ(backup->recopy_count, 1);
+    rc = pager_allocate_page(pager, &pages[BACKUP_TEST_PAGES]);
+    ASSERT_EQ(rc, 0);
+    ASSERT_EQ(backup_test_commit(cache, txn, &pages[BACKUP_TEST_PAGES], 1, 0x44), AMIDB_OK);
+
+    /* Finish in small steps */
+    do {
+        rc = amidb_backup_step(backup, 4);
+    } while (rc == AMIDB_OK);
+    ASSERT_EQ(rc, AMIDB_DONE);
+    ASSERT_EQ(backup->remaining, 0);
+    ASSERT_EQ(backup->pages_recopied, 1);
+    ASSERT_EQ(backup->pages_copied, pager->header.page_count + 1);
+    ASSERT_NULL(pager->backup);
+    ASSERT_EQ(amidb_backup_step(backup, 1), AMIDB_DONE);
+    amidb_backup_finish(backup);
+
+    /* The copy opens clean and matches the source page for page */
+    rc = pager_open(TEST_DB_BACKUP_DST, 0, &copy);
+    ASSERT_EQ(rc, 0);
+    ASSERT_EQ(copy->header.flags & DB_FLAG_DIRTY, 0);
+    ASSERT_EQ(copy->header.page_count, pager->header.page_count);
+    ASSERT_EQ(copy->header.checkpoint_lsn, wal->next_lsn - 1);
+    for (i = 0; i <= BACKUP_TEST_PAGES; i++) {
+        rc = pager_read_page(pager, pages[i], backup_src_page);
+        ASSERT_EQ(rc, 0);
+        rc = pager_read_page(copy, pages[i], backup_dst_page);
+        ASSERT_EQ(rc, 0);
+        ASSERT_EQ(memcmp(backup_src_page, backup_dst_page, AMIDB_PAGE_SIZE), 0);
+    }
+    rc = pager_read_page(copy, pages[0], backup_dst_page);
+    ASSERT_EQ(backup_dst_page[AMIDB_PAGE_HEADER_SIZE], 0x22);
+    pager_close(copy);
+
+    txn_destroy(txn);
+    wal_destroy(wal);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    file_delete(TEST_DB_BACKUP_SRC);
+    file_delete(TEST_DB_BACKUP_DST);
+
+    TEST_END();
+    return 0;
+}
+
+/* Test: Incremental backup carries only changed pages and restores */
+TEST(backup_incremental_restore) {
+    struct amidb_pager *pager = NULL;
+    struct amidb_pager *copy = NULL;
+    struct amidb_backup *backup;
+    struct page_cache *cache;
+    struct wal_context *wal;
+    struct txn_context *txn;
+    uint32_t pages[BACKUP_TEST_PAGES + 1];
+    uint32_t changed[3];
+    uint32_t i;
+    int rc;
+
+    file_delete(TEST_DB_BACKUP_SRC);
+    file_delete(TEST_DB_BACKUP_DST);
+    file_delete(TEST_DB_BACKUP_INC);
+
+    TEST_BEGIN();
+
+    rc = pager_open(TEST_DB_BACKUP_SRC, 0, &pager);
+    ASSERT_EQ(rc, 0);
+    cache = cache_create(64, pager);
+    ASSERT_NOT_NULL(cache);
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+    txn = txn_create(wal, cache);
+    ASSERT_NOT_NULL(txn);
+
+    for (i = 0; i < BACKUP_TEST_PAGES; i++) {
+        rc = pager_allocate_page(pager, &pages[i]);
+        ASSERT_EQ(rc, 0);
+    }
+    ASSERT_EQ(backup_test_commit(cache, txn, pages, BACKUP_TEST_PAGES, 0x11), AMIDB_OK);
+    ASSERT(pager_page_changed(pager, pages[0]));
+
+    /* Full backup: starts epoch 1 with nothing changed */
+    ASSERT_EQ(amidb_backup_init(pager, TEST_DB_BACKUP_DST, &backup), AMIDB_OK);
+    ASSERT_EQ(amidb_backup_step(backup, 0), AMIDB_DONE);
+    amidb_backup_finish(backup);
+    ASSERT_EQ(pager->header.backup_epoch, 1);
+    for (i = 0; i < BACKUP_TEST_PAGES; i++) {
+        ASSERT(!pager_page_changed(pager, pages[i]));
+    }
+
+    /* Change two pages and add one */
+    changed[0] = pages[3];
+    changed[1] = pages[BACKUP_TEST_PAGES - 2];
+    rc = pager_allocate_page(pager, &pages[BACKUP_TEST_PAGES]);
+    ASSERT_EQ(rc, 0);
+    changed[2] = pages[BACKUP_TEST_PAGES];
+    ASSERT_EQ(backup_test_commit(cache, txn, changed, 3, 0x55), AMIDB_OK);
+    ASSERT(pager_page_changed(pager, changed[0]));
+    ASSERT(!pager_page_changed(pager, pages[4]));
+
+    /* The increment holds the three pages and the header page */
+    ASSERT_EQ(amidb_backup_init_incremental(pager, TEST_DB_BACKUP_INC, &backup), AMIDB_OK);
+    ASSERT_EQ(backup->remaining, 3);
+    ASSERT_EQ(amidb_backup_step(backup, 0), AMIDB_DONE);
+    ASSERT_EQ(backup->record_count, 4);
+    amidb_backup_finish(backup);
+    ASSERT_EQ(pager->header.backup_epoch, 2);
+    ASSERT(!pager_page_changed(pager, changed[2]));
+
+    /* Restore onto the full backup; a second time it no longer fits */
+    ASSERT_EQ(amidb_backup_restore(TEST_DB_BACKUP_DST, TEST_DB_BACKUP_INC), AMIDB_OK);
+    ASSERT_EQ(amidb_backup_restore(TEST_DB_BACKUP_DST, TEST_DB_BACKUP_INC), AMIDB_ERROR);
+
+    rc = pager_open(TEST_DB_BACKUP_DST, 0, &copy);
+    ASSERT_EQ(rc, 0);
+    ASSERT_EQ(copy->header.flags & DB_FLAG_DIRTY, 0);
+    ASSERT_EQ(copy->header.backup_epoch, 2);
+    ASSERT_EQ(copy->header.page_count, pager->header.page_count);
+    for (i = 0; i <= BACKUP_TEST_PAGES; i++) {
+        rc = pager_read_page(pager, pages[i], backup_src_page);
+        ASSERT_EQ(rc, 0);
+        rc = pager_read_page(copy, pages[i], backup_dst_page);
+        ASSERT_EQ(rc, 0);
+        ASSERT_EQ(memcmp(backup_src_page, backup_dst_page, AMIDB_PAGE_SIZE), 0);
+    }
+    rc = pager_read_page(copy, changed[1], backup_dst_page);
+    ASSERT_EQ(backup_dst_page[AMIDB_PAGE_HEADER_SIZE], 0x55);
+    pager_close(copy);
+
+    txn_destroy(txn);
+    wal_destroy(wal);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    file_delete(TEST_DB_BACKUP_SRC);
+    file_delete(TEST_DB_BACKUP_DST);
+    file_delete(TEST_DB_BACKUP_INC);
+
+    TEST_END();
+    return 0;
+}
@@ -243,6 +243,74 @@ TEST(btree_split_cursor_iteration) {
     return 0;
 }
 
+/* Test: Cursor seek lands on the first key >= the one sought */
+TEST(btree_split_cursor_seek) {
+    struct amidb_pager *pager = NULL;
+    struct page_cache *cache;
+    struct btree *tree;
+    struct btree_cursor cursor;
+    uint32_t root_page;
+    int32_t key;
+    uint32_t value;
+    int rc;
+    int i;
+    int count;
+
+    TEST_BEGIN();
+
+    rc = pager_open("RAM:btree_split_seek.db", 0, &pager);
+    ASSERT_EQ(rc, 0);
+
+    cache = cache_create(32, pager);
+    ASSERT_NOT_NULL(cache);
+
+    tree = btree_create(pager, cache, &root_page);
+    ASSERT_NOT_NULL(tree);
+
+    /* Nothing to find in an empty tree */
+    rc = btree_cursor_seek(tree, 5, &cursor);
+    ASSERT_EQ(rc, 0);
+    ASSERT_EQ(btree_cursor_valid(&cursor), 0);
+
+    /* Even keys 0..398, spread over several leaves */
+    for (i = 0; i < 200; i++) {
+        rc = btree_insert(tree, i * 2, i);
+        ASSERT_EQ(rc, 0);
+    }
+
+    /* Every key, present or not, then on to the end */
+    for (i = -1; i < 400; i++) {
+        rc = btree_cursor_seek(tree, i, &cursor);
+        ASSERT_EQ(rc, 0);
+        if (i >= 398) {
+            ASSERT_EQ(btree_cursor_valid(&cursor), i == 398);
+            continue;
+        }
+        ASSERT_EQ(btree_cursor_valid(&cursor), 1);
+        btree_cursor_get(&cursor, &key, &value);
+        ASSERT_EQ(key, (i < 0) ? 0 : (i + 1) / 2 * 2);
+    }
+
+    rc = btree_cursor_seek(tree, 101, &cursor);
+    ASSERT_EQ(rc, 0);
+    count = 0;
+    while (btree_cursor_valid(&cursor)) {
+        btree_cursor_get(&cursor, &key, &value);
+        ASSERT_EQ(key, 102 + count * 2);
+        count++;
+        btree_cursor_next(&cursor);
+    }
+    ASSERT_EQ(count, 149);
+    test_printf("  Seek found every key and iterated on from it\n");
+
+    btree_close(tree);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    TEST_END();
+    return 0;
+}
+
 /* Test: Update keys after splits */
 TEST(btree_split_update_after_split) {
     struct amidb_pager *pager = NULL;
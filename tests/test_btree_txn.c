@@ -23,6 +23,31 @@
 #define TEST_DB_BTREE_SPLIT_ABORT "RAM:btree_split_abort.db"
 #define TEST_DB_BTREE_DELETE_MERGE "RAM:btree_delete_merge.db"
 #define TEST_DB_BTREE_COMPLEX "RAM:btree_complex.db"
+#define TEST_DB_BTREE_SNAPSHOT "RAM:btree_snapshot.db"
+
+/* Helper: count entries and check they run first..last in order */
+static int snapshot_scan(struct btree *tree, int32_t first, int32_t last)
+{
+    struct btree_cursor cursor;
+    int32_t key;
+    uint32_t value;
+    int32_t expect;
+
+    expect = first;
+    if (btree_cursor_first(tree, &cursor) != 0) {
+        return -1;
+    }
+    while (btree_cursor_valid(&cursor)) {
+        btree_cursor_get(&cursor, &key, &value);
+        if (key != expect || value != (uint32_t)key * 10) {
+            return -1;
+        }
+        expect++;
+        btree_cursor_next(&cursor);
+    }
+
+    return (expect == last + 1) ? 0 : -1;
+}
 
 /* Test: Simple B+Tree insert with transaction */
 TEST(btree_insert_with_transaction) {
@@ -413,3 +438,126 @@ TEST(btree_complex_multi_operation) {
     TEST_END();
     return 0;
 }
+
+/* Test: Snapshot readers see one committed state while the writer works */
+TEST(btree_snapshot_isolation) {
+    struct amidb_pager *pager = NULL;
+    struct page_cache *cache;
+    struct wal_context *wal;
+    struct txn_context *txn;
+    struct txn_snapshot *snap;
+    struct txn_snapshot *snap2;
+    struct btree *tree;
+    struct btree *reader;
+    struct btree_cursor cursor;
+    uint32_t root_page;
+    uint32_t value_out;
+    uint8_t *data;
+    int32_t key;
+    int32_t expect;
+    int rc;
+    int i;
+
+    file_delete(TEST_DB_BTREE_SNAPSHOT);
+
+    TEST_BEGIN();
+
+    rc = pager_open(TEST_DB_BTREE_SNAPSHOT, 0, &pager);
+    ASSERT_EQ(rc, 0);
+
+    cache = cache_create(64, pager);
+    ASSERT_NOT_NULL(cache);
+
+    tree = btree_create(pager, cache, &root_page);
+    ASSERT_NOT_NULL(tree);
+
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+    txn = txn_create(wal, cache);
+    ASSERT_NOT_NULL(txn);
+    btree_set_transaction(tree, txn);
+
+    /* Committed state: keys 1..100 */
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    for (i = 1; i <= 100; i++) {
+        ASSERT_EQ(btree_insert(tree, i, i * 10), 0);
+    }
+    ASSERT_EQ(txn_commit(txn), AMIDB_OK);
+
+    /* Reader pins that state */
+    ASSERT_EQ(txn_snapshot_open(txn, &snap), AMIDB_OK);
+    reader = btree_open(pager, cache, tree->root_page);
+    ASSERT_NOT_NULL(reader);
+    btree_set_snapshot(reader, snap);
+    ASSERT_EQ(btree_insert(reader, 1000, 1), -1);  /* Read-only */
+
+    /* Writer: grow the tree (splits) and delete the low keys */
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    for (i = 101; i <= 400; i++) {
+        ASSERT_EQ(btree_insert(tree, i, i * 10), 0);
+    }
+    for (i = 1; i <= 50; i++) {
+        ASSERT_EQ(btree_delete(tree, i), 0);
+    }
+
+    /* Uncommitted changes are invisible */
+    ASSERT_EQ(snapshot_scan(reader, 1, 100), 0);
+    ASSERT_EQ(btree_search(reader, 1, &value_out), 0);
+    ASSERT_EQ(btree_search(reader, 200, &value_out), -1);
+
+    /* A scan that straddles the commit still sees one state */
+    ASSERT_EQ(btree_cursor_first(reader, &cursor), 0);
+    for (expect = 1; expect <= 10; expect++) {
+        btree_cursor_get(&cursor, &key, &value_out);
+        ASSERT_EQ(key, expect);
+        btree_cursor_next(&cursor);
+    }
+
+    ASSERT_EQ(txn_commit(txn), AMIDB_OK);
+    ASSERT_GT(txn->version_count, 0);
+
+    while (btree_cursor_valid(&cursor)) {
+        btree_cursor_get(&cursor, &key, &value_out);
+        ASSERT_EQ(key, expect);
+        expect++;
+        btree_cursor_next(&cursor);
+    }
+    ASSERT_EQ(expect, 101);
+
+    /* Committed changes stay invisible too; a new snapshot sees them */
+    ASSERT_EQ(snapshot_scan(reader, 1, 100), 0);
+    ASSERT_EQ(txn_snapshot_open(txn, &snap2), AMIDB_OK);
+    btree_close(reader);
+    reader = btree_open(pager, cache, tree->root_page);
+    ASSERT_NOT_NULL(reader);
+    btree_set_snapshot(reader, snap2);
+    ASSERT_EQ(snapshot_scan(reader, 51, 400), 0);
+
+    /* Closing the old snapshot frees the versions only it needed */
+    txn_snapshot_close(snap);
+    ASSERT_EQ(txn->version_count, 0);
+    txn_snapshot_close(snap2);
+
+    /* Out of version budget: the snapshot goes stale, the writer goes on */
+    txn_set_version_limit(txn, 1);
+    ASSERT_EQ(txn_snapshot_open(txn, &snap), AMIDB_OK);
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    for (i = 401; i <= 600; i++) {
+        ASSERT_EQ(btree_insert(tree, i, i * 10), 0);
+    }
+    ASSERT_EQ(txn_commit(txn), AMIDB_OK);
+    ASSERT_EQ(snap->stale, 1);
+    ASSERT_EQ(txn->version_count, 0);
+    ASSERT_EQ(txn_snapshot_get_page(snap, tree->root_page, &data), AMIDB_BUSY);
+    txn_snapshot_close(snap);
+
+    btree_close(reader);
+    btree_close(tree);
+    txn_destroy(txn);
+    wal_destroy(wal);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    TEST_END();
+    return 0;
+}
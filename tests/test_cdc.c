@@ -0,0 +1,199 @@
+/*
+ * test_cdc.c - Tests for change data capture
+ */
+
+#include "test_harness.h"
+#include "txn/cdc.h"
+#include "txn/txn.h"
+#include "txn/wal.h"
+#include "storage/pager.h"
+#include "storage/cache.h"
+#include "os/file.h"
+#include "os/mem.h"
+#include "api/error.h"
+#include <string.h>
+
+#define TEST_DB_CDC_STREAM "RAM:cdc_stream.db"
+#define TEST_DB_CDC_RECOVER "RAM:cdc_recover.db"
+
+/* Helper: append a WAL_ROW record by hand */
+static int cdc_test_log_row(struct wal_context *wal, uint8_t op, int32_t key,
+                            const char *row)
+{
+    uint8_t payload[CDC_ROW_HEADER_SIZE + CDC_MAX_TABLE_NAME + 16];
+    uint32_t row_size;
+    uint32_t size;
+
+    row_size = row ? strlen(row) : 0;
+    size = cdc_encode_row_header(payload, op, "t", key, row_size);
+    if (row_size) {
+        memcpy(payload + size, row, row_size);
+    }
+
+    return wal_write_record(wal, WAL_ROW, payload, size + row_size);
+}
+
+/* Helper: check the next event */
+static int cdc_test_expect(struct cdc_reader *reader, uint8_t op, int32_t key,
+                           const char *row)
+{
+    struct cdc_event event;
+
+    if (cdc_next(reader, &event) != AMIDB_ROW ||
+        event.op != op || event.key != key || strcmp(event.table, "t") != 0) {
+        return -1;
+    }
+    if (row) {
+        if (event.row_size != strlen(row) || memcmp(event.row, row, event.row_size) != 0) {
+            return -1;
+        }
+    } else if (event.row != NULL) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Test: Only committed changes are streamed, and readers can resume */
+TEST(cdc_committed_changes) {
+    struct amidb_pager *pager = NULL;
+    struct page_cache *cache;
+    struct wal_context *wal;
+    struct txn_context *txn;
+    struct cdc_reader *reader;
+    struct cdc_event event;
+    uint32_t position;
+    int rc;
+
+    TEST_BEGIN();
+
+    rc = pager_open(TEST_DB_CDC_STREAM, 0, &pager);
+    ASSERT_EQ(rc, 0);
+    cache = cache_create(16, pager);
+    ASSERT_NOT_NULL(cache);
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+    txn = txn_create(wal, cache);
+    ASSERT_NOT_NULL(txn);
+
+    /* Capture off: nothing logged, no change log */
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    ASSERT_EQ(txn_log_row(txn, CDC_INSERT, "t", 9, (const uint8_t *)"off", 3), AMIDB_OK);
+    ASSERT_EQ(txn->row_count, 0);
+    ASSERT_EQ(txn_commit(txn), AMIDB_OK);
+    ASSERT_EQ(cdc_reader_open(TEST_DB_CDC_STREAM, 0, &reader), AMIDB_NOTFOUND);
+
+    ASSERT_EQ(cdc_enable(wal), AMIDB_OK);
+
+    /* Committed, with one row rolled back to a savepoint */
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    ASSERT_EQ(txn_log_row(txn, CDC_INSERT, "t", 1, (const uint8_t *)"abc", 3), AMIDB_OK);
+    ASSERT_EQ(txn_savepoint(txn, "sp"), AMIDB_OK);
+    ASSERT_EQ(txn_log_row(txn, CDC_INSERT, "t", 2, (const uint8_t *)"gone", 4), AMIDB_OK);
+    ASSERT_EQ(txn_rollback_to_savepoint(txn, "sp"), AMIDB_OK);
+    ASSERT_EQ(txn_log_row(txn, CDC_UPDATE, "t", 1, (const uint8_t *)"xyz", 3), AMIDB_OK);
+    ASSERT_EQ(txn_commit(txn), AMIDB_OK);
+
+    /* Aborted */
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    ASSERT_EQ(txn_log_row(txn, CDC_DELETE, "t", 1, NULL, 0), AMIDB_OK);
+    ASSERT_EQ(txn_abort(txn), AMIDB_OK);
+
+    /* Committed */
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    ASSERT_EQ(txn_log_row(txn, CDC_DELETE, "t", 1, NULL, 0), AMIDB_OK);
+    ASSERT_EQ(txn_commit(txn), AMIDB_OK);
+
+    rc = cdc_reader_open(TEST_DB_CDC_STREAM, 0, &reader);
+    ASSERT_EQ(rc, AMIDB_OK);
+    ASSERT_EQ(cdc_test_expect(reader, CDC_INSERT, 1, "abc"), 0);
+    position = cdc_reader_position(reader);
+    ASSERT_EQ(cdc_test_expect(reader, CDC_UPDATE, 1, "xyz"), 0);
+    ASSERT_EQ(cdc_test_expect(reader, CDC_DELETE, 1, NULL), 0);
+    ASSERT_EQ(cdc_next(reader, &event), AMIDB_DONE);
+
+    /* Tailing: a later commit shows up on the same reader */
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    ASSERT_EQ(txn_log_row(txn, CDC_INSERT, "t", 3, (const uint8_t *)"new", 3), AMIDB_OK);
+    ASSERT_EQ(cdc_next(reader, &event), AMIDB_DONE);
+    ASSERT_EQ(txn_commit(txn), AMIDB_OK);
+    ASSERT_EQ(cdc_test_expect(reader, CDC_INSERT, 3, "new"), 0);
+    cdc_reader_close(reader);
+
+    /* Resume from a saved position */
+    rc = cdc_reader_open(TEST_DB_CDC_STREAM, position, &reader);
+    ASSERT_EQ(rc, AMIDB_OK);
+    ASSERT_EQ(cdc_test_expect(reader, CDC_UPDATE, 1, "xyz"), 0);
+    cdc_reader_close(reader);
+
+    cdc_disable(wal);
+    ASSERT_EQ(cdc_reader_open(TEST_DB_CDC_STREAM, 0, &reader), AMIDB_NOTFOUND);
+
+    txn_destroy(txn);
+    wal_destroy(wal);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    TEST_END();
+    return 0;
+}
+
+/* Test: Recovery publishes committed changes the change log missed */
+TEST(cdc_recovery_publishes) {
+    struct amidb_pager *pager = NULL;
+    struct wal_context *wal;
+    struct cdc_reader *reader;
+    struct cdc_event event;
+    int rc;
+
+    TEST_BEGIN();
+
+    rc = pager_open(TEST_DB_CDC_RECOVER, 0, &pager);
+    ASSERT_EQ(rc, 0);
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+    ASSERT_EQ(cdc_enable(wal), AMIDB_OK);
+
+    /* Committed in the WAL; the copy to the change log never happened. */
+    /* The savepoint rollback leaves rows 1 and 3. */
+    wal->current_txn_id = 1;
+    ASSERT_EQ(wal_write_record(wal, WAL_BEGIN, NULL, 0), AMIDB_OK);
+    ASSERT_EQ(cdc_test_log_row(wal, CDC_INSERT, 1, "one"), AMIDB_OK);
+    ASSERT_EQ(cdc_test_log_row(wal, CDC_INSERT, 2, "two"), AMIDB_OK);
+    ASSERT_EQ(cdc_test_log_row(wal, CDC_TRUNCATE, 1, NULL), AMIDB_OK);
+    ASSERT_EQ(cdc_test_log_row(wal, CDC_INSERT, 3, "three"), AMIDB_OK);
+    ASSERT_EQ(wal_write_record(wal, WAL_COMMIT, NULL, 0), AMIDB_OK);
+
+    /* Uncommitted */
+    wal->current_txn_id = 2;
+    ASSERT_EQ(wal_write_record(wal, WAL_BEGIN, NULL, 0), AMIDB_OK);
+    ASSERT_EQ(cdc_test_log_row(wal, CDC_DELETE, 1, NULL), AMIDB_OK);
+    ASSERT_EQ(wal_flush(wal), AMIDB_OK);
+    wal_destroy(wal);
+
+    rc = cdc_reader_open(TEST_DB_CDC_RECOVER, 0, &reader);
+    ASSERT_EQ(rc, AMIDB_OK);
+    ASSERT_EQ(cdc_next(reader, &event), AMIDB_DONE);
+
+    /* Recovery appends the committed rows; a second run adds nothing */
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+    ASSERT_NOT_NULL(wal->cdc_handle);
+    ASSERT_EQ(wal_recover(wal), AMIDB_OK);
+    wal_destroy(wal);
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+    ASSERT_EQ(wal_recover(wal), AMIDB_OK);
+
+    ASSERT_EQ(cdc_test_expect(reader, CDC_INSERT, 1, "one"), 0);
+    ASSERT_EQ(cdc_test_expect(reader, CDC_INSERT, 3, "three"), 0);
+    ASSERT_EQ(cdc_next(reader, &event), AMIDB_DONE);
+    cdc_reader_close(reader);
+
+    cdc_disable(wal);
+    wal_destroy(wal);
+    pager_close(pager);
+
+    TEST_END();
+    return 0;
+}
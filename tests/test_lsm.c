@@ -0,0 +1,237 @@
+/*
+ * test_lsm.c - Tests for the LSM table engine
+ */
+
+#include "test_harness.h"
+#include "storage/btree.h"
+#include "storage/lsm.h"
+#include "txn/txn.h"
+#include "txn/wal.h"
+#include "storage/cache.h"
+#include "storage/pager.h"
+#include "os/file.h"
+#include "os/mem.h"
+#include "api/error.h"
+#include <string.h>
+
+#define TEST_DB_LSM_RUNS "RAM:lsm_runs.db"
+#define TEST_DB_LSM_TXN  "RAM:lsm_txn.db"
+
+/* Helper: live keys in cursor order, checking order and values */
+/* (value = key * 10, plus 1 for keys from updated_from on) */
+static int lsm_scan(struct btree *tree, int32_t updated_from, uint32_t *count_out)
+{
+    struct btree_cursor cursor;
+    int32_t key;
+    int32_t last = 0;
+    uint32_t value;
+    uint32_t count = 0;
+
+    if (btree_cursor_first(tree, &cursor) != 0) {
+        return -1;
+    }
+    while (btree_cursor_valid(&cursor)) {
+        btree_cursor_get(&cursor, &key, &value);
+        if ((count > 0 && key <= last) ||
+            value != (uint32_t)key * 10 + (key >= updated_from ? 1 : 0)) {
+            return -1;
+        }
+        last = key;
+        count++;
+        btree_cursor_next(&cursor);
+    }
+
+    *count_out = count;
+    return 0;
+}
+
+/* Test: Flushes, merges, bloom filters, tombstones and reopening */
+TEST(lsm_runs_and_merges) {
+    struct amidb_pager *pager = NULL;
+    struct page_cache *cache;
+    struct btree *tree;
+    uint32_t root_page;
+    uint32_t value;
+    uint32_t count;
+    uint32_t entries, height, nodes;
+    uint32_t merged_entries;
+    int32_t key;
+    int32_t i;
+    int rc;
+
+    file_delete(TEST_DB_LSM_RUNS);
+
+    TEST_BEGIN();
+
+    rc = pager_open(TEST_DB_LSM_RUNS, 0, &pager);
+    ASSERT_EQ(rc, 0);
+    cache = cache_create(64, pager);
+    ASSERT_NOT_NULL(cache);
+    tree = lsm_create(pager, cache, &root_page);
+    ASSERT_NOT_NULL(tree);
+    ASSERT_EQ(tree->engine, BTREE_ENGINE_LSM);
+    ASSERT_EQ(btree_insert(tree, 5, LSM_TOMBSTONE), -1);
+
+    /* Even keys 2..6000 in scrambled order, merging as the executor does */
+    for (i = 0; i < 3000; i++) {
+        key = ((i * 7919) % 3000 + 1) * 2;
+        ASSERT_EQ(btree_insert(tree, key, (uint32_t)key * 10), 0);
+        if (lsm_merge_pending(tree)) {
+            ASSERT_EQ(lsm_merge(tree), 0);
+        }
+    }
+    btree_get_stats(tree, &entries, &height, &nodes);
+    ASSERT_EQ(entries, 3000);
+    ASSERT_EQ(height, 2);
+
+    /* Every key found; odd keys inside the runs' ranges are not, */
+    /* most of them without reading a data page */
+    for (key = 2; key <= 6000; key += 2) {
+        ASSERT_EQ(btree_search(tree, key, &value), 0);
+        ASSERT_EQ(value, (uint32_t)key * 10);
+    }
+    tree->bloom_skips = 0;
+    for (key = 1; key < 6000; key += 2) {
+        ASSERT_EQ(btree_search(tree, key, &value), -1);
+    }
+    ASSERT_GT(tree->bloom_skips, 2000);
+
+    /* Newer versions hide older ones, in lookups and scans */
+    for (key = 4000; key <= 6000; key += 2) {
+        ASSERT_EQ(btree_insert(tree, key, (uint32_t)key * 10 + 1), 0);
+    }
+    ASSERT_EQ(btree_search(tree, 4000, &value), 0);
+    ASSERT_EQ(value, 40001);
+    ASSERT_EQ(lsm_scan(tree, 4000, &count), 0);
+    ASSERT_EQ(count, 3000);
+
+    /* Tombstones hide deleted keys until a merge drops them */
+    for (key = 2; key <= 1000; key += 2) {
+        ASSERT_EQ(btree_delete(tree, key), 0);
+    }
+    ASSERT_EQ(btree_delete(tree, 2), -1);
+    ASSERT_EQ(btree_delete(tree, 3), -1);
+    ASSERT_EQ(btree_search(tree, 500, &value), -1);
+    ASSERT_EQ(lsm_scan(tree, 4000, &count), 0);
+    ASSERT_EQ(count, 2500);
+
+    btree_get_stats(tree, &entries, &height, &nodes);
+    for (i = 0; i < LSM_MAX_RUNS; i++) {
+        ASSERT_EQ(lsm_merge(tree), 0);
+    }
+    btree_get_stats(tree, &merged_entries, &height, &nodes);
+    ASSERT_LT(merged_entries, entries);
+    ASSERT_LT(merged_entries, 3000 + LSM_MEMTABLE_MAX);
+    ASSERT_EQ(lsm_scan(tree, 4000, &count), 0);
+    ASSERT_EQ(count, 2500);
+
+    btree_close(tree);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    /* Reopen: btree_open recognises the LSM root */
+    rc = pager_open(TEST_DB_LSM_RUNS, 0, &pager);
+    ASSERT_EQ(rc, 0);
+    cache = cache_create(16, pager);
+    ASSERT_NOT_NULL(cache);
+    tree = btree_open(pager, cache, root_page);
+    ASSERT_NOT_NULL(tree);
+    ASSERT_EQ(tree->engine, BTREE_ENGINE_LSM);
+    ASSERT_EQ(lsm_scan(tree, 4000, &count), 0);
+    ASSERT_EQ(count, 2500);
+    ASSERT_EQ(btree_search(tree, 1002, &value), 0);
+    ASSERT_EQ(value, 10020);
+
+    btree_close(tree);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    TEST_END();
+    return 0;
+}
+
+/* Test: Aborts undo flushes, shadow commits copy only the root */
+TEST(lsm_transactions) {
+    struct amidb_pager *pager = NULL;
+    struct page_cache *cache;
+    struct wal_context *wal;
+    struct txn_context *txn;
+    struct btree *tree;
+    uint32_t root_page;
+    uint32_t old_root;
+    uint32_t value;
+    uint32_t count;
+    int32_t key;
+    int rc;
+
+    file_delete(TEST_DB_LSM_TXN);
+
+    TEST_BEGIN();
+
+    rc = pager_open(TEST_DB_LSM_TXN, 0, &pager);
+    ASSERT_EQ(rc, 0);
+    cache = cache_create(64, pager);
+    ASSERT_NOT_NULL(cache);
+    tree = lsm_create(pager, cache, &root_page);
+    ASSERT_NOT_NULL(tree);
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+    txn = txn_create(wal, cache);
+    ASSERT_NOT_NULL(txn);
+    btree_set_transaction(tree, txn);
+
+    /* Committed through the WAL: two flushes */
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    for (key = 1; key <= 1200; key++) {
+        ASSERT_EQ(btree_insert(tree, key, (uint32_t)key * 10), 0);
+    }
+    ASSERT_EQ(txn_commit(txn), AMIDB_OK);
+
+    /* Aborted, across a flush */
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    for (key = 1201; key <= 2000; key++) {
+        ASSERT_EQ(btree_insert(tree, key, (uint32_t)key * 10), 0);
+    }
+    for (key = 1; key <= 100; key++) {
+        ASSERT_EQ(btree_delete(tree, key), 0);
+    }
+    ASSERT_EQ(txn_abort(txn), AMIDB_OK);
+    ASSERT_EQ(tree->root_page, root_page);
+    ASSERT_EQ(lsm_scan(tree, 3000, &count), 0);
+    ASSERT_EQ(count, 1200);
+    ASSERT_EQ(btree_search(tree, 1500, &value), -1);
+
+    /* Shadow paging: the root is copied, merged runs freed at commit */
+    ASSERT_EQ(txn_set_commit_mode(txn, TXN_COMMIT_SHADOW), AMIDB_OK);
+    old_root = tree->root_page;
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    for (key = 1201; key <= 1800; key++) {
+        ASSERT_EQ(btree_insert(tree, key, (uint32_t)key * 10), 0);
+    }
+    ASSERT_NEQ(tree->root_page, old_root);
+    ASSERT_EQ(lsm_merge(tree), 0);
+    ASSERT_EQ(txn_commit(txn), AMIDB_OK);
+    ASSERT_EQ(pager_page_is_allocated(pager, old_root), 0);
+    ASSERT_EQ(lsm_scan(tree, 3000, &count), 0);
+    ASSERT_EQ(count, 1800);
+
+    /* Aborted: the committed root is untouched */
+    old_root = tree->root_page;
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    for (key = 1; key <= 600; key++) {
+        ASSERT_EQ(btree_delete(tree, key), 0);
+    }
+    ASSERT_EQ(txn_abort(txn), AMIDB_OK);
+    tree->root_page = old_root;
+    ASSERT_EQ(lsm_scan(tree, 3000, &count), 0);
+    ASSERT_EQ(count, 1800);
+
+    btree_close(tree);
+    txn_destroy(txn);
+    wal_destroy(wal);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    TEST_END();
+    return 0;
+}
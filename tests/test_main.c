@@ -25,6 +25,7 @@ extern int test_crc32_empty(void);
 extern int test_crc32_incremental(void);
 extern int test_crc32_different_data(void);
 extern int test_crc32_one_bit_change(void);
+extern int test_crc32_combine(void);
 
 /* Phase 2 - Pager tests */
 extern int test_pager_mem_test(void);
@@ -35,6 +36,8 @@ extern int test_pager_allocate_pages(void);
 extern int test_pager_write_read_page(void);
 extern int test_pager_checksum_verification(void);
 extern int test_pager_reopen_database(void);
+extern int test_pager_write_batch_runs(void);
+extern int test_pager_upgrade_v1(void);
 
 /* Phase 2 - Cache tests */
 extern int test_cache_create_destroy(void);
@@ -71,6 +74,7 @@ extern int test_btree_split_100_keys(void);
 extern int test_btree_split_500_keys(void);
 extern int test_btree_split_reverse_500(void);
 extern int test_btree_split_cursor_iteration(void);
+extern int test_btree_split_cursor_seek(void);
 extern int test_btree_split_update_after_split(void);
 
 /* Phase 3B - B+Tree Merge tests */
@@ -97,6 +101,16 @@ extern int test_txn_multi_page_commit(void);
 extern int test_txn_nested_abort(void);
 extern int test_txn_commit_durability(void);
 extern int test_txn_isolation(void);
+extern int test_txn_spill_large_commit(void);
+extern int test_txn_spill_large_abort(void);
+extern int test_txn_undo_restore_from_ram(void);
+extern int test_txn_undo_limit_fallback(void);
+extern int test_txn_undo_spilled_dirty_page(void);
+extern int test_txn_savepoint_rollback(void);
+extern int test_txn_savepoint_wal_images(void);
+extern int test_txn_durability_levels(void);
+extern int test_txn_checkpoint_after_off(void);
+extern int test_txn_background_wal_writer(void);
 
 /* Phase 3C - Recovery tests */
 extern int test_recovery_committed_transaction(void);
@@ -105,6 +119,10 @@ extern int test_recovery_partial_commit(void);
 extern int test_recovery_multiple_transactions(void);
 extern int test_recovery_corrupt_wal_record(void);
 extern int test_recovery_empty_wal(void);
+extern int test_recovery_idempotent_replay(void);
+extern int test_recovery_stale_tail(void);
+extern int test_recovery_normal_durability(void);
+extern int test_recovery_torn_page_before_commit(void);
 
 /* Phase 3C - B+Tree Transaction Integration tests */
 extern int test_btree_insert_with_transaction(void);
@@ -112,6 +130,26 @@ extern int test_btree_split_with_commit(void);
 extern int test_btree_split_with_abort(void);
 extern int test_btree_delete_merge_transaction(void);
 extern int test_btree_complex_multi_operation(void);
+extern int test_btree_snapshot_isolation(void);
+
+/* Online backup tests */
+extern int test_backup_online_consistent(void);
+extern int test_backup_incremental_restore(void);
+
+/* Change data capture tests */
+extern int test_cdc_committed_changes(void);
+extern int test_cdc_recovery_publishes(void);
+
+/* WAL shipping tests */
+extern int test_replica_follows_primary(void);
+
+/* Shadow paging tests */
+extern int test_shadow_commit_abort(void);
+extern int test_shadow_crash_and_snapshot(void);
+
+/* LSM table engine tests */
+extern int test_lsm_runs_and_merges(void);
+extern int test_lsm_transactions(void);
 
 /* Phase 4 - SQL Lexer tests */
 extern int test_lexer_keywords(void);
@@ -131,6 +169,13 @@ extern int test_parser_create_multiple_pk_error(void);
 extern int test_parser_create_no_columns_error(void);
 extern int test_parser_trailing_semicolon(void);
 extern int test_parser_case_insensitive(void);
+extern int test_parser_transaction_statements(void);
+extern int test_parser_create_engine(void);
+extern int test_parser_parameters(void);
+extern int test_parser_compound_where(void);
+extern int test_parser_analyze_explain(void);
+extern int test_parser_inner_join(void);
+extern int test_predicate_stored_rows(void);
 
 /* Phase 4 - SQL Catalog tests */
 extern int test_catalog_create_get(void);
@@ -187,6 +232,22 @@ extern int test_e2e_min_where(void);
 extern int test_e2e_max_basic(void);
 extern int test_e2e_max_empty(void);
 extern int test_e2e_max_where(void);
+extern int test_e2e_catalog_root_split(void);
+extern int test_e2e_delete_root_merge(void);
+extern int test_e2e_savepoint_rollback(void);
+extern int test_e2e_rollback_frees_pages(void);
+extern int test_e2e_shadow_paging(void);
+extern int test_e2e_lsm_table(void);
+extern int test_e2e_select_pipeline(void);
+extern int test_e2e_select_streaming(void);
+extern int test_e2e_prepared_statements(void);
+extern int test_e2e_snapshot_query(void);
+extern int test_e2e_order_by_external(void);
+extern int test_e2e_order_by_topk(void);
+extern int test_e2e_where_compound(void);
+extern int test_e2e_analyze_explain(void);
+extern int test_e2e_inner_join(void);
+extern int test_e2e_hash_join(void);
 
 /* Main test runner */
 int main(void) {
@@ -223,6 +284,7 @@ int main(void) {
     RUN_TEST(crc32_incremental);
     RUN_TEST(crc32_different_data);
     RUN_TEST(crc32_one_bit_change);
+    RUN_TEST(crc32_combine);
 
     /* Phase 2: Storage Tests */
     TEST_SECTION("Phase 2: Storage Engine");
@@ -236,6 +298,8 @@ int main(void) {
     RUN_TEST(pager_write_read_page);
     RUN_TEST(pager_checksum_verification);
     RUN_TEST(pager_reopen_database);
+    RUN_TEST(pager_write_batch_runs);
+    RUN_TEST(pager_upgrade_v1);
 
     test_printf("\nCache Tests:\n");
     RUN_TEST(cache_create_destroy);
@@ -278,6 +342,7 @@ int main(void) {
     RUN_TEST(btree_split_500_keys);
     RUN_TEST(btree_split_reverse_500);
     RUN_TEST(btree_split_cursor_iteration);
+    RUN_TEST(btree_split_cursor_seek);
     RUN_TEST(btree_split_update_after_split);
 
     test_printf("\nB+Tree Merge Tests:\n");
@@ -307,6 +372,16 @@ int main(void) {
     RUN_TEST(txn_nested_abort);
     RUN_TEST(txn_commit_durability);
     RUN_TEST(txn_isolation);
+    RUN_TEST(txn_spill_large_commit);
+    RUN_TEST(txn_spill_large_abort);
+    RUN_TEST(txn_undo_restore_from_ram);
+    RUN_TEST(txn_undo_limit_fallback);
+    RUN_TEST(txn_undo_spilled_dirty_page);
+    RUN_TEST(txn_savepoint_rollback);
+    RUN_TEST(txn_savepoint_wal_images);
+    RUN_TEST(txn_durability_levels);
+    RUN_TEST(txn_checkpoint_after_off);
+    RUN_TEST(txn_background_wal_writer);
 
     test_printf("\nCrash Recovery Tests:\n");
     RUN_TEST(recovery_committed_transaction);
@@ -315,6 +390,10 @@ int main(void) {
     RUN_TEST(recovery_multiple_transactions);
     RUN_TEST(recovery_corrupt_wal_record);
     RUN_TEST(recovery_empty_wal);
+    RUN_TEST(recovery_idempotent_replay);
+    RUN_TEST(recovery_stale_tail);
+    RUN_TEST(recovery_normal_durability);
+    RUN_TEST(recovery_torn_page_before_commit);
 
     test_printf("\nB+Tree Transaction Integration Tests:\n");
     RUN_TEST(btree_insert_with_transaction);
@@ -322,6 +401,26 @@ int main(void) {
     RUN_TEST(btree_split_with_abort);
     RUN_TEST(btree_delete_merge_transaction);
     RUN_TEST(btree_complex_multi_operation);
+    RUN_TEST(btree_snapshot_isolation);
+
+    test_printf("\nOnline Backup Tests:\n");
+    RUN_TEST(backup_online_consistent);
+    RUN_TEST(backup_incremental_restore);
+
+    test_printf("\nChange Data Capture Tests:\n");
+    RUN_TEST(cdc_committed_changes);
+    RUN_TEST(cdc_recovery_publishes);
+
+    test_printf("\nWAL Shipping Tests:\n");
+    RUN_TEST(replica_follows_primary);
+
+    test_printf("\nShadow Paging Tests:\n");
+    RUN_TEST(shadow_commit_abort);
+    RUN_TEST(shadow_crash_and_snapshot);
+
+    test_printf("\nLSM Engine Tests:\n");
+    RUN_TEST(lsm_runs_and_merges);
+    RUN_TEST(lsm_transactions);
 
     /* Phase 4: SQL Parser Tests */
     TEST_SECTION("Phase 4: SQL Parser");
@@ -344,6 +443,13 @@ int main(void) {
     RUN_TEST(parser_create_no_columns_error);
     RUN_TEST(parser_trailing_semicolon);
     RUN_TEST(parser_case_insensitive);
+    RUN_TEST(parser_transaction_statements);
+    RUN_TEST(parser_create_engine);
+    RUN_TEST(parser_parameters);
+    RUN_TEST(parser_compound_where);
+    RUN_TEST(parser_analyze_explain);
+    RUN_TEST(parser_inner_join);
+    RUN_TEST(predicate_stored_rows);
 
     test_printf("\nSQL Catalog Tests:\n");
     RUN_TEST(catalog_create_get);
@@ -404,6 +510,24 @@ int main(void) {
     RUN_TEST(e2e_max_empty);
     RUN_TEST(e2e_max_where);
 
+    test_printf("\nTransaction Tests:\n");
+    RUN_TEST(e2e_catalog_root_split);
+    RUN_TEST(e2e_delete_root_merge);
+    RUN_TEST(e2e_savepoint_rollback);
+    RUN_TEST(e2e_rollback_frees_pages);
+    RUN_TEST(e2e_shadow_paging);
+    RUN_TEST(e2e_lsm_table);
+    RUN_TEST(e2e_select_pipeline);
+    RUN_TEST(e2e_select_streaming);
+    RUN_TEST(e2e_prepared_statements);
+    RUN_TEST(e2e_snapshot_query);
+    RUN_TEST(e2e_order_by_external);
+    RUN_TEST(e2e_order_by_topk);
+    RUN_TEST(e2e_where_compound);
+    RUN_TEST(e2e_analyze_explain);
+    RUN_TEST(e2e_inner_join);
+    RUN_TEST(e2e_hash_join);
+
     /* Summary */
     test_printf("\n===============================================\n");
     test_printf("Test Results\n");
@@ -4,8 +4,11 @@
 
 #include "test_harness.h"
 #include "storage/pager.h"
+#include "txn/wal.h"
 #include "os/file.h"
 #include "os/mem.h"
+#include "util/endian.h"
+#include "util/crc32.h"
 #include <string.h>
 #include <stdio.h>
 
@@ -15,6 +18,8 @@
 #define TEST_DB_WRITE_READ "RAM:test_write_read.db"
 #define TEST_DB_CHECKSUM "RAM:test_checksum.db"
 #define TEST_DB_REOPEN "RAM:test_reopen.db"
+#define TEST_DB_BATCH "RAM:test_batch.db"
+#define TEST_DB_UPGRADE "RAM:test_upgrade.db"
 
 /* Test: Memory allocation */
 TEST(pager_mem_test) {
@@ -188,11 +193,12 @@ TEST(pager_allocate_pages) {
     ASSERT_EQ(rc, 0);
     ASSERT_EQ(page2, 2);
 
+    /* Pages 3-34 are the WAL region and are never handed out */
     rc = pager_allocate_page(pager, &page3);
     ASSERT_EQ(rc, 0);
-    ASSERT_EQ(page3, 3);
+    ASSERT_EQ(page3, 35);
 
-    ASSERT_EQ(pager_get_page_count(pager), 4);
+    ASSERT_EQ(pager_get_page_count(pager), 36);
 
     pager_close(pager);
 
@@ -349,3 +355,164 @@ TEST(pager_reopen_database) {
     TEST_END();
     return 0;
 }
+
+/* Test: Batched writes are sorted and merged into runs */
+TEST(pager_write_batch_runs) {
+    static uint8_t images[12][AMIDB_PAGE_SIZE];
+    static uint8_t read_data[AMIDB_PAGE_SIZE];
+    struct amidb_pager *pager = NULL;
+    struct pager_write writes[12];
+    uint32_t pages[14];
+    uint32_t i;
+    int rc;
+
+    file_delete(TEST_DB_BATCH);
+
+    TEST_BEGIN();
+
+    rc = pager_open(TEST_DB_BATCH, 0, &pager);
+    ASSERT_EQ(rc, 0);
+
+    for (i = 0; i < 14; i++) {
+        rc = pager_allocate_page(pager, &pages[i]);
+        ASSERT_EQ(rc, 0);
+    }
+
+    /* Pages 0-9 and 12-13 of the allocation, handed over back to front; */
+    /* every third image already stamped */
+    for (i = 0; i < 12; i++) {
+        uint32_t page_num = pages[(i < 10) ? 9 - i : 12 + (i - 10)];
+
+        memset(images[i], 0, AMIDB_PAGE_SIZE);
+        images[i][4] = PAGE_TYPE_BTREE;
+        images[i][AMIDB_PAGE_HEADER_SIZE] = (uint8_t)page_num;
+        writes[i].page_num = page_num;
+        writes[i].data = images[i];
+        writes[i].stamped = (i % 3 == 0);
+        if (writes[i].stamped) {
+            pager_stamp_page(images[i], page_num);
+        }
+    }
+
+    rc = pager_write_batch(pager, writes, 12);
+    ASSERT_EQ(rc, 0);
+
+    /* Sorted, and 10 + 2 consecutive pages took 8 + 2 + 2 writes */
+    for (i = 1; i < 12; i++) {
+        ASSERT_GT(writes[i].page_num, writes[i - 1].page_num);
+        ASSERT_EQ(writes[i].result, 0);
+    }
+    ASSERT_EQ(pager->batch_pages, 12);
+    ASSERT_EQ(pager->batch_writes, 3);
+
+    /* Every page reads back with a valid checksum */
+    for (i = 0; i < 14; i++) {
+        if (i == 10 || i == 11) {
+            continue;
+        }
+        rc = pager_read_page(pager, pages[i], read_data);
+        ASSERT_EQ(rc, 0);
+        ASSERT_EQ(read_data[AMIDB_PAGE_HEADER_SIZE], (uint8_t)pages[i]);
+    }
+
+    pager_close(pager);
+    file_delete(TEST_DB_BATCH);
+
+    TEST_END();
+    return 0;
+}
+
+/* Version 1 images of the upgrade test pages */
+static uint8_t upgrade_images[3][AMIDB_PAGE_SIZE];
+
+/* Turn a current page image back into its version 1 form */
+static void make_v1_page(uint8_t *buf) {
+    memmove(buf + 12, buf + AMIDB_PAGE_HEADER_SIZE, AMIDB_PAGE_SIZE - AMIDB_PAGE_HEADER_SIZE);
+    memset(buf + AMIDB_PAGE_SIZE - 4, 0, 4);
+    crc32_init();
+    put_u32(buf + 8, crc32_compute(buf + 12, AMIDB_PAGE_SIZE - 12));
+}
+
+/* Test: A version 1 file is upgraded on open, also after an interruption */
+TEST(pager_upgrade_v1) {
+    static uint8_t page_data[AMIDB_PAGE_SIZE];
+    struct amidb_pager *pager = NULL;
+    amidb_file_t file;
+    uint32_t pages[3];
+    uint32_t pass, i;
+    int rc;
+
+    file_delete(TEST_DB_UPGRADE);
+
+    TEST_BEGIN();
+
+    /* Three pages with contents up to the last byte that still fits */
+    rc = pager_open(TEST_DB_UPGRADE, 0, &pager);
+    ASSERT_EQ(rc, 0);
+    for (i = 0; i < 3; i++) {
+        rc = pager_allocate_page(pager, &pages[i]);
+        ASSERT_EQ(rc, 0);
+        memset(page_data, 0, AMIDB_PAGE_SIZE);
+        page_data[4] = PAGE_TYPE_BTREE;
+        page_data[AMIDB_PAGE_HEADER_SIZE] = (uint8_t)(0x51 + i);
+        page_data[AMIDB_PAGE_SIZE - 5] = (uint8_t)(0x61 + i);
+        rc = pager_write_page(pager, pages[i], page_data);
+        ASSERT_EQ(rc, 0);
+    }
+    pager_close(pager);
+
+    /* Pass 0: a plain version 1 file. Pass 1: an upgrade that stopped */
+    /* halfway through the second page, with its original in its slot */
+    for (pass = 0; pass < 2; pass++) {
+        file = file_open(TEST_DB_UPGRADE, AMIDB_O_RDWR);
+        ASSERT_NOT_NULL(file);
+        for (i = 0; i < 3; i++) {
+            file_seek(file, pages[i] * AMIDB_PAGE_SIZE, AMIDB_SEEK_SET);
+            ASSERT_EQ(file_read(file, upgrade_images[i], AMIDB_PAGE_SIZE), AMIDB_PAGE_SIZE);
+            make_v1_page(upgrade_images[i]);
+            if (pass == 1 && i == 0) {
+                continue;  /* Already rewritten */
+            }
+            if (pass == 1 && i == 1) {
+                file_seek(file, WAL_REGION_START + (pages[i] % 2) * AMIDB_PAGE_SIZE, AMIDB_SEEK_SET);
+                file_write(file, upgrade_images[i], AMIDB_PAGE_SIZE);
+                memset(upgrade_images[i] + 12, 0xEE, 64);  /* Torn */
+            }
+            file_seek(file, pages[i] * AMIDB_PAGE_SIZE, AMIDB_SEEK_SET);
+            file_write(file, upgrade_images[i], AMIDB_PAGE_SIZE);
+        }
+
+        file_seek(file, 0, AMIDB_SEEK_SET);
+        ASSERT_EQ(file_read(file, page_data, AMIDB_PAGE_SIZE), AMIDB_PAGE_SIZE);
+        put_u32(page_data + 4, AMIDB_VERSION_V1);
+        if (pass == 1) {
+            put_u32(page_data + 28, get_u32(page_data + 28) | DB_FLAG_UPGRADING);
+        }
+        file_seek(file, 0, AMIDB_SEEK_SET);
+        file_write(file, page_data, AMIDB_PAGE_SIZE);
+        file_sync(file);
+        file_close(file);
+
+        /* Not upgraded read-only */
+        rc = pager_open(TEST_DB_UPGRADE, 1, &pager);
+        ASSERT_NEQ(rc, 0);
+
+        rc = pager_open(TEST_DB_UPGRADE, 0, &pager);
+        ASSERT_EQ(rc, 0);
+        ASSERT_EQ(pager->header.version, AMIDB_VERSION);
+        ASSERT_EQ(pager->header.flags & DB_FLAG_UPGRADING, 0);
+        for (i = 0; i < 3; i++) {
+            rc = pager_read_page(pager, pages[i], page_data);
+            ASSERT_EQ(rc, 0);
+            ASSERT_EQ(pager_get_page_lsn(page_data), 0);
+            ASSERT_EQ(page_data[AMIDB_PAGE_HEADER_SIZE], 0x51 + i);
+            ASSERT_EQ(page_data[AMIDB_PAGE_SIZE - 5], 0x61 + i);
+        }
+        pager_close(pager);
+    }
+
+    file_delete(TEST_DB_UPGRADE);
+
+    TEST_END();
+    return 0;
+}
@@ -20,6 +20,27 @@
 #define TEST_DB_RECOVERY_MULTI "RAM:recovery_multi.db"
 #define TEST_DB_RECOVERY_CORRUPT "RAM:recovery_corrupt.db"
 #define TEST_DB_RECOVERY_EMPTY "RAM:recovery_empty.db"
+#define TEST_DB_RECOVERY_REPLAY "RAM:recovery_replay.db"
+#define TEST_DB_RECOVERY_STALE "RAM:recovery_stale.db"
+#define TEST_DB_RECOVERY_NORMAL "RAM:recovery_normal.db"
+#define TEST_DB_RECOVERY_TORN "RAM:recovery_torn.db"
+
+/* Page buffers (static: too large for the 4KB 68000 stack) */
+static uint8_t recovery_page[AMIDB_PAGE_SIZE];
+static struct {
+    uint32_t page_num;
+    uint8_t data[AMIDB_PAGE_SIZE];
+} recovery_payload;
+
+/* Append a PAGE record whose image has one marker byte */
+static int log_marker_page(struct wal_context *wal, uint32_t page_num, uint8_t value)
+{
+    recovery_payload.page_num = page_num;
+    memset(recovery_payload.data, 0, AMIDB_PAGE_SIZE);
+    pager_set_page_lsn(recovery_payload.data, wal->next_lsn);
+    recovery_payload.data[AMIDB_PAGE_HEADER_SIZE] = value;
+    return wal_write_record(wal, WAL_PAGE, &recovery_payload, sizeof(recovery_payload));
+}
 
 /* Test: Recovery of committed transaction */
 TEST(recovery_committed_transaction) {
@@ -62,8 +83,8 @@ TEST(recovery_committed_transaction) {
     rc = cache_get_page(cache, page_num, &data);
     ASSERT_EQ(rc, 0);
     for (i = 0; i < 100; i++) {
-        data[12 + i] = (uint8_t)(0xA0 + i);
-        test_pattern[i] = data[12 + i];
+        data[AMIDB_PAGE_HEADER_SIZE + i] = (uint8_t)(0xA0 + i);
+        test_pattern[i] = data[AMIDB_PAGE_HEADER_SIZE + i];
     }
 
     cache_mark_dirty(cache, page_num);
@@ -94,7 +115,7 @@ TEST(recovery_committed_transaction) {
     ASSERT_EQ(rc, 0);
 
     for (i = 0; i < 100; i++) {
-        ASSERT_EQ(data[12 + i], test_pattern[i]);
+        ASSERT_EQ(data[AMIDB_PAGE_HEADER_SIZE + i], test_pattern[i]);
     }
 
     cache_unpin(cache, page_num);
@@ -131,7 +152,7 @@ TEST(recovery_uncommitted_transaction) {
 
     rc = cache_get_page(cache, page_num, &data);
     ASSERT_EQ(rc, 0);
-    data[12] = 0x11;
+    data[AMIDB_PAGE_HEADER_SIZE] = 0x11;
     original_value = 0x11;
 
     cache_mark_dirty(cache, page_num);
@@ -152,7 +173,7 @@ TEST(recovery_uncommitted_transaction) {
 
     rc = cache_get_page(cache, page_num, &data);
     ASSERT_EQ(rc, 0);
-    data[12] = 0x99;  /* This should NOT persist */
+    data[AMIDB_PAGE_HEADER_SIZE] = 0x99;  /* This should NOT persist */
 
     /* Write to WAL buffer but DON'T commit */
     /* Just write BEGIN record, no COMMIT */
@@ -177,7 +198,7 @@ TEST(recovery_uncommitted_transaction) {
     /* Verify original value (uncommitted change should be ignored) */
     rc = cache_get_page(cache, page_num, &data);
     ASSERT_EQ(rc, 0);
-    ASSERT_EQ(data[12], original_value);
+    ASSERT_EQ(data[AMIDB_PAGE_HEADER_SIZE], original_value);
 
     cache_unpin(cache, page_num);
     cache_destroy(cache);
@@ -212,7 +233,7 @@ TEST(recovery_partial_commit) {
 
     rc = cache_get_page(cache, page_num, &data);
     ASSERT_EQ(rc, 0);
-    data[12] = 0x22;
+    data[AMIDB_PAGE_HEADER_SIZE] = 0x22;
     original_value = 0x22;
 
     cache_mark_dirty(cache, page_num);
@@ -236,7 +257,7 @@ TEST(recovery_partial_commit) {
     } payload;
     payload.page_num = page_num;
     memset(payload.data, 0, AMIDB_PAGE_SIZE);
-    payload.data[12] = 0xCC;  /* Different from original */
+    payload.data[AMIDB_PAGE_HEADER_SIZE] = 0xCC;  /* Different from original */
 
     rc = wal_write_record(wal, WAL_PAGE, &payload, sizeof(payload));
     ASSERT_EQ(rc, AMIDB_OK);
@@ -265,7 +286,7 @@ TEST(recovery_partial_commit) {
     /* Verify original value (uncommitted txn should be ignored) */
     rc = cache_get_page(cache, page_num, &data);
     ASSERT_EQ(rc, 0);
-    ASSERT_EQ(data[12], original_value);
+    ASSERT_EQ(data[AMIDB_PAGE_HEADER_SIZE], original_value);
 
     cache_unpin(cache, page_num);
     cache_destroy(cache);
@@ -314,7 +335,7 @@ TEST(recovery_multiple_transactions) {
 
     rc = cache_get_page(cache, page1, &data);
     ASSERT_EQ(rc, 0);
-    data[12] = 0xAA;
+    data[AMIDB_PAGE_HEADER_SIZE] = 0xAA;
 
     cache_mark_dirty(cache, page1);
     txn_add_dirty_page(txn, page1);
@@ -330,7 +351,7 @@ TEST(recovery_multiple_transactions) {
 
     rc = cache_get_page(cache, page2, &data);
     ASSERT_EQ(rc, 0);
-    data[12] = 0xBB;
+    data[AMIDB_PAGE_HEADER_SIZE] = 0xBB;
 
     cache_mark_dirty(cache, page2);
     txn_add_dirty_page(txn, page2);
@@ -355,12 +376,12 @@ TEST(recovery_multiple_transactions) {
 
     rc = cache_get_page(cache, page1, &data);
     ASSERT_EQ(rc, 0);
-    ASSERT_EQ(data[12], 0xAA);
+    ASSERT_EQ(data[AMIDB_PAGE_HEADER_SIZE], 0xAA);
     cache_unpin(cache, page1);
 
     rc = cache_get_page(cache, page2, &data);
     ASSERT_EQ(rc, 0);
-    ASSERT_EQ(data[12], 0xBB);
+    ASSERT_EQ(data[AMIDB_PAGE_HEADER_SIZE], 0xBB);
     cache_unpin(cache, page2);
 
     cache_destroy(cache);
@@ -478,3 +499,286 @@ TEST(recovery_empty_wal) {
     TEST_END();
     return 0;
 }
+
+/* Test: Replaying the same WAL twice only writes pages once */
+TEST(recovery_idempotent_replay) {
+    struct amidb_pager *pager = NULL;
+    struct wal_context *wal;
+    uint32_t page_num;
+    int rc;
+
+    TEST_BEGIN();
+
+    rc = pager_open(TEST_DB_RECOVERY_REPLAY, 0, &pager);
+    ASSERT_EQ(rc, 0);
+
+    rc = pager_allocate_page(pager, &page_num);
+    ASSERT_EQ(rc, 0);
+    memset(recovery_page, 0, AMIDB_PAGE_SIZE);
+    rc = pager_write_page(pager, page_num, recovery_page);
+    ASSERT_EQ(rc, 0);
+
+    /* Committed transaction that never reached the database file */
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+    wal->current_txn_id = 1;
+    ASSERT_EQ(wal_write_record(wal, WAL_BEGIN, NULL, 0), AMIDB_OK);
+    ASSERT_EQ(log_marker_page(wal, page_num, 0x5A), AMIDB_OK);
+    ASSERT_EQ(wal_write_record(wal, WAL_COMMIT, NULL, 0), AMIDB_OK);
+    ASSERT_EQ(wal_flush(wal), AMIDB_OK);
+    wal_destroy(wal);
+
+    /* First recovery applies the image */
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+    rc = wal_recover(wal);
+    ASSERT_EQ(rc, AMIDB_OK);
+    ASSERT_EQ(wal->recovered_records, 3);
+    ASSERT_EQ(wal->recovered_pages, 1);
+    ASSERT_EQ(pager->header.checkpoint_lsn, 3);
+    wal_destroy(wal);
+
+    rc = pager_read_page(pager, page_num, recovery_page);
+    ASSERT_EQ(rc, 0);
+    ASSERT_EQ(recovery_page[AMIDB_PAGE_HEADER_SIZE], 0x5A);
+    ASSERT_EQ(pager_get_page_lsn(recovery_page), 2);
+
+    /* Second recovery, with the checkpoint LSN lost: page LSN wins */
+    pager->header.checkpoint_lsn = 0;
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+    rc = wal_recover(wal);
+    ASSERT_EQ(rc, AMIDB_OK);
+    ASSERT_EQ(wal->recovered_pages, 0);
+    ASSERT_EQ(wal->recovered_skipped, 1);
+    ASSERT_EQ(wal->next_lsn, 4);
+    wal_destroy(wal);
+
+    /* Third recovery: everything is below the checkpoint LSN */
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+    rc = wal_recover(wal);
+    ASSERT_EQ(rc, AMIDB_OK);
+    ASSERT_EQ(wal->recovered_pages, 0);
+    ASSERT_EQ(wal->recovered_skipped, 1);
+    wal_destroy(wal);
+
+    pager_close(pager);
+
+    TEST_END();
+    return 0;
+}
+
+/* Test: Recovery stops where LSNs stop increasing */
+TEST(recovery_stale_tail) {
+    struct amidb_pager *pager = NULL;
+    struct wal_context *wal;
+    uint32_t page1, page2;
+    int rc;
+
+    TEST_BEGIN();
+
+    rc = pager_open(TEST_DB_RECOVERY_STALE, 0, &pager);
+    ASSERT_EQ(rc, 0);
+
+    rc = pager_allocate_page(pager, &page1);
+    ASSERT_EQ(rc, 0);
+    rc = pager_allocate_page(pager, &page2);
+    ASSERT_EQ(rc, 0);
+    memset(recovery_page, 0, AMIDB_PAGE_SIZE);
+    ASSERT_EQ(pager_write_page(pager, page1, recovery_page), 0);
+    ASSERT_EQ(pager_write_page(pager, page2, recovery_page), 0);
+
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+
+    /* Older, longer transaction: LSNs 1-4 */
+    wal->current_txn_id = 1;
+    ASSERT_EQ(wal_write_record(wal, WAL_BEGIN, NULL, 0), AMIDB_OK);
+    ASSERT_EQ(log_marker_page(wal, page1, 0x11), AMIDB_OK);
+    ASSERT_EQ(log_marker_page(wal, page2, 0x22), AMIDB_OK);
+    ASSERT_EQ(wal_write_record(wal, WAL_COMMIT, NULL, 0), AMIDB_OK);
+    ASSERT_EQ(wal_flush(wal), AMIDB_OK);
+
+    /* Checkpointed, then a newer transaction with the same ID overwrites */
+    /* the first two records and crashes before its COMMIT: LSNs 5-6 */
+    pager->header.checkpoint_lsn = 4;
+    wal_reset_buffer(wal);
+    ASSERT_EQ(wal_write_record(wal, WAL_BEGIN, NULL, 0), AMIDB_OK);
+    ASSERT_EQ(log_marker_page(wal, page1, 0x33), AMIDB_OK);
+    ASSERT_EQ(wal_flush(wal), AMIDB_OK);
+    wal_destroy(wal);
+
+    /* The old PAGE and COMMIT records after it must not commit it */
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+    rc = wal_recover(wal);
+    ASSERT_EQ(rc, AMIDB_OK);
+    ASSERT_EQ(wal->recovered_records, 2);
+    ASSERT_EQ(wal->recovered_pages, 0);
+    ASSERT_EQ(wal->next_lsn, 7);
+    wal_destroy(wal);
+
+    rc = pager_read_page(pager, page1, recovery_page);
+    ASSERT_EQ(rc, 0);
+    ASSERT_EQ(recovery_page[AMIDB_PAGE_HEADER_SIZE], 0);
+    rc = pager_read_page(pager, page2, recovery_page);
+    ASSERT_EQ(rc, 0);
+    ASSERT_EQ(recovery_page[AMIDB_PAGE_HEADER_SIZE], 0);
+
+    pager_close(pager);
+
+    TEST_END();
+    return 0;
+}
+
+/* Test: NORMAL durability commits survive losing unsynced page writes */
+TEST(recovery_normal_durability) {
+    struct amidb_pager *pager = NULL;
+    struct page_cache *cache;
+    struct wal_context *wal;
+    struct txn_context *txn;
+    struct cache_entry *entry;
+    uint32_t pages[2];
+    uint8_t *data;
+    uint32_t i;
+    int rc;
+
+    TEST_BEGIN();
+
+    rc = pager_open(TEST_DB_RECOVERY_NORMAL, 0, &pager);
+    ASSERT_EQ(rc, 0);
+
+    cache = cache_create(16, pager);
+    ASSERT_NOT_NULL(cache);
+
+    for (i = 0; i < 2; i++) {
+        rc = pager_allocate_page(pager, &pages[i]);
+        ASSERT_EQ(rc, 0);
+    }
+
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+    txn = txn_create(wal, cache);
+    ASSERT_NOT_NULL(txn);
+    ASSERT_EQ(wal_set_durability(wal, WAL_SYNC_NORMAL), AMIDB_OK);
+
+    /* Two committed transactions, WAL not checkpointed */
+    for (i = 0; i < 2; i++) {
+        rc = txn_begin(txn);
+        ASSERT_EQ(rc, AMIDB_OK);
+
+        rc = cache_get_page(cache, pages[i], &data);
+        ASSERT_EQ(rc, 0);
+        data[AMIDB_PAGE_HEADER_SIZE] = (uint8_t)(0x41 + i);
+
+        cache_mark_dirty(cache, pages[i]);
+        txn_add_dirty_page(txn, pages[i]);
+        entry = cache_find_entry(cache, pages[i]);
+        entry->txn_id = txn->txn_id;
+        cache_unpin(cache, pages[i]);
+
+        rc = txn_commit(txn);
+        ASSERT_EQ(rc, AMIDB_OK);
+    }
+    ASSERT_GT(pager->header.wal_head, 0);
+
+    /* Crash: the unsynced page writes never made it */
+    memset(recovery_page, 0, AMIDB_PAGE_SIZE);
+    for (i = 0; i < 2; i++) {
+        ASSERT_EQ(pager_write_page(pager, pages[i], recovery_page), 0);
+    }
+
+    txn_destroy(txn);
+    wal_destroy(wal);
+    cache_destroy(cache);
+    pager_close(pager);  /* Live WAL: dirty flag stays set */
+
+    /* Reopen: recovery replays both transactions */
+    rc = pager_open(TEST_DB_RECOVERY_NORMAL, 0, &pager);
+    ASSERT_EQ(rc, 0);
+    ASSERT_EQ(pager->header.flags & DB_FLAG_DIRTY, 0);
+
+    for (i = 0; i < 2; i++) {
+        rc = pager_read_page(pager, pages[i], recovery_page);
+        ASSERT_EQ(rc, 0);
+        ASSERT_EQ(recovery_page[AMIDB_PAGE_HEADER_SIZE], 0x41 + i);
+    }
+
+    pager_close(pager);
+
+    TEST_END();
+    return 0;
+}
+
+/* Test: A torn page image ends the log before its COMMIT */
+TEST(recovery_torn_page_before_commit) {
+    struct amidb_pager *pager = NULL;
+    struct wal_context *wal;
+    uint32_t page1, page2;
+    uint32_t offset;
+    uint8_t byte;
+    void *file_handle;
+    int rc;
+
+    TEST_BEGIN();
+
+    rc = pager_open(TEST_DB_RECOVERY_TORN, 0, &pager);
+    ASSERT_EQ(rc, 0);
+
+    rc = pager_allocate_page(pager, &page1);
+    ASSERT_EQ(rc, 0);
+    rc = pager_allocate_page(pager, &page2);
+    ASSERT_EQ(rc, 0);
+    memset(recovery_page, 0, AMIDB_PAGE_SIZE);
+    ASSERT_EQ(pager_write_page(pager, page1, recovery_page), 0);
+    ASSERT_EQ(pager_write_page(pager, page2, recovery_page), 0);
+
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+
+    wal->current_txn_id = 1;
+    ASSERT_EQ(wal_write_record(wal, WAL_BEGIN, NULL, 0), AMIDB_OK);
+    ASSERT_EQ(log_marker_page(wal, page1, 0x11), AMIDB_OK);
+    ASSERT_EQ(log_marker_page(wal, page2, 0x22), AMIDB_OK);
+    ASSERT_EQ(wal_write_record(wal, WAL_COMMIT, NULL, 0), AMIDB_OK);
+    ASSERT_EQ(wal_flush(wal), AMIDB_OK);
+    wal_destroy(wal);
+
+    /* Tear the second page image: its marker byte never reached disk */
+    offset = WAL_REGION_START +
+             sizeof(struct wal_record_header) +
+             (sizeof(struct wal_record_header) + sizeof(recovery_payload)) +
+             sizeof(struct wal_record_header) + 4 + AMIDB_PAGE_HEADER_SIZE;
+    file_handle = file_open(TEST_DB_RECOVERY_TORN, AMIDB_O_RDWR);
+    ASSERT_NOT_NULL(file_handle);
+    file_seek(file_handle, offset, AMIDB_SEEK_SET);
+    file_read(file_handle, &byte, 1);
+    ASSERT_EQ(byte, 0x22);
+    byte = 0;
+    file_seek(file_handle, offset, AMIDB_SEEK_SET);
+    file_write(file_handle, &byte, 1);
+    file_sync(file_handle);
+    file_close(file_handle);
+
+    /* The COMMIT after it must not replay the first page alone */
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+    rc = wal_recover(wal);
+    ASSERT_EQ(rc, AMIDB_OK);
+    ASSERT_EQ(wal->recovered_records, 2);
+    ASSERT_EQ(wal->recovered_pages, 0);
+    wal_destroy(wal);
+
+    rc = pager_read_page(pager, page1, recovery_page);
+    ASSERT_EQ(rc, 0);
+    ASSERT_EQ(recovery_page[AMIDB_PAGE_HEADER_SIZE], 0);
+    rc = pager_read_page(pager, page2, recovery_page);
+    ASSERT_EQ(rc, 0);
+    ASSERT_EQ(recovery_page[AMIDB_PAGE_HEADER_SIZE], 0);
+
+    pager_close(pager);
+
+    TEST_END();
+    return 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * test_replica.c - Tests for WAL shipping to a follower
+ */
+
+#include "test_harness.h"
+#include "txn/replica.h"
+#include "txn/txn.h"
+#include "txn/wal.h"
+#include "storage/backup.h"
+#include "storage/pager.h"
+#include "storage/cache.h"
+#include "os/file.h"
+#include "api/error.h"
+#include <string.h>
+
+#define TEST_DB_REPLICA_PRIMARY  "RAM:replica_primary.db"
+#define TEST_DB_REPLICA_FOLLOWER "RAM:replica_follower.db"
+#define TEST_DB_REPLICA_STREAM   "RAM:replica.ship"
+
+#define REPLICA_TEST_PAGES 4
+
+/* Helper: commit value into the given pages */
+static int replica_test_commit(struct page_cache *cache, struct txn_context *txn,
+                               const uint32_t *pages, uint32_t count, uint8_t value)
+{
+    struct cache_entry *entry;
+    uint8_t *data;
+    uint32_t i;
+
+    if (txn_begin(txn) != AMIDB_OK) {
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        if (cache_get_page(cache, pages[i], &data) != 0) {
+            return -1;
+        }
+        data[4] = PAGE_TYPE_BTREE;
+        data[AMIDB_PAGE_HEADER_SIZE] = value;
+        cache_mark_dirty(cache, pages[i]);
+        txn_add_dirty_page(txn, pages[i]);
+        entry = cache_find_entry(cache, pages[i]);
+        entry->txn_id = txn->txn_id;
+        cache_unpin(cache, pages[i]);
+    }
+
+    return txn_commit(txn);
+}
+
+/* Helper: value a page holds, as the follower's readers see it */
+static int replica_test_value(struct page_cache *cache, uint32_t page_num)
+{
+    uint8_t *data;
+    int value;
+
+    if (cache_get_page(cache, page_num, &data) != 0) {
+        return -1;
+    }
+    value = data[AMIDB_PAGE_HEADER_SIZE];
+    cache_unpin(cache, page_num);
+
+    return value;
+}
+
+/* Test: Committed transactions reach the follower, whole and once */
+TEST(replica_follows_primary) {
+    struct amidb_pager *pager = NULL;
+    struct amidb_pager *fpager = NULL;
+    struct page_cache *cache;
+    struct page_cache *fcache;
+    struct wal_context *wal;
+    struct wal_context *fwal;
+    struct txn_context *txn;
+    struct amidb_backup *backup;
+    struct replica *replica;
+    uint32_t pages[REPLICA_TEST_PAGES];
+    uint32_t extra;
+    uint32_t cached;
+    uint32_t dirty;
+    uint32_t pinned;
+    uint8_t *held;
+    struct cache_entry *entry;
+    uint32_t i;
+    int rc;
+
+    file_delete(TEST_DB_REPLICA_PRIMARY);
+    file_delete(TEST_DB_REPLICA_FOLLOWER);
+    file_delete(TEST_DB_REPLICA_STREAM);
+
+    TEST_BEGIN();
+
+    rc = pager_open(TEST_DB_REPLICA_PRIMARY, 0, &pager);
+    ASSERT_EQ(rc, 0);
+    cache = cache_create(16, pager);
+    ASSERT_NOT_NULL(cache);
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+    txn = txn_create(wal, cache);
+    ASSERT_NOT_NULL(txn);
+
+    for (i = 0; i < REPLICA_TEST_PAGES; i++) {
+        rc = pager_allocate_page(pager, &pages[i]);
+        ASSERT_EQ(rc, 0);
+    }
+    ASSERT_EQ(replica_test_commit(cache, txn, pages, REPLICA_TEST_PAGES, 0x11), AMIDB_OK);
+
+    /* Ship first, then copy: nothing committed in between is missed */
+    ASSERT_EQ(replica_ship_start(wal, TEST_DB_REPLICA_STREAM), AMIDB_OK);
+    ASSERT_EQ(replica_ship_start(wal, TEST_DB_REPLICA_STREAM), AMIDB_BUSY);
+    ASSERT_EQ(amidb_backup_init(pager, TEST_DB_REPLICA_FOLLOWER, &backup), AMIDB_OK);
+    do {
+        rc = amidb_backup_step(backup, 8);
+    } while (rc == AMIDB_OK);
+    ASSERT_EQ(rc, AMIDB_DONE);
+    amidb_backup_finish(backup);
+
+    ASSERT_EQ(replica_test_commit(cache, txn, pages, 2, 0x22), AMIDB_OK);
+    ASSERT_EQ(replica_test_commit(cache, txn, &pages[2], 1, 0x33), AMIDB_OK);
+
+    /* Allocations are not logged; the follower claims the new page */
+    rc = pager_allocate_page(pager, &extra);
+    ASSERT_EQ(rc, 0);
+    ASSERT_EQ(replica_test_commit(cache, txn, &extra, 1, 0x55), AMIDB_OK);
+    ASSERT_GT(wal->ship_bytes, 0);
+
+    /* Follower: a cached page is replaced by the shipped image */
+    rc = pager_open(TEST_DB_REPLICA_FOLLOWER, 0, &fpager);
+    ASSERT_EQ(rc, 0);
+    fcache = cache_create(16, fpager);
+    ASSERT_NOT_NULL(fcache);
+    fwal = wal_create(fpager);
+    ASSERT_NOT_NULL(fwal);
+    ASSERT_EQ(replica_test_value(fcache, pages[0]), 0x11);
+
+    ASSERT_EQ(replica_open(fwal, fcache, "RAM:replica_missing.ship", &replica), AMIDB_NOTFOUND);
+    ASSERT_EQ(replica_open(fwal, fcache, TEST_DB_REPLICA_STREAM, &replica), AMIDB_OK);
+    ASSERT_EQ(replica_poll(replica), 3);
+    ASSERT_EQ(fpager->header.page_count, pager->header.page_count);
+    ASSERT_EQ(replica_test_value(fcache, extra), 0x55);
+    ASSERT_EQ(replica_test_value(fcache, pages[0]), 0x22);
+    ASSERT_EQ(replica_test_value(fcache, pages[1]), 0x22);
+    ASSERT_EQ(replica_test_value(fcache, pages[2]), 0x33);
+    ASSERT_EQ(replica_test_value(fcache, pages[3]), 0x11);
+    ASSERT_EQ(replica_poll(replica), 0);
+
+    /* A transaction without its COMMIT yet waits for a later poll */
+    wal->current_txn_id = 99;
+    ASSERT_EQ(wal_write_record(wal, WAL_BEGIN, NULL, 0), AMIDB_OK);
+    ASSERT_EQ(wal_flush(wal), AMIDB_OK);
+    ASSERT_EQ(replica_poll(replica), 0);
+
+    /* A page a reader holds pinned is read again in place */
+    ASSERT_EQ(cache_get_page(fcache, pages[3], &held), 0);
+    ASSERT_EQ(replica_test_commit(cache, txn, &pages[3], 1, 0x44), AMIDB_OK);
+    ASSERT_EQ(replica_poll(replica), 1);
+    ASSERT_EQ(held[AMIDB_PAGE_HEADER_SIZE], 0x44);
+    cache_unpin(fcache, pages[3]);
+    ASSERT_EQ(replica_test_value(fcache, pages[3]), 0x44);
+
+    /* Dropped pages leave the LRU list too */
+    cache_get_stats(fcache, &cached, &dirty, &pinned);
+    ASSERT_EQ(pinned, 0);
+    for (entry = fcache->lru_head, i = 0; entry; entry = entry->lru_next, i++) {
+        ASSERT_NEQ(entry->state, CACHE_ENTRY_INVALID);
+    }
+    ASSERT_EQ(i, cached);
+    ASSERT_EQ(replica->txns_applied, 4);
+    replica_close(replica);
+
+    /* Reattaching skips what was applied */
+    ASSERT_EQ(replica_open(fwal, fcache, TEST_DB_REPLICA_STREAM, &replica), AMIDB_OK);
+    ASSERT_EQ(replica_poll(replica), 0);
+    ASSERT_GT(replica->records_skipped, 0);
+    replica_close(replica);
+
+    /* The follower reopens clean with the applied pages */
+    wal_destroy(fwal);
+    cache_destroy(fcache);
+    pager_close(fpager);
+    rc = pager_open(TEST_DB_REPLICA_FOLLOWER, 0, &fpager);
+    ASSERT_EQ(rc, 0);
+    ASSERT_EQ(fpager->header.flags & DB_FLAG_DIRTY, 0);
+    fcache = cache_create(16, fpager);
+    ASSERT_NOT_NULL(fcache);
+    ASSERT_EQ(replica_test_value(fcache, pages[2]), 0x33);
+    cache_destroy(fcache);
+    pager_close(fpager);
+
+    replica_ship_stop(wal);
+    ASSERT_NULL(wal->ship_handle);
+
+    txn_destroy(txn);
+    wal_destroy(wal);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    TEST_END();
+    return 0;
+}
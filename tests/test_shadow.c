@@ -0,0 +1,246 @@
+/*
+ * test_shadow.c - Tests for shadow-paging commits
+ */
+
+#include "test_harness.h"
+#include "storage/btree.h"
+#include "txn/txn.h"
+#include "txn/wal.h"
+#include "storage/cache.h"
+#include "storage/pager.h"
+#include "os/file.h"
+#include "os/mem.h"
+#include "api/error.h"
+#include <string.h>
+
+#define TEST_DB_SHADOW_COMMIT "RAM:shadow_commit.db"
+#define TEST_DB_SHADOW_CRASH  "RAM:shadow_crash.db"
+
+/* Helper: check the tree holds exactly first..last (value = key * 10) */
+static int shadow_scan(struct btree *tree, int32_t first, int32_t last)
+{
+    struct btree_cursor cursor;
+    int32_t key;
+    uint32_t value;
+    int32_t expect;
+
+    expect = first;
+    if (btree_cursor_first(tree, &cursor) != 0) {
+        return -1;
+    }
+    while (btree_cursor_valid(&cursor)) {
+        btree_cursor_get(&cursor, &key, &value);
+        if (key != expect || value != (uint32_t)key * 10) {
+            return -1;
+        }
+        expect++;
+        btree_cursor_next(&cursor);
+    }
+
+    return (expect == last + 1) ? 0 : -1;
+}
+
+/* Helper: the change every transaction below makes */
+static int shadow_change(struct btree *tree, int32_t insert_from, int32_t insert_to,
+                         int32_t delete_from, int32_t delete_to)
+{
+    int32_t i;
+
+    for (i = insert_from; i <= insert_to; i++) {
+        if (btree_insert(tree, i, (uint32_t)i * 10) != 0) {
+            return -1;
+        }
+    }
+    for (i = delete_from; i <= delete_to; i++) {
+        if (btree_delete(tree, i) != 0) {
+            return -1;
+        }
+    }
+
+    /* The header's catalog root is what the commit swaps */
+    pager_set_catalog_root(tree->pager, tree->root_page);
+    return 0;
+}
+
+/* Test: Commit swaps in a copied tree, abort keeps the old one, no WAL */
+TEST(shadow_commit_abort) {
+    struct amidb_pager *pager = NULL;
+    struct page_cache *cache;
+    struct wal_context *wal;
+    struct txn_context *txn;
+    struct btree *tree;
+    uint32_t root_page;
+    uint32_t old_root;
+    uint32_t logged;
+    uint32_t value_out;
+    int rc;
+
+    file_delete(TEST_DB_SHADOW_COMMIT);
+
+    TEST_BEGIN();
+
+    rc = pager_open(TEST_DB_SHADOW_COMMIT, 0, &pager);
+    ASSERT_EQ(rc, 0);
+    cache = cache_create(64, pager);
+    ASSERT_NOT_NULL(cache);
+    tree = btree_create(pager, cache, &root_page);
+    ASSERT_NOT_NULL(tree);
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+    txn = txn_create(wal, cache);
+    ASSERT_NOT_NULL(txn);
+    btree_set_transaction(tree, txn);
+
+    /* Committed through the WAL: keys 1..100 */
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    ASSERT_EQ(shadow_change(tree, 1, 100, 1, 0), 0);
+    ASSERT_EQ(txn_commit(txn), AMIDB_OK);
+
+    ASSERT_EQ(txn_set_commit_mode(txn, 7), AMIDB_ERROR);
+    ASSERT_EQ(txn_set_commit_mode(txn, TXN_COMMIT_SHADOW), AMIDB_OK);
+    old_root = tree->root_page;
+    logged = txn->pages_logged;
+
+    /* Aborted: everything was copied, nothing was overwritten */
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    ASSERT_EQ(txn->shadow, 1);
+    ASSERT_EQ(txn_savepoint(txn, "sp"), AMIDB_ERROR);
+    ASSERT_EQ(txn_set_commit_mode(txn, TXN_COMMIT_WAL), AMIDB_BUSY);
+    ASSERT_EQ(shadow_change(tree, 101, 300, 1, 50), 0);
+    ASSERT_NEQ(tree->root_page, old_root);
+    ASSERT_EQ(txn_abort(txn), AMIDB_OK);
+
+    ASSERT_EQ(pager_get_catalog_root(pager), old_root);
+    tree->root_page = old_root;
+    ASSERT_EQ(shadow_scan(tree, 1, 100), 0);
+    ASSERT_EQ(btree_search(tree, 200, &value_out), -1);
+
+    /* Committed: the old root is freed, the WAL never written */
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    ASSERT_EQ(shadow_change(tree, 101, 300, 1, 50), 0);
+    ASSERT_EQ(txn_commit(txn), AMIDB_OK);
+    ASSERT_NEQ(tree->root_page, old_root);
+    ASSERT_EQ(pager_page_is_allocated(pager, old_root), 0);
+    ASSERT_EQ(txn->pages_logged, logged);
+    ASSERT_GT(txn->pages_shadowed, 0);
+    ASSERT_EQ(pager->header.wal_head, 0);
+    ASSERT_EQ(shadow_scan(tree, 51, 300), 0);
+
+    btree_close(tree);
+    txn_destroy(txn);
+    wal_destroy(wal);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    /* Reopen: the header points at the new tree */
+    rc = pager_open(TEST_DB_SHADOW_COMMIT, 0, &pager);
+    ASSERT_EQ(rc, 0);
+    cache = cache_create(64, pager);
+    ASSERT_NOT_NULL(cache);
+    tree = btree_open(pager, cache, pager_get_catalog_root(pager));
+    ASSERT_NOT_NULL(tree);
+    ASSERT_EQ(shadow_scan(tree, 51, 300), 0);
+
+    btree_close(tree);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    TEST_END();
+    return 0;
+}
+
+/* Test: New pages on disk without the header write leave the old tree, */
+/* and a snapshot keeps reading the tree a commit replaced */
+TEST(shadow_crash_and_snapshot) {
+    struct amidb_pager *pager = NULL;
+    struct amidb_pager *crashed = NULL;
+    struct page_cache *cache;
+    struct page_cache *crashed_cache;
+    struct wal_context *wal;
+    struct txn_context *txn;
+    struct txn_snapshot *snap;
+    struct btree *tree;
+    struct btree *reader;
+    struct cache_entry *entry;
+    uint32_t root_page;
+    uint32_t old_root;
+    uint32_t i;
+    int rc;
+
+    file_delete(TEST_DB_SHADOW_CRASH);
+
+    TEST_BEGIN();
+
+    rc = pager_open(TEST_DB_SHADOW_CRASH, 0, &pager);
+    ASSERT_EQ(rc, 0);
+    cache = cache_create(64, pager);
+    ASSERT_NOT_NULL(cache);
+    tree = btree_create(pager, cache, &root_page);
+    ASSERT_NOT_NULL(tree);
+    pager_set_catalog_root(pager, root_page);
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+    txn = txn_create(wal, cache);
+    ASSERT_NOT_NULL(txn);
+    btree_set_transaction(tree, txn);
+    ASSERT_EQ(txn_set_commit_mode(txn, TXN_COMMIT_SHADOW), AMIDB_OK);
+
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    ASSERT_EQ(shadow_change(tree, 1, 100, 1, 0), 0);
+    ASSERT_EQ(txn_commit(txn), AMIDB_OK);
+
+    /* A reader on the committed tree */
+    ASSERT_EQ(txn_snapshot_open(txn, &snap), AMIDB_OK);
+    reader = btree_open(pager, cache, tree->root_page);
+    ASSERT_NOT_NULL(reader);
+    btree_set_snapshot(reader, snap);
+    old_root = tree->root_page;
+
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    ASSERT_EQ(shadow_change(tree, 101, 200, 1, 20), 0);
+    ASSERT_EQ(txn_commit(txn), AMIDB_OK);
+
+    /* The replaced pages stay until the snapshot closes */
+    ASSERT_EQ(shadow_scan(reader, 1, 100), 0);
+    ASSERT_EQ(pager_page_is_allocated(pager, old_root), 1);
+    ASSERT_GT(txn->retired_count, 0);
+    txn_snapshot_close(snap);
+    ASSERT_EQ(txn->retired_count, 0);
+    ASSERT_EQ(pager_page_is_allocated(pager, old_root), 0);
+    btree_close(reader);
+
+    /* Crash after the new pages reached the file, before the header */
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    ASSERT_EQ(shadow_change(tree, 201, 300, 21, 60), 0);
+    for (i = 0; i < txn->dirty_count; i++) {
+        entry = cache_find_entry(cache, txn->dirty_pages[i]);
+        if (entry && entry->state == CACHE_ENTRY_DIRTY) {
+            ASSERT_EQ(pager_write_page(pager, entry->page_num, entry->data), 0);
+        }
+    }
+    ASSERT_EQ(pager_sync(pager), 0);
+
+    rc = pager_open(TEST_DB_SHADOW_CRASH, 1, &crashed);
+    ASSERT_EQ(rc, 0);
+    crashed_cache = cache_create(16, crashed);
+    ASSERT_NOT_NULL(crashed_cache);
+    reader = btree_open(crashed, crashed_cache, pager_get_catalog_root(crashed));
+    ASSERT_NOT_NULL(reader);
+    ASSERT_EQ(shadow_scan(reader, 21, 200), 0);
+    btree_close(reader);
+    cache_destroy(crashed_cache);
+    pager_close(crashed);
+
+    ASSERT_EQ(txn_abort(txn), AMIDB_OK);
+    tree->root_page = pager_get_catalog_root(pager);
+    ASSERT_EQ(shadow_scan(tree, 21, 200), 0);
+
+    btree_close(tree);
+    txn_destroy(txn);
+    wal_destroy(wal);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    TEST_END();
+    return 0;
+}
@@ -8,6 +8,9 @@
 #include "sql/parser.h"
 #include "sql/lexer.h"
 #include "sql/catalog.h"
+#include "sql/plan.h"
+#include "sql/sort.h"
+#include "sql/hashjoin.h"
 #include "storage/pager.h"
 #include "storage/cache.h"
 #include "test_harness.h"
@@ -3594,3 +3597,2340 @@ int test_e2e_max_where(void) {
 
     return 0;
 }
+
+/*
+ * Parse and execute one statement (for the transaction tests)
+ */
+static int e2e_exec(struct sql_executor *exec, const char *sql) {
+    struct sql_lexer lex;
+    struct sql_parser parser;
+    static struct sql_statement stmt;
+
+    lexer_init(&lex, sql);
+    parser_init(&parser, &lex);
+    if (parser_parse_statement(&parser, &stmt) != 0) {
+        test_printf("  ERROR: Parse of '%s' failed\n", sql);
+        return -1;
+    }
+
+    return executor_execute(exec, &stmt);
+}
+
+/*
+ * Set a WHERE clause of one comparison with an INTEGER (for the UPDATE
+ * and DELETE statements the parser cannot build)
+ */
+static void e2e_where_int(struct sql_where *where, const char *column, uint8_t op, int32_t value) {
+    memset(where, 0, sizeof(*where));
+    where->has_condition = 1;
+    where->node_count = 1;
+    where->condition_count = 1;
+    where->nodes[0].type = SQL_WHERE_COMPARE;
+    strcpy(where->conditions[0].column_name, column);
+    where->conditions[0].op = op;
+    where->conditions[0].value.type = SQL_VALUE_INTEGER;
+    where->conditions[0].value.int_value = value;
+}
+
+/*
+ * Test: Tables survive a reopen after the catalog tree's root splits
+ */
+int test_e2e_catalog_root_split(void) {
+    struct amidb_pager *pager;
+    struct page_cache *cache;
+    struct catalog cat;
+    struct sql_executor exec;
+    static struct table_schema schema;
+    static char names[100][64];
+    char sql[64];
+    int ok = 0;
+    int count;
+    int i;
+    int rc;
+
+    test_printf("Testing E2E: Catalog root split across reopen...\n");
+
+    remove("RAM:test_catalog_split.db");
+
+    rc = pager_open("RAM:test_catalog_split.db", 0, &pager);
+    if (rc != 0) return -1;
+
+    cache = cache_create(32, pager);
+    if (!cache || catalog_init(&cat, pager, cache) != 0) {
+        if (cache) cache_destroy(cache);
+        pager_close(pager);
+        return -1;
+    }
+
+    /* More tables than a B+Tree node holds */
+    executor_init(&exec, pager, cache, &cat);
+    for (i = 0; i < BTREE_ORDER + 16; i++) {
+        sprintf(sql, "CREATE TABLE t%d (id INTEGER)", i);
+        if (e2e_exec(&exec, sql) != 0) break;
+    }
+    rc = (i == BTREE_ORDER + 16) ? e2e_exec(&exec, "DROP TABLE t7") : -1;
+    executor_close(&exec);
+    catalog_close(&cat);
+    cache_destroy(cache);
+    pager_close(pager);
+    if (rc != 0) return -1;
+
+    rc = pager_open("RAM:test_catalog_split.db", 0, &pager);
+    if (rc != 0) return -1;
+
+    cache = cache_create(32, pager);
+    if (!cache || catalog_init(&cat, pager, cache) != 0) {
+        if (cache) cache_destroy(cache);
+        pager_close(pager);
+        return -1;
+    }
+
+    do {
+        count = catalog_list_tables(&cat, names, 100);
+        if (count != BTREE_ORDER + 15) {
+            test_printf("  ERROR: Expected %d tables, got %d\n", BTREE_ORDER + 15, count);
+            break;
+        }
+        if (catalog_get_table(&cat, "t0", &schema) != 0 ||
+            catalog_get_table(&cat, "t79", &schema) != 0) {
+            test_printf("  ERROR: Table not found after reopen\n");
+            break;
+        }
+        if (catalog_get_table(&cat, "t7", &schema) == 0) {
+            test_printf("  ERROR: Dropped table is back\n");
+            break;
+        }
+
+        ok = 1;
+    } while (0);
+
+    catalog_close(&cat);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    return ok ? 0 : -1;
+}
+
+/*
+ * Test: DELETE that merges a table's root leaves the table readable
+ */
+int test_e2e_delete_root_merge(void) {
+    struct amidb_pager *pager;
+    struct page_cache *cache;
+    struct catalog cat;
+    struct sql_executor exec;
+    static struct sql_delete del;
+    char sql[64];
+    int ok = 0;
+    int i;
+    int rc;
+
+    test_printf("Testing E2E: DELETE merging the table root...\n");
+
+    remove("RAM:test_delete_merge.db");
+
+    rc = pager_open("RAM:test_delete_merge.db", 0, &pager);
+    if (rc != 0) return -1;
+
+    cache = cache_create(32, pager);
+    if (!cache || catalog_init(&cat, pager, cache) != 0) {
+        if (cache) cache_destroy(cache);
+        pager_close(pager);
+        return -1;
+    }
+
+    executor_init(&exec, pager, cache, &cat);
+
+    do {
+        /* Enough rows to split the root, then few enough to merge it back */
+        if (e2e_exec(&exec, "CREATE TABLE t (id INTEGER PRIMARY KEY, v INTEGER)") != 0) break;
+        for (i = 1; i <= 3 * BTREE_ORDER; i++) {
+            sprintf(sql, "INSERT INTO t VALUES (%d, %d)", i, i);
+            if (e2e_exec(&exec, sql) != 0) break;
+        }
+        if (i <= 3 * BTREE_ORDER) break;
+
+        /* DELETE is not parsed yet: by PRIMARY KEY, then by scan */
+        memset(&del, 0, sizeof(del));
+        strcpy(del.table_name, "t");
+        for (i = 3 * BTREE_ORDER; i > 3; i--) {
+            e2e_where_int(&del.where, "id", SQL_OP_EQ, i);
+            if (executor_delete(&exec, &del) != 0) break;
+        }
+        if (i > 3) break;
+        e2e_where_int(&del.where, "v", SQL_OP_EQ, 3);
+        if (executor_delete(&exec, &del) != 0) break;
+
+        if (e2e_exec(&exec, "SELECT * FROM t") != 0) break;
+        if (exec.result_count != 2) {
+            test_printf("  ERROR: Expected 2 rows, got %u\n", exec.result_count);
+            break;
+        }
+
+        /* New pages reuse the freed ones, the old root among them */
+        for (i = 500; i < 520; i++) {
+            sprintf(sql, "INSERT INTO t VALUES (%d, %d)", i, i);
+            if (e2e_exec(&exec, sql) != 0) break;
+        }
+        if (i < 520) break;
+        if (e2e_exec(&exec, "SELECT * FROM t") != 0) break;
+        if (exec.result_count != 22) {
+            test_printf("  ERROR: Expected 22 rows after the merge, got %u\n",
+                        exec.result_count);
+            break;
+        }
+
+        ok = 1;
+    } while (0);
+
+    if (!ok) {
+        test_printf("  ERROR: %s\n", executor_get_error(&exec));
+    }
+
+    executor_close(&exec);
+    catalog_close(&cat);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    return ok ? 0 : -1;
+}
+
+/*
+ * Test: ROLLBACK TO SAVEPOINT keeps the rest of the transaction
+ */
+int test_e2e_savepoint_rollback(void) {
+    struct amidb_pager *pager;
+    struct page_cache *cache;
+    struct wal_context *wal;
+    struct txn_context *txn;
+    struct catalog cat;
+    struct sql_executor exec;
+    static struct table_schema schema;
+    static struct sql_statement stmt;
+    int ok = 0;
+    int rc;
+
+    test_printf("Testing E2E: SAVEPOINT / ROLLBACK TO...\n");
+
+    remove("RAM:test_savepoint.db");
+    remove("RAM:test_savepoint.db-wal");
+
+    rc = pager_open("RAM:test_savepoint.db", 0, &pager);
+    if (rc != 0) return -1;
+
+    cache = cache_create(32, pager);
+    if (!cache) {
+        pager_close(pager);
+        return -1;
+    }
+
+    wal = wal_create(pager);
+    txn = wal ? txn_create(wal, cache) : NULL;
+
+    rc = catalog_init(&cat, pager, cache);
+    if (rc != 0 || !txn) {
+        if (txn) txn_destroy(txn);
+        if (wal) wal_destroy(wal);
+        cache_destroy(cache);
+        pager_close(pager);
+        return -1;
+    }
+
+    executor_init(&exec, pager, cache, &cat);
+    exec.txn = txn;
+
+    do {
+        /* No transaction yet */
+        if (e2e_exec(&exec, "COMMIT") == 0) break;
+
+        if (e2e_exec(&exec, "CREATE TABLE log (msg TEXT)") != 0) break;
+        if (e2e_exec(&exec, "INSERT INTO log VALUES ('before')") != 0) break;
+
+        if (e2e_exec(&exec, "BEGIN") != 0) break;
+        if (e2e_exec(&exec, "INSERT INTO log VALUES ('batch1')") != 0) break;
+        if (e2e_exec(&exec, "SAVEPOINT batch2") != 0) break;
+        if (e2e_exec(&exec, "INSERT INTO log VALUES ('bad1')") != 0) break;
+        if (e2e_exec(&exec, "INSERT INTO log VALUES ('bad2')") != 0) break;
+
+        /* DDL is refused inside a transaction */
+        if (e2e_exec(&exec, "CREATE TABLE other (id INTEGER)") == 0) break;
+        if (e2e_exec(&exec, "ROLLBACK TO nosuch") == 0) break;
+
+        if (e2e_exec(&exec, "ROLLBACK TO batch2") != 0) break;
+        if (e2e_exec(&exec, "SELECT * FROM log") != 0) break;
+        if (exec.result_count != 2) {
+            test_printf("  ERROR: Expected 2 rows after ROLLBACK TO, got %u\n",
+                        exec.result_count);
+            break;
+        }
+
+        if (e2e_exec(&exec, "INSERT INTO log VALUES ('batch2')") != 0) break;
+        if (e2e_exec(&exec, "RELEASE batch2") != 0) break;
+        if (e2e_exec(&exec, "COMMIT") != 0) break;
+
+        /* Rowid counter was rolled back with the rows */
+        if (catalog_get_table(&cat, "log", &schema) != 0) break;
+        if (schema.next_rowid != 4 || schema.row_count != 3) {
+            test_printf("  ERROR: next_rowid %u, row_count %u\n",
+                        schema.next_rowid, schema.row_count);
+            break;
+        }
+
+        /* A full ROLLBACK discards everything */
+        if (e2e_exec(&exec, "BEGIN") != 0) break;
+        if (e2e_exec(&exec, "INSERT INTO log VALUES ('discarded')") != 0) break;
+        if (e2e_exec(&exec, "ROLLBACK") != 0) break;
+
+        if (e2e_exec(&exec, "SELECT * FROM log") != 0) break;
+        if (exec.result_count != 3) {
+            test_printf("  ERROR: Expected 3 rows after ROLLBACK, got %u\n",
+                        exec.result_count);
+            break;
+        }
+
+        /* Without an undo buffer writes still run, and still roll back */
+        if (txn_set_undo_limit(txn, 0) != AMIDB_OK) break;
+        if (e2e_exec(&exec, "BEGIN") != 0) break;
+        if (e2e_exec(&exec, "INSERT INTO log VALUES ('unbuffered')") != 0) break;
+        if (e2e_exec(&exec, "SAVEPOINT sp") != 0) break;
+
+        memset(&stmt, 0, sizeof(stmt));
+        stmt.type = STMT_UPDATE;
+        strcpy(stmt.stmt.update.table_name, "log");
+        strcpy(stmt.stmt.update.column_name, "msg");
+        stmt.stmt.update.value.type = SQL_VALUE_TEXT;
+        strcpy(stmt.stmt.update.value.text_value, "changed");
+        if (executor_execute(&exec, &stmt) != 0) break;
+
+        if (e2e_exec(&exec, "ROLLBACK TO sp") != 0) break;
+        if (e2e_exec(&exec, "SELECT COUNT(*) FROM log WHERE msg = 'changed'") != 0) break;
+        if (exec.result_count != 1 || row_get_value(&exec.result_rows[0], 0)->u.i != 0) {
+            test_printf("  ERROR: ROLLBACK TO kept the unbuffered UPDATE\n");
+            break;
+        }
+        if (e2e_exec(&exec, "ROLLBACK") != 0) break;
+
+        if (e2e_exec(&exec, "SELECT * FROM log") != 0) break;
+        if (exec.result_count != 3) {
+            test_printf("  ERROR: Expected 3 rows after unbuffered ROLLBACK, got %u\n",
+                        exec.result_count);
+            break;
+        }
+
+        ok = 1;
+    } while (0);
+
+    if (!ok) {
+        test_printf("  ERROR: %s\n", executor_get_error(&exec));
+    }
+
+    executor_close(&exec);
+    catalog_close(&cat);
+    txn_destroy(txn);
+    wal_destroy(wal);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    return ok ? 0 : -1;
+}
+
+/*
+ * Test: ROLLBACK and ROLLBACK TO free the pages their INSERTs allocated
+ */
+int test_e2e_rollback_frees_pages(void) {
+    struct amidb_pager *pager;
+    struct page_cache *cache;
+    struct wal_context *wal;
+    struct txn_context *txn;
+    struct catalog cat;
+    struct sql_executor exec;
+    static uint8_t bitmap[AMIDB_MAX_PAGES / 8];
+    uint32_t page_count;
+    char sql[64];
+    int ok = 0;
+    int i;
+    int rc;
+
+    test_printf("Testing E2E: Rolled back INSERTs free their pages...\n");
+
+    remove("RAM:test_rollback_pages.db");
+    remove("RAM:test_rollback_pages.db-wal");
+
+    rc = pager_open("RAM:test_rollback_pages.db", 0, &pager);
+    if (rc != 0) return -1;
+
+    cache = cache_create(32, pager);
+    if (!cache) {
+        pager_close(pager);
+        return -1;
+    }
+
+    wal = wal_create(pager);
+    txn = wal ? txn_create(wal, cache) : NULL;
+
+    rc = catalog_init(&cat, pager, cache);
+    if (rc != 0 || !txn) {
+        if (txn) txn_destroy(txn);
+        if (wal) wal_destroy(wal);
+        cache_destroy(cache);
+        pager_close(pager);
+        return -1;
+    }
+
+    executor_init(&exec, pager, cache, &cat);
+    exec.txn = txn;
+
+    do {
+        if (e2e_exec(&exec, "CREATE TABLE t (id INTEGER PRIMARY KEY, v INTEGER)") != 0) break;
+        if (e2e_exec(&exec, "INSERT INTO t VALUES (1, 1)") != 0) break;
+        memcpy(bitmap, pager->bitmap, pager->bitmap_size);
+
+        /* Row pages and B+Tree splits, all rolled back */
+        if (e2e_exec(&exec, "BEGIN") != 0) break;
+        for (i = 2; i <= 2 * BTREE_ORDER; i++) {
+            sprintf(sql, "INSERT INTO t VALUES (%d, %d)", i, i);
+            if (e2e_exec(&exec, sql) != 0) break;
+        }
+        if (i <= 2 * BTREE_ORDER) break;
+        if (e2e_exec(&exec, "ROLLBACK") != 0) break;
+        if (memcmp(bitmap, pager->bitmap, pager->bitmap_size) != 0) {
+            test_printf("  ERROR: Pages still allocated after ROLLBACK\n");
+            break;
+        }
+        page_count = pager_get_page_count(pager);
+
+        /* Only the pages allocated after the savepoint are freed */
+        if (e2e_exec(&exec, "BEGIN") != 0) break;
+        if (e2e_exec(&exec, "INSERT INTO t VALUES (2, 2)") != 0) break;
+        memcpy(bitmap, pager->bitmap, pager->bitmap_size);
+        if (e2e_exec(&exec, "SAVEPOINT more") != 0) break;
+        for (i = 3; i <= 2 * BTREE_ORDER; i++) {
+            sprintf(sql, "INSERT INTO t VALUES (%d, %d)", i, i);
+            if (e2e_exec(&exec, sql) != 0) break;
+        }
+        if (i <= 2 * BTREE_ORDER) break;
+        if (e2e_exec(&exec, "ROLLBACK TO more") != 0) break;
+        if (memcmp(bitmap, pager->bitmap, pager->bitmap_size) != 0) {
+            test_printf("  ERROR: Pages still allocated after ROLLBACK TO\n");
+            break;
+        }
+
+        /* The same rows committed reuse the freed pages */
+        for (i = 3; i <= 2 * BTREE_ORDER; i++) {
+            sprintf(sql, "INSERT INTO t VALUES (%d, %d)", i, i);
+            if (e2e_exec(&exec, sql) != 0) break;
+        }
+        if (i <= 2 * BTREE_ORDER) break;
+        if (e2e_exec(&exec, "COMMIT") != 0) break;
+        if (pager_get_page_count(pager) != page_count) {
+            test_printf("  ERROR: File grew from %u to %u pages\n",
+                        page_count, pager_get_page_count(pager));
+            break;
+        }
+
+        if (e2e_exec(&exec, "SELECT * FROM t WHERE id = 100") != 0) break;
+        if (exec.result_count != 1) {
+            test_printf("  ERROR: Committed row not found\n");
+            break;
+        }
+
+        ok = 1;
+    } while (0);
+
+    if (!ok) {
+        test_printf("  ERROR: %s\n", executor_get_error(&exec));
+    }
+
+    executor_close(&exec);
+    catalog_close(&cat);
+    txn_destroy(txn);
+    wal_destroy(wal);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    return ok ? 0 : -1;
+}
+
+/*
+ * Helper: one shadow-paging session (reopened: check what the first left)
+ */
+static int e2e_shadow_session(int reopened) {
+    struct amidb_pager *pager;
+    struct page_cache *cache;
+    struct wal_context *wal;
+    struct txn_context *txn;
+    struct catalog cat;
+    struct sql_executor exec;
+    static struct sql_statement stmt;
+    char sql[96];
+    int ok = 0;
+    int rc;
+    int i;
+
+    rc = pager_open("RAM:test_shadow_sql.db", 0, &pager);
+    if (rc != 0) return -1;
+
+    cache = cache_create(32, pager);
+    if (!cache) {
+        pager_close(pager);
+        return -1;
+    }
+
+    wal = wal_create(pager);
+    txn = wal ? txn_create(wal, cache) : NULL;
+
+    rc = catalog_init(&cat, pager, cache);
+    if (rc != 0 || !txn || txn_set_commit_mode(txn, TXN_COMMIT_SHADOW) != 0) {
+        if (txn) txn_destroy(txn);
+        if (wal) wal_destroy(wal);
+        cache_destroy(cache);
+        pager_close(pager);
+        return -1;
+    }
+
+    executor_init(&exec, pager, cache, &cat);
+    exec.txn = txn;
+
+    do {
+        if (reopened) {
+            /* Everything committed survived, nothing went through the WAL */
+            if (e2e_exec(&exec, "SELECT * FROM items") != 0) break;
+            if (exec.result_count != 90 || txn->pages_logged != 0) {
+                test_printf("  ERROR: %u rows after reopen\n", exec.result_count);
+                break;
+            }
+            if (e2e_exec(&exec, "SELECT * FROM items WHERE name = 'sold'") != 0) break;
+            if (exec.result_count != 50) {
+                test_printf("  ERROR: %u updated rows after reopen\n", exec.result_count);
+                break;
+            }
+            ok = 1;
+            break;
+        }
+
+        if (e2e_exec(&exec, "CREATE TABLE items (id INTEGER PRIMARY KEY, name TEXT)") != 0) break;
+
+        /* Each INSERT commits on its own; enough rows to split the tree */
+        for (i = 1; i <= 100; i++) {
+            snprintf(sql, sizeof(sql), "INSERT INTO items VALUES (%d, 'new')", i);
+            if (e2e_exec(&exec, sql) != 0) break;
+        }
+        if (i <= 100) break;
+
+        /* UPDATE copies the row pages it changes */
+        memset(&stmt, 0, sizeof(stmt));
+        stmt.type = STMT_UPDATE;
+        strcpy(stmt.stmt.update.table_name, "items");
+        strcpy(stmt.stmt.update.column_name, "name");
+        stmt.stmt.update.value.type = SQL_VALUE_TEXT;
+        strcpy(stmt.stmt.update.value.text_value, "sold");
+        e2e_where_int(&stmt.stmt.update.where, "id", SQL_OP_GT, 50);
+        if (executor_execute(&exec, &stmt) != 0) break;
+
+        /* A rolled back UPDATE leaves the committed pages alone */
+        if (e2e_exec(&exec, "BEGIN") != 0) break;
+        if (e2e_exec(&exec, "SAVEPOINT sp") == 0) break;
+        stmt.stmt.update.where.has_condition = 0;
+        strcpy(stmt.stmt.update.value.text_value, "gone");
+        if (executor_execute(&exec, &stmt) != 0) break;
+        if (e2e_exec(&exec, "ROLLBACK") != 0) break;
+
+        if (e2e_exec(&exec, "SELECT * FROM items WHERE name = 'sold'") != 0) break;
+        if (exec.result_count != 50) {
+            test_printf("  ERROR: Expected 50 updated rows, got %u\n", exec.result_count);
+            break;
+        }
+
+        memset(&stmt, 0, sizeof(stmt));
+        stmt.type = STMT_DELETE;
+        strcpy(stmt.stmt.delete.table_name, "items");
+        e2e_where_int(&stmt.stmt.delete.where, "id", SQL_OP_LE, 10);
+        if (executor_execute(&exec, &stmt) != 0) break;
+
+        if (e2e_exec(&exec, "SELECT * FROM items") != 0) break;
+        if (exec.result_count != 90) {
+            test_printf("  ERROR: Expected 90 rows after DELETE, got %u\n", exec.result_count);
+            break;
+        }
+
+        ok = 1;
+    } while (0);
+
+    if (!ok) {
+        test_printf("  ERROR: %s\n", executor_get_error(&exec));
+    }
+
+    executor_close(&exec);
+    catalog_close(&cat);
+    txn_destroy(txn);
+    wal_destroy(wal);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    return ok ? 0 : -1;
+}
+
+/*
+ * Test: Statements under shadow paging (copy-on-write, no WAL)
+ */
+int test_e2e_shadow_paging(void) {
+    test_printf("Testing E2E: Shadow paging...\n");
+
+    remove("RAM:test_shadow_sql.db");
+    remove("RAM:test_shadow_sql.db-wal");
+
+    if (e2e_shadow_session(0) != 0) {
+        return -1;
+    }
+    return e2e_shadow_session(1);
+}
+
+/*
+ * Helper: one session on an LSM table (reopened: check what the first left)
+ */
+static int e2e_lsm_session(int reopened) {
+    struct amidb_pager *pager;
+    struct page_cache *cache;
+    struct catalog cat;
+    struct sql_executor exec;
+    static struct table_schema schema;
+    static struct sql_statement stmt;
+    struct btree *tree;
+    uint32_t entries, height, nodes;
+    char sql[96];
+    int ok = 0;
+    int rc;
+    int i;
+
+    rc = pager_open("RAM:test_lsm_sql.db", 0, &pager);
+    if (rc != 0) return -1;
+
+    cache = cache_create(32, pager);
+    if (!cache) {
+        pager_close(pager);
+        return -1;
+    }
+
+    rc = catalog_init(&cat, pager, cache);
+    if (rc != 0) {
+        cache_destroy(cache);
+        pager_close(pager);
+        return -1;
+    }
+
+    executor_init(&exec, pager, cache, &cat);
+
+    do {
+        if (reopened) {
+            if (e2e_exec(&exec, "SELECT COUNT(*) FROM events") != 0) break;
+            if (exec.result_count != 1 || row_get_value(&exec.result_rows[0], 0)->u.i != 1400) {
+                test_printf("  ERROR: Wrong row count after reopen\n");
+                break;
+            }
+            ok = 1;
+            break;
+        }
+
+        if (e2e_exec(&exec, "CREATE TABLE events (id INTEGER PRIMARY KEY, kind TEXT) ENGINE = lsm") != 0) break;
+
+        /* Scrambled keys: several flushes and merges */
+        for (i = 0; i < 1500; i++) {
+            snprintf(sql, sizeof(sql), "INSERT INTO events VALUES (%d, 'tick')",
+                     (i * 7919) % 1500 + 1);
+            if (e2e_exec(&exec, sql) != 0) break;
+        }
+        if (i < 1500) break;
+        if (e2e_exec(&exec, "INSERT INTO events VALUES (777, 'dup')") == 0) break;
+
+        if (catalog_get_table(&cat, "events", &schema) != 0) break;
+        tree = btree_open(pager, cache, schema.btree_root);
+        if (!tree) break;
+        btree_get_stats(tree, &entries, &height, &nodes);
+        rc = (tree->engine == BTREE_ENGINE_LSM && height == 2) ? 0 : -1;
+        btree_close(tree);
+        if (rc != 0) {
+            test_printf("  ERROR: Table is not an LSM table with runs\n");
+            break;
+        }
+
+        /* Scans come back in key order */
+        if (e2e_exec(&exec, "SELECT * FROM events LIMIT 5") != 0) break;
+        for (i = 0; i < 5 && i < (int)exec.result_count; i++) {
+            if (row_get_value(&exec.result_rows[i], 0)->u.i != i + 1) break;
+        }
+        if (exec.result_count != 5 || i != 5) {
+            test_printf("  ERROR: Scan out of order\n");
+            break;
+        }
+        if (e2e_exec(&exec, "SELECT * FROM events WHERE id = 777") != 0) break;
+        if (exec.result_count != 1) {
+            test_printf("  ERROR: Point lookup returned %u rows\n", exec.result_count);
+            break;
+        }
+
+        memset(&stmt, 0, sizeof(stmt));
+        stmt.type = STMT_DELETE;
+        strcpy(stmt.stmt.delete.table_name, "events");
+        e2e_where_int(&stmt.stmt.delete.where, "id", SQL_OP_LE, 100);
+        if (executor_execute(&exec, &stmt) != 0) break;
+
+        if (e2e_exec(&exec, "SELECT COUNT(*) FROM events") != 0) break;
+        if (exec.result_count != 1 || row_get_value(&exec.result_rows[0], 0)->u.i != 1400) {
+            test_printf("  ERROR: Wrong row count after DELETE\n");
+            break;
+        }
+
+        ok = 1;
+    } while (0);
+
+    if (!ok) {
+        test_printf("  ERROR: %s\n", executor_get_error(&exec));
+    }
+
+    executor_close(&exec);
+    catalog_close(&cat);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    return ok ? 0 : -1;
+}
+
+/*
+ * Test: A table on the LSM engine behind the same statements
+ */
+int test_e2e_lsm_table(void) {
+    test_printf("Testing E2E: LSM table engine...\n");
+
+    remove("RAM:test_lsm_sql.db");
+
+    if (e2e_lsm_session(0) != 0) {
+        return -1;
+    }
+    return e2e_lsm_session(1);
+}
+
+/*
+ * Test: Query plans - project, filter, sort, limit, seek and aggregate
+ */
+int test_e2e_select_pipeline(void) {
+    struct amidb_pager *pager;
+    struct page_cache *cache;
+    struct catalog cat;
+    struct sql_executor exec;
+    const struct amidb_value *val;
+    char sql[96];
+    int ok = 0;
+    int rc;
+    int i;
+
+    test_printf("Testing E2E: SELECT operator pipeline...\n");
+
+    remove("RAM:test_pipeline.db");
+
+    rc = pager_open("RAM:test_pipeline.db", 0, &pager);
+    if (rc != 0) return -1;
+
+    cache = cache_create(32, pager);
+    if (!cache) {
+        pager_close(pager);
+        return -1;
+    }
+
+    rc = catalog_init(&cat, pager, cache);
+    if (rc != 0) {
+        cache_destroy(cache);
+        pager_close(pager);
+        return -1;
+    }
+
+    executor_init(&exec, pager, cache, &cat);
+
+    do {
+        if (e2e_exec(&exec, "CREATE TABLE scores (id INTEGER PRIMARY KEY, name TEXT, score INTEGER)") != 0) break;
+        for (i = 1; i <= 10; i++) {
+            snprintf(sql, sizeof(sql), "INSERT INTO scores VALUES (%d, 'row%d', %d)", i, i, i * 10);
+            if (e2e_exec(&exec, sql) != 0) break;
+        }
+        if (i <= 10) break;
+
+        /* Columns come back in select-list order, sorted and limited */
+        if (e2e_exec(&exec, "SELECT score, name FROM scores WHERE score > 50 ORDER BY score DESC LIMIT 3") != 0) break;
+        if (exec.result_count != 3 || exec.result_rows[0].column_count != 2) {
+            test_printf("  ERROR: Expected 3 rows of 2 columns, got %u\n", exec.result_count);
+            break;
+        }
+        for (i = 0; i < 3; i++) {
+            if (row_get_value(&exec.result_rows[i], 0)->u.i != 100 - i * 10) break;
+        }
+        if (i < 3) {
+            test_printf("  ERROR: Rows out of order\n");
+            break;
+        }
+        val = row_get_value(&exec.result_rows[2], 1);
+        if (val->type != AMIDB_TYPE_TEXT || val->u.blob.size != 4 ||
+            memcmp(val->u.blob.data, "row8", 4) != 0) {
+            test_printf("  ERROR: Wrong name in projected row\n");
+            break;
+        }
+
+        /* A column selected twice, through a primary key seek */
+        if (e2e_exec(&exec, "SELECT name, name FROM scores WHERE id = 4") != 0) break;
+        if (exec.result_count != 1 || exec.result_rows[0].column_count != 2 ||
+            row_get_value(&exec.result_rows[0], 1)->u.blob.size != 4 ||
+            memcmp(row_get_value(&exec.result_rows[0], 1)->u.blob.data, "row4", 4) != 0) {
+            test_printf("  ERROR: Duplicated column wrong\n");
+            break;
+        }
+
+        /* Aggregates over a seek and over text filters */
+        if (e2e_exec(&exec, "SELECT COUNT(*) FROM scores WHERE id = 4") != 0) break;
+        if (row_get_value(&exec.result_rows[0], 0)->u.i != 1) break;
+        if (e2e_exec(&exec, "SELECT COUNT(*) FROM scores WHERE name >= 'row5'") != 0) break;
+        if (row_get_value(&exec.result_rows[0], 0)->u.i != 5) {
+            test_printf("  ERROR: Text filter matched %d rows\n",
+                        row_get_value(&exec.result_rows[0], 0)->u.i);
+            break;
+        }
+        if (e2e_exec(&exec, "SELECT MAX(score) FROM scores WHERE name < 'row2'") != 0) break;
+        if (row_get_value(&exec.result_rows[0], 0)->u.i != 100) break;
+
+        /* Unknown columns are caught before any row is read */
+        if (e2e_exec(&exec, "SELECT nosuch FROM scores") == 0) break;
+        if (e2e_exec(&exec, "SELECT * FROM scores ORDER BY nosuch") == 0) break;
+        if (e2e_exec(&exec, "SELECT SUM(name) FROM scores") == 0) break;
+
+        ok = 1;
+    } while (0);
+
+    if (!ok) {
+        test_printf("  ERROR: %s\n", executor_get_error(&exec));
+    }
+
+    executor_close(&exec);
+    catalog_close(&cat);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    return ok ? 0 : -1;
+}
+
+/*
+ * Test: Streaming SELECT - every row, in constant memory
+ */
+int test_e2e_select_streaming(void) {
+    struct amidb_pager *pager;
+    struct page_cache *cache;
+    struct catalog cat;
+    struct sql_executor exec;
+    static struct sql_statement stmt;
+    struct sql_lexer lex;
+    struct sql_parser parser;
+    const struct amidb_row *row;
+    char sql[64];
+    int32_t expect;
+    int ok = 0;
+    int rc;
+    int i;
+
+    test_printf("Testing E2E: Streaming SELECT past 100 rows...\n");
+
+    remove("RAM:test_streaming.db");
+
+    rc = pager_open("RAM:test_streaming.db", 0, &pager);
+    if (rc != 0) return -1;
+
+    cache = cache_create(32, pager);
+    if (!cache) {
+        pager_close(pager);
+        return -1;
+    }
+
+    rc = catalog_init(&cat, pager, cache);
+    if (rc != 0) {
+        cache_destroy(cache);
+        pager_close(pager);
+        return -1;
+    }
+
+    executor_init(&exec, pager, cache, &cat);
+
+    do {
+        if (e2e_exec(&exec, "CREATE TABLE events (id INTEGER PRIMARY KEY, kind INTEGER)") != 0) break;
+        for (i = 1; i <= 250; i++) {
+            snprintf(sql, sizeof(sql), "INSERT INTO events VALUES (%d, %d)", i, i % 3);
+            if (e2e_exec(&exec, sql) != 0) break;
+        }
+        if (i <= 250) break;
+
+        /* The buffered result set stops at MAX_RESULT_ROWS, and says so */
+        if (e2e_exec(&exec, "SELECT * FROM events") != 0) break;
+        if (exec.result_count != MAX_RESULT_ROWS || !exec.result_truncated) {
+            test_printf("  ERROR: Expected a truncated result, got %u rows\n", exec.result_count);
+            break;
+        }
+
+        /* Stepping returns all of them */
+        lexer_init(&lex, "SELECT id FROM events WHERE kind = 1");
+        parser_init(&parser, &lex);
+        if (parser_parse_statement(&parser, &stmt) != 0) break;
+        if (executor_query(&exec, &stmt.stmt.select) != 0) break;
+
+        /* The statement was copied */
+        memset(&stmt, 0, sizeof(stmt));
+
+        expect = 1;
+        while ((rc = executor_step(&exec, &row)) == AMIDB_ROW) {
+            if (row->column_count != 1 || row_get_value(row, 0)->u.i != expect) break;
+            expect += 3;
+        }
+        executor_finish(&exec);
+        if (rc != AMIDB_DONE || expect != 253) {
+            test_printf("  ERROR: Stream stopped before id %d\n", expect);
+            break;
+        }
+
+        /* No query open */
+        if (executor_step(&exec, &row) != AMIDB_ERROR) break;
+
+        /* executor_execute finishes an open query */
+        lexer_init(&lex, "SELECT * FROM events");
+        parser_init(&parser, &lex);
+        if (parser_parse_statement(&parser, &stmt) != 0) break;
+        if (executor_query(&exec, &stmt.stmt.select) != 0) break;
+        if (executor_step(&exec, &row) != AMIDB_ROW) break;
+        if (e2e_exec(&exec, "INSERT INTO events VALUES (251, 0)") != 0) break;
+        if (exec.query != NULL) break;
+
+        if (executor_query(&exec, &stmt.stmt.select) != 0) break;
+        for (i = 0; executor_step(&exec, &row) == AMIDB_ROW; i++) {
+        }
+        executor_finish(&exec);
+        if (i != 251) {
+            test_printf("  ERROR: Expected 251 rows, got %d\n", i);
+            break;
+        }
+
+        /* Unknown tables fail when the query starts */
+        memcpy(stmt.stmt.select.table_name, "nosuch", 7);
+        if (executor_query(&exec, &stmt.stmt.select) == 0) break;
+
+        ok = 1;
+    } while (0);
+
+    if (!ok) {
+        test_printf("  ERROR: %s\n", executor_get_error(&exec));
+    }
+
+    executor_close(&exec);
+    catalog_close(&cat);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    return ok ? 0 : -1;
+}
+
+/*
+ * Test: Prepared statements with bound parameters
+ */
+int test_e2e_prepared_statements(void) {
+    struct amidb_pager *pager;
+    struct page_cache *cache;
+    struct wal_context *wal;
+    struct txn_context *txn;
+    struct catalog cat;
+    struct sql_executor exec;
+    static struct table_schema schema;
+    struct sql_prepared *insert = NULL;
+    struct sql_prepared *lookup = NULL;
+    struct sql_prepared *count = NULL;
+    const struct amidb_row *row;
+    char name[16];
+    int ok = 0;
+    int rc;
+    int i;
+
+    test_printf("Testing E2E: Prepared statements...\n");
+
+    remove("RAM:test_prepared.db");
+    remove("RAM:test_prepared.db-wal");
+
+    rc = pager_open("RAM:test_prepared.db", 0, &pager);
+    if (rc != 0) return -1;
+
+    cache = cache_create(32, pager);
+    if (!cache) {
+        pager_close(pager);
+        return -1;
+    }
+
+    wal = wal_create(pager);
+    txn = wal ? txn_create(wal, cache) : NULL;
+
+    rc = catalog_init(&cat, pager, cache);
+    if (rc != 0 || !txn) {
+        if (txn) txn_destroy(txn);
+        if (wal) wal_destroy(wal);
+        cache_destroy(cache);
+        pager_close(pager);
+        return -1;
+    }
+
+    executor_init(&exec, pager, cache, &cat);
+    exec.txn = txn;
+
+    do {
+        if (e2e_exec(&exec, "CREATE TABLE users (id INTEGER PRIMARY KEY, name TEXT, score INTEGER)") != 0) break;
+
+        if (executor_prepare(&exec, "INSERT INTO users VALUES (?, ?, ?)", &insert) != 0) break;
+        if (executor_prepare(&exec, "SELECT name FROM users WHERE id = ?", &lookup) != 0) break;
+        if (executor_prepare(&exec, "SELECT COUNT(*) FROM users WHERE score = ?", &count) != 0) break;
+
+        /* Parameters must be bound, and exist */
+        if (prepared_step(insert, &row) != AMIDB_ERROR) break;
+        if (prepared_bind_int(insert, 4, 1) != AMIDB_ERROR) break;
+        if (prepared_bind_int(insert, 0, 1) != AMIDB_ERROR) break;
+
+        /* Bind, step, reset: one row per run */
+        for (i = 1; i <= 200; i++) {
+            snprintf(name, sizeof(name), "user%d", i);
+            if (prepared_bind_int(insert, 1, i) != AMIDB_OK) break;
+            if (prepared_bind_text(insert, 2, name) != AMIDB_OK) break;
+            if (prepared_bind_int(insert, 3, i % 10) != AMIDB_OK) break;
+            if (prepared_step(insert, &row) != AMIDB_DONE) break;
+            if (prepared_step(insert, &row) != AMIDB_DONE) break;
+            prepared_reset(insert);
+        }
+        if (i <= 200) break;
+
+        /* Lookups through the seek plan built on the first run */
+        for (i = 1; i <= 200; i += 7) {
+            snprintf(name, sizeof(name), "user%d", i);
+            if (prepared_bind_int(lookup, 1, i) != AMIDB_OK) break;
+            if (prepared_step(lookup, &row) != AMIDB_ROW) break;
+            if (row->column_count != 1 ||
+                row_get_value(row, 0)->u.blob.size != strlen(name) ||
+                memcmp(row_get_value(row, 0)->u.blob.data, name, strlen(name)) != 0) break;
+            if (prepared_step(lookup, &row) != AMIDB_DONE) break;
+            prepared_reset(lookup);
+        }
+        if (i <= 200) {
+            test_printf("  ERROR: Lookup of id %d failed\n", i);
+            break;
+        }
+        if (prepared_bind_int(lookup, 1, 500) != AMIDB_OK) break;
+        if (prepared_step(lookup, &row) != AMIDB_DONE) break;
+        prepared_reset(lookup);
+
+        /* No rebinding while rows are being returned */
+        if (prepared_bind_int(lookup, 1, 3) != AMIDB_OK) break;
+        if (prepared_step(lookup, &row) != AMIDB_ROW) break;
+        if (prepared_bind_int(lookup, 1, 4) != AMIDB_BUSY) break;
+        prepared_reset(lookup);
+
+        /* Parameters in a filter under an aggregate */
+        if (prepared_bind_int(count, 1, 3) != AMIDB_OK) break;
+        if (prepared_step(count, &row) != AMIDB_ROW) break;
+        if (row_get_value(row, 0)->u.i != 20) {
+            test_printf("  ERROR: COUNT with score = 3 gave %d\n", row_get_value(row, 0)->u.i);
+            break;
+        }
+        prepared_reset(count);
+
+        /* A write through another statement is seen */
+        if (e2e_exec(&exec, "INSERT INTO users VALUES (201, 'late', 3)") != 0) break;
+        if (prepared_step(count, &row) != AMIDB_ROW) break;
+        if (row_get_value(row, 0)->u.i != 21) break;
+        prepared_reset(count);
+
+        /* A rollback puts the schema back; the statements read it again */
+        if (e2e_exec(&exec, "BEGIN") != 0) break;
+        if (prepared_bind_int(insert, 1, 300) != AMIDB_OK) break;
+        if (prepared_step(insert, &row) != AMIDB_DONE) break;
+        prepared_reset(insert);
+        if (e2e_exec(&exec, "ROLLBACK") != 0) break;
+
+        if (prepared_bind_int(lookup, 1, 300) != AMIDB_OK) break;
+        if (prepared_step(lookup, &row) != AMIDB_DONE) break;
+        prepared_reset(lookup);
+        if (prepared_step(insert, &row) != AMIDB_DONE) break;
+        prepared_reset(insert);
+        if (catalog_get_table(&cat, "users", &schema) != 0) break;
+        if (schema.row_count != 202) {
+            test_printf("  ERROR: row_count %u after ROLLBACK\n", schema.row_count);
+            break;
+        }
+
+        /* Dropped and created again with other columns */
+        if (e2e_exec(&exec, "DROP TABLE users") != 0) break;
+        if (prepared_step(lookup, &row) != AMIDB_ERROR) break;
+        if (e2e_exec(&exec, "CREATE TABLE users (id INTEGER PRIMARY KEY, name TEXT)") != 0) break;
+        if (prepared_step(lookup, &row) != AMIDB_DONE) break;
+        prepared_reset(lookup);
+        if (prepared_step(insert, &row) != AMIDB_ERROR) break;
+
+        /* Parameters are only for prepared statements */
+        if (e2e_exec(&exec, "SELECT * FROM users WHERE id = ?") == 0) break;
+
+        ok = 1;
+    } while (0);
+
+    if (!ok) {
+        test_printf("  ERROR: %s\n", executor_get_error(&exec));
+    }
+
+    prepared_finalize(insert);
+    prepared_finalize(lookup);
+    prepared_finalize(count);
+    executor_close(&exec);
+    catalog_close(&cat);
+    txn_destroy(txn);
+    wal_destroy(wal);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    return ok ? 0 : -1;
+}
+
+/*
+ * Test: Streaming SELECT reads a snapshot while rows are written
+ */
+int test_e2e_snapshot_query(void) {
+    struct amidb_pager *pager;
+    struct page_cache *cache;
+    struct wal_context *wal;
+    struct txn_context *txn;
+    struct catalog cat;
+    struct sql_executor exec;
+    static struct sql_statement stmt;
+    struct sql_lexer lex;
+    struct sql_parser parser;
+    const struct amidb_row *row;
+    char sql[64];
+    int32_t expect;
+    int ok = 0;
+    int rc;
+    int i;
+
+    test_printf("Testing E2E: Streaming SELECT during writes...\n");
+
+    remove("RAM:test_snapquery.db");
+    remove("RAM:test_snapquery.db-wal");
+
+    rc = pager_open("RAM:test_snapquery.db", 0, &pager);
+    if (rc != 0) return -1;
+
+    cache = cache_create(32, pager);
+    if (!cache) {
+        pager_close(pager);
+        return -1;
+    }
+
+    wal = wal_create(pager);
+    txn = wal ? txn_create(wal, cache) : NULL;
+
+    rc = catalog_init(&cat, pager, cache);
+    if (rc != 0 || !txn) {
+        if (txn) txn_destroy(txn);
+        if (wal) wal_destroy(wal);
+        cache_destroy(cache);
+        pager_close(pager);
+        return -1;
+    }
+
+    executor_init(&exec, pager, cache, &cat);
+    exec.txn = txn;
+
+    /* Every autocommitted write below keeps the pages it replaces */
+    txn_set_version_limit(txn, 1024);
+
+    do {
+        if (e2e_exec(&exec, "CREATE TABLE events (id INTEGER PRIMARY KEY, kind INTEGER)") != 0) break;
+        for (i = 1; i <= 200; i++) {
+            snprintf(sql, sizeof(sql), "INSERT INTO events VALUES (%d, %d)", i, i % 3);
+            if (e2e_exec(&exec, sql) != 0) break;
+        }
+        if (i <= 200) break;
+
+        lexer_init(&lex, "SELECT id FROM events");
+        parser_init(&parser, &lex);
+        if (parser_parse_statement(&parser, &stmt) != 0) break;
+        if (executor_query(&exec, &stmt.stmt.select) != 0) break;
+
+        expect = 1;
+        while (expect <= 50 && executor_step(&exec, &row) == AMIDB_ROW) {
+            if (row_get_value(row, 0)->u.i != expect) break;
+            expect++;
+        }
+        if (expect != 51) break;
+
+        /* Row writes leave the query open and unchanged */
+        for (i = 201; i <= 300; i++) {
+            snprintf(sql, sizeof(sql), "INSERT INTO events VALUES (%d, 0)", i);
+            if (e2e_exec(&exec, sql) != 0) break;
+        }
+        if (i <= 300) break;
+
+        memset(&stmt, 0, sizeof(stmt));
+        stmt.type = STMT_DELETE;
+        strcpy(stmt.stmt.delete.table_name, "events");
+        e2e_where_int(&stmt.stmt.delete.where, "id", SQL_OP_LE, 100);
+        if (executor_execute(&exec, &stmt) != 0) break;
+
+        memset(&stmt, 0, sizeof(stmt));
+        stmt.type = STMT_UPDATE;
+        strcpy(stmt.stmt.update.table_name, "events");
+        strcpy(stmt.stmt.update.column_name, "kind");
+        stmt.stmt.update.value.type = SQL_VALUE_INTEGER;
+        stmt.stmt.update.value.int_value = 9;
+        e2e_where_int(&stmt.stmt.update.where, "id", SQL_OP_GT, 100);
+        if (executor_execute(&exec, &stmt) != 0) break;
+        if (exec.query == NULL) {
+            test_printf("  ERROR: A row write finished the query\n");
+            break;
+        }
+
+        while ((rc = executor_step(&exec, &row)) == AMIDB_ROW) {
+            if (row_get_value(row, 0)->u.i != expect) break;
+            expect++;
+        }
+        executor_finish(&exec);
+        if (rc != AMIDB_DONE || expect != 201) {
+            test_printf("  ERROR: Snapshot stream stopped at id %d\n", expect);
+            break;
+        }
+
+        /* A new query sees the writes */
+        if (e2e_exec(&exec, "SELECT COUNT(*) FROM events WHERE kind = 9") != 0) break;
+        if (exec.result_count != 1 || row_get_value(&exec.result_rows[0], 0)->u.i != 200) {
+            test_printf("  ERROR: Writes missing after the query\n");
+            break;
+        }
+
+        /* DDL still finishes the open query */
+        lexer_init(&lex, "SELECT id FROM events");
+        parser_init(&parser, &lex);
+        if (parser_parse_statement(&parser, &stmt) != 0) break;
+        if (executor_query(&exec, &stmt.stmt.select) != 0) break;
+        if (e2e_exec(&exec, "CREATE TABLE other (id INTEGER PRIMARY KEY)") != 0) break;
+        if (exec.query != NULL) {
+            test_printf("  ERROR: CREATE TABLE left the query open\n");
+            break;
+        }
+
+        /* A query started before BEGIN keeps its snapshot through the */
+        /* transaction, rolled back or committed */
+        lexer_init(&lex, "SELECT id FROM events");
+        parser_init(&parser, &lex);
+        if (parser_parse_statement(&parser, &stmt) != 0) break;
+        if (executor_query(&exec, &stmt.stmt.select) != 0) break;
+        if (executor_step(&exec, &row) != AMIDB_ROW || row_get_value(row, 0)->u.i != 101) break;
+
+        memset(&stmt, 0, sizeof(stmt));
+        stmt.type = STMT_DELETE;
+        strcpy(stmt.stmt.delete.table_name, "events");
+        e2e_where_int(&stmt.stmt.delete.where, "id", SQL_OP_LE, 150);
+
+        if (e2e_exec(&exec, "BEGIN") != 0) break;
+        if (e2e_exec(&exec, "INSERT INTO events VALUES (350, 0)") != 0) break;
+        if (executor_execute(&exec, &stmt) != 0) break;
+        if (e2e_exec(&exec, "ROLLBACK") != 0) break;
+        if (e2e_exec(&exec, "BEGIN") != 0) break;
+        if (executor_execute(&exec, &stmt) != 0) break;
+        if (exec.query == NULL) {
+            test_printf("  ERROR: A write after BEGIN finished the snapshot query\n");
+            break;
+        }
+        if (e2e_exec(&exec, "COMMIT") != 0) break;
+
+        expect = 102;
+        while ((rc = executor_step(&exec, &row)) == AMIDB_ROW) {
+            if (row_get_value(row, 0)->u.i != expect) break;
+            expect++;
+        }
+        executor_finish(&exec);
+        if (rc != AMIDB_DONE || expect != 301) {
+            test_printf("  ERROR: Snapshot stream across BEGIN stopped at id %d\n", expect);
+            break;
+        }
+        if (e2e_exec(&exec, "SELECT COUNT(*) FROM events") != 0) break;
+        if (exec.result_count != 1 || row_get_value(&exec.result_rows[0], 0)->u.i != 150) {
+            test_printf("  ERROR: Committed DELETE missing after the query\n");
+            break;
+        }
+
+        lexer_init(&lex, "SELECT id FROM events");
+        parser_init(&parser, &lex);
+        if (parser_parse_statement(&parser, &stmt) != 0) break;
+
+        /* Inside BEGIN the query reads the transaction, so a write finishes it */
+        if (e2e_exec(&exec, "BEGIN") != 0) break;
+        if (executor_query(&exec, &stmt.stmt.select) != 0) break;
+        if (e2e_exec(&exec, "INSERT INTO events VALUES (301, 0)") != 0) break;
+        if (exec.query != NULL) {
+            test_printf("  ERROR: A write inside BEGIN left the query open\n");
+            break;
+        }
+        if (e2e_exec(&exec, "COMMIT") != 0) break;
+
+        /* With no version budget the next commit makes the query stale */
+        txn_set_version_limit(txn, 0);
+        if (executor_query(&exec, &stmt.stmt.select) != 0) break;
+        if (executor_step(&exec, &row) != AMIDB_ROW) break;
+        memset(&stmt, 0, sizeof(stmt));
+        stmt.type = STMT_DELETE;
+        strcpy(stmt.stmt.delete.table_name, "events");
+        e2e_where_int(&stmt.stmt.delete.where, "id", SQL_OP_GE, 300);
+        if (executor_execute(&exec, &stmt) != 0) break;
+        while ((rc = executor_step(&exec, &row)) == AMIDB_ROW) {
+        }
+        executor_finish(&exec);
+        if (rc != AMIDB_BUSY) {
+            test_printf("  ERROR: Stale query returned %d\n", rc);
+            break;
+        }
+
+        ok = 1;
+    } while (0);
+
+    if (!ok) {
+        test_printf("  ERROR: %s\n", executor_get_error(&exec));
+    }
+
+    executor_close(&exec);
+    catalog_close(&cat);
+    txn_destroy(txn);
+    wal_destroy(wal);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    return ok ? 0 : -1;
+}
+
+/*
+ * Helper: stream a SELECT, checking the ORDER BY column never goes the
+ * wrong way; returns the row count, -1 on error
+ */
+static int e2e_count_ordered(struct sql_executor *exec, const char *sql,
+                             uint32_t column, int ascending) {
+    struct sql_lexer lex;
+    struct sql_parser parser;
+    static struct sql_statement stmt;
+    static char last_text[64];
+    const struct amidb_row *row;
+    const struct amidb_value *val;
+    int32_t last_int = 0;
+    int count = 0;
+    int cmp;
+    int rc;
+
+    lexer_init(&lex, sql);
+    parser_init(&parser, &lex);
+    if (parser_parse_statement(&parser, &stmt) != 0) return -1;
+    if (executor_query(exec, &stmt.stmt.select) != 0) return -1;
+
+    while ((rc = executor_step(exec, &row)) == AMIDB_ROW) {
+        val = row_get_value(row, column);
+        if (val->type == AMIDB_TYPE_INTEGER) {
+            cmp = (val->u.i < last_int) ? -1 : (val->u.i > last_int) ? 1 : 0;
+            last_int = val->u.i;
+        } else {
+            cmp = strncmp((const char *)val->u.blob.data, last_text, val->u.blob.size);
+            if (cmp == 0 && strlen(last_text) > val->u.blob.size) cmp = -1;
+            snprintf(last_text, sizeof(last_text), "%.*s", (int)val->u.blob.size,
+                     (const char *)val->u.blob.data);
+        }
+        if (count > 0 && (ascending ? cmp < 0 : cmp > 0)) {
+            test_printf("  ERROR: Row %d out of order\n", count);
+            executor_finish(exec);
+            return -1;
+        }
+        count++;
+    }
+    executor_finish(exec);
+
+    return (rc == AMIDB_DONE) ? count : -1;
+}
+
+/*
+ * Test: ORDER BY past the sort's memory budget spills and merges runs
+ */
+int test_e2e_order_by_external(void) {
+    struct amidb_pager *pager;
+    struct page_cache *cache;
+    struct catalog cat;
+    struct sql_executor exec;
+    static struct table_schema schema;
+    static struct sql_statement stmt;
+    static struct sql_plan plan;
+    struct sql_lexer lex;
+    struct sql_parser parser;
+    struct amidb_row row;
+    char sql[96];
+    int ok = 0;
+    int rc;
+    int n;
+    int i;
+
+    test_printf("Testing E2E: External ORDER BY...\n");
+
+    remove("RAM:test_extsort.db");
+
+    rc = pager_open("RAM:test_extsort.db", 0, &pager);
+    if (rc != 0) return -1;
+
+    cache = cache_create(32, pager);
+    if (!cache) {
+        pager_close(pager);
+        return -1;
+    }
+
+    rc = catalog_init(&cat, pager, cache);
+    if (rc != 0) {
+        cache_destroy(cache);
+        pager_close(pager);
+        return -1;
+    }
+
+    executor_init(&exec, pager, cache, &cat);
+
+    do {
+        if (e2e_exec(&exec, "CREATE TABLE scores (id INTEGER PRIMARY KEY, player TEXT, score INTEGER)") != 0) break;
+        for (i = 1; i <= 3000; i++) {
+            snprintf(sql, sizeof(sql), "INSERT INTO scores VALUES (%d, 'player%d', %d)",
+                     i, (i * 37) % 3000, (i * 7919) % 3001);
+            if (e2e_exec(&exec, sql) != 0) break;
+        }
+        if (i <= 3000) break;
+
+        /* Far more rows than fit in the smallest budget */
+        exec.sort_memory = SORTER_MIN_MEMORY;
+        n = e2e_count_ordered(&exec, "SELECT * FROM scores ORDER BY score", 2, 1);
+        if (n != 3000) {
+            test_printf("  ERROR: ORDER BY score returned %d rows\n", n);
+            break;
+        }
+        n = e2e_count_ordered(&exec, "SELECT player, id FROM scores ORDER BY player DESC", 0, 0);
+        if (n != 3000) {
+            test_printf("  ERROR: ORDER BY player DESC returned %d rows\n", n);
+            break;
+        }
+        n = e2e_count_ordered(&exec, "SELECT * FROM scores WHERE score > 1500 ORDER BY score DESC LIMIT 700", 2, 0);
+        if (n != 700) {
+            test_printf("  ERROR: ORDER BY ... LIMIT returned %d rows\n", n);
+            break;
+        }
+
+        /* The default budget, through the buffered result set */
+        exec.sort_memory = 0;
+        if (e2e_exec(&exec, "SELECT * FROM scores ORDER BY score DESC") != 0) break;
+        if (exec.result_count != MAX_RESULT_ROWS ||
+            row_get_value(&exec.result_rows[0], 2)->u.i != 3000) {
+            test_printf("  ERROR: Expected the top score first\n");
+            break;
+        }
+
+        /* The plan reports its runs and merge passes */
+        if (catalog_get_table(&cat, "scores", &schema) != 0) break;
+        lexer_init(&lex, "SELECT * FROM scores ORDER BY player");
+        parser_init(&parser, &lex);
+        if (parser_parse_statement(&parser, &stmt) != 0) break;
+        if (plan_build(&plan, pager, cache, &schema, &stmt.stmt.select) != 0) {
+            plan_close(&plan);
+            break;
+        }
+        plan.sort_memory = SORTER_MIN_MEMORY;
+        rc = plan_open(&plan);
+        for (n = 0; rc == 0; n++) {
+            row_init(&row);
+            if (plan_next(&plan, &row) != AMIDB_ROW) break;
+            row_clear(&row);
+        }
+        plan_close(&plan);
+        if (rc != 0 || n != 3000 || plan.sort_runs <= SORTER_MIN_MEMORY / SORTER_BUFFER ||
+            plan.sort_passes == 0) {
+            test_printf("  ERROR: %d rows, %u runs, %u passes\n", n, plan.sort_runs, plan.sort_passes);
+            break;
+        }
+
+        ok = 1;
+    } while (0);
+
+    if (!ok) {
+        test_printf("  ERROR: %s\n", executor_get_error(&exec));
+    }
+
+    executor_close(&exec);
+    catalog_close(&cat);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    return ok ? 0 : -1;
+}
+
+/*
+ * Test: ORDER BY ... LIMIT keeps only the LIMIT best rows
+ */
+int test_e2e_order_by_topk(void) {
+    struct amidb_pager *pager;
+    struct page_cache *cache;
+    struct catalog cat;
+    struct sql_executor exec;
+    static struct table_schema schema;
+    static struct sql_statement stmt;
+    static struct sql_plan plan;
+    struct sql_lexer lex;
+    struct sql_parser parser;
+    char sql[96];
+    int32_t expect;
+    int ok = 0;
+    int rc;
+    int n;
+    int i;
+
+    test_printf("Testing E2E: Top-K ORDER BY ... LIMIT...\n");
+
+    remove("RAM:test_topk.db");
+
+    rc = pager_open("RAM:test_topk.db", 0, &pager);
+    if (rc != 0) return -1;
+
+    cache = cache_create(32, pager);
+    if (!cache) {
+        pager_close(pager);
+        return -1;
+    }
+
+    rc = catalog_init(&cat, pager, cache);
+    if (rc != 0) {
+        cache_destroy(cache);
+        pager_close(pager);
+        return -1;
+    }
+
+    executor_init(&exec, pager, cache, &cat);
+
+    do {
+        /* Scores 0..199, each twice */
+        if (e2e_exec(&exec, "CREATE TABLE board (id INTEGER PRIMARY KEY, player TEXT, score INTEGER)") != 0) break;
+        for (i = 1; i <= 400; i++) {
+            snprintf(sql, sizeof(sql), "INSERT INTO board VALUES (%d, 'p%03d', %d)",
+                     i, (i * 13) % 400, (i * 7) % 200);
+            if (e2e_exec(&exec, sql) != 0) break;
+        }
+        if (i <= 400) break;
+
+        /* Leaderboard: 199, 199, 198, 198, ... */
+        if (e2e_exec(&exec, "SELECT score FROM board ORDER BY score DESC LIMIT 10") != 0) break;
+        if (exec.result_count != 10) break;
+        for (i = 0; i < 10; i++) {
+            expect = 199 - i / 2;
+            if (row_get_value(&exec.result_rows[i], 0)->u.i != expect) break;
+        }
+        if (i < 10) {
+            test_printf("  ERROR: Row %d of the leaderboard is wrong\n", i);
+            break;
+        }
+
+        /* Ascending TEXT, a single row, and more than there are */
+        if (e2e_exec(&exec, "SELECT player FROM board ORDER BY player LIMIT 3") != 0) break;
+        if (exec.result_count != 3 ||
+            memcmp(row_get_value(&exec.result_rows[2], 0)->u.blob.data, "p002", 4) != 0) break;
+        if (e2e_exec(&exec, "SELECT * FROM board WHERE score < 5 ORDER BY score DESC LIMIT 1") != 0) break;
+        if (exec.result_count != 1 || row_get_value(&exec.result_rows[0], 2)->u.i != 4) break;
+        n = e2e_count_ordered(&exec, "SELECT * FROM board ORDER BY score LIMIT 1000", 2, 1);
+        if (n != 400) {
+            test_printf("  ERROR: LIMIT 1000 returned %d rows\n", n);
+            break;
+        }
+
+        /* Plans: top-K up to SORTER_TOPK_MAX, a full sort past it, */
+        /* and no sort at all in PRIMARY KEY order */
+        if (catalog_get_table(&cat, "board", &schema) != 0) break;
+        {
+            static const struct {
+                const char *sql;
+                uint8_t op;
+            } cases[] = {
+                { "SELECT * FROM board ORDER BY score LIMIT 1000", PLAN_OP_TOPK },
+                { "SELECT * FROM board ORDER BY score LIMIT 1001", PLAN_OP_SORT },
+                { "SELECT * FROM board ORDER BY score", PLAN_OP_SORT },
+                { "SELECT * FROM board ORDER BY id LIMIT 5", PLAN_OP_SCAN }
+            };
+            uint32_t c;
+            uint32_t j;
+
+            for (c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+                lexer_init(&lex, cases[c].sql);
+                parser_init(&parser, &lex);
+                if (parser_parse_statement(&parser, &stmt) != 0) break;
+                rc = plan_build(&plan, pager, cache, &schema, &stmt.stmt.select);
+                for (j = 0; rc == 0 && j < plan.operator_count; j++) {
+                    if (plan.operators[j].type == PLAN_OP_SORT ||
+                        plan.operators[j].type == PLAN_OP_TOPK) break;
+                }
+                if (rc == 0 && j == plan.operator_count) {
+                    j = 0;
+                }
+                plan_close(&plan);
+                if (rc != 0 || plan.operators[j].type != cases[c].op) {
+                    test_printf("  ERROR: Wrong plan for '%s'\n", cases[c].sql);
+                    break;
+                }
+            }
+            if (c < sizeof(cases) / sizeof(cases[0])) break;
+        }
+
+        ok = 1;
+    } while (0);
+
+    if (!ok) {
+        test_printf("  ERROR: %s\n", executor_get_error(&exec));
+    }
+
+    executor_close(&exec);
+    catalog_close(&cat);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    return ok ? 0 : -1;
+}
+
+/* Bit e2e_plan_ops sets when the access operator tests a WHERE */
+#define E2E_FILTERED    (1L << 30)
+
+/*
+ * Operators in the plan of a SELECT, one bit (1 << PLAN_OP_*) each,
+ * and E2E_FILTERED; -1 if it does not build
+ */
+static int32_t e2e_plan_ops(struct sql_executor *exec, const char *sql) {
+    static struct table_schema schema;
+    static struct sql_statement stmt;
+    static struct sql_plan plan;
+    struct sql_lexer lex;
+    struct sql_parser parser;
+    int32_t ops = 0;
+    uint32_t i;
+
+    lexer_init(&lex, sql);
+    parser_init(&parser, &lex);
+    if (parser_parse_statement(&parser, &stmt) != 0 ||
+        catalog_get_table(exec->catalog, stmt.stmt.select.table_name, &schema) != 0) {
+        return -1;
+    }
+    if (plan_build(&plan, exec->pager, exec->cache, &schema, &stmt.stmt.select) != 0) {
+        plan_close(&plan);
+        return -1;
+    }
+    for (i = 0; i < plan.operator_count; i++) {
+        ops |= 1L << plan.operators[i].type;
+    }
+    if (plan.has_filter) {
+        ops |= E2E_FILTERED;
+    }
+    plan_close(&plan);
+    return ops;
+}
+
+/*
+ * Test: WHERE with AND, OR, NOT and parentheses; PRIMARY KEY bounds
+ * are pushed into the scan
+ */
+int test_e2e_where_compound(void) {
+    struct amidb_pager *pager;
+    struct page_cache *cache;
+    struct catalog cat;
+    struct sql_executor exec;
+    struct sql_prepared *ps = NULL;
+    const struct amidb_row *row;
+    static const struct {
+        const char *where;
+        int32_t ops;            /* Access path, and E2E_FILTERED if a WHERE is left */
+    } cases[] = {
+        { "id > 50 AND id <= 100", 1L << PLAN_OP_RANGE },
+        { "id >= 10 AND id < 20 AND score = 5", (1L << PLAN_OP_RANGE) | E2E_FILTERED },
+        { "score = 1 OR score = 2", (1L << PLAN_OP_SCAN) | E2E_FILTERED },
+        { "NOT score = 0", (1L << PLAN_OP_SCAN) | E2E_FILTERED },
+        { "(id < 5 OR id > 195) AND name = 'n1'", (1L << PLAN_OP_SCAN) | E2E_FILTERED },
+        { "id = 7 AND score = 7", (1L << PLAN_OP_SEEK) | E2E_FILTERED },
+        { "score = 8 AND id = 7", (1L << PLAN_OP_SEEK) | E2E_FILTERED },
+        { "id > 100 AND id < 50", 1L << PLAN_OP_RANGE },
+        { "NOT (id <= 150 OR score <> 3) AND id <> 173", (1L << PLAN_OP_SCAN) | E2E_FILTERED }
+    };
+    const int32_t access = (1L << PLAN_OP_SCAN) | (1L << PLAN_OP_RANGE) |
+                           (1L << PLAN_OP_SEEK) | E2E_FILTERED;
+    char sql[128];
+    uint32_t c;
+    int expect[9];
+    int ok = 0;
+    int rc;
+    int i;
+
+    test_printf("Testing E2E: Compound WHERE and pushdown...\n");
+
+    remove("RAM:test_where.db");
+
+    rc = pager_open("RAM:test_where.db", 0, &pager);
+    if (rc != 0) return -1;
+
+    cache = cache_create(32, pager);
+    if (!cache) {
+        pager_close(pager);
+        return -1;
+    }
+
+    rc = catalog_init(&cat, pager, cache);
+    if (rc != 0) {
+        cache_destroy(cache);
+        pager_close(pager);
+        return -1;
+    }
+
+    executor_init(&exec, pager, cache, &cat);
+
+    /* Rows 1..200: score = id % 10 (NULL every 50th), name = 'n<id % 3>' */
+    memset(expect, 0, sizeof(expect));
+    for (i = 1; i <= 200; i++) {
+        int score = i % 10;
+        int null_score = (i % 50 == 0);
+
+        expect[0] += (i > 50 && i <= 100);
+        expect[1] += (i >= 10 && i < 20 && !null_score && score == 5);
+        expect[2] += (!null_score && (score == 1 || score == 2));
+        expect[3] += (!null_score && score != 0);
+        expect[4] += ((i < 5 || i > 195) && i % 3 == 1);
+        expect[5] += (i == 7);
+        expect[6] += 0;
+        expect[7] += 0;
+        expect[8] += (i > 150 && !null_score && score == 3 && i != 173);
+    }
+
+    do {
+        if (e2e_exec(&exec, "CREATE TABLE t (id INTEGER PRIMARY KEY, name TEXT, score INTEGER)") != 0) break;
+        for (i = 1; i <= 200; i++) {
+            if (i % 50 == 0) {
+                snprintf(sql, sizeof(sql), "INSERT INTO t VALUES (%d, 'n%d', NULL)", i, i % 3);
+            } else {
+                snprintf(sql, sizeof(sql), "INSERT INTO t VALUES (%d, 'n%d', %d)", i, i % 3, i % 10);
+            }
+            if (e2e_exec(&exec, sql) != 0) break;
+        }
+        if (i <= 200) break;
+
+        for (c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+            snprintf(sql, sizeof(sql), "SELECT COUNT(*) FROM t WHERE %s", cases[c].where);
+            if (e2e_exec(&exec, sql) != 0) break;
+            if (row_get_value(&exec.result_rows[0], 0)->u.i != expect[c]) {
+                test_printf("  ERROR: '%s' counted %d rows, expected %d\n",
+                            cases[c].where, row_get_value(&exec.result_rows[0], 0)->u.i, expect[c]);
+                break;
+            }
+            if ((e2e_plan_ops(&exec, sql) & access) != cases[c].ops) {
+                test_printf("  ERROR: Wrong access path for '%s'\n", cases[c].where);
+                break;
+            }
+        }
+        if (c < sizeof(cases) / sizeof(cases[0])) break;
+
+        /* A range still comes out in key order and stops at the LIMIT */
+        if (e2e_exec(&exec, "SELECT id FROM t WHERE id > 190 ORDER BY id LIMIT 3") != 0) break;
+        if (exec.result_count != 3 ||
+            row_get_value(&exec.result_rows[0], 0)->u.i != 191 ||
+            row_get_value(&exec.result_rows[2], 0)->u.i != 193) break;
+        if (e2e_exec(&exec, "SELECT COUNT(*) FROM t WHERE id >= 190 AND NOT id = 195") != 0) break;
+        if (row_get_value(&exec.result_rows[0], 0)->u.i != 10) break;
+
+        /* Bounds bound late; a TEXT bound matches nothing */
+        if (executor_prepare(&exec, "SELECT COUNT(*) FROM t WHERE id >= ? AND id < ? AND NOT score = ?", &ps) != 0) break;
+        if (prepared_bind_int(ps, 1, 1) != AMIDB_OK ||
+            prepared_bind_int(ps, 2, 101) != AMIDB_OK ||
+            prepared_bind_int(ps, 3, 0) != AMIDB_OK) break;
+        if (prepared_step(ps, &row) != AMIDB_ROW || row_get_value(row, 0)->u.i != 90) {
+            test_printf("  ERROR: Prepared range returned the wrong count\n");
+            break;
+        }
+        prepared_reset(ps);
+        if (prepared_bind_text(ps, 2, "x") != AMIDB_OK) break;
+        if (prepared_step(ps, &row) != AMIDB_ROW || row_get_value(row, 0)->u.i != 0) break;
+        prepared_reset(ps);
+
+        ok = 1;
+    } while (0);
+
+    if (!ok) {
+        test_printf("  ERROR: %s\n", executor_get_error(&exec));
+    }
+
+    if (ps) {
+        prepared_finalize(ps);
+    }
+    executor_close(&exec);
+    catalog_close(&cat);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    return ok ? 0 : -1;
+}
+
+/* Copy a TEXT column of a result row into buffer ("" if it is not TEXT) */
+static const char *e2e_text(const struct amidb_row *row, uint32_t col, char *buffer, uint32_t size) {
+    const struct amidb_value *val = row_get_value(row, col);
+
+    buffer[0] = '\0';
+    if (val != NULL && val->type == AMIDB_TYPE_TEXT && val->u.blob.size < size) {
+        memcpy(buffer, val->u.blob.data, val->u.blob.size);
+        buffer[val->u.blob.size] = '\0';
+    }
+    return buffer;
+}
+
+/*
+ * Test: ANALYZE statistics, cost-based access paths, EXPLAIN
+ */
+int test_e2e_analyze_explain(void) {
+    struct amidb_pager *pager;
+    struct page_cache *cache;
+    struct catalog cat;
+    struct sql_executor exec;
+    static struct table_schema schema;
+    char sql[128];
+    char text[128];
+    int32_t rows;
+    uint32_t b;
+    uint32_t sum;
+    int ok = 0;
+    int rc;
+    int i;
+
+    test_printf("Testing E2E: ANALYZE and EXPLAIN...\n");
+
+    remove("RAM:test_analyze.db");
+
+    rc = pager_open("RAM:test_analyze.db", 0, &pager);
+    if (rc != 0) return -1;
+
+    cache = cache_create(32, pager);
+    if (!cache) {
+        pager_close(pager);
+        return -1;
+    }
+
+    rc = catalog_init(&cat, pager, cache);
+    if (rc != 0) {
+        cache_destroy(cache);
+        pager_close(pager);
+        return -1;
+    }
+
+    executor_init(&exec, pager, cache, &cat);
+
+    do {
+        /* Rows 1..400: grp = id % 4, name = 'n<id % 5>' (NULL every 10th) */
+        if (e2e_exec(&exec, "CREATE TABLE t (id INTEGER PRIMARY KEY, grp INTEGER, name TEXT)") != 0) break;
+        for (i = 1; i <= 400; i++) {
+            if (i % 10 == 0) {
+                snprintf(sql, sizeof(sql), "INSERT INTO t VALUES (%d, %d, NULL)", i, i % 4);
+            } else {
+                snprintf(sql, sizeof(sql), "INSERT INTO t VALUES (%d, %d, 'n%d')", i, i % 4, i % 5);
+            }
+            if (e2e_exec(&exec, sql) != 0) break;
+        }
+        if (i <= 400) break;
+
+        if (catalog_get_table(&cat, "t", &schema) != 0 || schema.analyzed_rows != 0) {
+            test_printf("  ERROR: New table has statistics\n");
+            break;
+        }
+        if (e2e_exec(&exec, "ANALYZE t") != 0) break;
+        if (e2e_exec(&exec, "ANALYZE missing") == 0) {
+            test_printf("  ERROR: ANALYZE of a missing table succeeded\n");
+            break;
+        }
+        if (e2e_exec(&exec, "ANALYZE") != 0) break;
+
+        /* Statistics are saved with the schema */
+        if (catalog_get_table(&cat, "t", &schema) != 0) break;
+        if (schema.analyzed_rows != 400 || schema.row_count != 400 || schema.row_bytes == 0 ||
+            schema.stats[0].distinct != 400 || schema.stats[0].min_value != 1 ||
+            schema.stats[0].max_value != 400 ||
+            schema.stats[1].distinct != 4 || schema.stats[1].null_count != 0 ||
+            schema.stats[1].min_value != 0 || schema.stats[1].max_value != 3 ||
+            schema.stats[2].distinct != 5 || schema.stats[2].null_count != 40) {
+            test_printf("  ERROR: Wrong statistics\n");
+            break;
+        }
+        for (b = 0, sum = 0; b < CATALOG_HISTOGRAM_BUCKETS; b++) {
+            sum += schema.stats[0].histogram[b];
+        }
+        if (sum != 400 || schema.stats[0].histogram[0] != 50) {
+            test_printf("  ERROR: Wrong histogram\n");
+            break;
+        }
+
+        /* A range's rows are estimated from the histogram */
+        if (e2e_exec(&exec, "EXPLAIN SELECT * FROM t WHERE id > 300") != 0) break;
+        rows = row_get_value(&exec.result_rows[0], 2)->u.i;
+        if (exec.result_count != 1 ||
+            strcmp(e2e_text(&exec.result_rows[0], 0, text, sizeof(text)), "RANGE") != 0 ||
+            strcmp(e2e_text(&exec.result_rows[0], 1, text, sizeof(text)), "t id >= 301") != 0 ||
+            rows < 90 || rows > 110 || row_get_value(&exec.result_rows[0], 3)->u.i < rows) {
+            test_printf("  ERROR: Wrong plan for a range\n");
+            break;
+        }
+
+        /* A filter's rows from the distinct values */
+        if (e2e_exec(&exec, "EXPLAIN SELECT COUNT(*) FROM t WHERE grp = 1") != 0) break;
+        rows = row_get_value(&exec.result_rows[1], 2)->u.i;
+        if (exec.result_count != 2 ||
+            strcmp(e2e_text(&exec.result_rows[0], 0, text, sizeof(text)), "AGGREGATE") != 0 ||
+            row_get_value(&exec.result_rows[0], 2)->u.i != 1 ||
+            strcmp(e2e_text(&exec.result_rows[1], 1, text, sizeof(text)), "t, WHERE filter") != 0 ||
+            rows < 90 || rows > 110) {
+            test_printf("  ERROR: Wrong plan for a filter\n");
+            break;
+        }
+
+        /* A range over every key costs more than a scan */
+        if (e2e_plan_ops(&exec, "SELECT * FROM t WHERE id >= 0") != ((1L << PLAN_OP_SCAN) | E2E_FILTERED) ||
+            e2e_plan_ops(&exec, "SELECT * FROM t WHERE id >= 390") != (1L << PLAN_OP_RANGE)) {
+            test_printf("  ERROR: Access path not chosen by cost\n");
+            break;
+        }
+        if (e2e_exec(&exec, "SELECT COUNT(*) FROM t WHERE id >= 0 AND name = 'n1'") != 0) break;
+        if (row_get_value(&exec.result_rows[0], 0)->u.i != 80) break;
+
+        /* Only keys needed: the rows are never read */
+        if (e2e_exec(&exec, "EXPLAIN SELECT COUNT(*) FROM t") != 0) break;
+        if (strcmp(e2e_text(&exec.result_rows[1], 1, text, sizeof(text)), "t, index only") != 0) {
+            test_printf("  ERROR: COUNT(*) should read keys only\n");
+            break;
+        }
+        if (e2e_exec(&exec, "SELECT COUNT(*) FROM t") != 0 ||
+            row_get_value(&exec.result_rows[0], 0)->u.i != 400) break;
+        if (e2e_exec(&exec, "SELECT COUNT(*) FROM t WHERE id > 300") != 0 ||
+            row_get_value(&exec.result_rows[0], 0)->u.i != 100) break;
+        if (e2e_exec(&exec, "SELECT id FROM t WHERE id < 50 ORDER BY id DESC") != 0) break;
+        if (exec.result_count != 49 ||
+            row_get_value(&exec.result_rows[0], 0)->u.i != 49 ||
+            row_get_value(&exec.result_rows[48], 0)->u.i != 1) {
+            test_printf("  ERROR: Index-only range returned the wrong keys\n");
+            break;
+        }
+
+        /* The plan is listed from the top */
+        if (e2e_exec(&exec, "EXPLAIN SELECT name FROM t WHERE grp = 2 ORDER BY name LIMIT 5") != 0) break;
+        if (exec.result_count != 4 ||
+            strcmp(e2e_text(&exec.result_rows[0], 0, text, sizeof(text)), "LIMIT") != 0 ||
+            strcmp(e2e_text(&exec.result_rows[2], 1, text, sizeof(text)), "name ASC, keep 5") != 0 ||
+            row_get_value(&exec.result_rows[0], 2)->u.i != 5 ||
+            strcmp(e2e_text(&exec.result_rows[3], 0, text, sizeof(text)), "SCAN") != 0) {
+            test_printf("  ERROR: Wrong plan for ORDER BY ... LIMIT\n");
+            break;
+        }
+
+        /* ANALYZE without a name covers every table, however many */
+        for (i = 0; i < 40; i++) {
+            snprintf(sql, sizeof(sql), "CREATE TABLE u%d (id INTEGER PRIMARY KEY)", i);
+            if (e2e_exec(&exec, sql) != 0) break;
+            snprintf(sql, sizeof(sql), "INSERT INTO u%d VALUES (%d)", i, i);
+            if (e2e_exec(&exec, sql) != 0) break;
+        }
+        if (i < 40) break;
+        if (e2e_exec(&exec, "ANALYZE") != 0) break;
+        for (i = 0; i < 40; i++) {
+            snprintf(sql, sizeof(sql), "u%d", i);
+            if (catalog_get_table(&cat, sql, &schema) != 0 || schema.analyzed_rows != 1) break;
+        }
+        if (i < 40) {
+            test_printf("  ERROR: ANALYZE missed table u%d\n", i);
+            break;
+        }
+
+        ok = 1;
+    } while (0);
+
+    if (!ok) {
+        test_printf("  ERROR: %s\n", executor_get_error(&exec));
+    }
+
+    executor_close(&exec);
+    catalog_close(&cat);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    return ok ? 0 : -1;
+}
+
+/*
+ * Test: INNER JOIN by PRIMARY KEY lookup and by block nested loop
+ */
+int test_e2e_inner_join(void) {
+    struct amidb_pager *pager;
+    struct page_cache *cache;
+    struct catalog cat;
+    struct sql_executor exec;
+    struct sql_prepared *ps = NULL;
+    const struct amidb_row *row;
+    static const struct {
+        const char *where;
+        int32_t count;
+    } cases[] = {
+        { "", 500 },
+        { "WHERE c.region = 2 AND o.amount < 50", 52 },
+        { "WHERE c.region = 2 OR amount = 8", 106 },
+        { "WHERE NOT (region = 2 OR amount < 90)", 34 },
+        { "WHERE o.id <= 10", 10 },
+        { "WHERE c.id = 5", 10 },
+        { "WHERE missing = 1", 0 }
+    };
+    char sql[256];
+    char text[128];
+    uint32_t c;
+    int ok = 0;
+    int rc;
+    int i;
+
+    test_printf("Testing E2E: INNER JOIN...\n");
+
+    remove("RAM:test_join.db");
+
+    rc = pager_open("RAM:test_join.db", 0, &pager);
+    if (rc != 0) return -1;
+
+    cache = cache_create(32, pager);
+    if (!cache) {
+        pager_close(pager);
+        return -1;
+    }
+
+    rc = catalog_init(&cat, pager, cache);
+    if (rc != 0) {
+        cache_destroy(cache);
+        pager_close(pager);
+        return -1;
+    }
+
+    executor_init(&exec, pager, cache, &cat);
+
+    do {
+        /* Customers 1..50 in regions id % 5; orders 1..600 of customer */
+        /* id % 60 (500 of them name a customer), amount id % 100, and a */
+        /* note long enough that the orders take more than one block */
+        if (e2e_exec(&exec, "CREATE TABLE customers (id INTEGER PRIMARY KEY, name TEXT, region INTEGER)") != 0) break;
+        if (e2e_exec(&exec, "CREATE TABLE orders (id INTEGER PRIMARY KEY, customer_id INTEGER, amount INTEGER, note TEXT)") != 0) break;
+        if (e2e_exec(&exec, "CREATE TABLE regions (id INTEGER PRIMARY KEY, code INTEGER, rname TEXT)") != 0) break;
+        for (i = 1; i <= 50; i++) {
+            snprintf(sql, sizeof(sql), "INSERT INTO customers VALUES (%d, 'c%d', %d)", i, i, i % 5);
+            if (e2e_exec(&exec, sql) != 0) break;
+        }
+        if (i <= 50) break;
+        for (i = 1; i <= 600; i++) {
+            snprintf(sql, sizeof(sql), "INSERT INTO orders VALUES (%d, %d, %d, "
+                     "'order %d, to be delivered with the next regular shipment')",
+                     i, i % 60, i % 100, i);
+            if (e2e_exec(&exec, sql) != 0) break;
+        }
+        if (i <= 600) break;
+        if (e2e_exec(&exec, "INSERT INTO orders VALUES (601, NULL, 1, 'no customer')") != 0) break;
+        for (i = 0; i < 5; i++) {
+            snprintf(sql, sizeof(sql), "INSERT INTO regions VALUES (%d, %d, 'r%d')", i + 10, i, i);
+            if (e2e_exec(&exec, sql) != 0) break;
+        }
+        if (i < 5) break;
+
+        /* The same rows from either side, however they are joined */
+        for (c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+            snprintf(sql, sizeof(sql), "SELECT COUNT(*) FROM orders o INNER JOIN customers c "
+                     "ON o.customer_id = c.id %s", cases[c].where);
+            if (e2e_exec(&exec, sql) != 0 ||
+                row_get_value(&exec.result_rows[0], 0)->u.i != cases[c].count) {
+                test_printf("  ERROR: Wrong count for orders JOIN customers %s\n", cases[c].where);
+                break;
+            }
+            snprintf(sql, sizeof(sql), "SELECT COUNT(*) FROM customers c JOIN orders o "
+                     "ON c.id = o.customer_id %s", cases[c].where);
+            if (e2e_exec(&exec, sql) != 0 ||
+                row_get_value(&exec.result_rows[0], 0)->u.i != cases[c].count) {
+                test_printf("  ERROR: Wrong count for customers JOIN orders %s\n", cases[c].where);
+                break;
+            }
+        }
+        if (c < sizeof(cases) / sizeof(cases[0])) break;
+
+        /* Joined rows hold both tables' columns */
+        if (e2e_exec(&exec, "SELECT c.name, o.amount, region FROM orders o JOIN customers c "
+                            "ON o.customer_id = c.id WHERE o.id = 125") != 0) break;
+        if (exec.result_count != 1 ||
+            strcmp(e2e_text(&exec.result_rows[0], 0, text, sizeof(text)), "c5") != 0 ||
+            row_get_value(&exec.result_rows[0], 1)->u.i != 25 ||
+            row_get_value(&exec.result_rows[0], 2)->u.i != 0) {
+            test_printf("  ERROR: Wrong joined row\n");
+            break;
+        }
+        if (e2e_exec(&exec, "SELECT * FROM customers JOIN orders ON customers.id = customer_id "
+                            "WHERE orders.id = 61") != 0) break;
+        if (exec.result_count != 1 || exec.result_rows[0].column_count != 7 ||
+            row_get_value(&exec.result_rows[0], 0)->u.i != 1 ||
+            row_get_value(&exec.result_rows[0], 3)->u.i != 61) {
+            test_printf("  ERROR: Wrong SELECT * of a join\n");
+            break;
+        }
+
+        /* A few rows coming in are looked up; many are matched by blocks */
+        if (e2e_exec(&exec, "ANALYZE") != 0) break;
+        if (e2e_exec(&exec, "EXPLAIN SELECT * FROM orders o JOIN customers c "
+                            "ON o.customer_id = c.id WHERE o.id <= 10") != 0) break;
+        if (exec.result_count != 2 ||
+            strcmp(e2e_text(&exec.result_rows[0], 0, text, sizeof(text)), "JOIN") != 0 ||
+            strcmp(e2e_text(&exec.result_rows[0], 1, text, sizeof(text)),
+                   "customers c ON o.customer_id = c.id, lookup by id") != 0) {
+            test_printf("  ERROR: Few rows should be joined by lookup\n");
+            break;
+        }
+        if (e2e_exec(&exec, "EXPLAIN SELECT * FROM customers c JOIN orders o "
+                            "ON o.customer_id = c.id WHERE c.region = 1 AND o.amount > 5") != 0) break;
+        if (exec.result_count != 2 ||
+            strncmp(e2e_text(&exec.result_rows[0], 1, text, sizeof(text)),
+                    "orders o ON o.customer_id = c.id, blocks of ", 44) != 0 ||
+            strstr(text, ", WHERE filter") == NULL ||
+            strcmp(e2e_text(&exec.result_rows[1], 1, text, sizeof(text)),
+                   "customers, WHERE filter") != 0) {
+            test_printf("  ERROR: Wrong plan for a block nested loop\n");
+            break;
+        }
+
+        if (e2e_exec(&exec, "SELECT o.amount, c.name FROM orders o JOIN customers c "
+                            "ON o.customer_id = c.id WHERE o.id <= 10 AND c.region = 2") != 0) break;
+        if (exec.result_count != 2 ||
+            row_get_value(&exec.result_rows[0], 0)->u.i != 2 ||
+            strcmp(e2e_text(&exec.result_rows[1], 1, text, sizeof(text)), "c7") != 0) {
+            test_printf("  ERROR: Wrong rows from a lookup join\n");
+            break;
+        }
+
+        /* Three tables, the last on a column that is not a key */
+        if (e2e_exec(&exec, "SELECT COUNT(*) FROM orders o JOIN customers c ON o.customer_id = c.id "
+                            "JOIN regions r ON r.code = c.region WHERE r.rname = 'r3'") != 0 ||
+            row_get_value(&exec.result_rows[0], 0)->u.i != 100) {
+            test_printf("  ERROR: Wrong count for a three-table join\n");
+            break;
+        }
+        if (e2e_exec(&exec, "SELECT o.id, rname FROM orders o JOIN customers c ON o.customer_id = c.id "
+                            "JOIN regions r ON c.region = r.code ORDER BY o.id DESC LIMIT 3") != 0) break;
+        if (exec.result_count != 3 ||
+            row_get_value(&exec.result_rows[0], 0)->u.i != 590 ||
+            strcmp(e2e_text(&exec.result_rows[0], 1, text, sizeof(text)), "r0") != 0 ||
+            row_get_value(&exec.result_rows[2], 0)->u.i != 588 ||
+            strcmp(e2e_text(&exec.result_rows[2], 1, text, sizeof(text)), "r3") != 0) {
+            test_printf("  ERROR: Wrong ORDER BY of a join\n");
+            break;
+        }
+
+        /* Names that are ambiguous, unknown or not joined */
+        if (e2e_exec(&exec, "SELECT id FROM orders JOIN customers ON customer_id = customers.id") == 0 ||
+            strcmp(executor_get_error(&exec), "Column 'id' is ambiguous") != 0 ||
+            e2e_exec(&exec, "SELECT x.id FROM orders JOIN customers ON customer_id = customers.id") == 0 ||
+            e2e_exec(&exec, "SELECT * FROM orders o JOIN customers c ON o.id = o.customer_id") == 0 ||
+            e2e_exec(&exec, "SELECT * FROM orders JOIN orders ON id = id") == 0 ||
+            e2e_exec(&exec, "SELECT * FROM orders JOIN nowhere ON id = nowhere.id") == 0) {
+            test_printf("  ERROR: Bad join was accepted\n");
+            break;
+        }
+
+        /* A table joined to itself, by alias */
+        if (e2e_exec(&exec, "SELECT COUNT(*) FROM orders a JOIN orders b ON a.amount = b.id "
+                            "WHERE a.id <= 100") != 0 ||
+            row_get_value(&exec.result_rows[0], 0)->u.i != 99) {
+            test_printf("  ERROR: Wrong count for a self join\n");
+            break;
+        }
+
+        /* A prepared join runs again with new values */
+        if (executor_prepare(&exec, "SELECT COUNT(*) FROM orders o JOIN customers c "
+                                    "ON o.customer_id = c.id WHERE c.region = ?", &ps) != 0) break;
+        for (i = 0; i < 5; i++) {
+            prepared_bind_int(ps, 1, i);
+            if (prepared_step(ps, &row) != AMIDB_ROW || row->values[0].u.i != 100) break;
+            prepared_reset(ps);
+        }
+        if (i < 5) {
+            test_printf("  ERROR: Wrong count from a prepared join\n");
+            break;
+        }
+
+        ok = 1;
+    } while (0);
+
+    if (!ok) {
+        test_printf("  ERROR: %s\n", executor_get_error(&exec));
+    }
+
+    prepared_finalize(ps);
+    executor_close(&exec);
+    catalog_close(&cat);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    return ok ? 0 : -1;
+}
+
+/*
+ * Test: hash join in memory and partitioned past its budget
+ */
+int test_e2e_hash_join(void) {
+    struct amidb_pager *pager;
+    struct page_cache *cache;
+    struct catalog cat;
+    struct sql_executor exec;
+    static struct table_schema schemas[2];
+    static struct sql_statement stmt;
+    static struct sql_plan plan;
+    struct sql_lexer lex;
+    struct sql_parser parser;
+    struct amidb_row row;
+    static const struct {
+        const char *sql;
+        int32_t result;
+    } cases[] = {
+        { "SELECT COUNT(*) FROM lefts l JOIN rights r ON l.k = r.k", 18256 },
+        { "SELECT SUM(l.id) FROM lefts l JOIN rights r ON l.k = r.k", 13667924 },
+        { "SELECT SUM(r.id) FROM rights r JOIN lefts l ON l.k = r.k", 10952942 },
+        { "SELECT COUNT(*) FROM lefts l JOIN rights r ON l.k = r.k WHERE l.id < 700 AND r.name = 'r3'", 294 },
+        { "SELECT COUNT(*) FROM lefts l JOIN rights r ON l.k = r.k WHERE l.id < 100 OR r.name = 'r3'", 1791 },
+        { "SELECT COUNT(*) FROM lefts l JOIN rights r ON r.k = l.k WHERE l.id <= 10", 138 },
+        { "SELECT COUNT(*) FROM lefts l JOIN rights r ON l.tag = r.name", 45200 },
+        { "SELECT COUNT(*) FROM rights r JOIN lefts l ON l.tag = r.name WHERE l.k = 5", 480 },
+        { "SELECT COUNT(*) FROM lefts l JOIN rights r ON l.k = r.k "
+          "JOIN lefts l2 ON l2.id = r.id WHERE l2.k = 3", 187 }
+    };
+    static const uint32_t budgets[] = { 0, HASHER_MIN_MEMORY };
+    char sql[160];
+    char text[128];
+    uint32_t b;
+    uint32_t c;
+    int ok = 0;
+    int rc;
+    int n;
+    int i;
+
+    test_printf("Testing E2E: Hash join...\n");
+
+    remove("RAM:test_hashjoin.db");
+
+    rc = pager_open("RAM:test_hashjoin.db", 0, &pager);
+    if (rc != 0) return -1;
+
+    cache = cache_create(32, pager);
+    if (!cache) {
+        pager_close(pager);
+        return -1;
+    }
+
+    rc = catalog_init(&cat, pager, cache);
+    if (rc != 0) {
+        cache_destroy(cache);
+        pager_close(pager);
+        return -1;
+    }
+
+    executor_init(&exec, pager, cache, &cat);
+
+    do {
+        /* Joined on columns that are not keys; some of the right's are NULL */
+        if (e2e_exec(&exec, "CREATE TABLE lefts (id INTEGER PRIMARY KEY, k INTEGER, tag TEXT, note TEXT)") != 0) break;
+        if (e2e_exec(&exec, "CREATE TABLE rights (id INTEGER PRIMARY KEY, k INTEGER, name TEXT)") != 0) break;
+        for (i = 1; i <= 1500; i++) {
+            snprintf(sql, sizeof(sql), "INSERT INTO lefts VALUES (%d, %d, 'r%d', "
+                     "'left row %d, padded out to make the rows longer')", i, i % 97, i % 40, i);
+            if (e2e_exec(&exec, sql) != 0) break;
+        }
+        if (i <= 1500) break;
+        for (i = 1; i <= 1200; i++) {
+            if (i % 50 == 0) {
+                snprintf(sql, sizeof(sql), "INSERT INTO rights VALUES (%d, NULL, 'r%d')", i, i % 30);
+            } else {
+                snprintf(sql, sizeof(sql), "INSERT INTO rights VALUES (%d, %d, 'r%d')", i, i % 89, i % 30);
+            }
+            if (e2e_exec(&exec, sql) != 0) break;
+        }
+        if (i <= 1200) break;
+        if (e2e_exec(&exec, "ANALYZE") != 0) break;
+
+        /* The smaller side is hashed, whichever comes first */
+        if (e2e_exec(&exec, "EXPLAIN SELECT * FROM lefts l JOIN rights r ON l.k = r.k") != 0 ||
+            strcmp(e2e_text(&exec.result_rows[0], 1, text, sizeof(text)),
+                   "rights r ON l.k = r.k, hash of r") != 0 ||
+            e2e_exec(&exec, "EXPLAIN SELECT * FROM rights r JOIN lefts l ON l.k = r.k") != 0 ||
+            strcmp(e2e_text(&exec.result_rows[0], 1, text, sizeof(text)),
+                   "lefts l ON l.k = r.k, hash of rows coming in") != 0) {
+            test_printf("  ERROR: Wrong side hashed\n");
+            break;
+        }
+
+        /* The same answers in memory and partitioned */
+        for (b = 0; b < sizeof(budgets) / sizeof(budgets[0]); b++) {
+            exec.join_memory = budgets[b];
+            for (c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+                if (e2e_exec(&exec, cases[c].sql) != 0 ||
+                    row_get_value(&exec.result_rows[0], 0)->u.i != cases[c].result) {
+                    test_printf("  ERROR: Wrong result with %lu bytes: %s\n",
+                                (unsigned long)budgets[b], cases[c].sql);
+                    break;
+                }
+            }
+            if (c < sizeof(cases) / sizeof(cases[0])) break;
+        }
+        if (b < sizeof(budgets) / sizeof(budgets[0])) break;
+
+        if (e2e_exec(&exec, "SELECT l.id, r.id, r.name FROM lefts l JOIN rights r ON l.k = r.k "
+                            "WHERE r.id = 45 ORDER BY l.id DESC LIMIT 2") != 0) break;
+        if (exec.result_count != 2 ||
+            row_get_value(&exec.result_rows[0], 0)->u.i != 1500 ||
+            row_get_value(&exec.result_rows[1], 0)->u.i != 1403 ||
+            strcmp(e2e_text(&exec.result_rows[1], 2, text, sizeof(text)), "r15") != 0) {
+            test_printf("  ERROR: Wrong rows from a partitioned join\n");
+            break;
+        }
+        if (e2e_exec(&exec, "EXPLAIN SELECT * FROM lefts l JOIN rights r ON l.k = r.k") != 0 ||
+            strstr(e2e_text(&exec.result_rows[0], 1, text, sizeof(text)), " partitions") == NULL) {
+            test_printf("  ERROR: EXPLAIN should show the partitions\n");
+            break;
+        }
+        exec.join_memory = 0;
+
+        /* The plan reports the partitions it wrote */
+        if (catalog_get_table(&cat, "lefts", &schemas[0]) != 0 ||
+            catalog_get_table(&cat, "rights", &schemas[1]) != 0) break;
+        lexer_init(&lex, "SELECT * FROM lefts l JOIN rights r ON l.k = r.k");
+        parser_init(&parser, &lex);
+        if (parser_parse_statement(&parser, &stmt) != 0) break;
+        if (plan_build(&plan, pager, cache, schemas, &stmt.stmt.select) != 0) {
+            plan_close(&plan);
+            break;
+        }
+        plan.join_memory = HASHER_MIN_MEMORY;
+        rc = plan_open(&plan);
+        for (n = 0; rc == 0; n++) {
+            row_init(&row);
+            if (plan_next(&plan, &row) != AMIDB_ROW) break;
+            row_clear(&row);
+        }
+        plan_close(&plan);
+        if (rc != 0 || n != 18256 || plan.join_partitions < HASHER_MIN_PARTITIONS) {
+            test_printf("  ERROR: %d rows, %u partitions\n", n, plan.join_partitions);
+            break;
+        }
+
+        ok = 1;
+    } while (0);
+
+    if (!ok) {
+        test_printf("  ERROR: %s\n", executor_get_error(&exec));
+    }
+
+    executor_close(&exec);
+    catalog_close(&cat);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    return ok ? 0 : -1;
+}
@@ -343,3 +343,367 @@ int test_parser_case_insensitive(void) {
 
     return 0;
 }
+
+/*
+ * Test: Transaction control statements
+ */
+int test_parser_transaction_statements(void) {
+    struct sql_lexer lex;
+    struct sql_parser parser;
+    struct sql_statement stmt;
+    static const struct {
+        const char *sql;
+        uint8_t type;
+        const char *name;
+    } cases[] = {
+        { "BEGIN", STMT_BEGIN, "" },
+        { "BEGIN TRANSACTION;", STMT_BEGIN, "" },
+        { "COMMIT", STMT_COMMIT, "" },
+        { "ROLLBACK", STMT_ROLLBACK, "" },
+        { "SAVEPOINT batch1", STMT_SAVEPOINT, "batch1" },
+        { "RELEASE batch1", STMT_RELEASE, "batch1" },
+        { "RELEASE SAVEPOINT batch1;", STMT_RELEASE, "batch1" },
+        { "ROLLBACK TO batch1", STMT_ROLLBACK, "batch1" },
+        { "rollback transaction to savepoint batch1", STMT_ROLLBACK, "batch1" }
+    };
+    uint32_t i;
+
+    printf("Testing transaction control statements...\n");
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        lexer_init(&lex, cases[i].sql);
+        parser_init(&parser, &lex);
+
+        if (parser_parse_statement(&parser, &stmt) != 0) {
+            printf("  ERROR: Parse of '%s' failed: %s\n",
+                   cases[i].sql, parser_get_error(&parser));
+            return -1;
+        }
+
+        if (stmt.type != cases[i].type) {
+            printf("  ERROR: Wrong statement type for '%s'\n", cases[i].sql);
+            return -1;
+        }
+
+        if (strcmp(stmt.stmt.transaction.savepoint_name, cases[i].name) != 0) {
+            printf("  ERROR: Wrong savepoint name for '%s'\n", cases[i].sql);
+            return -1;
+        }
+    }
+
+    /* SAVEPOINT needs a name */
+    lexer_init(&lex, "SAVEPOINT");
+    parser_init(&parser, &lex);
+    if (parser_parse_statement(&parser, &stmt) == 0) {
+        printf("  ERROR: Should fail without savepoint name\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Test: CREATE TABLE engine clause
+ */
+int test_parser_create_engine(void) {
+    struct sql_lexer lex;
+    struct sql_parser parser;
+    struct sql_statement stmt;
+    static const struct {
+        const char *sql;
+        uint8_t engine;
+    } cases[] = {
+        { "CREATE TABLE t (id INTEGER PRIMARY KEY)", SQL_ENGINE_BTREE },
+        { "CREATE TABLE t (id INTEGER PRIMARY KEY) ENGINE = BTREE", SQL_ENGINE_BTREE },
+        { "CREATE TABLE t (id INTEGER PRIMARY KEY) ENGINE = LSM;", SQL_ENGINE_LSM },
+        { "create table t (id integer primary key) engine = lsm", SQL_ENGINE_LSM }
+    };
+    uint32_t i;
+
+    printf("Testing CREATE TABLE engine clause...\n");
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        lexer_init(&lex, cases[i].sql);
+        parser_init(&parser, &lex);
+
+        if (parser_parse_statement(&parser, &stmt) != 0) {
+            printf("  ERROR: Parse of '%s' failed: %s\n",
+                   cases[i].sql, parser_get_error(&parser));
+            return -1;
+        }
+
+        if (stmt.stmt.create_table.engine != cases[i].engine) {
+            printf("  ERROR: Wrong engine for '%s'\n", cases[i].sql);
+            return -1;
+        }
+    }
+
+    /* Unknown engine */
+    lexer_init(&lex, "CREATE TABLE t (id INTEGER PRIMARY KEY) ENGINE = HEAP");
+    parser_init(&parser, &lex);
+    if (parser_parse_statement(&parser, &stmt) == 0) {
+        printf("  ERROR: Should fail for unknown engine\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Test: ? placeholders are numbered left to right
+ */
+int test_parser_parameters(void) {
+    struct sql_lexer lex;
+    struct sql_parser parser;
+    static struct sql_statement stmt;
+    const struct sql_insert *insert = &stmt.stmt.insert;
+
+    printf("Testing ? parameters...\n");
+
+    lexer_init(&lex, "INSERT INTO t VALUES (?, 'x', ?)");
+    parser_init(&parser, &lex);
+    if (parser_parse_statement(&parser, &stmt) != 0) {
+        printf("  ERROR: Parse failed: %s\n", parser_get_error(&parser));
+        return -1;
+    }
+    if (stmt.param_count != 2 ||
+        insert->values[0].type != SQL_VALUE_PARAM || insert->values[0].int_value != 1 ||
+        insert->values[1].type != SQL_VALUE_TEXT ||
+        insert->values[2].type != SQL_VALUE_PARAM || insert->values[2].int_value != 2) {
+        printf("  ERROR: Wrong parameters in INSERT\n");
+        return -1;
+    }
+
+    lexer_init(&lex, "SELECT * FROM t WHERE id >= ?");
+    parser_init(&parser, &lex);
+    if (parser_parse_statement(&parser, &stmt) != 0) {
+        printf("  ERROR: Parse failed: %s\n", parser_get_error(&parser));
+        return -1;
+    }
+    if (stmt.param_count != 1 || stmt.stmt.select.where.conditions[0].value.type != SQL_VALUE_PARAM) {
+        printf("  ERROR: Wrong parameter in WHERE\n");
+        return -1;
+    }
+
+    /* Statements without one have none */
+    lexer_init(&lex, "SELECT * FROM t WHERE id = 1");
+    parser_init(&parser, &lex);
+    if (parser_parse_statement(&parser, &stmt) != 0 || stmt.param_count != 0) {
+        printf("  ERROR: Unexpected parameters\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Test: AND binds tighter than OR; NOT and parentheses nest
+ */
+int test_parser_compound_where(void) {
+    struct sql_lexer lex;
+    struct sql_parser parser;
+    static struct sql_statement stmt;
+    const struct sql_where *where = &stmt.stmt.select.where;
+    const struct sql_where_node *root;
+    const struct sql_where_node *node;
+    char sql[512];
+    int i;
+
+    /* a = 1 OR (b = 2 AND c = 3) */
+    lexer_init(&lex, "SELECT * FROM t WHERE a = 1 OR b = 2 AND c = 3");
+    parser_init(&parser, &lex);
+    if (parser_parse_statement(&parser, &stmt) != 0) {
+        printf("  ERROR: Parse failed: %s\n", parser_get_error(&parser));
+        return -1;
+    }
+    root = &where->nodes[where->root];
+    if (where->condition_count != 3 || where->node_count != 5 || root->type != SQL_WHERE_OR ||
+        where->nodes[root->left].type != SQL_WHERE_COMPARE ||
+        where->nodes[root->right].type != SQL_WHERE_AND) {
+        printf("  ERROR: AND should bind tighter than OR\n");
+        return -1;
+    }
+
+    /* NOT (a = 1 OR b = 2) AND c >= ? */
+    lexer_init(&lex, "SELECT * FROM t WHERE NOT (a = 1 OR b = 2) AND c >= ? ORDER BY a");
+    parser_init(&parser, &lex);
+    if (parser_parse_statement(&parser, &stmt) != 0) {
+        printf("  ERROR: Parse failed: %s\n", parser_get_error(&parser));
+        return -1;
+    }
+    root = &where->nodes[where->root];
+    node = &where->nodes[root->left];
+    if (root->type != SQL_WHERE_AND || node->type != SQL_WHERE_NOT ||
+        where->nodes[node->left].type != SQL_WHERE_OR ||
+        strcmp(where->conditions[2].column_name, "c") != 0 ||
+        where->conditions[2].op != SQL_OP_GE ||
+        where->conditions[2].value.type != SQL_VALUE_PARAM ||
+        !stmt.stmt.select.order_by.has_order) {
+        printf("  ERROR: Wrong tree for NOT and parentheses\n");
+        return -1;
+    }
+
+    /* Unbalanced, dangling and oversized clauses */
+    lexer_init(&lex, "SELECT * FROM t WHERE (a = 1 OR b = 2");
+    parser_init(&parser, &lex);
+    if (parser_parse_statement(&parser, &stmt) == 0) {
+        printf("  ERROR: Should fail for missing ')'\n");
+        return -1;
+    }
+    lexer_init(&lex, "SELECT * FROM t WHERE a = 1 AND");
+    parser_init(&parser, &lex);
+    if (parser_parse_statement(&parser, &stmt) == 0) {
+        printf("  ERROR: Should fail for dangling AND\n");
+        return -1;
+    }
+
+    strcpy(sql, "SELECT * FROM t WHERE a = 0");
+    for (i = 1; i <= SQL_MAX_CONDITIONS; i++) {
+        sprintf(sql + strlen(sql), " OR a = %d", i);
+    }
+    lexer_init(&lex, sql);
+    parser_init(&parser, &lex);
+    if (parser_parse_statement(&parser, &stmt) == 0) {
+        printf("  ERROR: Should fail for too many conditions\n");
+        return -1;
+    }
+
+    strcpy(sql, "SELECT * FROM t WHERE ");
+    for (i = 0; i <= SQL_MAX_WHERE_DEPTH; i++) {
+        strcat(sql, "(");
+    }
+    strcat(sql, "a = 1");
+    for (i = 0; i <= SQL_MAX_WHERE_DEPTH; i++) {
+        strcat(sql, ")");
+    }
+    lexer_init(&lex, sql);
+    parser_init(&parser, &lex);
+    if (parser_parse_statement(&parser, &stmt) == 0) {
+        printf("  ERROR: Should fail for nesting too deep\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Test: ANALYZE [table] and EXPLAIN SELECT
+ */
+int test_parser_analyze_explain(void) {
+    struct sql_lexer lex;
+    struct sql_parser parser;
+    static struct sql_statement stmt;
+
+    lexer_init(&lex, "ANALYZE users;");
+    parser_init(&parser, &lex);
+    if (parser_parse_statement(&parser, &stmt) != 0 || stmt.type != STMT_ANALYZE ||
+        strcmp(stmt.stmt.analyze.table_name, "users") != 0) {
+        printf("  ERROR: ANALYZE users parsed wrong\n");
+        return -1;
+    }
+
+    lexer_init(&lex, "ANALYZE");
+    parser_init(&parser, &lex);
+    if (parser_parse_statement(&parser, &stmt) != 0 || stmt.type != STMT_ANALYZE ||
+        stmt.stmt.analyze.table_name[0] != '\0') {
+        printf("  ERROR: ANALYZE without a table parsed wrong\n");
+        return -1;
+    }
+
+    lexer_init(&lex, "EXPLAIN SELECT id FROM users WHERE id > 5 LIMIT 3");
+    parser_init(&parser, &lex);
+    if (parser_parse_statement(&parser, &stmt) != 0 || stmt.type != STMT_SELECT ||
+        !stmt.stmt.select.explain || stmt.stmt.select.limit != 3 ||
+        strcmp(stmt.stmt.select.table_name, "users") != 0) {
+        printf("  ERROR: EXPLAIN SELECT parsed wrong\n");
+        return -1;
+    }
+
+    lexer_init(&lex, "SELECT * FROM users");
+    parser_init(&parser, &lex);
+    if (parser_parse_statement(&parser, &stmt) != 0 || stmt.stmt.select.explain) {
+        printf("  ERROR: Plain SELECT marked EXPLAIN\n");
+        return -1;
+    }
+
+    lexer_init(&lex, "EXPLAIN DROP TABLE users");
+    parser_init(&parser, &lex);
+    if (parser_parse_statement(&parser, &stmt) == 0) {
+        printf("  ERROR: Should fail for EXPLAIN of a non-SELECT\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Test: INNER JOIN, aliases and table.column names
+ */
+int test_parser_inner_join(void) {
+    struct sql_lexer lex;
+    struct sql_parser parser;
+    static struct sql_statement stmt;
+    struct sql_select *select = &stmt.stmt.select;
+
+    lexer_init(&lex, "SELECT o.id, c.name FROM orders o INNER JOIN customers AS c "
+                     "ON o.customer_id = c.id JOIN regions ON regions.id = c.region "
+                     "WHERE c.name = 'bob' AND amount > 5 ORDER BY o.id DESC LIMIT 2");
+    parser_init(&parser, &lex);
+    if (parser_parse_statement(&parser, &stmt) != 0) {
+        printf("  ERROR: Parse failed: %s\n", parser_get_error(&parser));
+        return -1;
+    }
+    if (strcmp(select->table_name, "orders") != 0 || strcmp(select->alias, "o") != 0 ||
+        select->join_count != 2 ||
+        strcmp(select->joins[0].table_name, "customers") != 0 ||
+        strcmp(select->joins[0].alias, "c") != 0 ||
+        strcmp(select->joins[0].left_column, "o.customer_id") != 0 ||
+        strcmp(select->joins[0].right_column, "c.id") != 0 ||
+        strcmp(select->joins[1].table_name, "regions") != 0 ||
+        select->joins[1].alias[0] != '\0' ||
+        strcmp(select->joins[1].left_column, "regions.id") != 0) {
+        printf("  ERROR: Joins parsed wrong\n");
+        return -1;
+    }
+    if (select->column_count != 2 || strcmp(select->columns[0], "o.id") != 0 ||
+        strcmp(select->columns[1], "c.name") != 0 ||
+        strcmp(select->where.conditions[0].column_name, "c.name") != 0 ||
+        strcmp(select->where.conditions[1].column_name, "amount") != 0 ||
+        strcmp(select->order_by.column_name, "o.id") != 0 || select->limit != 2) {
+        printf("  ERROR: Qualified columns parsed wrong\n");
+        return -1;
+    }
+
+    lexer_init(&lex, "SELECT SUM(t.amount) FROM t");
+    parser_init(&parser, &lex);
+    if (parser_parse_statement(&parser, &stmt) != 0 ||
+        strcmp(select->agg_column, "t.amount") != 0 || select->join_count != 0 ||
+        select->alias[0] != '\0') {
+        printf("  ERROR: Qualified aggregate column parsed wrong\n");
+        return -1;
+    }
+
+    lexer_init(&lex, "SELECT * FROM a JOIN b ON a.id");
+    parser_init(&parser, &lex);
+    if (parser_parse_statement(&parser, &stmt) == 0) {
+        printf("  ERROR: Should fail for ON without '='\n");
+        return -1;
+    }
+
+    lexer_init(&lex, "SELECT * FROM a INNER b ON a.id = b.id");
+    parser_init(&parser, &lex);
+    if (parser_parse_statement(&parser, &stmt) == 0) {
+        printf("  ERROR: Should fail for INNER without JOIN\n");
+        return -1;
+    }
+
+    lexer_init(&lex, "SELECT * FROM a JOIN b ON a.id = b.id JOIN c ON a.id = c.id "
+                     "JOIN d ON a.id = d.id JOIN e ON a.id = e.id");
+    parser_init(&parser, &lex);
+    if (parser_parse_statement(&parser, &stmt) == 0) {
+        printf("  ERROR: Should fail for more than 3 joins\n");
+        return -1;
+    }
+
+    return 0;
+}
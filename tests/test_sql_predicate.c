@@ -0,0 +1,126 @@
+/*
+ * test_sql_predicate.c - Compiled WHERE clause tests
+ */
+
+#include "sql/predicate.h"
+#include "sql/parser.h"
+#include "sql/lexer.h"
+#include "sql/catalog.h"
+#include "storage/row.h"
+#include "test_harness.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Parse "SELECT * FROM t WHERE <where>" into stmt */
+static int parse_where_clause(const char *where, struct sql_statement *stmt) {
+    struct sql_lexer lex;
+    struct sql_parser parser;
+    char sql[256];
+
+    snprintf(sql, sizeof(sql), "SELECT * FROM t WHERE %s", where);
+    lexer_init(&lex, sql);
+    parser_init(&parser, &lex);
+    if (parser_parse_statement(&parser, stmt) != 0) {
+        printf("  ERROR: Parse of '%s' failed: %s\n", where, parser_get_error(&parser));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Test: a row and the same row as stored give the same answer
+ */
+int test_predicate_stored_rows(void) {
+    static struct sql_statement stmt;
+    static struct table_schema schema;
+    static struct sql_predicate pred;
+    static uint8_t buffer[512];
+    static const struct {
+        const char *where;
+        uint8_t expect[4];      /* Per row below */
+    } cases[] = {
+        { "id = 2", { 0, 1, 0, 0 } },
+        { "name = 'bob'", { 0, 1, 0, 0 } },
+        { "name < 'bob'", { 1, 0, 0, 0 } },
+        { "name >= 'b'", { 0, 1, 1, 0 } },
+        { "score > 10 AND name != 'carol'", { 1, 0, 0, 0 } },
+        { "score > 10 OR id = 4", { 1, 0, 1, 1 } },
+        { "NOT score > 10", { 0, 1, 0, 0 } },
+        { "NOT (score = 20 OR name = 'bob')", { 0, 0, 0, 0 } },
+        { "missing = 1 OR id = 3", { 0, 0, 1, 0 } },
+        { "name = 5", { 0, 0, 0, 0 } },
+        { "NOT name = NULL", { 0, 0, 0, 0 } }
+    };
+    static struct amidb_row rows[4];
+    uint32_t c;
+    int size;
+    int i;
+
+    memset(&schema, 0, sizeof(schema));
+    schema.column_count = 3;
+    strcpy(schema.columns[0].name, "id");
+    schema.columns[0].type = SQL_TYPE_INTEGER;
+    strcpy(schema.columns[1].name, "name");
+    schema.columns[1].type = SQL_TYPE_TEXT;
+    strcpy(schema.columns[2].name, "score");
+    schema.columns[2].type = SQL_TYPE_INTEGER;
+    schema.primary_key_index = 0;
+
+    /* alice 20, bob 5, carol 20, and a row with NULL name and score */
+    for (i = 0; i < 4; i++) {
+        row_init(&rows[i]);
+        row_set_int(&rows[i], 0, i + 1);
+    }
+    row_set_text(&rows[0], 1, "alice", 0);
+    row_set_int(&rows[0], 2, 20);
+    row_set_text(&rows[1], 1, "bob", 0);
+    row_set_int(&rows[1], 2, 5);
+    row_set_text(&rows[2], 1, "carol", 0);
+    row_set_int(&rows[2], 2, 20);
+    row_set_null(&rows[3], 1);
+    row_set_null(&rows[3], 2);
+
+    for (c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        if (parse_where_clause(cases[c].where, &stmt) != 0) {
+            return -1;
+        }
+        predicate_compile(&pred, &schema, &stmt.stmt.select.where, 0);
+
+        for (i = 0; i < 4; i++) {
+            size = row_serialize(&rows[i], buffer, sizeof(buffer));
+            if (predicate_matches(&pred, &rows[i]) != cases[c].expect[i] ||
+                predicate_matches_stored(&pred, buffer, (uint32_t)size) != cases[c].expect[i]) {
+                printf("  ERROR: '%s' is wrong for row %d\n", cases[c].where, i + 1);
+                return -1;
+            }
+        }
+    }
+
+    /* Conditions the access path answers are taken as true */
+    if (parse_where_clause("id >= 2 AND score = 20", &stmt) != 0) {
+        return -1;
+    }
+    predicate_compile(&pred, &schema, &stmt.stmt.select.where, 1);
+    if (!predicate_matches(&pred, &rows[0]) || predicate_matches(&pred, &rows[1])) {
+        printf("  ERROR: Skipped condition was tested\n");
+        return -1;
+    }
+
+    /* A stored row cut short does not match */
+    if (parse_where_clause("score = 20", &stmt) != 0) {
+        return -1;
+    }
+    predicate_compile(&pred, &schema, &stmt.stmt.select.where, 0);
+    size = row_serialize(&rows[0], buffer, sizeof(buffer));
+    if (!predicate_matches_stored(&pred, buffer, (uint32_t)size) ||
+        predicate_matches_stored(&pred, buffer, (uint32_t)size - 3) ||
+        predicate_matches_stored(&pred, buffer, 1)) {
+        printf("  ERROR: Truncated row matched\n");
+        return -1;
+    }
+
+    for (i = 0; i < 4; i++) {
+        row_clear(&rows[i]);
+    }
+    return 0;
+}
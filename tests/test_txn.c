@@ -22,6 +22,21 @@
 #define TEST_DB_TXN_NESTED "RAM:txn_nested.db"
 #define TEST_DB_TXN_DURABILITY "RAM:txn_durability.db"
 #define TEST_DB_TXN_ISOLATION "RAM:txn_isolation.db"
+#define TEST_DB_TXN_SPILL_COMMIT "RAM:txn_spill_commit.db"
+#define TEST_DB_TXN_SPILL_ABORT "RAM:txn_spill_abort.db"
+#define TEST_DB_TXN_UNDO_RAM "RAM:txn_undo_ram.db"
+#define TEST_DB_TXN_UNDO_LIMIT "RAM:txn_undo_limit.db"
+#define TEST_DB_TXN_UNDO_SPILLED "RAM:txn_undo_spilled.db"
+#define TEST_DB_TXN_SAVEPOINT "RAM:txn_savepoint.db"
+#define TEST_DB_TXN_SAVEPOINT_WAL "RAM:txn_savepoint_wal.db"
+#define TEST_DB_TXN_SYNC_LEVELS "RAM:txn_sync_levels.db"
+#define TEST_DB_TXN_SYNC_PENDING "RAM:txn_sync_pending.db"
+#define TEST_DB_TXN_WAL_WRITER "RAM:txn_wal_writer.db"
+
+/* Pages touched by the spill tests: more than the old 64-page limit, */
+/* far more than the cache, and enough to run past the WAL region */
+#define SPILL_TEST_PAGES 100
+#define SPILL_TEST_CACHE 8
 
 /* Test: Begin and commit transaction */
 TEST(txn_begin_commit) {
@@ -300,7 +315,7 @@ TEST(txn_multi_page_commit) {
         ASSERT_EQ(rc, 0);
 
         /* Write test pattern */
-        memset(data + 12, 0x40 + i, 100);
+        memset(data + AMIDB_PAGE_HEADER_SIZE, 0x40 + i, 100);
 
         /* Mark dirty and add to transaction */
         cache_mark_dirty(cache, pages[i]);
@@ -430,7 +445,7 @@ TEST(txn_commit_durability) {
     /* Modify page */
     rc = cache_get_page(cache, page_num, &data);
     ASSERT_EQ(rc, 0);
-    memset(data + 12, 0xAB, 100);
+    memset(data + AMIDB_PAGE_HEADER_SIZE, 0xAB, 100);
 
     cache_mark_dirty(cache, page_num);
     txn_add_dirty_page(txn, page_num);
@@ -488,8 +503,8 @@ TEST(txn_isolation) {
 
     rc = cache_get_page(cache, page_num, &data);
     ASSERT_EQ(rc, 0);
-    data[12] = 0x11;
-    original_value = data[12];
+    data[AMIDB_PAGE_HEADER_SIZE] = 0x11;
+    original_value = data[AMIDB_PAGE_HEADER_SIZE];
     cache_mark_dirty(cache, page_num);
     cache_unpin(cache, page_num);
     cache_flush(cache);
@@ -508,7 +523,7 @@ TEST(txn_isolation) {
     /* Modify page in transaction */
     rc = cache_get_page(cache, page_num, &data);
     ASSERT_EQ(rc, 0);
-    data[12] = 0x99;
+    data[AMIDB_PAGE_HEADER_SIZE] = 0x99;
 
     cache_mark_dirty(cache, page_num);
     txn_add_dirty_page(txn, page_num);
@@ -516,7 +531,7 @@ TEST(txn_isolation) {
     entry = cache_find_entry(cache, page_num);
     entry->txn_id = txn->txn_id;
 
-    ASSERT_EQ(data[12], 0x99);
+    ASSERT_EQ(data[AMIDB_PAGE_HEADER_SIZE], 0x99);
 
     /* Abort transaction */
     rc = txn_abort(txn);
@@ -525,7 +540,7 @@ TEST(txn_isolation) {
     /* Verify page was restored to original value */
     entry = cache_find_entry(cache, page_num);
     ASSERT_NOT_NULL(entry);
-    ASSERT_EQ(entry->data[12], original_value);
+    ASSERT_EQ(entry->data[AMIDB_PAGE_HEADER_SIZE], original_value);
     ASSERT_EQ(entry->state, CACHE_ENTRY_CLEAN);
 
     /* Cleanup */
@@ -537,3 +552,860 @@ TEST(txn_isolation) {
     TEST_END();
     return 0;
 }
+
+/* Helper: modify SPILL_TEST_PAGES pages in the active transaction */
+static int spill_test_modify(struct page_cache *cache, struct txn_context *txn,
+                             const uint32_t *pages)
+{
+    struct cache_entry *entry;
+    uint8_t *data;
+    uint32_t i;
+
+    for (i = 0; i < SPILL_TEST_PAGES; i++) {
+        if (cache_get_page(cache, pages[i], &data) != 0) {
+            return -1;
+        }
+
+        data[AMIDB_PAGE_HEADER_SIZE] = (uint8_t)i;
+        data[AMIDB_PAGE_HEADER_SIZE + 1] = 0x5A;
+
+        cache_mark_dirty(cache, pages[i]);
+        if (txn_add_dirty_page(txn, pages[i]) != AMIDB_OK) {
+            return -1;
+        }
+
+        entry = cache_find_entry(cache, pages[i]);
+        entry->txn_id = txn->txn_id;
+        cache_unpin(cache, pages[i]);
+    }
+
+    return 0;
+}
+
+/* Test: Transaction larger than the cache spills to the WAL and commits */
+TEST(txn_spill_large_commit) {
+    struct amidb_pager *pager = NULL;
+    struct page_cache *cache;
+    struct wal_context *wal;
+    struct txn_context *txn;
+    static uint32_t pages[SPILL_TEST_PAGES];
+    static uint8_t buf[AMIDB_PAGE_SIZE];
+    uint8_t *data;
+    uint32_t i;
+    int rc;
+
+    file_delete(TEST_DB_TXN_SPILL_COMMIT);
+    file_delete(TEST_DB_TXN_SPILL_COMMIT WAL_OVERFLOW_SUFFIX);
+
+    TEST_BEGIN();
+
+    rc = pager_open(TEST_DB_TXN_SPILL_COMMIT, 0, &pager);
+    ASSERT_EQ(rc, 0);
+
+    cache = cache_create(SPILL_TEST_CACHE, pager);
+    ASSERT_NOT_NULL(cache);
+
+    for (i = 0; i < SPILL_TEST_PAGES; i++) {
+        rc = pager_allocate_page(pager, &pages[i]);
+        ASSERT_EQ(rc, 0);
+    }
+
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+
+    txn = txn_create(wal, cache);
+    ASSERT_NOT_NULL(txn);
+
+    rc = txn_begin(txn);
+    ASSERT_EQ(rc, AMIDB_OK);
+
+    rc = spill_test_modify(cache, txn, pages);
+    ASSERT_EQ(rc, 0);
+    ASSERT_EQ(txn->dirty_count, SPILL_TEST_PAGES);
+    ASSERT_GT(txn->spill_count, 0);
+
+    /* A spilled page comes back with its uncommitted contents */
+    rc = cache_get_page(cache, pages[0], &data);
+    ASSERT_EQ(rc, 0);
+    ASSERT_EQ(data[AMIDB_PAGE_HEADER_SIZE], 0);
+    ASSERT_EQ(data[AMIDB_PAGE_HEADER_SIZE + 1], 0x5A);
+    cache_unpin(cache, pages[0]);
+
+    /* Nothing reached the database file yet */
+    rc = pager_read_page(pager, pages[1], buf);
+    ASSERT_EQ(rc, 0);
+    ASSERT_EQ(buf[AMIDB_PAGE_HEADER_SIZE + 1], 0);
+
+    rc = txn_commit(txn);
+    ASSERT_EQ(rc, AMIDB_OK);
+    ASSERT_EQ(txn->spill_count, 0);
+
+    /* Every page was checkpointed, spilled or not */
+    for (i = 0; i < SPILL_TEST_PAGES; i++) {
+        rc = pager_read_page(pager, pages[i], buf);
+        ASSERT_EQ(rc, 0);
+        ASSERT_EQ(buf[AMIDB_PAGE_HEADER_SIZE], (uint8_t)i);
+        ASSERT_EQ(buf[AMIDB_PAGE_HEADER_SIZE + 1], 0x5A);
+    }
+
+    txn_destroy(txn);
+    wal_destroy(wal);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    TEST_END();
+    return 0;
+}
+
+/* Test: Aborting a spilled transaction leaves the database untouched */
+TEST(txn_spill_large_abort) {
+    struct amidb_pager *pager = NULL;
+    struct page_cache *cache;
+    struct wal_context *wal;
+    struct txn_context *txn;
+    static uint32_t pages[SPILL_TEST_PAGES];
+    static uint8_t buf[AMIDB_PAGE_SIZE];
+    uint8_t *data;
+    uint32_t i;
+    int rc;
+
+    file_delete(TEST_DB_TXN_SPILL_ABORT);
+    file_delete(TEST_DB_TXN_SPILL_ABORT WAL_OVERFLOW_SUFFIX);
+
+    TEST_BEGIN();
+
+    rc = pager_open(TEST_DB_TXN_SPILL_ABORT, 0, &pager);
+    ASSERT_EQ(rc, 0);
+
+    cache = cache_create(SPILL_TEST_CACHE, pager);
+    ASSERT_NOT_NULL(cache);
+
+    for (i = 0; i < SPILL_TEST_PAGES; i++) {
+        rc = pager_allocate_page(pager, &pages[i]);
+        ASSERT_EQ(rc, 0);
+    }
+
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+
+    txn = txn_create(wal, cache);
+    ASSERT_NOT_NULL(txn);
+
+    rc = txn_begin(txn);
+    ASSERT_EQ(rc, AMIDB_OK);
+
+    rc = spill_test_modify(cache, txn, pages);
+    ASSERT_EQ(rc, 0);
+    ASSERT_GT(txn->spill_count, 0);
+
+    rc = txn_abort(txn);
+    ASSERT_EQ(rc, AMIDB_OK);
+    ASSERT_EQ(wal->wal_head, 0);
+
+    /* Cached and spilled pages both read back as before the txn */
+    for (i = 0; i < SPILL_TEST_PAGES; i++) {
+        rc = cache_get_page(cache, pages[i], &data);
+        ASSERT_EQ(rc, 0);
+        ASSERT_EQ(data[AMIDB_PAGE_HEADER_SIZE + 1], 0);
+        cache_unpin(cache, pages[i]);
+
+        rc = pager_read_page(pager, pages[i], buf);
+        ASSERT_EQ(rc, 0);
+        ASSERT_EQ(buf[AMIDB_PAGE_HEADER_SIZE + 1], 0);
+    }
+
+    txn_destroy(txn);
+    wal_destroy(wal);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    TEST_END();
+    return 0;
+}
+
+/* Helper: modify a page inside the transaction, saving its before-image */
+static int undo_test_write(struct page_cache *cache, struct txn_context *txn,
+                           uint32_t page_num, uint8_t value)
+{
+    struct cache_entry *entry;
+    uint8_t *data;
+
+    if (cache_get_page(cache, page_num, &data) != 0) {
+        return -1;
+    }
+
+    txn_save_before_image(txn, page_num, data);
+    data[AMIDB_PAGE_HEADER_SIZE] = value;
+
+    cache_mark_dirty(cache, page_num);
+    txn_add_dirty_page(txn, page_num);
+    entry = cache_find_entry(cache, page_num);
+    entry->txn_id = txn->txn_id;
+    cache_unpin(cache, page_num);
+
+    return 0;
+}
+
+/* Test: Abort restores pages from RAM before-images */
+TEST(txn_undo_restore_from_ram) {
+    struct amidb_pager *pager = NULL;
+    struct page_cache *cache;
+    struct wal_context *wal;
+    struct txn_context *txn;
+    struct cache_entry *entry;
+    uint32_t page_num;
+    uint8_t *data;
+    int rc;
+
+    file_delete(TEST_DB_TXN_UNDO_RAM);
+
+    TEST_BEGIN();
+
+    rc = pager_open(TEST_DB_TXN_UNDO_RAM, 0, &pager);
+    ASSERT_EQ(rc, 0);
+
+    cache = cache_create(16, pager);
+    ASSERT_NOT_NULL(cache);
+
+    rc = pager_allocate_page(pager, &page_num);
+    ASSERT_EQ(rc, 0);
+
+    /* Leave an unflushed change in the cache before the txn starts */
+    rc = cache_get_page(cache, page_num, &data);
+    ASSERT_EQ(rc, 0);
+    data[AMIDB_PAGE_HEADER_SIZE] = 0x22;
+    cache_mark_dirty(cache, page_num);
+    cache_unpin(cache, page_num);
+
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+
+    txn = txn_create(wal, cache);
+    ASSERT_NOT_NULL(txn);
+
+    rc = txn_begin(txn);
+    ASSERT_EQ(rc, AMIDB_OK);
+
+    /* Two writes: only the first takes a before-image */
+    rc = undo_test_write(cache, txn, page_num, 0x77);
+    ASSERT_EQ(rc, 0);
+    rc = undo_test_write(cache, txn, page_num, 0x88);
+    ASSERT_EQ(rc, 0);
+    ASSERT_EQ(txn->undo_count, 1);
+
+    rc = txn_abort(txn);
+    ASSERT_EQ(rc, AMIDB_OK);
+    ASSERT_EQ(txn->undo_restores, 1);
+    ASSERT_EQ(txn->disk_restores, 0);
+
+    /* Restored to the pre-txn cached state, which disk never had */
+    entry = cache_find_entry(cache, page_num);
+    ASSERT_NOT_NULL(entry);
+    ASSERT_EQ(entry->data[AMIDB_PAGE_HEADER_SIZE], 0x22);
+    ASSERT_EQ(entry->state, CACHE_ENTRY_DIRTY);
+    ASSERT_EQ(entry->txn_id, 0);
+
+    txn_destroy(txn);
+    wal_destroy(wal);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    TEST_END();
+    return 0;
+}
+
+/* Test: Pages beyond the undo limit fall back to disk reread */
+TEST(txn_undo_limit_fallback) {
+    struct amidb_pager *pager = NULL;
+    struct page_cache *cache;
+    struct wal_context *wal;
+    struct txn_context *txn;
+    struct cache_entry *entry;
+    uint32_t pages[4];
+    uint32_t i;
+    int rc;
+
+    file_delete(TEST_DB_TXN_UNDO_LIMIT);
+
+    TEST_BEGIN();
+
+    rc = pager_open(TEST_DB_TXN_UNDO_LIMIT, 0, &pager);
+    ASSERT_EQ(rc, 0);
+
+    cache = cache_create(16, pager);
+    ASSERT_NOT_NULL(cache);
+
+    for (i = 0; i < 4; i++) {
+        rc = pager_allocate_page(pager, &pages[i]);
+        ASSERT_EQ(rc, 0);
+    }
+
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+
+    txn = txn_create(wal, cache);
+    ASSERT_NOT_NULL(txn);
+
+    rc = txn_set_undo_limit(txn, 2);
+    ASSERT_EQ(rc, AMIDB_OK);
+
+    rc = txn_begin(txn);
+    ASSERT_EQ(rc, AMIDB_OK);
+
+    /* Limit can't change mid-transaction */
+    ASSERT_EQ(txn_set_undo_limit(txn, 8), AMIDB_BUSY);
+
+    for (i = 0; i < 4; i++) {
+        rc = undo_test_write(cache, txn, pages[i], (uint8_t)(0x90 + i));
+        ASSERT_EQ(rc, 0);
+    }
+    ASSERT_EQ(txn->undo_count, 2);
+
+    rc = txn_abort(txn);
+    ASSERT_EQ(rc, AMIDB_OK);
+    ASSERT_EQ(txn->undo_restores, 2);
+    ASSERT_EQ(txn->disk_restores, 2);
+
+    for (i = 0; i < 4; i++) {
+        entry = cache_find_entry(cache, pages[i]);
+        ASSERT_NOT_NULL(entry);
+        ASSERT_EQ(entry->data[AMIDB_PAGE_HEADER_SIZE], 0);
+    }
+
+    txn_destroy(txn);
+    wal_destroy(wal);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    TEST_END();
+    return 0;
+}
+
+static uint8_t savepoint_page[AMIDB_PAGE_SIZE];
+
+/* Test: Abort keeps a pre-transaction change on a page spilled and evicted */
+TEST(txn_undo_spilled_dirty_page) {
+    struct amidb_pager *pager = NULL;
+    struct page_cache *cache;
+    struct wal_context *wal;
+    struct txn_context *txn;
+    uint32_t pages[12];
+    uint8_t *data;
+    uint32_t i;
+    int rc;
+
+    file_delete(TEST_DB_TXN_UNDO_SPILLED);
+    file_delete(TEST_DB_TXN_UNDO_SPILLED WAL_OVERFLOW_SUFFIX);
+
+    TEST_BEGIN();
+
+    rc = pager_open(TEST_DB_TXN_UNDO_SPILLED, 0, &pager);
+    ASSERT_EQ(rc, 0);
+
+    cache = cache_create(4, pager);
+    ASSERT_NOT_NULL(cache);
+
+    for (i = 0; i < 12; i++) {
+        rc = pager_allocate_page(pager, &pages[i]);
+        ASSERT_EQ(rc, 0);
+    }
+
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+
+    txn = txn_create(wal, cache);
+    ASSERT_NOT_NULL(txn);
+
+    /* Change outside any transaction: only the cache has it */
+    rc = cache_get_page(cache, pages[0], &data);
+    ASSERT_EQ(rc, 0);
+    data[AMIDB_PAGE_HEADER_SIZE] = 0x77;
+    cache_mark_dirty(cache, pages[0]);
+    cache_unpin(cache, pages[0]);
+
+    rc = txn_begin(txn);
+    ASSERT_EQ(rc, AMIDB_OK);
+
+    /* More pages than the cache: the first ones are spilled and evicted */
+    for (i = 0; i < 12; i++) {
+        rc = undo_test_write(cache, txn, pages[i], 0x99);
+        ASSERT_EQ(rc, 0);
+    }
+    ASSERT_GT(txn->spill_count, 0);
+    ASSERT_NULL(cache_find_entry(cache, pages[0]));
+
+    rc = txn_abort(txn);
+    ASSERT_EQ(rc, AMIDB_OK);
+
+    /* The pre-transaction change is back; the others read as committed */
+    rc = cache_get_page(cache, pages[0], &data);
+    ASSERT_EQ(rc, 0);
+    ASSERT_EQ(data[AMIDB_PAGE_HEADER_SIZE], 0x77);
+    ASSERT_EQ(cache_find_entry(cache, pages[0])->state, CACHE_ENTRY_DIRTY);
+    cache_unpin(cache, pages[0]);
+
+    for (i = 1; i < 12; i++) {
+        rc = cache_get_page(cache, pages[i], &data);
+        ASSERT_EQ(rc, 0);
+        ASSERT_EQ(data[AMIDB_PAGE_HEADER_SIZE], 0);
+        cache_unpin(cache, pages[i]);
+    }
+
+    txn_destroy(txn);
+    wal_destroy(wal);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    TEST_END();
+    return 0;
+}
+
+/* Test: ROLLBACK TO undoes only changes made after the savepoint */
+TEST(txn_savepoint_rollback) {
+    struct amidb_pager *pager = NULL;
+    struct page_cache *cache;
+    struct wal_context *wal;
+    struct txn_context *txn;
+    struct cache_entry *entry;
+    uint32_t pages[3];
+    uint32_t i;
+    int rc;
+
+    file_delete(TEST_DB_TXN_SAVEPOINT);
+
+    TEST_BEGIN();
+
+    rc = pager_open(TEST_DB_TXN_SAVEPOINT, 0, &pager);
+    ASSERT_EQ(rc, 0);
+
+    cache = cache_create(16, pager);
+    ASSERT_NOT_NULL(cache);
+
+    for (i = 0; i < 3; i++) {
+        rc = pager_allocate_page(pager, &pages[i]);
+        ASSERT_EQ(rc, 0);
+    }
+
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+
+    txn = txn_create(wal, cache);
+    ASSERT_NOT_NULL(txn);
+
+    /* Savepoints need an active transaction */
+    ASSERT_EQ(txn_savepoint(txn, "a"), AMIDB_ERROR);
+
+    rc = txn_begin(txn);
+    ASSERT_EQ(rc, AMIDB_OK);
+
+    rc = undo_test_write(cache, txn, pages[0], 0x10);
+    ASSERT_EQ(rc, 0);
+
+    rc = txn_savepoint(txn, "a");
+    ASSERT_EQ(rc, AMIDB_OK);
+
+    /* Page 0 was dirty before the savepoint, page 1 is new */
+    rc = undo_test_write(cache, txn, pages[0], 0x11);
+    ASSERT_EQ(rc, 0);
+    rc = undo_test_write(cache, txn, pages[1], 0x21);
+    ASSERT_EQ(rc, 0);
+
+    rc = txn_savepoint(txn, "b");
+    ASSERT_EQ(rc, AMIDB_OK);
+    rc = undo_test_write(cache, txn, pages[2], 0x31);
+    ASSERT_EQ(rc, 0);
+
+    ASSERT_EQ(txn_rollback_to_savepoint(txn, "nope"), AMIDB_NOTFOUND);
+
+    /* Rolling back to "a" also discards "b" */
+    rc = txn_rollback_to_savepoint(txn, "a");
+    ASSERT_EQ(rc, AMIDB_OK);
+    ASSERT_EQ(txn->savepoint_count, 1);
+    ASSERT_EQ(txn->dirty_count, 1);
+    ASSERT_EQ(txn_release_savepoint(txn, "b"), AMIDB_NOTFOUND);
+
+    entry = cache_find_entry(cache, pages[0]);
+    ASSERT_NOT_NULL(entry);
+    ASSERT_EQ(entry->data[AMIDB_PAGE_HEADER_SIZE], 0x10);
+    ASSERT_EQ(entry->txn_id, txn->txn_id);
+
+    for (i = 1; i < 3; i++) {
+        entry = cache_find_entry(cache, pages[i]);
+        ASSERT_NOT_NULL(entry);
+        ASSERT_EQ(entry->data[AMIDB_PAGE_HEADER_SIZE], 0);
+        ASSERT_EQ(entry->txn_id, 0);
+    }
+
+    /* The savepoint stays usable after ROLLBACK TO */
+    rc = undo_test_write(cache, txn, pages[1], 0x22);
+    ASSERT_EQ(rc, 0);
+    rc = txn_release_savepoint(txn, "a");
+    ASSERT_EQ(rc, AMIDB_OK);
+    ASSERT_EQ(txn->savepoint_count, 0);
+
+    rc = txn_commit(txn);
+    ASSERT_EQ(rc, AMIDB_OK);
+
+    /* Committed state reached the database file */
+    for (i = 0; i < 3; i++) {
+        rc = pager_read_page(pager, pages[i], savepoint_page);
+        ASSERT_EQ(rc, 0);
+        ASSERT_EQ(savepoint_page[AMIDB_PAGE_HEADER_SIZE], (i == 0) ? 0x10 : (i == 1) ? 0x22 : 0);
+    }
+
+    txn_destroy(txn);
+    wal_destroy(wal);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    TEST_END();
+    return 0;
+}
+
+/* Test: Savepoint images beyond the undo buffer are kept in the WAL */
+TEST(txn_savepoint_wal_images) {
+    struct amidb_pager *pager = NULL;
+    struct page_cache *cache;
+    struct wal_context *wal;
+    struct txn_context *txn;
+    struct cache_entry *entry;
+    uint32_t pages[4];
+    uint32_t i;
+    int rc;
+
+    file_delete(TEST_DB_TXN_SAVEPOINT_WAL);
+
+    TEST_BEGIN();
+
+    rc = pager_open(TEST_DB_TXN_SAVEPOINT_WAL, 0, &pager);
+    ASSERT_EQ(rc, 0);
+
+    cache = cache_create(16, pager);
+    ASSERT_NOT_NULL(cache);
+
+    for (i = 0; i < 4; i++) {
+        rc = pager_allocate_page(pager, &pages[i]);
+        ASSERT_EQ(rc, 0);
+    }
+
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+
+    txn = txn_create(wal, cache);
+    ASSERT_NOT_NULL(txn);
+
+    rc = txn_set_undo_limit(txn, 2);
+    ASSERT_EQ(rc, AMIDB_OK);
+
+    rc = txn_begin(txn);
+    ASSERT_EQ(rc, AMIDB_OK);
+
+    /* Fills the undo arena */
+    for (i = 0; i < 4; i++) {
+        rc = undo_test_write(cache, txn, pages[i], (uint8_t)(0x40 + i));
+        ASSERT_EQ(rc, 0);
+    }
+
+    rc = txn_savepoint(txn, "sp");
+    ASSERT_EQ(rc, AMIDB_OK);
+
+    for (i = 0; i < 4; i++) {
+        rc = undo_test_write(cache, txn, pages[i], (uint8_t)(0x50 + i));
+        ASSERT_EQ(rc, 0);
+    }
+    ASSERT_EQ(txn->undo_count, 6);
+    ASSERT_NULL(txn->undo[5].image);
+
+    rc = txn_rollback_to_savepoint(txn, "sp");
+    ASSERT_EQ(rc, AMIDB_OK);
+
+    for (i = 0; i < 4; i++) {
+        entry = cache_find_entry(cache, pages[i]);
+        ASSERT_NOT_NULL(entry);
+        ASSERT_EQ(entry->data[AMIDB_PAGE_HEADER_SIZE], 0x40 + i);
+        ASSERT_EQ(entry->state, CACHE_ENTRY_DIRTY);
+    }
+
+    /* Abort still reaches the pre-transaction state */
+    rc = txn_abort(txn);
+    ASSERT_EQ(rc, AMIDB_OK);
+
+    for (i = 0; i < 4; i++) {
+        entry = cache_find_entry(cache, pages[i]);
+        ASSERT_NOT_NULL(entry);
+        ASSERT_EQ(entry->data[AMIDB_PAGE_HEADER_SIZE], 0);
+    }
+
+    txn_destroy(txn);
+    wal_destroy(wal);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    TEST_END();
+    return 0;
+}
+
+/* Test: FULL resets the WAL at every commit, NORMAL / OFF keep it */
+TEST(txn_durability_levels) {
+    struct amidb_pager *pager = NULL;
+    struct page_cache *cache;
+    struct wal_context *wal;
+    struct txn_context *txn;
+    uint32_t page_num;
+    uint32_t normal_head;
+    int rc;
+
+    file_delete(TEST_DB_TXN_SYNC_LEVELS);
+
+    TEST_BEGIN();
+
+    rc = pager_open(TEST_DB_TXN_SYNC_LEVELS, 0, &pager);
+    ASSERT_EQ(rc, 0);
+
+    cache = cache_create(16, pager);
+    ASSERT_NOT_NULL(cache);
+
+    rc = pager_allocate_page(pager, &page_num);
+    ASSERT_EQ(rc, 0);
+
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+    txn = txn_create(wal, cache);
+    ASSERT_NOT_NULL(txn);
+
+    ASSERT_EQ(wal->durability, WAL_SYNC_FULL);
+    ASSERT_EQ(wal_set_durability(wal, 3), AMIDB_ERROR);
+    ASSERT_EQ(txn_set_durability(txn, WAL_SYNC_OFF), AMIDB_ERROR);  /* No txn */
+
+    /* NORMAL: page reaches the file, WAL stays live */
+    ASSERT_EQ(wal_set_durability(wal, WAL_SYNC_NORMAL), AMIDB_OK);
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    ASSERT_EQ(undo_test_write(cache, txn, page_num, 0x31), 0);
+    ASSERT_EQ(txn_commit(txn), AMIDB_OK);
+    ASSERT_GT(wal->wal_head, 0);
+    ASSERT_EQ(pager->header.wal_head, wal->wal_head);
+    normal_head = wal->wal_head;
+
+    rc = pager_read_page(pager, page_num, savepoint_page);
+    ASSERT_EQ(rc, 0);
+    ASSERT_EQ(savepoint_page[AMIDB_PAGE_HEADER_SIZE], 0x31);
+
+    /* Next NORMAL commit appends */
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    ASSERT_EQ(undo_test_write(cache, txn, page_num, 0x32), 0);
+    ASSERT_EQ(txn_commit(txn), AMIDB_OK);
+    ASSERT_GT(wal->wal_head, normal_head);
+
+    /* One FULL transaction checkpoints everything */
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    ASSERT_EQ(txn_set_durability(txn, WAL_SYNC_FULL), AMIDB_OK);
+    ASSERT_EQ(undo_test_write(cache, txn, page_num, 0x33), 0);
+    ASSERT_EQ(txn_commit(txn), AMIDB_OK);
+    ASSERT_EQ(wal->wal_head, 0);
+    ASSERT_EQ(pager->header.wal_head, 0);
+    ASSERT_EQ(pager->header.checkpoint_lsn, wal->next_lsn - 1);
+    ASSERT_EQ(wal->durability, WAL_SYNC_NORMAL);
+
+    /* OFF: still committed, explicit checkpoint resets the WAL */
+    ASSERT_EQ(wal_set_durability(wal, WAL_SYNC_OFF), AMIDB_OK);
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    ASSERT_EQ(undo_test_write(cache, txn, page_num, 0x34), 0);
+    ASSERT_EQ(txn_commit(txn), AMIDB_OK);
+    ASSERT_GT(wal->wal_head, 0);
+
+    rc = pager_read_page(pager, page_num, savepoint_page);
+    ASSERT_EQ(rc, 0);
+    ASSERT_EQ(savepoint_page[AMIDB_PAGE_HEADER_SIZE], 0x34);
+
+    ASSERT_EQ(wal_checkpoint(wal), AMIDB_OK);
+    ASSERT_EQ(wal->wal_head, 0);
+    ASSERT_EQ(pager->header.checkpoint_lsn, wal->next_lsn - 1);
+
+    txn_destroy(txn);
+    wal_destroy(wal);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    TEST_END();
+    return 0;
+}
+
+/* Test: An OFF transaction's checkpoint still syncs NORMAL commits */
+TEST(txn_checkpoint_after_off) {
+    struct amidb_pager *pager = NULL;
+    struct page_cache *cache;
+    struct wal_context *wal;
+    struct txn_context *txn;
+    static uint32_t pages[SPILL_TEST_PAGES];
+    uint32_t page_num;
+    uint32_t syncs;
+    uint32_t i;
+    int rc;
+
+    file_delete(TEST_DB_TXN_SYNC_PENDING);
+    file_delete(TEST_DB_TXN_SYNC_PENDING WAL_OVERFLOW_SUFFIX);
+
+    TEST_BEGIN();
+
+    rc = pager_open(TEST_DB_TXN_SYNC_PENDING, 0, &pager);
+    ASSERT_EQ(rc, 0);
+
+    cache = cache_create(SPILL_TEST_CACHE, pager);
+    ASSERT_NOT_NULL(cache);
+
+    rc = pager_allocate_page(pager, &page_num);
+    ASSERT_EQ(rc, 0);
+    for (i = 0; i < SPILL_TEST_PAGES; i++) {
+        rc = pager_allocate_page(pager, &pages[i]);
+        ASSERT_EQ(rc, 0);
+    }
+
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+    txn = txn_create(wal, cache);
+    ASSERT_NOT_NULL(txn);
+    ASSERT_EQ(wal_set_durability(wal, WAL_SYNC_NORMAL), AMIDB_OK);
+
+    /* NORMAL commit: its page write is not synced yet */
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    ASSERT_EQ(undo_test_write(cache, txn, page_num, 0x41), 0);
+    ASSERT_EQ(txn_commit(txn), AMIDB_OK);
+    ASSERT_GT(wal->wal_head, 0);
+
+    /* OFF transaction spills, then aborts: the checkpoint on abort */
+    /* resets the WAL, so the NORMAL commit's page must be synced */
+    syncs = pager->sync_count;
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    ASSERT_EQ(txn_set_durability(txn, WAL_SYNC_OFF), AMIDB_OK);
+    ASSERT_EQ(spill_test_modify(cache, txn, pages), 0);
+    ASSERT_GT(txn->spill_count, 0);
+    ASSERT_EQ(txn_abort(txn), AMIDB_OK);
+    ASSERT_EQ(wal->wal_head, 0);
+    ASSERT_GT(pager->sync_count, syncs);
+
+    /* Same for an OFF commit that runs past the WAL region */
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    ASSERT_EQ(undo_test_write(cache, txn, page_num, 0x42), 0);
+    ASSERT_EQ(txn_commit(txn), AMIDB_OK);
+    ASSERT_GT(wal->wal_head, 0);
+
+    syncs = pager->sync_count;
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    ASSERT_EQ(txn_set_durability(txn, WAL_SYNC_OFF), AMIDB_OK);
+    ASSERT_EQ(spill_test_modify(cache, txn, pages), 0);
+    ASSERT_EQ(txn_commit(txn), AMIDB_OK);
+    ASSERT_EQ(wal->wal_head, 0);
+    ASSERT_GT(pager->sync_count, syncs);
+
+    /* Only OFF commits since: nothing to sync */
+    syncs = pager->sync_count;
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    ASSERT_EQ(txn_set_durability(txn, WAL_SYNC_OFF), AMIDB_OK);
+    ASSERT_EQ(undo_test_write(cache, txn, page_num, 0x43), 0);
+    ASSERT_EQ(txn_commit(txn), AMIDB_OK);
+    ASSERT_EQ(wal_checkpoint(wal), AMIDB_OK);
+    ASSERT_EQ(pager->sync_count, syncs);
+
+    txn_destroy(txn);
+    wal_destroy(wal);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    TEST_END();
+    return 0;
+}
+
+/* Test: Background WAL writer overlaps flushes with logging */
+TEST(txn_background_wal_writer) {
+    struct amidb_pager *pager = NULL;
+    struct page_cache *cache;
+    struct wal_context *wal;
+    struct txn_context *txn;
+    uint32_t pages[20];
+    uint32_t total;
+    uint32_t i;
+    uint32_t round;
+    int rc;
+
+    file_delete(TEST_DB_TXN_WAL_WRITER);
+    file_delete(TEST_DB_TXN_WAL_WRITER WAL_OVERFLOW_SUFFIX);
+
+    TEST_BEGIN();
+
+    rc = pager_open(TEST_DB_TXN_WAL_WRITER, 0, &pager);
+    ASSERT_EQ(rc, 0);
+
+    cache = cache_create(32, pager);
+    ASSERT_NOT_NULL(cache);
+
+    for (i = 0; i < 20; i++) {
+        rc = pager_allocate_page(pager, &pages[i]);
+        ASSERT_EQ(rc, 0);
+    }
+
+    wal = wal_create(pager);
+    ASSERT_NOT_NULL(wal);
+    txn = txn_create(wal, cache);
+    ASSERT_NOT_NULL(txn);
+
+    ASSERT_EQ(wal_start_writer(wal), AMIDB_OK);
+    ASSERT_NOT_NULL(wal->writer);
+
+    /* 20 page images = 80KB: the commit fills both buffers in turn */
+    for (round = 1; round <= 4; round++) {
+        if (round == 4) {
+            ASSERT_EQ(wal_set_durability(wal, WAL_SYNC_NORMAL), AMIDB_OK);
+        }
+        ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+        for (i = 0; i < 20; i++) {
+            ASSERT_EQ(undo_test_write(cache, txn, pages[i], (uint8_t)(round * 0x10 + i)), 0);
+        }
+        ASSERT_EQ(txn_commit(txn), AMIDB_OK);
+
+        /* Durable and checkpointed: nothing left in flight */
+        ASSERT_NULL(wal->flush_buffer);
+        rc = pager_read_page(pager, pages[19], savepoint_page);
+        ASSERT_EQ(rc, 0);
+        ASSERT_EQ(savepoint_page[AMIDB_PAGE_HEADER_SIZE], (uint8_t)(round * 0x10 + 19));
+    }
+    ASSERT_GT(wal->flush_count, 4 * 2);
+    ASSERT_GT(wal->wal_head, WAL_BUFFER_SIZE);  /* NORMAL kept the WAL */
+
+    /* Every commit is in the latency histogram */
+    total = 0;
+    for (i = 0; i < TXN_LATENCY_BUCKETS; i++) {
+        total += txn->commit_latency[i];
+    }
+    ASSERT_EQ(total, txn->commit_count);
+    ASSERT_EQ(txn_latency_bucket_ms(0), 0);
+    ASSERT_EQ(txn_latency_bucket_ms(3), 4);
+
+    /* Abort after the writer ran still rewinds cleanly */
+    ASSERT_EQ(txn_begin(txn), AMIDB_OK);
+    ASSERT_EQ(undo_test_write(cache, txn, pages[0], 0xEE), 0);
+    ASSERT_EQ(txn_abort(txn), AMIDB_OK);
+
+    ASSERT_EQ(wal_stop_writer(wal), AMIDB_OK);
+    ASSERT_NULL(wal->writer);
+
+    /* Records written by the writer are readable by recovery */
+    txn_destroy(txn);
+    wal_destroy(wal);
+    cache_destroy(cache);
+    pager_close(pager);
+
+    rc = pager_open(TEST_DB_TXN_WAL_WRITER, 0, &pager);
+    ASSERT_EQ(rc, 0);
+    for (i = 0; i < 20; i++) {
+        rc = pager_read_page(pager, pages[i], savepoint_page);
+        ASSERT_EQ(rc, 0);
+        ASSERT_EQ(savepoint_page[AMIDB_PAGE_HEADER_SIZE], (uint8_t)(0x40 + i));
+    }
+    pager_close(pager);
+
+    file_delete(TEST_DB_TXN_WAL_WRITER);
+    file_delete(TEST_DB_TXN_WAL_WRITER WAL_OVERFLOW_SUFFIX);
+
+    TEST_END();
+    return 0;
+}